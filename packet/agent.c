@@ -0,0 +1,336 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "agent.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+    An mtr-packet daemon listening on TCP serves remote controllers,
+    which must prove that they know a secret shared with the daemon.
+    The daemon sends each new client a random challenge, and the client
+    answers with the HMAC-SHA256 of the challenge, keyed by the secret,
+    so that the secret itself never crosses the network.  Both are
+    exchanged as hexadecimal text.
+
+    SHA-256 is implemented here, as specified in FIPS 180-4, so that
+    mtr needs no cryptographic library.
+*/
+
+#define SHA256_BLOCK_SIZE 64
+#define SHA256_DIGEST_SIZE 32
+
+/*  The state of a SHA-256 hash in progress  */
+struct sha256_t {
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t block[SHA256_BLOCK_SIZE];
+    int block_used;
+};
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static
+void sha256_init(
+    struct sha256_t *sha)
+{
+    static const uint32_t initial_state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(sha->state, initial_state, sizeof(initial_state));
+    sha->length = 0;
+    sha->block_used = 0;
+}
+
+/*  Mix a complete block into the hash state  */
+static
+void sha256_transform(
+    struct sha256_t *sha)
+{
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h;
+    uint32_t s0, s1, t1, t2;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        w[i] = (uint32_t) sha->block[4 * i] << 24
+            | (uint32_t) sha->block[4 * i + 1] << 16
+            | (uint32_t) sha->block[4 * i + 2] << 8
+            | (uint32_t) sha->block[4 * i + 3];
+    }
+    for (i = 16; i < 64; i++) {
+        s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = sha->state[0];
+    b = sha->state[1];
+    c = sha->state[2];
+    d = sha->state[3];
+    e = sha->state[4];
+    f = sha->state[5];
+    g = sha->state[6];
+    h = sha->state[7];
+
+    for (i = 0; i < 64; i++) {
+        s1 = ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25);
+        t1 = h + s1 + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        s0 = ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22);
+        t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    sha->state[0] += a;
+    sha->state[1] += b;
+    sha->state[2] += c;
+    sha->state[3] += d;
+    sha->state[4] += e;
+    sha->state[5] += f;
+    sha->state[6] += g;
+    sha->state[7] += h;
+}
+
+static
+void sha256_update(
+    struct sha256_t *sha,
+    const void *data,
+    size_t length)
+{
+    const uint8_t *bytes = data;
+
+    sha->length += length;
+    while (length > 0) {
+        sha->block[sha->block_used++] = *bytes++;
+        length--;
+
+        if (sha->block_used == SHA256_BLOCK_SIZE) {
+            sha256_transform(sha);
+            sha->block_used = 0;
+        }
+    }
+}
+
+/*  Pad the final block with the message length, and store the digest  */
+static
+void sha256_final(
+    struct sha256_t *sha,
+    uint8_t *digest)
+{
+    uint64_t bit_length = sha->length * 8;
+    int i;
+
+    sha->block[sha->block_used++] = 0x80;
+    if (sha->block_used > SHA256_BLOCK_SIZE - 8) {
+        memset(&sha->block[sha->block_used], 0,
+               SHA256_BLOCK_SIZE - sha->block_used);
+        sha256_transform(sha);
+        sha->block_used = 0;
+    }
+    memset(&sha->block[sha->block_used], 0,
+           SHA256_BLOCK_SIZE - 8 - sha->block_used);
+    for (i = 0; i < 8; i++) {
+        sha->block[SHA256_BLOCK_SIZE - 1 - i] = bit_length >> (8 * i);
+    }
+    sha256_transform(sha);
+
+    for (i = 0; i < 8; i++) {
+        digest[4 * i] = sha->state[i] >> 24;
+        digest[4 * i + 1] = sha->state[i] >> 16;
+        digest[4 * i + 2] = sha->state[i] >> 8;
+        digest[4 * i + 3] = sha->state[i];
+    }
+}
+
+/*  HMAC-SHA256 of a message, as specified in RFC 2104  */
+static
+void hmac_sha256(
+    const void *key,
+    size_t key_length,
+    const void *message,
+    size_t message_length,
+    uint8_t *digest)
+{
+    struct sha256_t sha;
+    uint8_t key_block[SHA256_BLOCK_SIZE];
+    uint8_t pad[SHA256_BLOCK_SIZE];
+    uint8_t inner[SHA256_DIGEST_SIZE];
+    int i;
+
+    /*  Keys longer than a block are replaced by their hash  */
+    memset(key_block, 0, SHA256_BLOCK_SIZE);
+    if (key_length > SHA256_BLOCK_SIZE) {
+        sha256_init(&sha);
+        sha256_update(&sha, key, key_length);
+        sha256_final(&sha, key_block);
+    } else {
+        memcpy(key_block, key, key_length);
+    }
+
+    for (i = 0; i < SHA256_BLOCK_SIZE; i++) {
+        pad[i] = key_block[i] ^ 0x36;
+    }
+    sha256_init(&sha);
+    sha256_update(&sha, pad, SHA256_BLOCK_SIZE);
+    sha256_update(&sha, message, message_length);
+    sha256_final(&sha, inner);
+
+    for (i = 0; i < SHA256_BLOCK_SIZE; i++) {
+        pad[i] = key_block[i] ^ 0x5c;
+    }
+    sha256_init(&sha);
+    sha256_update(&sha, pad, SHA256_BLOCK_SIZE);
+    sha256_update(&sha, inner, SHA256_DIGEST_SIZE);
+    sha256_final(&sha, digest);
+}
+
+/*  Returns true if an address names an agent to reach over TCP  */
+bool is_agent_address(
+    const char *address)
+{
+    return !strncmp(address, AGENT_ADDRESS_PREFIX,
+                    strlen(AGENT_ADDRESS_PREFIX));
+}
+
+/*
+    Split an agent address of the form "tcp:HOST:PORT" into its host
+    and port.  An IPv6 host is enclosed in brackets, as in
+    "tcp:[2001:db8::1]:PORT".  Returns zero, or -1 with errno set to
+    EINVAL if the address is malformed.
+*/
+int split_agent_address(
+    const char *address,
+    char *host,
+    size_t host_size,
+    char *port,
+    size_t port_size)
+{
+    const char *host_start;
+    const char *host_end;
+    const char *port_start;
+
+    if (!is_agent_address(address)) {
+        errno = EINVAL;
+        return -1;
+    }
+    host_start = address + strlen(AGENT_ADDRESS_PREFIX);
+
+    if (*host_start == '[') {
+        host_start++;
+        host_end = strchr(host_start, ']');
+        if (host_end == NULL || host_end[1] != ':') {
+            errno = EINVAL;
+            return -1;
+        }
+        port_start = host_end + 2;
+    } else {
+        host_end = strrchr(host_start, ':');
+        if (host_end == NULL) {
+            errno = EINVAL;
+            return -1;
+        }
+        port_start = host_end + 1;
+    }
+
+    if (host_end == host_start || *port_start == 0
+        || (size_t) (host_end - host_start) >= host_size
+        || strlen(port_start) >= port_size) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memcpy(host, host_start, host_end - host_start);
+    host[host_end - host_start] = 0;
+    strcpy(port, port_start);
+
+    return 0;
+}
+
+/*
+    The answer to a challenge: the HMAC-SHA256 of the challenge's
+    hexadecimal text, keyed by the shared secret, in hexadecimal.
+    The digest must have room for AGENT_DIGEST_HEX_SIZE + 1 characters.
+*/
+void compute_agent_digest(
+    const char *secret,
+    const char *nonce,
+    char *digest)
+{
+    uint8_t raw_digest[SHA256_DIGEST_SIZE];
+    int i;
+
+    hmac_sha256(secret, strlen(secret), nonce, strlen(nonce), raw_digest);
+
+    for (i = 0; i < SHA256_DIGEST_SIZE; i++) {
+        snprintf(&digest[2 * i], 3, "%02x", raw_digest[i]);
+    }
+}
+
+/*
+    Compare a digest given by a client with the one expected, taking
+    the same time wherever they differ.
+*/
+bool is_agent_digest_equal(
+    const char *digest,
+    const char *expected)
+{
+    unsigned char difference = 0;
+    int i;
+
+    if (strlen(digest) != AGENT_DIGEST_HEX_SIZE) {
+        return false;
+    }
+
+    for (i = 0; i < AGENT_DIGEST_HEX_SIZE; i++) {
+        difference |= digest[i] ^ expected[i];
+    }
+
+    return difference == 0;
+}
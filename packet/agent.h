@@ -0,0 +1,54 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef AGENT_H
+#define AGENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*  The prefix of the address of an agent reached over TCP  */
+#define AGENT_ADDRESS_PREFIX "tcp:"
+
+/*  The bytes of random challenge sent to each TCP client  */
+#define AGENT_NONCE_SIZE 32
+
+/*  The length of a challenge or a digest, in hexadecimal digits  */
+#define AGENT_NONCE_HEX_SIZE (2 * AGENT_NONCE_SIZE)
+#define AGENT_DIGEST_HEX_SIZE 64
+
+bool is_agent_address(
+    const char *address);
+
+int split_agent_address(
+    const char *address,
+    char *host,
+    size_t host_size,
+    char *port,
+    size_t port_size);
+
+void compute_agent_digest(
+    const char *secret,
+    const char *nonce,
+    char *digest);
+
+bool is_agent_digest_equal(
+    const char *digest,
+    const char *expected);
+
+#endif
@@ -0,0 +1,198 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+#include "busypoll_unix.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+
+#include "timeval.h"
+
+/*
+    On short paths, the time taken to wake from a blocking wait, and
+    the jitter of our being scheduled, can exceed the round trip times
+    being measured.  Two environment variables trade CPU time for
+    lower measurement overhead:
+
+    MTR_PACKET_BUSY_POLL gives a number of microseconds for which the
+    kernel is asked to poll the device queue of each receive socket,
+    rather than wait for an interrupt, with SO_BUSY_POLL.  Raising it
+    above the net.core.busy_read sysctl requires CAP_NET_ADMIN, so it
+    is set while we still have our privileges, and silently ignored
+    if refused.
+
+    MTR_PACKET_SPIN names a CPU to which the main thread is pinned,
+    and on which it polls its sockets without sleeping for as long as
+    probes are outstanding.
+
+    Either also selects CLOCK_MONOTONIC_RAW, which isn't slewed by NTP,
+    to time probes.
+*/
+
+/*  Parse a non-negative integer from the environment, or return -1  */
+static
+int get_env_count(
+    const char *name)
+{
+    const char *env = getenv(name);
+    char *end;
+    long value;
+
+    if (env == NULL || *env == 0) {
+        return -1;
+    }
+
+    errno = 0;
+    value = strtol(env, &end, 10);
+    if (errno || *end != 0 || value < 0 || value > 1000000) {
+        fprintf(stderr, "Invalid %s: %s\n", name, env);
+        exit(EXIT_FAILURE);
+    }
+
+    return value;
+}
+
+/*
+    If a low-latency mode has been requested, switch the probe clock.
+    This is done before any probe is timed, and before any worker
+    thread is started.
+*/
+void select_probe_clock(
+    void)
+{
+    if (get_env_count("MTR_PACKET_BUSY_POLL") >= 0
+        || get_env_count("MTR_PACKET_SPIN") >= 0) {
+        use_raw_probe_clock();
+    }
+}
+
+/*  Ask the kernel to busy poll for replies to a socket  */
+static
+void set_socket_busy_poll(
+    int socket,
+    int usec)
+{
+    int trueopt = 1;
+
+    if (!socket) {
+        return;
+    }
+#ifdef SO_BUSY_POLL
+    setsockopt(socket, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(int));
+#endif
+#ifdef SO_PREFER_BUSY_POLL
+    setsockopt(socket, SOL_SOCKET, SO_PREFER_BUSY_POLL, &trueopt,
+               sizeof(int));
+#endif
+    (void) usec;
+    (void) trueopt;
+}
+
+/*  Enable busy polling on the receive sockets, if requested  */
+void enable_busy_poll(
+    struct net_state_t *net_state)
+{
+    struct net_state_platform_t *platform = &net_state->platform;
+    int usec = get_env_count("MTR_PACKET_BUSY_POLL");
+
+    if (usec <= 0) {
+        return;
+    }
+
+    if (platform->ip4_socket_raw) {
+        set_socket_busy_poll(platform->ip4_recv_socket, usec);
+    } else {
+        set_socket_busy_poll(platform->ip4_txrx_icmp_socket, usec);
+        set_socket_busy_poll(platform->ip4_txrx_udp_socket, usec);
+    }
+    if (platform->ip6_socket_raw) {
+        set_socket_busy_poll(platform->ip6_recv_socket, usec);
+    } else {
+        set_socket_busy_poll(platform->ip6_txrx_icmp_socket, usec);
+        set_socket_busy_poll(platform->ip6_txrx_udp_socket, usec);
+    }
+    set_socket_busy_poll(platform->ip4_tcp_recv_socket, usec);
+    set_socket_busy_poll(platform->tcp6_socket, usec);
+    set_socket_busy_poll(platform->ring.socket, usec);
+}
+
+/*  Returns true if the main thread should spin while waiting  */
+bool is_spin_poll_requested(
+    void)
+{
+    return get_env_count("MTR_PACKET_SPIN") >= 0;
+}
+
+/*
+    Pin the calling thread to the CPU named by MTR_PACKET_SPIN, if the
+    net state is to spin.  This is called after any worker threads have
+    started, so that they aren't pinned with us.
+*/
+void start_spin_poll(
+    struct net_state_t *net_state)
+{
+    int cpu = get_env_count("MTR_PACKET_SPIN");
+#ifdef HAVE_SCHED_SETAFFINITY
+    cpu_set_t cpus;
+#endif
+
+    if (!net_state->platform.spin_poll) {
+        return;
+    }
+
+    /*  The io_uring engine does its own waiting  */
+    if (net_state->platform.uring) {
+        net_state->platform.spin_poll = false;
+        return;
+    }
+
+#ifdef HAVE_SCHED_SETAFFINITY
+    if (cpu >= CPU_SETSIZE) {
+        fprintf(stderr, "Invalid MTR_PACKET_SPIN cpu: %d\n", cpu);
+        exit(EXIT_FAILURE);
+    }
+
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (sched_setaffinity(0, sizeof(cpu_set_t), &cpus)) {
+        perror("Failure to pin to MTR_PACKET_SPIN cpu");
+        exit(EXIT_FAILURE);
+    }
+#endif
+}
+
+/*
+    Returns true if a wait which found nothing ready should be retried
+    at once, rather than returned from, because we are spinning and the
+    soonest probe timeout hasn't yet passed.  Without outstanding probes
+    there is nothing to time, so we sleep as usual.
+*/
+bool keep_spinning(
+    const struct net_state_t *net_state,
+    const struct timeval *probe_timeout)
+{
+    if (!net_state->platform.spin_poll || probe_timeout == NULL) {
+        return false;
+    }
+
+    return probe_timeout->tv_sec > 0 || probe_timeout->tv_usec > 0;
+}
@@ -0,0 +1,42 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef BUSYPOLL_UNIX_H
+#define BUSYPOLL_UNIX_H
+
+#include <stdbool.h>
+
+#include "probe.h"
+
+void select_probe_clock(
+    void);
+
+void enable_busy_poll(
+    struct net_state_t *net_state);
+
+bool is_spin_poll_requested(
+    void);
+
+void start_spin_poll(
+    struct net_state_t *net_state);
+
+bool keep_spinning(
+    const struct net_state_t *net_state,
+    const struct timeval *probe_timeout);
+
+#endif
@@ -29,7 +29,6 @@
     Fill the tokens array with pointers to the tokens, and return the
     number of tokens found.
 */
-static
 int tokenize_command(
     char **tokens,
     int max_tokens,
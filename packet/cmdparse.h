@@ -42,6 +42,11 @@ struct command_t {
     char *argument_value[MAX_COMMAND_ARGUMENTS];
 };
 
+int tokenize_command(
+    char **tokens,
+    int max_tokens,
+    char *command_string);
+
 int parse_command(
     struct command_t *command,
     char *command_string);
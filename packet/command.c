@@ -18,16 +18,19 @@
 
 #include "command.h"
 
-#include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <strings.h>
 
+#include "agent.h"
 #include "cmdparse.h"
+#include "pace.h"
 #include "platform.h"
+#include "trace.h"
+#include "wire.h"
 #include "config.h"
 
 /*
@@ -103,6 +106,30 @@ const char *check_support(
         return "ok";
     }
 
+    if (!strcmp(feature, "send-probe-batch")) {
+        return "ok";
+    }
+
+    if (!strcmp(feature, "probe-template")) {
+        return "ok";
+    }
+
+    if (!strcmp(feature, "binary-protocol")) {
+        return "ok";
+    }
+
+    if (!strcmp(feature, "timeout-ms")) {
+        return "ok";
+    }
+
+    if (!strcmp(feature, "stats")) {
+        return "ok";
+    }
+
+    if (!strcmp(feature, "pace")) {
+        return "ok";
+    }
+
     if (!strcmp(feature, "icmp")) {
         return check_protocol_support(net_state, IPPROTO_ICMP);
     }
@@ -120,6 +147,22 @@ const char *check_support(
     }
 #endif
 
+    if (!strcmp(feature, "tcp-syn")) {
+        if (is_tcp_syn_supported(net_state, 4)
+            || is_tcp_syn_supported(net_state, 6)) {
+            return "ok";
+        } else {
+            return "no";
+        }
+    }
+
+    if (!strcmp(feature, "kernel-timestamp")) {
+        if (is_kernel_timestamp_supported(net_state)) {
+            return "ok";
+        } else {
+            return "no";
+        }
+    }
 #ifdef SO_MARK
     if (!strcmp(feature, "mark")) {
         return "ok";
@@ -140,12 +183,14 @@ void check_support_command(
 
     feature = find_parameter(command, "feature");
     if (feature == NULL) {
-        printf("%d invalid-argument\n", command->token);
+        queue_reply(&net_state->session->output, "%d invalid-argument\n",
+                    command->token);
         return;
     }
 
     support = check_support(feature, net_state);
-    printf("%d feature-support support %s\n", command->token, support);
+    queue_reply(&net_state->session->output, "%d feature-support support %s\n",
+                command->token, support);
 }
 
 /*
@@ -159,6 +204,7 @@ bool decode_probe_argument(
     const char *value)
 {
     char *endstr = NULL;
+    long timeout;
 
     /*  Pass IPv4 addresses as string values  */
     if (!strcmp(name, "ip-4")) {
@@ -266,8 +312,59 @@ bool decode_probe_argument(
 
     /*  Number of seconds to wait for a reply  */
     if (!strcmp(name, "timeout")) {
-        param->timeout = strtol(value, &endstr, 10);
-        if (*endstr != 0) {
+        timeout = strtol(value, &endstr, 10);
+        if (*endstr != 0 || timeout < 0
+            || timeout > MAX_PROBE_TIMEOUT_MS / 1000) {
+            return false;
+        }
+        param->timeout_ms = 1000 * timeout;
+    }
+
+    /*  Number of milliseconds to wait for a reply  */
+    if (!strcmp(name, "timeout-ms")) {
+        timeout = strtol(value, &endstr, 10);
+        if (*endstr != 0 || timeout < 0 || timeout > MAX_PROBE_TIMEOUT_MS) {
+            return false;
+        }
+        param->timeout_ms = timeout;
+    }
+
+    /*  The source of the timestamps used to time the probe  */
+    if (!strcmp(name, "timestamp")) {
+        if (!strcmp(value, "kernel")) {
+            param->kernel_timestamp = true;
+        } else if (!strcmp(value, "user")) {
+            param->kernel_timestamp = false;
+        } else {
+            return false;
+        }
+    }
+
+    /*  Microseconds between probes to the destination  */
+    if (!strcmp(name, "pace-us")) {
+        param->pace_interval = strtol(value, &endstr, 10);
+        if (*endstr != 0 || param->pace_interval < 0
+            || param->pace_interval > MAX_PACE_INTERVAL) {
+            return false;
+        }
+    }
+
+    /*  The number of paced probes which may leave together  */
+    if (!strcmp(name, "pace-burst")) {
+        param->pace_burst = strtol(value, &endstr, 10);
+        if (*endstr != 0 || param->pace_burst < 1
+            || param->pace_burst > MAX_PROBES) {
+            return false;
+        }
+    }
+
+    /*  How TCP probes are sent  */
+    if (!strcmp(name, "tcp-method")) {
+        if (!strcmp(value, "syn")) {
+            param->tcp_syn = true;
+        } else if (!strcmp(value, "connect")) {
+            param->tcp_syn = false;
+        } else {
             return false;
         }
     }
@@ -287,15 +384,17 @@ bool validate_probe_parameters(
     struct probe_param_t *param)
 {
     if (!is_ip_version_supported(net_state, param->ip_version)) {
-        printf("%d invalid-argument reason ip-version-not-supported\n",
-               param->command_token);
+        report_reply(net_state->session, param->command_token,
+                     WIRE_REPLY_INVALID_ARGUMENT,
+                     "reason ip-version-not-supported");
 
         return false;
     }
 
     if (!is_protocol_supported(net_state, param->protocol)) {
-        printf("%d invalid-argument reason protocol-not-supported\n",
-               param->command_token);
+        report_reply(net_state->session, param->command_token,
+                     WIRE_REPLY_INVALID_ARGUMENT,
+                     "reason protocol-not-supported");
 
         return false;
     }
@@ -303,37 +402,58 @@ bool validate_probe_parameters(
     return true;
 }
 
-/*  Handle "send-probe" commands  */
+/*
+    Fill in probe parameters from the arguments of a probe command.
+    Returns false, after reporting the error, if an argument is invalid.
+*/
 static
-void send_probe_command(
+bool decode_probe_command(
     const struct command_t *command,
-    struct net_state_t *net_state)
+    struct net_state_t *net_state,
+    struct probe_param_t *param)
 {
-    struct probe_param_t param;
     int i;
     char *name;
     char *value;
 
-    /*  We will prepare a probe_param_t for send_probe.  */
-    memset(&param, 0, sizeof(struct probe_param_t));
-    param.command_token = command->token;
-    param.protocol = IPPROTO_ICMP;
-    param.ttl = 255;
-    param.packet_size = 64;
-    param.timeout = 10;
-    param.is_probing_byte_order = false;
+    memset(param, 0, sizeof(struct probe_param_t));
+    param->command_token = command->token;
+    param->protocol = IPPROTO_ICMP;
+    param->ttl = 255;
+    param->packet_size = 64;
+    param->timeout_ms = 10000;
+    param->pace_burst = 1;
+    param->is_probing_byte_order = false;
 
     for (i = 0; i < command->argument_count; i++) {
         name = command->argument_name[i];
         value = command->argument_value[i];
 
-        if (!decode_probe_argument(&param, name, value)) {
-            printf("%d invalid-argument\n", command->token);
-            return;
+        if (!decode_probe_argument(param, name, value)) {
+            queue_reply(&net_state->session->output, "%d invalid-argument\n",
+                        command->token);
+            return false;
         }
     }
 
-    if (!validate_probe_parameters(net_state, &param)) {
+    return validate_probe_parameters(net_state, param);
+}
+
+/*  Handle "send-probe" commands  */
+static
+void send_probe_command(
+    const struct command_t *command,
+    struct net_state_t *net_state)
+{
+    struct probe_param_t param;
+
+    /*  We will prepare a probe_param_t for send_probe.  */
+    if (!decode_probe_command(command, net_state, &param)) {
+        return;
+    }
+
+    /*  A paced probe may have to wait for its turn  */
+    if (pace_probe(net_state, &param)) {
         return;
     }
 
@@ -341,6 +461,299 @@ void send_probe_command(
     send_probe(net_state, &param);
 }
 
+/*
+    Decode the "probes" argument of send-probe-batch, which is a comma
+    separated list of values in groups of two: the command token to
+    use for the probe's reply, followed by the probe's time-to-live.
+
+    Returns the number of probes, or -1 if the list is malformed.
+*/
+static
+int decode_batch_probes(
+    const char *probes,
+    const struct probe_param_t *base_param,
+    struct probe_param_t *params)
+{
+    const char *pos = probes;
+    char *endstr;
+    long token;
+    long ttl;
+    int count = 0;
+
+    while (*pos) {
+        if (count >= MAX_BATCH_PROBES) {
+            return -1;
+        }
+
+        errno = 0;
+        token = strtol(pos, &endstr, 10);
+        if (endstr == pos || *endstr != ',') {
+            return -1;
+        }
+        if (errno == ERANGE || token < INT_MIN || token > INT_MAX) {
+            return -1;
+        }
+        pos = endstr + 1;
+
+        ttl = strtol(pos, &endstr, 10);
+        if (endstr == pos || (*endstr != ',' && *endstr != 0)) {
+            return -1;
+        }
+        if (ttl < 1 || ttl > 255) {
+            return -1;
+        }
+        pos = endstr;
+        if (*pos == ',') {
+            pos++;
+        }
+
+        params[count] = *base_param;
+        params[count].command_token = token;
+        params[count].ttl = ttl;
+        count++;
+    }
+
+    return count;
+}
+
+/*
+    Handle "send-probe-batch" commands, which send several probes to
+    the same destination with differing time-to-live values.  Each
+    probe receives its own reply, using the token given for it.
+*/
+static
+void send_probe_batch_command(
+    const struct command_t *command,
+    struct net_state_t *net_state)
+{
+    static struct probe_param_t params[MAX_BATCH_PROBES];
+    struct probe_param_t base_param;
+    const char *probes;
+    int probe_count;
+    int i;
+
+    probes = find_parameter(command, "probes");
+    if (probes == NULL) {
+        queue_reply(&net_state->session->output, "%d invalid-argument\n",
+                    command->token);
+        return;
+    }
+
+    if (!decode_probe_command(command, net_state, &base_param)) {
+        return;
+    }
+
+    probe_count = decode_batch_probes(probes, &base_param, params);
+    if (probe_count <= 0) {
+        queue_reply(&net_state->session->output, "%d invalid-argument\n",
+                    command->token);
+        return;
+    }
+
+    /*  Paced probes leave one at a time, rather than as a batch  */
+    if (base_param.pace_interval > 0) {
+        for (i = 0; i < probe_count; i++) {
+            if (!pace_probe(net_state, &params[i])) {
+                send_probe(net_state, &params[i]);
+            }
+        }
+        return;
+    }
+
+    send_probe_batch(net_state, params, probe_count);
+}
+
+/*
+    Decode the template id argument of a template command.
+    Returns -1 if the argument is missing or malformed.
+*/
+static
+int decode_template_id(
+    const struct command_t *command)
+{
+    const char *value;
+    char *endstr;
+    long template_id;
+
+    value = find_parameter(command, "template");
+    if (value == NULL) {
+        return -1;
+    }
+
+    template_id = strtol(value, &endstr, 10);
+    if (endstr == value || *endstr != 0) {
+        return -1;
+    }
+    if (template_id < 0 || template_id >= MAX_PROBE_TEMPLATES) {
+        return -1;
+    }
+
+    return template_id;
+}
+
+/*
+    Handle "define-probe-template" commands, which store the arguments
+    of a probe for repeated use with "send-template".
+*/
+static
+void define_probe_template_command(
+    const struct command_t *command,
+    struct net_state_t *net_state)
+{
+    struct probe_param_t param;
+    int template_id;
+
+    template_id = decode_template_id(command);
+    if (template_id == -1) {
+        queue_reply(&net_state->session->output, "%d invalid-argument\n",
+                    command->token);
+        return;
+    }
+
+    if (!decode_probe_command(command, net_state, &param)) {
+        return;
+    }
+
+    if (define_probe_template(net_state, template_id, &param)) {
+        queue_reply(&net_state->session->output, "%d invalid-argument\n",
+                    command->token);
+        return;
+    }
+
+    queue_reply(&net_state->session->output,
+                "%d template-defined template %d\n", command->token,
+                template_id);
+}
+
+/*
+    Handle "send-template" commands, which send a probe defined by a
+    template, with a particular time-to-live, and optionally a timeout
+    other than the template's.
+*/
+static
+void send_template_command(
+    const struct command_t *command,
+    struct net_state_t *net_state)
+{
+    struct probe_template_t *probe_template;
+    struct probe_param_t param;
+    const char *value;
+    char *endstr;
+    long ttl = 255;
+    long timeout_ms = -1;
+
+    probe_template =
+        find_probe_template(net_state, decode_template_id(command));
+    if (probe_template == NULL) {
+        queue_reply(&net_state->session->output, "%d invalid-argument\n",
+                    command->token);
+        return;
+    }
+
+    value = find_parameter(command, "ttl");
+    if (value != NULL) {
+        ttl = strtol(value, &endstr, 10);
+        if (endstr == value || *endstr != 0 || ttl < 1 || ttl > 255) {
+            queue_reply(&net_state->session->output, "%d invalid-argument\n",
+                        command->token);
+            return;
+        }
+    }
+
+    /*  A template's timeout may be replaced for a single probe  */
+    value = find_parameter(command, "timeout-ms");
+    if (value != NULL) {
+        timeout_ms = strtol(value, &endstr, 10);
+        if (endstr == value || *endstr != 0 || timeout_ms < 0
+            || timeout_ms > MAX_PROBE_TIMEOUT_MS) {
+            queue_reply(&net_state->session->output, "%d invalid-argument\n",
+                        command->token);
+            return;
+        }
+    }
+
+    /*  A paced probe may have to wait for its turn  */
+    if (probe_template->param.pace_interval > 0) {
+        param = probe_template->param;
+        param.command_token = command->token;
+        param.ttl = ttl;
+        if (timeout_ms >= 0) {
+            param.timeout_ms = timeout_ms;
+        }
+        if (pace_probe(net_state, &param)) {
+            return;
+        }
+    }
+
+    send_probe_template(net_state, probe_template, command->token, ttl,
+                        timeout_ms);
+}
+
+/*
+    Handle "enter-binary-mode" commands.  After the reply, all further
+    requests and replies are exchanged as binary records.
+*/
+static
+void enter_binary_mode_command(
+    const struct command_t *command,
+    struct net_state_t *net_state)
+{
+    queue_reply(&net_state->session->output, "%d binary-mode-entered\n",
+                command->token);
+    net_state->session->binary_protocol = true;
+}
+
+/*
+    Handle "stats" commands, reporting the counters of our own work,
+    totalled across all threads.
+*/
+static
+void stats_command(
+    const struct command_t *command,
+    struct net_state_t *net_state)
+{
+    struct packet_stats_t stats;
+
+    gather_packet_stats(net_state, &stats);
+    queue_stats_reply(&net_state->session->output, command->token, &stats,
+                      net_state->outstanding_probe_count);
+}
+
+/*
+    Handle the commands of a TCP client which has yet to authenticate.
+    The only command accepted is "authenticate", giving the digest of
+    the challenge we sent, keyed by our secret.  Anything else, or a
+    wrong digest, is refused, and the client is dropped.
+*/
+static
+void authenticate_command(
+    const struct command_t *command,
+    struct net_state_t *net_state)
+{
+    struct command_session_t *session = net_state->session;
+    char expected[AGENT_DIGEST_HEX_SIZE + 1];
+    const char *digest = NULL;
+
+    if (!strcmp(command->command_name, "authenticate")) {
+        digest = find_parameter(command, "digest");
+    }
+
+    if (digest) {
+        compute_agent_digest(session->auth_secret, session->auth_nonce,
+                             expected);
+        if (is_agent_digest_equal(digest, expected)) {
+            queue_reply(&session->output, "%d authenticated\n",
+                        command->token);
+            session->auth_secret = NULL;
+            return;
+        }
+    }
+
+    queue_reply(&session->output, "%d permission-denied\n",
+                command->token);
+    session->auth_failed = true;
+}
+
 /*
     Given a parsed command, dispatch to the handler for specific
     command requests.
@@ -350,38 +763,239 @@ void dispatch_command(
     const struct command_t *command,
     struct net_state_t *net_state)
 {
+    TRACE_PROBE2(mtr_packet, dispatch_command, command->token,
+                 net_state->stats.command_time_ns);
+
+    if (net_state->session->auth_failed) {
+        return;
+    }
+    if (net_state->session->auth_secret) {
+        authenticate_command(command, net_state);
+        return;
+    }
+
     if (!strcmp(command->command_name, "check-support")) {
         check_support_command(command, net_state);
     } else if (!strcmp(command->command_name, "send-probe")) {
         send_probe_command(command, net_state);
+    } else if (!strcmp(command->command_name, "send-probe-batch")) {
+        send_probe_batch_command(command, net_state);
+    } else if (!strcmp(command->command_name, "define-probe-template")) {
+        define_probe_template_command(command, net_state);
+    } else if (!strcmp(command->command_name, "send-template")) {
+        send_template_command(command, net_state);
+    } else if (!strcmp(command->command_name, "enter-binary-mode")) {
+        enter_binary_mode_command(command, net_state);
+    } else if (!strcmp(command->command_name, "stats")) {
+        stats_command(command, net_state);
     } else {
         /*  For unrecognized commands, respond with an error  */
-        printf("%d unknown-command\n", command->token);
+        queue_reply(&net_state->session->output, "%d unknown-command\n",
+                    command->token);
     }
 }
 
+/*
+    Fill in probe parameters from a binary request record.
+    Returns false, after reporting the error, if a field is invalid.
+*/
+static
+bool decode_wire_probe_request(
+    const struct wire_request_t *request,
+    struct net_state_t *net_state,
+    struct probe_param_t *param)
+{
+    uint32_t timeout_ms;
+    bool timeout_valid;
+
+    memset(param, 0, sizeof(struct probe_param_t));
+    param->command_token = request->token;
+    param->ip_version = request->ip_version;
+    param->protocol = request->protocol;
+    param->ttl = request->ttl;
+    param->packet_size = request->packet_size;
+    param->dest_port = request->dest_port;
+    param->local_port = request->local_port;
+    param->type_of_service = request->type_of_service;
+    param->bit_pattern = request->bit_pattern;
+    /*  A timeout too long to hold is left at zero, and refused below  */
+    if (request->flags & WIRE_FLAG_TIMEOUT_MS) {
+        timeout_valid = request->timeout <= MAX_PROBE_TIMEOUT_MS;
+        timeout_ms = request->timeout;
+    } else {
+        timeout_valid = request->timeout <= MAX_PROBE_TIMEOUT_MS / 1000;
+        timeout_ms = 1000 * request->timeout;
+    }
+    if (timeout_valid) {
+        param->timeout_ms = timeout_ms;
+    }
+    param->routing_mark = request->routing_mark;
+    param->kernel_timestamp =
+        (request->flags & WIRE_FLAG_KERNEL_TIMESTAMP) != 0;
+    param->tcp_syn = (request->flags & WIRE_FLAG_TCP_SYN) != 0;
+    if (request->flags & WIRE_FLAG_PACE) {
+        param->pace_interval = request->pace_interval;
+    }
+    param->pace_burst = 1;
+    param->is_probing_byte_order = false;
+
+    param->remote_address_bytes = request->remote_address;
+    if (request->flags & WIRE_FLAG_LOCAL_ADDRESS) {
+        param->local_address_bytes = request->local_address;
+    }
+
+    /*  As with send-probe, privileged local ports are not allowed  */
+    if ((param->local_port && param->local_port < 1024)
+        || (param->ip_version != 4 && param->ip_version != 6)
+        || param->pace_interval > MAX_PACE_INTERVAL
+        || !timeout_valid) {
+
+        report_reply(net_state->session, param->command_token,
+                     WIRE_REPLY_INVALID_ARGUMENT, NULL);
+        return false;
+    }
+
+    return validate_probe_parameters(net_state, param);
+}
+
+/*  Handle a single binary request record  */
+static
+void dispatch_wire_request(
+    const uint8_t *record,
+    struct net_state_t *net_state)
+{
+    struct wire_request_t request;
+    struct probe_param_t param;
+
+    decode_wire_request(record, &request);
+    TRACE_PROBE2(mtr_packet, dispatch_command, request.token,
+                 net_state->stats.command_time_ns);
+
+    if (request.request_type != WIRE_REQUEST_SEND_PROBE) {
+        report_reply(net_state->session, request.token,
+                     WIRE_REPLY_UNKNOWN_COMMAND, NULL);
+        return;
+    }
+
+    if (!decode_wire_probe_request(&request, net_state, &param)) {
+        return;
+    }
+
+    if (pace_probe(net_state, &param)) {
+        return;
+    }
+
+    send_probe(net_state, &param);
+}
+
+/*
+    Receive replies once DISPATCH_RECEIVE_INTERVAL probes have been sent
+    since we last did, for the dispatch of a burst of commands.
+*/
+static
+void receive_during_dispatch(
+    struct net_state_t *net_state,
+    unsigned long *received_at)
+{
+    if (net_state->stats.probes_sent - *received_at
+        >= DISPATCH_RECEIVE_INTERVAL) {
+        receive_replies(net_state);
+        *received_at = net_state->stats.probes_sent;
+    }
+}
+
+/*
+    Dispatch all complete binary request records in the command buffer,
+    starting at a particular position.  Returns the position following
+    the last complete record, leaving any partial record for the next
+    read.
+*/
+static
+int dispatch_wire_requests(
+    struct command_buffer_t *buffer,
+    struct net_state_t *net_state,
+    int position)
+{
+    uint8_t *record = (uint8_t *) buffer->incoming_buffer;
+    unsigned long received_at = net_state->stats.probes_sent;
+
+    while (buffer->incoming_read_position - position >= WIRE_REQUEST_SIZE) {
+        dispatch_wire_request(&record[position], net_state);
+        position += WIRE_REQUEST_SIZE;
+        receive_during_dispatch(net_state, &received_at);
+    }
+
+    return position;
+}
+
+/*
+    Enlarge the incoming command buffer, doubling its size, so that a
+    burst of commands larger than the buffer can be read at once.
+    Returns -1 if the buffer is already at its maximum size.
+*/
+int grow_command_buffer(
+    struct command_buffer_t *buffer)
+{
+    int size;
+    char *incoming_buffer;
+
+    if (buffer->incoming_buffer_size) {
+        size = buffer->incoming_buffer_size * 2;
+    } else {
+        size = COMMAND_BUFFER_SIZE;
+    }
+
+    if (size > COMMAND_BUFFER_MAX_SIZE) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    incoming_buffer = realloc(buffer->incoming_buffer, size);
+    if (incoming_buffer == NULL) {
+        perror("Failure to allocate command buffer");
+        exit(EXIT_FAILURE);
+    }
+
+    buffer->incoming_buffer = incoming_buffer;
+    buffer->incoming_buffer_size = size;
+
+    return 0;
+}
+
 /*
     With newly read data in our command buffer, dispatch all completed
-    command requests.
+    command requests.  Commands are parsed in place as a cursor advances
+    through the buffer, and any partial command remaining is moved to
+    the front of the buffer once all complete commands are dispatched.
 */
 void dispatch_buffer_commands(
     struct command_buffer_t *buffer,
     struct net_state_t *net_state)
 {
     struct command_t command;
+    char *commands = buffer->incoming_buffer;
     char *end_of_command;
-    char full_command[COMMAND_BUFFER_SIZE];
-    int command_length;
-    int remaining_count;
+    int position = 0;
+    long long parse_start;
+    int parse_result;
+    unsigned long received_at = net_state->stats.probes_sent;
 
-    while (true) {
-        assert(buffer->incoming_read_position < COMMAND_BUFFER_SIZE);
+    /*  The send latency of the probes requested is counted from here  */
+    net_state->stats.command_time_ns = get_stats_time_ns();
 
-        /*  Terminate the buffer string  */
-        buffer->incoming_buffer[buffer->incoming_read_position] = 0;
+    while (position < buffer->incoming_read_position) {
+        /*
+           After "enter-binary-mode", the remainder of the buffer
+           holds binary request records, rather than text.
+         */
+        if (net_state->session->binary_protocol) {
+            position = dispatch_wire_requests(buffer, net_state, position);
+            break;
+        }
 
         /*  Find the next newline, which terminates command requests  */
-        end_of_command = index(buffer->incoming_buffer, '\n');
+        end_of_command = memchr(&commands[position], '\n',
+                                buffer->incoming_read_position - position);
         if (end_of_command == NULL) {
             /*
                No newlines found, so any data we've read so far is
@@ -390,37 +1004,48 @@ void dispatch_buffer_commands(
             break;
         }
 
-        command_length = end_of_command - buffer->incoming_buffer;
-        remaining_count =
-            buffer->incoming_read_position - command_length - 1;
+        /*  Terminate the command, and parse it where it lies  */
+        *end_of_command = 0;
 
-        /*  Copy the completed command  */
-        memmove(full_command, buffer->incoming_buffer, command_length);
-        full_command[command_length] = 0;
+        if (end_of_command - &commands[position] >= COMMAND_BUFFER_SIZE - 1) {
+            queue_reply(&net_state->session->output,
+                        "0 command-buffer-overflow\n");
+            position = end_of_command - commands + 1;
+            continue;
+        }
 
-        /*
-           Free the space used by the completed command by advancing the
-           remaining requests within the buffer.
-         */
-        memmove(buffer->incoming_buffer, end_of_command + 1,
-                remaining_count);
-        buffer->incoming_read_position -= command_length + 1;
+        parse_start = get_stats_time_ns();
+        parse_result = parse_command(&command, &commands[position]);
+        record_histogram(&net_state->stats.parse_ns,
+                         get_stats_time_ns() - parse_start);
 
-        if (parse_command(&command, full_command)) {
+        if (parse_result) {
             /*  If the command fails to parse, respond with an error  */
-            printf("0 command-parse-error\n");
+            queue_reply(&net_state->session->output,
+                        "0 command-parse-error\n");
         } else {
             dispatch_command(&command, net_state);
         }
+
+        position = end_of_command - commands + 1;
+        receive_during_dispatch(net_state, &received_at);
+    }
+
+    /*  Free the space used by the dispatched commands  */
+    if (position > 0) {
+        memmove(commands, &commands[position],
+                buffer->incoming_read_position - position);
+        buffer->incoming_read_position -= position;
     }
 
     if (buffer->incoming_read_position >= COMMAND_BUFFER_SIZE - 1) {
         /*
-           If we've filled the buffer without a complete command, the
-           only thing we can do is discard what we've read and hope that 
-           new data is better formatted.
+           If we've read more than a command's maximum length without
+           its end, the only thing we can do is discard what we've read
+           and hope that new data is better formatted.
          */
-        printf("0 command-buffer-overflow\n");
+        queue_reply(&net_state->session->output,
+                    "0 command-buffer-overflow\n");
         buffer->incoming_read_position = 0;
     }
 }
@@ -24,6 +24,20 @@
 
 #define COMMAND_BUFFER_SIZE 4096
 
+/*
+    A single command must be shorter than COMMAND_BUFFER_SIZE, but the
+    incoming command buffer grows to hold large bursts of commands, up
+    to this size.
+*/
+#define COMMAND_BUFFER_MAX_SIZE (1024 * 1024)
+
+/*
+    While dispatching a burst of commands, replies are received after
+    every this many probes sent, so that replies to the first probes of
+    the burst don't overflow the receive sockets before we read them.
+*/
+#define DISPATCH_RECEIVE_INTERVAL 64
+
 #ifdef PLATFORM_CYGWIN
 #include "command_cygwin.h"
 #else
@@ -36,7 +50,10 @@ struct command_buffer_t {
     int command_stream;
 
     /*  Storage to read commands into  */
-    char incoming_buffer[COMMAND_BUFFER_SIZE];
+    char *incoming_buffer;
+
+    /*  The allocated size of incoming_buffer  */
+    int incoming_buffer_size;
 
     /*  The number of bytes read so far in incoming_buffer  */
     int incoming_read_position;
@@ -49,6 +66,9 @@ void init_command_buffer(
     struct command_buffer_t *command_buffer,
     int command_stream);
 
+int grow_command_buffer(
+    struct command_buffer_t *buffer);
+
 int read_commands(
     struct command_buffer_t *buffer);
 
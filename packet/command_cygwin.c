@@ -89,8 +89,7 @@ void start_read_command(
     struct command_buffer_t *buffer)
 {
     HANDLE command_stream = (HANDLE) get_osfhandle(buffer->command_stream);
-    int space_remaining =
-        COMMAND_BUFFER_SIZE - buffer->incoming_read_position - 1;
+    int space_remaining;
     int err;
 
     /*  If a read is already active, or the pipe is closed, do nothing  */
@@ -98,6 +97,22 @@ void start_read_command(
         return;
     }
 
+    /*
+       If the buffer is full, and at its maximum size, wait until the
+       commands already read have been dispatched.
+     */
+    if (buffer->incoming_read_position == buffer->incoming_buffer_size
+        && grow_command_buffer(buffer)) {
+        return;
+    }
+
+    /*  The overlapped read completes into a buffer of fixed size  */
+    space_remaining =
+        buffer->incoming_buffer_size - buffer->incoming_read_position;
+    if (space_remaining > COMMAND_BUFFER_SIZE) {
+        space_remaining = COMMAND_BUFFER_SIZE;
+    }
+
     memset(&buffer->platform.overlapped, 0, sizeof(OVERLAPPED));
     buffer->platform.overlapped.hEvent = (HANDLE) buffer;
 
@@ -134,6 +149,7 @@ void init_command_buffer(
     memset(command_buffer, 0, sizeof(struct command_buffer_t));
     command_buffer->command_stream = command_stream;
     command_buffer->platform.pipe_open = true;
+    grow_command_buffer(command_buffer);
 }
 
 /*
@@ -37,6 +37,7 @@ void init_command_buffer(
 
     memset(command_buffer, 0, sizeof(struct command_buffer_t));
     command_buffer->command_stream = command_stream;
+    grow_command_buffer(command_buffer);
 
     /*  Get the current command stream flags  */
     flags = fcntl(command_stream, F_GETFL, 0);
@@ -52,38 +53,58 @@ void init_command_buffer(
     }
 }
 
-/*  Read currently available data from the command stream  */
+/*
+    Read all currently available data from the command stream, growing
+    the command buffer as necessary, so that a large burst of commands
+    can be dispatched together.
+*/
 int read_commands(
     struct command_buffer_t *buffer)
 {
-    int space_remaining =
-        COMMAND_BUFFER_SIZE - buffer->incoming_read_position - 1;
-    char *read_position =
-        &buffer->incoming_buffer[buffer->incoming_read_position];
+    int space_remaining;
+    char *read_position;
     int read_count;
     int command_stream = buffer->command_stream;
 
-    read_count = read(command_stream, read_position, space_remaining);
+    while (true) {
+        if (buffer->incoming_read_position == buffer->incoming_buffer_size) {
+            /*
+               At the maximum buffer size, leave further commands in the
+               stream until those already read have been dispatched.
+             */
+            if (grow_command_buffer(buffer)) {
+                return 0;
+            }
+        }
 
-    /*  If the command stream has been closed, read will return zero.  */
-    if (read_count == 0) {
-        errno = EPIPE;
-        return -1;
-    }
+        space_remaining =
+            buffer->incoming_buffer_size - buffer->incoming_read_position;
+        read_position =
+            &buffer->incoming_buffer[buffer->incoming_read_position];
 
-    if (read_count > 0) {
-        /*  Account for the newly read data  */
-        buffer->incoming_read_position += read_count;
-    }
+        read_count = read(command_stream, read_position, space_remaining);
 
-    if (read_count < 0) {
-        /*  EAGAIN simply means there is no available data to read  */
-        /*  EINTR indicates we received a signal during read  */
-        if (errno != EINTR && errno != EAGAIN) {
-            perror("Unexpected command buffer read error");
-            exit(EXIT_FAILURE);
+        /*
+           If the command stream has been closed, read will return zero.
+           A socket stream may also be reset by its peer.
+         */
+        if (read_count == 0 || (read_count < 0 && errno == ECONNRESET)) {
+            errno = EPIPE;
+            return -1;
+        }
+
+        if (read_count < 0) {
+            /*  EAGAIN simply means there is no available data to read  */
+            /*  EINTR indicates we received a signal during read  */
+            if (errno != EINTR && errno != EAGAIN) {
+                perror("Unexpected command buffer read error");
+                exit(EXIT_FAILURE);
+            }
+
+            return 0;
         }
-    }
 
-    return 0;
+        /*  Account for the newly read data  */
+        buffer->incoming_read_position += read_count;
+    }
 }
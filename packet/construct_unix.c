@@ -25,34 +25,72 @@
 #include <unistd.h>
 
 #include "protocols.h"
+#include "wait.h"
 
 /* For Mac OS X and FreeBSD */
 #ifndef SOL_IP
 #define SOL_IP IPPROTO_IP
 #endif
 
+/*  The receive window advertised in TCP SYN probes  */
+#define TCP_SYN_WINDOW 65535
+
 /*  A source of data for computing a checksum  */
 struct checksum_source_t {
     const void *data;
     size_t size;
 };
 
-/*  Compute the IP checksum (or ICMP checksum) of a packet.  */
-static
+/*
+    Compute the IP checksum (or ICMP checksum) of a packet.
+
+    The one's complement sum doesn't depend on byte order (RFC 1071),
+    so we sum the packet 32 bits at a time in host order, into a 64-bit
+    accumulator which can't overflow for any packet we could construct.
+    The loop is simple enough for the compiler to vectorize.  The sum is
+    folded and converted to host order only once, at the end.
+*/
 uint16_t compute_checksum(
     const void *packet,
     int size)
 {
     const uint8_t *packet_bytes = (uint8_t *) packet;
-    uint32_t sum = 0;
-    int i;
+    uint64_t sum = 0;
+    uint32_t word32;
+    uint16_t word16;
+    uint16_t checksum;
+
+    while (size >= 8) {
+        memcpy(&word32, packet_bytes, sizeof(uint32_t));
+        sum += word32;
+        memcpy(&word32, packet_bytes + 4, sizeof(uint32_t));
+        sum += word32;
+
+        packet_bytes += 8;
+        size -= 8;
+    }
 
-    for (i = 0; i < size; i++) {
-        if ((i & 1) == 0) {
-            sum += packet_bytes[i] << 8;
-        } else {
-            sum += packet_bytes[i];
-        }
+    if (size >= 4) {
+        memcpy(&word32, packet_bytes, sizeof(uint32_t));
+        sum += word32;
+
+        packet_bytes += 4;
+        size -= 4;
+    }
+
+    if (size >= 2) {
+        memcpy(&word16, packet_bytes, sizeof(uint16_t));
+        sum += word16;
+
+        packet_bytes += 2;
+        size -= 2;
+    }
+
+    /*  A trailing odd byte is padded with a zero byte following it  */
+    if (size) {
+        word16 = 0;
+        memcpy(&word16, packet_bytes, 1);
+        sum += word16;
     }
 
     /*
@@ -67,6 +105,29 @@ uint16_t compute_checksum(
        The value stored is the one's complement of the
        mathematical sum.
      */
+    checksum = ~sum & 0xffff;
+
+    return ntohs(checksum);
+}
+
+/*
+    Update a checksum for the change of a single 16-bit word of the
+    checksummed data, without summing the data again, as described by
+    RFC 1624:  HC' = ~(~HC + ~m + m')
+
+    All values are in host byte order.
+*/
+uint16_t update_checksum(
+    uint16_t checksum,
+    uint16_t old_word,
+    uint16_t new_word)
+{
+    uint32_t sum;
+
+    sum = (~checksum & 0xffff) + (~old_word & 0xffff) + new_word;
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum = (sum >> 16) + (sum & 0xffff);
+
     return (~sum & 0xffff);
 }
 
@@ -219,6 +280,69 @@ void set_udp_ports(
     }
 }
 
+/*
+    With both ports fixed, the sequence number is stored in the UDP
+    checksum, and the destination silently discards the probe unless
+    the checksum is nevertheless correct.  As Paris traceroute does,
+    we set the first two bytes of the payload such that the correct
+    checksum is the sequence number.  The sum covers the pseudoheader
+    as well as the datagram, and the payload has room for the two bytes.
+*/
+static
+void set_udp_checksum_payload(
+    struct UDPHeader *udp,
+    int udp_size,
+    const void *pseudo,
+    int pseudo_size,
+    const struct probe_param_t *param)
+{
+    char *payload = (char *) udp + sizeof(struct UDPHeader);
+    uint16_t word = 0;
+    uint32_t sum;
+
+    if (!param->dest_port || !param->local_port) {
+        return;
+    }
+
+    memcpy(payload, &word, sizeof(uint16_t));
+
+    /*
+       The complement of each checksum is a sum of its data, and
+       the sums of the pseudoheader and the datagram add together.
+     */
+    sum = (~compute_checksum(pseudo, pseudo_size) & 0xffff) +
+        (~compute_checksum(udp, udp_size) & 0xffff);
+    sum = (sum >> 16) + (sum & 0xffff);
+
+    word = htons(~sum & 0xffff);
+    memcpy(payload, &word, sizeof(uint16_t));
+}
+
+/*
+    Fix the checksum of a raw UDPv4 packet following its IP header,
+    using the addresses in the IP header for the pseudoheader.
+*/
+static
+void set_udp4_checksum_payload(
+    char *packet_buffer,
+    const struct probe_param_t *param)
+{
+    const struct IPHeader *ip = (struct IPHeader *) packet_buffer;
+    struct UDPHeader *udp;
+    struct UDPPseudoHeader pseudo;
+
+    udp = (struct UDPHeader *) &packet_buffer[sizeof(struct IPHeader)];
+
+    memset(&pseudo, 0, sizeof(struct UDPPseudoHeader));
+    pseudo.saddr = ip->saddr;
+    pseudo.daddr = ip->daddr;
+    pseudo.protocol = IPPROTO_UDP;
+    pseudo.len = udp->length;
+
+    set_udp_checksum_payload(udp, ntohs(udp->length),
+                             &pseudo, sizeof(struct UDPPseudoHeader), param);
+}
+
 /*
     Construct a header for UDP probes, using the port number associated
     with the probe.
@@ -246,20 +370,28 @@ void construct_udp4_header(
 
     set_udp_ports(udp, sequence, param);
     udp->length = htons(udp_size);
+
+    if (net_state->platform.ip4_socket_raw) {
+        set_udp4_checksum_payload(packet_buffer, param);
+    }
 }
 
 /*  Construct a header for UDPv6 probes  */
 static
 int construct_udp6_packet(
-    const struct net_state_t *net_state,
+    struct net_state_t *net_state,
     int sequence,
     char *packet_buffer,
     int packet_size,
+    const struct sockaddr_storage *src_sockaddr,
+    const struct sockaddr_storage *dest_sockaddr,
     const struct probe_param_t *param)
 {
     int udp_socket = net_state->platform.udp6_send_socket;
     struct UDPHeader *udp;
+    struct IP6PseudoHeader pseudo;
     int udp_size;
+    int chksum_offset;
 
     udp = (struct UDPHeader *) packet_buffer;
     udp_size = packet_size;
@@ -273,10 +405,32 @@ int construct_udp6_packet(
         /*
            Instruct the kernel to put the pseudoheader checksum into the
            UDP header, this is only needed when using RAW socket.
+           When the checksum holds the sequence number, we make it
+           correct ourselves, and the kernel must leave it alone.
          */
-        int chksum_offset = (char *) &udp->checksum - (char *) udp;
-        if (setsockopt(udp_socket, IPPROTO_IPV6,
-                       IPV6_CHECKSUM, &chksum_offset, sizeof(int))) {
+        if (param->dest_port && param->local_port) {
+            const struct sockaddr_in6 *src_sin6 =
+                (const struct sockaddr_in6 *) src_sockaddr;
+            const struct sockaddr_in6 *dest_sin6 =
+                (const struct sockaddr_in6 *) dest_sockaddr;
+
+            memset(&pseudo, 0, sizeof(struct IP6PseudoHeader));
+            memcpy(pseudo.saddr, &src_sin6->sin6_addr, sizeof(pseudo.saddr));
+            memcpy(pseudo.daddr, &dest_sin6->sin6_addr,
+                   sizeof(pseudo.daddr));
+            pseudo.len = htonl(udp_size);
+            pseudo.protocol = IPPROTO_UDP;
+
+            set_udp_checksum_payload(udp, udp_size, &pseudo,
+                                     sizeof(struct IP6PseudoHeader), param);
+            chksum_offset = -1;
+        } else {
+            chksum_offset = (char *) &udp->checksum - (char *) udp;
+        }
+
+        if (COUNT_SYSCALL(&net_state->stats,
+                          setsockopt(udp_socket, IPPROTO_IPV6, IPV6_CHECKSUM,
+                                     &chksum_offset, sizeof(int)))) {
             return -1;
         }
     }
@@ -284,12 +438,123 @@ int construct_udp6_packet(
     return 0;
 }
 
+/*
+    Returns true if a probe is to be sent as a raw TCP SYN segment,
+    rather than by connecting a TCP socket.  Probes which ask for
+    a SYN segment fall back to connecting when raw TCP isn't available
+    for the IP version of the probe.
+*/
+bool is_tcp_syn_probe(
+    const struct net_state_t *net_state,
+    const struct probe_param_t *param)
+{
+    return param->protocol == IPPROTO_TCP && param->tcp_syn
+        && is_tcp_syn_supported(net_state, param->ip_version);
+}
+
+/*
+    The initial TCP sequence number of a SYN probe.  A reply from the
+    destination acknowledges this number, which lets us distinguish
+    replies to our probes from other traffic to the same local port.
+*/
+uint32_t compute_tcp_syn_sequence(
+    int sequence)
+{
+    return ((uint32_t) getpid() << 16) | (sequence & 0xFFFF);
+}
+
+/*  Fill in the TCP header of a SYN probe, other than the checksum  */
+static
+void construct_tcp_header(
+    struct TCPSegmentHeader *tcp,
+    int sequence,
+    const struct probe_param_t *param)
+{
+    memset(tcp, 0, sizeof(struct TCPSegmentHeader));
+
+    /*
+       As with connected TCP probes, the local port identifies the
+       probe when a TTL expiration is reported.
+     */
+    tcp->srcport = htons(sequence);
+
+    if (param->dest_port) {
+        tcp->dstport = htons(param->dest_port);
+    } else {
+        tcp->dstport = htons(HTTP_PORT);
+    }
+
+    tcp->seq = htonl(compute_tcp_syn_sequence(sequence));
+    tcp->offset = (sizeof(struct TCPSegmentHeader) / 4) << 4;
+    tcp->flags = TCP_FLAG_SYN;
+    tcp->window = htons(TCP_SYN_WINDOW);
+}
+
+/*
+    Construct the TCP header for an IPv4 SYN probe, following the
+    IP header we have already constructed.  The checksum covers a
+    pseudoheader built from the addresses in the IP header.
+*/
+static
+void construct_tcp4_header(
+    const struct net_state_t *net_state,
+    int sequence,
+    char *packet_buffer,
+    int packet_size,
+    const struct probe_param_t *param)
+{
+    const struct IPHeader *ip = (struct IPHeader *) packet_buffer;
+    struct TCPSegmentHeader *tcp;
+    struct UDPPseudoHeader pseudo;
+    char checksum_buffer[sizeof(struct UDPPseudoHeader) +
+                         sizeof(struct TCPSegmentHeader)];
+    int tcp_size;
+
+    tcp = (struct TCPSegmentHeader *) &packet_buffer[sizeof(struct IPHeader)];
+    tcp_size = packet_size - sizeof(struct IPHeader);
+
+    construct_tcp_header(tcp, sequence, param);
+
+    memset(&pseudo, 0, sizeof(struct UDPPseudoHeader));
+    pseudo.saddr = ip->saddr;
+    pseudo.daddr = ip->daddr;
+    pseudo.protocol = IPPROTO_TCP;
+    pseudo.len = htons(tcp_size);
+
+    memcpy(checksum_buffer, &pseudo, sizeof(struct UDPPseudoHeader));
+    memcpy(&checksum_buffer[sizeof(struct UDPPseudoHeader)], tcp,
+           sizeof(struct TCPSegmentHeader));
+
+    tcp->checksum =
+        htons(compute_checksum(checksum_buffer, sizeof(checksum_buffer)));
+}
+
+/*
+    Construct the TCP header for an IPv6 SYN probe.  The kernel adds
+    the IPv6 header, and computes the checksum, as requested with
+    IPV6_CHECKSUM when the socket was opened.
+*/
+static
+int construct_tcp6_packet(
+    const struct net_state_t *net_state,
+    int sequence,
+    char *packet_buffer,
+    int packet_size,
+    const struct probe_param_t *param)
+{
+    construct_tcp_header((struct TCPSegmentHeader *) packet_buffer,
+                         sequence, param);
+
+    return 0;
+}
+
 /*
     Set the socket options for an outgoing stream protocol socket based on
     the packet parameters.
 */
 static
 int set_stream_socket_options(
+    struct net_state_t *net_state,
     int stream_socket,
     const struct probe_param_t *param)
 {
@@ -303,15 +568,17 @@ int set_stream_socket_options(
        FreeBSD wants SO_REUSEPORT in addition to SO_REUSEADDR to
        bind to the same port
      */
-    if (setsockopt(stream_socket, SOL_SOCKET, SO_REUSEPORT,
-                   &reuse, sizeof(int)) == -1) {
+    if (COUNT_SYSCALL(&net_state->stats,
+                      setsockopt(stream_socket, SOL_SOCKET, SO_REUSEPORT,
+                                 &reuse, sizeof(int))) == -1) {
 
         return -1;
     }
 #endif
 
-    if (setsockopt(stream_socket, SOL_SOCKET, SO_REUSEADDR,
-                   &reuse, sizeof(int)) == -1) {
+    if (COUNT_SYSCALL(&net_state->stats,
+                      setsockopt(stream_socket, SOL_SOCKET, SO_REUSEADDR,
+                                 &reuse, sizeof(int))) == -1) {
 
         return -1;
     }
@@ -325,8 +592,9 @@ int set_stream_socket_options(
         opt = IP_TTL;
     }
 
-    if (setsockopt(stream_socket, level, opt, &param->ttl, sizeof(int)) ==
-        -1) {
+    if (COUNT_SYSCALL(&net_state->stats,
+                      setsockopt(stream_socket, level, opt, &param->ttl,
+                                 sizeof(int))) == -1) {
 
         return -1;
     }
@@ -340,15 +608,18 @@ int set_stream_socket_options(
         opt = IP_TOS;
     }
 
-    if (setsockopt(stream_socket, level, opt,
-                   &param->type_of_service, sizeof(int)) == -1) {
+    if (COUNT_SYSCALL(&net_state->stats,
+                      setsockopt(stream_socket, level, opt,
+                                 &param->type_of_service,
+                                 sizeof(int))) == -1) {
 
         return -1;
     }
 #ifdef SO_MARK
     if (param->routing_mark) {
-        if (setsockopt(stream_socket, SOL_SOCKET,
-                       SO_MARK, &param->routing_mark, sizeof(int))) {
+        if (COUNT_SYSCALL(&net_state->stats,
+                          setsockopt(stream_socket, SOL_SOCKET, SO_MARK,
+                                     &param->routing_mark, sizeof(int)))) {
             return -1;
         }
     }
@@ -363,7 +634,7 @@ int set_stream_socket_options(
 */
 static
 int open_stream_socket(
-    const struct net_state_t *net_state,
+    struct net_state_t *net_state,
     int protocol,
     int port,
     const struct sockaddr_storage *src_sockaddr,
@@ -377,10 +648,14 @@ int open_stream_socket(
     struct sockaddr_storage src_port_addr;
 
     if (param->ip_version == 6) {
-        stream_socket = socket(AF_INET6, SOCK_STREAM, protocol);
+        stream_socket = COUNT_SYSCALL(&net_state->stats,
+                                      socket(AF_INET6, SOCK_STREAM,
+                                             protocol));
         addr_len = sizeof(struct sockaddr_in6);
     } else if (param->ip_version == 4) {
-        stream_socket = socket(AF_INET, SOCK_STREAM, protocol);
+        stream_socket = COUNT_SYSCALL(&net_state->stats,
+                                      socket(AF_INET, SOCK_STREAM,
+                                             protocol));
         addr_len = sizeof(struct sockaddr_in);
     } else {
         errno = EINVAL;
@@ -391,10 +666,12 @@ int open_stream_socket(
         return -1;
     }
 
+    /*  set_socket_nonblocking makes two fcntl calls  */
+    net_state->stats.syscalls += 2;
     set_socket_nonblocking(stream_socket);
 
-    if (set_stream_socket_options(stream_socket, param)) {
-        close(stream_socket);
+    if (set_stream_socket_options(net_state, stream_socket, param)) {
+        COUNT_SYSCALL(&net_state->stats, close(stream_socket));
         return -1;
     }
 
@@ -403,8 +680,10 @@ int open_stream_socket(
        causes a TTL expiration.
      */
     construct_addr_port(&src_port_addr, src_sockaddr, port);
-    if (bind(stream_socket, (struct sockaddr *) &src_port_addr, addr_len)) {
-        close(stream_socket);
+    if (COUNT_SYSCALL(&net_state->stats,
+                      bind(stream_socket, (struct sockaddr *) &src_port_addr,
+                           addr_len))) {
+        COUNT_SYSCALL(&net_state->stats, close(stream_socket));
         return -1;
     }
 
@@ -417,12 +696,14 @@ int open_stream_socket(
 
     /*  Attempt a connection  */
     construct_addr_port(&dest_port_addr, dest_sockaddr, dest_port);
-    if (connect
-        (stream_socket, (struct sockaddr *) &dest_port_addr, addr_len)) {
+    if (COUNT_SYSCALL(&net_state->stats,
+                      connect(stream_socket,
+                              (struct sockaddr *) &dest_port_addr,
+                              addr_len))) {
 
         /*  EINPROGRESS simply means the connection is in progress  */
         if (errno != EINPROGRESS) {
-            close(stream_socket);
+            COUNT_SYSCALL(&net_state->stats, close(stream_socket));
             return -1;
         }
     }
@@ -444,8 +725,21 @@ int compute_packet_size(
 {
     int packet_size = 0;
 
+    /*
+       SYN segments carry no payload, so, as with connected TCP probes,
+       the requested packet size doesn't apply.
+     */
     if (param->protocol == IPPROTO_TCP) {
-        return 0;
+        if (!is_tcp_syn_probe(net_state, param)) {
+            return 0;
+        }
+
+        packet_size = sizeof(struct TCPSegmentHeader);
+        if (param->ip_version == 4) {
+            packet_size += sizeof(struct IPHeader);
+        }
+
+        return packet_size;
     }
 #ifdef IPPROTO_SCTP
     if (param->protocol == IPPROTO_SCTP) {
@@ -501,7 +795,7 @@ int compute_packet_size(
 /*  Construct a packet for an IPv4 probe  */
 static
 int construct_ip4_packet(
-    const struct net_state_t *net_state,
+    struct net_state_t *net_state,
     int *packet_socket,
     int sequence,
     char *packet_buffer,
@@ -517,7 +811,8 @@ int construct_ip4_packet(
     struct sockaddr_storage current_sockaddr;
     int current_sockaddr_len;
 
-    if (param->protocol == IPPROTO_TCP) {
+    if (param->protocol == IPPROTO_TCP
+        && !is_tcp_syn_probe(net_state, param)) {
         is_stream_protocol = true;
 #ifdef IPPROTO_SCTP
     } else if (param->protocol == IPPROTO_SCTP) {
@@ -534,6 +829,9 @@ int construct_ip4_packet(
         } else if (param->protocol == IPPROTO_UDP) {
             construct_udp4_header(net_state, sequence, packet_buffer,
                                   packet_size, param);
+        } else if (param->protocol == IPPROTO_TCP) {
+            construct_tcp4_header(net_state, sequence, packet_buffer,
+                                  packet_size, param);
         } else {
             errno = EINVAL;
             return -1;
@@ -565,8 +863,9 @@ int construct_ip4_packet(
      */
 #ifdef SO_MARK
     if (param->routing_mark) {
-        if (setsockopt(send_socket, SOL_SOCKET,
-                       SO_MARK, &param->routing_mark, sizeof(int))) {
+        if (COUNT_SYSCALL(&net_state->stats,
+                          setsockopt(send_socket, SOL_SOCKET, SO_MARK,
+                                     &param->routing_mark, sizeof(int)))) {
             return -1;
         }
     }
@@ -582,8 +881,10 @@ int construct_ip4_packet(
         current_sockaddr_len = sizeof(struct sockaddr_in);
         bind_send_socket = true;
         socket = net_state->platform.ip4_txrx_icmp_socket;
-        if (getsockname(socket, (struct sockaddr *) &current_sockaddr,
-                        &current_sockaddr_len)) {
+        if (COUNT_SYSCALL(&net_state->stats,
+                          getsockname(socket,
+                                      (struct sockaddr *) &current_sockaddr,
+                                      &current_sockaddr_len))) {
             return -1;
         }
         struct sockaddr_in *sin_cur =
@@ -596,8 +897,10 @@ int construct_ip4_packet(
     }
 
     /*  Bind to our local address  */
-    if (bind_send_socket && bind(socket, (struct sockaddr *)src_sockaddr,
-                sizeof(struct sockaddr_in))) {
+    if (bind_send_socket
+        && COUNT_SYSCALL(&net_state->stats,
+                         bind(socket, (struct sockaddr *) src_sockaddr,
+                              sizeof(struct sockaddr_in)))) {
         return -1;
     }
 
@@ -611,12 +914,15 @@ int construct_ip4_packet(
             return 0;
         }
         tos = param->type_of_service;
-        if (setsockopt(socket, SOL_IP, IP_TOS, &tos, sizeof(int))) {
+        if (COUNT_SYSCALL(&net_state->stats,
+                          setsockopt(socket, SOL_IP, IP_TOS, &tos,
+                                     sizeof(int)))) {
             return -1;
         }
         ttl = param->ttl;
-        if (setsockopt(socket, SOL_IP, IP_TTL,
-                       &ttl, sizeof(int)) == -1) {
+        if (COUNT_SYSCALL(&net_state->stats,
+                          setsockopt(socket, SOL_IP, IP_TTL, &ttl,
+                                     sizeof(int))) == -1) {
             return -1;
         }
     }
@@ -627,7 +933,7 @@ int construct_ip4_packet(
 /*  Construct a packet for an IPv6 probe  */
 static
 int construct_ip6_packet(
-    const struct net_state_t *net_state,
+    struct net_state_t *net_state,
     int *packet_socket,
     int sequence,
     char *packet_buffer,
@@ -642,12 +948,20 @@ int construct_ip6_packet(
     struct sockaddr_storage current_sockaddr;
     int current_sockaddr_len;
 
-    if (param->protocol == IPPROTO_TCP) {
+    if (param->protocol == IPPROTO_TCP
+        && !is_tcp_syn_probe(net_state, param)) {
         is_stream_protocol = true;
 #ifdef IPPROTO_SCTP
     } else if (param->protocol == IPPROTO_SCTP) {
         is_stream_protocol = true;
 #endif
+    } else if (param->protocol == IPPROTO_TCP) {
+        send_socket = net_state->platform.tcp6_socket;
+
+        if (construct_tcp6_packet
+            (net_state, sequence, packet_buffer, packet_size, param)) {
+            return -1;
+        }
     } else if (param->protocol == IPPROTO_ICMP) {
         if (net_state->platform.ip6_socket_raw) {
             send_socket = net_state->platform.icmp6_send_socket;
@@ -667,7 +981,8 @@ int construct_ip6_packet(
         }
 
         if (construct_udp6_packet
-            (net_state, sequence, packet_buffer, packet_size, param)) {
+            (net_state, sequence, packet_buffer, packet_size,
+             src_sockaddr, dest_sockaddr, param)) {
             return -1;
         }
     } else {
@@ -696,8 +1011,10 @@ int construct_ip6_packet(
        bound, even if the same address is used.
      */
     current_sockaddr_len = sizeof(struct sockaddr_in6);
-    if (getsockname(send_socket, (struct sockaddr *) &current_sockaddr,
-                    &current_sockaddr_len) == 0) {
+    if (COUNT_SYSCALL(&net_state->stats,
+                      getsockname(send_socket,
+                                  (struct sockaddr *) &current_sockaddr,
+                                  &current_sockaddr_len)) == 0) {
         struct sockaddr_in6 *sin6_cur = (struct sockaddr_in6 *) &current_sockaddr;
 
         if (net_state->platform.ip6_socket_raw) {
@@ -715,28 +1032,32 @@ int construct_ip6_packet(
 
     /*  Bind to our local address  */
     if (bind_send_socket) {
-        if (bind(send_socket, (struct sockaddr *) src_sockaddr,
-                 sizeof(struct sockaddr_in6))) {
+        if (COUNT_SYSCALL(&net_state->stats,
+                          bind(send_socket, (struct sockaddr *) src_sockaddr,
+                               sizeof(struct sockaddr_in6)))) {
             return -1;
         }
     }
 
     /*  The traffic class in IPv6 is analagous to ToS in IPv4  */
-    if (setsockopt(send_socket, IPPROTO_IPV6,
-                   IPV6_TCLASS, &param->type_of_service, sizeof(int))) {
+    if (COUNT_SYSCALL(&net_state->stats,
+                      setsockopt(send_socket, IPPROTO_IPV6, IPV6_TCLASS,
+                                 &param->type_of_service, sizeof(int)))) {
         return -1;
     }
 
     /*  Set the time-to-live  */
-    if (setsockopt(send_socket, IPPROTO_IPV6,
-                   IPV6_UNICAST_HOPS, &param->ttl, sizeof(int))) {
+    if (COUNT_SYSCALL(&net_state->stats,
+                      setsockopt(send_socket, IPPROTO_IPV6,
+                                 IPV6_UNICAST_HOPS, &param->ttl,
+                                 sizeof(int)))) {
         return -1;
     }
 #ifdef SO_MARK
     if (param->routing_mark) {
-        if (setsockopt(send_socket,
-                       SOL_SOCKET, SO_MARK, &param->routing_mark,
-                       sizeof(int))) {
+        if (COUNT_SYSCALL(&net_state->stats,
+                          setsockopt(send_socket, SOL_SOCKET, SO_MARK,
+                                     &param->routing_mark, sizeof(int)))) {
             return -1;
         }
     }
@@ -747,7 +1068,7 @@ int construct_ip6_packet(
 
 /*  Construct a probe packet based on the probe parameters  */
 int construct_packet(
-    const struct net_state_t *net_state,
+    struct net_state_t *net_state,
     int *packet_socket,
     int sequence,
     char *packet_buffer,
@@ -789,3 +1110,39 @@ int construct_packet(
 
     return packet_size;
 }
+
+/*
+    Update a raw IPv4 ICMP or UDP packet, previously built by
+    construct_packet, for a new sequence number and time-to-live.
+    The kernel fills in the IP header checksum of raw packets, so only
+    the ICMP checksum needs updating, which we do incrementally, and
+    the UDP payload which keeps a sequence number checksum correct.
+*/
+void patch_ip4_packet(
+    char *packet_buffer,
+    int old_sequence,
+    int sequence,
+    const struct probe_param_t *param)
+{
+    struct IPHeader *ip;
+    struct ICMPHeader *icmp;
+    struct UDPHeader *udp;
+    uint16_t checksum;
+
+    ip = (struct IPHeader *) packet_buffer;
+    ip->ttl = param->ttl;
+
+    if (param->protocol == IPPROTO_ICMP) {
+        icmp = (struct ICMPHeader *) &packet_buffer[sizeof(struct IPHeader)];
+
+        checksum = update_checksum(ntohs(icmp->checksum),
+                                   old_sequence, sequence);
+        icmp->sequence = htons(sequence);
+        icmp->checksum = htons(checksum);
+    } else if (param->protocol == IPPROTO_UDP) {
+        udp = (struct UDPHeader *) &packet_buffer[sizeof(struct IPHeader)];
+
+        set_udp_ports(udp, sequence, param);
+        set_udp4_checksum_payload(packet_buffer, param);
+    }
+}
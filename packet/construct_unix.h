@@ -22,7 +22,7 @@
 #include "probe.h"
 
 int construct_packet(
-    const struct net_state_t *net_state,
+    struct net_state_t *net_state,
     int *packet_socket,
     int sequence,
     char *packet_buffer,
@@ -31,4 +31,26 @@ int construct_packet(
     const struct sockaddr_storage *src_sockaddr,
     const struct probe_param_t *param);
 
+bool is_tcp_syn_probe(
+    const struct net_state_t *net_state,
+    const struct probe_param_t *param);
+
+uint32_t compute_tcp_syn_sequence(
+    int sequence);
+
+uint16_t compute_checksum(
+    const void *packet,
+    int size);
+
+uint16_t update_checksum(
+    uint16_t checksum,
+    uint16_t old_word,
+    uint16_t new_word);
+
+void patch_ip4_packet(
+    char *packet_buffer,
+    int old_sequence,
+    int sequence,
+    const struct probe_param_t *param);
+
 #endif
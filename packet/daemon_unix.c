@@ -0,0 +1,586 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+#include "daemon_unix.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "agent.h"
+#include "pace.h"
+#include "wait.h"
+
+/*
+    In daemon mode, a single mtr-packet serves many clients connected
+    to a Unix socket, so that the probes of many mtr instances share
+    one set of raw sockets and one probe table, rather than every
+    instance receiving, and filtering, the replies to all the others.
+
+    Each client has a command session of its own, so its tokens and
+    template ids are independent of those used by other clients.
+    Replies are routed by the session recorded with each probe.
+
+    A daemon may instead listen on a TCP address, to serve as an agent
+    for controllers on other hosts.  Each TCP client is first sent a
+    challenge, and must prove it knows the secret in MTR_PACKET_SECRET
+    before any other command is accepted.
+
+    The listening socket and the client sockets are gathered in an
+    epoll set, whose descriptor we hand to wait_for_activity in place
+    of the command stream.  An epoll descriptor is readable while any
+    descriptor in its set is, so each of the wait mechanisms will wake
+    for client activity without knowing about the clients.
+*/
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE1)
+
+#include <sys/epoll.h>
+
+/*  The epoll data value marking the listening socket  */
+#define DAEMON_LISTEN_EVENT MAX_DAEMON_CLIENTS
+
+/*  The state of a running daemon  */
+struct packet_daemon_t {
+    /*  The socket on which we accept new clients  */
+    int listen_socket;
+
+    /*  The epoll set of the listening socket and client sockets  */
+    int event_fd;
+
+    /*  The secret with which TCP clients authenticate, or NULL  */
+    const char *secret;
+
+    /*  Our source of random challenges, when listening on TCP  */
+    int random_fd;
+
+    /*  Connected clients, and those whose probes are still draining  */
+    struct daemon_client_t client[MAX_DAEMON_CLIENTS];
+};
+
+/*
+    Bind a listening socket to a path.  If a socket file is already
+    present, but nothing is listening, it was left by a daemon which
+    exited, and we replace it.
+*/
+static
+int bind_unix_socket(
+    const char *socket_path)
+{
+    struct sockaddr_un addr;
+    int listen_socket;
+    int probe_socket;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Daemon socket path too long\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    listen_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_socket == -1) {
+        perror("Failure to open daemon socket");
+        exit(EXIT_FAILURE);
+    }
+
+    if (bind(listen_socket, (struct sockaddr *) &addr,
+             sizeof(struct sockaddr_un))) {
+        if (errno != EADDRINUSE) {
+            perror("Failure to bind daemon socket");
+            exit(EXIT_FAILURE);
+        }
+
+        probe_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (probe_socket == -1) {
+            perror("Failure to open daemon socket");
+            exit(EXIT_FAILURE);
+        }
+
+        if (connect(probe_socket, (struct sockaddr *) &addr,
+                    sizeof(struct sockaddr_un)) == 0) {
+            fprintf(stderr, "Another mtr-packet is listening on %s\n",
+                    socket_path);
+            exit(EXIT_FAILURE);
+        }
+        close(probe_socket);
+
+        unlink(socket_path);
+        if (bind(listen_socket, (struct sockaddr *) &addr,
+                 sizeof(struct sockaddr_un))) {
+            perror("Failure to bind daemon socket");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return listen_socket;
+}
+
+/*  Bind a listening socket to a TCP address, "tcp:HOST:PORT"  */
+static
+int bind_tcp_socket(
+    const char *address)
+{
+    struct addrinfo hints;
+    struct addrinfo *res;
+    char host[NI_MAXHOST];
+    char port[NI_MAXSERV];
+    int listen_socket;
+    int reuse = 1;
+    int gai_error;
+
+    if (split_agent_address(address, host, sizeof(host),
+                            port, sizeof(port))) {
+        fprintf(stderr, "Daemon address is not tcp:HOST:PORT\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    gai_error = getaddrinfo(host, port, &hints, &res);
+    if (gai_error) {
+        fprintf(stderr, "Failure to resolve daemon address: %s\n",
+                gai_strerror(gai_error));
+        exit(EXIT_FAILURE);
+    }
+
+    listen_socket = socket(res->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_socket == -1) {
+        perror("Failure to open daemon socket");
+        exit(EXIT_FAILURE);
+    }
+
+    /*  A restarted daemon needn't wait out the old one's connections  */
+    if (setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR,
+                   &reuse, sizeof(int))) {
+        perror("Failure to set daemon socket SO_REUSEADDR");
+        exit(EXIT_FAILURE);
+    }
+
+    if (bind(listen_socket, res->ai_addr, res->ai_addrlen)) {
+        perror("Failure to bind daemon socket");
+        exit(EXIT_FAILURE);
+    }
+
+    freeaddrinfo(res);
+    return listen_socket;
+}
+
+/*  Open the socket on which we listen for clients  */
+static
+int open_listen_socket(
+    const char *socket_path)
+{
+    int listen_socket;
+
+    if (is_agent_address(socket_path)) {
+        listen_socket = bind_tcp_socket(socket_path);
+    } else {
+        listen_socket = bind_unix_socket(socket_path);
+    }
+
+    if (listen(listen_socket, SOMAXCONN)) {
+        perror("Failure to listen on daemon socket");
+        exit(EXIT_FAILURE);
+    }
+
+    if (fcntl(listen_socket, F_SETFL, O_NONBLOCK)) {
+        perror("Failure to set daemon socket non-blocking");
+        exit(EXIT_FAILURE);
+    }
+
+    return listen_socket;
+}
+
+/*  Add a descriptor to the daemon's epoll set  */
+static
+void add_daemon_event(
+    struct packet_daemon_t *daemon,
+    int fd,
+    int index)
+{
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.events = EPOLLIN;
+    event.data.u32 = index;
+
+    if (epoll_ctl(daemon->event_fd, EPOLL_CTL_ADD, fd, &event)) {
+        perror("Failure to add daemon client to wait set");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+    Send a new TCP client a random challenge, which it must answer with
+    the digest keyed by our secret before we take other commands.
+*/
+static
+void challenge_daemon_client(
+    struct packet_daemon_t *daemon,
+    struct daemon_client_t *client)
+{
+    struct command_session_t *session = &client->session;
+    unsigned char nonce[AGENT_NONCE_SIZE];
+    int one = 1;
+    int i;
+
+    if (read(daemon->random_fd, nonce, AGENT_NONCE_SIZE)
+        != AGENT_NONCE_SIZE) {
+        perror("Failure to read random challenge");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < AGENT_NONCE_SIZE; i++) {
+        snprintf(&session->auth_nonce[2 * i], 3, "%02x", nonce[i]);
+    }
+    session->auth_secret = daemon->secret;
+    client->challenge_time = time(NULL);
+
+    /*  Replies go out as they are queued, rather than as segments fill  */
+    setsockopt(client->command_buffer.command_stream, IPPROTO_TCP,
+               TCP_NODELAY, &one, sizeof(int));
+
+    queue_reply(&session->output, "0 authenticate-challenge nonce %s\n",
+                session->auth_nonce);
+}
+
+/*
+    Close a client's socket.  Its replies are discarded from here on,
+    but the slot is kept until its outstanding probes have completed,
+    as they refer to its session.
+*/
+static
+void disconnect_daemon_client(
+    struct daemon_client_t *client)
+{
+    if (!client->connected) {
+        return;
+    }
+
+    /*  Closing the socket removes it from the epoll set  */
+    close(client->command_buffer.command_stream);
+    client->connected = false;
+    client->session.output.length = 0;
+    client->command_buffer.incoming_read_position = 0;
+}
+
+/*  Release the slots of disconnected clients with no probes in flight  */
+static
+void reap_daemon_clients(
+    struct packet_daemon_t *daemon)
+{
+    struct daemon_client_t *client;
+    int i;
+
+    for (i = 0; i < MAX_DAEMON_CLIENTS; i++) {
+        client = &daemon->client[i];
+
+        if (client->in_use && !client->connected
+            && client->session.outstanding_probe_count == 0) {
+
+            free_command_session(&client->session);
+            free(client->command_buffer.incoming_buffer);
+            memset(client, 0, sizeof(struct daemon_client_t));
+        }
+    }
+}
+
+/*
+    Disconnect TCP clients which haven't answered their challenge
+    within DAEMON_AUTH_TIMEOUT, and release their slots.
+*/
+static
+void drop_unauthenticated_clients(
+    struct packet_daemon_t *daemon)
+{
+    struct daemon_client_t *client;
+    time_t now = time(NULL);
+    int i;
+
+    for (i = 0; i < MAX_DAEMON_CLIENTS; i++) {
+        client = &daemon->client[i];
+
+        if (client->connected && client->session.auth_secret
+            && now - client->challenge_time >= DAEMON_AUTH_TIMEOUT) {
+
+            disconnect_daemon_client(client);
+        }
+    }
+
+    reap_daemon_clients(daemon);
+}
+
+/*  Accept all pending connections on the listening socket  */
+static
+void accept_daemon_clients(
+    struct packet_daemon_t *daemon)
+{
+    struct daemon_client_t *client;
+    int client_socket;
+    int i;
+
+    /*  Make room for new clients in the slots of idle ones  */
+    if (daemon->secret) {
+        drop_unauthenticated_clients(daemon);
+    }
+
+    while (true) {
+        client_socket = accept(daemon->listen_socket, NULL, NULL);
+        if (client_socket == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            /*
+               EAGAIN means no more connections are pending, and a
+               connection may also have been reset before we accepted
+               it.  In any case, we'll try again with the next wake.
+             */
+            return;
+        }
+
+        for (i = 0; i < MAX_DAEMON_CLIENTS; i++) {
+            if (!daemon->client[i].in_use) {
+                break;
+            }
+        }
+
+        /*  With no free slot, the client sees the connection close  */
+        if (i == MAX_DAEMON_CLIENTS) {
+            close(client_socket);
+            continue;
+        }
+
+        if (fcntl(client_socket, F_SETFD, FD_CLOEXEC)) {
+            perror("Failure to set daemon client close-on-exec");
+            exit(EXIT_FAILURE);
+        }
+
+        client = &daemon->client[i];
+        memset(&client->session, 0, sizeof(struct command_session_t));
+        init_command_buffer(&client->command_buffer, client_socket);
+        client->in_use = true;
+        client->connected = true;
+
+        if (daemon->secret) {
+            challenge_daemon_client(daemon, client);
+        }
+
+        add_daemon_event(daemon, client_socket, i);
+    }
+}
+
+/*
+    Write a client's queued replies.  Unlike flush_output_queue, a
+    failure only disconnects the client, and we won't wait longer than
+    DAEMON_WRITE_TIMEOUT for a client which has stopped reading.
+*/
+static
+void flush_client_output(
+    struct daemon_client_t *client)
+{
+    struct output_queue_t *output = &client->session.output;
+    struct pollfd writable;
+    int fd = client->command_buffer.command_stream;
+    int written = 0;
+    ssize_t write_count;
+
+    while (written < output->length) {
+        write_count = send(fd, &output->buffer[written],
+                           output->length - written, MSG_NOSIGNAL);
+
+        if (write_count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN) {
+                writable.fd = fd;
+                writable.events = POLLOUT;
+                if (poll(&writable, 1, DAEMON_WRITE_TIMEOUT) > 0) {
+                    continue;
+                }
+            }
+
+            disconnect_daemon_client(client);
+            return;
+        }
+
+        written += write_count;
+    }
+
+    output->length = 0;
+}
+
+/*
+    Read commands from each client with pending activity, and accept
+    any new clients.
+*/
+static
+void read_daemon_clients(
+    struct packet_daemon_t *daemon)
+{
+    struct epoll_event events[MAX_DAEMON_CLIENTS + 1];
+    struct daemon_client_t *client;
+    int event_count;
+    int index;
+    int i;
+
+    event_count = epoll_wait(daemon->event_fd, events,
+                             MAX_DAEMON_CLIENTS + 1, 0);
+    if (event_count == -1) {
+        if (errno == EINTR) {
+            return;
+        }
+
+        perror("Unexpected daemon wait error");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < event_count; i++) {
+        index = events[i].data.u32;
+
+        if (index == DAEMON_LISTEN_EVENT) {
+            accept_daemon_clients(daemon);
+            continue;
+        }
+
+        client = &daemon->client[index];
+        if (!client->connected) {
+            continue;
+        }
+
+        if (read_commands(&client->command_buffer) && errno == EPIPE) {
+            disconnect_daemon_client(client);
+        }
+    }
+}
+
+/*
+    Serve clients connected to a Unix socket at the given path, until
+    we are terminated.
+*/
+void run_packet_daemon(
+    struct net_state_t *net_state,
+    const char *socket_path)
+{
+    static struct packet_daemon_t daemon;
+    struct command_buffer_t daemon_events;
+    struct daemon_client_t *client;
+    int i;
+
+    /*  Worker threads reply only to the command stream on stdin  */
+    if (net_state->platform.threads) {
+        fprintf(stderr, "Daemon mode doesn't support MTR_PACKET_THREADS\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /*  Anyone who can reach a TCP socket must prove they may use it  */
+    if (is_agent_address(socket_path)) {
+        daemon.secret = getenv("MTR_PACKET_SECRET");
+        if (daemon.secret == NULL || *daemon.secret == 0) {
+            fprintf(stderr,
+                    "MTR_PACKET_SECRET must be set to listen on TCP\n");
+            exit(EXIT_FAILURE);
+        }
+
+        daemon.random_fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+        if (daemon.random_fd == -1) {
+            perror("Failure to open /dev/urandom");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    daemon.listen_socket = open_listen_socket(socket_path);
+
+    daemon.event_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (daemon.event_fd == -1) {
+        perror("Failure to create daemon wait set");
+        exit(EXIT_FAILURE);
+    }
+    add_daemon_event(&daemon, daemon.listen_socket, DAEMON_LISTEN_EVENT);
+
+    /*  The main loop waits on our epoll set as its command stream  */
+    memset(&daemon_events, 0, sizeof(struct command_buffer_t));
+    daemon_events.command_stream = daemon.event_fd;
+
+    while (true) {
+        for (i = 0; i < MAX_DAEMON_CLIENTS; i++) {
+            if (daemon.client[i].connected) {
+                flush_client_output(&daemon.client[i]);
+            }
+        }
+        if (daemon.secret) {
+            drop_unauthenticated_clients(&daemon);
+        } else {
+            reap_daemon_clients(&daemon);
+        }
+
+        wait_for_activity(&daemon_events, net_state);
+        receive_replies(net_state);
+        read_daemon_clients(&daemon);
+        check_probe_timeouts(net_state);
+        send_paced_probes(net_state);
+
+        /*  Probes sent while dispatching are attributed to the client  */
+        for (i = 0; i < MAX_DAEMON_CLIENTS; i++) {
+            client = &daemon.client[i];
+
+            if (client->connected) {
+                net_state->session = &client->session;
+                dispatch_buffer_commands(&client->command_buffer,
+                                         net_state);
+            }
+
+            /*  A client which failed to authenticate is told, then dropped  */
+            if (client->connected && client->session.auth_failed) {
+                flush_client_output(client);
+                disconnect_daemon_client(client);
+            }
+        }
+        net_state->session = NULL;
+    }
+}
+
+#else
+
+/*  Without epoll, we have no way to wait on many clients at once  */
+void run_packet_daemon(
+    struct net_state_t *net_state,
+    const char *socket_path)
+{
+    fprintf(stderr, "Daemon mode is not supported on this platform\n");
+    exit(EXIT_FAILURE);
+}
+
+#endif
@@ -0,0 +1,65 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DAEMON_UNIX_H
+#define DAEMON_UNIX_H
+
+#include <time.h>
+
+#include "command.h"
+#include "probe.h"
+
+/*  The most clients a daemon serves at once  */
+#define MAX_DAEMON_CLIENTS 64
+
+/*
+    The number of milliseconds we'll wait for a client to accept its
+    replies before giving up on it, so that a client which stops
+    reading can't stall the others.
+*/
+#define DAEMON_WRITE_TIMEOUT 1000
+
+/*
+    The number of seconds a TCP client has to answer its challenge,
+    so that idle connections can't hold every slot.
+*/
+#define DAEMON_AUTH_TIMEOUT 10
+
+/*  A client connected to the daemon's socket  */
+struct daemon_client_t {
+    /*  true while the slot is in use, including while probes drain  */
+    bool in_use;
+
+    /*  false once the client has disconnected  */
+    bool connected;
+
+    /*  When the client was sent its challenge  */
+    time_t challenge_time;
+
+    /*  Storage for commands read from the client  */
+    struct command_buffer_t command_buffer;
+
+    /*  The client's probe templates, protocol mode and replies  */
+    struct command_session_t session;
+};
+
+void run_packet_daemon(
+    struct net_state_t *net_state,
+    const char *socket_path);
+
+#endif
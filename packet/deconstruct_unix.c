@@ -22,6 +22,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "construct_unix.h"
 #include "protocols.h"
 
 #define MAX_MPLS_LABELS 8
@@ -46,6 +47,7 @@ void find_and_receive_probe(
 
     probe = find_probe(net_state, protocol, icmp_id, icmp_sequence);
     if (probe == NULL) {
+        net_state->stats.replies_unmatched++;
         return;
     }
 
@@ -80,10 +82,13 @@ void handle_inner_udp_packet(
         probe = find_probe(net_state, IPPROTO_UDP, 0, udp->checksum);
     }
 
-    if (probe != NULL) {
-        receive_probe(net_state, probe, icmp_result,
-                      remote_addr, timestamp, mpls_count, mpls);
+    if (probe == NULL) {
+        net_state->stats.replies_unmatched++;
+        return;
     }
+
+    receive_probe(net_state, probe, icmp_result,
+                  remote_addr, timestamp, mpls_count, mpls);
 }
 
 void handle_error_queue_packet(
@@ -547,3 +552,126 @@ void handle_received_ip6_packet(
     handle_received_icmp6_packet(net_state, remote_addr, icmp,
                                  packet_length, timestamp);
 }
+
+/*  Returns true if two socket addresses hold the same IP address  */
+static
+bool is_same_address(
+    const struct sockaddr_storage *addr_a,
+    const struct sockaddr_storage *addr_b)
+{
+    const struct sockaddr_in *addr4_a = (struct sockaddr_in *) addr_a;
+    const struct sockaddr_in *addr4_b = (struct sockaddr_in *) addr_b;
+    const struct sockaddr_in6 *addr6_a = (struct sockaddr_in6 *) addr_a;
+    const struct sockaddr_in6 *addr6_b = (struct sockaddr_in6 *) addr_b;
+
+    if (addr_a->ss_family != addr_b->ss_family) {
+        return false;
+    }
+
+    if (addr_a->ss_family == AF_INET6) {
+        return memcmp(&addr6_a->sin6_addr, &addr6_b->sin6_addr,
+                      sizeof(struct in6_addr)) == 0;
+    }
+
+    return addr4_a->sin_addr.s_addr == addr4_b->sin_addr.s_addr;
+}
+
+/*
+    Check a TCP segment received on a raw TCP socket for a reply to
+    one of our SYN probes.  The destination host will reply with either
+    a SYN-ACK or a RST, each of which acknowledges the initial sequence
+    number of the probe.  As we have no socket for the connection, the
+    kernel will reset it in response to a SYN-ACK.
+*/
+static
+void handle_received_tcp_segment(
+    struct net_state_t *net_state,
+    const struct sockaddr_storage *remote_addr,
+    const struct TCPSegmentHeader *tcp,
+    int segment_length,
+    struct timeval *timestamp)
+{
+    struct probe_t *probe;
+
+    if (segment_length < sizeof(struct TCPSegmentHeader)) {
+        return;
+    }
+
+    if (!(tcp->flags & TCP_FLAG_ACK)
+        || !(tcp->flags & (TCP_FLAG_SYN | TCP_FLAG_RST))) {
+        return;
+    }
+
+    probe = find_probe(net_state, IPPROTO_TCP, 0, tcp->dstport);
+    if (probe == NULL) {
+        net_state->stats.replies_unmatched++;
+        return;
+    }
+
+    /*
+       Other connections may be using the same local port, so the
+       segment must come from the probe's destination, and must
+       acknowledge the probe's SYN segment.
+     */
+    if (ntohl(tcp->ack) != compute_tcp_syn_sequence(probe->sequence) + 1) {
+        return;
+    }
+
+    if (!is_same_address(remote_addr, &probe->remote_addr)) {
+        return;
+    }
+
+    receive_probe(net_state, probe, ICMP_ECHOREPLY, remote_addr,
+                  timestamp, 0, NULL);
+}
+
+/*
+    We've received a TCP segment on the raw IPv4 TCP socket, which,
+    as with raw ICMP sockets, includes the IP header.
+*/
+void handle_received_tcp4_packet(
+    struct net_state_t *net_state,
+    const struct sockaddr_storage *remote_addr,
+    const void *packet,
+    int packet_length,
+    struct timeval *timestamp)
+{
+    const struct IPHeader *ip;
+    int header_length;
+
+    if (packet_length < sizeof(struct IPHeader)) {
+        return;
+    }
+
+    ip = (struct IPHeader *) packet;
+    if (ip->protocol != IPPROTO_TCP) {
+        return;
+    }
+
+    header_length = (ip->version & 0x0F) * 4;
+    if (header_length < sizeof(struct IPHeader)
+        || header_length > packet_length) {
+        return;
+    }
+
+    handle_received_tcp_segment(net_state, remote_addr,
+                                (struct TCPSegmentHeader *)
+                                ((char *) packet + header_length),
+                                packet_length - header_length, timestamp);
+}
+
+/*
+    We've received a TCP segment on the raw IPv6 TCP socket.  As with
+    ICMPv6, the IPv6 header isn't included.
+*/
+void handle_received_tcp6_packet(
+    struct net_state_t *net_state,
+    const struct sockaddr_storage *remote_addr,
+    const void *packet,
+    int packet_length,
+    struct timeval *timestamp)
+{
+    handle_received_tcp_segment(net_state, remote_addr,
+                                (struct TCPSegmentHeader *) packet,
+                                packet_length, timestamp);
+}
@@ -43,6 +43,20 @@ void handle_received_ip6_packet(
     int packet_length,
     struct timeval *timestamp);
 
+void handle_received_tcp4_packet(
+    struct net_state_t *net_state,
+    const struct sockaddr_storage *remote_addr,
+    const void *packet,
+    int packet_length,
+    struct timeval *timestamp);
+
+void handle_received_tcp6_packet(
+    struct net_state_t *net_state,
+    const struct sockaddr_storage *remote_addr,
+    const void *packet,
+    int packet_length,
+    struct timeval *timestamp);
+
 void handle_error_queue_packet(
     struct net_state_t *net_state,
     const struct sockaddr_storage *remote_addr,
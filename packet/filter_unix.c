@@ -0,0 +1,457 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "filter_unix.h"
+
+#include "config.h"
+
+#ifdef HAVE_LINUX_FILTER_H
+#include <linux/filter.h>
+#endif
+#ifdef HAVE_LINUX_IF_PACKET_H
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#endif
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "protocols.h"
+
+/*
+    Raw receive sockets are given every ICMP packet arriving at the
+    host, or, for the TCP sockets, every TCP segment.  Without a filter,
+    each of those is copied to us, only to be discarded when it doesn't
+    match an outstanding probe.  With many mtr-packet processes on a
+    busy host, most of that work is rejecting other processes' packets.
+
+    We attach classic BPF programs which accept only what might be a
+    reply to one of our probes:  echo replies carrying our ICMP id and
+    a sequence number in our range, and ICMP errors quoting such a
+    packet, or a packet with a port in our sequence number range.  The
+    programs are a coarse screen, and received packets are still
+    matched against our probes as before.
+
+    Neither our ICMP id nor our sequence number range change while we
+    run, so the filters are attached only once.  When probes are sharded
+    across threads, each thread's sockets accept only its own slice of
+    the sequence number range.
+*/
+#if defined(HAVE_LINUX_FILTER_H) && defined(SO_ATTACH_FILTER)
+
+#ifndef IPPROTO_SCTP
+#define IPPROTO_SCTP 132
+#endif
+
+/*  Accept the whole of a packet  */
+#define FILTER_ACCEPT 0xFFFFFFFF
+
+/*  The number of instructions in each of the ICMP filter programs  */
+#define ICMP4_FILTER_LENGTH 38
+#define ICMP6_FILTER_LENGTH 30
+
+/*  The packet ring filter checks the protocol before the ICMP filters  */
+#define RING_ICMP4_START 10
+#define RING_ICMP6_START (RING_ICMP4_START + ICMP4_FILTER_LENGTH)
+#define RING_FILTER_LENGTH (RING_ICMP6_START + ICMP6_FILTER_LENGTH)
+
+/*  What the ICMP filter programs match as belonging to us  */
+struct filter_match_t {
+    /*  Our ICMP id  */
+    int icmp_id;
+
+    /*  The range of sequence numbers we assign to probes  */
+    int min_sequence;
+    int max_sequence;
+};
+
+/*  Describe the packets belonging to a network state  */
+static
+void init_filter_match(
+    const struct net_state_t *net_state,
+    struct filter_match_t *match)
+{
+    match->icmp_id = getpid() & 0xFFFF;
+    match->min_sequence = net_state->platform.min_sequence;
+    match->max_sequence = net_state->platform.max_sequence;
+}
+
+/*  Attach a filter program to a socket, ignoring failure  */
+static
+void attach_filter(
+    int socket,
+    struct sock_filter *program,
+    int program_length)
+{
+    struct sock_fprog fprog;
+
+    if (!socket) {
+        return;
+    }
+
+    fprog.len = program_length;
+    fprog.filter = program;
+
+    /*
+       The filter is only an optimization, so if it can't be attached,
+       we'll continue to discard unrelated packets ourselves.
+     */
+    setsockopt(socket, SOL_SOCKET, SO_ATTACH_FILTER,
+               &fprog, sizeof(struct sock_fprog));
+}
+
+/*
+    Build the filter for IPv4 ICMP packets, starting with the IP header,
+    as received by the raw IPv4 ICMP socket.  When an ICMP error quotes
+    a UDP packet, the sequence number may be in either port or in the
+    checksum, so we accept the packet if any of the three is in our
+    range.  Echo packets carry it as their ICMP sequence.
+*/
+static
+void build_icmp4_filter(
+    struct sock_filter *filter,
+    const struct filter_match_t *match)
+{
+    const int icmp_id = match->icmp_id;
+    const int min_sequence = match->min_sequence;
+    const int max_sequence = match->max_sequence;
+    struct sock_filter program[ICMP4_FILTER_LENGTH] = {
+        /*  0: X = the length of the IP header  */
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+
+        /*  1: The ICMP type  */
+        BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHOREPLY, 2, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_TIME_EXCEEDED, 5, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_DEST_UNREACH, 4, 32),
+
+        /*  5: An echo reply must carry our ICMP id and sequence  */
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 4),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, icmp_id, 0, 30),
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 6),
+        BPF_STMT(BPF_JMP | BPF_JA, 25),
+
+        /*  9: Save the protocol of the quoted IP header  */
+        BPF_STMT(BPF_LD | BPF_B | BPF_IND, 8 + 9),
+        BPF_STMT(BPF_ST, 0),
+
+        /*  11: X = the length of both IP headers  */
+        BPF_STMT(BPF_LD | BPF_B | BPF_IND, 8),
+        BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0x0F),
+        BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 2),
+        BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+
+        /*  16: The quoted protocol  */
+        BPF_STMT(BPF_LD | BPF_MEM, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ICMP, 3, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 8, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, 5, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_SCTP, 4, 16),
+
+        /*  21: A quoted ICMP packet must carry our ICMP id and sequence  */
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 8 + 4),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, icmp_id, 0, 14),
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 8 + 6),
+        BPF_STMT(BPF_JMP | BPF_JA, 9),
+
+        /*  25: The TCP or SCTP source port  */
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 8),
+        BPF_STMT(BPF_JMP | BPF_JA, 7),
+
+        /*  27: The UDP destination port, source port, and checksum  */
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 8 + 2),
+        BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, min_sequence, 0, 1),
+        BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, max_sequence, 0, 6),
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 8),
+        BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, min_sequence, 0, 1),
+        BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, max_sequence, 0, 3),
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 8 + 6),
+
+        /*  34: A sequence number must be in our range  */
+        BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, min_sequence, 0, 2),
+        BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, max_sequence, 1, 0),
+
+        /*  36: Accept, or 37: reject  */
+        BPF_STMT(BPF_RET | BPF_K, FILTER_ACCEPT),
+        BPF_STMT(BPF_RET | BPF_K, 0)
+    };
+
+    memcpy(filter, program, sizeof(program));
+}
+
+/*
+    Build the filter for ICMPv6 packets, with the ICMPv6 header at
+    an offset into the packet.  The raw ICMPv6 socket receives packets
+    starting with the ICMPv6 header, but a packet ring receives the
+    IPv6 header as well.  As the IPv6 header has a fixed size, the
+    quoted header can be examined at fixed offsets.  This mirrors the
+    IPv4 filter.
+*/
+static
+void build_icmp6_filter(
+    struct sock_filter *filter,
+    const struct filter_match_t *match,
+    int offset)
+{
+    const int icmp_id = match->icmp_id;
+    const int min_sequence = match->min_sequence;
+    const int max_sequence = match->max_sequence;
+    const int inner = offset + 8 + sizeof(struct IP6Header);
+    struct sock_filter program[ICMP6_FILTER_LENGTH] = {
+        /*  0: The ICMPv6 type  */
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, offset),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP6_ECHOREPLY, 2, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP6_TIME_EXCEEDED, 5, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP6_DEST_UNREACH, 4, 25),
+
+        /*  4: An echo reply must carry our ICMP id and sequence  */
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, offset + 4),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, icmp_id, 0, 23),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, offset + 6),
+        BPF_STMT(BPF_JMP | BPF_JA, 18),
+
+        /*  8: The next header of the quoted IPv6 header  */
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, offset + 8 + 6),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ICMPV6, 3, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 8, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, 5, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_SCTP, 4, 16),
+
+        /*  13: A quoted ICMPv6 packet must carry our ICMP id and sequence  */
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, inner + 4),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, icmp_id, 0, 14),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, inner + 6),
+        BPF_STMT(BPF_JMP | BPF_JA, 9),
+
+        /*  17: The TCP or SCTP source port  */
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, inner),
+        BPF_STMT(BPF_JMP | BPF_JA, 7),
+
+        /*  19: The UDP destination port, source port, and checksum  */
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, inner + 2),
+        BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, min_sequence, 0, 1),
+        BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, max_sequence, 0, 6),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, inner),
+        BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, min_sequence, 0, 1),
+        BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, max_sequence, 0, 3),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, inner + 6),
+
+        /*  26: A sequence number must be in our range  */
+        BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, min_sequence, 0, 2),
+        BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, max_sequence, 1, 0),
+
+        /*  28: Accept, or 29: reject  */
+        BPF_STMT(BPF_RET | BPF_K, FILTER_ACCEPT),
+        BPF_STMT(BPF_RET | BPF_K, 0)
+    };
+
+    memcpy(filter, program, sizeof(program));
+}
+
+/*  Filter the raw IPv4 ICMP socket  */
+static
+void attach_icmp4_filter(
+    int socket,
+    const struct filter_match_t *match)
+{
+    struct sock_filter program[ICMP4_FILTER_LENGTH];
+
+    build_icmp4_filter(program, match);
+    attach_filter(socket, program, ICMP4_FILTER_LENGTH);
+}
+
+/*  Filter the raw ICMPv6 socket  */
+static
+void attach_icmp6_filter(
+    int socket,
+    const struct filter_match_t *match)
+{
+    struct sock_filter program[ICMP6_FILTER_LENGTH];
+
+    build_icmp6_filter(program, match, 0);
+    attach_filter(socket, program, ICMP6_FILTER_LENGTH);
+}
+
+/*
+    Filter a raw TCP socket, accepting only segments which acknowledge
+    something, sent to a port in our sequence number range.  For IPv4,
+    the segment follows the IP header, while for IPv6, it doesn't.
+*/
+static
+void attach_tcp_filter(
+    int socket,
+    int ip_version,
+    const struct filter_match_t *match)
+{
+    const int min_sequence = match->min_sequence;
+    const int max_sequence = match->max_sequence;
+    struct sock_filter program[] = {
+        /*  0: X = the length of the IP header, if any  */
+        BPF_STMT(BPF_LDX | BPF_W | BPF_IMM, 0),
+
+        /*  1: The destination port  */
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 2),
+        BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, min_sequence, 0, 4),
+        BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, max_sequence, 3, 0),
+
+        /*  4: The flags  */
+        BPF_STMT(BPF_LD | BPF_B | BPF_IND, 13),
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, TCP_FLAG_ACK, 0, 1),
+
+        /*  6: Accept, or 7: reject  */
+        BPF_STMT(BPF_RET | BPF_K, FILTER_ACCEPT),
+        BPF_STMT(BPF_RET | BPF_K, 0)
+    };
+
+    if (ip_version == 4) {
+        program[0] = (struct sock_filter)
+            BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0);
+    }
+
+    attach_filter(socket, program, sizeof(program) / sizeof(program[0]));
+}
+
+/*
+    Raw IPv6 sockets used only for sending still receive packets of
+    their protocol, which we never read, so we reject everything.
+*/
+static
+void attach_reject_filter(
+    int socket)
+{
+    struct sock_filter program[] = {
+        BPF_STMT(BPF_RET | BPF_K, 0)
+    };
+
+    attach_filter(socket, program, sizeof(program) / sizeof(program[0]));
+}
+
+/*  Attach filters to all of our raw receive sockets  */
+void attach_receive_filters(
+    const struct net_state_t *net_state)
+{
+    struct filter_match_t match;
+
+    init_filter_match(net_state, &match);
+
+    /*
+       When ICMP replies are read from a packet ring, the raw receive
+       sockets are never read, so they needn't queue anything.
+     */
+    if (net_state->platform.ring.socket) {
+        attach_reject_filter(net_state->platform.ip4_recv_socket);
+        attach_reject_filter(net_state->platform.ip6_recv_socket);
+    } else if (net_state->platform.ip4_socket_raw) {
+        attach_icmp4_filter(net_state->platform.ip4_recv_socket, &match);
+    }
+
+    if (net_state->platform.ip6_socket_raw) {
+        if (!net_state->platform.ring.socket) {
+            attach_icmp6_filter(net_state->platform.ip6_recv_socket,
+                                &match);
+        }
+        attach_reject_filter(net_state->platform.icmp6_send_socket);
+        attach_reject_filter(net_state->platform.udp6_send_socket);
+    }
+
+    attach_tcp_filter(net_state->platform.ip4_tcp_recv_socket, 4, &match);
+    attach_tcp_filter(net_state->platform.tcp6_socket, 6, &match);
+}
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+/*
+    Filter an AF_PACKET socket, which receives packets of every
+    protocol, in both directions, starting with the network header.
+    We skip the packets we send, and check that a packet is ICMP
+    before passing it through the same programs used for the raw ICMP
+    sockets.
+*/
+bool attach_ring_filter(
+    const struct net_state_t *net_state,
+    int socket)
+{
+    struct filter_match_t match;
+    struct sock_filter program[RING_FILTER_LENGTH];
+    struct sock_filter prefix[] = {
+        /*  0: Packets we have sent  */
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING, 7, 0),
+
+        /*  2: The ethernet protocol of the packet  */
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PROTOCOL),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, 2),
+
+        /*  4: The IPv4 protocol  */
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ICMP,
+                 RING_ICMP4_START - 6, 3),
+
+        /*  6: The next header of the IPv6 header  */
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IPV6, 0, 2),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 6),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ICMPV6,
+                 RING_ICMP6_START - 9, 0),
+
+        /*  9: Reject  */
+        BPF_STMT(BPF_RET | BPF_K, 0)
+    };
+    struct sock_fprog fprog;
+
+    init_filter_match(net_state, &match);
+    memcpy(program, prefix, sizeof(prefix));
+    build_icmp4_filter(&program[RING_ICMP4_START], &match);
+    build_icmp6_filter(&program[RING_ICMP6_START], &match,
+                       sizeof(struct IP6Header));
+
+    fprog.len = RING_FILTER_LENGTH;
+    fprog.filter = program;
+
+    /*
+       Unlike the raw sockets, the ring would receive every packet on
+       the host without a filter, so we don't use it if this fails.
+     */
+    return setsockopt(socket, SOL_SOCKET, SO_ATTACH_FILTER,
+                      &fprog, sizeof(struct sock_fprog)) == 0;
+}
+#else
+
+bool attach_ring_filter(
+    const struct net_state_t *net_state,
+    int socket)
+{
+    return false;
+}
+#endif
+
+#else
+
+/*  Without socket filters, we discard unrelated packets ourselves  */
+void attach_receive_filters(
+    const struct net_state_t *net_state)
+{
+}
+
+bool attach_ring_filter(
+    const struct net_state_t *net_state,
+    int socket)
+{
+    return false;
+}
+
+#endif
@@ -0,0 +1,33 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef FILTER_UNIX_H
+#define FILTER_UNIX_H
+
+#include <stdbool.h>
+
+#include "probe.h"
+
+void attach_receive_filters(
+    const struct net_state_t *net_state);
+
+bool attach_ring_filter(
+    const struct net_state_t *net_state,
+    int socket);
+
+#endif
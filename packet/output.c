@@ -0,0 +1,146 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "output.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*  Grow the queue, if necessary, to hold a number of additional bytes  */
+static
+void reserve_output_queue(
+    struct output_queue_t *queue,
+    int length)
+{
+    int size;
+    char *buffer;
+
+    size = queue->buffer_size;
+    if (size == 0) {
+        size = OUTPUT_QUEUE_SIZE;
+    }
+
+    while (size - queue->length < length) {
+        size *= 2;
+    }
+
+    if (size == queue->buffer_size) {
+        return;
+    }
+
+    buffer = realloc(queue->buffer, size);
+    if (buffer == NULL) {
+        perror("Failure to allocate output queue");
+        exit(EXIT_FAILURE);
+    }
+
+    queue->buffer = buffer;
+    queue->buffer_size = size;
+}
+
+/*  Format a text reply, in the manner of printf, and queue it  */
+void queue_reply(
+    struct output_queue_t *queue,
+    const char *format,
+    ...)
+{
+    va_list args;
+    int space;
+    int length;
+
+    reserve_output_queue(queue, 1);
+
+    while (true) {
+        space = queue->buffer_size - queue->length;
+
+        va_start(args, format);
+        length = vsnprintf(&queue->buffer[queue->length], space,
+                           format, args);
+        va_end(args);
+
+        if (length < 0) {
+            perror("Failure to format reply");
+            exit(EXIT_FAILURE);
+        }
+
+        if (length < space) {
+            queue->length += length;
+            return;
+        }
+
+        /*  Make room for the reply and its terminator, and try again  */
+        reserve_output_queue(queue, length + 1);
+    }
+}
+
+/*  Queue a binary reply  */
+void queue_reply_bytes(
+    struct output_queue_t *queue,
+    const void *data,
+    int length)
+{
+    reserve_output_queue(queue, length);
+
+    memcpy(&queue->buffer[queue->length], data, length);
+    queue->length += length;
+}
+
+/*
+    Write all queued replies.  A single write will usually suffice,
+    but we continue until everything has been written, waiting for
+    the stream to accept more if it happens to be non-blocking.
+*/
+void flush_output_queue(
+    struct output_queue_t *queue,
+    int fd)
+{
+    struct pollfd writable;
+    int written = 0;
+    int write_count;
+
+    while (written < queue->length) {
+        write_count =
+            write(fd, &queue->buffer[written], queue->length - written);
+
+        if (write_count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN) {
+                writable.fd = fd;
+                writable.events = POLLOUT;
+                poll(&writable, 1, -1);
+                continue;
+            }
+
+            perror("Failure writing replies");
+            exit(EXIT_FAILURE);
+        }
+
+        written += write_count;
+    }
+
+    queue->length = 0;
+}
@@ -0,0 +1,55 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+/*  The initial size of the output queue, which grows as needed  */
+#define OUTPUT_QUEUE_SIZE 8192
+
+/*
+    Replies produced while handling a single cycle of activity, which
+    are written together, with one system call, before waiting for
+    more activity.
+*/
+struct output_queue_t {
+    /*  Storage for the queued replies  */
+    char *buffer;
+
+    /*  The allocated size of buffer  */
+    int buffer_size;
+
+    /*  The number of bytes of replies queued  */
+    int length;
+};
+
+void queue_reply(
+    struct output_queue_t *queue,
+    const char *format,
+    ...) __attribute__ ((format(printf, 2, 3)));
+
+void queue_reply_bytes(
+    struct output_queue_t *queue,
+    const void *data,
+    int length);
+
+void flush_output_queue(
+    struct output_queue_t *queue,
+    int fd);
+
+#endif
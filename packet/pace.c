@@ -0,0 +1,455 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "pace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "timeval.h"
+#include "wire.h"
+
+/*
+    A probe sent with "pace-us" leaves no sooner than that many
+    microseconds after the previous paced probe to the same
+    destination, so that the spacing of probes doesn't depend on when
+    their commands happen to arrive.  "pace-burst" allows that many
+    probes to leave back to back after an idle period, as with a token
+    bucket of that depth refilled at the pace.
+
+    The bucket of each destination is kept as the time at which its
+    next probe would leave with the bucket empty, a form which needs no
+    refilling.  Probes which must wait are held, with copies of their
+    addresses, in a heap ordered by their send time, and the wait for
+    activity wakes for the soonest of them.
+*/
+
+/*  The size of the largest address in a probe request  */
+#define PACE_ADDRESS_BYTES 16
+
+/*  A probe held until its destination's pace allows it to leave  */
+struct paced_probe_t {
+    /*  The parameters of the probe, referencing the storage below  */
+    struct probe_param_t param;
+
+    /*  The session which sent the probe  */
+    struct command_session_t *session;
+
+    /*  When the probe is to be sent  */
+    struct timeval send_time;
+
+    /*  The order in which probes were held, to break ties  */
+    unsigned long serial;
+
+    /*  The index of the probe's destination  */
+    int destination;
+
+    /*  Storage for the address strings  */
+    char remote_address[PROBE_ADDRESS_LENGTH];
+    char local_address[PROBE_ADDRESS_LENGTH];
+
+    /*  Storage for addresses in network byte order  */
+    unsigned char remote_address_bytes[PACE_ADDRESS_BYTES];
+    unsigned char local_address_bytes[PACE_ADDRESS_BYTES];
+};
+
+/*  The pace of the probes sent to one destination  */
+struct pace_destination_t {
+    int ip_version;
+    unsigned char address[PACE_ADDRESS_BYTES];
+
+    /*  When the next probe would leave, were the bucket empty  */
+    struct timeval next_time;
+
+    /*  The number of probes held for the destination  */
+    int held_count;
+};
+
+struct pacer_t {
+    /*  Destinations, which are reused once their buckets are full  */
+    struct pace_destination_t destination[MAX_PACED_DESTINATIONS];
+    int destination_count;
+
+    /*  A binary min-heap of held probes, ordered by send time  */
+    struct paced_probe_t *heap[MAX_PROBES];
+    int heap_count;
+
+    /*  Storage for held probes, and those not in use  */
+    struct paced_probe_t probe[MAX_PROBES];
+    struct paced_probe_t *free_probe[MAX_PROBES];
+    int free_count;
+
+    unsigned long next_serial;
+};
+
+/*  Advance a time by a number of microseconds  */
+static
+void add_usec(
+    struct timeval *time,
+    long usec)
+{
+    time->tv_sec += usec / 1000000;
+    time->tv_usec += usec % 1000000;
+    normalize_timeval(time);
+}
+
+/*  Returns true if probe a should be sent before probe b  */
+static
+bool is_paced_before(
+    const struct paced_probe_t *a,
+    const struct paced_probe_t *b)
+{
+    int order = compare_timeval(a->send_time, b->send_time);
+
+    if (order) {
+        return order < 0;
+    }
+
+    return a->serial < b->serial;
+}
+
+/*  Add a held probe to the heap  */
+static
+void push_paced_probe(
+    struct pacer_t *pacer,
+    struct paced_probe_t *probe)
+{
+    int at = pacer->heap_count++;
+    int parent;
+
+    while (at > 0) {
+        parent = (at - 1) / 2;
+        if (!is_paced_before(probe, pacer->heap[parent])) {
+            break;
+        }
+        pacer->heap[at] = pacer->heap[parent];
+        at = parent;
+    }
+    pacer->heap[at] = probe;
+}
+
+/*  Remove the soonest probe from the heap  */
+static
+struct paced_probe_t *pop_paced_probe(
+    struct pacer_t *pacer)
+{
+    struct paced_probe_t *soonest = pacer->heap[0];
+    struct paced_probe_t *last = pacer->heap[--pacer->heap_count];
+    int at = 0;
+    int child;
+
+    while (true) {
+        child = 2 * at + 1;
+        if (child >= pacer->heap_count) {
+            break;
+        }
+        if (child + 1 < pacer->heap_count
+            && is_paced_before(pacer->heap[child + 1],
+                               pacer->heap[child])) {
+            child++;
+        }
+        if (!is_paced_before(pacer->heap[child], last)) {
+            break;
+        }
+        pacer->heap[at] = pacer->heap[child];
+        at = child;
+    }
+    if (pacer->heap_count > 0) {
+        pacer->heap[at] = last;
+    }
+
+    return soonest;
+}
+
+/*  Allocate the pacer, when the first paced probe is sent  */
+static
+struct pacer_t *get_pacer(
+    struct net_state_t *net_state)
+{
+    struct pacer_t *pacer = net_state->pacer;
+    int i;
+
+    if (pacer) {
+        return pacer;
+    }
+
+    pacer = calloc(1, sizeof(struct pacer_t));
+    if (pacer == NULL) {
+        perror("Failure allocating pacer");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < MAX_PROBES; i++) {
+        pacer->free_probe[i] = &pacer->probe[MAX_PROBES - 1 - i];
+    }
+    pacer->free_count = MAX_PROBES;
+
+    net_state->pacer = pacer;
+    return pacer;
+}
+
+/*  Get the bytes of the destination of a probe, or return -1  */
+static
+int get_pace_address(
+    const struct probe_param_t *param,
+    unsigned char *address)
+{
+    struct sockaddr_storage sockaddr;
+
+    if (decode_probe_address(param->ip_version, param->remote_address,
+                             param->remote_address_bytes, &sockaddr)) {
+        return -1;
+    }
+
+    memset(address, 0, PACE_ADDRESS_BYTES);
+    if (param->ip_version == 6) {
+        memcpy(address, &((struct sockaddr_in6 *) &sockaddr)->sin6_addr,
+               sizeof(struct in6_addr));
+    } else {
+        memcpy(address, &((struct sockaddr_in *) &sockaddr)->sin_addr,
+               sizeof(struct in_addr));
+    }
+
+    return 0;
+}
+
+/*
+    Find the pace of a destination, or start one.  A destination with
+    no held probes, whose next time has passed, has a full bucket, and
+    so can be forgotten to make room for another.  Returns -1 if every
+    destination is busy.
+*/
+static
+int find_pace_destination(
+    struct pacer_t *pacer,
+    int ip_version,
+    const unsigned char *address,
+    struct timeval now)
+{
+    struct pace_destination_t *destination;
+    int reusable = -1;
+    int i;
+
+    for (i = 0; i < pacer->destination_count; i++) {
+        destination = &pacer->destination[i];
+
+        if (destination->ip_version == ip_version
+            && !memcmp(destination->address, address,
+                       PACE_ADDRESS_BYTES)) {
+            return i;
+        }
+
+        if (reusable == -1 && destination->held_count == 0
+            && compare_timeval(destination->next_time, now) <= 0) {
+            reusable = i;
+        }
+    }
+
+    if (reusable == -1) {
+        if (pacer->destination_count == MAX_PACED_DESTINATIONS) {
+            return -1;
+        }
+        reusable = pacer->destination_count++;
+    }
+
+    destination = &pacer->destination[reusable];
+    destination->ip_version = ip_version;
+    memcpy(destination->address, address, PACE_ADDRESS_BYTES);
+    destination->next_time = now;
+    destination->held_count = 0;
+
+    return reusable;
+}
+
+/*  Copy a probe, and the addresses it references, to hold it  */
+static
+void copy_paced_probe(
+    struct paced_probe_t *probe,
+    const struct probe_param_t *param)
+{
+    int address_length = param->ip_version == 6 ? 16 : 4;
+
+    probe->param = *param;
+
+    if (param->remote_address) {
+        strcpy(probe->remote_address, param->remote_address);
+        probe->param.remote_address = probe->remote_address;
+    }
+    if (param->local_address) {
+        strcpy(probe->local_address, param->local_address);
+        probe->param.local_address = probe->local_address;
+    }
+
+    if (param->remote_address_bytes) {
+        memcpy(probe->remote_address_bytes, param->remote_address_bytes,
+               address_length);
+        probe->param.remote_address_bytes = probe->remote_address_bytes;
+    }
+    if (param->local_address_bytes) {
+        memcpy(probe->local_address_bytes, param->local_address_bytes,
+               address_length);
+        probe->param.local_address_bytes = probe->local_address_bytes;
+    }
+}
+
+/*
+    Apply the pace of a probe.  Returns false if the probe may be sent
+    at once, or true if it has been held, to be sent later by
+    send_paced_probes, or refused, with a reply already queued.
+*/
+bool pace_probe(
+    struct net_state_t *net_state,
+    const struct probe_param_t *param)
+{
+    struct pacer_t *pacer;
+    struct pace_destination_t *destination;
+    struct paced_probe_t *probe;
+    unsigned char address[PACE_ADDRESS_BYTES];
+    struct timeval now;
+    struct timeval earliest;
+    int burst = param->pace_burst > 1 ? param->pace_burst : 1;
+    int index;
+
+    if (param->pace_interval <= 0) {
+        return false;
+    }
+
+    /*  An address which can't be decoded is reported when sent  */
+    if (get_pace_address(param, address)) {
+        return false;
+    }
+
+    if (get_probe_time(&now)) {
+        perror("get_probe_time failure");
+        exit(EXIT_FAILURE);
+    }
+
+    pacer = get_pacer(net_state);
+    index = find_pace_destination(pacer, param->ip_version, address, now);
+    if (index == -1) {
+        report_reply(net_state->session, param->command_token,
+                     WIRE_REPLY_PROBES_EXHAUSTED, NULL);
+        return true;
+    }
+    destination = &pacer->destination[index];
+
+    /*  A burst may leave before the next time, by up to its length  */
+    earliest = destination->next_time;
+    add_usec(&earliest, -(long) (burst - 1) * param->pace_interval);
+
+    if (destination->held_count == 0
+        && compare_timeval(earliest, now) <= 0) {
+        if (compare_timeval(destination->next_time, now) < 0) {
+            destination->next_time = now;
+        }
+        add_usec(&destination->next_time, param->pace_interval);
+        return false;
+    }
+
+    if (pacer->free_count == 0) {
+        report_reply(net_state->session, param->command_token,
+                     WIRE_REPLY_PROBES_EXHAUSTED, NULL);
+        return true;
+    }
+
+    probe = pacer->free_probe[--pacer->free_count];
+    copy_paced_probe(probe, param);
+    probe->session = net_state->session;
+    probe->send_time = earliest;
+    probe->serial = pacer->next_serial++;
+    probe->destination = index;
+    push_paced_probe(pacer, probe);
+
+    add_usec(&destination->next_time, param->pace_interval);
+    destination->held_count++;
+
+    /*  A session isn't released while it has probes to be sent  */
+    net_state->session->outstanding_probe_count++;
+
+    return true;
+}
+
+/*  Send the held probes whose time has come  */
+void send_paced_probes(
+    struct net_state_t *net_state)
+{
+    struct pacer_t *pacer = net_state->pacer;
+    struct command_session_t *session = net_state->session;
+    struct paced_probe_t *probe;
+    struct timeval now;
+
+    if (pacer == NULL || pacer->heap_count == 0) {
+        return;
+    }
+
+    if (get_probe_time(&now)) {
+        perror("get_probe_time failure");
+        exit(EXIT_FAILURE);
+    }
+
+    while (pacer->heap_count > 0
+           && compare_timeval(pacer->heap[0]->send_time, now) <= 0) {
+        probe = pop_paced_probe(pacer);
+        pacer->destination[probe->destination].held_count--;
+
+        /*  The probe is sent on behalf of the session which sent it  */
+        net_state->session = probe->session;
+        net_state->session->outstanding_probe_count--;
+        send_probe(net_state, &probe->param);
+
+        pacer->free_probe[pacer->free_count++] = probe;
+    }
+
+    net_state->session = session;
+}
+
+/*
+    Get the time at which the next held probe is to be sent.  Returns
+    false if no probes are held.
+*/
+bool get_next_paced_time(
+    const struct net_state_t *net_state,
+    struct timeval *send_time)
+{
+    const struct pacer_t *pacer = net_state->pacer;
+
+    if (pacer == NULL || pacer->heap_count == 0) {
+        return false;
+    }
+
+    *send_time = pacer->heap[0]->send_time;
+    return true;
+}
+
+/*  Returns true if any probes are held, waiting to be sent  */
+bool has_paced_probes(
+    const struct net_state_t *net_state)
+{
+    return net_state->pacer && net_state->pacer->heap_count > 0;
+}
+
+/*  Release the pacer, once no probes are held  */
+void free_pacer(
+    struct net_state_t *net_state)
+{
+    free(net_state->pacer);
+    net_state->pacer = NULL;
+}
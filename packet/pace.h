@@ -0,0 +1,50 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef PACE_H
+#define PACE_H
+
+#include <stdbool.h>
+#include <sys/time.h>
+
+#include "probe.h"
+
+/*  The number of destinations whose pacing is tracked at once  */
+#define MAX_PACED_DESTINATIONS 256
+
+/*  The longest interval between paced probes, in microseconds  */
+#define MAX_PACE_INTERVAL 10000000
+
+bool pace_probe(
+    struct net_state_t *net_state,
+    const struct probe_param_t *param);
+
+void send_paced_probes(
+    struct net_state_t *net_state);
+
+bool get_next_paced_time(
+    const struct net_state_t *net_state,
+    struct timeval *send_time);
+
+bool has_paced_probes(
+    const struct net_state_t *net_state);
+
+void free_pacer(
+    struct net_state_t *net_state);
+
+#endif
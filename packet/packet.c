@@ -28,8 +28,13 @@
 #include <sys/capability.h>
 #endif
 
+#include "pace.h"
 #include "wait.h"
 
+#ifndef PLATFORM_CYGWIN
+#include "daemon_unix.h"
+#endif
+
 /*  Drop SUID privileges.  To be used after accquiring raw sockets.  */
 static
 int drop_elevated_permissions(
@@ -74,7 +79,21 @@ int main(
 {
     bool command_pipe_open;
     struct command_buffer_t command_buffer;
+    struct command_session_t session;
     struct net_state_t net_state;
+    const char *listen_path = NULL;
+
+    /*
+       "--listen PATH" serves many clients on a Unix socket at PATH,
+       and "--listen tcp:HOST:PORT" serves remote clients over TCP.
+     */
+    if (argc == 3 && !strcmp(argv[1], "--listen")) {
+        listen_path = argv[2];
+    } else if (argc != 1) {
+        fprintf(stderr, "usage: %s [--listen PATH | --listen tcp:HOST:PORT]\n",
+                argv[0]);
+        exit(EXIT_FAILURE);
+    }
 
     /*
        To minimize security risk, the only thing done prior to 
@@ -88,6 +107,19 @@ int main(
     }
     init_net_state(&net_state);
 
+    /*  The daemon serves its clients until we are terminated  */
+    if (listen_path) {
+#ifdef PLATFORM_CYGWIN
+        fprintf(stderr, "Daemon mode is not supported on this platform\n");
+        exit(EXIT_FAILURE);
+#else
+        run_packet_daemon(&net_state, listen_path);
+#endif
+    }
+
+    memset(&session, 0, sizeof(struct command_session_t));
+    net_state.session = &session;
+
     init_command_buffer(&command_buffer, fileno(stdin));
 
     command_pipe_open = true;
@@ -98,7 +130,7 @@ int main(
      */
     while (true) {
         /*  Ensure any responses are written before waiting  */
-        fflush(stdout);
+        flush_replies(&net_state, &session.output);
         wait_for_activity(&command_buffer, &net_state);
 
         /*
@@ -116,6 +148,7 @@ int main(
         }
 
         check_probe_timeouts(&net_state);
+        send_paced_probes(&net_state);
 
         /*
            Dispatch commands late so that the window between probe
@@ -125,14 +158,20 @@ int main(
 
         /*
            If the command pipe has been closed, exit after all
-           in-flight probes have reported their status.
+           in-flight probes, and those held to their pace, have
+           reported their status.
          */
         if (!command_pipe_open) {
-            if (net_state.outstanding_probe_count == 0) {
+            if (net_state.outstanding_probe_count == 0
+                && !has_paced_probes(&net_state)) {
                 break;
             }
         }
     }
 
+    flush_replies(&net_state, &session.output);
+    close_net_state(&net_state);
+    free_pacer(&net_state);
+
     return 0;
 }
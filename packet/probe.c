@@ -31,6 +31,8 @@
 #include "platform.h"
 #include "protocols.h"
 #include "timeval.h"
+#include "trace.h"
+#include "wire.h"
 
 #define IP_TEXT_LENGTH 64
 
@@ -82,6 +84,173 @@ int decode_address_string(
     return 0;
 }
 
+/*
+    Convert an address in network byte order, as carried by the binary
+    protocol, to sockaddr
+*/
+static
+int decode_address_bytes(
+    int ip_version,
+    const void *address_bytes,
+    struct sockaddr_storage *address)
+{
+    struct sockaddr_in *sockaddr4;
+    struct sockaddr_in6 *sockaddr6;
+
+    memset(address, 0, sizeof(struct sockaddr_storage));
+
+    if (ip_version == 6) {
+        sockaddr6 = (struct sockaddr_in6 *) address;
+        sockaddr6->sin6_family = AF_INET6;
+        memcpy(&sockaddr6->sin6_addr, address_bytes,
+               sizeof(struct in6_addr));
+    } else if (ip_version == 4) {
+        sockaddr4 = (struct sockaddr_in *) address;
+        sockaddr4->sin_family = AF_INET;
+        memcpy(&sockaddr4->sin_addr, address_bytes,
+               sizeof(struct in_addr));
+    } else {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*  Convert the text or binary form of a probe address to sockaddr  */
+int decode_probe_address(
+    int ip_version,
+    const char *address_string,
+    const void *address_bytes,
+    struct sockaddr_storage *address)
+{
+    if (address_bytes) {
+        return decode_address_bytes(ip_version, address_bytes, address);
+    }
+
+    return decode_address_string(ip_version, address_string, address);
+}
+
+/*
+    Get a pointer to the raw bytes of an IP address, and their count,
+    since we hash and compare the addresses of either IP version.
+*/
+static
+const unsigned char *get_address_bytes(
+    const struct sockaddr_storage *addr,
+    int *length)
+{
+    if (addr->ss_family == AF_INET6) {
+        *length = sizeof(struct in6_addr);
+        return (const unsigned char *)
+            &((const struct sockaddr_in6 *) addr)->sin6_addr;
+    } else {
+        *length = sizeof(struct in_addr);
+        return (const unsigned char *)
+            &((const struct sockaddr_in *) addr)->sin_addr;
+    }
+}
+
+/*  Find the source cache entry which would hold a destination address  */
+static
+struct source_cache_entry_t *get_source_cache_entry(
+    struct net_state_t *net_state,
+    const struct sockaddr_storage *dest_addr)
+{
+    const unsigned char *bytes;
+    unsigned int hash = 0;
+    int length;
+    int i;
+
+    bytes = get_address_bytes(dest_addr, &length);
+    for (i = 0; i < length; i++) {
+        hash = hash * 31 + bytes[i];
+    }
+
+    return &net_state->source_cache[hash % SOURCE_CACHE_SIZE];
+}
+
+/*  Returns true if two socket addresses hold the same IP address  */
+static
+bool is_same_address(
+    const struct sockaddr_storage *a,
+    const struct sockaddr_storage *b)
+{
+    const unsigned char *a_bytes;
+    const unsigned char *b_bytes;
+    int a_length;
+    int b_length;
+
+    if (a->ss_family != b->ss_family) {
+        return false;
+    }
+
+    if (a->ss_family == AF_INET6
+        && ((const struct sockaddr_in6 *) a)->sin6_scope_id
+        != ((const struct sockaddr_in6 *) b)->sin6_scope_id) {
+        return false;
+    }
+
+    a_bytes = get_address_bytes(a, &a_length);
+    b_bytes = get_address_bytes(b, &b_length);
+
+    return !memcmp(a_bytes, b_bytes, a_length);
+}
+
+/*
+    Find the source address for a destination, using the source cache
+    when we've recently found the source for the same destination.
+*/
+static
+int find_cached_source_addr(
+    struct net_state_t *net_state,
+    struct sockaddr_storage *src_addr,
+    const struct sockaddr_storage *dest_addr)
+{
+    struct source_cache_entry_t *entry;
+    struct timeval now;
+
+    if (get_probe_time(&now)) {
+        return find_source_addr(src_addr, dest_addr);
+    }
+
+    entry = get_source_cache_entry(net_state, dest_addr);
+    if (entry->valid && is_same_address(&entry->dest_addr, dest_addr)
+        && compare_timeval(now, entry->expire_time) < 0) {
+
+        *src_addr = entry->src_addr;
+        return 0;
+    }
+
+    if (find_source_addr(src_addr, dest_addr)) {
+        return -1;
+    }
+
+    entry->valid = true;
+    entry->dest_addr = *dest_addr;
+    entry->src_addr = *src_addr;
+    entry->expire_time = now;
+    entry->expire_time.tv_sec += SOURCE_CACHE_TIMEOUT;
+
+    return 0;
+}
+
+/*
+    Forget all cached source addresses, as we should when the routing
+    table or the local addresses change.
+*/
+void invalidate_source_cache(
+    struct net_state_t *net_state)
+{
+    int i;
+
+    for (i = 0; i < SOURCE_CACHE_SIZE; i++) {
+        net_state->source_cache[i].valid = false;
+    }
+
+    net_state->source_cache_generation++;
+}
+
 /*
     Resolve the probe parameters into a remote and local address
     for the probe.
@@ -92,18 +261,21 @@ int resolve_probe_addresses(
     struct sockaddr_storage *dest_sockaddr,
     struct sockaddr_storage *src_sockaddr)
 {
-    if (decode_address_string
-        (param->ip_version, param->remote_address, dest_sockaddr)) {
+    if (decode_probe_address
+        (param->ip_version, param->remote_address,
+         param->remote_address_bytes, dest_sockaddr)) {
         return -1;
     }
 
-    if (param->local_address) {
-        if (decode_address_string
-            (param->ip_version, param->local_address, src_sockaddr)) {
+    if (param->local_address || param->local_address_bytes) {
+        if (decode_probe_address
+            (param->ip_version, param->local_address,
+             param->local_address_bytes, src_sockaddr)) {
             return -1;
         }
     } else {
-        if (find_source_addr(src_sockaddr, dest_sockaddr)) {
+        if (find_cached_source_addr(net_state, src_sockaddr,
+                                    dest_sockaddr)) {
             return -1;
         }
     }
@@ -127,6 +299,140 @@ int resolve_probe_addresses(
     return 0;
 }
 
+/*  Find the bucket of the probe table for a particular sequence number  */
+static
+struct probe_table_head_t *get_probe_table_bucket(
+    struct net_state_t *net_state,
+    int sequence)
+{
+    return &net_state->probe_table[sequence % PROBE_TABLE_SIZE];
+}
+
+/*
+    Allocate the pool of probe structures, and put all of them on the
+    free list.  The pool is a single contiguous array, so that probes
+    in flight at the same time share as few cache lines as possible.
+*/
+void init_probe_pool(
+    struct net_state_t *net_state)
+{
+    int i;
+
+    net_state->probe_pool = malloc(MAX_PROBES * sizeof(struct probe_t));
+    if (net_state->probe_pool == NULL) {
+        perror("Failure allocating probe pool");
+        exit(EXIT_FAILURE);
+    }
+
+    LIST_INIT(&net_state->free_probes);
+
+    /*  Insert in reverse, so that the lowest addressed probe is used first  */
+    for (i = MAX_PROBES - 1; i >= 0; i--) {
+        LIST_INSERT_HEAD(&net_state->free_probes,
+                         &net_state->probe_pool[i], probe_list_entry);
+    }
+}
+
+/*  Copy an address string from a probe command into template storage  */
+static
+int copy_template_address(
+    char *storage,
+    const char *address,
+    const char **param_address)
+{
+    if (address == NULL) {
+        *param_address = NULL;
+        return 0;
+    }
+
+    if (strlen(address) >= PROBE_ADDRESS_LENGTH) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    strcpy(storage, address);
+    *param_address = storage;
+
+    return 0;
+}
+
+/*
+    Define a probe template with the given id, replacing any template
+    previously defined with that id.  The parameters are copied, so
+    they needn't outlive the command which defined them.
+*/
+int define_probe_template(
+    struct net_state_t *net_state,
+    int template_id,
+    const struct probe_param_t *param)
+{
+    struct probe_template_t *probe_template;
+    struct probe_template_t **templates;
+
+    if (template_id < 0 || template_id >= MAX_PROBE_TEMPLATES) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    probe_template = calloc(1, sizeof(struct probe_template_t));
+    if (probe_template == NULL) {
+        return -1;
+    }
+
+    probe_template->param = *param;
+    if (copy_template_address(probe_template->remote_address,
+                              param->remote_address,
+                              &probe_template->param.remote_address)
+        || copy_template_address(probe_template->local_address,
+                                 param->local_address,
+                                 &probe_template->param.local_address)) {
+        free(probe_template);
+        return -1;
+    }
+
+    templates = net_state->session->probe_templates;
+    if (templates[template_id]) {
+        platform_free_probe_template(templates[template_id]);
+        free(templates[template_id]);
+    }
+    templates[template_id] = probe_template;
+
+    return 0;
+}
+
+/*  Find a defined probe template by id, or return NULL  */
+struct probe_template_t *find_probe_template(
+    struct net_state_t *net_state,
+    int template_id)
+{
+    if (template_id < 0 || template_id >= MAX_PROBE_TEMPLATES) {
+        return NULL;
+    }
+
+    return net_state->session->probe_templates[template_id];
+}
+
+/*
+    Release the probe templates and queued replies of a session which
+    is no longer in use.  Its outstanding probes must already have
+    completed.
+*/
+void free_command_session(
+    struct command_session_t *session)
+{
+    int i;
+
+    for (i = 0; i < MAX_PROBE_TEMPLATES; i++) {
+        if (session->probe_templates[i]) {
+            platform_free_probe_template(session->probe_templates[i]);
+            free(session->probe_templates[i]);
+        }
+    }
+
+    free(session->output.buffer);
+    memset(session, 0, sizeof(struct command_session_t));
+}
+
 /*  Allocate a structure for tracking a new probe  */
 struct probe_t *alloc_probe(
     struct net_state_t *net_state,
@@ -134,23 +440,32 @@ struct probe_t *alloc_probe(
 {
     struct probe_t *probe;
 
-    if (net_state->outstanding_probe_count >= MAX_PROBES) {
-        return NULL;
-    }
-
-    probe = malloc(sizeof(struct probe_t));
+    probe = LIST_FIRST(&net_state->free_probes);
     if (probe == NULL) {
+        net_state->stats.probes_exhausted++;
         return NULL;
     }
+    LIST_REMOVE(probe, probe_list_entry);
 
     memset(probe, 0, sizeof(struct probe_t));
     probe->token = token;
+    probe->session = net_state->session;
 
     platform_alloc_probe(net_state, probe);
 
     net_state->outstanding_probe_count++;
+    probe->session->outstanding_probe_count++;
+    if (net_state->outstanding_probe_count >
+        net_state->stats.peak_outstanding) {
+        net_state->stats.peak_outstanding =
+            net_state->outstanding_probe_count;
+    }
     LIST_INSERT_HEAD(&net_state->outstanding_probes, probe,
                      probe_list_entry);
+    LIST_INSERT_HEAD(get_probe_table_bucket(net_state, probe->sequence),
+                     probe, probe_table_entry);
+
+    TRACE_PROBE2(mtr_packet, alloc_probe, token, probe->sequence);
 
     return probe;
 }
@@ -161,11 +476,37 @@ void free_probe(
     struct probe_t *probe)
 {
     LIST_REMOVE(probe, probe_list_entry);
+    LIST_REMOVE(probe, probe_table_entry);
     net_state->outstanding_probe_count--;
+    probe->session->outstanding_probe_count--;
 
-    platform_free_probe(probe);
+    platform_free_probe(net_state, probe);
 
-    free(probe);
+    /*
+       Freed probes go to the head of the free list, so the most
+       recently used, and likely cached, probe is the next one allocated.
+     */
+    LIST_INSERT_HEAD(&net_state->free_probes, probe, probe_list_entry);
+}
+
+/*
+    Find an outstanding probe by its sequence number, in host byte order.
+    Returns NULL if none is found.
+*/
+struct probe_t *find_probe_by_sequence(
+    struct net_state_t *net_state,
+    int sequence)
+{
+    struct probe_t *probe;
+
+    LIST_FOREACH(probe, get_probe_table_bucket(net_state, sequence),
+                 probe_table_entry) {
+        if (probe->sequence == sequence) {
+            return probe;
+        }
+    }
+
+    return NULL;
 }
 
 /*
@@ -178,8 +519,6 @@ struct probe_t *find_probe(
     int id,
     int sequence)
 {
-    struct probe_t *probe;
-
     /*
        ICMP has room for an id to check against our process, but
        UDP doesn't.
@@ -194,13 +533,11 @@ struct probe_t *find_probe(
         }
     }
 
-    LIST_FOREACH(probe, &net_state->outstanding_probes, probe_list_entry) {
-        if (htons(probe->sequence) == sequence) {
-            return probe;
-        }
-    }
-
-    return NULL;
+    /*
+       The sequence number arrives in network byte order, but the
+       table is indexed by host byte order.
+     */
+    return find_probe_by_sequence(net_state, ntohs(sequence));
 }
 
 /*
@@ -240,6 +577,93 @@ void format_mpls_string(
     }
 }
 
+/*  Queue a reply record for a session's command stream  */
+static
+void queue_wire_reply(
+    struct command_session_t *session,
+    const struct wire_reply_t *reply)
+{
+    uint8_t record[WIRE_REPLY_SIZE];
+
+    encode_wire_reply(reply, record);
+    queue_reply_bytes(&session->output, record, WIRE_REPLY_SIZE);
+}
+
+/*
+    Report a reply which carries no probe result, such as an error.
+    In the text protocol, the detail string, when present, is appended
+    to the reply as further arguments.  The binary protocol has no room
+    for such detail, and only the reply type is reported.
+*/
+void report_reply(
+    struct command_session_t *session,
+    int token,
+    int reply_type,
+    const char *detail)
+{
+    struct wire_reply_t reply;
+
+    if (session->binary_protocol) {
+        memset(&reply, 0, sizeof(struct wire_reply_t));
+        reply.token = token;
+        reply.reply_type = reply_type;
+
+        queue_wire_reply(session, &reply);
+    } else if (detail) {
+        queue_reply(&session->output, "%d %s %s\n", token,
+                    wire_reply_name(reply_type), detail);
+    } else {
+        queue_reply(&session->output, "%d %s\n", token,
+                    wire_reply_name(reply_type));
+    }
+}
+
+/*
+    Respond to a probe with a reply record, which carries the address
+    and MPLS labels in binary form, avoiding any text formatting.
+*/
+static
+void respond_to_probe_binary(
+    struct probe_t *probe,
+    int reply_type,
+    const struct sockaddr_storage *remote_addr,
+    unsigned int round_trip_us,
+    int mpls_count,
+    const struct mpls_label_t *mpls)
+{
+    struct wire_reply_t reply;
+    struct sockaddr_in *sockaddr4;
+    struct sockaddr_in6 *sockaddr6;
+    int i;
+
+    memset(&reply, 0, sizeof(struct wire_reply_t));
+    reply.token = probe->token;
+    reply.reply_type = reply_type;
+    reply.round_trip_us = round_trip_us;
+
+    if (remote_addr->ss_family == AF_INET6) {
+        sockaddr6 = (struct sockaddr_in6 *) remote_addr;
+        reply.ip_version = 6;
+        memcpy(reply.address, &sockaddr6->sin6_addr,
+               sizeof(struct in6_addr));
+    } else {
+        sockaddr4 = (struct sockaddr_in *) remote_addr;
+        reply.ip_version = 4;
+        memcpy(reply.address, &sockaddr4->sin_addr,
+               sizeof(struct in_addr));
+    }
+
+    for (i = 0; i < mpls_count && i < WIRE_MAX_MPLS_LABELS; i++) {
+        reply.mpls[i].label = mpls[i].label;
+        reply.mpls[i].experimental_use = mpls[i].experimental_use;
+        reply.mpls[i].bottom_of_stack = mpls[i].bottom_of_stack;
+        reply.mpls[i].ttl = mpls[i].ttl;
+    }
+    reply.mpls_count = i;
+
+    queue_wire_reply(probe->session, &reply);
+}
+
 /*
     After a probe reply has arrived, respond to the command request which
     sent the probe.
@@ -254,22 +678,31 @@ void respond_to_probe(
     const struct mpls_label_t *mpls)
 {
     char ip_text[IP_TEXT_LENGTH];
-    char response[COMMAND_BUFFER_SIZE];
     char mpls_str[COMMAND_BUFFER_SIZE];
-    int remaining_size;
-    const char *result;
+    int reply_type;
     const char *ip_argument;
     struct sockaddr_in *sockaddr4;
     struct sockaddr_in6 *sockaddr6;
     void *addr;
 
+    net_state->stats.replies_matched++;
+    TRACE_PROBE3(mtr_packet, respond_to_probe, probe->token,
+                 probe->sequence, round_trip_us);
+
     if (icmp_type == ICMP_TIME_EXCEEDED) {
-        result = "ttl-expired";
+        reply_type = WIRE_REPLY_TTL_EXPIRED;
     } else if (icmp_type == ICMP_DEST_UNREACH) {
-        result = "no-route";
+        reply_type = WIRE_REPLY_NO_ROUTE;
     } else {
         assert(icmp_type == ICMP_ECHOREPLY);
-        result = "reply";
+        reply_type = WIRE_REPLY_REPLY;
+    }
+
+    if (probe->session->binary_protocol) {
+        respond_to_probe_binary(probe, reply_type, remote_addr,
+                                round_trip_us, mpls_count, mpls);
+        free_probe(net_state, probe);
+        return;
     }
 
     if (remote_addr->ss_family == AF_INET6) {
@@ -289,22 +722,18 @@ void respond_to_probe(
         exit(EXIT_FAILURE);
     }
 
-    snprintf(response, COMMAND_BUFFER_SIZE,
-             "%d %s %s %s round-trip-time %d",
-             probe->token, result, ip_argument, ip_text, round_trip_us);
+    queue_reply(&probe->session->output, "%d %s %s %s round-trip-time %d",
+                probe->token, wire_reply_name(reply_type), ip_argument,
+                ip_text, round_trip_us);
 
     if (mpls_count) {
         format_mpls_string(mpls_str, COMMAND_BUFFER_SIZE, mpls_count,
                            mpls);
 
-        remaining_size = COMMAND_BUFFER_SIZE - strlen(response) - 1;
-        strncat(response, " mpls ", remaining_size);
-
-        remaining_size = COMMAND_BUFFER_SIZE - strlen(response) - 1;
-        strncat(response, mpls_str, remaining_size);
+        queue_reply(&probe->session->output, " mpls %s", mpls_str);
     }
 
-    puts(response);
+    queue_reply(&probe->session->output, "\n");
     free_probe(net_state, probe);
 }
 
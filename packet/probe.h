@@ -21,12 +21,17 @@
 
 #include "platform.h"
 
+#include <limits.h>
 #include <netinet/in.h>
 #include <stdbool.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 
 #include "portability/queue.h"
+#include "stats.h"
+
+#include "agent.h"
+#include "output.h"
 
 #ifdef PLATFORM_CYGWIN
 #include "probe_cygwin.h"
@@ -34,7 +39,45 @@
 #include "probe_unix.h"
 #endif
 
+/*
+    ICMP.DLL tracks its own requests, so on Windows the only bound on
+    probes in flight is the size of our pool, and not the range of
+    sequence numbers we can encode.
+*/
+#ifdef PLATFORM_CYGWIN
+#define MAX_PROBES 4096
+#else
 #define MAX_PROBES 1024
+#endif
+
+/*
+    The number of buckets in the table of outstanding probes, which is
+    indexed by sequence number.  Sequence numbers are assigned
+    consecutively, so with as many buckets as there are probes, a
+    lookup nearly always requires a single comparison.
+*/
+#define PROBE_TABLE_SIZE MAX_PROBES
+
+/*  The maximum number of probes in a single send-probe-batch command  */
+#define MAX_BATCH_PROBES 256
+
+/*  The number of destinations for which we remember the source address  */
+#define SOURCE_CACHE_SIZE 64
+
+/*  The number of seconds for which a remembered source address is used  */
+#define SOURCE_CACHE_TIMEOUT 5
+
+/*
+    The longest a probe may wait for a reply, in milliseconds, such
+    that the wait in microseconds still fits an int
+*/
+#define MAX_PROBE_TIMEOUT_MS (INT_MAX / 1000)
+
+/*  The number of probe templates which may be defined at once  */
+#define MAX_PROBE_TEMPLATES 64
+
+/*  Room for the text of an IPv4 or IPv6 address in a probe template  */
+#define PROBE_ADDRESS_LENGTH 64
 
 /*  Use the "jumbo" frame size as the max packet size  */
 #define PACKET_BUFFER_SIZE 9000
@@ -53,6 +96,13 @@ struct probe_param_t {
     /*  The local address from which to send probes  */
     const char *local_address;
 
+    /*
+       Addresses in network byte order, used in place of remote_address
+       and local_address when non-NULL, for the binary protocol.
+     */
+    const void *remote_address_bytes;
+    const void *local_address_bytes;
+
     /*  Protocol for the probe, using the IPPROTO_* defines  */
     int protocol;
 
@@ -77,19 +127,83 @@ struct probe_param_t {
     /*  The value with which to fill the bytes of the packet.  */
     int bit_pattern;
 
-    /*  The number of seconds to wait before assuming the probe was lost  */
-    int timeout;
+    /*  The milliseconds to wait before assuming the probe was lost  */
+    int timeout_ms;
+
+    /*  true to time the probe with kernel transmit timestamps  */
+    bool kernel_timestamp;
+
+    /*  true to send a TCP probe as a raw SYN segment, where possible  */
+    bool tcp_syn;
 
     /*  true is the probe is to test byte order */
     bool is_probing_byte_order;
+
+    /*
+       The microseconds by which probes to the destination are spaced,
+       or zero to send at once, and the number which may leave together
+     */
+    int pace_interval;
+    int pace_burst;
+};
+
+/*
+    A probe definition, from define-probe-template, shared by many
+    probes which differ only in their command token and time-to-live.
+*/
+struct probe_template_t {
+    /*  The parameters used for each probe sent with the template  */
+    struct probe_param_t param;
+
+    /*  Storage for the address strings referenced by param  */
+    char remote_address[PROBE_ADDRESS_LENGTH];
+    char local_address[PROBE_ADDRESS_LENGTH];
+
+    /*  Platform specific state, such as a prebuilt packet  */
+    struct probe_template_platform_t platform;
+};
+
+/*
+    The state belonging to one command stream: its probe templates,
+    its protocol mode and the replies waiting to be written to it.
+    Usually there is a single stream, on stdin and stdout, but in
+    daemon mode each connected client has a session of its own, so
+    that tokens and template ids used by one client don't collide
+    with those of another.
+*/
+struct command_session_t {
+    /*  Probe templates, indexed by template id, or NULL when undefined  */
+    struct probe_template_t *probe_templates[MAX_PROBE_TEMPLATES];
+
+    /*  true after "enter-binary-mode", when we exchange binary records  */
+    bool binary_protocol;
+
+    /*  Replies waiting to be written to the command stream  */
+    struct output_queue_t output;
+
+    /*  The number of outstanding probes sent by this session  */
+    int outstanding_probe_count;
+
+    /*  The secret a TCP client must prove it knows, until it has  */
+    const char *auth_secret;
+
+    /*  The challenge sent to the client, to be answered with the secret  */
+    char auth_nonce[AGENT_NONCE_HEX_SIZE + 1];
+
+    /*  true if the client failed to authenticate, and is to be dropped  */
+    bool auth_failed;
 };
 
 /*  Tracking information for an outstanding probe  */
 struct probe_t {
-    /*  Our entry in the probe list  */
+    /*  Our entry in the probe list, or in the free list when unused  */
     LIST_ENTRY(
     probe_t) probe_list_entry;
 
+    /*  Our entry in the sequence indexed table of probes  */
+    LIST_ENTRY(
+    probe_t) probe_table_entry;
+
     /*
        Also the ICMP sequence ID used to identify the probe.
 
@@ -101,6 +215,9 @@ struct probe_t {
     /*  Command token of the probe request  */
     int token;
 
+    /*  The session which sent the probe, to which we'll reply  */
+    struct command_session_t *session;
+
     /*  The address being probed  */
     struct sockaddr_storage remote_addr;
 
@@ -108,6 +225,23 @@ struct probe_t {
     struct probe_platform_t platform;
 };
 
+/*  A remembered result of find_source_addr  */
+struct source_cache_entry_t {
+    /*  true if the entry holds a source address  */
+    bool valid;
+
+    /*  The destination address for which the source was found  */
+    struct sockaddr_storage dest_addr;
+
+    /*  The source address the kernel chose for the destination  */
+    struct sockaddr_storage src_addr;
+
+    /*  The time after which the entry should no longer be used  */
+    struct timeval expire_time;
+};
+
+struct pacer_t;
+
 /*  Global state for interacting with the network  */
 struct net_state_t {
     /*  The number of entries in the outstanding_probes list  */
@@ -118,6 +252,43 @@ struct net_state_t {
     probe_list_head_t,
     probe_t) outstanding_probes;
 
+    /*  In-flight probes, hashed by sequence number for fast lookup  */
+     LIST_HEAD(
+    probe_table_head_t,
+    probe_t) probe_table[PROBE_TABLE_SIZE];
+
+    /*
+       Preallocated storage for MAX_PROBES probes, so that allocating
+       and freeing probes doesn't require the general purpose allocator.
+     */
+    struct probe_t *probe_pool;
+
+    /*  The probes in the pool which are not currently in use  */
+     LIST_HEAD(
+    probe_free_head_t,
+    probe_t) free_probes;
+
+    /*
+       Source addresses for recent destinations, indexed by a hash of
+       the destination address, to avoid a routing lookup per probe.
+     */
+    struct source_cache_entry_t source_cache[SOURCE_CACHE_SIZE];
+
+    /*  Incremented each time the source cache is invalidated  */
+    unsigned int source_cache_generation;
+
+    /*
+       The session whose commands are being dispatched.  Probes sent
+       are attributed to it, and replies to commands are queued to it.
+     */
+    struct command_session_t *session;
+
+    /*  Probes held to their destination's pace, or NULL if none yet  */
+    struct pacer_t *pacer;
+
+    /*  Counters of our own work, for the "stats" command  */
+    struct packet_stats_t stats;
+
     /*  Platform specific tracking information  */
     struct net_state_platform_t platform;
 };
@@ -136,6 +307,16 @@ void init_net_state_privileged(
 void init_net_state(
     struct net_state_t *net_state);
 
+void flush_replies(
+    struct net_state_t *net_state,
+    struct output_queue_t *output);
+
+void close_net_state(
+    struct net_state_t *net_state);
+
+void init_probe_pool(
+    struct net_state_t *net_state);
+
 bool is_ip_version_supported(
     struct net_state_t *net_state,
     int ip_version);
@@ -144,6 +325,13 @@ bool is_protocol_supported(
     struct net_state_t *net_state,
     int protocol);
 
+bool is_kernel_timestamp_supported(
+    struct net_state_t *net_state);
+
+bool is_tcp_syn_supported(
+    const struct net_state_t *net_state,
+    int ip_version);
+
 bool get_next_probe_timeout(
     const struct net_state_t *net_state,
     struct timeval *timeout);
@@ -152,6 +340,33 @@ void send_probe(
     struct net_state_t *net_state,
     const struct probe_param_t *param);
 
+void send_probe_batch(
+    struct net_state_t *net_state,
+    const struct probe_param_t *params,
+    int probe_count);
+
+int define_probe_template(
+    struct net_state_t *net_state,
+    int template_id,
+    const struct probe_param_t *param);
+
+struct probe_template_t *find_probe_template(
+    struct net_state_t *net_state,
+    int template_id);
+
+void send_probe_template(
+    struct net_state_t *net_state,
+    struct probe_template_t *probe_template,
+    int command_token,
+    int ttl,
+    int timeout_ms);
+
+void platform_free_probe_template(
+    struct probe_template_t *probe_template);
+
+void free_command_session(
+    struct command_session_t *session);
+
 void receive_replies(
     struct net_state_t *net_state);
 
@@ -167,11 +382,23 @@ void respond_to_probe(
     int mpls_count,
     const struct mpls_label_t *mpls);
 
+void report_reply(
+    struct command_session_t *session,
+    int token,
+    int reply_type,
+    const char *detail);
+
 int decode_address_string(
     int ip_version,
     const char *address_string,
     struct sockaddr_storage *address);
 
+int decode_probe_address(
+    int ip_version,
+    const char *address_string,
+    const void *address_bytes,
+    struct sockaddr_storage *address);
+
 int resolve_probe_addresses(
     struct net_state_t *net_state,
     const struct probe_param_t *param,
@@ -191,14 +418,26 @@ void platform_alloc_probe(
     struct probe_t *probe);
 
 void platform_free_probe(
+    struct net_state_t *net_state,
     struct probe_t *probe);
 
+void gather_packet_stats(
+    struct net_state_t *net_state,
+    struct packet_stats_t *stats);
+
 struct probe_t *find_probe(
     struct net_state_t *net_state,
     int protocol,
     int icmp_id,
     int icmp_sequence);
 
+struct probe_t *find_probe_by_sequence(
+    struct net_state_t *net_state,
+    int sequence);
+
+void invalidate_source_cache(
+    struct net_state_t *net_state);
+
 int find_source_addr(
     struct sockaddr_storage *srcaddr,
     const struct sockaddr_storage *destaddr);
@@ -23,6 +23,13 @@
 #include <winternl.h>
 
 #include "protocols.h"
+#include "wire.h"
+
+/*
+    The smallest reply buffer we allocate, which holds the replies to
+    probes of the usual sizes, so that buffers are rarely regrown.
+*/
+#define MIN_REPLY_BUFFER_SIZE 512
 
 /*  Windows doesn't require any initialization at a privileged level  */
 void init_net_state_privileged(
@@ -36,6 +43,15 @@ void init_net_state(
 {
     memset(net_state, 0, sizeof(struct net_state_t));
 
+    init_probe_pool(net_state);
+
+    net_state->platform.reply_buffers =
+        calloc(MAX_PROBES, sizeof(struct reply_buffer_t));
+    if (net_state->platform.reply_buffers == NULL) {
+        perror("Failure allocating reply buffers");
+        exit(EXIT_FAILURE);
+    }
+
     net_state->platform.icmp4 = IcmpCreateFile();
     net_state->platform.icmp6 = Icmp6CreateFile();
 
@@ -48,6 +64,20 @@ void init_net_state(
     net_state->platform.ip6_socket_raw = false;
 }
 
+/*  Write queued replies to stdout  */
+void flush_replies(
+    struct net_state_t *net_state,
+    struct output_queue_t *output)
+{
+    flush_output_queue(output, fileno(stdout));
+}
+
+/*  Windows has no state to clean up before exit  */
+void close_net_state(
+    struct net_state_t *net_state)
+{
+}
+
 /*
     If we succeeded at opening the ICMP file handle, we can
     assume that IP protocol version is supported.
@@ -77,6 +107,21 @@ bool is_protocol_supported(
     return false;
 }
 
+/*  Round trip times are measured by ICMP.DLL, not with kernel timestamps  */
+bool is_kernel_timestamp_supported(
+    struct net_state_t *net_state)
+{
+    return false;
+}
+
+/*  Without TCP support, there are no raw TCP SYN probes  */
+bool is_tcp_syn_supported(
+    const struct net_state_t *net_state,
+    int ip_version)
+{
+    return false;
+}
+
 /*  Set the back pointer to the net_state when a probe is allocated  */
 void platform_alloc_probe(
     struct net_state_t *net_state,
@@ -85,31 +130,71 @@ void platform_alloc_probe(
     probe->platform.net_state = net_state;
 }
 
-/*  Free the reply buffer when the probe is freed  */
+/*  The reply buffer stays with the pool, for the next probe to use  */
 void platform_free_probe(
+    struct net_state_t *net_state,
     struct probe_t *probe)
 {
-    if (probe->platform.reply4) {
-        free(probe->platform.reply4);
-        probe->platform.reply4 = NULL;
+    probe->platform.reply4 = NULL;
+}
+
+/*
+    Find the reply buffer of a probe, growing it if it is smaller than
+    required.  Once grown, a buffer is reused by every later probe in
+    the same place in the pool, so in the steady state sending a probe
+    requires no allocation.
+*/
+static
+void *get_reply_buffer(
+    struct net_state_t *net_state,
+    struct probe_t *probe,
+    int size)
+{
+    struct reply_buffer_t *reply_buffer;
+
+    reply_buffer =
+        &net_state->platform.reply_buffers[probe - net_state->probe_pool];
+    if (reply_buffer->size < size) {
+        if (size < MIN_REPLY_BUFFER_SIZE) {
+            size = MIN_REPLY_BUFFER_SIZE;
+        }
+
+        free(reply_buffer->buffer);
+        reply_buffer->buffer = malloc(size);
+        if (reply_buffer->buffer == NULL) {
+            perror("failure to allocate reply buffer");
+            exit(EXIT_FAILURE);
+        }
+        reply_buffer->size = size;
     }
+
+    return reply_buffer->buffer;
 }
 
 /*  Report a windows error code using a platform-independent error string  */
 static
 void report_win_error(
+    struct net_state_t *net_state,
     int command_token,
     int err)
 {
+    char detail[32];
+
     /*  It could be that we got no reply because of timeout  */
     if (err == IP_REQ_TIMED_OUT || err == IP_SOURCE_QUENCH) {
-        printf("%d no-reply\n", command_token);
+        net_state->stats.timeouts++;
+        report_reply(net_state->session, command_token,
+                     WIRE_REPLY_NO_REPLY, NULL);
     } else if (err == ERROR_INVALID_NETNAME) {
-        printf("%d address-not-available\n", command_token);
+        report_reply(net_state->session, command_token,
+                     WIRE_REPLY_ADDRESS_NOT_AVAILABLE, NULL);
     } else if (err == ERROR_INVALID_PARAMETER) {
-        printf("%d invalid-argument\n", command_token);
+        report_reply(net_state->session, command_token,
+                     WIRE_REPLY_INVALID_ARGUMENT, NULL);
     } else {
-        printf("%d unexpected-error winerror %d\n", command_token, err);
+        snprintf(detail, sizeof(detail), "winerror %d", err);
+        report_reply(net_state->session, command_token,
+                     WIRE_REPLY_UNEXPECTED_ERROR, detail);
     }
 }
 
@@ -199,7 +284,7 @@ void WINAPI on_icmp_reply(
         respond_to_probe(net_state, probe, icmp_type,
                          &remote_addr, round_trip_us, 0, NULL);
     } else {
-        report_win_error(probe->token, reply_status);
+        report_win_error(net_state, probe->token, reply_status);
         free_probe(net_state, probe);
     }
 }
@@ -224,8 +309,8 @@ void icmp_send_probe(
     struct sockaddr_in6 *src_sockaddr6;
     struct sockaddr_in6 *dest_sockaddr6;
 
-    if (param->timeout > 0) {
-        timeout = 1000 * param->timeout;
+    if (param->timeout_ms > 0) {
+        timeout = param->timeout_ms;
     } else {
         /*
            IcmpSendEcho2 will return invalid argument on a timeout of 
@@ -238,37 +323,42 @@ void icmp_send_probe(
     memset(&option, 0, sizeof(IP_OPTION_INFORMATION));
     option.Ttl = param->ttl;
 
+    /*
+       Beyond the reply and its payload, ICMP.DLL requires room for the
+       8 bytes of an ICMP error, and for an IO_STATUS_BLOCK.
+     */
     if (param->ip_version == 6) {
         reply_size = sizeof(ICMPV6_ECHO_REPLY) + payload_size;
     } else {
         reply_size = sizeof(ICMP_ECHO_REPLY) + payload_size;
     }
+    reply_size += 8 + sizeof(IO_STATUS_BLOCK);
 
-    probe->platform.reply4 = malloc(reply_size);
-    if (probe->platform.reply4 == NULL) {
-        perror("failure to allocate reply buffer");
-        exit(EXIT_FAILURE);
-    }
+    probe->platform.reply4 = get_reply_buffer(net_state, probe, reply_size);
 
     if (param->ip_version == 6) {
         src_sockaddr6 = (struct sockaddr_in6 *) src_sockaddr;
         dest_sockaddr6 = (struct sockaddr_in6 *) dest_sockaddr;
 
-        send_result = Icmp6SendEcho2(net_state->platform.icmp6, NULL,
-                                     (FARPROC) on_icmp_reply, probe,
-                                     src_sockaddr6, dest_sockaddr6,
-                                     payload, payload_size, &option,
-                                     probe->platform.reply6, reply_size,
-                                     timeout);
+        send_result =
+            COUNT_SYSCALL(&net_state->stats,
+                          Icmp6SendEcho2(net_state->platform.icmp6, NULL,
+                                         (FARPROC) on_icmp_reply, probe,
+                                         src_sockaddr6, dest_sockaddr6,
+                                         payload, payload_size, &option,
+                                         probe->platform.reply6,
+                                         reply_size, timeout));
     } else {
         dest_sockaddr4 = (struct sockaddr_in *) dest_sockaddr;
 
-        send_result = IcmpSendEcho2(net_state->platform.icmp4, NULL,
-                                    (FARPROC) on_icmp_reply, probe,
-                                    dest_sockaddr4->sin_addr.s_addr,
-                                    payload, payload_size, &option,
-                                    probe->platform.reply4, reply_size,
-                                    timeout);
+        send_result =
+            COUNT_SYSCALL(&net_state->stats,
+                          IcmpSendEcho2(net_state->platform.icmp4, NULL,
+                                        (FARPROC) on_icmp_reply, probe,
+                                        dest_sockaddr4->sin_addr.s_addr,
+                                        payload, payload_size, &option,
+                                        probe->platform.reply4,
+                                        reply_size, timeout));
     }
 
     if (send_result == 0) {
@@ -279,10 +369,12 @@ void icmp_send_probe(
            but any other error is unexpected.
          */
         if (err != ERROR_IO_PENDING) {
-            report_win_error(probe->token, err);
+            report_win_error(net_state, probe->token, err);
             free_probe(net_state, probe);
+            return;
         }
     }
+    record_probe_sent(&net_state->stats);
 }
 
 /*  Fill the payload of the packet as specified by the probe parameters  */
@@ -333,13 +425,15 @@ void send_probe(
 
     if (resolve_probe_addresses(net_state, param, &dest_sockaddr,
                 &src_sockaddr)) {
-        printf("%d invalid-argument\n", param->command_token);
+        report_reply(net_state->session, param->command_token,
+                     WIRE_REPLY_INVALID_ARGUMENT, NULL);
         return;
     }
 
     probe = alloc_probe(net_state, param->command_token);
     if (probe == NULL) {
-        printf("%d probes-exhausted\n", param->command_token);
+        report_reply(net_state->session, param->command_token,
+                     WIRE_REPLY_PROBES_EXHAUSTED, NULL);
         return;
     }
 
@@ -355,10 +449,52 @@ void send_probe(
                     &src_sockaddr, &dest_sockaddr, payload, payload_size);
 }
 
+/*
+    ICMP.DLL has no means of sending several probes with one call,
+    so the probes of a batch are sent individually.
+*/
+void send_probe_batch(
+    struct net_state_t *net_state,
+    const struct probe_param_t *params,
+    int probe_count)
+{
+    int i;
+
+    for (i = 0; i < probe_count; i++) {
+        send_probe(net_state, &params[i]);
+    }
+}
+
+/*  Send a template probe using the template's copy of the parameters  */
+void send_probe_template(
+    struct net_state_t *net_state,
+    struct probe_template_t *probe_template,
+    int command_token,
+    int ttl,
+    int timeout_ms)
+{
+    struct probe_param_t param = probe_template->param;
+
+    param.command_token = command_token;
+    param.ttl = ttl;
+    if (timeout_ms >= 0) {
+        param.timeout_ms = timeout_ms;
+    }
+    send_probe(net_state, &param);
+}
+
+/*  There is no platform specific template state to free on Windows  */
+void platform_free_probe_template(
+    struct probe_template_t *probe_template)
+{
+}
+
 /*
     On Windows, an implementation of receive_replies is unnecessary, because,
     unlike Unix, replies are completed using Overlapped I/O during an
-    alertable wait, and don't require explicit reads.
+    alertable wait, and don't require explicit reads.  Every completion
+    routine queued by the time we wake runs within the same wait, and
+    their replies are written together when the output queue is flushed.
 */
 void receive_replies(
     struct net_state_t *net_state)
@@ -385,3 +521,11 @@ bool get_next_probe_timeout(
 {
     return false;
 }
+
+/*  Without worker threads, our own counters are all there are  */
+void gather_packet_stats(
+    struct net_state_t *net_state,
+    struct packet_stats_t *stats)
+{
+    *stats = net_state->stats;
+}
@@ -45,6 +45,16 @@ typedef struct icmpv6_echo_reply_lh {
 } ICMPV6_ECHO_REPLY,
 *PICMPV6_ECHO_REPLY;
 
+/*
+    Windows requires a buffer for the echo reply of each in-flight ICMP
+    probe.  The buffers are kept with the pool of probes, so that a
+    probe reuses the buffer of the probe before it in the same place.
+*/
+struct reply_buffer_t {
+    void *buffer;
+    int size;
+};
+
 /*
 	Windows requires an echo reply structure for each in-flight
 	ICMP probe.
@@ -65,12 +75,23 @@ struct probe_platform_t {
     };
 };
 
+/*
+    Windows sends template probes as ordinary probes, so there is no
+    platform specific template state.
+*/
+struct probe_template_platform_t {
+    int unused;
+};
+
 /*  A Windows HANDLE for the ICMP session  */
 struct net_state_platform_t {
     HANDLE icmp4;
     HANDLE icmp6;
     bool ip4_socket_raw;
     bool ip6_socket_raw;
+
+    /*  A reply buffer for each probe of the pool, by its index  */
+    struct reply_buffer_t *reply_buffers;
 };
 
 #endif
@@ -16,14 +16,25 @@
     51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
+#include "config.h"
+
 #include "probe.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #ifdef HAVE_LINUX_ERRQUEUE_H
 #include <linux/errqueue.h>
 #endif
+#ifdef HAVE_LINUX_NET_TSTAMP_H
+#include <linux/net_tstamp.h>
+#endif
+#ifdef HAVE_LINUX_RTNETLINK_H
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,23 +45,63 @@
 #include "protocols.h"
 #include "construct_unix.h"
 #include "deconstruct_unix.h"
+#include "filter_unix.h"
+#include "pace.h"
+#include "ring_unix.h"
+#include "simulate_unix.h"
+#include "busypoll_unix.h"
+#include "thread_unix.h"
 #include "timeval.h"
+#include "trace.h"
+#include "uring_unix.h"
+#include "wait.h"
+#include "wire.h"
 
-/*  A wrapper around sendto for mixed IPv4 and IPv6 sending  */
+/*
+    Each outstanding probe needs a distinct sequence number, so we
+    can't have more probes in flight than there are local ports to
+    assign them.
+*/
+#if MAX_PROBES > MAX_PORT - MIN_PORT + 1
+#error MAX_PROBES exceeds the range of probe sequence numbers
+#endif
+
+/*
+    Kernel transmit timestamps are read from the socket error queue,
+    which is specific to Linux.
+*/
+#if defined(HAVE_LINUX_ERRQUEUE_H) && defined(HAVE_LINUX_NET_TSTAMP_H) \
+    && defined(SO_TIMESTAMPING)
+#define USE_TX_TIMESTAMPS
+
+/*
+    Software timestamps, identified by a per-socket counter rather than
+    by a copy of the sent packet.  Hardware timestamps would come from
+    the network interface's clock, which wouldn't be comparable to the
+    software timestamps of received packets.
+*/
+#define TX_TIMESTAMP_FLAGS \
+    (SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE \
+    | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY)
+#endif
+
+/*
+    Choose the socket on which to send a probe packet, given the
+    address family and the probe protocol.  Returns 0 if no suitable
+    socket is available.
+*/
 static
-int send_packet(
+int select_send_socket(
     const struct net_state_t *net_state,
     const struct probe_param_t *param,
     int sequence,
-    const char *packet,
-    int packet_size,
-    const struct sockaddr_storage *sockaddr)
+    const struct sockaddr_storage *sockaddr,
+    int *sockaddr_length)
 {
     int send_socket = 0;
-    int sockaddr_length;
 
     if (sockaddr->ss_family == AF_INET6) {
-        sockaddr_length = sizeof(struct sockaddr_in6);
+        *sockaddr_length = sizeof(struct sockaddr_in6);
 
         if (param->protocol == IPPROTO_ICMP) {
             if (net_state->platform.ip6_socket_raw) {
@@ -58,6 +109,8 @@ int send_packet(
             } else {
                 send_socket = net_state->platform.ip6_txrx_icmp_socket;
             }
+        } else if (param->protocol == IPPROTO_TCP) {
+            send_socket = net_state->platform.tcp6_socket;
         } else if (param->protocol == IPPROTO_UDP) {
             if (net_state->platform.ip6_socket_raw) {
                 send_socket = net_state->platform.udp6_send_socket;
@@ -73,7 +126,7 @@ int send_packet(
             }
         }
     } else if (sockaddr->ss_family == AF_INET) {
-        sockaddr_length = sizeof(struct sockaddr_in);
+        *sockaddr_length = sizeof(struct sockaddr_in);
 
         if (net_state->platform.ip4_socket_raw) {
             send_socket = net_state->platform.ip4_send_socket;
@@ -97,13 +150,170 @@ int send_packet(
         }
     }
 
+    return send_socket;
+}
+
+#ifdef USE_TX_TIMESTAMPS
+/*
+    Discard any timestamps queued for a socket, and restart transmit
+    timestamping, which resets the kernel's packet counter to zero.
+    If the socket doesn't support timestamping, stop tracking it.
+*/
+static
+void reset_tx_timestamps(
+    struct net_state_t *net_state,
+    struct tx_timestamp_socket_t *tx_timestamp)
+{
+    char control[256];
+    struct msghdr msg;
+    int flags;
+
+    do {
+        memset(&msg, 0, sizeof(struct msghdr));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+    } while (COUNT_SYSCALL(&net_state->stats,
+                           recvmsg(tx_timestamp->socket, &msg,
+                                   MSG_ERRQUEUE | MSG_DONTWAIT)) >= 0);
+
+    flags = 0;
+    COUNT_SYSCALL(&net_state->stats,
+                  setsockopt(tx_timestamp->socket, SOL_SOCKET,
+                             SO_TIMESTAMPING, &flags, sizeof(int)));
+
+    flags = TX_TIMESTAMP_FLAGS;
+    if (COUNT_SYSCALL(&net_state->stats,
+                      setsockopt(tx_timestamp->socket, SOL_SOCKET,
+                                 SO_TIMESTAMPING, &flags, sizeof(int)))) {
+        tx_timestamp->socket = 0;
+    }
+
+    tx_timestamp->next_id = 0;
+}
+
+/*
+    Request transmit timestamps on the raw sockets used to send probes.
+    This is done when the first probe asks for a kernel timestamp, so
+    that others don't pay for timestamps they won't use.
+*/
+static
+void enable_kernel_timestamps(
+    struct net_state_t *net_state)
+{
+    struct net_state_platform_t *platform = &net_state->platform;
+    int i;
+
+    if (platform->ip4_socket_raw) {
+        platform->tx_timestamp[0].socket = platform->ip4_send_socket;
+    }
+    if (platform->ip6_socket_raw) {
+        platform->tx_timestamp[1].socket = platform->icmp6_send_socket;
+        platform->tx_timestamp[2].socket = platform->udp6_send_socket;
+        platform->tx_timestamp[3].socket = platform->tcp6_socket;
+    }
+
+    for (i = 0; i < TX_TIMESTAMP_SOCKET_COUNT; i++) {
+        if (platform->tx_timestamp[i].socket) {
+            reset_tx_timestamps(net_state, &platform->tx_timestamp[i]);
+        }
+    }
+
+    platform->kernel_timestamps_enabled = true;
+}
+
+/*  Find the timestamp tracking for a sending socket, if it has any  */
+static
+struct tx_timestamp_socket_t *find_tx_timestamp_socket(
+    struct net_state_t *net_state,
+    int socket)
+{
+    int i;
+
+    for (i = 0; i < TX_TIMESTAMP_SOCKET_COUNT; i++) {
+        if (net_state->platform.tx_timestamp[i].socket == socket) {
+            return &net_state->platform.tx_timestamp[i];
+        }
+    }
+
+    return NULL;
+}
+#endif
+
+/*
+    Note a transmission on a socket, so that we can later match the
+    kernel's transmit timestamp to the probe.  We can't tell whether a
+    failed send consumed an identifier, so after a failure, we restart
+    the count rather than risk attributing timestamps to the wrong probe.
+*/
+static
+void record_transmission(
+    struct net_state_t *net_state,
+    int socket,
+    int sequence,
+    bool sent)
+{
+#ifdef USE_TX_TIMESTAMPS
+    struct tx_timestamp_socket_t *tx_timestamp;
+    int send_errno;
+#endif
+
+    if (sent) {
+        record_probe_sent(&net_state->stats);
+        TRACE_PROBE2(mtr_packet, send_packet, sequence, socket);
+    }
+
+#ifdef USE_TX_TIMESTAMPS
+    if (!net_state->platform.kernel_timestamps_enabled || !socket) {
+        return;
+    }
+
+    tx_timestamp = find_tx_timestamp_socket(net_state, socket);
+    if (tx_timestamp == NULL) {
+        return;
+    }
+
+    /*  Preserve errno, which the caller will use to report the failure  */
+    if (!sent) {
+        send_errno = errno;
+        reset_tx_timestamps(net_state, tx_timestamp);
+        errno = send_errno;
+        return;
+    }
+
+    tx_timestamp->sequence[tx_timestamp->next_id % TX_TIMESTAMP_RING_SIZE]
+        = sequence;
+    tx_timestamp->next_id++;
+#endif
+}
+
+/*  A wrapper around sendto for mixed IPv4 and IPv6 sending  */
+static
+int send_packet(
+    struct net_state_t *net_state,
+    const struct probe_param_t *param,
+    int sequence,
+    const char *packet,
+    int packet_size,
+    const struct sockaddr_storage *sockaddr)
+{
+    int send_socket;
+    int sockaddr_length;
+    int result;
+
+    send_socket = select_send_socket(net_state, param, sequence,
+                                     sockaddr, &sockaddr_length);
     if (send_socket == 0) {
         errno = EINVAL;
         return -1;
     }
 
-    return sendto(send_socket, packet, packet_size, 0,
-                  (struct sockaddr *) sockaddr, sockaddr_length);
+    result = COUNT_SYSCALL(&net_state->stats,
+                           sendto(send_socket, packet, packet_size, 0,
+                                  (struct sockaddr *) sockaddr,
+                                  sockaddr_length));
+    record_transmission(net_state, send_socket, sequence, result != -1);
+
+    return result;
 }
 
 /*
@@ -117,6 +327,7 @@ int send_packet(
 
     Test for a byte order which works by sending a ping to localhost.
 */
+#ifndef PLATFORM_LINUX
 static
 void check_length_order(
     struct net_state_t *net_state)
@@ -127,6 +338,7 @@ void check_length_order(
     struct sockaddr_storage src_sockaddr;
     ssize_t bytes_sent;
     int packet_size;
+    int sequence = net_state->platform.min_sequence;
 
     memset(&param, 0, sizeof(struct probe_param_t));
     param.ip_version = 4;
@@ -144,7 +356,7 @@ void check_length_order(
     /*  First attempt to ping the localhost with network byte order  */
     net_state->platform.ip_length_host_order = false;
 
-    packet_size = construct_packet(net_state, NULL, MIN_PORT,
+    packet_size = construct_packet(net_state, NULL, sequence,
                                    packet, PACKET_BUFFER_SIZE,
                                    &dest_sockaddr, &src_sockaddr, &param);
     if (packet_size < 0) {
@@ -153,7 +365,7 @@ void check_length_order(
     }
 
     bytes_sent =
-        send_packet(net_state, &param, MIN_PORT, packet, packet_size,
+        send_packet(net_state, &param, sequence, packet, packet_size,
                     &dest_sockaddr);
     if (bytes_sent > 0) {
         return;
@@ -162,7 +374,7 @@ void check_length_order(
     /*  Since network byte order failed, try host byte order  */
     net_state->platform.ip_length_host_order = true;
 
-    packet_size = construct_packet(net_state, NULL, MIN_PORT,
+    packet_size = construct_packet(net_state, NULL, sequence,
                                    packet, PACKET_BUFFER_SIZE,
                                    &dest_sockaddr, &src_sockaddr, &param);
     if (packet_size < 0) {
@@ -171,13 +383,14 @@ void check_length_order(
     }
 
     bytes_sent =
-        send_packet(net_state, &param, MIN_PORT, packet, packet_size,
+        send_packet(net_state, &param, sequence, packet, packet_size,
                     &dest_sockaddr);
     if (bytes_sent < 0) {
         perror("Unable to send with swapped length");
         exit(EXIT_FAILURE);
     }
 }
+#endif
 
 /*
     Check to see if SCTP is support.  We can't just rely on checking
@@ -201,6 +414,68 @@ void check_sctp_support(
 #endif
 }
 
+/*
+    Returns true if a word is among the space separated probe features
+    given by mtr in MTR_PACKET_PROBES.
+*/
+static
+bool is_probe_feature_listed(
+    const char *probes,
+    const char *feature)
+{
+    int length = strlen(feature);
+    const char *word = probes;
+
+    while ((word = strstr(word, feature)) != NULL) {
+        if ((word == probes || word[-1] == ' ')
+            && (word[length] == 0 || word[length] == ' ')) {
+            return true;
+        }
+        word += length;
+    }
+
+    return false;
+}
+
+/*
+    mtr tells us, through MTR_PACKET_PROBES, which probes it intends
+    to send, so that we needn't open sockets which will go unused.
+    Where it doesn't name an IP version, we expect either.
+*/
+static
+bool is_ip_version_expected(
+    int ip_version)
+{
+    const char *probes = getenv("MTR_PACKET_PROBES");
+
+    if (probes == NULL || (!is_probe_feature_listed(probes, "ip-4")
+                           && !is_probe_feature_listed(probes, "ip-6"))) {
+        return true;
+    }
+
+    if (ip_version == 4) {
+        return is_probe_feature_listed(probes, "ip-4");
+    }
+    return is_probe_feature_listed(probes, "ip-6");
+}
+
+/*  Where MTR_PACKET_PROBES doesn't name a protocol, we expect any  */
+static
+bool is_protocol_expected(
+    const char *protocol)
+{
+    const char *probes = getenv("MTR_PACKET_PROBES");
+
+    if (probes == NULL || (!is_probe_feature_listed(probes, "icmp")
+                           && !is_probe_feature_listed(probes, "udp")
+                           && !is_probe_feature_listed(probes, "tcp")
+                           && !is_probe_feature_listed(probes, "sctp"))) {
+        return true;
+    }
+
+    return is_probe_feature_listed(probes, protocol);
+}
+
 /*  Set a socket to non-blocking mode  */
 void set_socket_nonblocking(
     int socket)
@@ -397,21 +672,81 @@ int open_ip6_sockets_dgram(
 #endif
 
 /*
-    The first half of the net state initialization.  Since this
-    happens with elevated privileges, this is kept as minimal
-    as possible to minimize security risk.
+    Open the sockets used for raw TCP SYN probes.  IPv4 SYN segments
+    are sent through the raw IPv4 send socket, but we need a socket
+    to receive the SYN-ACK or RST segments sent in reply.  Only Linux
+    delivers received TCP segments to raw sockets, so elsewhere we
+    always connect a socket for TCP probes.  Failure here isn't fatal.
 */
-void init_net_state_privileged(
+static
+void open_tcp_syn_sockets(
     struct net_state_t *net_state)
+{
+#ifdef PLATFORM_LINUX
+    int tcp_socket;
+    int checksum_offset = offsetof(struct TCPSegmentHeader, checksum);
+
+    if (net_state->platform.ip4_socket_raw) {
+        tcp_socket = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
+        if (tcp_socket != -1) {
+            net_state->platform.ip4_tcp_recv_socket = tcp_socket;
+        }
+    }
+
+    if (net_state->platform.ip6_socket_raw) {
+        tcp_socket = socket(AF_INET6, SOCK_RAW, IPPROTO_TCP);
+        if (tcp_socket == -1) {
+            return;
+        }
+
+        /*  Have the kernel compute the TCP checksum of our segments  */
+        if (setsockopt(tcp_socket, IPPROTO_IPV6, IPV6_CHECKSUM,
+                       &checksum_offset, sizeof(int))) {
+            close(tcp_socket);
+            return;
+        }
+
+        net_state->platform.tcp6_socket = tcp_socket;
+    }
+#endif
+}
+
+/*
+    Open the sockets of a net state which will assign its probes
+    sequence numbers in the given range.  This runs with elevated
+    privileges, both for the main thread and for each worker thread.
+*/
+void init_net_state_range_privileged(
+    struct net_state_t *net_state,
+    int min_sequence,
+    int max_sequence)
 {
     int ip4_err = 0;
     int ip6_err = 0;
 
     memset(net_state, 0, sizeof(struct net_state_t));
 
-    net_state->platform.next_sequence = MIN_PORT;
+    net_state->platform.next_sequence = min_sequence;
+    net_state->platform.min_sequence = min_sequence;
+    net_state->platform.max_sequence = max_sequence;
+
+    init_probe_pool(net_state);
+
+    net_state->platform.timeout_heap =
+        malloc(MAX_PROBES * sizeof(struct probe_t *));
+    if (net_state->platform.timeout_heap == NULL) {
+        perror("Failure allocating timeout heap");
+        exit(EXIT_FAILURE);
+    }
+
+    /*  A simulated network stands in for the sockets of both versions  */
+    if (is_simulation_requested()) {
+        net_state->platform.ip4_present = true;
+        net_state->platform.ip6_present = true;
+        return;
+    }
 
-    if (open_ip4_sockets_raw(net_state)) {
+    if (is_ip_version_expected(4) && open_ip4_sockets_raw(net_state)) {
 #ifdef HAVE_LINUX_ERRQUEUE_H
         /* fall back to using unprivileged sockets */
         if (open_ip4_sockets_dgram(net_state)) {
@@ -419,7 +754,7 @@ void init_net_state_privileged(
         }
 #endif
     }
-    if (open_ip6_sockets_raw(net_state)) {
+    if (is_ip_version_expected(6) && open_ip6_sockets_raw(net_state)) {
 #ifdef HAVE_LINUX_ERRQUEUE_H
         /* fall back to using unprivileged sockets */
         if (open_ip6_sockets_dgram(net_state)) {
@@ -428,6 +763,12 @@ void init_net_state_privileged(
 #endif
     }
 
+    if (is_protocol_expected("tcp")) {
+        open_tcp_syn_sockets(net_state);
+    }
+    open_packet_ring(net_state);
+    enable_busy_poll(net_state);
+
     /*
        If we couldn't open either IPv4 or IPv6 sockets, we can't do
        much, so print errors and exit.
@@ -445,6 +786,123 @@ void init_net_state_privileged(
     }
 }
 
+/*
+    The first half of the net state initialization.  Since this
+    happens with elevated privileges, this is kept as minimal
+    as possible to minimize security risk.
+*/
+void init_net_state_privileged(
+    struct net_state_t *net_state)
+{
+    int thread_count = get_packet_thread_count();
+
+    /*  The probe clock must be chosen before any probe is timed  */
+    select_probe_clock();
+
+    /*  The simulated network has no sockets to shard  */
+    if (is_simulation_requested()) {
+        thread_count = 1;
+    }
+
+    /*  With worker threads, the main thread is the first shard  */
+    init_net_state_range_privileged(net_state, MIN_PORT,
+                                    get_shard_max_sequence(0,
+                                                           thread_count));
+    net_state->platform.spin_poll =
+        !is_simulation_requested() && is_spin_poll_requested();
+
+    if (thread_count > 1) {
+        init_packet_threads_privileged(net_state, thread_count);
+    }
+}
+
+#if defined(HAVE_RECVMMSG) && defined(SO_TIMESTAMP)
+/*  Request a timestamp in the control data of each received packet  */
+static
+void enable_receive_timestamps(
+    int socket)
+{
+    int trueopt = 1;
+
+    if (socket) {
+        setsockopt(socket, SOL_SOCKET, SO_TIMESTAMP, &trueopt, sizeof(int));
+    }
+}
+#endif
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+/*
+    Subscribe to notifications of changes to routes and local addresses,
+    either of which may change the source address for a destination.
+    Without the notifications, cached source addresses will still
+    expire after SOURCE_CACHE_TIMEOUT.
+*/
+static
+void open_route_socket(
+    struct net_state_t *net_state)
+{
+    int route_socket;
+    struct sockaddr_nl addr;
+
+    route_socket = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+    if (route_socket == -1) {
+        return;
+    }
+
+    memset(&addr, 0, sizeof(struct sockaddr_nl));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE
+        | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+
+    if (bind(route_socket, (struct sockaddr *) &addr,
+             sizeof(struct sockaddr_nl))) {
+        close(route_socket);
+        return;
+    }
+
+    set_socket_nonblocking(route_socket);
+    net_state->platform.route_socket = route_socket;
+}
+
+/*
+    Read any pending routing notifications.  We don't need their
+    details, since any change is reason to forget our source addresses.
+*/
+static
+void receive_route_changes(
+    struct net_state_t *net_state)
+{
+    char buffer[8192];
+    bool changed = false;
+
+    while (true) {
+        if (recv(net_state->platform.route_socket, buffer,
+                 sizeof(buffer), 0) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            /*
+               ENOBUFS means we've missed notifications, which is as
+               much a reason to invalidate as any notification.
+             */
+            if (errno == ENOBUFS) {
+                changed = true;
+                continue;
+            }
+
+            break;
+        }
+
+        changed = true;
+    }
+
+    if (changed) {
+        invalidate_source_cache(net_state);
+    }
+}
+#endif
+
 /*
     The second half of net state initialization, which is run
     at normal privilege levels.
@@ -452,29 +910,124 @@ void init_net_state_privileged(
 void init_net_state(
     struct net_state_t *net_state)
 {
-    if (net_state->platform.ip4_socket_raw) {
+    if (is_simulation_requested()) {
+        init_simulation(net_state);
+        init_wait_events(net_state);
+        return;
+    }
+
+    if (!net_state->platform.ip4_present) {
+        /*  No IPv4 sockets were opened  */
+    } else if (net_state->platform.ip4_socket_raw) {
         set_socket_nonblocking(net_state->platform.ip4_recv_socket);
     } else {
         set_socket_nonblocking(net_state->platform.ip4_txrx_icmp_socket);
         set_socket_nonblocking(net_state->platform.ip4_txrx_udp_socket);
     }
-    if (net_state->platform.ip4_socket_raw) {
+    if (!net_state->platform.ip6_present) {
+        /*  No IPv6 sockets were opened  */
+    } else if (net_state->platform.ip6_socket_raw) {
         set_socket_nonblocking(net_state->platform.ip6_recv_socket);
     } else {
         set_socket_nonblocking(net_state->platform.ip6_txrx_icmp_socket);
         set_socket_nonblocking(net_state->platform.ip6_txrx_udp_socket);
     }
+    if (net_state->platform.ip4_tcp_recv_socket) {
+        set_socket_nonblocking(net_state->platform.ip4_tcp_recv_socket);
+    }
+    if (net_state->platform.tcp6_socket) {
+        set_socket_nonblocking(net_state->platform.tcp6_socket);
+    }
+
+#if defined(HAVE_RECVMMSG) && defined(SO_TIMESTAMP)
+    /*
+       Ask for kernel receive timestamps on the raw sockets, so that
+       packets read in a batch don't all share the time of the batch.
+       If this fails, we'll use the time the batch was read instead.
+     */
+    if (net_state->platform.ip4_socket_raw) {
+        enable_receive_timestamps(net_state->platform.ip4_recv_socket);
+    }
+    if (net_state->platform.ip6_socket_raw) {
+        enable_receive_timestamps(net_state->platform.ip6_recv_socket);
+    }
+    enable_receive_timestamps(net_state->platform.ip4_tcp_recv_socket);
+    enable_receive_timestamps(net_state->platform.tcp6_socket);
+#endif
+
+    attach_receive_filters(net_state);
 
-    if (net_state->platform.ip4_present) {
+#ifdef HAVE_LINUX_RTNETLINK_H
+    open_route_socket(net_state);
+#endif
+
+    init_wait_events(net_state);
+
+    /*
+       The test ping is only needed where we construct the IP header
+       ourselves, and never on Linux.
+     */
+#ifndef PLATFORM_LINUX
+    if (net_state->platform.ip4_present
+        && net_state->platform.ip4_socket_raw) {
         check_length_order(net_state);
     }
+#endif
+
+    if (is_protocol_expected("sctp")) {
+        check_sctp_support(net_state);
+    }
 
-    check_sctp_support(net_state);
+    /*  The ping testing the byte order isn't counted as a probe  */
+    memset(&net_state->stats, 0, sizeof(struct packet_stats_t));
+
+    if (net_state->platform.threads) {
+        start_packet_threads(net_state);
+    }
+    start_spin_poll(net_state);
 }
 
 /*
-    Returns true if we were able to open sockets for a particular
-    IP protocol version.
+    Write queued replies to stdout.  When probes are sharded across
+    threads, all replies pass through the writer thread, so that the
+    replies of one thread aren't interleaved with those of another.
+*/
+void flush_replies(
+    struct net_state_t *net_state,
+    struct output_queue_t *output)
+{
+    if (net_state->platform.threads) {
+        push_thread_output(net_state->platform.threads, output);
+        return;
+    }
+
+    flush_output_queue(output, fileno(stdout));
+}
+
+/*  Total the counters of the main thread and any worker threads  */
+void gather_packet_stats(
+    struct net_state_t *net_state,
+    struct packet_stats_t *stats)
+{
+    *stats = net_state->stats;
+
+    if (net_state->platform.threads) {
+        add_thread_stats(net_state, stats);
+    }
+}
+
+/*  Wait for any worker threads to complete their probes and exit  */
+void close_net_state(
+    struct net_state_t *net_state)
+{
+    if (net_state->platform.threads) {
+        stop_packet_threads(net_state);
+    }
+}
+
+/*
+    Returns true if we were able to open sockets for a particular
+    IP protocol version.
 */
 bool is_ip_version_supported(
     struct net_state_t *net_state,
@@ -514,64 +1067,136 @@ bool is_protocol_supported(
     return false;
 }
 
+/*
+    Returns true if TCP probes of an IP version can be sent as raw
+    SYN segments.
+*/
+bool is_tcp_syn_supported(
+    const struct net_state_t *net_state,
+    int ip_version)
+{
+    if (ip_version == 4) {
+        return net_state->platform.ip4_tcp_recv_socket != 0;
+    } else if (ip_version == 6) {
+        return net_state->platform.tcp6_socket != 0;
+    } else {
+        return false;
+    }
+}
+
+/*
+    Kernel transmit timestamps are available for probes sent through
+    raw sockets, on systems with a socket error queue.
+*/
+bool is_kernel_timestamp_supported(
+    struct net_state_t *net_state)
+{
+#ifdef USE_TX_TIMESTAMPS
+    return net_state->platform.ip4_socket_raw
+        || net_state->platform.ip6_socket_raw;
+#else
+    return false;
+#endif
+}
+
 /*  Report an error during send_probe based on the errno value  */
 static
 void report_packet_error(
+    struct command_session_t *session,
     int command_token)
 {
+    char detail[32];
+
     if (errno == EINVAL) {
-        printf("%d invalid-argument\n", command_token);
+        report_reply(session, command_token, WIRE_REPLY_INVALID_ARGUMENT,
+                     NULL);
     } else if (errno == ENETDOWN) {
-        printf("%d network-down\n", command_token);
+        report_reply(session, command_token, WIRE_REPLY_NETWORK_DOWN,
+                     NULL);
     } else if (errno == ENETUNREACH) {
-        printf("%d no-route\n", command_token);
+        report_reply(session, command_token, WIRE_REPLY_NO_ROUTE, NULL);
     } else if (errno == EHOSTUNREACH) {
-        printf("%d no-route\n", command_token);
+        report_reply(session, command_token, WIRE_REPLY_NO_ROUTE, NULL);
     } else if (errno == EPERM) {
-        printf("%d permission-denied\n", command_token);
+        report_reply(session, command_token,
+                     WIRE_REPLY_PERMISSION_DENIED, NULL);
     } else if (errno == EADDRINUSE) {
-        printf("%d address-in-use\n", command_token);
+        report_reply(session, command_token, WIRE_REPLY_ADDRESS_IN_USE,
+                     NULL);
     } else if (errno == EADDRNOTAVAIL) {
-        printf("%d address-not-available\n", command_token);
+        report_reply(session, command_token,
+                     WIRE_REPLY_ADDRESS_NOT_AVAILABLE, NULL);
     } else {
-        printf("%d unexpected-error errno %d\n", command_token, errno);
+        snprintf(detail, sizeof(detail), "errno %d", errno);
+        report_reply(session, command_token, WIRE_REPLY_UNEXPECTED_ERROR,
+                     detail);
     }
 }
 
-/*  Craft a custom ICMP packet for a network probe.  */
-void send_probe(
+/*
+    Record the departure time of a probe about to be sent, and arrange
+    for a kernel timestamp to replace it, if the probe asked for one.
+*/
+static
+void start_probe_timing(
     struct net_state_t *net_state,
+    struct probe_t *probe,
     const struct probe_param_t *param)
 {
-    char packet[PACKET_BUFFER_SIZE];
+#ifdef USE_TX_TIMESTAMPS
+    if (param->kernel_timestamp) {
+        if (!net_state->platform.kernel_timestamps_enabled) {
+            enable_kernel_timestamps(net_state);
+        }
+        probe->platform.kernel_timestamp = true;
+    }
+#endif
+
+    if (get_probe_time(&probe->platform.departure_time)) {
+        perror("get_probe_time failure");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+    Allocate a probe and construct the packet to send for it.
+    If the probe can't be sent, a reply is issued for the command token
+    and NULL is returned.  A packet size of zero indicates that the
+    probe uses a stream socket, which has already been connected.
+*/
+static
+struct probe_t *prepare_probe(
+    struct net_state_t *net_state,
+    const struct probe_param_t *param,
+    char *packet,
+    int *packet_size)
+{
     struct probe_t *probe;
-    int packet_size;
     struct sockaddr_storage src_sockaddr;
 
     probe = alloc_probe(net_state, param->command_token);
     if (probe == NULL) {
-        printf("%d probes-exhausted\n", param->command_token);
-        return;
+        report_reply(net_state->session, param->command_token,
+                     WIRE_REPLY_PROBES_EXHAUSTED, NULL);
+        return NULL;
     }
 
     if (resolve_probe_addresses(net_state, param, &probe->remote_addr,
                 &src_sockaddr)) {
-        printf("%d invalid-argument\n", param->command_token);
+        report_reply(net_state->session, param->command_token,
+                     WIRE_REPLY_INVALID_ARGUMENT, NULL);
         free_probe(net_state, probe);
-        return;
+        return NULL;
     }
 
-    if (gettimeofday(&probe->platform.departure_time, NULL)) {
-        perror("gettimeofday failure");
-        exit(EXIT_FAILURE);
-    }
+    start_probe_timing(net_state, probe, param);
 
-    packet_size =
+    *packet_size =
         construct_packet(net_state, &probe->platform.socket,
                          probe->sequence, packet, PACKET_BUFFER_SIZE,
                          &probe->remote_addr, &src_sockaddr, param);
 
-    if (packet_size < 0) {
+    if (*packet_size < 0) {
         /*
            When using a stream protocol, FreeBSD will return ECONNREFUSED
            when connecting to localhost if the port doesn't exist,
@@ -582,25 +1207,742 @@ void send_probe(
             receive_probe(net_state, probe, ICMP_ECHOREPLY,
                           &probe->remote_addr, NULL, 0, NULL);
         } else {
-            report_packet_error(param->command_token);
+            report_packet_error(net_state->session, param->command_token);
             free_probe(net_state, probe);
         }
 
+        return NULL;
+    }
+
+    /*  A stream probe has no packet, and is sent by its connection  */
+    if (*packet_size == 0) {
+        record_probe_sent(&net_state->stats);
+        add_wait_probe_socket(net_state, probe);
+    }
+
+    return probe;
+}
+
+/*  Exchange two entries in the timeout heap  */
+static
+void swap_timeout_heap_entries(
+    struct net_state_platform_t *platform,
+    int a,
+    int b)
+{
+    struct probe_t *probe_a = platform->timeout_heap[a];
+    struct probe_t *probe_b = platform->timeout_heap[b];
+
+    platform->timeout_heap[a] = probe_b;
+    platform->timeout_heap[b] = probe_a;
+    probe_b->platform.timeout_heap_index = a;
+    probe_a->platform.timeout_heap_index = b;
+}
+
+/*  Returns true if the probe at heap index a times out before b  */
+static
+bool is_timeout_heap_less(
+    const struct net_state_platform_t *platform,
+    int a,
+    int b)
+{
+    return compare_timeval(platform->timeout_heap[a]->platform.timeout_time,
+                           platform->timeout_heap[b]->platform.
+                           timeout_time) < 0;
+}
+
+/*  Move a heap entry towards the root until the heap is ordered  */
+static
+void sift_timeout_heap_up(
+    struct net_state_platform_t *platform,
+    int index)
+{
+    int parent;
+
+    while (index > 0) {
+        parent = (index - 1) / 2;
+        if (!is_timeout_heap_less(platform, index, parent)) {
+            break;
+        }
+
+        swap_timeout_heap_entries(platform, index, parent);
+        index = parent;
+    }
+}
+
+/*  Move a heap entry away from the root until the heap is ordered  */
+static
+void sift_timeout_heap_down(
+    struct net_state_platform_t *platform,
+    int index)
+{
+    int child;
+
+    while (true) {
+        child = index * 2 + 1;
+        if (child >= platform->timeout_heap_count) {
+            break;
+        }
+
+        /*  Use the child with the sooner timeout  */
+        if (child + 1 < platform->timeout_heap_count
+            && is_timeout_heap_less(platform, child + 1, child)) {
+            child++;
+        }
+
+        if (!is_timeout_heap_less(platform, child, index)) {
+            break;
+        }
+
+        swap_timeout_heap_entries(platform, index, child);
+        index = child;
+    }
+}
+
+/*  Add a probe to the timeout heap  */
+static
+void insert_timeout_heap(
+    struct net_state_t *net_state,
+    struct probe_t *probe)
+{
+    struct net_state_platform_t *platform = &net_state->platform;
+    int index = platform->timeout_heap_count++;
+
+    assert(index < MAX_PROBES);
+
+    platform->timeout_heap[index] = probe;
+    probe->platform.timeout_heap_index = index;
+    sift_timeout_heap_up(platform, index);
+}
+
+/*  Remove a probe from the timeout heap, if it is present  */
+static
+void remove_timeout_heap(
+    struct net_state_t *net_state,
+    struct probe_t *probe)
+{
+    struct net_state_platform_t *platform = &net_state->platform;
+    int index = probe->platform.timeout_heap_index;
+    int last;
+
+    if (index < 0) {
+        return;
+    }
+
+    last = --platform->timeout_heap_count;
+    if (index != last) {
+        swap_timeout_heap_entries(platform, index, last);
+
+        /*  The entry moved into the gap may belong above or below it  */
+        sift_timeout_heap_up(platform, index);
+        sift_timeout_heap_down(platform, index);
+    }
+
+    probe->platform.timeout_heap_index = -1;
+}
+
+/*  Set the time at which a just-sent probe will be considered lost  */
+void set_probe_timeout(
+    struct net_state_t *net_state,
+    struct probe_t *probe,
+    const struct probe_param_t *param)
+{
+    struct timeval *timeout_time = &probe->platform.timeout_time;
+
+    *timeout_time = probe->platform.departure_time;
+    timeout_time->tv_sec += param->timeout_ms / 1000;
+    timeout_time->tv_usec += (param->timeout_ms % 1000) * 1000;
+    if (timeout_time->tv_usec >= 1000000) {
+        timeout_time->tv_sec++;
+        timeout_time->tv_usec -= 1000000;
+    }
+
+    insert_timeout_heap(net_state, probe);
+}
+
+/*
+    Sends are queued for the io_uring engine only when everything about
+    the packet is in headers we construct, as with raw IPv4 sockets.
+    Socket options, such as the IPv6 traffic class, are set as a probe
+    is prepared, and could be changed by a later probe before a queued
+    send is submitted.
+*/
+static
+bool is_queued_send_supported(
+    const struct net_state_t *net_state,
+    const struct probe_param_t *param)
+{
+    return net_state->platform.uring != NULL && param->ip_version == 4
+        && net_state->platform.ip4_socket_raw && !param->routing_mark;
+}
+
+/*
+    Queue a probe packet for transmission by the io_uring engine.
+    Returns false if the packet should be sent immediately instead.
+*/
+static
+bool queue_probe_packet(
+    struct net_state_t *net_state,
+    const struct probe_param_t *param,
+    struct probe_t *probe,
+    char *packet,
+    int packet_size)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    int send_socket;
+    int sockaddr_length;
+
+    if (!is_queued_send_supported(net_state, param)) {
+        return false;
+    }
+
+    send_socket = select_send_socket(net_state, param, probe->sequence,
+                                     &probe->remote_addr,
+                                     &sockaddr_length);
+    if (send_socket == 0) {
+        return false;
+    }
+
+    iov.iov_base = packet;
+    iov.iov_len = packet_size;
+
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_name = &probe->remote_addr;
+    msg.msg_namelen = sockaddr_length;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    return queue_uring_send(net_state, send_socket, probe, &msg);
+}
+
+/*
+    Complete a send queued by the io_uring engine, given the result
+    of the sendmsg.  If the send failed, the probe's error is reported
+    as it would have been had we sent the packet immediately.
+*/
+void complete_queued_send(
+    struct net_state_t *net_state,
+    int socket,
+    int sequence,
+    int result)
+{
+    struct probe_t *probe;
+
+    if (result < 0) {
+        errno = -result;
+    }
+    record_transmission(net_state, socket, sequence, result >= 0);
+
+    probe = find_probe_by_sequence(net_state, sequence);
+    if (result >= 0 || probe == NULL) {
+        return;
+    }
+
+    report_packet_error(probe->session, probe->token);
+    free_probe(net_state, probe);
+}
+
+/*  Craft a custom ICMP packet for a network probe.  */
+void send_probe(
+    struct net_state_t *net_state,
+    const struct probe_param_t *param)
+{
+    char packet[PACKET_BUFFER_SIZE];
+    struct probe_t *probe;
+    int packet_size;
+
+    if (net_state->platform.threads
+        && forward_probes(net_state, param, 1)) {
+        return;
+    }
+
+    if (net_state->platform.simulation) {
+        send_simulated_probe(net_state, param);
+        return;
+    }
+
+    probe = prepare_probe(net_state, param, packet, &packet_size);
+    if (probe == NULL) {
+        return;
+    }
+
+    if (packet_size > 0
+        && !queue_probe_packet(net_state, param, probe, packet,
+                               packet_size)) {
+        if (send_packet(net_state, param, probe->sequence,
+                        packet, packet_size, &probe->remote_addr) == -1) {
+
+            report_packet_error(net_state->session, param->command_token);
+            free_probe(net_state, probe);
+            return;
+        }
+    }
+
+    set_probe_timeout(net_state, probe, param);
+}
+
+/*
+    A prebuilt template packet can be used when the time-to-live and
+    the sequence number are both in headers we construct, and there
+    are no per-probe socket options to apply.
+*/
+static
+bool is_template_packet_supported(
+    const struct net_state_t *net_state,
+    const struct probe_param_t *param)
+{
+    if (param->protocol != IPPROTO_ICMP && param->protocol != IPPROTO_UDP) {
+        return false;
+    }
+
+    return param->ip_version == 4 && net_state->platform.ip4_socket_raw
+        && !param->routing_mark;
+}
+
+/*
+    Ensure the prebuilt packet of a template is present and current.
+    The packet is rebuilt when the source cache has been invalidated or
+    has expired since the packet was built, as the source address in
+    the packet may no longer be correct.  Returns false if the packet
+    can't be built, in which case the probe should be sent normally.
+*/
+static
+bool prepare_template_packet(
+    struct net_state_t *net_state,
+    struct probe_template_t *probe_template,
+    const struct probe_param_t *param)
+{
+    struct probe_template_platform_t *platform = &probe_template->platform;
+    struct sockaddr_storage src_sockaddr;
+    struct timeval now;
+
+    if (!is_template_packet_supported(net_state, param)) {
+        return false;
+    }
+
+    if (get_probe_time(&now)) {
+        perror("get_probe_time failure");
+        exit(EXIT_FAILURE);
+    }
+
+    if (platform->packet
+        && platform->source_cache_generation ==
+        net_state->source_cache_generation
+        && compare_timeval(now, platform->expire_time) < 0) {
+        return true;
+    }
+
+    if (platform->packet == NULL) {
+        platform->packet = malloc(PACKET_BUFFER_SIZE);
+        if (platform->packet == NULL) {
+            return false;
+        }
+    }
+
+    platform->packet_size = 0;
+    if (resolve_probe_addresses(net_state, param, &platform->dest_addr,
+                                &src_sockaddr)) {
+        return false;
+    }
+
+    platform->packet_size =
+        construct_packet(net_state, NULL, 0, platform->packet,
+                         PACKET_BUFFER_SIZE, &platform->dest_addr,
+                         &src_sockaddr, param);
+    if (platform->packet_size <= 0) {
+        return false;
+    }
+
+    platform->sequence = 0;
+    platform->source_cache_generation = net_state->source_cache_generation;
+    platform->expire_time = now;
+    platform->expire_time.tv_sec += SOURCE_CACHE_TIMEOUT;
+
+    return true;
+}
+
+/*
+    Send a probe defined by a template.  When possible, the template's
+    prebuilt packet is sent after patching only the time-to-live, the
+    sequence number and the checksum.  Otherwise, we send the probe as
+    we would for send-probe, with the template's parameters.
+*/
+void send_probe_template(
+    struct net_state_t *net_state,
+    struct probe_template_t *probe_template,
+    int command_token,
+    int ttl,
+    int timeout_ms)
+{
+    struct probe_template_platform_t *platform = &probe_template->platform;
+    struct probe_param_t param = probe_template->param;
+    struct probe_t *probe;
+
+    param.command_token = command_token;
+    param.ttl = ttl;
+    if (timeout_ms >= 0) {
+        param.timeout_ms = timeout_ms;
+    }
+
+    if (net_state->platform.threads
+        && forward_probes(net_state, &param, 1)) {
+        return;
+    }
+
+    if (!prepare_template_packet(net_state, probe_template, &param)) {
+        send_probe(net_state, &param);
+        return;
+    }
+
+    probe = alloc_probe(net_state, command_token);
+    if (probe == NULL) {
+        report_reply(net_state->session, command_token,
+                     WIRE_REPLY_PROBES_EXHAUSTED, NULL);
+        return;
+    }
+
+    probe->remote_addr = platform->dest_addr;
+    start_probe_timing(net_state, probe, &param);
+
+    patch_ip4_packet(platform->packet, platform->sequence,
+                     probe->sequence, &param);
+    platform->sequence = probe->sequence;
+
+    if (!queue_probe_packet(net_state, &param, probe, platform->packet,
+                            platform->packet_size)
+        && send_packet(net_state, &param, probe->sequence,
+                       platform->packet, platform->packet_size,
+                       &probe->remote_addr) == -1) {
+
+        report_packet_error(net_state->session, command_token);
+        free_probe(net_state, probe);
+        return;
+    }
+
+    set_probe_timeout(net_state, probe, &param);
+}
+
+/*  Free the prebuilt packet of a template which is being replaced  */
+void platform_free_probe_template(
+    struct probe_template_t *probe_template)
+{
+    free(probe_template->platform.packet);
+    probe_template->platform.packet = NULL;
+}
+
+#ifdef HAVE_SENDMMSG
+/*
+    Probes can only share a sendmmsg call when the time-to-live of
+    each packet can be specified without changing the options of the
+    shared socket.  For raw IPv4 sockets, the time-to-live is part of
+    the IP header we construct.  For IPv6, we attach the hop limit to
+    each message as ancillary data.  Stream protocols always need a
+    socket per probe, unless TCP probes are sent as SYN segments.
+*/
+static
+bool is_batch_supported(
+    const struct net_state_t *net_state,
+    const struct probe_param_t *param)
+{
+    if (net_state->platform.simulation) {
+        return false;
+    }
+
+    if (param->protocol != IPPROTO_ICMP && param->protocol != IPPROTO_UDP
+        && !is_tcp_syn_probe(net_state, param)) {
+        return false;
+    }
+
+    if (param->ip_version == 4) {
+        return net_state->platform.ip4_socket_raw;
+    }
+#ifdef IPV6_HOPLIMIT
+    if (param->ip_version == 6) {
+        return true;
+    }
+#endif
+
+    return false;
+}
+
+/*
+    The space for the packets of a batch: room for a full batch of
+    probes of typical size, or fewer larger ones, and for constructing
+    one more of the largest size.
+*/
+#define SEND_BATCH_PACKET_SPACE \
+    (MAX_BATCH_PROBES * 128 + PACKET_BUFFER_SIZE)
+
+/*  Packets constructed for a batch, waiting for transmission  */
+struct send_batch_t {
+    /*  The number of packets in the batch  */
+    int count;
+
+    /*  The socket on which the batch will be sent  */
+    int socket;
+
+    /*  The probe associated with each packet  */
+    struct probe_t *probe[MAX_BATCH_PROBES];
+
+    /*  The probe parameters used for each packet  */
+    const struct probe_param_t *param[MAX_BATCH_PROBES];
+
+    /*  Message headers for sendmmsg  */
+    struct mmsghdr msg[MAX_BATCH_PROBES];
+
+    /*  I/O vectors pointing at the packet content  */
+    struct iovec iov[MAX_BATCH_PROBES];
+
+#ifdef IPV6_HOPLIMIT
+    /*  Ancillary data carrying the IPv6 hop limit of each packet  */
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control[MAX_BATCH_PROBES];
+#endif
+
+    /*  The bytes of packet content in use  */
+    int packet_used;
+
+    /*
+       The packet content, packed one after another.  When there is
+       no longer room to construct a packet of the largest size, the
+       batch is sent to make room.
+     */
+    union {
+        char buf[SEND_BATCH_PACKET_SPACE];
+        uint64_t align;
+    } packet;
+};
+
+/*
+    The batch storage is large, so it is allocated only when first
+    used.  Each thread's net state has storage of its own.
+*/
+static
+struct send_batch_t *get_send_batch(
+    struct net_state_t *net_state)
+{
+    if (net_state->platform.send_batch == NULL) {
+        net_state->platform.send_batch =
+            calloc(1, sizeof(struct send_batch_t));
+        if (net_state->platform.send_batch == NULL) {
+            perror("Failure allocating send batch");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return net_state->platform.send_batch;
+}
+
+/*
+    Transmit all the packets in a batch with as few calls to sendmmsg
+    as possible.  All probes in the batch share a departure time,
+    taken immediately before transmission.
+*/
+static
+void flush_send_batch(
+    struct net_state_t *net_state,
+    struct send_batch_t *batch)
+{
+    struct timeval departure_time;
+    int sent = 0;
+    int count;
+    int i;
+
+    if (batch->count == 0) {
+        return;
+    }
+
+    if (get_probe_time(&departure_time)) {
+        perror("get_probe_time failure");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < batch->count; i++) {
+        batch->probe[i]->platform.departure_time = departure_time;
+    }
+
+    /*  The io_uring engine will submit queued sends when we next wait  */
+    while (sent < batch->count
+           && is_queued_send_supported(net_state, batch->param[sent])
+           && queue_uring_send(net_state, batch->socket, batch->probe[sent],
+                               &batch->msg[sent].msg_hdr)) {
+        sent++;
+    }
+
+    while (sent < batch->count) {
+        count = COUNT_SYSCALL(&net_state->stats,
+                              sendmmsg(batch->socket, &batch->msg[sent],
+                                       batch->count - sent, 0));
+
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            /*
+               The first unsent packet has failed.  Report it, and
+               continue with the remainder of the batch.
+             */
+            record_transmission(net_state, batch->socket,
+                                batch->probe[sent]->sequence, false);
+            report_packet_error(net_state->session,
+                                batch->param[sent]->command_token);
+            free_probe(net_state, batch->probe[sent]);
+            batch->probe[sent] = NULL;
+            sent++;
+            continue;
+        }
+
+        for (i = sent; i < sent + count; i++) {
+            record_transmission(net_state, batch->socket,
+                                batch->probe[i]->sequence, true);
+        }
+        sent += count;
+    }
+
+    for (i = 0; i < batch->count; i++) {
+        if (batch->probe[i]) {
+            set_probe_timeout(net_state, batch->probe[i],
+                              batch->param[i]);
+        }
+    }
+
+    batch->count = 0;
+    batch->packet_used = 0;
+}
+
+/*
+    Construct the packet for a probe and add it to the batch.
+    Returns false if the probe can't be batched, in which case
+    it should be sent individually.
+*/
+static
+bool add_to_send_batch(
+    struct net_state_t *net_state,
+    struct send_batch_t *batch,
+    const struct probe_param_t *param)
+{
+    struct probe_t *probe;
+    struct msghdr *msg;
+    char *packet;
+    int packet_size;
+    int send_socket;
+    int sockaddr_length;
+    int index = batch->count;
+
+    if (!is_batch_supported(net_state, param)) {
+        return false;
+    }
+
+    if (batch->packet_used + PACKET_BUFFER_SIZE > SEND_BATCH_PACKET_SPACE) {
+        flush_send_batch(net_state, batch);
+        index = 0;
+    }
+    packet = &batch->packet.buf[batch->packet_used];
+
+    probe = prepare_probe(net_state, param, packet, &packet_size);
+    if (probe == NULL) {
+        return true;
+    }
+
+    send_socket = select_send_socket(net_state, param, probe->sequence,
+                                     &probe->remote_addr,
+                                     &sockaddr_length);
+    if (send_socket == 0) {
+        errno = EINVAL;
+        report_packet_error(net_state->session, param->command_token);
+        free_probe(net_state, probe);
+        return true;
+    }
+
+    /*  All packets in a batch must share the same socket  */
+    if (batch->count > 0 && batch->socket != send_socket) {
+        flush_send_batch(net_state, batch);
+        memmove(batch->packet.buf, packet, packet_size);
+        packet = batch->packet.buf;
+        index = 0;
+    }
+
+    batch->socket = send_socket;
+    batch->probe[index] = probe;
+    batch->param[index] = param;
+
+    batch->iov[index].iov_base = packet;
+    batch->iov[index].iov_len = packet_size;
+
+    msg = &batch->msg[index].msg_hdr;
+    memset(msg, 0, sizeof(struct msghdr));
+    msg->msg_name = &probe->remote_addr;
+    msg->msg_namelen = sockaddr_length;
+    msg->msg_iov = &batch->iov[index];
+    msg->msg_iovlen = 1;
+
+#ifdef IPV6_HOPLIMIT
+    if (param->ip_version == 6) {
+        struct cmsghdr *cm;
+
+        msg->msg_control = batch->control[index].buf;
+        msg->msg_controllen = sizeof(batch->control[index].buf);
+
+        cm = CMSG_FIRSTHDR(msg);
+        cm->cmsg_level = IPPROTO_IPV6;
+        cm->cmsg_type = IPV6_HOPLIMIT;
+        cm->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cm), &param->ttl, sizeof(int));
+    }
+#endif
+
+    batch->count = index + 1;
+
+    /*  The next packet's headers are kept aligned  */
+    batch->packet_used = packet - batch->packet.buf + packet_size;
+    batch->packet_used = (batch->packet_used + 7) & ~7;
+
+    return true;
+}
+#endif
+
+/*
+    Send a group of probes, which differ only in their command token
+    and time-to-live.  Where possible, the packets are transmitted with
+    a single sendmmsg call.  Replies are identical to those of probes
+    sent individually.
+*/
+void send_probe_batch(
+    struct net_state_t *net_state,
+    const struct probe_param_t *params,
+    int probe_count)
+{
+#ifdef HAVE_SENDMMSG
+    struct send_batch_t *batch;
+#endif
+    int i;
+
+    /*  A batch is sent by a single thread  */
+    if (net_state->platform.threads
+        && forward_probes(net_state, params, probe_count)) {
         return;
     }
+#ifdef HAVE_SENDMMSG
+    batch = get_send_batch(net_state);
+#endif
 
-    if (packet_size > 0) {
-        if (send_packet(net_state, param, probe->sequence,
-                        packet, packet_size, &probe->remote_addr) == -1) {
-
-            report_packet_error(param->command_token);
-            free_probe(net_state, probe);
-            return;
+    for (i = 0; i < probe_count; i++) {
+#ifdef HAVE_SENDMMSG
+        if (add_to_send_batch(net_state, batch, &params[i])) {
+            continue;
         }
+#endif
+
+        send_probe(net_state, &params[i]);
     }
 
-    probe->platform.timeout_time = probe->platform.departure_time;
-    probe->platform.timeout_time.tv_sec += param->timeout;
+#ifdef HAVE_SENDMMSG
+    flush_send_batch(net_state, batch);
+#endif
 }
 
 /*  When allocating a probe, assign it a unique port number  */
@@ -609,10 +1951,78 @@ void platform_alloc_probe(
     struct probe_t *probe)
 {
     probe->sequence = net_state->platform.next_sequence++;
+    probe->platform.timeout_heap_index = -1;
+
+    if (net_state->platform.next_sequence >
+        net_state->platform.max_sequence) {
+        net_state->platform.next_sequence =
+            net_state->platform.min_sequence;
+    }
+}
+
+/*
+    Note that the wait found the socket of a probe ready, so that
+    receive_replies will check that probe's connection.
+*/
+void mark_probe_ready(
+    struct net_state_t *net_state,
+    struct probe_t *probe)
+{
+    struct net_state_platform_t *platform = &net_state->platform;
+
+    if (probe->platform.ready) {
+        return;
+    }
+
+    if (platform->ready_probes == NULL) {
+        platform->ready_probes = calloc(MAX_PROBES, sizeof(struct probe_t *));
+        if (platform->ready_probes == NULL) {
+            perror("Failure allocating ready probes");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    probe->platform.ready = true;
+    platform->ready_probes[platform->ready_probe_count++] = probe;
+}
+
+/*  Note the probes whose sockets are set in the result of a select  */
+void mark_ready_probe_sockets(
+    struct net_state_t *net_state,
+    const fd_set * write_set)
+{
+    struct probe_t *probe;
+
+    LIST_FOREACH(probe, &net_state->outstanding_probes, probe_list_entry) {
+        if (probe->platform.socket
+            && FD_ISSET(probe->platform.socket, write_set)) {
+            mark_probe_ready(net_state, probe);
+        }
+    }
+}
+
+/*  Remove a probe being freed from the ready probes  */
+static
+void forget_ready_probe(
+    struct net_state_t *net_state,
+    struct probe_t *probe)
+{
+    struct net_state_platform_t *platform = &net_state->platform;
+    int i;
+
+    if (!probe->platform.ready) {
+        return;
+    }
 
-    if (net_state->platform.next_sequence > MAX_PORT) {
-        net_state->platform.next_sequence = MIN_PORT;
+    for (i = 0; i < platform->ready_probe_count; i++) {
+        if (platform->ready_probes[i] == probe) {
+            platform->ready_probes[i] =
+                platform->ready_probes[--platform->ready_probe_count];
+            break;
+        }
     }
+
+    probe->platform.ready = false;
 }
 
 /*
@@ -620,10 +2030,16 @@ void platform_alloc_probe(
     if one has been opened
 */
 void platform_free_probe(
+    struct net_state_t *net_state,
     struct probe_t *probe)
 {
+    remove_timeout_heap(net_state, probe);
+    uring_forget_probe(net_state, probe);
+    forget_ready_probe(net_state, probe);
+
     if (probe->platform.socket) {
-        close(probe->platform.socket);
+        remove_wait_probe_socket(net_state, probe);
+        COUNT_SYSCALL(&net_state->stats, close(probe->platform.socket));
         probe->platform.socket = 0;
     }
 }
@@ -646,17 +2062,36 @@ void receive_probe(
     struct timeval now;
 
     if (timestamp == NULL) {
-        if (gettimeofday(&now, NULL)) {
-            perror("gettimeofday failure");
+        if (get_probe_time(&now)) {
+            perror("get_probe_time failure");
             exit(EXIT_FAILURE);
         }
 
         timestamp = &now;
     }
 
-    round_trip_us =
-        (timestamp->tv_sec - departure_time->tv_sec) * 1000000 +
-        timestamp->tv_usec - departure_time->tv_usec;
+    /*
+       A packet ring timestamps replies as they arrive, but may hand
+       them to us only after its block timeout, so from a ring an
+       earlier timestamp belongs to a reply to an earlier packet with
+       the same sequence number, such as the ping sent by
+       check_length_order.  Elsewhere, it comes of kernel and user
+       timestamps which disagree, and the reply is valid.
+     */
+    if (compare_timeval(*timestamp, *departure_time) < 0) {
+        if (net_state->platform.ring.reading) {
+            return;
+        }
+        round_trip_us = 0;
+    } else {
+        round_trip_us =
+            (timestamp->tv_sec - departure_time->tv_sec) * 1000000 +
+            timestamp->tv_usec - departure_time->tv_usec;
+    }
+
+    TRACE_PROBE4(mtr_packet, receive_probe, probe->token, probe->sequence,
+                 (long long) timestamp->tv_sec * 1000000 +
+                 timestamp->tv_usec, round_trip_us);
 
     respond_to_probe(net_state, probe, icmp_type,
                      remote_addr, round_trip_us, mpls_count, mpls);
@@ -700,14 +2135,15 @@ void receive_replies_from_recv_socket(
         msg.msg_namelen = sizeof(remote_addr);
         msg.msg_control = control;
         msg.msg_controllen = sizeof(control);
-        packet_length = recvmsg(socket, &msg, flag);
+        packet_length =
+            COUNT_SYSCALL(&net_state->stats, recvmsg(socket, &msg, flag));
 
         /*
            Get the time immediately after reading the packet to
            keep the timing as precise as we can.
          */
-        if (gettimeofday(&timestamp, NULL)) {
-            perror("gettimeofday failure");
+        if (get_probe_time(&timestamp)) {
+            perror("get_probe_time failure");
             exit(EXIT_FAILURE);
         }
 
@@ -731,7 +2167,9 @@ void receive_replies_from_recv_socket(
                 int err;
 
                 do {
-                  err = getsockopt(socket, SOL_SOCKET, SO_ERROR, &so_err, &so_err_size);
+                  err = COUNT_SYSCALL(&net_state->stats,
+                                      getsockopt(socket, SOL_SOCKET, SO_ERROR,
+                                                 &so_err, &so_err_size));
                 } while (err < 0 && errno == EINTR);
                 continue;
             }
@@ -791,7 +2229,9 @@ void receive_replies_from_recv_socket(
             /* handle packet based on send socket protocol */
             int proto, length = sizeof(int);
 
-            if (getsockopt(socket, SOL_SOCKET, SO_PROTOCOL, &proto, &length) < 0) {
+            if (COUNT_SYSCALL(&net_state->stats,
+                              getsockopt(socket, SOL_SOCKET, SO_PROTOCOL,
+                                         &proto, &length)) < 0) {
                 perror("getsockopt SO_PROTOCOL error");
                 exit(EXIT_FAILURE);
             }
@@ -808,6 +2248,230 @@ void receive_replies_from_recv_socket(
     }
 }
 
+/*
+    Extract the kernel receive timestamp from the control data of a
+    received message, if one is present.  Returns false if there is
+    no timestamp in the control data.
+*/
+bool get_control_timestamp(
+    struct msghdr *msg,
+    struct timeval *timestamp)
+{
+#ifdef SO_TIMESTAMP
+    struct cmsghdr *cm;
+
+    for (cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMP) {
+            memcpy(timestamp, CMSG_DATA(cm), sizeof(struct timeval));
+            return true;
+        }
+    }
+#endif
+
+    return false;
+}
+
+#ifdef HAVE_RECVMMSG
+/*  The maximum number of packets to read with a single recvmmsg call  */
+#define RECV_BATCH_SIZE 16
+
+/*  A preallocated buffer for one packet read with recvmmsg  */
+struct recv_slot_t {
+    /*  Control data, which will contain the receive timestamp  */
+    char control[256];
+
+    /*  The address from which the packet was sent  */
+    struct sockaddr_storage remote_addr;
+
+    /*  The I/O vector pointing at the packet content  */
+    struct iovec iov;
+
+    /*  The packet content  */
+    char packet[PACKET_BUFFER_SIZE];
+};
+
+/*  The storage for reading packets with recvmmsg  */
+struct recv_batch_t {
+    /*  The preallocated packet buffers  */
+    struct recv_slot_t slots[RECV_BATCH_SIZE];
+
+    /*  Message headers for recvmmsg  */
+    struct mmsghdr msgs[RECV_BATCH_SIZE];
+
+    /*  true if recvmmsg has failed with ENOSYS  */
+    bool recvmmsg_unsupported;
+};
+
+/*  Allocate receive storage when first used, as for send batches  */
+static
+struct recv_batch_t *get_recv_batch(
+    struct net_state_t *net_state)
+{
+    if (net_state->platform.recv_batch == NULL) {
+        net_state->platform.recv_batch =
+            calloc(1, sizeof(struct recv_batch_t));
+        if (net_state->platform.recv_batch == NULL) {
+            perror("Failure allocating receive batch");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return net_state->platform.recv_batch;
+}
+
+/*
+    Read packets from a raw receive socket using recvmmsg, which
+    retrieves up to RECV_BATCH_SIZE datagrams with a single system call.
+    The packet slots are preallocated, and each has its own control
+    buffer, so that every datagram carries its own receive timestamp.
+
+    Returns false if recvmmsg reported an error other than EAGAIN,
+    in which case the caller should fall back to reading with recvmsg,
+    which knows how to deal with the remaining error cases.
+*/
+static
+bool receive_batch_from_recv_socket(
+    struct net_state_t *net_state,
+    int socket,
+    received_packet_func_t handle_received_packet)
+{
+    struct recv_batch_t *batch = get_recv_batch(net_state);
+    struct recv_slot_t *slots = batch->slots;
+    struct mmsghdr *msgs = batch->msgs;
+    struct msghdr *msg;
+    struct timeval now;
+    struct timeval timestamp;
+    struct timeval kernel_offset;
+    int packet_count;
+    int i;
+
+    if (batch->recvmmsg_unsupported) {
+        return false;
+    }
+
+    do {
+        for (i = 0; i < RECV_BATCH_SIZE; i++) {
+            msg = &msgs[i].msg_hdr;
+
+            slots[i].iov.iov_base = slots[i].packet;
+            slots[i].iov.iov_len = sizeof(slots[i].packet);
+
+            memset(msg, 0, sizeof(struct msghdr));
+            msg->msg_iov = &slots[i].iov;
+            msg->msg_iovlen = 1;
+            msg->msg_name = (struct sockaddr *) &slots[i].remote_addr;
+            msg->msg_namelen = sizeof(slots[i].remote_addr);
+            msg->msg_control = slots[i].control;
+            msg->msg_controllen = sizeof(slots[i].control);
+        }
+
+        packet_count =
+            COUNT_SYSCALL(&net_state->stats,
+                          recvmmsg(socket, msgs, RECV_BATCH_SIZE, 0, NULL));
+
+        /*
+           If the kernel didn't timestamp the packets for us, this is
+           the best approximation of the arrival time we have.
+         */
+        if (get_probe_time(&now) || get_kernel_time_offset(&kernel_offset)) {
+            perror("get_probe_time failure");
+            exit(EXIT_FAILURE);
+        }
+
+        if (packet_count == -1) {
+            if (errno == EAGAIN) {
+                return true;
+            }
+
+            if (errno == ENOSYS) {
+                batch->recvmmsg_unsupported = true;
+            }
+
+            return false;
+        }
+
+        for (i = 0; i < packet_count; i++) {
+            msg = &msgs[i].msg_hdr;
+
+            if (get_control_timestamp(msg, &timestamp)) {
+                kernel_to_probe_time(&timestamp, &kernel_offset);
+            } else {
+                timestamp = now;
+            }
+
+            handle_received_packet(net_state, &slots[i].remote_addr,
+                                   slots[i].packet, msgs[i].msg_len,
+                                   &timestamp);
+        }
+
+        /*
+           A short batch means the receive queue has been drained,
+           so we can avoid the system call which would return EAGAIN.
+         */
+    } while (packet_count == RECV_BATCH_SIZE);
+
+    return true;
+}
+#endif
+
+/*
+    Read packets from one of the raw receive sockets.  recvmmsg is
+    used, when available, to reduce the number of system calls
+    required when many replies arrive at once.
+*/
+static
+void receive_replies_from_raw_socket(
+    struct net_state_t *net_state,
+    int socket,
+    received_packet_func_t handle_received_packet)
+{
+    /*  Multishot receives read the socket as packets arrive  */
+    if (is_uring_receiving(net_state, socket)) {
+        return;
+    }
+#ifdef HAVE_RECVMMSG
+    if (receive_batch_from_recv_socket(net_state, socket,
+                                       handle_received_packet)) {
+        return;
+    }
+#endif
+
+    receive_replies_from_recv_socket(net_state, socket,
+                                     handle_received_packet);
+}
+
+/*
+    An ICMP error, such as an expired time-to-live, is reported to the
+    probe's socket as soon as it arrives, but may reach us through the
+    packet ring only after the ring's block timeout.  Rather than report
+    the less specific socket error first, we wait until the ICMP packet
+    would have reached us, and report the socket error then if the
+    probe hasn't been answered.
+*/
+static
+void defer_probe_error(
+    struct net_state_t *net_state,
+    struct probe_t *probe,
+    int err)
+{
+    /*  The socket has nothing more to tell us  */
+    remove_wait_probe_socket(net_state, probe);
+    COUNT_SYSCALL(&net_state->stats, close(probe->platform.socket));
+    probe->platform.socket = 0;
+
+    remove_timeout_heap(net_state, probe);
+
+    if (get_probe_time(&probe->platform.timeout_time)) {
+        perror("get_probe_time failure");
+        exit(EXIT_FAILURE);
+    }
+    probe->platform.timeout_time.tv_usec += RING_DELIVERY_TIME;
+    normalize_timeval(&probe->platform.timeout_time);
+    probe->platform.deferred_error = err;
+
+    insert_timeout_heap(net_state, probe);
+}
+
 /*
     Attempt to send using the probe's socket, in order to check whether
     the connection has completed, for stream oriented protocols such as
@@ -819,39 +2483,43 @@ void receive_replies_from_probe_socket(
     struct probe_t *probe)
 {
     int probe_socket;
-    struct timeval zero_time;
     int err;
     int err_length = sizeof(int);
-    fd_set write_set;
+    struct pollfd poll_fd;
 
     probe_socket = probe->platform.socket;
     if (!probe_socket) {
         return;
     }
 
-    FD_ZERO(&write_set);
-    FD_SET(probe_socket, &write_set);
-
-    zero_time.tv_sec = 0;
-    zero_time.tv_usec = 0;
+    /*
+       Use poll rather than select, so that we aren't limited to
+       descriptors below FD_SETSIZE when many probes are outstanding.
+     */
+    poll_fd.fd = probe_socket;
+    poll_fd.events = POLLOUT;
+    poll_fd.revents = 0;
 
-    if (select(probe_socket + 1, NULL, &write_set, NULL, &zero_time) == -1) {
-        if (errno == EAGAIN) {
+    if (COUNT_SYSCALL(&net_state->stats, poll(&poll_fd, 1, 0)) == -1) {
+        if (errno == EAGAIN || errno == EINTR) {
             return;
         } else {
-            perror("probe socket select error");
+            perror("probe socket poll error");
             exit(EXIT_FAILURE);
         }
     }
 
     /*
        If the socket is writable, the connection attempt has completed.
+       A failed connection may be reported as an error or hangup instead.
      */
-    if (!FD_ISSET(probe_socket, &write_set)) {
+    if (!(poll_fd.revents & (POLLOUT | POLLERR | POLLHUP))) {
         return;
     }
 
-    if (getsockopt(probe_socket, SOL_SOCKET, SO_ERROR, &err, &err_length)) {
+    if (COUNT_SYSCALL(&net_state->stats,
+                      getsockopt(probe_socket, SOL_SOCKET, SO_ERROR, &err,
+                                 &err_length))) {
         perror("probe socket SO_ERROR");
         exit(EXIT_FAILURE);
     }
@@ -863,26 +2531,182 @@ void receive_replies_from_probe_socket(
     if (!err || err == ECONNREFUSED) {
         receive_probe(net_state, probe, ICMP_ECHOREPLY,
                       &probe->remote_addr, NULL, 0, NULL);
+    } else if (net_state->platform.ring.socket
+               && (err == EHOSTUNREACH || err == ENETUNREACH)) {
+        defer_probe_error(net_state, probe, err);
     } else {
         errno = err;
-        report_packet_error(probe->token);
+        report_packet_error(probe->session, probe->token);
         free_probe(net_state, probe);
     }
 }
 
+#ifdef USE_TX_TIMESTAMPS
+/*
+    Replace the departure time of a probe with the kernel's transmit
+    timestamp, if the probe asked for one.  The identifier is the count
+    of packets sent on the socket before the stamped packet.
+*/
+static
+void apply_tx_timestamp(
+    struct net_state_t *net_state,
+    struct tx_timestamp_socket_t *tx_timestamp,
+    unsigned int id,
+    struct timeval *timestamp)
+{
+    struct probe_t *probe;
+    int sequence;
+
+    /*  Ignore identifiers too old to be in the ring, or not yet sent  */
+    if (tx_timestamp->next_id - id - 1 >= TX_TIMESTAMP_RING_SIZE) {
+        return;
+    }
+
+    sequence = tx_timestamp->sequence[id % TX_TIMESTAMP_RING_SIZE];
+    probe = find_probe_by_sequence(net_state, sequence);
+    if (probe == NULL || !probe->platform.kernel_timestamp) {
+        return;
+    }
+
+    /*
+       The kernel can't have transmitted the packet before we started
+       constructing it, so an earlier timestamp must belong to another
+       packet.
+     */
+    if (compare_timeval(*timestamp, probe->platform.departure_time) < 0) {
+        return;
+    }
+
+    probe->platform.departure_time = *timestamp;
+    probe->platform.kernel_timestamp = false;
+}
+
+/*
+    Read the transmit timestamps queued on the error queue of a sending
+    socket.  This must happen before reading replies, so that the round
+    trip time of a reply is computed from the kernel's departure time.
+*/
+static
+void receive_tx_timestamps(
+    struct net_state_t *net_state,
+    struct tx_timestamp_socket_t *tx_timestamp)
+{
+    char control[512];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct scm_timestamping *stamps;
+    struct sock_extended_err *ee;
+    struct timeval kernel_offset;
+    struct timeval timestamp;
+    bool have_timestamp;
+    bool have_id;
+    unsigned int id;
+
+    if (get_kernel_time_offset(&kernel_offset)) {
+        perror("get_kernel_time_offset failure");
+        exit(EXIT_FAILURE);
+    }
+
+    while (true) {
+        memset(&msg, 0, sizeof(struct msghdr));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (COUNT_SYSCALL(&net_state->stats,
+                          recvmsg(tx_timestamp->socket, &msg,
+                                  MSG_ERRQUEUE | MSG_DONTWAIT)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            /*  EAGAIN indicates the queue is empty  */
+            return;
+        }
+
+        have_timestamp = false;
+        have_id = false;
+        id = 0;
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (cm->cmsg_level == SOL_SOCKET
+                && cm->cmsg_type == SCM_TIMESTAMPING) {
+
+                /*  The first entry is the software timestamp  */
+                stamps = (struct scm_timestamping *) CMSG_DATA(cm);
+                timestamp.tv_sec = stamps->ts[0].tv_sec;
+                timestamp.tv_usec = stamps->ts[0].tv_nsec / 1000;
+                have_timestamp = true;
+            } else if ((cm->cmsg_level == SOL_IP
+                        && cm->cmsg_type == IP_RECVERR)
+                       || (cm->cmsg_level == SOL_IPV6
+                           && cm->cmsg_type == IPV6_RECVERR)) {
+
+                ee = (struct sock_extended_err *) CMSG_DATA(cm);
+                if (ee->ee_errno == ENOMSG
+                    && ee->ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
+                    id = ee->ee_data;
+                    have_id = true;
+                }
+            }
+        }
+
+        if (have_timestamp && have_id) {
+            kernel_to_probe_time(&timestamp, &kernel_offset);
+            apply_tx_timestamp(net_state, tx_timestamp, id, &timestamp);
+        }
+    }
+}
+#endif
+
 /*  Check both the IPv4 and IPv6 sockets for incoming packets  */
 void receive_replies(
     struct net_state_t *net_state)
 {
     struct probe_t *probe;
-    struct probe_t *probe_safe_iter;
+    bool ring_ip4 = false;
+    bool ring_ip6 = false;
+#ifdef USE_TX_TIMESTAMPS
+    int i;
+#endif
+
+    if (net_state->platform.simulation) {
+        receive_simulated_replies(net_state);
+        return;
+    }
+#ifdef USE_TX_TIMESTAMPS
+
+    if (net_state->platform.kernel_timestamps_enabled) {
+        for (i = 0; i < TX_TIMESTAMP_SOCKET_COUNT; i++) {
+            if (net_state->platform.tx_timestamp[i].socket) {
+                receive_tx_timestamps(net_state,
+                                      &net_state->platform.tx_timestamp[i]);
+            }
+        }
+    }
+#endif
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+    if (net_state->platform.route_socket) {
+        receive_route_changes(net_state);
+    }
+#endif
+
+    /*
+       The ring replaces the raw ICMP sockets, which are otherwise
+       left idle, but not the unprivileged ICMP sockets.
+     */
+    if (net_state->platform.ring.socket) {
+        receive_replies_from_ring(net_state);
+        ring_ip4 = net_state->platform.ip4_socket_raw;
+        ring_ip6 = net_state->platform.ip6_socket_raw;
+    }
 
-    if (net_state->platform.ip4_present) {
+    if (net_state->platform.ip4_present && !ring_ip4) {
         if (net_state->platform.ip4_socket_raw) {
-            receive_replies_from_recv_socket(net_state,
-                                             net_state->platform.
-                                             ip4_recv_socket,
-                                             handle_received_ip4_packet);
+            receive_replies_from_raw_socket(net_state,
+                                            net_state->platform.
+                                            ip4_recv_socket,
+                                            handle_received_ip4_packet);
         } else {
             receive_replies_from_recv_socket(net_state,
                                              net_state->platform.
@@ -895,12 +2719,12 @@ void receive_replies(
         }
     }
 
-    if (net_state->platform.ip6_present) {
+    if (net_state->platform.ip6_present && !ring_ip6) {
         if (net_state->platform.ip6_socket_raw) {
-            receive_replies_from_recv_socket(net_state,
-                                             net_state->platform.
-                                             ip6_recv_socket,
-                                             handle_received_ip6_packet);
+            receive_replies_from_raw_socket(net_state,
+                                            net_state->platform.
+                                            ip6_recv_socket,
+                                            handle_received_ip6_packet);
         } else {
             receive_replies_from_recv_socket(net_state,
                                              net_state->platform.
@@ -913,8 +2737,26 @@ void receive_replies(
         }
     }
 
-    LIST_FOREACH_SAFE(probe, &net_state->outstanding_probes,
-                      probe_list_entry, probe_safe_iter) {
+    if (net_state->platform.ip4_tcp_recv_socket) {
+        receive_replies_from_raw_socket(net_state,
+                                        net_state->platform.
+                                        ip4_tcp_recv_socket,
+                                        handle_received_tcp4_packet);
+    }
+
+    if (net_state->platform.tcp6_socket) {
+        receive_replies_from_raw_socket(net_state,
+                                        net_state->platform.tcp6_socket,
+                                        handle_received_tcp6_packet);
+    }
+
+    /*
+       Only the probes whose sockets the wait found ready need checking.
+       Checking one may free it, which removes it from the ready probes.
+     */
+    while (net_state->platform.ready_probe_count) {
+        probe = net_state->platform.ready_probes[0];
+        forget_ready_probe(net_state, probe);
 
         receive_replies_from_probe_socket(net_state, probe);
     }
@@ -958,22 +2800,34 @@ void check_probe_timeouts(
 {
     struct timeval now;
     struct probe_t *probe;
-    struct probe_t *probe_safe_iter;
 
-    if (gettimeofday(&now, NULL)) {
-        perror("gettimeofday failure");
+    if (get_probe_time(&now)) {
+        perror("get_probe_time failure");
         exit(EXIT_FAILURE);
     }
 
-    LIST_FOREACH_SAFE(probe, &net_state->outstanding_probes,
-                      probe_list_entry, probe_safe_iter) {
+    /*
+       Expire probes from the root of the timeout heap until we find
+       one which hasn't yet timed out.
+     */
+    while (net_state->platform.timeout_heap_count > 0) {
+        probe = net_state->platform.timeout_heap[0];
 
-        if (compare_timeval(probe->platform.timeout_time, now) < 0) {
-            /*  Report timeout to the command stream  */
-            printf("%d no-reply\n", probe->token);
+        if (compare_timeval(probe->platform.timeout_time, now) >= 0) {
+            break;
+        }
 
-            free_probe(net_state, probe);
+        /*  Report timeout to the command stream  */
+        if (probe->platform.deferred_error) {
+            errno = probe->platform.deferred_error;
+            report_packet_error(probe->session, probe->token);
+        } else {
+            report_reply(probe->session, probe->token, WIRE_REPLY_NO_REPLY,
+                         NULL);
         }
+
+        net_state->stats.timeouts++;
+        free_probe(net_state, probe);
     }
 }
 
@@ -983,40 +2837,47 @@ void check_probe_timeouts(
     already elapsed.
 
     Returns false if no probes are currently outstanding, and true
-    if a timeout value for the next probe exists.
+    if a timeout value for the next probe exists.  A probe held to its
+    pace counts as outstanding, with its send time as its timeout.
 */
 bool get_next_probe_timeout(
     const struct net_state_t *net_state,
     struct timeval *timeout)
 {
-    bool have_timeout;
     const struct probe_t *probe;
+    struct timeval next_time;
+    struct timeval arrival_time;
+    struct timeval send_time;
     struct timeval now;
-    struct timeval probe_timeout;
+    bool have_paced = get_next_paced_time(net_state, &send_time);
+
+    /*  The root of the timeout heap is the soonest timeout  */
+    if (net_state->platform.timeout_heap_count > 0) {
+        probe = net_state->platform.timeout_heap[0];
+        next_time = probe->platform.timeout_time;
+        if (have_paced && compare_timeval(send_time, next_time) < 0) {
+            next_time = send_time;
+        }
+    } else if (have_paced) {
+        next_time = send_time;
+    } else {
+        return false;
+    }
 
-    if (gettimeofday(&now, NULL)) {
-        perror("gettimeofday failure");
-        exit(EXIT_FAILURE);
+    /*  A simulated reply may be due before then  */
+    if (get_next_simulated_reply(net_state, &arrival_time)
+        && compare_timeval(arrival_time, next_time) < 0) {
+        next_time = arrival_time;
     }
 
-    have_timeout = false;
-    LIST_FOREACH(probe, &net_state->outstanding_probes, probe_list_entry) {
-        probe_timeout.tv_sec =
-            probe->platform.timeout_time.tv_sec - now.tv_sec;
-        probe_timeout.tv_usec =
-            probe->platform.timeout_time.tv_usec - now.tv_usec;
-
-        normalize_timeval(&probe_timeout);
-        if (have_timeout) {
-            if (compare_timeval(probe_timeout, *timeout) < 0) {
-                /*  If this probe has a sooner timeout, store it instead  */
-                *timeout = probe_timeout;
-            }
-        } else {
-            *timeout = probe_timeout;
-            have_timeout = true;
-        }
+    if (get_probe_time(&now)) {
+        perror("get_probe_time failure");
+        exit(EXIT_FAILURE);
     }
 
-    return have_timeout;
+    timeout->tv_sec = next_time.tv_sec - now.tv_sec;
+    timeout->tv_usec = next_time.tv_usec - now.tv_usec;
+    normalize_timeval(timeout);
+
+    return true;
 }
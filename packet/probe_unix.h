@@ -23,6 +23,12 @@
 #define MIN_PORT 33000
 #define MAX_PORT 65535
 
+/*  The number of recent transmissions for which we match timestamps  */
+#define TX_TIMESTAMP_RING_SIZE 1024
+
+/*  The number of sockets which may report kernel transmit timestamps  */
+#define TX_TIMESTAMP_SOCKET_COUNT 4
+
 /*  We need to track the transmission and timeouts on Unix systems  */
 struct probe_platform_t {
     /*  The socket for the outgoing connection  (used by TCP probes)  */
@@ -33,6 +39,88 @@ struct probe_platform_t {
 
     /*  The time at which the probe was sent  */
     struct timeval departure_time;
+
+    /*  Our position in the timeout heap, or -1 if not yet in the heap  */
+    int timeout_heap_index;
+
+    /*  true if departure_time should be replaced by a kernel timestamp  */
+    bool kernel_timestamp;
+
+    /*  An error from the probe's socket, to be reported at timeout_time  */
+    int deferred_error;
+
+    /*  true while the probe is among the ready_probes of net_state  */
+    bool ready;
+};
+
+/*
+    Probes sent with a template reuse a packet built with the template's
+    parameters, patching only the time-to-live and sequence number.
+*/
+struct probe_template_platform_t {
+    /*  The prebuilt packet, or NULL if not yet built  */
+    char *packet;
+
+    /*  The size of the prebuilt packet  */
+    int packet_size;
+
+    /*  The sequence number currently in the prebuilt packet  */
+    int sequence;
+
+    /*  The destination of the prebuilt packet  */
+    struct sockaddr_storage dest_addr;
+
+    /*  The source cache generation when the packet was built  */
+    unsigned int source_cache_generation;
+
+    /*  The time after which the packet's source address should be rechecked  */
+    struct timeval expire_time;
+};
+
+/*
+    Kernel transmit timestamps are reported on the error queue of the
+    sending socket, identified by a counter of the packets sent on that
+    socket.  We track which probe was sent with each recent identifier.
+*/
+struct tx_timestamp_socket_t {
+    /*  The sending socket, or zero if not reporting timestamps  */
+    int socket;
+
+    /*  The identifier the kernel will assign to the next packet sent  */
+    unsigned int next_id;
+
+    /*  The sequence numbers of recently sent probes, by identifier  */
+    int sequence[TX_TIMESTAMP_RING_SIZE];
+};
+
+struct uring_t;
+struct simulation_t;
+struct send_batch_t;
+struct recv_batch_t;
+struct packet_threads_t;
+
+/*
+    On Linux, ICMP replies may optionally be read from a memory-mapped
+    TPACKET_V3 ring, which the kernel fills with blocks of packets.
+*/
+struct packet_ring_t {
+    /*  The AF_PACKET socket owning the ring, or zero if not in use  */
+    int socket;
+
+    /*  The mapping of the ring's blocks into our address space  */
+    char *map;
+
+    /*  The size of each block, in bytes  */
+    int block_size;
+
+    /*  The number of blocks in the ring  */
+    int block_count;
+
+    /*  The block which the kernel will hand to us next  */
+    int next_block;
+
+    /*  true while the packets of a block are being handled  */
+    bool reading;
 };
 
 /*  We'll use rack sockets to send and recieve probes on Unix systems  */
@@ -73,12 +161,30 @@ struct net_state_platform_t {
     /*  Receive socket for IPv6 packets  */
     int ip6_recv_socket;
 
+    /*  Socket used to receive the replies to raw IPv4 TCP SYN probes  */
+    int ip4_tcp_recv_socket;
+
+    /*  Socket used to send and receive raw IPv6 TCP SYN probes  */
+    int tcp6_socket;
+
     /*  Socket used to tx & rx non-raw IPv6 icmp packets */
     int ip6_txrx_icmp_socket;
 
     /*  Socket used to send IPv6 udp packets and receive icmp err packets */
     int ip6_txrx_udp_socket;
 
+    /*  Socket notified of routing changes, which invalidate source_cache  */
+    int route_socket;
+
+    /*  The packet ring from which ICMP replies are read, if enabled  */
+    struct packet_ring_t ring;
+
+    /*  The io_uring engine state, or NULL if waiting with epoll  */
+    struct uring_t *uring;
+
+    /*  The simulated network replacing our sockets, or NULL if none  */
+    struct simulation_t *simulation;
+
     /*
        true if we should encode the IP header length in host order.
        (as opposed to network order)
@@ -90,15 +196,76 @@ struct net_state_platform_t {
 
     /*  The next port number to use when creating a new probe  */
     int next_sequence;
+
+    /*
+       The range of port numbers assigned to our probes.  When probes
+       are sharded across threads, each thread has a slice of the range.
+     */
+    int min_sequence;
+    int max_sequence;
+
+    /*  The worker threads, or NULL if probes aren't sharded  */
+    struct packet_threads_t *threads;
+
+    /*  Storage for packets sent with sendmmsg, allocated when needed  */
+    struct send_batch_t *send_batch;
+
+    /*  Storage for packets read with recvmmsg, allocated when needed  */
+    struct recv_batch_t *recv_batch;
+
+    /*
+       The probes whose sockets the last wait found ready, to be
+       checked by receive_replies, so that it needn't check them all.
+       Allocated when needed, with room for every probe.
+     */
+    struct probe_t **ready_probes;
+    int ready_probe_count;
+
+    /*
+       A binary min-heap of outstanding probes, ordered by timeout time,
+       so that the soonest timeout is always found at the root.
+     */
+    struct probe_t **timeout_heap;
+
+    /*  The number of probes in the timeout heap  */
+    int timeout_heap_count;
+
+    /*  The epoll or kqueue descriptor used for waiting, or -1 for select  */
+    int wait_fd;
+
+    /*  A timer in wait_fd, for timeouts finer than epoll's milliseconds  */
+    int timer_fd;
+
+    /*  true if the command stream and receive sockets are in wait_fd  */
+    bool wait_fds_registered;
+
+    /*  true if the command stream is a file, which epoll can't wait on  */
+    bool command_stream_unwaitable;
+
+    /*  true if waits spin rather than sleep while probes are outstanding  */
+    bool spin_poll;
+
+    /*  true if we have requested kernel transmit timestamps  */
+    bool kernel_timestamps_enabled;
+
+    /*  The sockets on which kernel transmit timestamps are reported  */
+    struct tx_timestamp_socket_t tx_timestamp[TX_TIMESTAMP_SOCKET_COUNT];
 };
 
 struct net_state_t;
 struct probe_t;
+struct probe_param_t;
 struct mpls_label_t;
+struct msghdr;
 
 void set_socket_nonblocking(
     int socket);
 
+void init_net_state_range_privileged(
+    struct net_state_t *net_state,
+    int min_sequence,
+    int max_sequence);
+
 void receive_probe(
     struct net_state_t *net_state,
     struct probe_t *probe,
@@ -108,8 +275,31 @@ void receive_probe(
     int mpls_count,
     struct mpls_label_t *mpls);
 
+void set_probe_timeout(
+    struct net_state_t *net_state,
+    struct probe_t *probe,
+    const struct probe_param_t *param);
+
+bool get_control_timestamp(
+    struct msghdr *msg,
+    struct timeval *timestamp);
+
+void complete_queued_send(
+    struct net_state_t *net_state,
+    int socket,
+    int sequence,
+    int result);
+
 int gather_probe_sockets(
     const struct net_state_t *net_state,
     fd_set * write_set);
 
+void mark_probe_ready(
+    struct net_state_t *net_state,
+    struct probe_t *probe);
+
+void mark_ready_probe_sockets(
+    struct net_state_t *net_state,
+    const fd_set * write_set);
+
 #endif
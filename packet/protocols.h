@@ -49,6 +49,11 @@
 
 #define HTTP_PORT 80
 
+/*  TCP header flags  */
+#define TCP_FLAG_SYN 0x02
+#define TCP_FLAG_RST 0x04
+#define TCP_FLAG_ACK 0x10
+
 /*  We can't rely on header files to provide this information, because
     the fields have different names between, for instance, Linux and 
     Solaris  */
@@ -97,6 +102,24 @@ struct TCPHeader {
     uint32_t seq;
 };
 
+/*
+    Structure of a complete TCP header, without options, as used for
+    the SYN segments we construct.  Only the start of the header is
+    guaranteed to be quoted in ICMP replies, so those are decoded
+    with struct TCPHeader instead.
+*/
+struct TCPSegmentHeader {
+    uint16_t srcport;
+    uint16_t dstport;
+    uint32_t seq;
+    uint32_t ack;
+    uint8_t offset;
+    uint8_t flags;
+    uint16_t window;
+    uint16_t checksum;
+    uint16_t urgent;
+};
+
 /* Structure of an SCTP header */
 struct SCTPHeader {
     uint16_t srcport;
@@ -104,7 +127,7 @@ struct SCTPHeader {
     uint32_t veri_tag;
 };
 
-/* Structure of an IPv4 UDP pseudoheader.  */
+/* Structure of an IPv4 UDP or TCP pseudoheader.  */
 struct UDPPseudoHeader {
     uint32_t saddr;
     uint32_t daddr;
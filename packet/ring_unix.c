@@ -0,0 +1,269 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "ring_unix.h"
+
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#endif
+
+#include "deconstruct_unix.h"
+#include "filter_unix.h"
+#include "protocols.h"
+#include "timeval.h"
+
+/*
+    Reading from the raw ICMP sockets costs a system call for every
+    batch of replies, plus a copy of each packet.  With a TPACKET_V3
+    ring, the kernel instead writes packets into blocks of memory shared
+    with us, along with the time at which each packet arrived, and hands
+    over a block when it fills or when its timeout expires.  We only
+    make a system call when waiting for the next block.
+
+    The ring is an alternative to the raw ICMP sockets, which remain
+    the default, and is used only when MTR_PACKET_RING is set in the
+    environment.  TCP replies are still read from the raw TCP sockets.
+
+    TPACKET_V3 is an enumeration value rather than a macro, so we check
+    for a block status flag which was introduced alongside it.
+*/
+#if defined(HAVE_LINUX_IF_PACKET_H) && defined(TP_STATUS_BLK_TMO)
+
+/*  The geometry of the ring, which occupies two megabytes  */
+#define RING_BLOCK_SIZE (1 << 16)
+#define RING_BLOCK_COUNT 32
+#define RING_FRAME_SIZE 2048
+
+/*
+    Open an AF_PACKET socket and map a receive ring for it.  As no
+    packets are delivered until the socket is bound to a protocol, we
+    attach our filter and create the ring before binding, so that
+    unrelated packets never reach the ring.  Failure isn't fatal, as
+    we can continue to use the raw sockets.
+*/
+void open_packet_ring(
+    struct net_state_t *net_state)
+{
+    struct packet_ring_t *ring = &net_state->platform.ring;
+    struct tpacket_req3 req;
+    struct sockaddr_ll addr;
+    const char *ring_env;
+    int version = TPACKET_V3;
+    int ring_socket;
+    void *map;
+
+    ring_env = getenv("MTR_PACKET_RING");
+    if (ring_env == NULL || *ring_env == 0) {
+        return;
+    }
+
+    if (!net_state->platform.ip4_socket_raw
+        && !net_state->platform.ip6_socket_raw) {
+        return;
+    }
+
+    ring_socket = socket(AF_PACKET, SOCK_DGRAM, 0);
+    if (ring_socket == -1) {
+        return;
+    }
+
+    memset(&req, 0, sizeof(struct tpacket_req3));
+    req.tp_block_size = RING_BLOCK_SIZE;
+    req.tp_block_nr = RING_BLOCK_COUNT;
+    req.tp_frame_size = RING_FRAME_SIZE;
+    req.tp_frame_nr = RING_BLOCK_SIZE / RING_FRAME_SIZE * RING_BLOCK_COUNT;
+    req.tp_retire_blk_tov = RING_BLOCK_TIMEOUT;
+
+    if (!attach_ring_filter(net_state, ring_socket)
+        || setsockopt(ring_socket, SOL_PACKET, PACKET_VERSION,
+                      &version, sizeof(int))
+        || setsockopt(ring_socket, SOL_PACKET, PACKET_RX_RING,
+                      &req, sizeof(struct tpacket_req3))) {
+        close(ring_socket);
+        return;
+    }
+
+    map = mmap(NULL, RING_BLOCK_SIZE * RING_BLOCK_COUNT,
+               PROT_READ | PROT_WRITE, MAP_SHARED, ring_socket, 0);
+    if (map == MAP_FAILED) {
+        close(ring_socket);
+        return;
+    }
+
+    /*  Receive from every interface  */
+    memset(&addr, 0, sizeof(struct sockaddr_ll));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_ALL);
+    addr.sll_ifindex = 0;
+
+    if (bind(ring_socket, (struct sockaddr *) &addr,
+             sizeof(struct sockaddr_ll))) {
+        munmap(map, RING_BLOCK_SIZE * RING_BLOCK_COUNT);
+        close(ring_socket);
+        return;
+    }
+
+    ring->socket = ring_socket;
+    ring->map = map;
+    ring->block_size = RING_BLOCK_SIZE;
+    ring->block_count = RING_BLOCK_COUNT;
+    ring->next_block = 0;
+}
+
+/*
+    Pass a packet from the ring to the same handlers used for the raw
+    sockets.  The raw IPv4 socket receives the IP header, as the ring
+    does, but the raw IPv6 socket doesn't, so we strip it.  The source
+    address, which recvmsg would provide, comes from the IP header.
+*/
+static
+void handle_ring_packet(
+    struct net_state_t *net_state,
+    const char *packet,
+    int packet_length,
+    struct timeval *timestamp)
+{
+    struct sockaddr_storage remote_addr;
+    struct sockaddr_in *remote_addr4 = (struct sockaddr_in *) &remote_addr;
+    struct sockaddr_in6 *remote_addr6 =
+        (struct sockaddr_in6 *) &remote_addr;
+    const struct IPHeader *ip;
+    const struct IP6Header *ip6;
+
+    if (packet_length < 1) {
+        return;
+    }
+
+    memset(&remote_addr, 0, sizeof(struct sockaddr_storage));
+
+    if ((packet[0] >> 4) == 4) {
+        if (!net_state->platform.ip4_socket_raw
+            || packet_length < sizeof(struct IPHeader)) {
+            return;
+        }
+
+        ip = (const struct IPHeader *) packet;
+        remote_addr4->sin_family = AF_INET;
+        remote_addr4->sin_addr.s_addr = ip->saddr;
+
+        handle_received_ip4_packet(net_state, &remote_addr, packet,
+                                   packet_length, timestamp);
+    } else if ((packet[0] >> 4) == 6) {
+        if (!net_state->platform.ip6_socket_raw
+            || packet_length < sizeof(struct IP6Header)) {
+            return;
+        }
+
+        ip6 = (const struct IP6Header *) packet;
+        if (ip6->protocol != IPPROTO_ICMPV6) {
+            return;
+        }
+
+        remote_addr6->sin6_family = AF_INET6;
+        memcpy(&remote_addr6->sin6_addr, ip6->saddr,
+               sizeof(struct in6_addr));
+
+        handle_received_ip6_packet(net_state, &remote_addr,
+                                   packet + sizeof(struct IP6Header),
+                                   packet_length -
+                                   sizeof(struct IP6Header), timestamp);
+    }
+}
+
+/*
+    Consume every block which the kernel has handed over to us,
+    returning each to the kernel after handling its packets.
+*/
+void receive_replies_from_ring(
+    struct net_state_t *net_state)
+{
+    struct packet_ring_t *ring = &net_state->platform.ring;
+    struct tpacket_block_desc *block;
+    struct tpacket3_hdr *frame;
+    struct timeval timestamp;
+    struct timeval kernel_offset;
+    int packet_count;
+    int i;
+
+    if (get_kernel_time_offset(&kernel_offset)) {
+        perror("get_kernel_time_offset failure");
+        exit(EXIT_FAILURE);
+    }
+
+    while (true) {
+        block = (struct tpacket_block_desc *)
+            &ring->map[ring->next_block * ring->block_size];
+
+        if (!(block->hdr.bh1.block_status & TP_STATUS_USER)) {
+            break;
+        }
+
+        /*  Don't read the block's contents before its status  */
+        __sync_synchronize();
+
+        packet_count = block->hdr.bh1.num_pkts;
+        frame = (struct tpacket3_hdr *)
+            ((char *) block + block->hdr.bh1.offset_to_first_pkt);
+
+        ring->reading = true;
+        for (i = 0; i < packet_count; i++) {
+            timestamp.tv_sec = frame->tp_sec;
+            timestamp.tv_usec = frame->tp_nsec / 1000;
+            kernel_to_probe_time(&timestamp, &kernel_offset);
+
+            handle_ring_packet(net_state, (char *) frame + frame->tp_net,
+                               frame->tp_snaplen, &timestamp);
+
+            frame = (struct tpacket3_hdr *)
+                ((char *) frame + frame->tp_next_offset);
+        }
+        ring->reading = false;
+
+        /*  Finish with the block before returning it to the kernel  */
+        __sync_synchronize();
+        block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+
+        ring->next_block = (ring->next_block + 1) % ring->block_count;
+    }
+}
+
+#else
+
+/*  Without TPACKET_V3, replies are always read from the raw sockets  */
+void open_packet_ring(
+    struct net_state_t *net_state)
+{
+}
+
+void receive_replies_from_ring(
+    struct net_state_t *net_state)
+{
+}
+
+#endif
@@ -0,0 +1,45 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef RING_UNIX_H
+#define RING_UNIX_H
+
+#include "probe.h"
+
+/*
+    The number of milliseconds after which the kernel hands us a
+    partially filled block.  The round trip times come from the
+    timestamps of individual packets, so this only delays the reporting
+    of replies.
+*/
+#define RING_BLOCK_TIMEOUT 1
+
+/*
+    The time, in microseconds, within which a received packet will
+    have reached us through the ring, allowing for the resolution of
+    the kernel's block timer.
+*/
+#define RING_DELIVERY_TIME 20000
+
+void open_packet_ring(
+    struct net_state_t *net_state);
+
+void receive_replies_from_ring(
+    struct net_state_t *net_state);
+
+#endif
@@ -0,0 +1,732 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "simulate_unix.h"
+
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "protocols.h"
+#include "timeval.h"
+#include "wire.h"
+
+/*
+    When MTR_PACKET_SIMULATE names a topology file, no sockets are
+    opened, and replies to our probes are synthesized from the
+    topology instead of being read from the network.  This needs no
+    privileges, and is fast enough to load test mtr, and the many
+    targets it can trace at once, without any routers.
+
+    The topology is a path of hops, one per line, in order of
+    time-to-live, which applies to every destination:
+
+        # comment
+        seed 7
+        hop 10.0.0.1 delay 0.5
+        hop 10.0.1.1 10.0.1.2 2001:db8:1::1 delay 2 jitter 0.5 loss 1
+        hop *
+        hop 10.0.3.1 delay 9 mpls 16001,16002
+        target delay 12 jitter 1 loss 0.5
+
+    A hop lists the addresses which answer from it, each a branch of
+    an equal cost multipath.  A probe's branch is chosen by a hash of
+    its flow, as a router would, among the addresses of its IP version.
+    A hop with no addresses of the probe's version, such as "*", never
+    answers.  Probes with a time-to-live beyond the last hop reach the
+    destination, which answers as "target" describes.
+
+    delay is the fixed round trip time, in milliseconds, to which a
+    queueing delay with an exponential distribution, of mean jitter,
+    is added.  loss is the percentage of probes which go unanswered.
+    mpls gives the labels of the stack quoted in a hop's replies.
+
+    The losses and delays come from a pseudo-random sequence started
+    from seed, so that the same probes are answered in the same way.
+*/
+
+#define SIMULATE_MAX_HOPS 64
+#define SIMULATE_MAX_BRANCHES 16
+#define SIMULATE_MAX_LABELS 8
+#define SIMULATE_LINE_SIZE 1024
+
+/*  A hop of the simulated path, or the destination at its end  */
+struct simulated_hop_t {
+    /*  The address answering from each branch of the hop  */
+    struct sockaddr_storage branch[SIMULATE_MAX_BRANCHES];
+    int branch_count;
+
+    /*  The fixed round trip time, and the mean added to it, in usec  */
+    double delay_us;
+    double jitter_us;
+
+    /*  The probability of a probe going unanswered  */
+    double loss;
+
+    /*  The MPLS label stack quoted in replies  */
+    struct mpls_label_t mpls[SIMULATE_MAX_LABELS];
+    int mpls_count;
+};
+
+/*  A reply which will arrive when its time comes  */
+struct simulated_reply_t {
+    struct timeval arrival_time;
+
+    /*  The sequence and departure identify the probe answered  */
+    int sequence;
+    struct timeval departure_time;
+
+    int icmp_type;
+    struct sockaddr_storage remote_addr;
+    const struct simulated_hop_t *hop;
+};
+
+struct simulation_t {
+    struct simulated_hop_t hop[SIMULATE_MAX_HOPS];
+    int hop_count;
+    struct simulated_hop_t target;
+
+    /*  The state of the pseudo-random sequence  */
+    uint64_t random_state;
+
+    /*  A binary min-heap of replies, by arrival time  */
+    struct simulated_reply_t *reply_heap;
+    int reply_count;
+    int reply_capacity;
+};
+
+/*  Returns true if a simulated network is to replace our sockets  */
+bool is_simulation_requested(
+    void)
+{
+    const char *simulate_env = getenv("MTR_PACKET_SIMULATE");
+
+    return simulate_env != NULL && *simulate_env != 0;
+}
+
+/*  Report an error in the topology file, and exit  */
+static
+void topology_error(
+    const char *filename,
+    int line_number,
+    const char *message,
+    const char *token)
+{
+    fprintf(stderr, "%s:%d: %s%s%s\n", filename, line_number, message,
+            token ? ": " : "", token ? token : "");
+    exit(EXIT_FAILURE);
+}
+
+/*  Parse a non-negative number, or exit  */
+static
+double parse_topology_number(
+    const char *filename,
+    int line_number,
+    const char *token)
+{
+    char *end;
+    double value;
+
+    if (token == NULL) {
+        topology_error(filename, line_number, "missing value", NULL);
+    }
+
+    value = strtod(token, &end);
+    if (*end != 0 || !(value >= 0)) {
+        topology_error(filename, line_number, "invalid value", token);
+    }
+
+    return value;
+}
+
+/*  Parse a comma separated MPLS label stack, or exit  */
+static
+void parse_topology_labels(
+    const char *filename,
+    int line_number,
+    char *token,
+    struct simulated_hop_t *hop)
+{
+    char *label;
+    char *end;
+    char *saveptr;
+    unsigned long value;
+
+    if (token == NULL) {
+        topology_error(filename, line_number, "missing value", NULL);
+    }
+
+    for (label = strtok_r(token, ",", &saveptr); label;
+         label = strtok_r(NULL, ",", &saveptr)) {
+        value = strtoul(label, &end, 10);
+        if (*end != 0 || value > 0xfffff) {
+            topology_error(filename, line_number, "invalid label", label);
+        }
+        if (hop->mpls_count == SIMULATE_MAX_LABELS) {
+            topology_error(filename, line_number, "too many labels", label);
+        }
+
+        hop->mpls[hop->mpls_count].label = value;
+        hop->mpls[hop->mpls_count].ttl = 1;
+        hop->mpls_count++;
+    }
+
+    if (hop->mpls_count) {
+        hop->mpls[hop->mpls_count - 1].bottom_of_stack = 1;
+    }
+}
+
+/*
+    Parse the remainder of a "hop" or "target" line: the addresses
+    of the branches, and then its properties.
+*/
+static
+void parse_topology_hop(
+    const char *filename,
+    int line_number,
+    char **saveptr,
+    struct simulated_hop_t *hop,
+    bool has_branches)
+{
+    struct sockaddr_storage branch;
+    char *token;
+    char *value;
+    int ip_version;
+
+    token = strtok_r(NULL, " \t\r\n", saveptr);
+
+    while (has_branches && token) {
+        if (!strcmp(token, "*")) {
+            token = strtok_r(NULL, " \t\r\n", saveptr);
+            continue;
+        }
+
+        ip_version = strchr(token, ':') ? 6 : 4;
+        memset(&branch, 0, sizeof(struct sockaddr_storage));
+        if (decode_address_string(ip_version, token, &branch)) {
+            break;
+        }
+        if (hop->branch_count == SIMULATE_MAX_BRANCHES) {
+            topology_error(filename, line_number, "too many branches",
+                           token);
+        }
+
+        hop->branch[hop->branch_count] = branch;
+        hop->branch_count++;
+        token = strtok_r(NULL, " \t\r\n", saveptr);
+    }
+
+    while (token) {
+        value = strtok_r(NULL, " \t\r\n", saveptr);
+
+        if (!strcmp(token, "delay")) {
+            hop->delay_us =
+                parse_topology_number(filename, line_number, value) * 1000;
+        } else if (!strcmp(token, "jitter")) {
+            hop->jitter_us =
+                parse_topology_number(filename, line_number, value) * 1000;
+        } else if (!strcmp(token, "loss")) {
+            hop->loss =
+                parse_topology_number(filename, line_number, value) / 100;
+        } else if (!strcmp(token, "mpls")) {
+            parse_topology_labels(filename, line_number, value, hop);
+        } else {
+            topology_error(filename, line_number, "unknown keyword", token);
+        }
+
+        token = strtok_r(NULL, " \t\r\n", saveptr);
+    }
+}
+
+/*  Read the topology file, exiting if it can't be read  */
+static
+void read_topology(
+    struct simulation_t *simulation,
+    const char *filename)
+{
+    char line[SIMULATE_LINE_SIZE];
+    char *saveptr;
+    char *token;
+    int line_number = 0;
+    FILE *file;
+
+    file = fopen(filename, "r");
+    if (file == NULL) {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        line_number++;
+
+        token = strchr(line, '#');
+        if (token) {
+            *token = 0;
+        }
+
+        token = strtok_r(line, " \t\r\n", &saveptr);
+        if (token == NULL) {
+            continue;
+        }
+
+        if (!strcmp(token, "hop")) {
+            if (simulation->hop_count == SIMULATE_MAX_HOPS) {
+                topology_error(filename, line_number, "too many hops",
+                               NULL);
+            }
+            parse_topology_hop(filename, line_number, &saveptr,
+                               &simulation->hop[simulation->hop_count],
+                               true);
+            simulation->hop_count++;
+        } else if (!strcmp(token, "target")) {
+            parse_topology_hop(filename, line_number, &saveptr,
+                               &simulation->target, false);
+        } else if (!strcmp(token, "seed")) {
+            simulation->random_state =
+                parse_topology_number(filename, line_number,
+                                      strtok_r(NULL, " \t\r\n",
+                                               &saveptr));
+        } else {
+            topology_error(filename, line_number, "unknown keyword", token);
+        }
+    }
+
+    if (ferror(file)) {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+}
+
+/*
+    Read the topology named by MTR_PACKET_SIMULATE.  This is done
+    after dropping privileges, so that the file is read only if the
+    user could read it.
+*/
+void init_simulation(
+    struct net_state_t *net_state)
+{
+    struct simulation_t *simulation;
+
+    simulation = calloc(1, sizeof(struct simulation_t));
+    if (simulation == NULL) {
+        perror("Failure allocating simulated network");
+        exit(EXIT_FAILURE);
+    }
+
+    simulation->random_state = 1;
+    read_topology(simulation, getenv("MTR_PACKET_SIMULATE"));
+
+    /*  A zero state would leave the sequence stuck at zero  */
+    simulation->random_state =
+        simulation->random_state * 0x9e3779b97f4a7c15ULL + 1;
+
+    simulation->reply_capacity = MAX_PROBES;
+    simulation->reply_heap =
+        malloc(MAX_PROBES * sizeof(struct simulated_reply_t));
+    if (simulation->reply_heap == NULL) {
+        perror("Failure allocating simulated replies");
+        exit(EXIT_FAILURE);
+    }
+
+    net_state->platform.simulation = simulation;
+}
+
+/*  The next value, in [0, 1), of the xorshift64* sequence  */
+static
+double next_simulated_random(
+    struct simulation_t *simulation)
+{
+    uint64_t x = simulation->random_state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    simulation->random_state = x;
+
+    return (double) ((x * 0x2545f4914f6cdd1dULL) >> 11) / (1ULL << 53);
+}
+
+/*  Mix bytes into an FNV-1a hash  */
+static
+uint32_t hash_bytes(
+    uint32_t hash,
+    const void *bytes,
+    int length)
+{
+    const uint8_t *byte = bytes;
+    int i;
+
+    for (i = 0; i < length; i++) {
+        hash = (hash ^ byte[i]) * 16777619;
+    }
+
+    return hash;
+}
+
+/*
+    Hash the fields with which a router balances a probe across
+    multiple paths: the addresses, the protocol, and for protocols
+    with ports, the ports, which we find as construct_packet would.
+*/
+static
+uint32_t hash_probe_flow(
+    const struct probe_param_t *param,
+    const struct sockaddr_storage *dest_addr,
+    int sequence)
+{
+    const struct sockaddr_in *dest4 = (const struct sockaddr_in *)
+        dest_addr;
+    const struct sockaddr_in6 *dest6 = (const struct sockaddr_in6 *)
+        dest_addr;
+    uint32_t hash = 2166136261u;
+    int ports[2];
+
+    if (dest_addr->ss_family == AF_INET6) {
+        hash = hash_bytes(hash, &dest6->sin6_addr, sizeof(struct in6_addr));
+    } else {
+        hash = hash_bytes(hash, &dest4->sin_addr, sizeof(struct in_addr));
+    }
+    hash = hash_bytes(hash, &param->protocol, sizeof(int));
+
+    if (param->protocol == IPPROTO_ICMP) {
+        return hash;
+    }
+
+    if (param->protocol == IPPROTO_UDP && !param->dest_port) {
+        ports[0] = param->local_port ? param->local_port : getpid();
+        ports[1] = sequence;
+    } else {
+        ports[0] = param->local_port ? param->local_port : sequence;
+        ports[1] = param->dest_port;
+    }
+
+    return hash_bytes(hash, ports, sizeof(ports));
+}
+
+/*
+    Each router of the path balances flows with a hash of its own, so
+    the hash of a flow is salted with the time-to-live of the hop.  The
+    low bits of FNV-1a depend on few of the input bits, so the hash is
+    mixed before it chooses among branches.
+*/
+static
+uint32_t hash_simulated_hop(
+    const struct probe_param_t *param,
+    const struct probe_t *probe)
+{
+    uint32_t hash;
+
+    hash = hash_probe_flow(param, &probe->remote_addr, probe->sequence);
+    hash = hash_bytes(hash, &param->ttl, sizeof(int));
+
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+
+    return hash;
+}
+
+/*  Choose the branch of a hop taken by a flow, or NULL if none  */
+static
+const struct sockaddr_storage *choose_simulated_branch(
+    const struct simulated_hop_t *hop,
+    int family,
+    uint32_t flow_hash)
+{
+    int count = 0;
+    int i;
+
+    for (i = 0; i < hop->branch_count; i++) {
+        if (hop->branch[i].ss_family == family) {
+            count++;
+        }
+    }
+    if (count == 0) {
+        return NULL;
+    }
+
+    count = flow_hash % count;
+    for (i = 0; i < hop->branch_count; i++) {
+        if (hop->branch[i].ss_family == family && count-- == 0) {
+            break;
+        }
+    }
+
+    return &hop->branch[i];
+}
+
+/*  Swap two replies in the heap  */
+static
+void swap_simulated_replies(
+    struct simulation_t *simulation,
+    int a,
+    int b)
+{
+    struct simulated_reply_t swap = simulation->reply_heap[a];
+
+    simulation->reply_heap[a] = simulation->reply_heap[b];
+    simulation->reply_heap[b] = swap;
+}
+
+static
+bool is_simulated_reply_sooner(
+    const struct simulation_t *simulation,
+    int a,
+    int b)
+{
+    return compare_timeval(simulation->reply_heap[a].arrival_time,
+                           simulation->reply_heap[b].arrival_time) < 0;
+}
+
+/*  Add a reply to the heap, growing the heap if it is full  */
+static
+struct simulated_reply_t *push_simulated_reply(
+    struct simulation_t *simulation)
+{
+    struct simulated_reply_t *heap;
+    int capacity;
+
+    /*  Replies to probes which have timed out may outnumber probes  */
+    if (simulation->reply_count == simulation->reply_capacity) {
+        capacity = simulation->reply_capacity * 2;
+        heap = realloc(simulation->reply_heap,
+                       capacity * sizeof(struct simulated_reply_t));
+        if (heap == NULL) {
+            perror("Failure allocating simulated replies");
+            exit(EXIT_FAILURE);
+        }
+        simulation->reply_heap = heap;
+        simulation->reply_capacity = capacity;
+    }
+
+    return &simulation->reply_heap[simulation->reply_count++];
+}
+
+/*  Restore the heap after filling the reply added last  */
+static
+void sift_simulated_reply_up(
+    struct simulation_t *simulation)
+{
+    int index = simulation->reply_count - 1;
+    int parent;
+
+    while (index > 0) {
+        parent = (index - 1) / 2;
+        if (!is_simulated_reply_sooner(simulation, index, parent)) {
+            break;
+        }
+
+        swap_simulated_replies(simulation, index, parent);
+        index = parent;
+    }
+}
+
+/*  Remove the soonest reply from the heap  */
+static
+void pop_simulated_reply(
+    struct simulation_t *simulation)
+{
+    int index = 0;
+    int child;
+
+    simulation->reply_count--;
+    simulation->reply_heap[0] =
+        simulation->reply_heap[simulation->reply_count];
+
+    while (true) {
+        child = 2 * index + 1;
+        if (child >= simulation->reply_count) {
+            break;
+        }
+        if (child + 1 < simulation->reply_count
+            && is_simulated_reply_sooner(simulation, child + 1, child)) {
+            child++;
+        }
+        if (!is_simulated_reply_sooner(simulation, child, index)) {
+            break;
+        }
+
+        swap_simulated_replies(simulation, index, child);
+        index = child;
+    }
+}
+
+/*
+    Decide the fate of a probe which has just been sent, and if it is
+    to be answered, queue its reply.
+*/
+static
+void simulate_probe_path(
+    struct simulation_t *simulation,
+    const struct probe_param_t *param,
+    const struct probe_t *probe)
+{
+    const struct simulated_hop_t *hop;
+    const struct sockaddr_storage *remote_addr;
+    struct simulated_reply_t *reply;
+    double delay_us;
+    long delay;
+    int icmp_type;
+
+    if (param->ttl <= simulation->hop_count) {
+        hop = &simulation->hop[param->ttl - 1];
+        remote_addr =
+            choose_simulated_branch(hop, probe->remote_addr.ss_family,
+                                    hash_simulated_hop(param, probe));
+        icmp_type = ICMP_TIME_EXCEEDED;
+    } else {
+        hop = &simulation->target;
+        remote_addr = &probe->remote_addr;
+        icmp_type = ICMP_ECHOREPLY;
+    }
+
+    if (remote_addr == NULL
+        || next_simulated_random(simulation) < hop->loss) {
+        return;
+    }
+
+    delay_us = hop->delay_us;
+    if (hop->jitter_us > 0) {
+        delay_us -=
+            hop->jitter_us * log(1 - next_simulated_random(simulation));
+    }
+    delay = delay_us;
+
+    reply = push_simulated_reply(simulation);
+    reply->sequence = probe->sequence;
+    reply->departure_time = probe->platform.departure_time;
+    reply->arrival_time = probe->platform.departure_time;
+    reply->arrival_time.tv_sec += delay / 1000000;
+    reply->arrival_time.tv_usec += delay % 1000000;
+    normalize_timeval(&reply->arrival_time);
+    reply->icmp_type = icmp_type;
+    reply->remote_addr = *remote_addr;
+    reply->hop = hop;
+    sift_simulated_reply_up(simulation);
+}
+
+/*
+    Send a probe into the simulated network.  As with a real probe,
+    a reply to the command token is issued if it can't be sent.
+*/
+void send_simulated_probe(
+    struct net_state_t *net_state,
+    const struct probe_param_t *param)
+{
+    struct probe_t *probe;
+
+    if (param->ttl < 1) {
+        report_reply(net_state->session, param->command_token,
+                     WIRE_REPLY_INVALID_ARGUMENT, NULL);
+        return;
+    }
+
+    probe = alloc_probe(net_state, param->command_token);
+    if (probe == NULL) {
+        report_reply(net_state->session, param->command_token,
+                     WIRE_REPLY_PROBES_EXHAUSTED, NULL);
+        return;
+    }
+
+    if (decode_probe_address(param->ip_version, param->remote_address,
+                             param->remote_address_bytes,
+                             &probe->remote_addr)) {
+        report_reply(net_state->session, param->command_token,
+                     WIRE_REPLY_INVALID_ARGUMENT, NULL);
+        free_probe(net_state, probe);
+        return;
+    }
+
+    if (get_probe_time(&probe->platform.departure_time)) {
+        perror("get_probe_time failure");
+        exit(EXIT_FAILURE);
+    }
+    record_probe_sent(&net_state->stats);
+
+    simulate_probe_path(net_state->platform.simulation, param, probe);
+    set_probe_timeout(net_state, probe, param);
+}
+
+/*
+    Deliver the replies whose time has come.  A reply to a probe which
+    has since timed out finds no probe, or one sent later with the
+    same sequence number, and is discarded, as a late reply would be.
+*/
+void receive_simulated_replies(
+    struct net_state_t *net_state)
+{
+    struct simulation_t *simulation = net_state->platform.simulation;
+    struct simulated_reply_t reply;
+    struct probe_t *probe;
+    struct timeval now;
+
+    if (get_probe_time(&now)) {
+        perror("get_probe_time failure");
+        exit(EXIT_FAILURE);
+    }
+
+    while (simulation->reply_count > 0
+           && compare_timeval(simulation->reply_heap[0].arrival_time,
+                              now) <= 0) {
+        reply = simulation->reply_heap[0];
+        pop_simulated_reply(simulation);
+
+        probe = find_probe_by_sequence(net_state, reply.sequence);
+        if (probe == NULL
+            || compare_timeval(probe->platform.departure_time,
+                               reply.departure_time) != 0) {
+            net_state->stats.replies_unmatched++;
+            continue;
+        }
+
+        /*  The round trip time is as simulated, however late we are  */
+        receive_probe(net_state, probe, reply.icmp_type,
+                      &reply.remote_addr, &reply.arrival_time,
+                      reply.hop->mpls_count,
+                      (struct mpls_label_t *) reply.hop->mpls);
+    }
+}
+
+/*
+    Find the arrival time of the next simulated reply.  Returns false
+    if no reply is on its way.
+*/
+bool get_next_simulated_reply(
+    const struct net_state_t *net_state,
+    struct timeval *arrival_time)
+{
+    const struct simulation_t *simulation = net_state->platform.simulation;
+
+    if (simulation == NULL || simulation->reply_count == 0) {
+        return false;
+    }
+
+    *arrival_time = simulation->reply_heap[0].arrival_time;
+    return true;
+}
@@ -0,0 +1,183 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+
+#include "stats.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+/*  The current time in nanoseconds, from a clock which never steps  */
+long long get_stats_time_ns(
+    void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec now;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &now) == 0) {
+        return (long long) now.tv_sec * 1000000000 + now.tv_nsec;
+    }
+#endif
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (long long) tv.tv_sec * 1000000000 + tv.tv_usec * 1000LL;
+}
+
+/*  Count a value in the bucket for its power of two  */
+void record_histogram(
+    struct stats_histogram_t *histogram,
+    unsigned long value)
+{
+    int bucket = 0;
+
+    while (value >> bucket && bucket < STATS_HISTOGRAM_BUCKETS - 1) {
+        bucket++;
+    }
+
+    histogram->bucket[bucket]++;
+    histogram->count++;
+    histogram->sum += value;
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+/*
+    Count a probe handed to the kernel, and the time since the command
+    requesting it was read.
+*/
+void record_probe_sent(
+    struct packet_stats_t *stats)
+{
+    long long latency_ns;
+
+    stats->probes_sent++;
+
+    if (stats->command_time_ns) {
+        latency_ns = get_stats_time_ns() - stats->command_time_ns;
+        record_histogram(&stats->send_latency_us,
+                         latency_ns > 0 ? latency_ns / 1000 : 0);
+    }
+}
+
+/*  Count a return from waiting, and the calls made since the last  */
+void record_wakeup(
+    struct packet_stats_t *stats)
+{
+    stats->wakeups++;
+    record_histogram(&stats->syscalls_per_wakeup,
+                     stats->syscalls - stats->wakeup_syscalls);
+    stats->wakeup_syscalls = stats->syscalls;
+}
+
+static
+void add_histogram(
+    struct stats_histogram_t *total,
+    const struct stats_histogram_t *histogram)
+{
+    int i;
+
+    total->count += histogram->count;
+    total->sum += histogram->sum;
+    if (histogram->max > total->max) {
+        total->max = histogram->max;
+    }
+
+    for (i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+        total->bucket[i] += histogram->bucket[i];
+    }
+}
+
+/*
+    Add the counters of one thread to the totals of all.  The peak of
+    outstanding probes is the largest of any one thread, since each
+    thread's peaks may come at different times.
+*/
+void add_packet_stats(
+    struct packet_stats_t *total,
+    const struct packet_stats_t *stats)
+{
+    total->probes_sent += stats->probes_sent;
+    total->replies_matched += stats->replies_matched;
+    total->replies_unmatched += stats->replies_unmatched;
+    total->timeouts += stats->timeouts;
+    total->probes_exhausted += stats->probes_exhausted;
+    if (stats->peak_outstanding > total->peak_outstanding) {
+        total->peak_outstanding = stats->peak_outstanding;
+    }
+    total->wakeups += stats->wakeups;
+    total->syscalls += stats->syscalls;
+
+    add_histogram(&total->syscalls_per_wakeup, &stats->syscalls_per_wakeup);
+    add_histogram(&total->parse_ns, &stats->parse_ns);
+    add_histogram(&total->send_latency_us, &stats->send_latency_us);
+}
+
+/*
+    Queue a histogram as an argument of the stats reply: the count,
+    sum and largest of its values, followed by the count of each
+    bucket, up to the last which isn't empty, separated by commas.
+*/
+static
+void queue_histogram(
+    struct output_queue_t *output,
+    const char *name,
+    const struct stats_histogram_t *histogram)
+{
+    int last = 0;
+    int i;
+
+    for (i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+        if (histogram->bucket[i]) {
+            last = i;
+        }
+    }
+
+    queue_reply(output, " %s %lu,%llu,%lu", name, histogram->count,
+                histogram->sum, histogram->max);
+    for (i = 0; i <= last; i++) {
+        queue_reply(output, ",%lu", histogram->bucket[i]);
+    }
+}
+
+/*  Queue the reply to a stats command  */
+void queue_stats_reply(
+    struct output_queue_t *output,
+    int token,
+    const struct packet_stats_t *stats,
+    int outstanding_probe_count)
+{
+    queue_reply(output, "%d stats probes-sent %lu replies-matched %lu"
+                " replies-unmatched %lu timeouts %lu probes-exhausted %lu"
+                " outstanding-probes %d peak-outstanding-probes %d"
+                " wakeups %lu syscalls %lu", token, stats->probes_sent,
+                stats->replies_matched, stats->replies_unmatched,
+                stats->timeouts, stats->probes_exhausted,
+                outstanding_probe_count, stats->peak_outstanding,
+                stats->wakeups, stats->syscalls);
+
+    queue_histogram(output, "syscalls-per-wakeup",
+                    &stats->syscalls_per_wakeup);
+    queue_histogram(output, "parse-time-ns", &stats->parse_ns);
+    queue_histogram(output, "send-latency-us", &stats->send_latency_us);
+    queue_reply(output, "\n");
+}
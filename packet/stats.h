@@ -0,0 +1,117 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include "output.h"
+
+/*
+    The number of buckets in each histogram.  Bucket 0 counts values of
+    zero, and bucket N counts values from 2^(N-1) up to 2^N - 1, with
+    the last bucket counting everything larger.
+*/
+#define STATS_HISTOGRAM_BUCKETS 32
+
+/*  A distribution of values, such as times, in powers of two  */
+struct stats_histogram_t {
+    /*  The number of values recorded, their sum, and the largest  */
+    unsigned long count;
+    unsigned long long sum;
+    unsigned long max;
+
+    /*  The number of values recorded in each bucket  */
+    unsigned long bucket[STATS_HISTOGRAM_BUCKETS];
+};
+
+/*
+    Counters of mtr-packet's own work, reported by the "stats" command,
+    to tell whether poor results come from the network or from
+    mtr-packet falling behind.
+*/
+struct packet_stats_t {
+    /*  Probes handed to the kernel for transmission  */
+    unsigned long probes_sent;
+
+    /*  Replies matched to an outstanding probe  */
+    unsigned long replies_matched;
+
+    /*  Packets received which matched no outstanding probe  */
+    unsigned long replies_unmatched;
+
+    /*  Probes which timed out before a reply arrived  */
+    unsigned long timeouts;
+
+    /*  Probes refused because too many were already outstanding  */
+    unsigned long probes_exhausted;
+
+    /*  The most probes outstanding at once  */
+    int peak_outstanding;
+
+    /*  Returns from waiting for activity  */
+    unsigned long wakeups;
+
+    /*  System calls made for probes and waiting, in all  */
+    unsigned long syscalls;
+
+    /*  The value of syscalls at the last wakeup  */
+    unsigned long wakeup_syscalls;
+
+    /*  System calls made between one wakeup and the next  */
+    struct stats_histogram_t syscalls_per_wakeup;
+
+    /*  The nanoseconds spent parsing each text command  */
+    struct stats_histogram_t parse_ns;
+
+    /*  Microseconds from the dispatch of a command to its probe's send  */
+    struct stats_histogram_t send_latency_us;
+
+    /*  When dispatch of the commands being sent began, in nanoseconds  */
+    long long command_time_ns;
+};
+
+/*
+    Make a system call, counting it in the stats, and evaluate to its
+    result.  Every call made for a probe or a wait goes through this.
+*/
+#define COUNT_SYSCALL(stats, call) ((stats)->syscalls++, (call))
+
+long long get_stats_time_ns(
+    void);
+
+void record_histogram(
+    struct stats_histogram_t *histogram,
+    unsigned long value);
+
+void record_probe_sent(
+    struct packet_stats_t *stats);
+
+void record_wakeup(
+    struct packet_stats_t *stats);
+
+void add_packet_stats(
+    struct packet_stats_t *total,
+    const struct packet_stats_t *stats);
+
+void queue_stats_reply(
+    struct output_queue_t *output,
+    int token,
+    const struct packet_stats_t *stats,
+    int outstanding_probe_count);
+
+#endif
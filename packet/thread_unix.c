@@ -0,0 +1,731 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+#include "thread_unix.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "wait.h"
+
+/*
+    With MTR_PACKET_THREADS set, probes are sharded across several
+    threads, each with a net state of its own: its own sockets, probe
+    pool and timeout heap, and its own slice of the sequence number
+    range.  Since each thread's receive filters accept only the
+    replies to its own slice, a thread only ever touches the probes
+    it sent, and the probe state needs no locking.
+
+    The main thread reads and parses commands, as usual, and is
+    itself the first shard.  Probes are assigned to shards in turn,
+    and are handed to the worker threads through a single-producer,
+    single-consumer queue for each worker.  A batch of probes is kept
+    together, so that it can still be sent with sendmmsg.
+
+    Replies from all threads are pushed onto a lock-free list, from
+    which a writer thread writes them to stdout, so the wire protocol
+    is unchanged.
+*/
+
+/*  Read the number of threads requested with MTR_PACKET_THREADS  */
+int get_packet_thread_count(
+    void)
+{
+#ifdef HAVE_PTHREAD
+    const char *threads_env;
+    int thread_count;
+
+    threads_env = getenv("MTR_PACKET_THREADS");
+    if (threads_env == NULL || *threads_env == 0) {
+        return 1;
+    }
+
+    thread_count = atoi(threads_env);
+    if (thread_count < 1) {
+        return 1;
+    }
+    if (thread_count > MAX_PACKET_THREADS) {
+        return MAX_PACKET_THREADS;
+    }
+
+    return thread_count;
+#else
+    return 1;
+#endif
+}
+
+/*  The first sequence number in a shard's slice of the range  */
+int get_shard_min_sequence(
+    int shard,
+    int thread_count)
+{
+    int shard_size = (MAX_PORT - MIN_PORT + 1) / thread_count;
+
+    return MIN_PORT + shard * shard_size;
+}
+
+/*  The last sequence number in a shard's slice of the range  */
+int get_shard_max_sequence(
+    int shard,
+    int thread_count)
+{
+    /*  The last shard takes any remainder of the range  */
+    if (shard == thread_count - 1) {
+        return MAX_PORT;
+    }
+
+    return get_shard_min_sequence(shard + 1, thread_count) - 1;
+}
+
+#ifdef HAVE_PTHREAD
+
+#include <pthread.h>
+#include <sched.h>
+
+/*  The size of the largest address in a binary protocol request  */
+#define THREAD_ADDRESS_BYTES 16
+
+/*
+    A probe handed to a worker thread.  The addresses referenced by the
+    probe parameters are copied with it, as the command buffer holding
+    the originals is reused once the command has been dispatched.
+*/
+struct thread_request_t {
+    /*  The parameters of the probe, referencing the storage below  */
+    struct probe_param_t param;
+
+    /*  true if the probe was requested in binary protocol mode  */
+    bool binary_protocol;
+
+    /*  When the main thread began dispatching the probe's command  */
+    long long command_time_ns;
+
+    /*  Storage for the address strings  */
+    char remote_address[PROBE_ADDRESS_LENGTH];
+    char local_address[PROBE_ADDRESS_LENGTH];
+
+    /*  Storage for addresses in network byte order  */
+    unsigned char remote_address_bytes[THREAD_ADDRESS_BYTES];
+    unsigned char local_address_bytes[THREAD_ADDRESS_BYTES];
+};
+
+struct packet_threads_t;
+
+/*  A thread sending and receiving one shard of the probes  */
+struct packet_worker_t {
+    /*  The workers and writer to which we belong  */
+    struct packet_threads_t *threads;
+
+    /*  The thread running the worker  */
+    pthread_t thread;
+
+    /*  The worker's sockets and probes  */
+    struct net_state_t net_state;
+
+    /*  The worker's protocol mode and queued replies  */
+    struct command_session_t session;
+
+    /*  A command buffer with the read end of wake_pipe as its stream  */
+    struct command_buffer_t wake_buffer;
+
+    /*  Written to wake the worker from wait_for_activity  */
+    int wake_pipe[2];
+
+    /*  true while the worker may be waiting for activity  */
+    bool waiting;
+
+    /*  true once the worker should exit after its probes complete  */
+    bool closing;
+
+    /*  The next request to be read, advanced by the worker  */
+    unsigned int queue_head;
+
+    /*  The next request to be written, advanced by the main thread  */
+    unsigned int queue_tail;
+
+    /*  Probe requests from the main thread  */
+    struct thread_request_t queue[THREAD_QUEUE_SIZE];
+
+    /*  Parameters gathered from the queue to be sent as a batch  */
+    struct probe_param_t batch[MAX_BATCH_PROBES];
+
+    /*  Guards stats, which the main thread reads for stats commands  */
+    pthread_mutex_t stats_lock;
+
+    /*  A copy of the worker's counters, as of its last pass  */
+    struct packet_stats_t stats;
+};
+
+/*  Replies pushed by one thread, waiting for the writer thread  */
+struct thread_output_t {
+    /*  The next most recently pushed replies  */
+    struct thread_output_t *next;
+
+    /*  The length of the replies, in bytes  */
+    int length;
+
+    /*  The reply content  */
+    char data[];
+};
+
+/*  The worker threads and the writer thread  */
+struct packet_threads_t {
+    /*  The number of shards, including the main thread  */
+    int thread_count;
+
+    /*  The worker for each shard, except the first  */
+    struct packet_worker_t *worker[MAX_PACKET_THREADS];
+
+    /*  The shard to which the next probe is assigned  */
+    int next_shard;
+
+    /*  The thread writing replies to stdout  */
+    pthread_t writer;
+
+    /*  Written to wake the writer when replies are pushed  */
+    int writer_pipe[2];
+
+    /*  The most recently pushed replies, or NULL if there are none  */
+    struct thread_output_t *output_head;
+};
+
+/*  Open a pipe used to wake a thread  */
+static
+void open_wake_pipe(
+    int *wake_pipe,
+    bool nonblocking)
+{
+    if (pipe(wake_pipe)) {
+        perror("Failure to open thread wake pipe");
+        exit(EXIT_FAILURE);
+    }
+
+    if (fcntl(wake_pipe[0], F_SETFD, FD_CLOEXEC)
+        || fcntl(wake_pipe[1], F_SETFD, FD_CLOEXEC)) {
+        perror("Failure to set thread wake pipe close-on-exec");
+        exit(EXIT_FAILURE);
+    }
+
+    if (nonblocking) {
+        set_socket_nonblocking(wake_pipe[0]);
+        set_socket_nonblocking(wake_pipe[1]);
+    }
+}
+
+/*
+    Write a byte to a wake pipe.  If the pipe is full, the thread is
+    already due to wake, so there is no need to retry.
+*/
+static
+void write_wake(
+    int fd)
+{
+    char wake = 0;
+
+    while (write(fd, &wake, 1) == -1 && errno == EINTR) {
+    }
+}
+
+/*  Wake a worker, if it may be waiting for activity  */
+static
+void wake_worker(
+    struct packet_worker_t *worker)
+{
+    if (__atomic_exchange_n(&worker->waiting, false, __ATOMIC_SEQ_CST)) {
+        write_wake(worker->wake_pipe[1]);
+    }
+}
+
+/*  Returns true if the main thread has no requests queued for a worker  */
+static
+bool is_queue_empty(
+    struct packet_worker_t *worker)
+{
+    return worker->queue_head ==
+        __atomic_load_n(&worker->queue_tail, __ATOMIC_ACQUIRE);
+}
+
+/*  Probes with addresses too long to copy are sent by the main thread  */
+static
+bool is_request_supported(
+    const struct probe_param_t *param)
+{
+    if (param->remote_address
+        && strlen(param->remote_address) >= PROBE_ADDRESS_LENGTH) {
+        return false;
+    }
+
+    if (param->local_address
+        && strlen(param->local_address) >= PROBE_ADDRESS_LENGTH) {
+        return false;
+    }
+
+    return true;
+}
+
+/*  Copy a probe, and the addresses it references, into a request  */
+static
+void copy_request(
+    struct thread_request_t *request,
+    const struct probe_param_t *param,
+    bool binary_protocol)
+{
+    int address_length = param->ip_version == 6 ? 16 : 4;
+
+    request->param = *param;
+    request->binary_protocol = binary_protocol;
+
+    if (param->remote_address) {
+        strcpy(request->remote_address, param->remote_address);
+        request->param.remote_address = request->remote_address;
+    }
+    if (param->local_address) {
+        strcpy(request->local_address, param->local_address);
+        request->param.local_address = request->local_address;
+    }
+
+    if (param->remote_address_bytes) {
+        memcpy(request->remote_address_bytes, param->remote_address_bytes,
+               address_length);
+        request->param.remote_address_bytes = request->remote_address_bytes;
+    }
+    if (param->local_address_bytes) {
+        memcpy(request->local_address_bytes, param->local_address_bytes,
+               address_length);
+        request->param.local_address_bytes = request->local_address_bytes;
+    }
+}
+
+/*
+    Assign probes to the next shard.  Returns false if the probes
+    belong to the main thread's shard, in which case the caller should
+    send them itself.
+*/
+bool forward_probes(
+    struct net_state_t *net_state,
+    const struct probe_param_t *params,
+    int probe_count)
+{
+    struct packet_threads_t *threads = net_state->platform.threads;
+    struct packet_worker_t *worker;
+    bool binary_protocol = net_state->session->binary_protocol;
+    unsigned int tail;
+    int shard;
+    int i;
+
+    shard = threads->next_shard;
+    threads->next_shard = (shard + 1) % threads->thread_count;
+    if (shard == 0) {
+        return false;
+    }
+
+    for (i = 0; i < probe_count; i++) {
+        if (!is_request_supported(&params[i])) {
+            return false;
+        }
+    }
+
+    worker = threads->worker[shard];
+    tail = worker->queue_tail;
+
+    for (i = 0; i < probe_count; i++) {
+        /*  If the worker has fallen behind, let it catch up  */
+        while (tail - __atomic_load_n(&worker->queue_head, __ATOMIC_ACQUIRE)
+               >= THREAD_QUEUE_SIZE) {
+            wake_worker(worker);
+            sched_yield();
+        }
+
+        copy_request(&worker->queue[tail % THREAD_QUEUE_SIZE], &params[i],
+                     binary_protocol);
+        worker->queue[tail % THREAD_QUEUE_SIZE].command_time_ns =
+            net_state->stats.command_time_ns;
+        tail++;
+        __atomic_store_n(&worker->queue_tail, tail, __ATOMIC_RELEASE);
+    }
+
+    wake_worker(worker);
+
+    return true;
+}
+
+/*
+    Send the probes queued for a worker.  Consecutive requests are
+    gathered into batches, to be sent with as few system calls as
+    possible.  Requests are released only after they are sent, as the
+    probe parameters refer to the addresses stored with them.
+*/
+static
+void dispatch_thread_requests(
+    struct packet_worker_t *worker)
+{
+    struct thread_request_t *request;
+    unsigned int head = worker->queue_head;
+    unsigned int tail;
+    int count;
+
+    tail = __atomic_load_n(&worker->queue_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        request = &worker->queue[head % THREAD_QUEUE_SIZE];
+
+        /*  Replies use the protocol mode in which probes were requested  */
+        worker->session.binary_protocol = request->binary_protocol;
+        worker->net_state.stats.command_time_ns = request->command_time_ns;
+
+        count = 0;
+        while (head + count != tail && count < MAX_BATCH_PROBES) {
+            request = &worker->queue[(head + count) % THREAD_QUEUE_SIZE];
+            if (request->binary_protocol != worker->session.binary_protocol) {
+                break;
+            }
+
+            worker->batch[count++] = request->param;
+        }
+
+        send_probe_batch(&worker->net_state, worker->batch, count);
+
+        head += count;
+        __atomic_store_n(&worker->queue_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+/*  Consume the bytes written to wake a worker  */
+static
+void drain_wake_pipe(
+    struct packet_worker_t *worker)
+{
+    char wake[64];
+
+    while (read(worker->wake_pipe[0], wake, sizeof(wake)) > 0) {
+    }
+}
+
+/*
+    The main loop of a worker thread, which mirrors that of the main
+    thread, with probe requests read from the queue rather than from
+    the command stream.
+*/
+static
+void *run_packet_worker(
+    void *arg)
+{
+    struct packet_worker_t *worker = arg;
+    struct net_state_t *net_state = &worker->net_state;
+
+    while (true) {
+        push_thread_output(worker->threads, &worker->session.output);
+
+        if (__atomic_load_n(&worker->closing, __ATOMIC_ACQUIRE)
+            && net_state->outstanding_probe_count == 0
+            && is_queue_empty(worker)) {
+            break;
+        }
+
+        /*
+           The main thread checks our waiting flag after queueing a
+           request, so either we see the request here, or we are woken
+           through the wake pipe.
+         */
+        __atomic_store_n(&worker->waiting, true, __ATOMIC_SEQ_CST);
+        if (is_queue_empty(worker)) {
+            wait_for_activity(&worker->wake_buffer, net_state);
+        }
+        __atomic_store_n(&worker->waiting, false, __ATOMIC_SEQ_CST);
+
+        receive_replies(net_state);
+        drain_wake_pipe(worker);
+        check_probe_timeouts(net_state);
+        dispatch_thread_requests(worker);
+
+        pthread_mutex_lock(&worker->stats_lock);
+        worker->stats = net_state->stats;
+        pthread_mutex_unlock(&worker->stats_lock);
+    }
+
+    return NULL;
+}
+
+/*
+    Push replies from one thread for the writer thread.  The list is
+    a lock-free stack, so the writer is woken only when the list was
+    empty, and will reverse the list to write replies in order.
+*/
+void push_thread_output(
+    struct packet_threads_t *threads,
+    struct output_queue_t *output)
+{
+    struct thread_output_t *chunk;
+    struct thread_output_t *head;
+
+    if (output->length == 0) {
+        return;
+    }
+
+    chunk = malloc(sizeof(struct thread_output_t) + output->length);
+    if (chunk == NULL) {
+        perror("Failure allocating thread replies");
+        exit(EXIT_FAILURE);
+    }
+
+    chunk->length = output->length;
+    memcpy(chunk->data, output->buffer, output->length);
+    output->length = 0;
+
+    head = __atomic_load_n(&threads->output_head, __ATOMIC_RELAXED);
+    do {
+        chunk->next = head;
+    } while (!__atomic_compare_exchange_n(&threads->output_head, &head,
+                                          chunk, true, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+
+    if (head == NULL) {
+        write_wake(threads->writer_pipe[1]);
+    }
+}
+
+/*  Write all pushed replies to stdout, in the order they were pushed  */
+static
+void write_thread_output(
+    struct packet_threads_t *threads)
+{
+    struct output_queue_t queue;
+    struct thread_output_t *chunk;
+    struct thread_output_t *next;
+    struct thread_output_t *ordered = NULL;
+
+    chunk = __atomic_exchange_n(&threads->output_head, NULL,
+                                __ATOMIC_ACQUIRE);
+    while (chunk) {
+        next = chunk->next;
+        chunk->next = ordered;
+        ordered = chunk;
+        chunk = next;
+    }
+
+    while (ordered) {
+        memset(&queue, 0, sizeof(struct output_queue_t));
+        queue.buffer = ordered->data;
+        queue.length = ordered->length;
+        flush_output_queue(&queue, fileno(stdout));
+
+        next = ordered->next;
+        free(ordered);
+        ordered = next;
+    }
+}
+
+/*
+    The writer thread, which writes replies until its wake pipe is
+    closed, after all other threads have pushed their last replies.
+*/
+static
+void *run_packet_writer(
+    void *arg)
+{
+    struct packet_threads_t *threads = arg;
+    char wake[64];
+    ssize_t count;
+
+    while (true) {
+        count = read(threads->writer_pipe[0], wake, sizeof(wake));
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            perror("Failure reading writer wake pipe");
+            exit(EXIT_FAILURE);
+        }
+
+        write_thread_output(threads);
+
+        if (count == 0) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+    Open the sockets of each worker thread, while we still have
+    elevated privileges.  The main thread's net state is already open,
+    with the first shard of the sequence number range.
+*/
+void init_packet_threads_privileged(
+    struct net_state_t *net_state,
+    int thread_count)
+{
+    struct packet_threads_t *threads;
+    struct packet_worker_t *worker;
+    int shard;
+
+    threads = calloc(1, sizeof(struct packet_threads_t));
+    if (threads == NULL) {
+        perror("Failure allocating threads");
+        exit(EXIT_FAILURE);
+    }
+    threads->thread_count = thread_count;
+
+    for (shard = 1; shard < thread_count; shard++) {
+        worker = calloc(1, sizeof(struct packet_worker_t));
+        if (worker == NULL) {
+            perror("Failure allocating worker thread");
+            exit(EXIT_FAILURE);
+        }
+
+        worker->threads = threads;
+        pthread_mutex_init(&worker->stats_lock, NULL);
+        init_net_state_range_privileged(&worker->net_state,
+                                        get_shard_min_sequence(shard,
+                                                               thread_count),
+                                        get_shard_max_sequence(shard,
+                                                               thread_count));
+        worker->net_state.session = &worker->session;
+
+        threads->worker[shard] = worker;
+    }
+
+    net_state->platform.threads = threads;
+}
+
+/*  Complete the initialization of the workers, and start the threads  */
+void start_packet_threads(
+    struct net_state_t *net_state)
+{
+    struct packet_threads_t *threads = net_state->platform.threads;
+    struct packet_worker_t *worker;
+    int shard;
+
+    open_wake_pipe(threads->writer_pipe, false);
+    if (pthread_create(&threads->writer, NULL, run_packet_writer, threads)) {
+        fprintf(stderr, "Failure to start writer thread\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (shard = 1; shard < threads->thread_count; shard++) {
+        worker = threads->worker[shard];
+
+        init_net_state(&worker->net_state);
+
+        open_wake_pipe(worker->wake_pipe, true);
+        memset(&worker->wake_buffer, 0, sizeof(struct command_buffer_t));
+        worker->wake_buffer.command_stream = worker->wake_pipe[0];
+
+        if (pthread_create(&worker->thread, NULL, run_packet_worker,
+                           worker)) {
+            fprintf(stderr, "Failure to start worker thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/*
+    Wait for the workers to report on all their probes, and for the
+    writer to write the last of the replies.
+*/
+void stop_packet_threads(
+    struct net_state_t *net_state)
+{
+    struct packet_threads_t *threads = net_state->platform.threads;
+    struct packet_worker_t *worker;
+    int shard;
+
+    for (shard = 1; shard < threads->thread_count; shard++) {
+        worker = threads->worker[shard];
+
+        __atomic_store_n(&worker->closing, true, __ATOMIC_RELEASE);
+        write_wake(worker->wake_pipe[1]);
+    }
+
+    for (shard = 1; shard < threads->thread_count; shard++) {
+        pthread_join(threads->worker[shard]->thread, NULL);
+    }
+
+    close(threads->writer_pipe[1]);
+    pthread_join(threads->writer, NULL);
+}
+
+/*
+    Add the counters of the workers to a total.  Each worker copies its
+    counters under its lock once per pass of its loop, so a count may be
+    a pass stale, but is never read while being written.
+*/
+void add_thread_stats(
+    struct net_state_t *net_state,
+    struct packet_stats_t *total)
+{
+    struct packet_threads_t *threads = net_state->platform.threads;
+    struct packet_worker_t *worker;
+    int shard;
+
+    for (shard = 1; shard < threads->thread_count; shard++) {
+        worker = threads->worker[shard];
+
+        pthread_mutex_lock(&worker->stats_lock);
+        add_packet_stats(total, &worker->stats);
+        pthread_mutex_unlock(&worker->stats_lock);
+    }
+}
+
+#else
+
+/*  Without POSIX threads, get_packet_thread_count is always one  */
+
+void init_packet_threads_privileged(
+    struct net_state_t *net_state,
+    int thread_count)
+{
+}
+
+void start_packet_threads(
+    struct net_state_t *net_state)
+{
+}
+
+void stop_packet_threads(
+    struct net_state_t *net_state)
+{
+}
+
+bool forward_probes(
+    struct net_state_t *net_state,
+    const struct probe_param_t *params,
+    int probe_count)
+{
+    return false;
+}
+
+void push_thread_output(
+    struct packet_threads_t *threads,
+    struct output_queue_t *output)
+{
+}
+
+void add_thread_stats(
+    struct net_state_t *net_state,
+    struct packet_stats_t *total)
+{
+}
+
+#endif
@@ -0,0 +1,78 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef THREAD_UNIX_H
+#define THREAD_UNIX_H
+
+#include <stdbool.h>
+
+#include "output.h"
+#include "probe.h"
+
+/*  The most threads among which probes may be sharded  */
+#define MAX_PACKET_THREADS 16
+
+/*  The number of probe requests which may be queued for a worker  */
+#define THREAD_QUEUE_SIZE 1024
+
+/*
+    Each thread has its own probe pool, so every thread must be able
+    to have MAX_PROBES probes in flight within its slice of the
+    sequence number range.
+*/
+#if MAX_PROBES * MAX_PACKET_THREADS > MAX_PORT - MIN_PORT + 1
+#error MAX_PACKET_THREADS exceeds the range of probe sequence numbers
+#endif
+
+struct packet_threads_t;
+
+int get_packet_thread_count(
+    void);
+
+int get_shard_min_sequence(
+    int shard,
+    int thread_count);
+
+int get_shard_max_sequence(
+    int shard,
+    int thread_count);
+
+void init_packet_threads_privileged(
+    struct net_state_t *net_state,
+    int thread_count);
+
+void start_packet_threads(
+    struct net_state_t *net_state);
+
+void stop_packet_threads(
+    struct net_state_t *net_state);
+
+bool forward_probes(
+    struct net_state_t *net_state,
+    const struct probe_param_t *params,
+    int probe_count);
+
+void push_thread_output(
+    struct packet_threads_t *threads,
+    struct output_queue_t *output);
+
+void add_thread_stats(
+    struct net_state_t *net_state,
+    struct packet_stats_t *total);
+
+#endif
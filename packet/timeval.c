@@ -16,8 +16,19 @@
     51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
+#include "config.h"
 #include "timeval.h"
 
+#include <time.h>
+
+/*  A monotonic clock isn't stepped when the system time is changed  */
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+#define USE_MONOTONIC_CLOCK
+
+/*  The clock used to time probes, which may be made CLOCK_MONOTONIC_RAW  */
+static clockid_t probe_clock = CLOCK_MONOTONIC;
+#endif
+
 /*
     Ensure that a timevalue has a microsecond value in the range
     [0.0, 1.0e6) microseconds by converting microseconds to full seconds.
@@ -75,3 +86,80 @@ int compare_timeval(
 
     return 0;
 }
+
+/*
+    Get the current time, for timing probes.  Where available, we use
+    a monotonic clock, so that adjustments to the system time, such as
+    those made by NTP, don't distort round trip times or timeouts.
+*/
+int get_probe_time(
+    struct timeval *now)
+{
+#ifdef USE_MONOTONIC_CLOCK
+    struct timespec monotonic;
+
+    if (clock_gettime(probe_clock, &monotonic)) {
+        return -1;
+    }
+
+    now->tv_sec = monotonic.tv_sec;
+    now->tv_usec = monotonic.tv_nsec / 1000;
+
+    return 0;
+#else
+    return gettimeofday(now, NULL);
+#endif
+}
+
+/*
+    Time probes with a clock which, unlike CLOCK_MONOTONIC, isn't slewed
+    by NTP, where one is available.  This must be called before the
+    first probe is timed.
+*/
+void use_raw_probe_clock(
+    void)
+{
+#if defined(USE_MONOTONIC_CLOCK) && defined(CLOCK_MONOTONIC_RAW)
+    struct timespec raw;
+
+    if (clock_gettime(CLOCK_MONOTONIC_RAW, &raw) == 0) {
+        probe_clock = CLOCK_MONOTONIC_RAW;
+    }
+#endif
+}
+
+/*
+    Timestamps provided by the kernel with packets are in system time.
+    Get the offset of system time from the clock used by get_probe_time,
+    so that kernel timestamps can be converted with kernel_to_probe_time.
+*/
+int get_kernel_time_offset(
+    struct timeval *offset)
+{
+#ifdef USE_MONOTONIC_CLOCK
+    struct timeval now;
+
+    if (gettimeofday(offset, NULL) || get_probe_time(&now)) {
+        return -1;
+    }
+
+    offset->tv_sec -= now.tv_sec;
+    offset->tv_usec -= now.tv_usec;
+    normalize_timeval(offset);
+#else
+    offset->tv_sec = 0;
+    offset->tv_usec = 0;
+#endif
+
+    return 0;
+}
+
+/*  Convert a kernel timestamp to the clock used by get_probe_time  */
+void kernel_to_probe_time(
+    struct timeval *timestamp,
+    const struct timeval *offset)
+{
+    timestamp->tv_sec -= offset->tv_sec;
+    timestamp->tv_usec -= offset->tv_usec;
+    normalize_timeval(timestamp);
+}
@@ -28,4 +28,17 @@ int compare_timeval(
     struct timeval a,
     struct timeval b);
 
+int get_probe_time(
+    struct timeval *now);
+
+void use_raw_probe_clock(
+    void);
+
+int get_kernel_time_offset(
+    struct timeval *offset);
+
+void kernel_to_probe_time(
+    struct timeval *timestamp,
+    const struct timeval *offset);
+
 #endif
@@ -0,0 +1,77 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "config.h"
+
+/*
+    Static tracepoints, for SystemTap, DTrace or bpftrace, on the path
+    of each probe from mtr, through mtr-packet, and back again.  They
+    are built with --enable-usdt, and compile to nothing otherwise.
+    A tracer records the time at which each tracepoint fires, so the
+    arguments carry only the identities of the probe, and times which
+    are already at hand.
+
+    In mtr, under the provider "mtr":
+
+        send_probe_command(token, ttl)
+        net_process_ping(token, err, round_trip_us)
+
+    In mtr-packet, under the provider "mtr_packet":
+
+        dispatch_command(token, dispatch_ns)
+        alloc_probe(token, sequence)
+        send_packet(sequence, socket)
+        receive_probe(token, sequence, arrival_us, round_trip_us)
+        respond_to_probe(token, sequence, round_trip_us)
+
+    The token of a probe is the sequence number given it by mtr, and
+    its sequence is the number mtr-packet gives it in turn.  For
+    example, the time from mtr sending a probe command to mtr-packet
+    sending the probe's packet:
+
+        bpftrace -e '
+            usdt:./mtr:mtr:send_probe_command { @sent[arg0] = nsecs; }
+            usdt:./mtr-packet:mtr_packet:alloc_probe {
+                @token[arg1] = arg0; }
+            usdt:./mtr-packet:mtr_packet:send_packet
+            /@sent[@token[arg0]]/ {
+                @us = hist((nsecs - @sent[@token[arg0]]) / 1000); }'
+*/
+#ifdef HAVE_USDT
+
+#include <sys/sdt.h>
+
+#define TRACE_PROBE2(provider, name, a, b) \
+    DTRACE_PROBE2(provider, name, a, b)
+#define TRACE_PROBE3(provider, name, a, b, c) \
+    DTRACE_PROBE3(provider, name, a, b, c)
+#define TRACE_PROBE4(provider, name, a, b, c, d) \
+    DTRACE_PROBE4(provider, name, a, b, c, d)
+
+#else
+
+#define TRACE_PROBE2(provider, name, a, b)
+#define TRACE_PROBE3(provider, name, a, b, c)
+#define TRACE_PROBE4(provider, name, a, b, c, d)
+
+#endif
+
+#endif
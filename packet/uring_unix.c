@@ -0,0 +1,999 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "uring_unix.h"
+
+#include "config.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#include "deconstruct_unix.h"
+#include "timeval.h"
+
+/*
+    With epoll, each probe costs a sendto, and each reply a wakeup
+    followed by a recvmmsg which eventually returns EAGAIN.  The
+    io_uring engine instead queues our sends in a submission ring, and
+    keeps multishot receives armed on the raw receive sockets, so that
+    the kernel delivers each reply into one of our buffers as it
+    arrives.  A single io_uring_enter call per pass through the main
+    loop then submits the sends queued by the previous pass, and waits
+    for completions.
+
+    Other descriptors, such as the command stream, the unprivileged
+    ICMP sockets and TCP probe sockets, are waited on with poll
+    requests, and read by the main loop as they are with epoll.
+
+    The engine is used only when MTR_PACKET_URING is set in the
+    environment, and if it can't be set up, we fall back to epoll.
+    We make the system calls directly, rather than depending on
+    liburing.  Multishot receives need Linux 6.0.
+*/
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup) \
+    && defined(IORING_RECV_MULTISHOT)
+
+/*  The number of entries in the submission and completion queues  */
+#define URING_SUBMIT_SIZE 256
+#define URING_COMPLETE_SIZE (4 * MAX_PROBES)
+
+/*  The buffers provided to the kernel for multishot receives  */
+#define URING_BUFFER_COUNT 256
+#define URING_BUFFER_SIZE 2048
+#define URING_BUFFER_GROUP 0
+
+/*  Space for the control data, and its timestamp, of a receive  */
+#define URING_CONTROL_SIZE 64
+
+/*  The most receive sockets and polled descriptors we'll have  */
+#define URING_RECV_MAX 4
+#define URING_POLL_MAX 16
+
+/*
+    The user data of each request identifies what it is for, using
+    the upper half, and which one, using the lower half.
+*/
+#define URING_KIND_SHIFT 32
+#define URING_INDEX_MASK 0xFFFFFFFF
+
+enum uring_request_kind_t {
+    URING_POLL = 1,
+    URING_PROBE_POLL,
+    URING_RECV,
+    URING_SEND,
+    URING_CANCEL
+};
+
+/*  A raw socket on which a multishot receive is kept armed  */
+struct uring_recv_t {
+    /*  The receiving socket  */
+    int socket;
+
+    /*  The function used to decode packets received on the socket  */
+    received_packet_func_t handle_received_packet;
+
+    /*  true if a multishot receive is outstanding  */
+    bool armed;
+};
+
+/*  A descriptor for which we wait for readability  */
+struct uring_poll_t {
+    /*  The descriptor to poll  */
+    int fd;
+
+    /*  true if a poll request is outstanding  */
+    bool armed;
+};
+
+/*
+    A probe packet queued for transmission.  The kernel reads the
+    message when the request is submitted, which happens after the
+    caller's buffers have been reused, so we keep our own copy.
+*/
+struct uring_send_t {
+    /*
+        The probe being sent, until the send is submitted, or NULL if
+        the probe was freed before then
+    */
+    struct probe_t *probe;
+
+    /*  The socket and sequence number, for matching the completion  */
+    int socket;
+    int sequence;
+
+    /*  The message, and the storage it points at  */
+    struct msghdr msg;
+    struct iovec iov;
+    struct sockaddr_storage addr;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    char *packet;
+};
+
+struct uring_t {
+    /*  The io_uring descriptor  */
+    int fd;
+
+    /*  The submission queue, shared with the kernel  */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+
+    /*  The completion queue, shared with the kernel  */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /*  The ring through which we provide receive buffers  */
+    struct io_uring_buf_ring *buf_ring;
+    char *buffers;
+    unsigned short buf_tail;
+
+    /*  The layout of the name and control data in receive buffers  */
+    struct msghdr recv_msg;
+
+    /*  true once the descriptors below have been gathered  */
+    bool registered;
+
+    struct uring_recv_t recv[URING_RECV_MAX];
+    int recv_count;
+
+    struct uring_poll_t poll[URING_POLL_MAX];
+    int poll_count;
+
+    /*  Send slots, one for each probe which may be outstanding  */
+    struct uring_send_t send[MAX_PROBES];
+
+    /*  The indices of unused send slots  */
+    int free_send[MAX_PROBES];
+    int free_send_count;
+
+    /*  The indices of queued sends which haven't yet been submitted  */
+    int unsubmitted_send[MAX_PROBES];
+    int unsubmitted_send_count;
+
+    /*  The stats of the net_state, in which we count our submissions  */
+    struct packet_stats_t *stats;
+};
+
+static
+int io_uring_setup(
+    unsigned entries,
+    struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static
+int io_uring_enter(
+    int fd,
+    unsigned to_submit,
+    unsigned min_complete,
+    unsigned flags,
+    void *arg,
+    size_t arg_size)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                   flags, arg, arg_size);
+}
+
+static
+int io_uring_register(
+    int fd,
+    unsigned opcode,
+    void *arg,
+    unsigned arg_count)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, arg_count);
+}
+
+/*  Give a receive buffer to the kernel  */
+static
+void provide_uring_buffer(
+    struct uring_t *uring,
+    int buffer_id)
+{
+    struct io_uring_buf *buf;
+
+    buf = &uring->buf_ring->bufs[uring->buf_tail &
+                                 (URING_BUFFER_COUNT - 1)];
+    buf->addr = (uintptr_t) & uring->buffers[buffer_id * URING_BUFFER_SIZE];
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = buffer_id;
+
+    uring->buf_tail++;
+    __atomic_store_n(&uring->buf_ring->tail, uring->buf_tail,
+                     __ATOMIC_RELEASE);
+}
+
+/*
+    Map the submission and completion queues, and register our receive
+    buffers.  Returns false if the kernel lacks a feature we need.
+*/
+static
+bool map_uring(
+    struct uring_t *uring,
+    const struct io_uring_params *params)
+{
+    struct io_uring_buf_reg buf_reg;
+    size_t ring_size;
+    size_t cq_size;
+    char *ring;
+    void *sqes;
+    void *buf_ring;
+    int i;
+
+    ring_size = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+    cq_size = params->cq_off.cqes +
+        params->cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_size > ring_size) {
+        ring_size = cq_size;
+    }
+
+    ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED) {
+        return false;
+    }
+
+    sqes = mmap(NULL, params->sq_entries * sizeof(struct io_uring_sqe),
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                uring->fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        return false;
+    }
+
+    uring->sq_head = (unsigned *) (ring + params->sq_off.head);
+    uring->sq_tail = (unsigned *) (ring + params->sq_off.tail);
+    uring->sq_mask = *(unsigned *) (ring + params->sq_off.ring_mask);
+    uring->sq_entries = params->sq_entries;
+    uring->sq_array = (unsigned *) (ring + params->sq_off.array);
+    uring->sqes = sqes;
+
+    uring->cq_head = (unsigned *) (ring + params->cq_off.head);
+    uring->cq_tail = (unsigned *) (ring + params->cq_off.tail);
+    uring->cq_mask = *(unsigned *) (ring + params->cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *) (ring + params->cq_off.cqes);
+
+    /*  The buffer ring must be page aligned  */
+    buf_ring = mmap(NULL, URING_BUFFER_COUNT * sizeof(struct io_uring_buf),
+                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                    -1, 0);
+    if (buf_ring == MAP_FAILED) {
+        return false;
+    }
+    uring->buf_ring = buf_ring;
+
+    memset(&buf_reg, 0, sizeof(struct io_uring_buf_reg));
+    buf_reg.ring_addr = (uintptr_t) buf_ring;
+    buf_reg.ring_entries = URING_BUFFER_COUNT;
+    buf_reg.bgid = URING_BUFFER_GROUP;
+
+    if (io_uring_register(uring->fd, IORING_REGISTER_PBUF_RING,
+                          &buf_reg, 1)) {
+        return false;
+    }
+
+    uring->buffers = malloc(URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+    if (uring->buffers == NULL) {
+        perror("Failure to allocate receive buffers");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < URING_BUFFER_COUNT; i++) {
+        provide_uring_buffer(uring, i);
+    }
+
+    return true;
+}
+
+/*
+    Create the io_uring, if it has been requested through the
+    environment.  If that fails, platform.uring remains NULL, and
+    we'll wait with epoll or select instead.
+*/
+void init_uring(
+    struct net_state_t *net_state)
+{
+    struct io_uring_params params;
+    struct uring_t *uring;
+    const char *uring_env;
+    int i;
+
+    uring_env = getenv("MTR_PACKET_URING");
+    if (uring_env == NULL || *uring_env == 0) {
+        return;
+    }
+
+    memset(&params, 0, sizeof(struct io_uring_params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_COMPLETE_SIZE;
+
+    uring = calloc(1, sizeof(struct uring_t));
+    if (uring == NULL) {
+        perror("Failure to allocate io_uring state");
+        exit(EXIT_FAILURE);
+    }
+
+    uring->fd = io_uring_setup(URING_SUBMIT_SIZE, &params);
+    if (uring->fd == -1) {
+        free(uring);
+        return;
+    }
+
+    /*
+       We need the kernel to hold completions rather than drop them
+       when the completion queue is full, and to accept a timeout with
+       io_uring_enter.  Mapping failures leave the mappings in place,
+       but this happens at most once.
+     */
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)
+        || !(params.features & IORING_FEAT_NODROP)
+        || !(params.features & IORING_FEAT_EXT_ARG)
+        || !map_uring(uring, &params)) {
+        close(uring->fd);
+        free(uring->buffers);
+        free(uring);
+        return;
+    }
+
+    uring->recv_msg.msg_namelen = sizeof(struct sockaddr_storage);
+    uring->recv_msg.msg_controllen = URING_CONTROL_SIZE;
+
+    for (i = 0; i < MAX_PROBES; i++) {
+        uring->free_send[i] = MAX_PROBES - 1 - i;
+    }
+    uring->free_send_count = MAX_PROBES;
+    uring->stats = &net_state->stats;
+
+    net_state->platform.uring = uring;
+}
+
+/*
+    Record the departure time of sends about to be submitted.  As the
+    kernel transmits them during submission, this is more accurate
+    than the time at which they were queued.
+*/
+static
+void start_uring_sends(
+    struct uring_t *uring)
+{
+    struct uring_send_t *send;
+    struct timeval now;
+    int i;
+
+    if (uring->unsubmitted_send_count == 0) {
+        return;
+    }
+
+    if (get_probe_time(&now)) {
+        perror("get_probe_time failure");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < uring->unsubmitted_send_count; i++) {
+        send = &uring->send[uring->unsubmitted_send[i]];
+        if (send->probe) {
+            send->probe->platform.departure_time = now;
+            send->probe = NULL;
+        }
+    }
+
+    uring->unsubmitted_send_count = 0;
+}
+
+/*  The number of queued requests not yet consumed by the kernel  */
+static
+unsigned get_uring_unsubmitted(
+    const struct uring_t *uring)
+{
+    return *uring->sq_tail - __atomic_load_n(uring->sq_head,
+                                             __ATOMIC_ACQUIRE);
+}
+
+/*
+    Get a cleared submission queue entry.  The kernel only reads the
+    queue when we call io_uring_enter, so the caller may fill the entry
+    after the tail has advanced.  If the queue is full, we submit what
+    it holds, without waiting for completions.
+*/
+static
+struct io_uring_sqe *get_uring_sqe(
+    struct uring_t *uring,
+    enum uring_request_kind_t kind,
+    int index)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail;
+    int submitted;
+
+    while (get_uring_unsubmitted(uring) >= uring->sq_entries) {
+        start_uring_sends(uring);
+
+        submitted =
+            COUNT_SYSCALL(uring->stats,
+                          io_uring_enter(uring->fd,
+                                         get_uring_unsubmitted(uring), 0, 0,
+                                         NULL, 0));
+        if (submitted == -1 && errno != EINTR) {
+            perror("io_uring submission failure");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    tail = *uring->sq_tail;
+    sqe = &uring->sqes[tail & uring->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->user_data = ((uint64_t) kind << URING_KIND_SHIFT) | index;
+
+    uring->sq_array[tail & uring->sq_mask] = tail & uring->sq_mask;
+    __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    return sqe;
+}
+
+/*  Arm a one-shot poll for a descriptor  */
+static
+void arm_uring_poll(
+    struct uring_t *uring,
+    enum uring_request_kind_t kind,
+    int index,
+    int fd,
+    unsigned events)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = get_uring_sqe(uring, kind, index);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+}
+
+/*  Arm a multishot receive on a raw receive socket  */
+static
+void arm_uring_recv(
+    struct uring_t *uring,
+    int index)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = get_uring_sqe(uring, URING_RECV, index);
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = uring->recv[index].socket;
+    sqe->addr = (uintptr_t) & uring->recv_msg;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+
+    uring->recv[index].armed = true;
+}
+
+/*  Add a descriptor to wait on for readability, if it is open  */
+static
+void add_uring_poll(
+    struct uring_t *uring,
+    int fd)
+{
+    if (fd && uring->poll_count < URING_POLL_MAX) {
+        uring->poll[uring->poll_count++].fd = fd;
+    }
+}
+
+/*  Add a raw socket on which to keep a multishot receive armed  */
+static
+void add_uring_recv(
+    struct uring_t *uring,
+    int socket,
+    received_packet_func_t handle_received_packet)
+{
+    struct uring_recv_t *recv;
+
+    if (!socket) {
+        return;
+    }
+
+    recv = &uring->recv[uring->recv_count++];
+    recv->socket = socket;
+    recv->handle_received_packet = handle_received_packet;
+}
+
+/*
+    Gather the descriptors we wait on.  These match those registered
+    with epoll, except that the raw receive sockets, which
+    receive_replies would read with recvmmsg, are read by multishot
+    receives instead.
+*/
+static
+void register_uring_fds(
+    const struct command_buffer_t *command_buffer,
+    struct net_state_t *net_state)
+{
+    struct uring_t *uring = net_state->platform.uring;
+    struct net_state_platform_t *platform = &net_state->platform;
+
+    /*  The command stream is usually stdin, so it may be descriptor 0  */
+    uring->poll[uring->poll_count++].fd = command_buffer->command_stream;
+
+    if (platform->ring.socket) {
+        add_uring_poll(uring, platform->ring.socket);
+    }
+
+    if (platform->ip4_socket_raw) {
+        if (!platform->ring.socket) {
+            add_uring_recv(uring, platform->ip4_recv_socket,
+                           handle_received_ip4_packet);
+        }
+    } else {
+        add_uring_poll(uring, platform->ip4_txrx_icmp_socket);
+        add_uring_poll(uring, platform->ip4_txrx_udp_socket);
+    }
+
+    if (platform->ip6_socket_raw) {
+        if (!platform->ring.socket) {
+            add_uring_recv(uring, platform->ip6_recv_socket,
+                           handle_received_ip6_packet);
+        }
+    } else {
+        add_uring_poll(uring, platform->ip6_txrx_icmp_socket);
+        add_uring_poll(uring, platform->ip6_txrx_udp_socket);
+    }
+
+    add_uring_recv(uring, platform->ip4_tcp_recv_socket,
+                   handle_received_tcp4_packet);
+    add_uring_recv(uring, platform->tcp6_socket,
+                   handle_received_tcp6_packet);
+    add_uring_poll(uring, platform->route_socket);
+
+    uring->registered = true;
+}
+
+/*
+    Returns true if a socket is read by a multishot receive, in which
+    case receive_replies needn't read it.
+*/
+bool is_uring_receiving(
+    const struct net_state_t *net_state,
+    int socket)
+{
+    const struct uring_t *uring = net_state->platform.uring;
+    int i;
+
+    if (uring == NULL) {
+        return false;
+    }
+
+    for (i = 0; i < uring->recv_count; i++) {
+        if (uring->recv[i].socket == socket) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+    Queue the transmission of a probe packet.  Returns false if the
+    packet can't be queued, in which case the caller should send it.
+*/
+bool queue_uring_send(
+    struct net_state_t *net_state,
+    int socket,
+    struct probe_t *probe,
+    const struct msghdr *msg)
+{
+    struct uring_t *uring = net_state->platform.uring;
+    struct uring_send_t *send;
+    struct io_uring_sqe *sqe;
+    int index;
+
+    if (uring == NULL || uring->free_send_count == 0
+        || msg->msg_iovlen != 1
+        || msg->msg_iov[0].iov_len > PACKET_BUFFER_SIZE
+        || msg->msg_namelen > sizeof(struct sockaddr_storage)
+        || msg->msg_controllen > sizeof(send->control)) {
+        return false;
+    }
+
+    index = uring->free_send[--uring->free_send_count];
+    send = &uring->send[index];
+
+    if (send->packet == NULL) {
+        send->packet = malloc(PACKET_BUFFER_SIZE);
+        if (send->packet == NULL) {
+            perror("Failure to allocate send buffer");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    send->probe = probe;
+    send->socket = socket;
+    send->sequence = probe->sequence;
+
+    memcpy(send->packet, msg->msg_iov[0].iov_base, msg->msg_iov[0].iov_len);
+    send->iov.iov_base = send->packet;
+    send->iov.iov_len = msg->msg_iov[0].iov_len;
+
+    memset(&send->msg, 0, sizeof(struct msghdr));
+    memcpy(&send->addr, msg->msg_name, msg->msg_namelen);
+    send->msg.msg_name = &send->addr;
+    send->msg.msg_namelen = msg->msg_namelen;
+    send->msg.msg_iov = &send->iov;
+    send->msg.msg_iovlen = 1;
+
+    if (msg->msg_controllen) {
+        memcpy(send->control.buf, msg->msg_control, msg->msg_controllen);
+        send->msg.msg_control = send->control.buf;
+        send->msg.msg_controllen = msg->msg_controllen;
+    }
+
+    sqe = get_uring_sqe(uring, URING_SEND, index);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = socket;
+    sqe->addr = (uintptr_t) & send->msg;
+    sqe->len = 1;
+
+    uring->unsubmitted_send[uring->unsubmitted_send_count++] = index;
+
+    return true;
+}
+
+/*
+    Forget a probe being freed, so that a send of it not yet submitted
+    doesn't record its departure in the freed probe.
+*/
+void uring_forget_probe(
+    const struct net_state_t *net_state,
+    const struct probe_t *probe)
+{
+    struct uring_t *uring = net_state->platform.uring;
+    struct uring_send_t *send;
+    int i;
+
+    if (uring == NULL) {
+        return;
+    }
+
+    for (i = 0; i < uring->unsubmitted_send_count; i++) {
+        send = &uring->send[uring->unsubmitted_send[i]];
+        if (send->probe == probe) {
+            send->probe = NULL;
+        }
+    }
+}
+
+/*
+    Wait for a newly opened probe socket to become writable.  The
+    request is identified by the probe's place in the pool, so that
+    its completion tells us which probe is ready.
+*/
+void uring_add_probe_socket(
+    const struct net_state_t *net_state,
+    const struct probe_t *probe)
+{
+    arm_uring_poll(net_state->platform.uring, URING_PROBE_POLL,
+                   probe - net_state->probe_pool, probe->platform.socket,
+                   POLLOUT);
+}
+
+/*
+    Cancel the poll of a probe socket which is about to be closed.
+    If the poll has already completed, the cancellation fails, which
+    is harmless.
+*/
+void uring_remove_probe_socket(
+    const struct net_state_t *net_state,
+    const struct probe_t *probe)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = get_uring_sqe(net_state->platform.uring, URING_CANCEL, 0);
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->addr = ((uint64_t) URING_PROBE_POLL << URING_KIND_SHIFT)
+        | (probe - net_state->probe_pool);
+}
+
+/*
+    Decode a packet delivered by a multishot receive.  The buffer
+    holds a header describing the message, followed by space for the
+    source address and control data, laid out as in recv_msg, and
+    then the packet itself.
+*/
+static
+void handle_uring_packet(
+    struct net_state_t *net_state,
+    struct uring_t *uring,
+    struct uring_recv_t *recv,
+    const char *buffer,
+    int length,
+    const struct timeval *kernel_offset)
+{
+    const struct io_uring_recvmsg_out *out;
+    struct sockaddr_storage remote_addr;
+    struct msghdr control_msg;
+    struct timeval timestamp;
+    const char *name;
+    const char *control;
+    const char *packet;
+    int packet_length;
+    int name_length;
+
+    if (length < sizeof(struct io_uring_recvmsg_out)) {
+        return;
+    }
+
+    out = (const struct io_uring_recvmsg_out *) buffer;
+    name = buffer + sizeof(struct io_uring_recvmsg_out);
+    control = name + uring->recv_msg.msg_namelen;
+    packet = control + uring->recv_msg.msg_controllen;
+
+    packet_length = length - (packet - buffer);
+    if (packet_length < 0) {
+        return;
+    }
+    if (out->payloadlen < packet_length) {
+        packet_length = out->payloadlen;
+    }
+
+    name_length = out->namelen;
+    if (name_length > sizeof(struct sockaddr_storage)) {
+        name_length = sizeof(struct sockaddr_storage);
+    }
+    memset(&remote_addr, 0, sizeof(struct sockaddr_storage));
+    memcpy(&remote_addr, name, name_length);
+
+    memset(&control_msg, 0, sizeof(struct msghdr));
+    control_msg.msg_control = (void *) control;
+    control_msg.msg_controllen = out->controllen;
+
+    if (get_control_timestamp(&control_msg, &timestamp)) {
+        kernel_to_probe_time(&timestamp, kernel_offset);
+    } else if (get_probe_time(&timestamp)) {
+        perror("get_probe_time failure");
+        exit(EXIT_FAILURE);
+    }
+
+    recv->handle_received_packet(net_state, &remote_addr, packet,
+                                 packet_length, &timestamp);
+}
+
+/*  Handle the completion of one request  */
+static
+void handle_uring_completion(
+    struct net_state_t *net_state,
+    const struct io_uring_cqe *cqe,
+    const struct timeval *kernel_offset)
+{
+    struct uring_t *uring = net_state->platform.uring;
+    struct uring_recv_t *recv;
+    struct uring_send_t *send;
+    int kind = cqe->user_data >> URING_KIND_SHIFT;
+    int index = cqe->user_data & URING_INDEX_MASK;
+    int buffer_id;
+
+    if (kind == URING_POLL) {
+        uring->poll[index].armed = false;
+    } else if (kind == URING_PROBE_POLL) {
+        /*  A cancelled poll completes too, for a probe already freed  */
+        if (cqe->res > 0) {
+            mark_probe_ready(net_state, &net_state->probe_pool[index]);
+        }
+    } else if (kind == URING_RECV) {
+        recv = &uring->recv[index];
+
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            buffer_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+            if (cqe->res > 0) {
+                handle_uring_packet(net_state, uring, recv,
+                                    &uring->buffers[buffer_id *
+                                                    URING_BUFFER_SIZE],
+                                    cqe->res, kernel_offset);
+            }
+
+            provide_uring_buffer(uring, buffer_id);
+        }
+
+        /*
+           The receive ends when we've run out of buffers, and will be
+           rearmed before we next wait.  If it failed for another
+           reason, we read the socket in receive_replies instead.
+         */
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            recv->armed = false;
+
+            if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+                add_uring_poll(uring, recv->socket);
+                recv->socket = 0;
+            }
+        }
+    } else if (kind == URING_SEND) {
+        send = &uring->send[index];
+
+        complete_queued_send(net_state, send->socket, send->sequence,
+                             cqe->res);
+        uring->free_send[uring->free_send_count++] = index;
+    }
+}
+
+/*  Handle all available completions  */
+static
+void reap_uring_completions(
+    struct net_state_t *net_state)
+{
+    struct uring_t *uring = net_state->platform.uring;
+    struct io_uring_cqe cqe;
+    struct timeval kernel_offset;
+    unsigned head;
+
+    if (get_kernel_time_offset(&kernel_offset)) {
+        perror("get_kernel_time_offset failure");
+        exit(EXIT_FAILURE);
+    }
+
+    head = *uring->cq_head;
+    while (head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+        cqe = uring->cqes[head & uring->cq_mask];
+
+        /*  Release the entry before handling it, which may queue more  */
+        head++;
+        __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+
+        handle_uring_completion(net_state, &cqe, &kernel_offset);
+    }
+}
+
+/*
+    Submit everything queued, and sleep until at least one request
+    completes or the next probe times out, then handle the completions.
+*/
+void uring_wait_for_activity(
+    struct command_buffer_t *command_buffer,
+    struct net_state_t *net_state)
+{
+    struct uring_t *uring = net_state->platform.uring;
+    struct io_uring_getevents_arg arg;
+    struct timeval probe_timeout;
+    struct __kernel_timespec wait_time;
+    int result;
+    int i;
+
+    if (!uring->registered) {
+        register_uring_fds(command_buffer, net_state);
+    }
+
+    for (i = 0; i < uring->recv_count; i++) {
+        if (uring->recv[i].socket && !uring->recv[i].armed) {
+            arm_uring_recv(uring, i);
+        }
+    }
+
+    for (i = 0; i < uring->poll_count; i++) {
+        if (!uring->poll[i].armed) {
+            arm_uring_poll(uring, URING_POLL, i, uring->poll[i].fd, POLLIN);
+            uring->poll[i].armed = true;
+        }
+    }
+
+    memset(&arg, 0, sizeof(struct io_uring_getevents_arg));
+    arg.sigmask_sz = _NSIG / 8;
+
+    /*  Use the soonest probe timeout time as our maximum wait time  */
+    if (get_next_probe_timeout(net_state, &probe_timeout)) {
+        wait_time.tv_sec = probe_timeout.tv_sec;
+        wait_time.tv_nsec = probe_timeout.tv_usec * 1000;
+        arg.ts = (uintptr_t) & wait_time;
+    }
+
+    start_uring_sends(uring);
+
+    while (true) {
+        result =
+            COUNT_SYSCALL(&net_state->stats,
+                          io_uring_enter(uring->fd,
+                                         get_uring_unsubmitted(uring), 1,
+                                         IORING_ENTER_GETEVENTS |
+                                         IORING_ENTER_EXT_ARG, &arg,
+                                         sizeof(struct
+                                                io_uring_getevents_arg)));
+
+        /*  ETIME indicates the wait reached the probe timeout  */
+        if (result != -1 || errno == ETIME) {
+            break;
+        }
+
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("unexpected io_uring wait error");
+            exit(EXIT_FAILURE);
+        }
+
+        /*  If completions are backed up, handle them before waiting  */
+        if (errno == EBUSY) {
+            break;
+        }
+    }
+
+    reap_uring_completions(net_state);
+}
+
+#else
+
+/*  Without io_uring, we always wait with epoll or select  */
+void init_uring(
+    struct net_state_t *net_state)
+{
+}
+
+void uring_wait_for_activity(
+    struct command_buffer_t *command_buffer,
+    struct net_state_t *net_state)
+{
+}
+
+void uring_add_probe_socket(
+    const struct net_state_t *net_state,
+    const struct probe_t *probe)
+{
+}
+
+void uring_remove_probe_socket(
+    const struct net_state_t *net_state,
+    const struct probe_t *probe)
+{
+}
+
+void uring_forget_probe(
+    const struct net_state_t *net_state,
+    const struct probe_t *probe)
+{
+}
+
+bool is_uring_receiving(
+    const struct net_state_t *net_state,
+    int socket)
+{
+    return false;
+}
+
+bool queue_uring_send(
+    struct net_state_t *net_state,
+    int socket,
+    struct probe_t *probe,
+    const struct msghdr *msg)
+{
+    return false;
+}
+
+#endif
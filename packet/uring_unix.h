@@ -0,0 +1,57 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef URING_UNIX_H
+#define URING_UNIX_H
+
+#include <stdbool.h>
+#include <sys/socket.h>
+
+#include "command.h"
+#include "probe.h"
+
+void init_uring(
+    struct net_state_t *net_state);
+
+void uring_wait_for_activity(
+    struct command_buffer_t *command_buffer,
+    struct net_state_t *net_state);
+
+void uring_add_probe_socket(
+    const struct net_state_t *net_state,
+    const struct probe_t *probe);
+
+void uring_remove_probe_socket(
+    const struct net_state_t *net_state,
+    const struct probe_t *probe);
+
+void uring_forget_probe(
+    const struct net_state_t *net_state,
+    const struct probe_t *probe);
+
+bool is_uring_receiving(
+    const struct net_state_t *net_state,
+    int socket);
+
+bool queue_uring_send(
+    struct net_state_t *net_state,
+    int socket,
+    struct probe_t *probe,
+    const struct msghdr *msg);
+
+#endif
@@ -26,4 +26,17 @@ void wait_for_activity(
     struct command_buffer_t *command_buffer,
     struct net_state_t *net_state);
 
+#ifndef PLATFORM_CYGWIN
+void init_wait_events(
+    struct net_state_t *net_state);
+
+void add_wait_probe_socket(
+    struct net_state_t *net_state,
+    struct probe_t *probe);
+
+void remove_wait_probe_socket(
+    struct net_state_t *net_state,
+    const struct probe_t *probe);
+#endif
+
 #endif
@@ -20,9 +20,12 @@
 
 #include <io.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <windows.h>
 
 #include "command.h"
+#include "pace.h"
+#include "timeval.h"
 
 /*
     Sleep until we receive a new probe response, a new command on the
@@ -35,6 +38,9 @@ void wait_for_activity(
     struct net_state_t *net_state)
 {
     DWORD wait_result;
+    DWORD wait_ms = INFINITE;
+    struct timeval send_time;
+    struct timeval now;
 
     /*
        Start the command read overlapped I/O just prior to sleeping.
@@ -45,11 +51,27 @@ void wait_for_activity(
      */
     start_read_command(command_buffer);
 
-    /*  Sleep until an I/O completion routine runs  */
-    wait_result = SleepEx(INFINITE, TRUE);
+    /*
+       Probes held to their pace are the only timeouts we manage
+       ourselves, so wake for the soonest of them.
+     */
+    if (get_next_paced_time(net_state, &send_time)) {
+        if (get_probe_time(&now)) {
+            perror("get_probe_time failure");
+            exit(EXIT_FAILURE);
+        }
+        send_time.tv_sec -= now.tv_sec;
+        send_time.tv_usec -= now.tv_usec;
+        normalize_timeval(&send_time);
+        wait_ms = send_time.tv_sec * 1000 + (send_time.tv_usec + 999) / 1000;
+    }
+
+    /*  Sleep until an I/O completion routine runs, or a probe is due  */
+    wait_result = COUNT_SYSCALL(&net_state->stats, SleepEx(wait_ms, TRUE));
 
     if (wait_result == WAIT_FAILED) {
         fprintf(stderr, "SleepEx failure %d\n", GetLastError());
         exit(EXIT_FAILURE);
     }
+    record_wakeup(&net_state->stats);
 }
@@ -16,15 +16,358 @@
     51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
+#include "config.h"
 #include "wait.h"
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/select.h>
+#include <unistd.h>
+
+#include "busypoll_unix.h"
+#include "uring_unix.h"
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE1)
+#define USE_EPOLL
+#include <sys/epoll.h>
+#if defined(HAVE_SYS_TIMERFD_H) && defined(HAVE_TIMERFD_CREATE)
+#define USE_TIMERFD
+#include <sys/timerfd.h>
+#endif
+#elif defined(HAVE_SYS_EVENT_H) && defined(HAVE_KQUEUE)
+#define USE_KQUEUE
+#include <sys/event.h>
+#endif
+
+/*  The maximum number of events to retrieve with one wait  */
+#define MAX_WAIT_EVENTS 64
+
+#if defined(USE_EPOLL) || defined(USE_KQUEUE)
+
+/*
+    Add a descriptor to the event set, to wake us when it becomes
+    readable, or writable if 'write' is true.  The data is returned
+    with the descriptor's events: the probe owning a probe socket,
+    the timer for the timer, and NULL for the others.
+*/
+static
+int add_wait_event(
+    int wait_fd,
+    int fd,
+    bool write,
+    void *data)
+{
+#ifdef USE_EPOLL
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.events = write ? EPOLLOUT : EPOLLIN;
+    event.data.ptr = data;
+
+    return epoll_ctl(wait_fd, EPOLL_CTL_ADD, fd, &event);
+#else
+    struct kevent event;
+
+    EV_SET(&event, fd, write ? EVFILT_WRITE : EVFILT_READ, EV_ADD, 0, 0,
+           data);
+
+    return kevent(wait_fd, &event, 1, NULL, 0, NULL);
+#endif
+}
+
+/*
+    Remove a probe socket previously added with add_wait_event, for
+    writing, as probe sockets are.
+*/
+static
+int remove_wait_event(
+    int wait_fd,
+    int fd)
+{
+#ifdef USE_EPOLL
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(struct epoll_event));
+
+    return epoll_ctl(wait_fd, EPOLL_CTL_DEL, fd, &event);
+#else
+    struct kevent event;
+
+    EV_SET(&event, fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+
+    return kevent(wait_fd, &event, 1, NULL, 0, NULL);
+#endif
+}
+
+/*
+    Add the command stream and our receive sockets to the event set.
+    Unlike the probe sockets, these live as long as mtr-packet does,
+    so we only need to do this once.
+*/
+static
+void register_read_fds(
+    const struct command_buffer_t *command_buffer,
+    struct net_state_t *net_state)
+{
+    int fds[10];
+    int fd_count = 0;
+    int i;
+    int wait_fd = net_state->platform.wait_fd;
+
+    if (net_state->platform.ring.socket) {
+        fds[fd_count++] = net_state->platform.ring.socket;
+    }
+
+    /*  The raw ICMP sockets aren't read while the ring is in use  */
+    if (net_state->platform.ip4_socket_raw) {
+        if (!net_state->platform.ring.socket) {
+            fds[fd_count++] = net_state->platform.ip4_recv_socket;
+        }
+    } else {
+        fds[fd_count++] = net_state->platform.ip4_txrx_icmp_socket;
+        fds[fd_count++] = net_state->platform.ip4_txrx_udp_socket;
+    }
+
+    if (net_state->platform.ip6_socket_raw) {
+        if (!net_state->platform.ring.socket) {
+            fds[fd_count++] = net_state->platform.ip6_recv_socket;
+        }
+    } else {
+        fds[fd_count++] = net_state->platform.ip6_txrx_icmp_socket;
+        fds[fd_count++] = net_state->platform.ip6_txrx_udp_socket;
+    }
+
+    fds[fd_count++] = net_state->platform.ip4_tcp_recv_socket;
+    fds[fd_count++] = net_state->platform.tcp6_socket;
+    fds[fd_count++] = net_state->platform.route_socket;
+
+    /*
+       epoll refuses regular files and character devices such as
+       /dev/null, which are always readable.  With such a command
+       stream we never sleep, just as select wouldn't.
+     */
+    if (add_wait_event(wait_fd, command_buffer->command_stream, false,
+                       NULL)) {
+        if (errno != EPERM) {
+            perror("failure to add command stream to wait set");
+            exit(EXIT_FAILURE);
+        }
+        net_state->platform.command_stream_unwaitable = true;
+    }
+
+    /*  A zero descriptor indicates a socket we didn't open  */
+    for (i = 0; i < fd_count; i++) {
+        if (fds[i] && fds[i] != command_buffer->command_stream) {
+            if (add_wait_event(wait_fd, fds[i], false, NULL)
+                && errno != EEXIST) {
+                perror("failure to add socket to wait set");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    if (net_state->platform.timer_fd
+        && add_wait_event(wait_fd, net_state->platform.timer_fd, false,
+                          &net_state->platform.timer_fd)) {
+        perror("failure to add timer to wait set");
+        exit(EXIT_FAILURE);
+    }
+
+    net_state->platform.wait_fds_registered = true;
+}
+
+#ifdef USE_EPOLL
+/*
+    Convert the time until the next probe timeout to the millisecond
+    count used by epoll_wait, rounding up so that we don't wake
+    before the timeout has actually passed.
+*/
+static
+int timeval_to_wait_ms(
+    const struct timeval *timeout)
+{
+    if (timeout->tv_sec >= INT_MAX / 1000 - 1) {
+        return INT_MAX;
+    }
+
+    return timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000;
+}
+#endif
+
+#ifdef USE_TIMERFD
+/*
+    Arm the timer to expire after a timeout, so that we wake within
+    microseconds of it, as paced probes require, rather than at the
+    next millisecond.  Returns false if there is no timer, or the
+    timeout has already passed.
+*/
+static
+bool arm_wait_timer(
+    struct net_state_t *net_state,
+    const struct timeval *timeout)
+{
+    struct itimerspec timer;
+
+    if (!net_state->platform.timer_fd
+        || (timeout->tv_sec == 0 && timeout->tv_usec == 0)) {
+        return false;
+    }
+
+    memset(&timer, 0, sizeof(struct itimerspec));
+    timer.it_value.tv_sec = timeout->tv_sec;
+    timer.it_value.tv_nsec = timeout->tv_usec * 1000;
+
+    return COUNT_SYSCALL(&net_state->stats,
+                         timerfd_settime(net_state->platform.timer_fd, 0,
+                                         &timer, NULL)) == 0;
+}
+
+/*  Consume the expiry of the timer  */
+static
+void drain_wait_timer(
+    struct net_state_t *net_state)
+{
+    uint64_t expirations;
+
+    if (COUNT_SYSCALL(&net_state->stats,
+                      read(net_state->platform.timer_fd, &expirations,
+                           sizeof(uint64_t))) == -1) {
+        /*  A timer which was re-armed has nothing to read  */
+    }
+}
+#endif
+
+/*
+    Note the probes whose sockets are among the events, for
+    receive_replies to check, and consume the timer's expiry.
+*/
+static
+void handle_wait_events(
+    struct net_state_t *net_state,
+#ifdef USE_EPOLL
+    const struct epoll_event *events,
+#else
+    const struct kevent *events,
+#endif
+    int event_count)
+{
+    void *data;
+    int i;
+
+    for (i = 0; i < event_count; i++) {
+#ifdef USE_EPOLL
+        data = events[i].data.ptr;
+#else
+        data = (void *) events[i].udata;
+#endif
+
+        if (data == NULL) {
+            continue;
+        }
+#ifdef USE_TIMERFD
+        if (data == &net_state->platform.timer_fd) {
+            drain_wait_timer(net_state);
+            continue;
+        }
+#endif
+
+        mark_probe_ready(net_state, data);
+    }
+}
+
+#endif
+
+/*
+    Create the descriptor used to wait for events.  If neither epoll
+    nor kqueue is available, or creating the descriptor fails, we'll
+    leave wait_fd as -1 and fall back to select.  The io_uring engine,
+    if it has been requested and is available, replaces both, except
+    with a simulated network, which has no sockets for it to read.
+*/
+void init_wait_events(
+    struct net_state_t *net_state)
+{
+    net_state->platform.wait_fd = -1;
+
+    if (!net_state->platform.simulation) {
+        init_uring(net_state);
+    }
+    if (net_state->platform.uring) {
+        return;
+    }
+
+#ifdef USE_EPOLL
+    net_state->platform.wait_fd = epoll_create1(EPOLL_CLOEXEC);
+#ifdef USE_TIMERFD
+    if (net_state->platform.wait_fd != -1) {
+        net_state->platform.timer_fd =
+            timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (net_state->platform.timer_fd == -1) {
+            net_state->platform.timer_fd = 0;
+        }
+    }
+#endif
+#elif defined(USE_KQUEUE)
+    net_state->platform.wait_fd = kqueue();
+#endif
+}
+
+/*
+    Add the newly opened socket of a probe to the event set, so that
+    we wake when its connection attempt completes, and know which
+    probe's it is.
+*/
+void add_wait_probe_socket(
+    struct net_state_t *net_state,
+    struct probe_t *probe)
+{
+    if (net_state->platform.uring) {
+        uring_add_probe_socket(net_state, probe);
+        return;
+    }
+#if defined(USE_EPOLL) || defined(USE_KQUEUE)
+    if (net_state->platform.wait_fd == -1) {
+        return;
+    }
+
+    if (COUNT_SYSCALL(&net_state->stats,
+                      add_wait_event(net_state->platform.wait_fd,
+                                     probe->platform.socket, true, probe))) {
+        perror("failure to add probe socket to wait set");
+        exit(EXIT_FAILURE);
+    }
+#endif
+}
+
+/*  Remove a probe socket from the event set before it is closed  */
+void remove_wait_probe_socket(
+    struct net_state_t *net_state,
+    const struct probe_t *probe)
+{
+    if (net_state->platform.uring) {
+        uring_remove_probe_socket(net_state, probe);
+        return;
+    }
+#if defined(USE_EPOLL) || defined(USE_KQUEUE)
+    if (net_state->platform.wait_fd == -1) {
+        return;
+    }
+
+    /*
+       Failure isn't a concern here, since closing the socket will
+       remove it from the event set in any case.
+     */
+    COUNT_SYSCALL(&net_state->stats,
+                  remove_wait_event(net_state->platform.wait_fd,
+                                    probe->platform.socket));
+#endif
+}
 
 /*
     Gather all the file descriptors which should wake our select call when
@@ -49,11 +392,20 @@ int gather_read_fds(
     FD_SET(command_stream, read_set);
     nfds = command_stream + 1;
 
+    if (net_state->platform.ring.socket) {
+        FD_SET(net_state->platform.ring.socket, read_set);
+        if (net_state->platform.ring.socket >= nfds) {
+            nfds = net_state->platform.ring.socket + 1;
+        }
+    }
+
     if (net_state->platform.ip4_socket_raw) {
         ip4_socket = net_state->platform.ip4_recv_socket;
-        FD_SET(ip4_socket, read_set);
-        if (ip4_socket >= nfds) {
-            nfds = ip4_socket + 1;
+        if (!net_state->platform.ring.socket) {
+            FD_SET(ip4_socket, read_set);
+            if (ip4_socket >= nfds) {
+                nfds = ip4_socket + 1;
+            }
         }
     } else {
         ip4_socket = net_state->platform.ip4_txrx_icmp_socket;
@@ -70,9 +422,11 @@ int gather_read_fds(
 
     if (net_state->platform.ip6_socket_raw) {
         ip6_socket = net_state->platform.ip6_recv_socket;
-        FD_SET(ip6_socket, read_set);
-        if (ip6_socket >= nfds) {
-            nfds = ip6_socket + 1;
+        if (!net_state->platform.ring.socket) {
+            FD_SET(ip6_socket, read_set);
+            if (ip6_socket >= nfds) {
+                nfds = ip6_socket + 1;
+            }
         }
     } else {
         ip6_socket = net_state->platform.ip6_txrx_icmp_socket;
@@ -87,6 +441,27 @@ int gather_read_fds(
         }
     }
 
+    if (net_state->platform.ip4_tcp_recv_socket) {
+        FD_SET(net_state->platform.ip4_tcp_recv_socket, read_set);
+        if (net_state->platform.ip4_tcp_recv_socket >= nfds) {
+            nfds = net_state->platform.ip4_tcp_recv_socket + 1;
+        }
+    }
+
+    if (net_state->platform.tcp6_socket) {
+        FD_SET(net_state->platform.tcp6_socket, read_set);
+        if (net_state->platform.tcp6_socket >= nfds) {
+            nfds = net_state->platform.tcp6_socket + 1;
+        }
+    }
+
+    if (net_state->platform.route_socket) {
+        FD_SET(net_state->platform.route_socket, read_set);
+        if (net_state->platform.route_socket >= nfds) {
+            nfds = net_state->platform.route_socket + 1;
+        }
+    }
+
     probe_nfds = gather_probe_sockets(net_state, write_set);
     if (probe_nfds > nfds) {
         nfds = probe_nfds;
@@ -97,11 +472,13 @@ int gather_read_fds(
 
 /*
     Sleep until we receive a new probe response, a new command on the
-    command stream, or a probe timeout.  On Unix systems, this means
-    we use select to wait on file descriptors for the command stream
-    and the raw recieve socket.
+    command stream, or a probe timeout, using select to wait on file
+    descriptors for the command stream, the raw recieve socket and
+    any probe sockets.  This is our fallback when neither epoll nor
+    kqueue is available.
 */
-void wait_for_activity(
+static
+void select_for_activity(
     struct command_buffer_t *command_buffer,
     struct net_state_t *net_state)
 {
@@ -110,12 +487,15 @@ void wait_for_activity(
     fd_set write_set;
     struct timeval probe_timeout;
     struct timeval *select_timeout;
+    struct timeval no_wait;
+    bool spinning;
     int ready_count;
 
-    nfds =
-        gather_read_fds(command_buffer, net_state, &read_set, &write_set);
-
     while (true) {
+        /*  select modifies the sets, so they are gathered for each try  */
+        nfds =
+            gather_read_fds(command_buffer, net_state, &read_set,
+                            &write_set);
         select_timeout = NULL;
 
         /*  Use the soonest probe timeout time as our maximum wait time  */
@@ -124,14 +504,30 @@ void wait_for_activity(
             select_timeout = &probe_timeout;
         }
 
+        spinning = keep_spinning(net_state, select_timeout);
+        if (spinning) {
+            no_wait.tv_sec = 0;
+            no_wait.tv_usec = 0;
+            select_timeout = &no_wait;
+        }
+
         ready_count =
-            select(nfds, &read_set, &write_set, NULL, select_timeout);
+            COUNT_SYSCALL(&net_state->stats,
+                          select(nfds, &read_set, &write_set, NULL,
+                                 select_timeout));
+
+        if (ready_count == 0 && spinning) {
+            continue;
+        }
 
         /*
            If we didn't have an error, either one of our descriptors is
            readable, or we timed out.  So we can now return.
          */
         if (ready_count != -1) {
+            if (ready_count > 0) {
+                mark_ready_probe_sockets(net_state, &write_set);
+            }
             break;
         }
 
@@ -149,3 +545,120 @@ void wait_for_activity(
         }
     }
 }
+
+#if defined(USE_EPOLL) || defined(USE_KQUEUE)
+/*
+    Wait for activity using the event set.  The probe sockets have
+    already been added as they were opened, so unlike select, we don't
+    need to walk the list of outstanding probes before each wait.
+*/
+static
+void wait_for_events(
+    struct command_buffer_t *command_buffer,
+    struct net_state_t *net_state)
+{
+    struct timeval probe_timeout;
+    bool have_timeout;
+    bool spinning;
+    bool no_wait;
+    int ready_count;
+#ifdef USE_EPOLL
+    struct epoll_event events[MAX_WAIT_EVENTS];
+    int wait_ms;
+#else
+    struct kevent events[MAX_WAIT_EVENTS];
+    struct timespec wait_time;
+#endif
+
+    if (!net_state->platform.wait_fds_registered) {
+        register_read_fds(command_buffer, net_state);
+    }
+
+    while (true) {
+        /*  Use the soonest probe timeout time as our maximum wait time  */
+        have_timeout = get_next_probe_timeout(net_state, &probe_timeout);
+        if (have_timeout) {
+            assert(probe_timeout.tv_sec >= 0);
+        }
+        spinning =
+            keep_spinning(net_state, have_timeout ? &probe_timeout : NULL);
+        no_wait = spinning
+            || net_state->platform.command_stream_unwaitable;
+#ifdef USE_EPOLL
+        wait_ms = -1;
+        if (no_wait) {
+            wait_ms = 0;
+        } else if (have_timeout) {
+            wait_ms = timeval_to_wait_ms(&probe_timeout);
+#ifdef USE_TIMERFD
+            if (arm_wait_timer(net_state, &probe_timeout)) {
+                wait_ms = -1;
+            }
+#endif
+        }
+
+        ready_count =
+            COUNT_SYSCALL(&net_state->stats,
+                          epoll_wait(net_state->platform.wait_fd, events,
+                                     MAX_WAIT_EVENTS, wait_ms));
+#else
+        wait_time.tv_sec = no_wait ? 0 : probe_timeout.tv_sec;
+        wait_time.tv_nsec = no_wait ? 0 : probe_timeout.tv_usec * 1000;
+
+        ready_count =
+            COUNT_SYSCALL(&net_state->stats,
+                          kevent(net_state->platform.wait_fd, NULL, 0,
+                                 events, MAX_WAIT_EVENTS, have_timeout
+                                 || no_wait ? &wait_time : NULL));
+#endif
+        if (ready_count > 0) {
+            handle_wait_events(net_state, events, ready_count);
+        }
+
+        if (ready_count == 0 && spinning) {
+            continue;
+        }
+
+        /*
+           The main loop reads the receive sockets after we return,
+           and checks the probe sockets among the events.
+         */
+        if (ready_count != -1) {
+            break;
+        }
+
+        if (errno != EINTR && errno != EAGAIN) {
+            perror("unexpected wait error");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+#endif
+
+/*
+    Sleep until we receive a new probe response, a new command on the
+    command stream, or a probe timeout.  We use epoll on Linux and
+    kqueue on BSD and macOS, and select elsewhere, unless the io_uring
+    engine has been selected.
+*/
+void wait_for_activity(
+    struct command_buffer_t *command_buffer,
+    struct net_state_t *net_state)
+{
+    if (net_state->platform.uring) {
+        uring_wait_for_activity(command_buffer, net_state);
+        record_wakeup(&net_state->stats);
+        return;
+    }
+
+#if defined(USE_EPOLL) || defined(USE_KQUEUE)
+    if (net_state->platform.wait_fd != -1) {
+        wait_for_events(command_buffer, net_state);
+        record_wakeup(&net_state->stats);
+        return;
+    }
+#endif
+
+    select_for_activity(command_buffer, net_state);
+    record_wakeup(&net_state->stats);
+}
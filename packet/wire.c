@@ -0,0 +1,223 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "wire.h"
+
+#include <string.h>
+
+/*  Text names of the reply types, indexed by reply type  */
+static const char *const wire_reply_names[WIRE_REPLY_TYPE_COUNT] = {
+    [WIRE_REPLY_REPLY] = "reply",
+    [WIRE_REPLY_TTL_EXPIRED] = "ttl-expired",
+    [WIRE_REPLY_NO_ROUTE] = "no-route",
+    [WIRE_REPLY_NO_REPLY] = "no-reply",
+    [WIRE_REPLY_NETWORK_DOWN] = "network-down",
+    [WIRE_REPLY_PROBES_EXHAUSTED] = "probes-exhausted",
+    [WIRE_REPLY_PERMISSION_DENIED] = "permission-denied",
+    [WIRE_REPLY_ADDRESS_IN_USE] = "address-in-use",
+    [WIRE_REPLY_ADDRESS_NOT_AVAILABLE] = "address-not-available",
+    [WIRE_REPLY_INVALID_ARGUMENT] = "invalid-argument",
+    [WIRE_REPLY_UNEXPECTED_ERROR] = "unexpected-error",
+    [WIRE_REPLY_UNKNOWN_COMMAND] = "unknown-command"
+};
+
+static
+void put_le16(
+    uint8_t *pos,
+    uint16_t value)
+{
+    pos[0] = value & 0xFF;
+    pos[1] = value >> 8;
+}
+
+static
+void put_le32(
+    uint8_t *pos,
+    uint32_t value)
+{
+    pos[0] = value & 0xFF;
+    pos[1] = (value >> 8) & 0xFF;
+    pos[2] = (value >> 16) & 0xFF;
+    pos[3] = value >> 24;
+}
+
+static
+uint16_t get_le16(
+    const uint8_t *pos)
+{
+    return pos[0] | (pos[1] << 8);
+}
+
+static
+uint32_t get_le32(
+    const uint8_t *pos)
+{
+    return (uint32_t) pos[0] | ((uint32_t) pos[1] << 8)
+        | ((uint32_t) pos[2] << 16) | ((uint32_t) pos[3] << 24);
+}
+
+/*
+    Fill a request record from a request structure.  The record
+    layout is:
+
+        0   token               4   request type
+        5   IP version          6   protocol
+        7   time-to-live        8   packet size
+        10  destination port    12  local port
+        14  type of service     15  flags
+        16  bit pattern         20  timeout
+        24  routing mark        28  pace in microseconds
+        32  remote address      48  local address
+
+    The timeout is in milliseconds if WIRE_FLAG_TIMEOUT_MS is set, and
+    in seconds otherwise.
+*/
+void encode_wire_request(
+    const struct wire_request_t *request,
+    uint8_t *record)
+{
+    memset(record, 0, WIRE_REQUEST_SIZE);
+
+    put_le32(&record[0], request->token);
+    record[4] = request->request_type;
+    record[5] = request->ip_version;
+    record[6] = request->protocol;
+    record[7] = request->ttl;
+    put_le16(&record[8], request->packet_size);
+    put_le16(&record[10], request->dest_port);
+    put_le16(&record[12], request->local_port);
+    record[14] = request->type_of_service;
+    record[15] = request->flags;
+    put_le32(&record[16], (uint32_t) request->bit_pattern);
+    put_le32(&record[20], request->timeout);
+    put_le32(&record[24], request->routing_mark);
+    put_le32(&record[28], request->pace_interval);
+    memcpy(&record[32], request->remote_address, WIRE_ADDRESS_SIZE);
+    memcpy(&record[48], request->local_address, WIRE_ADDRESS_SIZE);
+}
+
+/*  Fill a request structure from a request record  */
+void decode_wire_request(
+    const uint8_t *record,
+    struct wire_request_t *request)
+{
+    request->token = get_le32(&record[0]);
+    request->request_type = record[4];
+    request->ip_version = record[5];
+    request->protocol = record[6];
+    request->ttl = record[7];
+    request->packet_size = get_le16(&record[8]);
+    request->dest_port = get_le16(&record[10]);
+    request->local_port = get_le16(&record[12]);
+    request->type_of_service = record[14];
+    request->flags = record[15];
+    request->bit_pattern = (int32_t) get_le32(&record[16]);
+    request->timeout = get_le32(&record[20]);
+    request->routing_mark = get_le32(&record[24]);
+    request->pace_interval = get_le32(&record[28]);
+    memcpy(request->remote_address, &record[32], WIRE_ADDRESS_SIZE);
+    memcpy(request->local_address, &record[48], WIRE_ADDRESS_SIZE);
+}
+
+/*
+    Fill a reply record from a reply structure.  The record layout is:
+
+        0   token               4   reply type
+        5   IP version          6   MPLS label count
+        7   reserved            8   round trip time in microseconds
+        12  address             28  MPLS labels
+
+    Each MPLS label is stored as four bytes in the layout of an MPLS
+    label stack entry: a 20-bit label, the 3 experimental use bits,
+    the bottom of stack bit, and an 8-bit time-to-live.
+*/
+void encode_wire_reply(
+    const struct wire_reply_t *reply,
+    uint8_t *record)
+{
+    const struct wire_mpls_label_t *mpls;
+    uint32_t entry;
+    int i;
+
+    memset(record, 0, WIRE_REPLY_SIZE);
+
+    put_le32(&record[0], reply->token);
+    record[4] = reply->reply_type;
+    record[5] = reply->ip_version;
+    record[6] = reply->mpls_count;
+    put_le32(&record[8], reply->round_trip_us);
+    memcpy(&record[12], reply->address, WIRE_ADDRESS_SIZE);
+
+    for (i = 0; i < reply->mpls_count && i < WIRE_MAX_MPLS_LABELS; i++) {
+        mpls = &reply->mpls[i];
+
+        entry = (mpls->label & 0xFFFFF) << 12;
+        entry |= (mpls->experimental_use & 0x7) << 9;
+        entry |= (mpls->bottom_of_stack & 0x1) << 8;
+        entry |= mpls->ttl;
+
+        put_le32(&record[28 + 4 * i], entry);
+    }
+}
+
+/*  Fill a reply structure from a reply record  */
+void decode_wire_reply(
+    const uint8_t *record,
+    struct wire_reply_t *reply)
+{
+    struct wire_mpls_label_t *mpls;
+    uint32_t entry;
+    int i;
+
+    memset(reply, 0, sizeof(struct wire_reply_t));
+
+    reply->token = get_le32(&record[0]);
+    reply->reply_type = record[4];
+    reply->ip_version = record[5];
+    reply->mpls_count = record[6];
+    reply->round_trip_us = get_le32(&record[8]);
+    memcpy(reply->address, &record[12], WIRE_ADDRESS_SIZE);
+
+    if (reply->mpls_count > WIRE_MAX_MPLS_LABELS) {
+        reply->mpls_count = WIRE_MAX_MPLS_LABELS;
+    }
+
+    for (i = 0; i < reply->mpls_count; i++) {
+        mpls = &reply->mpls[i];
+        entry = get_le32(&record[28 + 4 * i]);
+
+        mpls->label = entry >> 12;
+        mpls->experimental_use = (entry >> 9) & 0x7;
+        mpls->bottom_of_stack = (entry >> 8) & 0x1;
+        mpls->ttl = entry & 0xFF;
+    }
+}
+
+/*
+    Get the text name of a reply type, which is also the name of the
+    reply in the text protocol.  Returns NULL for unknown reply types.
+*/
+const char *wire_reply_name(
+    int reply_type)
+{
+    if (reply_type <= 0 || reply_type >= WIRE_REPLY_TYPE_COUNT) {
+        return NULL;
+    }
+
+    return wire_reply_names[reply_type];
+}
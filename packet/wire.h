@@ -0,0 +1,130 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stdint.h>
+
+/*
+    After "enter-binary-mode", requests and replies are exchanged as
+    fixed size records, with all multi-byte values in little-endian
+    byte order, rather than as lines of text.
+*/
+#define WIRE_REQUEST_SIZE 64
+#define WIRE_REPLY_SIZE 64
+
+/*  Room for either an IPv4 or an IPv6 address, in network byte order  */
+#define WIRE_ADDRESS_SIZE 16
+
+/*  The maximum number of MPLS labels in a reply record  */
+#define WIRE_MAX_MPLS_LABELS 8
+
+/*  Request types  */
+#define WIRE_REQUEST_SEND_PROBE 1
+
+/*  Request flags  */
+#define WIRE_FLAG_LOCAL_ADDRESS 0x01
+#define WIRE_FLAG_KERNEL_TIMESTAMP 0x02
+#define WIRE_FLAG_TCP_SYN 0x04
+#define WIRE_FLAG_TIMEOUT_MS 0x08
+#define WIRE_FLAG_PACE 0x10
+
+/*
+    Reply types.  Each corresponds to the text reply of the same name,
+    as returned by wire_reply_name.
+*/
+enum wire_reply_type_t {
+    WIRE_REPLY_REPLY = 1,
+    WIRE_REPLY_TTL_EXPIRED,
+    WIRE_REPLY_NO_ROUTE,
+    WIRE_REPLY_NO_REPLY,
+    WIRE_REPLY_NETWORK_DOWN,
+    WIRE_REPLY_PROBES_EXHAUSTED,
+    WIRE_REPLY_PERMISSION_DENIED,
+    WIRE_REPLY_ADDRESS_IN_USE,
+    WIRE_REPLY_ADDRESS_NOT_AVAILABLE,
+    WIRE_REPLY_INVALID_ARGUMENT,
+    WIRE_REPLY_UNEXPECTED_ERROR,
+    WIRE_REPLY_UNKNOWN_COMMAND,
+
+    WIRE_REPLY_TYPE_COUNT
+};
+
+/*  The decoded contents of a probe request record  */
+struct wire_request_t {
+    uint32_t token;
+    uint8_t request_type;
+    uint8_t ip_version;
+    uint8_t protocol;
+    uint8_t ttl;
+    uint16_t packet_size;
+    uint16_t dest_port;
+    uint16_t local_port;
+    uint8_t type_of_service;
+    uint8_t flags;
+    int32_t bit_pattern;
+    uint32_t timeout;
+    uint32_t routing_mark;
+    uint32_t pace_interval;
+    uint8_t remote_address[WIRE_ADDRESS_SIZE];
+    uint8_t local_address[WIRE_ADDRESS_SIZE];
+};
+
+/*  An MPLS label, as carried in a reply record  */
+struct wire_mpls_label_t {
+    uint32_t label;
+    uint8_t experimental_use;
+    uint8_t bottom_of_stack;
+    uint8_t ttl;
+};
+
+/*  The decoded contents of a reply record  */
+struct wire_reply_t {
+    uint32_t token;
+    uint8_t reply_type;
+
+    /*  4 or 6 if the reply carries an address, zero otherwise  */
+    uint8_t ip_version;
+
+    uint8_t mpls_count;
+    uint32_t round_trip_us;
+    uint8_t address[WIRE_ADDRESS_SIZE];
+    struct wire_mpls_label_t mpls[WIRE_MAX_MPLS_LABELS];
+};
+
+void encode_wire_request(
+    const struct wire_request_t *request,
+    uint8_t *record);
+
+void decode_wire_request(
+    const uint8_t *record,
+    struct wire_request_t *request);
+
+void encode_wire_reply(
+    const struct wire_reply_t *reply,
+    uint8_t *record);
+
+void decode_wire_reply(
+    const uint8_t *record,
+    struct wire_reply_t *reply);
+
+const char *wire_reply_name(
+    int reply_type);
+
+#endif
@@ -0,0 +1,182 @@
+#!/usr/bin/env python
+#
+#   mtr  --  a network diagnostic tool
+#   Copyright (C) 2016  Matt Kimball
+#
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License version 2 as
+#   published by the Free Software Foundation.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License along
+#   with this program; if not, write to the Free Software Foundation, Inc.,
+#   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+#
+
+'''Test the authentication of mtr-packet agents listening on TCP.'''
+
+
+import hashlib
+import hmac
+import os
+import socket
+import subprocess
+import tempfile
+import time
+import unittest
+
+import mtrpacket
+
+
+SECRET = 'correct horse battery staple'
+
+#  As MAX_DAEMON_CLIENTS and DAEMON_AUTH_TIMEOUT in packet/daemon_unix.h
+MAX_CLIENTS = 64
+AUTH_TIMEOUT = 10
+
+TOPOLOGY = '''
+seed 1
+hop 10.2.0.1 delay 1
+target delay 2
+'''
+
+
+def free_port():  # type: () -> int
+    'Find a TCP port on the loopback address which is free'
+
+    probe = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    probe.bind(('127.0.0.1', 0))
+    port = probe.getsockname()[1]
+    probe.close()
+
+    return port
+
+
+class TestAgent(unittest.TestCase):
+    '''Test clients of an mtr-packet daemon listening on TCP, answering
+    from a simulated network'''
+
+    def setUp(self):
+        'Start an mtr-packet agent, and wait for it to listen'
+
+        handle, self.topology_path = tempfile.mkstemp()
+        os.write(handle, TOPOLOGY.encode('utf-8'))
+        os.close(handle)
+
+        packet_path = os.environ.get('MTR_PACKET', './mtr-packet')
+        environment = dict(os.environ)
+        environment['MTR_PACKET_SECRET'] = SECRET
+        environment['MTR_PACKET_SIMULATE'] = self.topology_path
+
+        self.port = free_port()
+        try:
+            self.agent_process = subprocess.Popen(
+                [packet_path, '--listen', 'tcp:127.0.0.1:%d' % self.port],
+                env=environment)
+        except OSError:
+            raise mtrpacket.MtrPacketExecuteError(packet_path)
+
+        self.connection = None
+        for _ in range(100):
+            try:
+                self.connection = socket.create_connection(
+                    ('127.0.0.1', self.port))
+                break
+            except socket.error:
+                time.sleep(0.05)
+        self.assertIsNotNone(self.connection)
+
+        self.stream = self.connection.makefile('rw')
+
+    def tearDown(self):
+        'Stop the agent'
+
+        self.stream.close()
+        self.connection.close()
+        self.agent_process.kill()
+        self.agent_process.wait()
+        os.remove(self.topology_path)
+
+    def write_command(self, command):  # type: (str) -> None
+        'Send a command to the agent'
+
+        self.stream.write(command + '\n')
+        self.stream.flush()
+
+    def parse_reply(self):  # type: () -> mtrpacket.MtrPacketReply
+        'Read the next reply from the agent'
+
+        return mtrpacket.MtrPacketReply(self.stream.readline())
+
+    def answer_challenge(self, secret):  # type: (str) -> None
+        'Read the challenge sent on connection, and answer it'
+
+        challenge = self.parse_reply()
+        self.assertEqual(challenge.token, 0)
+        self.assertEqual(challenge.command_name, 'authenticate-challenge')
+
+        nonce = challenge.argument['nonce']
+        digest = hmac.new(secret.encode('utf-8'), nonce.encode('utf-8'),
+                          hashlib.sha256).hexdigest()
+        self.write_command('1 authenticate digest ' + digest)
+
+    def test_authenticated(self):
+        'Test that an authenticated client may send probes'
+
+        self.answer_challenge(SECRET)
+        reply = self.parse_reply()
+        self.assertEqual(reply.token, 1)
+        self.assertEqual(reply.command_name, 'authenticated')
+
+        self.write_command('2 send-probe ip-4 203.0.113.1 ttl 1')
+        reply = self.parse_reply()
+        self.assertEqual(reply.command_name, 'ttl-expired')
+        self.assertEqual(reply.argument['ip-4'], '10.2.0.1')
+
+    def test_wrong_secret(self):
+        'Test that a client with the wrong secret is refused'
+
+        self.answer_challenge('wrong secret')
+        reply = self.parse_reply()
+        self.assertEqual(reply.command_name, 'permission-denied')
+
+        #  The agent then closes the connection
+        self.assertEqual(self.stream.readline(), '')
+
+    def test_unauthenticated(self):
+        'Test that commands before authentication are refused'
+
+        self.parse_reply()
+        self.write_command('3 send-probe ip-4 203.0.113.1 ttl 1')
+        reply = self.parse_reply()
+        self.assertEqual(reply.token, 3)
+        self.assertEqual(reply.command_name, 'permission-denied')
+        self.assertEqual(self.stream.readline(), '')
+
+    def test_idle_clients_dropped(self):
+        'Test that clients which never authenticate give up their slots'
+
+        #  With the connection of setUp, every slot is taken
+        idle = [self.connection]
+        for _ in range(MAX_CLIENTS - 1):
+            idle.append(socket.create_connection(('127.0.0.1', self.port)))
+        time.sleep(AUTH_TIMEOUT + 1)
+
+        self.stream.close()
+        self.connection = socket.create_connection(('127.0.0.1', self.port))
+        self.stream = self.connection.makefile('rw')
+        try:
+            self.answer_challenge(SECRET)
+            reply = self.parse_reply()
+            self.assertEqual(reply.command_name, 'authenticated')
+        finally:
+            for connection in idle:
+                connection.close()
+
+
+if __name__ == '__main__':
+    unittest.main()
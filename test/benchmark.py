@@ -0,0 +1,443 @@
+#!/usr/bin/env python
+#
+#   mtr  --  a network diagnostic tool
+#   Copyright (C) 2016  Matt Kimball
+#
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License version 2 as
+#   published by the Free Software Foundation.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License along
+#   with this program; if not, write to the Free Software Foundation, Inc.,
+#   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+#
+
+'''Measure the throughput and latency of mtr-packet.
+
+Probes are sent at increasing rates, either to the loopback address,
+or through a chain of network namespaces joined by veth pairs, with
+delay and loss injected by netem on every hop.  For each rate, report
+the probes/sec sustained, the latency from writing a command to
+reading its reply, and the error of the measured round trip time
+against the delay injected.
+
+The namespace topology requires root, iproute2 and the netem qdisc.
+Unlike the tests, this isn't run by "make check", but by
+"make benchmark".'''
+
+import argparse
+import fcntl
+import os
+import select
+import subprocess
+import sys
+import time
+
+#
+#  typing is used for mypy type checking, but isn't required to run,
+#  so it's okay if we can't import it.
+#
+try:
+    # pylint: disable=locally-disabled, unused-import
+    from typing import Dict, List
+except ImportError:
+    pass
+
+
+NAMESPACE_PREFIX = 'mtr-bench-'
+NETWORK_PREFIX = '10.201'
+
+#  Replies which mean a probe reached a host
+REPLY_NAMES = ['reply', 'ttl-expired', 'no-route']
+
+
+def set_nonblocking(file_descriptor):  # type: (int) -> None
+    'Put a file descriptor into non-blocking mode'
+
+    flags = fcntl.fcntl(file_descriptor, fcntl.F_GETFL)
+
+    # pylint: disable=locally-disabled, no-member
+    fcntl.fcntl(file_descriptor, fcntl.F_SETFL, flags | os.O_NONBLOCK)
+
+
+def percentile(values, fraction):  # type: (List[float], float) -> float
+    'The value below which a fraction of sorted values fall'
+
+    if not values:
+        return float('nan')
+
+    index = int(fraction * (len(values) - 1) + 0.5)
+    return values[index]
+
+
+def run(*args):  # type: (*str) -> None
+    'Run a command, raising an exception if it fails'
+
+    subprocess.check_call(list(args))
+
+
+class NamespaceTopology(object):
+    '''A chain of network namespaces, each joined to the next with a
+    veth pair.  mtr-packet runs in the first, and the last is the
+    target, so that every namespace between is a hop.'''
+
+    def __init__(self, hops, delay_ms, loss):
+        # type: (int, float, float) -> None
+
+        self.hops = hops
+        self.delay_ms = delay_ms
+        self.loss = loss
+        self.namespaces = [
+            NAMESPACE_PREFIX + str(i) for i in range(hops + 1)]
+        self.target = '%s.%d.2' % (NETWORK_PREFIX, hops - 1)
+
+        #  The delay is added in both directions of every link
+        self.injected_ms = 2 * hops * delay_ms
+
+    def __enter__(self):
+        self.teardown()
+
+        try:
+            self.setup()
+        except Exception:
+            self.teardown()
+            raise
+
+        return self
+
+    def __exit__(self, exc_type, exc_value, traceback):
+        self.teardown()
+
+    def setup(self):
+        'Create the namespaces, their links, and their routes'
+
+        for namespace in self.namespaces:
+            run('ip', 'netns', 'add', namespace)
+            run('ip', '-n', namespace, 'link', 'set', 'lo', 'up')
+            run('ip', 'netns', 'exec', namespace,
+                'sysctl', '-q', '-w', 'net.ipv4.ip_forward=1')
+
+        for i in range(self.hops):
+            self.setup_link(i)
+
+        #  Replies return through the links before, to each subnet beyond
+        for i, namespace in enumerate(self.namespaces):
+            for subnet in range(i - 1):
+                run('ip', '-n', namespace, 'route', 'add',
+                    '%s.%d.0/24' % (NETWORK_PREFIX, subnet),
+                    'via', '%s.%d.1' % (NETWORK_PREFIX, i - 1))
+            if i < self.hops:
+                run('ip', '-n', namespace, 'route', 'add', 'default',
+                    'via', '%s.%d.2' % (NETWORK_PREFIX, i))
+
+    def setup_link(self, i):  # type: (int) -> None
+        'Join a namespace to the next, with netem on both ends'
+
+        near = self.namespaces[i]
+        far = self.namespaces[i + 1]
+        near_dev = 'mb%da' % i
+        far_dev = 'mb%db' % i
+
+        run('ip', '-n', near, 'link', 'add', near_dev, 'type', 'veth',
+            'peer', 'name', far_dev, 'netns', far)
+        run('ip', '-n', near, 'addr', 'add',
+            '%s.%d.1/24' % (NETWORK_PREFIX, i), 'dev', near_dev)
+        run('ip', '-n', far, 'addr', 'add',
+            '%s.%d.2/24' % (NETWORK_PREFIX, i), 'dev', far_dev)
+
+        for (namespace, dev) in [(near, near_dev), (far, far_dev)]:
+            run('ip', '-n', namespace, 'link', 'set', dev, 'up')
+
+            if self.delay_ms or self.loss:
+                run('ip', 'netns', 'exec', namespace, 'tc', 'qdisc', 'add',
+                    'dev', dev, 'root', 'netem',
+                    'delay', '%gms' % self.delay_ms,
+                    'loss', '%g%%' % self.loss, 'limit', '100000')
+
+    def teardown(self):
+        'Remove the namespaces, which removes their links'
+
+        with open(os.devnull, 'w') as devnull:
+            for namespace in self.namespaces:
+                subprocess.call(['ip', 'netns', 'del', namespace],
+                                stderr=devnull)
+
+    def command_prefix(self):  # type: () -> List[str]
+        'The command prefix to run a program in the first namespace'
+
+        return ['ip', 'netns', 'exec', self.namespaces[0]]
+
+
+class LoopbackTopology(object):
+    'Probes of the loopback address, with nothing injected'
+
+    def __init__(self):
+        self.target = '127.0.0.1'
+        self.injected_ms = 0.0
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc_value, traceback):
+        pass
+
+    # pylint: disable=locally-disabled, no-self-use
+    def command_prefix(self):  # type: () -> List[str]
+        'Nothing is needed to run a program on the host'
+
+        return []
+
+
+class RateResult(object):
+    'The measurements of probes sent at one rate'
+
+    # pylint: disable=locally-disabled, too-few-public-methods
+    def __init__(self, rate):  # type: (int) -> None
+        self.rate = rate
+        self.elapsed = 0.0
+        self.sent = 0
+        self.replied = 0
+        self.no_reply = 0
+        self.errors = 0
+        self.latency_ms = []  # type: List[float]
+        self.error_ms = []  # type: List[float]
+
+
+class PacketBenchmark(object):
+    'A mtr-packet process, and the probes sent to it'
+
+    def __init__(self, command, args):
+        # type: (List[str], argparse.Namespace) -> None
+
+        self.args = args
+        self.process = subprocess.Popen(
+            command, stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+        self.stdin_fd = self.process.stdin.fileno()
+        self.stdout_fd = self.process.stdout.fileno()
+        set_nonblocking(self.stdin_fd)
+        set_nonblocking(self.stdout_fd)
+
+        self.next_token = 1
+        self.write_buffer = b''
+        self.read_buffer = b''
+
+        #  The time at which each outstanding probe's command was queued
+        self.queued = {}  # type: Dict[int, float]
+
+    def close(self):
+        'Close the command stream, and wait for mtr-packet to exit'
+
+        self.process.stdin.close()
+        self.process.stdout.close()
+        self.process.wait()
+
+    def queue_probe(self, target):  # type: (str) -> None
+        'Queue a command for a probe to send'
+
+        token = self.next_token
+        self.next_token += 1
+
+        command = '%d send-probe ip-4 %s protocol %s ttl %d timeout %d\n' % (
+            token, target, self.args.protocol, self.args.ttl,
+            self.args.timeout)
+        self.write_buffer += command.encode('utf-8')
+        self.queued[token] = time.time()
+
+    def write_commands(self):  # type: () -> None
+        'Write as much of the queued commands as the pipe will take'
+
+        try:
+            written = os.write(self.stdin_fd, self.write_buffer)
+        except OSError:
+            return
+
+        self.write_buffer = self.write_buffer[written:]
+
+    def read_replies(self, result, injected_ms):
+        # type: (RateResult, float) -> None
+
+        'Read the available replies, adding them to the results'
+
+        try:
+            data = os.read(self.stdout_fd, 65536)
+        except OSError:
+            return
+
+        now = time.time()
+        self.read_buffer += data
+        lines = self.read_buffer.split(b'\n')
+        self.read_buffer = lines.pop()
+
+        for line in lines:
+            tokens = line.decode('utf-8').split()
+            token = int(tokens[0])
+            if token not in self.queued:
+                continue
+
+            queued = self.queued.pop(token)
+            if tokens[1] in REPLY_NAMES:
+                result.replied += 1
+                result.latency_ms.append((now - queued) * 1000)
+                rtt_us = int(tokens[tokens.index('round-trip-time') + 1])
+                result.error_ms.append(rtt_us / 1000.0 - injected_ms)
+            elif tokens[1] == 'no-reply':
+                result.no_reply += 1
+            else:
+                result.errors += 1
+
+    def measure_rate(self, rate, topology):
+        # type: (int, object) -> RateResult
+
+        'Send probes at a rate for the benchmark duration'
+
+        result = RateResult(rate)
+        interval = 1.0 / rate
+        start = time.time()
+        end = start + self.args.duration
+        drain = end + self.args.timeout + 1
+        next_send = start
+
+        while True:
+            now = time.time()
+            if now >= drain or (now >= end and not self.queued):
+                break
+
+            #  Queue the probes which are due, catching up if behind
+            while next_send <= now and next_send < end:
+                self.queue_probe(topology.target)
+                result.sent += 1
+                next_send += interval
+
+            if next_send < end:
+                wait = max(0, next_send - now)
+            else:
+                wait = max(0, drain - now)
+
+            writers = [self.stdin_fd] if self.write_buffer else []
+            readable, writable, _ = select.select(
+                [self.stdout_fd], writers, [], wait)
+
+            if writable:
+                self.write_commands()
+            if readable:
+                self.read_replies(result, topology.injected_ms)
+
+        result.elapsed = self.args.duration
+        self.queued.clear()
+
+        return result
+
+
+def report_header():  # type: () -> None
+    'Print the headings of the results table'
+
+    sys.stdout.write(
+        '%8s %9s %9s %6s %9s %9s %9s %9s\n' % (
+            'rate', 'sent/s', 'reply/s', 'loss%',
+            'lat-p50', 'lat-p99', 'err-p50', 'err-p99'))
+
+
+def report_result(result):  # type: (RateResult) -> None
+    'Print the results of one rate, with times in milliseconds'
+
+    latency = sorted(result.latency_ms)
+    error = sorted(result.error_ms)
+    loss = 0.0
+    if result.sent:
+        loss = 100.0 * (result.sent - result.replied) / result.sent
+
+    sys.stdout.write(
+        '%8d %9.1f %9.1f %6.2f %9.3f %9.3f %9.3f %9.3f\n' % (
+            result.rate, result.sent / result.elapsed,
+            result.replied / result.elapsed, loss,
+            percentile(latency, 0.5), percentile(latency, 0.99),
+            percentile(error, 0.5), percentile(error, 0.99)))
+    sys.stdout.flush()
+
+
+def parse_arguments():  # type: () -> argparse.Namespace
+    'Parse the command line'
+
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument(
+        '--mtr-packet', default=os.environ.get('MTR_PACKET', './mtr-packet'),
+        help='the mtr-packet to measure')
+    parser.add_argument(
+        '--topology', choices=['loopback', 'netns'], default='loopback',
+        help='probe the loopback address, or a chain of namespaces')
+    parser.add_argument(
+        '--hops', type=int, default=4,
+        help='the number of hops in the namespace chain')
+    parser.add_argument(
+        '--delay', type=float, default=1.0,
+        help='the delay added each way on every hop, in milliseconds')
+    parser.add_argument(
+        '--loss', type=float, default=0.0,
+        help='the loss added each way on every hop, in percent')
+    parser.add_argument(
+        '--rates', default='100,200,500,1000,2000,5000,10000',
+        help='the comma separated probes/sec to attempt')
+    parser.add_argument(
+        '--duration', type=float, default=5.0,
+        help='the seconds to send probes at each rate')
+    parser.add_argument(
+        '--protocol', choices=['icmp', 'udp', 'tcp'], default='icmp',
+        help='the protocol of the probes')
+    parser.add_argument(
+        '--ttl', type=int, default=64,
+        help='the time-to-live of the probes')
+    parser.add_argument(
+        '--timeout', type=int, default=2,
+        help='the seconds to wait for each reply')
+    parser.add_argument(
+        '--stop-loss', type=float, default=10.0,
+        help='stop once loss exceeds that injected by this many percent')
+
+    return parser.parse_args()
+
+
+def injected_loss(args):  # type: (argparse.Namespace) -> float
+    'The loss expected of a round trip across the topology, in percent'
+
+    if args.topology != 'netns':
+        return 0.0
+
+    delivered = (1 - args.loss / 100.0) ** (2 * args.hops)
+    return 100.0 * (1 - delivered)
+
+
+def main():  # type: () -> None
+    'Run the benchmark at each rate in turn'
+
+    args = parse_arguments()
+    rates = [int(rate) for rate in args.rates.split(',')]
+
+    if args.topology == 'netns':
+        topology = NamespaceTopology(args.hops, args.delay, args.loss)
+    else:
+        topology = LoopbackTopology()
+
+    with topology:
+        benchmark = PacketBenchmark(
+            topology.command_prefix() + [args.mtr_packet], args)
+
+        report_header()
+        try:
+            for rate in rates:
+                result = benchmark.measure_rate(rate, topology)
+                report_result(result)
+
+                loss = 100.0 * (result.sent - result.replied) / result.sent
+                if loss > injected_loss(args) + args.stop_loss:
+                    break
+        finally:
+            benchmark.close()
+
+
+if __name__ == '__main__':
+    main()
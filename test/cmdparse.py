@@ -61,6 +61,10 @@ class TestCommandParse(mtrpacket.MtrPacketTest):
             '22 send-probe',
             '23 send-probe ip-4 str-value',
             '24 send-probe ip-4 8.8.8.8 timeout str-value',
+            '26 send-probe ip-4 8.8.8.8 timeout-ms str-value',
+            '27 send-probe ip-4 8.8.8.8 timeout-ms -1',
+            '28 send-probe ip-4 8.8.8.8 timeout-ms 2147484',
+            '29 send-probe ip-4 8.8.8.8 timeout 2148',
             '25 send-probe ip-4 8.8.8.8 ttl str-value',
         ]
 
@@ -75,6 +79,8 @@ class TestCommandParse(mtrpacket.MtrPacketTest):
         feature_tests = [
             ('31 check-support feature ip-4', 'ok'),
             ('32 check-support feature send-probe', 'ok'),
+            ('34 check-support feature timeout-ms', 'ok'),
+            ('35 check-support feature stats', 'ok'),
             ('33 check-support feature bogus-feature', 'no')
         ]
 
@@ -100,6 +106,41 @@ class TestCommandParse(mtrpacket.MtrPacketTest):
         reply = self.read_reply()
         self.assertEqual(reply, '0 command-buffer-overflow')
 
+    def test_command_burst(self):
+        'Test a burst of commands larger than the command buffer'
+
+        burst = '\n'.join(
+            [str(token) + ' check-support feature send-probe'
+             for token in range(1000)])
+        self.write_command(burst)
+
+        for token in range(1000):
+            reply = self.parse_reply()
+            self.assertEqual(reply.token, token)
+            self.assertEqual(reply.command_name, 'feature-support')
+
+    def test_stats(self):
+        'Test the counters reported by a stats request'
+
+        self.write_command('40 check-support feature bogus-feature')
+        self.parse_reply()
+
+        self.write_command('41 stats')
+        reply = self.parse_reply()
+        self.assertEqual(reply.token, 41)
+        self.assertEqual(reply.command_name, 'stats')
+        self.assertEqual(reply.argument['outstanding-probes'], '0')
+
+        # The requests before this one have been parsed and timed
+        parse_time = reply.argument['parse-time-ns'].split(',')
+        self.assertGreaterEqual(int(parse_time[0]), 2)
+
+        for name in ['probes-sent', 'replies-matched', 'replies-unmatched',
+                     'timeouts', 'probes-exhausted',
+                     'peak-outstanding-probes', 'wakeups', 'syscalls',
+                     'syscalls-per-wakeup', 'send-latency-us']:
+            self.assertIn(name, reply.argument)
+
 
 if __name__ == '__main__':
     mtrpacket.check_running_as_root()
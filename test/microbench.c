@@ -0,0 +1,679 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+    Time the kernels which mtr and mtr-packet run for every probe:
+    command parsing, reply parsing, checksums, packet construction,
+    probe lookup and the accounting of replies.  Each is run in a
+    loop, calibrated to last a tenth of a second or more, and reported
+    in nanoseconds and heap allocations per operation.
+
+    The kernels are linked in from the same sources as mtr and
+    mtr-packet, and driven through the functions which call them, in
+    the same state as they would be in use, with no sockets or
+    subprocess of their own beyond a pipe.
+*/
+
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ui/mtr.h"
+#include "ui/cmdpipe.h"
+#include "ui/net.h"
+#include "packet/cmdparse.h"
+#include "packet/construct_unix.h"
+#include "packet/probe.h"
+
+/*  The least time over which to measure a kernel, in nanoseconds  */
+#define MIN_MEASURE_NS 100000000LL
+
+/*  Hops among which the replies of the net_process_ping benchmark fall  */
+#define REPLAY_HOPS 16
+
+/*  The first token of the replayed probes, at least MinToken in net.c  */
+#define REPLAY_MIN_TOKEN 33000
+
+/*  Replies written to the reply pipe at once, short of filling it  */
+#define REPLY_BATCH 1024
+
+/*  A kernel to time, run for a number of operations  */
+typedef void (
+    *bench_func_t) (
+    void *context,
+    long iterations);
+
+/*
+    Allocations are counted by interposing on the allocator, which we
+    can do only where the underlying allocator can be called by name.
+*/
+#ifdef __GLIBC__
+#define COUNT_ALLOCATIONS 1
+
+extern void *__libc_malloc(
+    size_t size);
+extern void *__libc_calloc(
+    size_t count,
+    size_t size);
+extern void *__libc_realloc(
+    void *ptr,
+    size_t size);
+extern void __libc_free(
+    void *ptr);
+
+static volatile long allocation_count;
+
+void *malloc(
+    size_t size)
+{
+    allocation_count++;
+    return __libc_malloc(size);
+}
+
+void *calloc(
+    size_t count,
+    size_t size)
+{
+    allocation_count++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(
+    void *ptr,
+    size_t size)
+{
+    allocation_count++;
+    return __libc_realloc(ptr, size);
+}
+
+void free(
+    void *ptr)
+{
+    __libc_free(ptr);
+}
+#else
+#define COUNT_ALLOCATIONS 0
+
+static volatile long allocation_count;
+#endif
+
+/*
+    mtr's frontends, the capture file and program name, which net.c
+    and cmdpipe.c call or refer to, have nothing to do here.
+*/
+char *myname = "mtr-microbench";
+
+void display_close(
+    struct mtr_ctl *ctl)
+{
+}
+
+void display_rawxmit(
+    struct mtr_ctl *ctl,
+    int hostnum,
+    int seq)
+{
+}
+
+void display_rawping(
+    struct mtr_ctl *ctl,
+    int hostnum,
+    int msec,
+    int seq)
+{
+}
+
+void display_rawhost(
+    struct mtr_ctl *ctl,
+    int hostnum,
+    int addr_id)
+{
+}
+
+void capture_xmit(
+    int host,
+    int seq)
+{
+}
+
+void capture_reply(
+    int af,
+    int host,
+    int seq,
+    int err,
+    struct mplslen *mpls,
+    ip_t * addr,
+    int usec)
+{
+}
+
+/*  Keep the compiler from discarding the results of a kernel  */
+static volatile long sink;
+
+static long long now_ns(
+    void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+    Time a kernel, doubling the number of operations until a run lasts
+    long enough to measure, and report the cost of one operation.
+*/
+static void run_bench(
+    const char *name,
+    bench_func_t func,
+    void *context)
+{
+    long iterations = 1;
+    long allocations;
+    long long start, elapsed;
+
+    /*  Warm the caches, and let the kernel reach its steady state  */
+    func(context, 1);
+
+    while (1) {
+        allocations = allocation_count;
+        start = now_ns();
+        func(context, iterations);
+        elapsed = now_ns() - start;
+        allocations = allocation_count - allocations;
+
+        if (elapsed >= MIN_MEASURE_NS || iterations >= (1L << 40)) {
+            break;
+        }
+        iterations *= 2;
+    }
+
+    printf("%-36s %12ld %10.1f", name, iterations,
+           (double) elapsed / iterations);
+    if (COUNT_ALLOCATIONS) {
+        printf(" %12.3f\n", (double) allocations / iterations);
+    } else {
+        printf(" %12s\n", "-");
+    }
+}
+
+/*  A command or reply, parsed from a copy, as parsing modifies it  */
+struct parse_context {
+    const char *text;
+    size_t length;
+    char buffer[COMMAND_BUFFER_SIZE];
+};
+
+static void bench_tokenize(
+    void *context,
+    long iterations)
+{
+    struct parse_context *parse = context;
+    char *tokens[MAX_COMMAND_TOKENS];
+    long i;
+
+    for (i = 0; i < iterations; i++) {
+        memcpy(parse->buffer, parse->text, parse->length + 1);
+        sink += tokenize_command(tokens, MAX_COMMAND_TOKENS,
+                                 parse->buffer);
+    }
+}
+
+static void bench_parse(
+    void *context,
+    long iterations)
+{
+    struct parse_context *parse = context;
+    struct command_t command;
+    long i;
+
+    for (i = 0; i < iterations; i++) {
+        memcpy(parse->buffer, parse->text, parse->length + 1);
+        sink += parse_command(&command, parse->buffer);
+        sink += command.argument_count;
+    }
+}
+
+/*  A reply pipe, as from mtr-packet, and replies to write into it  */
+struct reply_context {
+    struct mtr_ctl *ctl;
+    struct packet_command_pipe_t cmdpipe;
+    int write_fd;
+    char *replies;
+    size_t reply_length[REPLY_BATCH];
+    size_t batch_length;
+};
+
+static void count_reply(
+    struct mtr_ctl *ctl,
+    int seq,
+    int err,
+    struct mplslen *mpls,
+    ip_t * addr,
+    int usec)
+{
+    sink += seq + usec;
+}
+
+/*
+    Format a batch of text replies, as mtr-packet sends them, with
+    addresses and round trip times which vary as they would in use.
+*/
+static void init_reply_context(
+    struct reply_context *reply,
+    struct mtr_ctl *ctl)
+{
+    int fds[2];
+    size_t used = 0;
+    int i;
+
+    memset(reply, 0, sizeof(struct reply_context));
+    reply->ctl = ctl;
+
+    if (pipe(fds)) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+    if (fcntl(fds[0], F_SETFL, O_NONBLOCK)) {
+        perror("fcntl");
+        exit(EXIT_FAILURE);
+    }
+    reply->write_fd = fds[1];
+
+    reply->cmdpipe.read_fd = fds[0];
+    reply->cmdpipe.write_fd = -1;
+    reply->cmdpipe.reply_buffer_size = PACKET_REPLY_BUFFER_SIZE;
+    reply->cmdpipe.reply_buffer = malloc(PACKET_REPLY_BUFFER_SIZE);
+    reply->cmdpipe.reply_line = malloc(PACKET_REPLY_BUFFER_SIZE);
+    reply->replies = malloc(REPLY_BATCH * 64);
+    if (reply->cmdpipe.reply_buffer == NULL
+        || reply->cmdpipe.reply_line == NULL || reply->replies == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < REPLY_BATCH; i++) {
+        used += snprintf(reply->replies + used, 64,
+                         "%d %s ip-4 10.0.%d.1 round-trip-time %d\n",
+                         REPLAY_MIN_TOKEN + i,
+                         i % REPLAY_HOPS == REPLAY_HOPS - 1
+                         ? "reply" : "ttl-expired",
+                         i % REPLAY_HOPS, 1000 + (i * 7919) % 50000);
+    }
+    reply->batch_length = used;
+}
+
+/*
+    Operations are single replies, read from the pipe a batch at a
+    time, so that the cost of writing the pipe is spread thinly.
+*/
+static void bench_replies(
+    void *context,
+    long iterations)
+{
+    struct reply_context *reply = context;
+    long i;
+    long count;
+
+    for (i = 0; i < iterations; i += count) {
+        count = iterations - i;
+        if (count > REPLY_BATCH) {
+            count = REPLY_BATCH;
+        }
+
+        /*  Only whole batches are written, so as to end on a newline  */
+        if (write(reply->write_fd, reply->replies, reply->batch_length)
+            != (ssize_t) reply->batch_length) {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        handle_command_replies(reply->ctl, &reply->cmdpipe, count_reply);
+    }
+}
+
+/*  A packet of a given size to checksum  */
+struct checksum_context {
+    int size;
+    char packet[9000];
+};
+
+static void bench_checksum(
+    void *context,
+    long iterations)
+{
+    struct checksum_context *checksum = context;
+    long i;
+
+    for (i = 0; i < iterations; i++) {
+        sink += compute_checksum(checksum->packet, checksum->size);
+    }
+}
+
+/*  A probe to construct, with the addresses it is sent between  */
+struct construct_context {
+    struct net_state_t *net_state;
+    struct probe_param_t param;
+    struct sockaddr_storage src_sockaddr;
+    struct sockaddr_storage dest_sockaddr;
+    char packet[PACKET_BUFFER_SIZE];
+};
+
+static void bench_construct(
+    void *context,
+    long iterations)
+{
+    struct construct_context *construct = context;
+    int packet_socket;
+    long i;
+
+    for (i = 0; i < iterations; i++) {
+        sink += construct_packet(construct->net_state, &packet_socket,
+                                 MIN_PORT + (i & 0x3ff),
+                                 construct->packet,
+                                 sizeof(construct->packet),
+                                 &construct->dest_sockaddr,
+                                 &construct->src_sockaddr,
+                                 &construct->param);
+    }
+}
+
+static void init_construct_context(
+    struct construct_context *construct,
+    struct net_state_t *net_state,
+    int ip_version,
+    int protocol)
+{
+    struct sockaddr_in *src4 = (struct sockaddr_in *)
+        &construct->src_sockaddr;
+    struct sockaddr_in *dest4 = (struct sockaddr_in *)
+        &construct->dest_sockaddr;
+    struct sockaddr_in6 *src6 = (struct sockaddr_in6 *)
+        &construct->src_sockaddr;
+    struct sockaddr_in6 *dest6 = (struct sockaddr_in6 *)
+        &construct->dest_sockaddr;
+
+    memset(construct, 0, sizeof(struct construct_context));
+    construct->net_state = net_state;
+    construct->param.ip_version = ip_version;
+    construct->param.protocol = protocol;
+    construct->param.ttl = 8;
+    construct->param.packet_size = 64;
+    construct->param.dest_port = 33434;
+    construct->param.timeout_ms = 10000;
+
+    if (ip_version == 6) {
+        src6->sin6_family = AF_INET6;
+        src6->sin6_addr = in6addr_loopback;
+        dest6->sin6_family = AF_INET6;
+        dest6->sin6_addr = in6addr_loopback;
+    } else {
+        src4->sin_family = AF_INET;
+        src4->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        dest4->sin_family = AF_INET;
+        dest4->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    }
+}
+
+/*
+    Time the construction of a probe, unless it can't be constructed
+    here, as for IPv6 without the sockets it must set options on.
+*/
+static void run_construct(
+    const char *name,
+    struct net_state_t *net_state,
+    int ip_version,
+    int protocol)
+{
+    static struct construct_context construct;
+    int packet_socket;
+
+    init_construct_context(&construct, net_state, ip_version, protocol);
+    if (construct_packet(net_state, &packet_socket, MIN_PORT,
+                         construct.packet, sizeof(construct.packet),
+                         &construct.dest_sockaddr,
+                         &construct.src_sockaddr,
+                         &construct.param) < 0) {
+        printf("%-36s skipped: %s\n", name, strerror(errno));
+        return;
+    }
+
+    run_bench(name, bench_construct, &construct);
+}
+
+/*  The packet state of mtr-packet, with its pool of probes in flight  */
+struct probe_context {
+    struct net_state_t *net_state;
+    int sequence[MAX_PROBES];
+    int icmp_id;
+};
+
+static void bench_find_probe(
+    void *context,
+    long iterations)
+{
+    struct probe_context *probes = context;
+    struct probe_t *probe;
+    long i;
+
+    for (i = 0; i < iterations; i++) {
+        probe = find_probe(probes->net_state, IPPROTO_ICMP,
+                           probes->icmp_id,
+                           htons(probes->sequence
+                                 [(i * 7919) % MAX_PROBES]));
+        sink += probe != NULL;
+    }
+}
+
+static void bench_find_probe_miss(
+    void *context,
+    long iterations)
+{
+    struct probe_context *probes = context;
+    long i;
+
+    for (i = 0; i < iterations; i++) {
+        sink += find_probe(probes->net_state, IPPROTO_UDP, 0,
+                           htons(MIN_PORT + MAX_PROBES + (i & 0x3ff)))
+            != NULL;
+    }
+}
+
+/*  Fill the probe pool, as it is with the most probes in flight  */
+static void init_probe_context(
+    struct probe_context *probes,
+    struct net_state_t *net_state,
+    struct command_session_t *session)
+{
+    struct probe_t *probe;
+    int i;
+
+    memset(session, 0, sizeof(struct command_session_t));
+    probes->net_state = net_state;
+    probes->icmp_id = htons(getpid());
+
+    init_probe_pool(net_state);
+    net_state->session = session;
+    net_state->platform.min_sequence = MIN_PORT;
+    net_state->platform.max_sequence = MAX_PORT;
+    net_state->platform.next_sequence = MIN_PORT;
+
+    for (i = 0; i < MAX_PROBES; i++) {
+        probe = alloc_probe(net_state, i);
+        if (probe == NULL) {
+            fprintf(stderr, "probe pool exhausted after %d probes\n", i);
+            exit(EXIT_FAILURE);
+        }
+        probes->sequence[i] = probe->sequence;
+    }
+}
+
+/*  A trace being replayed, with probes and their replies to account  */
+struct ping_context {
+    struct mtr_ctl *ctl;
+    struct net_session *net;
+    ip_t addr[REPLAY_HOPS];
+    struct mplslen mpls;
+    long sequence;
+};
+
+/*
+    An operation is a probe accounted as sent, followed by its reply,
+    as net_process_ping can't be reached without a probe to match.
+*/
+static void bench_process_ping(
+    void *context,
+    long iterations)
+{
+    struct ping_context *ping = context;
+    int index;
+    int seq;
+    long i;
+
+    for (i = 0; i < iterations; i++) {
+        index = ping->sequence % REPLAY_HOPS;
+        seq = REPLAY_MIN_TOKEN + ping->sequence % 16384;
+        ping->sequence++;
+
+        net_replay_xmit(ping->ctl, ping->net, index, seq);
+        net_replay_reply(ping->ctl, seq, 0, &ping->mpls,
+                         &ping->addr[index],
+                         1000 + (ping->sequence * 7919) % 50000);
+    }
+}
+
+static void init_ping_context(
+    struct ping_context *ping,
+    struct mtr_ctl *ctl)
+{
+    static struct in_addr target;
+    static char *addr_list[2];
+    struct hostent hostent;
+    int i;
+
+    memset(ping, 0, sizeof(struct ping_context));
+    ping->ctl = ctl;
+
+    target.s_addr = htonl(0x0a000000 | ((REPLAY_HOPS - 1) << 8) | 1);
+    addr_list[0] = (char *) &target;
+    addr_list[1] = NULL;
+    memset(&hostent, 0, sizeof(struct hostent));
+    hostent.h_addrtype = AF_INET;
+    hostent.h_length = sizeof(struct in_addr);
+    hostent.h_addr_list = addr_list;
+
+    ping->net = net_session_replay(ctl, &hostent, "127.0.0.1");
+    ctl->net = ping->net;
+
+    for (i = 0; i < REPLAY_HOPS; i++) {
+        memset(&ping->addr[i], 0, sizeof(ip_t));
+        ((struct in_addr *) &ping->addr[i])->s_addr =
+            htonl(0x0a000000 | (i << 8) | 1);
+    }
+}
+
+int main(
+    int argc,
+    char **argv)
+{
+    static struct mtr_ctl ctl;
+    static struct parse_context parse;
+    static struct reply_context reply;
+    static struct checksum_context checksum;
+    static struct net_state_t net_state;
+    static struct net_state_t probe_state;
+    static struct command_session_t session;
+    static struct probe_context probes;
+    static struct ping_context ping;
+    static const int checksum_sizes[] = { 20, 64, 576, 1500, 9000 };
+    char name[64];
+    unsigned i;
+
+    ctl.af = AF_INET;
+    ctl.mtrtype = IPPROTO_ICMP;
+    ctl.cpacketsize = 64;
+    ctl.fstTTL = 1;
+    ctl.maxTTL = 30;
+    ctl.maxUnknown = 12;
+    ctl.probe_timeout = 10 * 1000000;
+    ctl.saved_pings = SAVED_PINGS;
+    ctl.WaitTime = 1.0;
+
+    printf("%-36s %12s %10s %12s\n", "benchmark", "iterations", "ns/op",
+           "allocs/op");
+
+    parse.text = "42 send-probe ip-4 203.0.113.1 ttl 12 size 64 "
+        "timeout 10 protocol icmp";
+    parse.length = strlen(parse.text);
+    run_bench("tokenize_command send-probe", bench_tokenize, &parse);
+    run_bench("parse_command send-probe", bench_parse, &parse);
+
+    parse.text = "33042 ttl-expired ip-4 203.0.113.1 round-trip-time 12345 "
+        "mpls 1234,0,0,1";
+    parse.length = strlen(parse.text);
+    run_bench("parse_command ttl-expired", bench_parse, &parse);
+
+    init_reply_context(&reply, &ctl);
+    run_bench("handle_command_replies per reply", bench_replies, &reply);
+
+    memset(checksum.packet, 0x5a, sizeof(checksum.packet));
+    for (i = 0; i < sizeof(checksum_sizes) / sizeof(int); i++) {
+        checksum.size = checksum_sizes[i];
+        snprintf(name, sizeof(name), "compute_checksum %d bytes",
+                 checksum.size);
+        run_bench(name, bench_checksum, &checksum);
+    }
+
+    /*  Raw sockets are assumed, so that the headers are built here  */
+    net_state.platform.ip4_socket_raw = true;
+    net_state.platform.ip6_socket_raw = false;
+    net_state.platform.ip6_txrx_icmp_socket =
+        socket(AF_INET6, SOCK_DGRAM, IPPROTO_ICMPV6);
+    net_state.platform.ip6_txrx_udp_socket =
+        socket(AF_INET6, SOCK_DGRAM, 0);
+    run_construct("construct_packet icmp ip-4", &net_state, 4,
+                  IPPROTO_ICMP);
+    run_construct("construct_packet udp ip-4", &net_state, 4, IPPROTO_UDP);
+    run_construct("construct_packet icmp ip-6", &net_state, 6,
+                  IPPROTO_ICMP);
+    run_construct("construct_packet udp ip-6", &net_state, 6, IPPROTO_UDP);
+
+    init_probe_context(&probes, &probe_state, &session);
+    snprintf(name, sizeof(name), "find_probe %d in flight", MAX_PROBES);
+    run_bench(name, bench_find_probe, &probes);
+    snprintf(name, sizeof(name), "find_probe miss %d in flight",
+             MAX_PROBES);
+    run_bench(name, bench_find_probe_miss, &probes);
+
+    init_ping_context(&ping, &ctl);
+    run_bench("net_process_ping", bench_process_ping, &ping);
+
+    return EXIT_SUCCESS;
+}
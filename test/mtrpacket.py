@@ -284,6 +284,12 @@ class MtrPacketTest(unittest.TestCase):
         #  or we read a newline character, which indicates a finished
         #  reply.
         while True:
+            #  A previous read may have already buffered a complete
+            #  reply, in which case we shouldn't wait for more input.
+            newline_ix = self.reply_buffer.find('\n')
+            if newline_ix != -1:
+                break
+
             now = time.time()
             elapsed = now - start_time
 
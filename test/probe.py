@@ -19,8 +19,14 @@
 
 '''Test sending probes and receiving respones.'''
 
+import os
+import select
+import shutil
 import socket
+import struct
+import subprocess
 import sys
+import tempfile
 import time
 import unittest
 
@@ -205,6 +211,13 @@ class TestProbeICMPv4(mtrpacket.MtrPacketTest):
         self.assertGreaterEqual(elapsed, 2.9)
         self.assertLess(elapsed, 3.5)
 
+        begin = time.time()
+        self.write_command('22 send-probe ip-4 8.8.254.254 timeout-ms 300')
+        self.parse_reply()
+        elapsed = time.time() - begin
+        self.assertGreaterEqual(elapsed, 0.29)
+        self.assertLess(elapsed, 0.8)
+
     def test_ttl_expired(self):
         'Test sending a probe which will have its time-to-live expire'
 
@@ -263,6 +276,133 @@ class TestProbeICMPv4(mtrpacket.MtrPacketTest):
         required_success = int(loop_count * 0.90)
         self.assertGreaterEqual(success_count, required_success)
 
+    def test_probe_burst(self):
+        'Test that every probe of a burst written at once is answered'
+
+        probe_count = 1000
+        burst = '\n'.join(
+            ['%d send-probe ip-4 127.0.0.1 timeout 2' % (1000 + i)
+             for i in range(probe_count)])
+        self.write_command(burst)
+
+        tokens = set()
+        # pylint: disable=locally-disabled, unused-variable
+        for i in range(probe_count):
+            reply = self.parse_reply()
+            self.assertEqual(reply.command_name, 'reply')
+            tokens.add(reply.token)
+
+        self.assertEqual(tokens, set(range(1000, 1000 + probe_count)))
+
+    def test_probe_batch(self):
+        'Test sending several probes with a single send-probe-batch'
+
+        if not check_feature(self, 'send-probe-batch'):
+            return
+
+        cmd = '30 send-probe-batch ip-4 127.0.0.1 probes 31,1,32,2,33,3'
+        self.write_command(cmd)
+
+        tokens = set()
+        # pylint: disable=locally-disabled, unused-variable
+        for i in range(3):
+            reply = self.parse_reply()
+            self.assertEqual(reply.command_name, 'reply')
+            self.assertIn('ip-4', reply.argument)
+            self.assertEqual(reply.argument['ip-4'], '127.0.0.1')
+            self.assertIn('round-trip-time', reply.argument)
+            tokens.add(reply.token)
+
+        self.assertEqual(tokens, set([31, 32, 33]))
+
+        #  A probe list without a time-to-live for each token is invalid
+        cmd = '34 send-probe-batch ip-4 127.0.0.1 probes 35,1,36'
+        self.write_command(cmd)
+        reply = self.parse_reply()
+        self.assertEqual(reply.token, 34)
+        self.assertEqual(reply.command_name, 'invalid-argument')
+
+        #  So is a token which doesn't fit in an integer
+        cmd = '37 send-probe-batch ip-4 127.0.0.1 probes 4294967334,1'
+        self.write_command(cmd)
+        reply = self.parse_reply()
+        self.assertEqual(reply.token, 37)
+        self.assertEqual(reply.command_name, 'invalid-argument')
+
+        #  Large packets fill the batch storage before the batch is full
+        probes = ','.join('%d,%d' % (token, 64) for token in range(40, 80))
+        cmd = '38 send-probe-batch ip-4 127.0.0.1 size 1400 probes ' + probes
+        self.write_command(cmd)
+
+        tokens = set()
+        # pylint: disable=locally-disabled, unused-variable
+        for i in range(40):
+            reply = self.parse_reply()
+            self.assertEqual(reply.command_name, 'reply')
+            tokens.add(reply.token)
+
+        self.assertEqual(tokens, set(range(40, 80)))
+
+    def test_kernel_timestamp(self):
+        'Test probes timed with kernel transmit timestamps'
+
+        if not check_feature(self, 'kernel-timestamp'):
+            return
+
+        self.write_command('40 send-probe ip-4 127.0.0.1 timestamp kernel')
+        reply = self.parse_reply()
+        self.assertEqual(reply.token, 40)
+        self.assertEqual(reply.command_name, 'reply')
+        self.assertIn('round-trip-time', reply.argument)
+
+        #  Only kernel and user timestamps are allowed
+        self.write_command('41 send-probe ip-4 127.0.0.1 timestamp wall')
+        reply = self.parse_reply()
+        self.assertEqual(reply.token, 41)
+        self.assertEqual(reply.command_name, 'invalid-argument')
+
+    def test_probe_template(self):
+        'Test probes sent using a probe template'
+
+        if not check_feature(self, 'probe-template'):
+            return
+
+        self.write_command(
+            '42 define-probe-template template 3 ip-4 127.0.0.1')
+        reply = self.parse_reply()
+        self.assertEqual(reply.token, 42)
+        self.assertEqual(reply.command_name, 'template-defined')
+        self.assertEqual(reply.argument['template'], '3')
+
+        #  Send two probes with the template, to reuse its packet
+        self.write_command('43 send-template template 3 ttl 64')
+        reply = self.parse_reply()
+        self.assertEqual(reply.token, 43)
+        self.assertEqual(reply.command_name, 'reply')
+        self.assertIn('round-trip-time', reply.argument)
+
+        self.write_command('44 send-template template 3 ttl 64')
+        reply = self.parse_reply()
+        self.assertEqual(reply.token, 44)
+        self.assertEqual(reply.command_name, 'reply')
+
+        #  Templates which haven't been defined can't be used
+        self.write_command('45 send-template template 4')
+        reply = self.parse_reply()
+        self.assertEqual(reply.token, 45)
+        self.assertEqual(reply.command_name, 'invalid-argument')
+
+        #  A probe may have a timeout other than its template's
+        self.write_command('46 send-template template 3 ttl 64 timeout-ms 500')
+        reply = self.parse_reply()
+        self.assertEqual(reply.token, 46)
+        self.assertEqual(reply.command_name, 'reply')
+
+        self.write_command('47 send-template template 3 timeout-ms -1')
+        reply = self.parse_reply()
+        self.assertEqual(reply.token, 47)
+        self.assertEqual(reply.command_name, 'invalid-argument')
+
 
 class TestProbeICMPv6(mtrpacket.MtrPacketTest):
     '''Test sending probes using IP version 6'''
@@ -349,6 +489,45 @@ class TestProbeUDP(mtrpacket.MtrPacketTest):
 
         self.udp_port_test('ip-6 ::1')
 
+    def sequence_checksum_test(self, address):  # type: (unicode) -> None
+        '''With both ports given, the sequence number is in the checksum,
+        which must still be correct for the destination to reply.'''
+
+        if not check_feature(self, 'udp'):
+            return
+
+        cmd = '83 send-probe protocol udp port 990 local-port 1991 ' + address
+        self.write_command(cmd)
+        reply = self.parse_reply()
+        self.assertEqual('reply', reply.command_name)
+
+    def test_sequence_checksum_v4(self):
+        'Test IPv4 UDP probes with the sequence number in the checksum'
+
+        self.sequence_checksum_test('ip-4 127.0.0.1')
+
+        #  Probes sent with a template have their packet patched
+        if not check_feature(self, 'probe-template'):
+            return
+
+        self.write_command('84 define-probe-template template 5 ' +
+                           'protocol udp port 990 local-port 1991 ' +
+                           'ip-4 127.0.0.1')
+        reply = self.parse_reply()
+        self.assertEqual('template-defined', reply.command_name)
+
+        for token in [85, 86]:
+            self.write_command('%d send-template template 5 ttl 64' % token)
+            reply = self.parse_reply()
+            self.assertEqual(token, reply.token)
+            self.assertEqual('reply', reply.command_name)
+
+    @unittest.skipUnless(mtrpacket.HAVE_IPV6, 'No IPv6')
+    def test_sequence_checksum_v6(self):
+        'Test IPv6 UDP probes with the sequence number in the checksum'
+
+        self.sequence_checksum_test('ip-6 ::1')
+
 
 class TestProbeTCP(mtrpacket.MtrPacketTest):
     'Test TCP probe support'
@@ -385,6 +564,29 @@ class TestProbeTCP(mtrpacket.MtrPacketTest):
         reply = self.parse_reply()
         self.assertEqual(reply.command_name, 'reply')
 
+    def test_tcp_syn(self):
+        'Test TCP probes sent as raw SYN segments'
+
+        if not check_feature(self, 'tcp-syn'):
+            return
+
+        #  The RST from a refused port is matched to the probe
+        cmd = '81 send-probe ip-4 127.0.0.1 protocol tcp port 164 ' + \
+            'tcp-method syn'
+        self.write_command(cmd)
+
+        reply = self.parse_reply()
+        self.assertEqual(reply.token, 81)
+        self.assertEqual(reply.command_name, 'reply')
+        self.assertEqual(reply.argument['ip-4'], '127.0.0.1')
+
+        #  Only SYN segments and connections are allowed
+        self.write_command('82 send-probe ip-4 127.0.0.1 protocol tcp ' +
+                           'tcp-method rst')
+        reply = self.parse_reply()
+        self.assertEqual(reply.token, 82)
+        self.assertEqual(reply.command_name, 'invalid-argument')
+
 
 class TestProbeSCTP(mtrpacket.MtrPacketTest):
     'Test SCTP probes'
@@ -401,6 +603,203 @@ class TestProbeSCTP(mtrpacket.MtrPacketTest):
         test_basic_probe(self, 6, 'sctp')
 
 
+class TestBinaryProtocol(mtrpacket.MtrPacketTest):
+    '''Test probes sent with binary request records'''
+
+    def read_record(self, size, timeout=10.0):
+        # type: (int, float) -> bytes
+
+        'Read a binary record of a particular size from mtr-packet'
+
+        record = b''
+        start_time = time.time()
+        while len(record) < size:
+            elapsed = time.time() - start_time
+            if elapsed >= timeout:
+                raise mtrpacket.ReadReplyTimeout()
+
+            select.select([self.stdout_fd], [], [], timeout - elapsed)
+
+            try:
+                record += os.read(self.stdout_fd, size - len(record))
+            except OSError:
+                pass
+
+        return record
+
+    def test_binary_probe(self):
+        'Test a binary probe to the loopback address'
+
+        if not check_feature(self, 'binary-protocol'):
+            return
+
+        self.write_command('80 enter-binary-mode')
+        reply = self.parse_reply()
+        self.assertEqual(reply.token, 80)
+        self.assertEqual(reply.command_name, 'binary-mode-entered')
+
+        loopback = socket.inet_aton('127.0.0.1')
+
+        #  An ICMP probe with a TTL of 64, 64 bytes in size
+        request = struct.pack(
+            '<IBBBBHHHBBiII4x16s16s', 81, 1, 4, socket.IPPROTO_ICMP,
+            64, 64, 0, 0, 0, 0, 0, 10, 0, loopback, b'')
+        os.write(self.stdin_fd, request)
+
+        record = self.read_record(64)
+        (token, reply_type, ip_version, mpls_count, round_trip_time,
+         address) = struct.unpack('<IBBBxI16s', record[:28])
+        self.assertEqual(token, 81)
+        self.assertEqual(reply_type, 1)
+        self.assertEqual(ip_version, 4)
+        self.assertEqual(mpls_count, 0)
+        self.assertEqual(address[:4], loopback)
+
+        #  Unknown request types are rejected with unknown-command
+        request = struct.pack('<IB59x', 82, 99)
+        os.write(self.stdin_fd, request)
+
+        record = self.read_record(64)
+        (token, reply_type) = struct.unpack('<IB', record[:5])
+        self.assertEqual(token, 82)
+        self.assertEqual(reply_type, 12)
+
+
+class TestThreads(mtrpacket.MtrPacketTest):
+    '''Test probes sharded across threads with MTR_PACKET_THREADS'''
+
+    def setUp(self):
+        'Spawn mtr-packet with probes sharded across four threads'
+
+        previous = os.environ.get('MTR_PACKET_THREADS')
+        os.environ['MTR_PACKET_THREADS'] = '4'
+        try:
+            super(TestThreads, self).setUp()
+        finally:
+            if previous is None:
+                del os.environ['MTR_PACKET_THREADS']
+            else:
+                os.environ['MTR_PACKET_THREADS'] = previous
+
+    def test_sharded_probes(self):
+        'Test that each of many probes is answered exactly once'
+
+        probe_count = 64
+        for i in range(probe_count):
+            self.write_command(
+                '%d send-probe ip-4 127.0.0.1 timeout 2' % (100 + i))
+
+        tokens = set()
+        # pylint: disable=locally-disabled, unused-variable
+        for i in range(probe_count):
+            reply = self.parse_reply()
+            self.assertEqual(reply.command_name, 'reply')
+            self.assertNotIn(reply.token, tokens)
+            tokens.add(reply.token)
+
+        self.assertEqual(tokens, set(range(100, 100 + probe_count)))
+
+        #  Each thread's filter passes only the replies to its own probes
+        if sys.platform.startswith('linux'):
+            self.write_command('200 stats')
+            reply = self.parse_reply()
+            self.assertEqual(reply.command_name, 'stats')
+            self.assertEqual(reply.argument['replies-unmatched'], '0')
+
+
+class TestDaemon(unittest.TestCase):
+    '''Test several clients sharing an mtr-packet started with --listen'''
+
+    def setUp(self):
+        'Start an mtr-packet daemon listening in a temporary directory'
+
+        packet_path = os.environ.get('MTR_PACKET', './mtr-packet')
+
+        self.socket_dir = tempfile.mkdtemp()
+        self.socket_path = os.path.join(self.socket_dir, 'mtr-packet')
+        self.daemon_process = subprocess.Popen(
+            [packet_path, '--listen', self.socket_path])
+
+        for _ in range(100):
+            if os.path.exists(self.socket_path):
+                break
+            time.sleep(0.1)
+
+    def tearDown(self):
+        'Terminate the daemon and remove its socket'
+
+        self.daemon_process.kill()
+        self.daemon_process.wait()
+        shutil.rmtree(self.socket_dir)
+
+    def connect(self):  # type: () -> socket.socket
+        'Connect a new client to the daemon'
+
+        client = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        client.settimeout(10.0)
+        client.connect(self.socket_path)
+
+        return client
+
+    @staticmethod
+    def read_reply(client):
+        # type: (socket.socket) -> mtrpacket.MtrPacketReply
+
+        'Read a single reply from a client'
+
+        reply = b''
+        while not reply.endswith(b'\n'):
+            received = client.recv(1)
+            if not received:
+                raise mtrpacket.ReadReplyTimeout()
+            reply += received
+
+        return mtrpacket.MtrPacketReply(reply.decode('utf-8'))
+
+    def test_shared_tokens(self):
+        'Test that clients may use the same tokens and template ids'
+
+        first = self.connect()
+        second = self.connect()
+
+        first.sendall(b'1 define-probe-template template 1 ip-4 127.0.0.1\n')
+        reply = self.read_reply(first)
+        self.assertEqual(reply.token, 1)
+        self.assertEqual(reply.command_name, 'template-defined')
+
+        #  The second client hasn't defined template 1
+        second.sendall(b'1 send-template template 1\n')
+        reply = self.read_reply(second)
+        self.assertEqual(reply.token, 1)
+        self.assertEqual(reply.command_name, 'invalid-argument')
+
+        first.sendall(b'2 send-template template 1\n')
+        second.sendall(b'2 send-probe ip-4 127.0.0.1\n')
+
+        for client in (first, second):
+            reply = self.read_reply(client)
+            self.assertEqual(reply.token, 2)
+            self.assertEqual(reply.command_name, 'reply')
+            self.assertEqual(reply.argument['ip-4'], '127.0.0.1')
+
+        first.close()
+        second.close()
+
+    def test_disconnect(self):
+        'Test that the daemon continues serving after a client leaves'
+
+        first = self.connect()
+        first.sendall(b'1 send-probe ip-4 127.0.0.1\n')
+        first.close()
+
+        second = self.connect()
+        second.sendall(b'1 check-support feature send-probe\n')
+        reply = self.read_reply(second)
+        self.assertEqual(reply.token, 1)
+        self.assertEqual(reply.argument['support'], 'ok')
+        second.close()
+
+
 if __name__ == '__main__':
     mtrpacket.check_running_as_root()
     unittest.main()
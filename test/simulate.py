@@ -0,0 +1,190 @@
+#!/usr/bin/env python
+#
+#   mtr  --  a network diagnostic tool
+#   Copyright (C) 2016  Matt Kimball
+#
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License version 2 as
+#   published by the Free Software Foundation.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License along
+#   with this program; if not, write to the Free Software Foundation, Inc.,
+#   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+#
+
+'''Test the replies of mtr-packet's simulated network.'''
+
+
+import os
+import subprocess
+import tempfile
+import time
+import unittest
+
+import mtrpacket
+
+
+TOPOLOGY = '''
+# A path of five hops, the third of which never replies
+seed 3
+hop 10.1.0.1 delay 1
+hop 10.1.1.1 10.1.1.2 2001:db8:1::1 delay 2
+hop *
+hop 10.1.3.1 2001:db8:3::1 delay 4 mpls 16001,16002
+hop 10.1.4.1 delay 5 jitter 1 loss 50
+target delay 8
+'''
+
+
+class TestSimulate(mtrpacket.MtrPacketTest):
+    '''Test replies synthesized from a topology file'''
+
+    def setUp(self):
+        'Start mtr-packet with a simulated network'
+
+        handle, self.topology_path = tempfile.mkstemp()
+        os.write(handle, TOPOLOGY.encode('utf-8'))
+        os.close(handle)
+
+        os.environ['MTR_PACKET_SIMULATE'] = self.topology_path
+        try:
+            super(TestSimulate, self).setUp()
+        finally:
+            del os.environ['MTR_PACKET_SIMULATE']
+
+    def tearDown(self):
+        'Remove the topology file'
+
+        super(TestSimulate, self).tearDown()
+        os.remove(self.topology_path)
+
+    def test_ttl_expired(self):
+        'Test the replies of hops, with their round trip times'
+
+        self.write_command('10 send-probe ip-4 203.0.113.1 ttl 1')
+        reply = self.parse_reply()
+        self.assertEqual(reply.token, 10)
+        self.assertEqual(reply.command_name, 'ttl-expired')
+        self.assertEqual(reply.argument['ip-4'], '10.1.0.1')
+        self.assertEqual(reply.argument['round-trip-time'], '1000')
+
+        self.write_command('11 send-probe ip-4 203.0.113.1 ttl 4')
+        reply = self.parse_reply()
+        self.assertEqual(reply.command_name, 'ttl-expired')
+        self.assertEqual(reply.argument['ip-4'], '10.1.3.1')
+        self.assertEqual(reply.argument['round-trip-time'], '4000')
+        self.assertEqual(reply.argument['mpls'], '16001,0,0,1,16002,0,1,1')
+
+    def test_target(self):
+        'Test that probes beyond the last hop reach the destination'
+
+        self.write_command('20 send-probe ip-4 203.0.113.1 ttl 30')
+        reply = self.parse_reply()
+        self.assertEqual(reply.command_name, 'reply')
+        self.assertEqual(reply.argument['ip-4'], '203.0.113.1')
+        self.assertEqual(reply.argument['round-trip-time'], '8000')
+
+    def test_silent_hop(self):
+        'Test that a hop without addresses never replies'
+
+        self.write_command('30 send-probe ip-4 203.0.113.1 ttl 3 timeout 1')
+        reply = self.parse_reply()
+        self.assertEqual(reply.command_name, 'no-reply')
+
+        # The first hop has no IPv6 address
+        self.write_command('31 send-probe ip-6 2001:db8::1 ttl 1 timeout 1')
+        reply = self.parse_reply()
+        self.assertEqual(reply.command_name, 'no-reply')
+
+        self.write_command('32 send-probe ip-6 2001:db8::1 ttl 2')
+        reply = self.parse_reply()
+        self.assertEqual(reply.argument['ip-6'], '2001:db8:1::1')
+
+    def test_multipath(self):
+        'Test that UDP flows are balanced across branches'
+
+        addresses = set()
+        for port in range(1000, 1016):
+            self.write_command(
+                '%d send-probe ip-4 203.0.113.1 ttl 2 protocol udp '
+                'port %d' % (port, port))
+            reply = self.parse_reply()
+            addresses.add(reply.argument['ip-4'])
+
+        self.assertEqual(addresses, set(['10.1.1.1', '10.1.1.2']))
+
+        # The same flow always takes the same branch
+        addresses = set()
+        for token in range(4):
+            self.write_command(
+                '%d send-probe ip-4 203.0.113.1 ttl 2 protocol udp '
+                'port 1000 local-port 2000' % token)
+            reply = self.parse_reply()
+            addresses.add(reply.argument['ip-4'])
+
+        self.assertEqual(len(addresses), 1)
+
+    def test_loss(self):
+        'Test that a lossy hop loses some probes, but not all'
+
+        for token in range(40):
+            self.write_command(
+                '%d send-probe ip-4 203.0.113.1 ttl 5 timeout 1' % token)
+
+        names = set()
+        for token in range(40):
+            reply = self.parse_reply()
+            names.add(reply.command_name)
+            if reply.command_name == 'ttl-expired':
+                self.assertGreaterEqual(
+                    int(reply.argument['round-trip-time']), 5000)
+
+        self.assertEqual(names, set(['ttl-expired', 'no-reply']))
+
+    def test_pace(self):
+        'Test that paced probes to a destination are spaced apart'
+
+        start = time.time()
+        for token in range(4):
+            self.write_command(
+                '%d send-probe ip-4 203.0.113.1 ttl 1 '
+                'pace-us 100000 pace-burst 2' % token)
+
+        for token in range(4):
+            reply = self.parse_reply()
+            self.assertEqual(reply.token, token)
+            self.assertEqual(reply.command_name, 'ttl-expired')
+
+        # Two probes are sent at once, and the others held back
+        self.assertGreaterEqual(time.time() - start, 0.2)
+
+        self.write_command('50 send-probe ip-4 203.0.113.1 pace-us -1')
+        reply = self.parse_reply()
+        self.assertEqual(reply.command_name, 'invalid-argument')
+
+    def test_command_file(self):
+        'Test commands read from a regular file, which epoll refuses'
+
+        packet_path = os.environ.get('MTR_PACKET', './mtr-packet')
+        environment = dict(os.environ)
+        environment['MTR_PACKET_SIMULATE'] = self.topology_path
+
+        with tempfile.TemporaryFile() as command_file:
+            command_file.write(b'60 send-probe ip-4 203.0.113.1 ttl 1\n')
+            command_file.seek(0)
+            output = subprocess.check_output(
+                [packet_path], stdin=command_file, env=environment)
+
+        reply = mtrpacket.MtrPacketReply(output.decode('utf-8'))
+        self.assertEqual(reply.token, 60)
+        self.assertEqual(reply.command_name, 'ttl-expired')
+        self.assertEqual(reply.argument['ip-4'], '10.1.0.1')
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,209 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 1997,1998  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_ERROR_H
+#include <error.h>
+#else
+#include "portability/error.h"
+#endif
+
+#include "addrtab.h"
+
+/*
+    Entries are allocated in chunks, which are never moved, and ids
+    are found from addresses through an open-addressing hash table of
+    ids, which is kept no more than half full.  Only the main thread
+    touches the table.
+*/
+
+/*  The entries of a chunk, which must be a power of two  */
+#define ADDR_CHUNK_SIZE 256
+
+/*  The initial size of the hash table, which must be a power of two  */
+#define ADDR_SLOTS 256
+
+static struct addr_entry **chunks;
+static int chunk_count;
+static int entry_count;
+
+static int *slots;
+static int slot_count;
+
+/*  The number of bytes of an address of a family  */
+static int addr_len(
+    int af)
+{
+#ifdef ENABLE_IPV6
+    if (af == AF_INET6)
+        return sizeof(struct in6_addr);
+#endif
+    return sizeof(struct in_addr);
+}
+
+
+/*  FNV-1a, over the bytes of the address  */
+static uint32_t addr_hash(
+    int af,
+    ip_t * ip)
+{
+    const unsigned char *bytes = (const unsigned char *) ip;
+    uint32_t hash = 2166136261u ^ (uint32_t) af;
+    int i;
+
+    for (i = 0; i < addr_len(af); i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+
+/*  Find the slot of an address, or the empty slot where it belongs  */
+static int *addr_slot(
+    int af,
+    ip_t * ip)
+{
+    struct addr_entry *entry;
+    uint32_t at = addr_hash(af, ip) & (slot_count - 1);
+
+    while (slots[at]) {
+        entry = addr_entry(slots[at]);
+        if (entry->af == af && memcmp(&entry->ip, ip, addr_len(af)) == 0)
+            break;
+        at = (at + 1) & (slot_count - 1);
+    }
+
+    return &slots[at];
+}
+
+
+/*  Double the size of the hash table, placing the ids afresh  */
+static void addr_grow_slots(
+    void)
+{
+    struct addr_entry *entry;
+    int id;
+
+    free(slots);
+    slot_count = slot_count ? 2 * slot_count : ADDR_SLOTS;
+    slots = calloc(slot_count, sizeof(int));
+    if (slots == NULL) {
+        error(EXIT_FAILURE, errno, "address table allocation failure");
+    }
+
+    for (id = 1; id < entry_count; id++) {
+        entry = addr_entry(id);
+        *addr_slot(entry->af, &entry->ip) = id;
+    }
+}
+
+
+/*  Make room for another entry, with a new chunk if need be  */
+static struct addr_entry *addr_new_entry(
+    void)
+{
+    struct addr_entry **grown;
+
+    if (entry_count == chunk_count * ADDR_CHUNK_SIZE) {
+        grown = realloc(chunks, (chunk_count + 1) * sizeof(*chunks));
+        if (grown == NULL) {
+            error(EXIT_FAILURE, errno, "address table allocation failure");
+        }
+        chunks = grown;
+        chunks[chunk_count] =
+            calloc(ADDR_CHUNK_SIZE, sizeof(struct addr_entry));
+        if (chunks[chunk_count] == NULL) {
+            error(EXIT_FAILURE, errno, "address table allocation failure");
+        }
+        chunk_count++;
+    }
+
+    return addr_entry(entry_count++);
+}
+
+
+/*  The id of an address, which is interned if it is new  */
+int addr_intern(
+    int af,
+    ip_t * ip)
+{
+    struct addr_entry *entry;
+    int *slot;
+
+    /*  The first entry is that of no address  */
+    if (entry_count == 0) {
+        addr_new_entry();
+    }
+
+    if (2 * entry_count > slot_count) {
+        addr_grow_slots();
+    }
+
+    slot = addr_slot(af, ip);
+    if (*slot) {
+        return *slot;
+    }
+
+    entry = addr_new_entry();
+    memcpy(&entry->ip, ip, addr_len(af));
+    entry->af = af;
+    if (inet_ntop(af, ip, entry->text, sizeof(entry->text)) == NULL) {
+        entry->text[0] = 0;
+    }
+    *slot = entry_count - 1;
+
+    return *slot;
+}
+
+
+/*  The entry of an id, which must have been interned  */
+struct addr_entry *addr_entry(
+    int id)
+{
+    static struct addr_entry no_address;
+
+    if (id >= entry_count) {
+        return &no_address;
+    }
+
+    return &chunks[id / ADDR_CHUNK_SIZE][id % ADDR_CHUNK_SIZE];
+}
+
+
+/*  The number of ids interned, including that of no address  */
+int addr_count(
+    void)
+{
+    return entry_count;
+}
+
+
+/*  The address of an id, as text  */
+const char *addr_text(
+    int id)
+{
+    return addr_entry(id)->text;
+}
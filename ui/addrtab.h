@@ -0,0 +1,64 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 1997,1998  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ADDRTAB_H
+#define ADDRTAB_H
+
+#include <arpa/inet.h>
+#include <time.h>
+
+#include "mtr.h"
+
+/*
+    Each address seen at a hop is interned once, for the life of the
+    process, as a small integer id, which net.c, dns.c, asn.c and the
+    displays exchange in its place.  Id 0 is no address, with a zeroed
+    entry.  Entries never move, so pointers into them remain valid.
+*/
+
+struct ipinfo;
+
+struct addr_entry {
+    ip_t ip;
+    int af;
+    char text[INET6_ADDRSTRLEN];        /* the address, formatted */
+
+    /*  The reverse lookup of the address, kept by dns.c  */
+    int dns_state;
+    time_t dns_retry;           /* when a failed lookup may be retried */
+    char *dns_name;
+
+    /*  The ipinfo of the address, kept by asn.c  */
+    struct ipinfo *ipinfo;      /* NULL until looked up */
+    int ipinfo_owned;           /* ipinfo is the entry's, not a route's */
+};
+
+extern int addr_intern(
+    int af,
+    ip_t * ip);
+
+extern struct addr_entry *addr_entry(
+    int id);
+
+extern int addr_count(
+    void);
+
+extern const char *addr_text(
+    int id);
+
+#endif
@@ -21,6 +21,7 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <sys/types.h>
 #ifdef HAVE_ERROR_H
 #include <error.h>
@@ -41,11 +42,23 @@
 #include <resolv.h>
 #include <string.h>
 #include <sys/socket.h>
-#include <search.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #include "mtr.h"
 #include "asn.h"
+#include "asndb.h"
+#include "cache.h"
 #include "utils.h"
+#include "addrtab.h"
 
 /* #define IIDEBUG */
 #ifdef IIDEBUG
@@ -55,43 +68,107 @@
 #define DEB_syslog(...) do {} while (0)
 #endif
 
-#define IIHASH_HI	128
 #define ITEMSMAX	15
 #define ITEMSEP	'|'
 #define NAMELEN	127
 #define UNKN	"???"
+#define PENDING	"..."
+
+/*  The number of resolver threads, and the most lookups outstanding  */
+#define ASN_THREADS 2
+#define ASN_QUEUE_SIZE 64
+
+/*  Seconds a report waits, with no answers, for a pending lookup  */
+#define ASN_WAIT 30
 
-static int iihash = 0;
+static int iiready = 0;
 static char fmtinfo[32];
 
 /* items width: ASN, Route, Country, Registry, Allocated */
 static const int iiwidth[] = { 7, 19, 4, 8, 11 };       /* item len + space */
 
 typedef char *items_t[ITEMSMAX + 1];
-static items_t items_a;         /* without hash: items */
-static char txtrec[NAMELEN + 1];        /* without hash: txtrec */
-static items_t *items = &items_a;
 
+/*  An answer, split into its items  */
+struct ipinfo {
+    char *txt;
+    items_t items;
+};
+
+/*  The items of a lookup which hasn't been answered yet  */
+static struct ipinfo pending = { NULL, { PENDING } };
 
-static char *ipinfo_lookup(
-    const char *domain)
+/*
+    Answers name the route which covers the address looked up, so they
+    are kept in a binary radix trie of routes, one for each address
+    family, and an address within a known route is answered from it
+    without a lookup.  The answer for each address, whether its route's
+    or its own when it names no usable route, is kept in the address's
+    entry of addrtab.c, with &pending while it is being looked up.
+*/
+struct route_node {
+    struct route_node *child[2];
+    struct ipinfo *info;        /* the answer for the route ending here */
+};
+
+static struct route_node *routes4;
+#ifdef ENABLE_IPV6
+static struct route_node *routes6;
+#endif
+
+/*  The offline database of --asn-db, mapped as mtr-asndb wrote it  */
+static const unsigned char *asndb;
+static size_t asndb_size;
+static uint32_t asndb_count4, asndb_count6, asndb_strings;
+
+/*
+    Lookups are made by resolver threads, as for names in dns.c, so
+    that a slow DNS server doesn't stall the display.  Requests and
+    answers pass through rings, and each answer is signalled with a
+    byte written to a pipe, on which the main loop waits.  Only the
+    main thread touches the trie and the table.
+*/
+struct ipinfo_request {
+    int addr_id;
+    char domain[NAMELEN];
+    char txt[NAMELEN + 1];
+    int found;
+    uint32_t ttl;
+};
+
+static struct ipinfo_request requests[ASN_QUEUE_SIZE];
+static int request_first, request_count;
+static struct ipinfo_request completed[ASN_QUEUE_SIZE];
+static int completed_first, completed_count;
+
+/*  Lookups queued and not yet acknowledged, kept by the main thread  */
+static int outstanding;
+
+static int fromii[2] = { -1, -1 };
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t ii_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ii_wake = PTHREAD_COND_INITIALIZER;
+#endif
+
+
+/*
+    Query the TXT record of a domain, which a resolver thread may do.
+    Returns 1 with the record, 0 if there is none, or -1 if the answer
+    is broken.
+*/
+static int ipinfo_query(
+    const char *domain,
+    char *txt,
+    uint32_t * ttl)
 {
     unsigned char answer[PACKETSZ], *pt;
     char host[128];
-    char *txt;
     int len, exp, size, txtlen, type;
 
-
-    if (res_init() < 0) {
-        error(0, 0, "@res_init failed");
-        return NULL;
-    }
-
     memset(answer, 0, PACKETSZ);
     if ((len = res_query(domain, C_IN, T_TXT, answer, PACKETSZ)) < 0) {
-        if (iihash)
-            DEB_syslog(LOG_INFO, "Malloc-txt: %s", UNKN);
-        return xstrdup(UNKN);
+        return 0;
     }
 
     pt = answer + sizeof(HEADER);
@@ -99,7 +176,7 @@ static char *ipinfo_lookup(
     if ((exp =
          dn_expand(answer, answer + len, pt, host, sizeof(host))) < 0) {
         printf("@dn_expand failed\n");
-        return NULL;
+        return -1;
     }
 
     pt += exp;
@@ -107,7 +184,7 @@ static char *ipinfo_lookup(
     GETSHORT(type, pt);
     if (type != T_TXT) {
         printf("@Broken DNS reply.\n");
-        return NULL;
+        return -1;
     }
 
     pt += INT16SZ;              /* class */
@@ -115,18 +192,18 @@ static char *ipinfo_lookup(
     if ((exp =
          dn_expand(answer, answer + len, pt, host, sizeof(host))) < 0) {
         printf("@second dn_expand failed\n");
-        return NULL;
+        return -1;
     }
 
     pt += exp;
     GETSHORT(type, pt);
     if (type != T_TXT) {
         printf("@Not a TXT record\n");
-        return NULL;
+        return -1;
     }
 
     pt += INT16SZ;              /* class */
-    pt += INT32SZ;              /* ttl */
+    GETLONG(*ttl, pt);
     GETSHORT(size, pt);
     txtlen = *pt;
 
@@ -134,70 +211,75 @@ static char *ipinfo_lookup(
     if (txtlen >= size || !txtlen) {
         printf("@Broken TXT record (txtlen = %d, size = %d)\n", txtlen,
                size);
-        return NULL;
+        return -1;
     }
 
     if (txtlen > NAMELEN)
         txtlen = NAMELEN;
 
-    if (iihash) {
-        txt = xmalloc(txtlen + 1);
-    } else
-        txt = (char *) txtrec;
-
     pt++;
     xstrncpy(txt, (char *) pt, txtlen + 1);
 
-    if (iihash)
-        DEB_syslog(LOG_INFO, "Malloc-txt(%p): %s", txt, txt);
-
-    return txt;
+    return 1;
 }
 
 /* originX.asn.cymru.com txtrec:    ASN | Route | Country | Registry | Allocated */
-static char *split_txtrec(
+static struct ipinfo *split_txtrec(
     struct mtr_ctl *ctl,
-    char *txt_rec)
+    const char *txt_rec)
 {
+    struct ipinfo *info;
     char *prev;
     char *next;
     int i = 0, j;
 
-    if (!txt_rec)
-        return NULL;
-    if (iihash) {
-        DEB_syslog(LOG_INFO, "Malloc-tbl: %s", txt_rec);
-        if (!(items = malloc(sizeof(*items)))) {
-            DEB_syslog(LOG_INFO, "Free-txt(%p)", txt_rec);
-            free(txt_rec);
-            return NULL;
-        }
-    }
+    info = xmalloc(sizeof(struct ipinfo));
+    info->txt = xstrdup(txt_rec);
+    DEB_syslog(LOG_INFO, "Malloc-txt(%p): %s", info->txt, info->txt);
 
-    prev = txt_rec;
+    prev = info->txt;
 
     while ((next = strchr(prev, ITEMSEP)) && (i < ITEMSMAX)) {
         *next = '\0';
         next++;
-        (*items)[i] = trim(prev, ITEMSEP);
+        info->items[i] = trim(prev, ITEMSEP);
         prev = next;
         i++;
     }
-    (*items)[i] = trim(prev, ITEMSEP);
+    info->items[i] = trim(prev, ITEMSEP);
 
     if (i < ITEMSMAX)
         i++;
     for (j = i; j <= ITEMSMAX; j++)
-        (*items)[j] = NULL;
+        info->items[j] = NULL;
 
     if (i > ctl->ipinfo_max)
         ctl->ipinfo_max = i;
-    if (ctl->ipinfo_no >= i) {
-        if (ctl->ipinfo_no >= ctl->ipinfo_max)
-            ctl->ipinfo_no = 0;
-        return (*items)[0];
-    } else
-        return (*items)[ctl->ipinfo_no];
+    if (ctl->ipinfo_no >= i && ctl->ipinfo_no >= ctl->ipinfo_max)
+        ctl->ipinfo_no = 0;
+
+    return info;
+}
+
+static void free_ipinfo(
+    struct ipinfo *info)
+{
+    free(info->txt);
+    free(info);
+}
+
+/*  The item of an answer to be shown  */
+static char *ipinfo_item(
+    struct mtr_ctl *ctl,
+    struct ipinfo *info)
+{
+    char *val;
+
+    if (ctl->ipinfo_no < 0 || ctl->ipinfo_no > ITEMSMAX
+        || !(val = info->items[ctl->ipinfo_no]))
+        val = info->items[0];
+
+    return val;
 }
 
 #ifdef ENABLE_IPV6
@@ -217,65 +299,483 @@ static void reverse_host6(
 }
 #endif
 
-static char *get_ipinfo(
-    struct mtr_ctl *ctl,
+/*  The root of the trie of routes of an address family, and its bits  */
+static struct route_node **route_root(
+    int af,
+    int *bits)
+{
+#ifdef ENABLE_IPV6
+    if (af == AF_INET6) {
+        *bits = 128;
+        return &routes6;
+    }
+#endif
+    *bits = 32;
+    return &routes4;
+}
+
+static int addr_bit(
+    const unsigned char *bytes,
+    int bit)
+{
+    return (bytes[bit / 8] >> (7 - bit % 8)) & 1;
+}
+
+/*  The answer for the longest route which covers an address  */
+static struct ipinfo *route_find(
+    int af,
     ip_t * addr)
 {
-    char key[NAMELEN];
-    char lookup_key[NAMELEN];
-    char *val = NULL;
-    ENTRY item;
+    const unsigned char *bytes = (const unsigned char *) addr;
+    struct route_node *node;
+    struct ipinfo *found = NULL;
+    int bits, bit;
+
+    node = *route_root(af, &bits);
+    for (bit = 0; node; bit++) {
+        if (node->info)
+            found = node->info;
+        if (bit == bits)
+            break;
+        node = node->child[addr_bit(bytes, bit)];
+    }
+
+    return found;
+}
 
-    if (!addr)
+/*
+    Add the route named by an answer, if it covers the address looked
+    up.  Returns the answer kept for the route, which is an earlier one
+    if the route was known already, or NULL if it names no usable route.
+*/
+static struct ipinfo *route_add(
+    int af,
+    ip_t * addr,
+    struct ipinfo *info)
+{
+    char prefix[NAMELEN];
+    unsigned char route[sizeof(ip_t)];
+    const unsigned char *bytes = (const unsigned char *) addr;
+    struct route_node **node;
+    char *slash, *end;
+    long len;
+    int bits, bit;
+
+    if (!info->items[1])
         return NULL;
+    xstrncpy(prefix, info->items[1], sizeof(prefix));
+    if (!(slash = strchr(prefix, '/')))
+        return NULL;
+    *slash = 0;
 
-    if (ctl->af == AF_INET6) {
+    node = route_root(af, &bits);
+    len = strtol(slash + 1, &end, 10);
+    if (*end || end == slash + 1 || len < 0 || len > bits
+        || inet_pton(af, prefix, route) != 1)
+        return NULL;
+
+    /*  A route which doesn't cover the address can't be trusted  */
+    for (bit = 0; bit < len; bit++) {
+        if (addr_bit(route, bit) != addr_bit(bytes, bit))
+            return NULL;
+    }
+
+    for (bit = 0;; bit++) {
+        if (!*node) {
+            *node = xmalloc(sizeof(struct route_node));
+            memset(*node, 0, sizeof(struct route_node));
+        }
+        if (bit == len)
+            break;
+        node = &(*node)->child[addr_bit(route, bit)];
+    }
+
+    if (!(*node)->info)
+        (*node)->info = info;
+    return (*node)->info;
+}
+
+static void free_routes(
+    struct route_node *node)
+{
+    if (!node)
+        return;
+    free_routes(node->child[0]);
+    free_routes(node->child[1]);
+    if (node->info)
+        free_ipinfo(node->info);
+    free(node);
+}
+
+
+/*  The key of an address, and the domain to look it up  */
+static int ipinfo_keys(
+    struct addr_entry *entry,
+    char *key,
+    char *lookup_key)
+{
+    if (entry->af == AF_INET6) {
 #ifdef ENABLE_IPV6
-        reverse_host6(addr, key, NAMELEN);
+        reverse_host6(&entry->ip, key, NAMELEN);
         if (snprintf(lookup_key, NAMELEN, "%s.origin6.asn.cymru.com", key)
             >= NAMELEN)
-            return NULL;
+            return -1;
 #else
-        return NULL;
+        return -1;
 #endif
     } else {
         unsigned char buff[4];
-        memcpy(buff, addr, 4);
+        memcpy(buff, &entry->ip, 4);
         if (snprintf
             (key, NAMELEN, "%d.%d.%d.%d", buff[3], buff[2], buff[1],
              buff[0]) >= NAMELEN)
-            return NULL;
+            return -1;
         if (snprintf(lookup_key, NAMELEN, "%s.origin.asn.cymru.com", key)
             >= NAMELEN)
-            return NULL;
+            return -1;
     }
 
-    if (iihash) {
-        ENTRY *found_item;
+    return 0;
+}
+
+
+static uint32_t asndb_get32(
+    const unsigned char *at)
+{
+    uint32_t value;
+
+    memcpy(&value, at, sizeof(value));
+    return ntohl(value);
+}
 
-        DEB_syslog(LOG_INFO, ">> Search: %s", key);
-        item.key = key;;
-        if ((found_item = hsearch(item, FIND))) {
-            if (!(val = (*((items_t *) found_item->data))[ctl->ipinfo_no]))
-                val = (*((items_t *) found_item->data))[0];
-            DEB_syslog(LOG_INFO, "Found (hashed): %s", val);
+/*  Map the database of --asn-db, checking that it's whole  */
+static void asndb_open(
+    const char *filename)
+{
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+    struct stat st;
+    void *map;
+    int fd;
+    uint64_t expected;
+
+    if ((fd = open(filename, O_RDONLY)) == -1 || fstat(fd, &st)) {
+        error(EXIT_FAILURE, errno, "%s", filename);
+    }
+    if ((size_t) st.st_size < ASNDB_HEADER_SIZE) {
+        error(EXIT_FAILURE, 0, "%s: not an ASN database", filename);
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        error(EXIT_FAILURE, errno, "%s", filename);
+    }
+    close(fd);
+
+    asndb = map;
+    asndb_size = st.st_size;
+    asndb_count4 = asndb_get32(asndb + 12);
+    asndb_count6 = asndb_get32(asndb + 16);
+    asndb_strings = asndb_get32(asndb + 20);
+
+    expected = ASNDB_HEADER_SIZE
+        + (uint64_t) asndb_count4 * ASNDB_RANGE4_SIZE
+        + (uint64_t) asndb_count6 * ASNDB_RANGE6_SIZE + asndb_strings;
+    if (memcmp(asndb, ASNDB_MAGIC, 8)
+        || asndb_get32(asndb + 8) != ASNDB_VERSION
+        || expected != (uint64_t) asndb_size
+        || (asndb_strings && asndb[asndb_size - 1] != 0)) {
+        error(EXIT_FAILURE, 0, "%s: not an ASN database", filename);
+    }
+#else
+    error(EXIT_FAILURE, 0, "%s: an ASN database is not supported here",
+          filename);
+#endif
+}
+
+/*
+    Find the record of an address in the database, by binary search
+    of the ranges of its family.  Returns NULL if no range holds it.
+*/
+static const char *asndb_find(
+    int af,
+    ip_t * addr)
+{
+    const unsigned char *ranges = asndb + ASNDB_HEADER_SIZE;
+    size_t bytes = 4, size = ASNDB_RANGE4_SIZE;
+    size_t low = 0, high = asndb_count4, mid;
+    const unsigned char *range;
+    uint32_t record;
+
+#ifdef ENABLE_IPV6
+    if (af == AF_INET6) {
+        ranges += (size_t) asndb_count4 * ASNDB_RANGE4_SIZE;
+        bytes = 16;
+        size = ASNDB_RANGE6_SIZE;
+        high = asndb_count6;
+    }
+#endif
+
+    /*  Find the last range which starts no later than the address  */
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (memcmp(ranges + mid * size, addr, bytes) <= 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if (low == 0)
+        return NULL;
+
+    range = ranges + (low - 1) * size;
+    if (memcmp(range + bytes, addr, bytes) < 0)
+        return NULL;
+
+    record = asndb_get32(range + 2 * bytes);
+    if (record >= asndb_strings)
+        return NULL;
+    return (const char *) asndb + asndb_size - asndb_strings + record;
+}
+
+
+/*  Record the answer for an address, from a resolver thread or cache  */
+static void ipinfo_answer(
+    struct mtr_ctl *ctl,
+    int addr_id,
+    const char *txt)
+{
+    struct addr_entry *entry = addr_entry(addr_id);
+    struct ipinfo *info, *route;
+
+    info = split_txtrec(ctl, txt);
+    if (entry->ipinfo_owned)
+        free_ipinfo(entry->ipinfo);
+
+    if ((route = route_add(entry->af, &entry->ip, info))) {
+        /*  The route keeps the answer, or an earlier one for it  */
+        if (route != info)
+            free_ipinfo(info);
+        entry->ipinfo = route;
+        entry->ipinfo_owned = 0;
+    } else {
+        entry->ipinfo = info;
+        entry->ipinfo_owned = 1;
+    }
+    DEB_syslog(LOG_INFO, "Insert into table: %s", entry->text);
+}
+
+
+#ifdef HAVE_PTHREAD
+
+static void *ipinfo_thread(
+    void *arg ATTRIBUTE_UNUSED)
+{
+    struct ipinfo_request request;
+    char wake = 0;
+
+    /*  Each thread has resolver state of its own  */
+    if (res_init() < 0) {
+        error(0, 0, "@res_init failed");
+    }
+
+    while (1) {
+        pthread_mutex_lock(&ii_lock);
+        while (request_count == 0)
+            pthread_cond_wait(&ii_wake, &ii_lock);
+        request = requests[request_first];
+        request_first = (request_first + 1) % ASN_QUEUE_SIZE;
+        request_count--;
+        pthread_mutex_unlock(&ii_lock);
+
+        request.found = ipinfo_query(request.domain, request.txt,
+                                     &request.ttl);
+
+        pthread_mutex_lock(&ii_lock);
+        completed[(completed_first + completed_count) % ASN_QUEUE_SIZE] =
+            request;
+        completed_count++;
+        pthread_mutex_unlock(&ii_lock);
+
+        /*  A full pipe is already readable, so a failed write is fine  */
+        if (write(fromii[1], &wake, 1) == -1 && errno != EAGAIN)
+            error(0, errno, "ipinfo result notification");
+    }
+
+    return NULL;
+}
+
+
+/*  Start the resolver threads, the first time a lookup is queued  */
+static void ipinfo_start(
+    void)
+{
+    static int started;
+    pthread_t thread;
+    sigset_t signals, oldsignals;
+    int i;
+
+    if (started)
+        return;
+    started = 1;
+
+    /*  Signals, such as SIGWINCH, are left to the main thread  */
+    sigfillset(&signals);
+    pthread_sigmask(SIG_SETMASK, &signals, &oldsignals);
+    for (i = 0; i < ASN_THREADS; i++) {
+        if (pthread_create(&thread, NULL, ipinfo_thread, NULL)) {
+            error(EXIT_FAILURE, errno, "can't start ipinfo thread");
         }
+        pthread_detach(thread);
     }
+    pthread_sigmask(SIG_SETMASK, &oldsignals, NULL);
+}
+
+#else
+
+/*  Initialize the resolver for lookups in line, once only  */
+static int ipinfo_res_init(
+    void)
+{
+    static int res_ready;
 
-    if (!val) {
-        DEB_syslog(LOG_INFO, "Lookup: %s", key);
-        if ((val = split_txtrec(ctl, ipinfo_lookup(lookup_key)))) {
-            DEB_syslog(LOG_INFO, "Looked up: %s", key);
-            if (iihash)
-                if ((item.key = xstrdup(key))) {
-                    item.data = (void *) items;
-                    hsearch(item, ENTER);
-                    DEB_syslog(LOG_INFO, "Insert into hash: %s", key);
-                }
+    if (!res_ready) {
+        if (res_init() < 0) {
+            error(0, 0, "@res_init failed");
+            return -1;
         }
+        res_ready = 1;
     }
 
-    return val;
+    return 0;
+}
+
+#endif
+
+
+/*
+    Queue a lookup of an address, entering it in the table as pending.
+    Returns 0, or -1 if the queue is full.
+*/
+static int ipinfo_queue(
+    struct mtr_ctl *ctl,
+    int addr_id,
+    const char *lookup_key)
+{
+    struct addr_entry *entry = addr_entry(addr_id);
+    char txt[NAMELEN + 1];
+    struct ipinfo_request *request;
+    const char *record;
+#ifndef HAVE_PTHREAD
+    char wake = 0;
+#endif
+
+    /*  With --asn-db, the database is all we consult  */
+    if (asndb) {
+        record = asndb_find(entry->af, &entry->ip);
+        ipinfo_answer(ctl, addr_id, record ? record : UNKN);
+        return 0;
+    }
+
+    /*  Another run may have looked it up, with --cache  */
+    if (cache_find(CACHE_IPINFO, lookup_key, txt, sizeof(txt))) {
+        ipinfo_answer(ctl, addr_id, txt);
+        return 0;
+    }
+
+    if (outstanding >= ASN_QUEUE_SIZE)
+        return -1;
+
+    entry->ipinfo = &pending;
+    entry->ipinfo_owned = 0;
+    DEB_syslog(LOG_INFO, "Lookup: %s", entry->text);
+    outstanding++;
+
+#ifdef HAVE_PTHREAD
+    ipinfo_start();
+    pthread_mutex_lock(&ii_lock);
+#endif
+    request = &requests[(request_first + request_count) % ASN_QUEUE_SIZE];
+    memset(request, 0, sizeof(struct ipinfo_request));
+    request->addr_id = addr_id;
+    xstrncpy(request->domain, lookup_key, sizeof(request->domain));
+#ifdef HAVE_PTHREAD
+    request_count++;
+    pthread_cond_signal(&ii_wake);
+    pthread_mutex_unlock(&ii_lock);
+#else
+    /*  Without threads, we have no choice but to look up in line  */
+    if (ipinfo_res_init() == 0)
+        request->found = ipinfo_query(request->domain, request->txt,
+                                      &request->ttl);
+    completed[(completed_first + completed_count) % ASN_QUEUE_SIZE] =
+        *request;
+    completed_count++;
+    if (write(fromii[1], &wake, 1) == -1 && errno != EAGAIN)
+        error(0, errno, "ipinfo result notification");
+#endif
+
+    return 0;
+}
+
+
+/*
+    Wait for a pending lookup, for reports, which are printed once and
+    so can't show a record as pending.
+*/
+static void ipinfo_wait(
+    struct mtr_ctl *ctl,
+    int addr_id)
+{
+    struct addr_entry *entry = addr_entry(addr_id);
+    struct pollfd pfd;
+    int waited = 0;
+
+    pfd.fd = fromii[0];
+    pfd.events = POLLIN;
+    while (entry->ipinfo == &pending && waited < ASN_WAIT) {
+        if (poll(&pfd, 1, 1000) == 0)
+            waited++;
+        asn_ack(ctl);
+    }
+}
+
+
+static char *get_ipinfo(
+    struct mtr_ctl *ctl,
+    int addr_id)
+{
+    char key[NAMELEN];
+    char lookup_key[NAMELEN];
+    struct addr_entry *entry;
+    struct ipinfo *info;
+
+    if (!addr_id || !iiready)
+        return NULL;
+
+    /*  Each address keeps its answer, once it has one  */
+    entry = addr_entry(addr_id);
+    if (entry->ipinfo && entry->ipinfo != &pending)
+        return ipinfo_item(ctl, entry->ipinfo);
+
+    if ((info = route_find(entry->af, &entry->ip))) {
+        DEB_syslog(LOG_INFO, "Found (routed)");
+        entry->ipinfo = info;
+        entry->ipinfo_owned = 0;
+        return ipinfo_item(ctl, info);
+    }
+
+    if (ipinfo_keys(entry, key, lookup_key))
+        return NULL;
+
+    DEB_syslog(LOG_INFO, ">> Search: %s", key);
+    if (!entry->ipinfo && ipinfo_queue(ctl, addr_id, lookup_key))
+        return PENDING;
+
+    if (!ctl->Interactive)
+        ipinfo_wait(ctl, addr_id);
+
+    if (entry->ipinfo)
+        return ipinfo_item(ctl, entry->ipinfo);
+
+    return NULL;
 }
 
 ATTRIBUTE_CONST size_t get_iiwidth_len(
@@ -296,9 +796,9 @@ ATTRIBUTE_CONST int get_iiwidth(
 
 char *fmt_ipinfo(
     struct mtr_ctl *ctl,
-    ip_t * addr)
+    int addr_id)
 {
-    char *ipinfo = get_ipinfo(ctl, addr);
+    char *ipinfo = get_ipinfo(ctl, addr_id);
     char fmt[8];
     snprintf(fmt, sizeof(fmt), "%s%%-%ds", ctl->ipinfo_no ? "" : "AS",
              get_iiwidth(ctl->ipinfo_no));
@@ -315,19 +815,103 @@ int is_printii(
 void asn_open(
     struct mtr_ctl *ctl)
 {
-    if (ctl->ipinfo_no >= 0) {
-        DEB_syslog(LOG_INFO, "hcreate(%d)", IIHASH_HI);
-        if (!(iihash = hcreate(IIHASH_HI)))
-            error(0, errno, "ipinfo hash");
+    int i;
+
+    if (ctl->asn_db && !asndb)
+        asndb_open(ctl->asn_db);
+
+    if (fromii[0] == -1) {
+        if (pipe(fromii) < 0) {
+            error(EXIT_FAILURE, errno, "can't make a pipe for ipinfo");
+        }
+        for (i = 0; i < 2; i++) {
+            fcntl(fromii[i], F_SETFL,
+                  fcntl(fromii[i], F_GETFL, 0) | O_NONBLOCK);
+            fcntl(fromii[i], F_SETFD, FD_CLOEXEC);
+        }
     }
+
+    /*  Lookups are ready even without -y, which may be chosen later  */
+    iiready = 1;
 }
 
 void asn_close(
+    struct mtr_ctl *ctl ATTRIBUTE_UNUSED)
+{
+    struct addr_entry *entry;
+    int id;
+
+    if (iiready) {
+        /*  Answers are forgotten before the routes which hold them  */
+        for (id = 1; id < addr_count(); id++) {
+            entry = addr_entry(id);
+            if (entry->ipinfo_owned)
+                free_ipinfo(entry->ipinfo);
+            entry->ipinfo = NULL;
+            entry->ipinfo_owned = 0;
+        }
+        free_routes(routes4);
+        routes4 = NULL;
+#ifdef ENABLE_IPV6
+        free_routes(routes6);
+        routes6 = NULL;
+#endif
+        iiready = 0;
+    }
+}
+
+int asn_waitfd(
+    void)
+{
+    return fromii[0];
+}
+
+/*  Record the lookups which have been answered  */
+void asn_ack(
     struct mtr_ctl *ctl)
 {
-    if ((ctl->ipinfo_no >= 0) && iihash) {
-        DEB_syslog(LOG_INFO, "hdestroy()");
-        hdestroy();
-        iihash = 0;
+    char buf[256];
+    struct ipinfo_request *request;
+
+    while (read(fromii[0], buf, sizeof(buf)) > 0);
+
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&ii_lock);
+#endif
+    while (completed_count) {
+        request = &completed[completed_first];
+        completed_first = (completed_first + 1) % ASN_QUEUE_SIZE;
+        completed_count--;
+        outstanding--;
+
+        if (!iiready)
+            continue;
+        if (request->found == 1) {
+            cache_store(CACHE_IPINFO, request->domain, request->txt,
+                        request->ttl);
+            ipinfo_answer(ctl, request->addr_id, request->txt);
+        } else {
+            ipinfo_answer(ctl, request->addr_id, UNKN);
+        }
     }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&ii_lock);
+#endif
+}
+
+/*  Queue a lookup for an address as it is first seen at a hop  */
+void asn_prefetch(
+    struct mtr_ctl *ctl,
+    int addr_id)
+{
+    char key[NAMELEN];
+    char lookup_key[NAMELEN];
+    struct addr_entry *entry = addr_entry(addr_id);
+
+    if (!iiready || !addr_id || ctl->ipinfo_no < 0 || entry->ipinfo
+        || route_find(entry->af, &entry->ip)
+        || ipinfo_keys(entry, key, lookup_key))
+        return;
+
+    ipinfo_queue(ctl, addr_id, lookup_key);
 }
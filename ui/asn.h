@@ -22,9 +22,16 @@ extern void asn_open(
     struct mtr_ctl *ctl);
 extern void asn_close(
     struct mtr_ctl *ctl);
+extern int asn_waitfd(
+    void);
+extern void asn_ack(
+    struct mtr_ctl *ctl);
+extern void asn_prefetch(
+    struct mtr_ctl *ctl,
+    int addr_id);
 extern char *fmt_ipinfo(
     struct mtr_ctl *ctl,
-    ip_t * addr);
+    int addr_id);
 extern ATTRIBUTE_CONST size_t get_iiwidth_len(
     void);
 extern ATTRIBUTE_CONST int get_iiwidth(
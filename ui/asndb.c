@@ -0,0 +1,452 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+    mtr-asndb compiles a list of routes into the database read by
+    mtr --asn-db.  Each line of input is either
+
+        ASN | PREFIX | COUNTRY | REGISTRY | ALLOCATED
+
+    as in the TXT records of origin.asn.cymru.com, or the
+
+        ADDRESS LENGTH ASN
+
+    of a prefix-to-AS dump, such as those of RouteViews.  Lines which
+    are empty, or start with '#', are ignored.
+
+    Where routes overlap, as when a more specific route is announced
+    within a larger one, the more specific route wins for the addresses
+    it covers, and the larger is split around it.
+*/
+
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifdef HAVE_ERROR_H
+#include <error.h>
+#else
+#include "portability/error.h"
+#endif
+
+#include "asndb.h"
+#include "utils.h"
+
+/*  Routes may be nested no deeper than there are prefix lengths  */
+#define MAX_NESTING 129
+
+/*  A route, with the range of addresses it covers  */
+struct route {
+    unsigned char first[16];
+    unsigned char last[16];
+    int length;
+    uint32_t record;
+};
+
+/*  The routes of an address family, and the ranges they flatten to  */
+struct family {
+    int af;
+    int bytes;
+    struct route *routes;
+    size_t route_count;
+    size_t route_max;
+    struct route *ranges;
+    size_t range_count;
+    size_t range_max;
+};
+
+static struct family family4 = { .af = AF_INET, .bytes = 4 };
+static struct family family6 = { .af = AF_INET6, .bytes = 16 };
+
+/*  The text of the records, NUL terminated  */
+static char *strings;
+static size_t strings_size;
+static size_t strings_max;
+
+/*  The family being sorted, for compare_routes  */
+static int sort_bytes;
+
+
+static void *grow(
+    void *array,
+    size_t * max,
+    size_t size)
+{
+    *max = *max ? 2 * *max : 1024;
+    array = realloc(array, *max * size);
+    if (array == NULL) {
+        error(EXIT_FAILURE, errno, "allocation failure");
+    }
+
+    return array;
+}
+
+
+static uint32_t add_record(
+    const char *text)
+{
+    size_t len = strlen(text) + 1;
+    uint32_t offset = strings_size;
+
+    while (strings_size + len > strings_max) {
+        strings = grow(strings, &strings_max, 1);
+    }
+    memcpy(strings + strings_size, text, len);
+    strings_size += len;
+
+    return offset;
+}
+
+
+/*  Parse "ADDRESS/LENGTH" or an address and length into a route  */
+static int parse_prefix(
+    const char *address,
+    const char *length,
+    struct family **family,
+    struct route *route)
+{
+    char text[INET6_ADDRSTRLEN + 4];
+    char *slash, *end;
+    long len;
+    int bit;
+
+    xstrncpy(text, address, sizeof(text));
+    if (!length) {
+        if (!(slash = strchr(text, '/')))
+            return -1;
+        *slash = 0;
+        length = slash + 1;
+    }
+
+    *family = strchr(text, ':') ? &family6 : &family4;
+    memset(route, 0, sizeof(struct route));
+    if (inet_pton((*family)->af, text, route->first) != 1)
+        return -1;
+
+    len = strtol(length, &end, 10);
+    if (*end || end == length || len < 0 || len > 8 * (*family)->bytes)
+        return -1;
+    route->length = len;
+
+    /*  Clear the host bits of first, and set those of last  */
+    for (bit = len; bit < 8 * (*family)->bytes; bit++) {
+        route->first[bit / 8] &= ~(0x80 >> (bit % 8));
+    }
+    memcpy(route->last, route->first, sizeof(route->last));
+    for (bit = len; bit < 8 * (*family)->bytes; bit++) {
+        route->last[bit / 8] |= 0x80 >> (bit % 8);
+    }
+
+    return 0;
+}
+
+
+static void add_route(
+    struct family *family,
+    struct route *route)
+{
+    if (family->route_count == family->route_max) {
+        family->routes = grow(family->routes, &family->route_max,
+                              sizeof(struct route));
+    }
+    family->routes[family->route_count++] = *route;
+}
+
+
+/*  Parse a line of input, adding its route.  Returns 0 if well formed  */
+static int parse_line(
+    char *line)
+{
+    char record[1024];
+    char *field[5];
+    char *at;
+    struct family *family;
+    struct route route;
+    int count = 0;
+
+    line = trim(line, 0);
+    if (!*line || *line == '#')
+        return 0;
+
+    if (strchr(line, '|')) {
+        xstrncpy(record, line, sizeof(record));
+        for (at = line; count < 2; count++) {
+            field[count] = at;
+            if (!(at = strchr(at, '|')))
+                break;
+            *at++ = 0;
+        }
+        if (count < 1
+            || parse_prefix(trim(field[1], 0), NULL, &family, &route))
+            return -1;
+    } else {
+        for (at = strtok(line, " \t"); at && count < 5;
+             at = strtok(NULL, " \t"))
+            field[count++] = at;
+
+        if (count == 3) {
+            if (parse_prefix(field[0], field[1], &family, &route))
+                return -1;
+            snprintf(record, sizeof(record), "%s | %s/%s |  |  | ",
+                     field[2], field[0], field[1]);
+        } else if (count == 2) {
+            if (parse_prefix(field[0], NULL, &family, &route))
+                return -1;
+            snprintf(record, sizeof(record), "%s | %s |  |  | ", field[1],
+                     field[0]);
+        } else {
+            return -1;
+        }
+    }
+
+    route.record = add_record(record);
+    add_route(family, &route);
+
+    return 0;
+}
+
+
+/*  Order routes by their first address, and larger routes first  */
+static int compare_routes(
+    const void *a,
+    const void *b)
+{
+    const struct route *ra = a;
+    const struct route *rb = b;
+    int order = memcmp(ra->first, rb->first, sort_bytes);
+
+    if (order)
+        return order;
+    return ra->length - rb->length;
+}
+
+
+/*  Step an address by one, returning 0 if it wrapped  */
+static int step(
+    unsigned char *address,
+    int bytes,
+    int by)
+{
+    int i;
+
+    for (i = bytes - 1; i >= 0; i--) {
+        address[i] += by;
+        if (address[i] != (by > 0 ? 0x00 : 0xff))
+            return 1;
+    }
+
+    return 0;
+}
+
+
+/*  Add the range of a route from first up to some last address  */
+static void add_range(
+    struct family *family,
+    const unsigned char *first,
+    const unsigned char *last,
+    uint32_t record)
+{
+    struct route *range;
+
+    if (memcmp(first, last, family->bytes) > 0)
+        return;
+
+    if (family->range_count == family->range_max) {
+        family->ranges = grow(family->ranges, &family->range_max,
+                              sizeof(struct route));
+    }
+    range = &family->ranges[family->range_count++];
+    memcpy(range->first, first, family->bytes);
+    memcpy(range->last, last, family->bytes);
+    range->record = record;
+}
+
+
+/*
+    Flatten the routes to ranges which don't overlap.  Routes are
+    taken in order, with a stack of the routes enclosing each, and
+    the addresses between a route and those it encloses are given to
+    the innermost route covering them.
+*/
+static void flatten(
+    struct family *family)
+{
+    struct route *stack[MAX_NESTING];
+    struct route *route, *top;
+    unsigned char cursor[16], before[16];
+    int depth = 0;
+    int more = 1;
+    size_t i;
+
+    sort_bytes = family->bytes;
+    qsort(family->routes, family->route_count, sizeof(struct route),
+          compare_routes);
+
+    memset(cursor, 0, sizeof(cursor));
+    for (i = 0; i <= family->route_count; i++) {
+        route = i < family->route_count ? &family->routes[i] : NULL;
+
+        /*  Close the routes which end before this one starts  */
+        while (depth) {
+            top = stack[depth - 1];
+            if (route && memcmp(top->last, route->first, family->bytes) >= 0)
+                break;
+            if (more)
+                add_range(family, cursor, top->last, top->record);
+            memcpy(cursor, top->last, family->bytes);
+            more = step(cursor, family->bytes, 1);
+            depth--;
+        }
+        if (!route)
+            break;
+
+        /*  The enclosing route covers the addresses up to this one  */
+        if (depth && more) {
+            memcpy(before, route->first, family->bytes);
+            if (step(before, family->bytes, -1))
+                add_range(family, cursor, before, stack[depth - 1]->record);
+        }
+
+        memcpy(cursor, route->first, family->bytes);
+        more = 1;
+        if (depth == MAX_NESTING) {
+            error(EXIT_FAILURE, 0, "routes nested too deeply");
+        }
+        stack[depth++] = route;
+    }
+}
+
+
+static void put32(
+    FILE * out,
+    uint32_t value)
+{
+    value = htonl(value);
+    fwrite(&value, sizeof(value), 1, out);
+}
+
+
+static void write_ranges(
+    FILE * out,
+    struct family *family)
+{
+    size_t i;
+
+    for (i = 0; i < family->range_count; i++) {
+        fwrite(family->ranges[i].first, family->bytes, 1, out);
+        fwrite(family->ranges[i].last, family->bytes, 1, out);
+        put32(out, family->ranges[i].record);
+    }
+}
+
+
+static void __attribute__ ((__noreturn__)) usage(FILE * out)
+{
+    fputs("\nUsage:\n", out);
+    fputs(" mtr-asndb DATABASE [FILE...]\n", out);
+    fputs("\n", out);
+    fputs(" Compile the routes in FILE, or standard input, into DATABASE\n",
+          out);
+    fputs(" for mtr --asn-db.  Lines are either\n", out);
+    fputs("   ASN | PREFIX | COUNTRY | REGISTRY | ALLOCATED\n", out);
+    fputs(" or\n", out);
+    fputs("   ADDRESS LENGTH ASN\n", out);
+    fputs("\n", out);
+    exit(out == stderr ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+
+int main(
+    int argc,
+    char **argv)
+{
+    char line[4096];
+    char *tmpname;
+    const char *source;
+    FILE *in, *out;
+    unsigned long lineno;
+    int i;
+
+    if (argc < 2)
+        usage(stderr);
+    if (!strcmp(argv[1], "-h") || !strcmp(argv[1], "--help"))
+        usage(stdout);
+
+    for (i = 2; i < argc || i == 2; i++) {
+        if (i < argc) {
+            source = argv[i];
+            if (!(in = fopen(source, "r"))) {
+                error(EXIT_FAILURE, errno, "%s", source);
+            }
+        } else {
+            source = "standard input";
+            in = stdin;
+        }
+
+        for (lineno = 1; fgets(line, sizeof(line), in); lineno++) {
+            if (parse_line(line)) {
+                error(0, 0, "%s:%lu: ignoring malformed line", source,
+                      lineno);
+            }
+        }
+        if (ferror(in)) {
+            error(EXIT_FAILURE, errno, "%s", source);
+        }
+        if (in != stdin)
+            fclose(in);
+    }
+
+    flatten(&family4);
+    flatten(&family6);
+
+    tmpname = xmalloc(strlen(argv[1]) + 5);
+    sprintf(tmpname, "%s.tmp", argv[1]);
+    if (!(out = fopen(tmpname, "wb"))) {
+        error(EXIT_FAILURE, errno, "%s", tmpname);
+    }
+
+    fwrite(ASNDB_MAGIC, 8, 1, out);
+    put32(out, ASNDB_VERSION);
+    put32(out, family4.range_count);
+    put32(out, family6.range_count);
+    put32(out, strings_size);
+    write_ranges(out, &family4);
+    write_ranges(out, &family6);
+    if (strings_size)
+        fwrite(strings, strings_size, 1, out);
+
+    if (fclose(out) || rename(tmpname, argv[1])) {
+        unlink(tmpname);
+        error(EXIT_FAILURE, errno, "%s", argv[1]);
+    }
+
+    printf("%lu IPv4 and %lu IPv6 ranges, from %lu routes\n",
+           (unsigned long) family4.range_count,
+           (unsigned long) family6.range_count,
+           (unsigned long) (family4.route_count + family6.route_count));
+
+    return EXIT_SUCCESS;
+}
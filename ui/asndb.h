@@ -0,0 +1,57 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ASNDB_H
+#define ASNDB_H
+
+/*
+    The offline ipinfo database read by --asn-db, and written by
+    mtr-asndb.  It is mapped into memory and searched in place, so
+    every field is laid out byte by byte, with integers in network
+    byte order.
+
+    The file starts with a header:
+
+        magic      8 bytes, ASNDB_MAGIC
+        version    4 bytes, ASNDB_VERSION
+        count4     4 bytes, the number of IPv4 ranges
+        count6     4 bytes, the number of IPv6 ranges
+        strings    4 bytes, the size of the record text
+
+    which is followed by the IPv4 ranges, the IPv6 ranges, and the
+    record text.  A range is
+
+        first      the first address, 4 or 16 bytes
+        last       the last address, 4 or 16 bytes
+        record     4 bytes, the offset of its record in the text
+
+    Ranges of each family are sorted, and don't overlap, so that an
+    address is found by binary search.  Records are NUL terminated, and
+    are laid out as an origin.asn.cymru.com TXT record:
+
+        ASN | Route | Country | Registry | Allocated
+*/
+
+#define ASNDB_MAGIC "MTRASNDB"
+#define ASNDB_VERSION 1
+
+#define ASNDB_HEADER_SIZE 24
+#define ASNDB_RANGE4_SIZE (4 + 4 + 4)
+#define ASNDB_RANGE6_SIZE (16 + 16 + 4)
+
+#endif
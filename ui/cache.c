@@ -0,0 +1,507 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_SYS_FILE_H
+#include <sys/file.h>
+#endif
+#ifdef HAVE_ERROR_H
+#include <error.h>
+#else
+#include "portability/error.h"
+#endif
+
+#include "mtr.h"
+#include "cache.h"
+#include "utils.h"
+
+/*
+    A cache of names and ipinfo records, kept in a file so that they
+    outlive a run of mtr and are shared by the runs which follow.
+
+    The file is a log of text records, one per line:
+
+        EXPIRES KIND KEY VALUE
+
+    where EXPIRES is when the record lapses, in seconds since the epoch,
+    KIND is CACHE_NAME or CACHE_IPINFO, KEY is an address or domain, and
+    VALUE runs to the end of the line.  An empty VALUE records a failed
+    lookup.  Later records replace earlier ones with the same key.
+
+    Records are only ever appended, each with a single write() to a
+    descriptor opened with O_APPEND, so that many mtr processes may add
+    to the file at once.  Each maps the file to read it, and indexes the
+    records in place, mapping it again as it grows.  A record appended
+    part way is ignored until its newline is written.
+
+    When the file has grown large with lapsed records, it is compacted
+    into a new file, which is renamed into place under an exclusive
+    lock.  Writers take a shared lock, and move to the new file if the
+    one they have open has been replaced.
+*/
+
+/*  The size beyond which a file with mostly lapsed records is compacted  */
+#define CACHE_COMPACT_SIZE (1024 * 1024)
+
+/*  The longest record we write  */
+#define CACHE_RECORD_MAX 512
+
+/*  A record, within the mapped file  */
+struct cache_record {
+    const char *key;
+    const char *value;
+    int key_len;
+    int value_len;
+    int kind;
+    time_t expires;
+};
+
+static const char *cache_filename;
+static int cache_fd = -1;
+static char *cache_map;
+static size_t cache_map_size;
+
+/*  An open-addressing index over the mapped records  */
+static struct cache_record *cache_index;
+static size_t cache_slots;
+static size_t cache_records;
+static size_t cache_live;
+
+/*  The last time the file was checked for records from others  */
+static time_t cache_checked;
+
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+
+/*  FNV-1a, over the kind and key of a record  */
+static uint32_t cache_hash(
+    int kind,
+    const char *key,
+    int key_len)
+{
+    uint32_t hash = 2166136261u ^ (uint32_t) kind;
+    int i;
+
+    for (i = 0; i < key_len; i++) {
+        hash ^= (unsigned char) key[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+
+/*  Find the slot of a key, or the empty slot where it belongs  */
+static struct cache_record *cache_slot(
+    int kind,
+    const char *key,
+    int key_len)
+{
+    struct cache_record *record;
+    size_t at = cache_hash(kind, key, key_len) & (cache_slots - 1);
+
+    while (1) {
+        record = &cache_index[at];
+        if (record->key == NULL
+            || (record->kind == kind && record->key_len == key_len
+                && memcmp(record->key, key, key_len) == 0))
+            return record;
+        at = (at + 1) & (cache_slots - 1);
+    }
+}
+
+
+/*
+    Parse a line of the file, without its newline.  Returns 0 if it is
+    a well formed record.
+*/
+static int cache_parse(
+    const char *line,
+    const char *end,
+    struct cache_record *record)
+{
+    const char *at = line;
+    long long expires = 0;
+
+    if (at == end || *at < '0' || *at > '9')
+        return -1;
+    while (at < end && *at >= '0' && *at <= '9')
+        expires = expires * 10 + (*at++ - '0');
+
+    if (end - at < 4 || at[0] != ' ' || at[2] != ' ')
+        return -1;
+    record->kind = at[1];
+    at += 3;
+
+    record->key = at;
+    while (at < end && *at != ' ')
+        at++;
+    record->key_len = at - record->key;
+    if (record->key_len == 0 || at == end)
+        return -1;
+
+    record->value = at + 1;
+    record->value_len = end - record->value;
+    record->expires = expires;
+
+    return 0;
+}
+
+
+/*  Index the records of the mapped file  */
+static void cache_build_index(
+    void)
+{
+    const char *at = cache_map;
+    const char *end = cache_map + cache_map_size;
+    const char *newline;
+    struct cache_record record, *slot;
+    size_t lines = 0;
+    time_t now = time(NULL);
+
+    free(cache_index);
+    cache_index = NULL;
+    cache_records = 0;
+    cache_live = 0;
+
+    for (newline = at; newline && newline < end; newline++) {
+        if (!(newline = memchr(newline, '\n', end - newline)))
+            break;
+        lines++;
+    }
+
+    cache_slots = 64;
+    while (cache_slots < 2 * lines)
+        cache_slots *= 2;
+    cache_index = calloc(cache_slots, sizeof(struct cache_record));
+    if (cache_index == NULL) {
+        error(EXIT_FAILURE, errno, "cache index allocation failure");
+    }
+
+    while (at && at < end && (newline = memchr(at, '\n', end - at))) {
+        if (cache_parse(at, newline, &record) == 0) {
+            slot = cache_slot(record.kind, record.key, record.key_len);
+            if (slot->key == NULL) {
+                cache_records++;
+            } else if (slot->expires > now) {
+                cache_live--;
+            }
+            *slot = record;
+            if (record.expires > now)
+                cache_live++;
+        }
+        at = newline + 1;
+    }
+}
+
+
+/*  Map the file again, if it has grown since we last mapped it  */
+static void cache_map_file(
+    void)
+{
+    struct stat st;
+    void *map;
+
+    if (fstat(cache_fd, &st)
+        || (cache_index && (size_t) st.st_size == cache_map_size))
+        return;
+
+    if (cache_map)
+        munmap(cache_map, cache_map_size);
+    cache_map = NULL;
+    cache_map_size = 0;
+
+    if (st.st_size) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, cache_fd, 0);
+        if (map == MAP_FAILED) {
+            error(0, errno, "%s", cache_filename);
+        } else {
+            cache_map = map;
+            cache_map_size = st.st_size;
+        }
+    }
+
+    cache_build_index();
+}
+
+
+/*
+    Open and map the file, or the file which has replaced the one we
+    have open
+*/
+static int cache_open_file(
+    void)
+{
+    int fd;
+
+    fd = open(cache_filename, O_RDWR | O_APPEND | O_CREAT, 0644);
+    if (fd == -1) {
+        error(0, errno, "%s", cache_filename);
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    /*  A replaced file's mapping and index are those of the old file  */
+    if (cache_fd != -1) {
+        close(cache_fd);
+        if (cache_map)
+            munmap(cache_map, cache_map_size);
+        cache_map = NULL;
+        cache_map_size = 0;
+        free(cache_index);
+        cache_index = NULL;
+    }
+    cache_fd = fd;
+    cache_map_file();
+
+    return 0;
+}
+
+
+/*  Has the file we have open been compacted, and replaced?  */
+static int cache_replaced(
+    void)
+{
+    struct stat st;
+
+    return fstat(cache_fd, &st) == 0 && st.st_nlink == 0;
+}
+
+
+#ifdef HAVE_FLOCK
+
+/*  Write the records still live to a new file, and rename it into place  */
+static void cache_compact(
+    void)
+{
+    char *tmpname;
+    FILE *out;
+    size_t i;
+    int fd;
+    time_t now = time(NULL);
+    struct cache_record *record;
+
+    if (flock(cache_fd, LOCK_EX))
+        return;
+    if (cache_replaced()) {
+        /*  Someone else has compacted it, while we waited  */
+        flock(cache_fd, LOCK_UN);
+        return;
+    }
+    cache_map_file();
+
+    tmpname = xmalloc(strlen(cache_filename) + 8);
+    sprintf(tmpname, "%s.XXXXXX", cache_filename);
+    fd = mkstemp(tmpname);
+    if (fd == -1 || !(out = fdopen(fd, "w"))) {
+        if (fd != -1)
+            close(fd);
+        flock(cache_fd, LOCK_UN);
+        free(tmpname);
+        return;
+    }
+    fchmod(fd, 0644);
+
+    for (i = 0; i < cache_slots; i++) {
+        record = &cache_index[i];
+        if (record->key && record->expires > now)
+            fprintf(out, "%lld %c %.*s %.*s\n",
+                    (long long) record->expires, record->kind,
+                    record->key_len, record->key, record->value_len,
+                    record->value);
+    }
+
+    if (fclose(out) == 0 && rename(tmpname, cache_filename) == 0) {
+        flock(cache_fd, LOCK_UN);
+        cache_open_file();
+    } else {
+        unlink(tmpname);
+        flock(cache_fd, LOCK_UN);
+    }
+    free(tmpname);
+}
+
+#endif
+
+
+void cache_open(
+    const char *filename)
+{
+    cache_filename = filename;
+    if (cache_open_file())
+        return;
+    cache_checked = time(NULL);
+
+#ifdef HAVE_FLOCK
+    if (cache_map_size > CACHE_COMPACT_SIZE && 2 * cache_live < cache_records)
+        cache_compact();
+#endif
+}
+
+
+void cache_close(
+    void)
+{
+    if (cache_map)
+        munmap(cache_map, cache_map_size);
+    cache_map = NULL;
+    cache_map_size = 0;
+
+    free(cache_index);
+    cache_index = NULL;
+    cache_slots = 0;
+
+    if (cache_fd != -1)
+        close(cache_fd);
+    cache_fd = -1;
+}
+
+
+/*
+    Find a record which hasn't lapsed, copying its value.  Returns when
+    the record lapses, or 0 if there is no such record.
+*/
+time_t cache_find(
+    int kind,
+    const char *key,
+    char *value,
+    int value_len)
+{
+    struct cache_record *record;
+    int key_len = strlen(key);
+    time_t now;
+    int len;
+
+    if (cache_fd == -1)
+        return 0;
+
+    now = time(NULL);
+    record = cache_slot(kind, key, key_len);
+    if (record->key == NULL && now != cache_checked) {
+        /*  Another run may have looked it up since we last looked  */
+        cache_checked = now;
+        if (cache_replaced() && cache_open_file())
+            return 0;
+        cache_map_file();
+        record = cache_slot(kind, key, key_len);
+    }
+
+    if (record->key == NULL || record->expires <= now)
+        return 0;
+
+    len = record->value_len;
+    if (len > value_len - 1)
+        len = value_len - 1;
+    memcpy(value, record->value, len);
+    value[len] = 0;
+
+    return record->expires;
+}
+
+
+/*  Append a record, to lapse after ttl seconds  */
+void cache_store(
+    int kind,
+    const char *key,
+    const char *value,
+    long ttl)
+{
+    char record[CACHE_RECORD_MAX];
+    char *at;
+    int len;
+
+    if (cache_fd == -1 || ttl <= 0 || strpbrk(key, " \n") || !*key)
+        return;
+
+    len = snprintf(record, sizeof(record), "%lld %c %s %s\n",
+                   (long long) time(NULL) + ttl, kind, key, value);
+    if (len < 0 || len >= (int) sizeof(record))
+        return;
+
+    /*  Values run to the end of the line, so may not hold a newline  */
+    for (at = record; at < record + len - 1; at++) {
+        if (*at == '\n' || *at == '\r')
+            *at = ' ';
+    }
+
+#ifdef HAVE_FLOCK
+    if (flock(cache_fd, LOCK_SH))
+        return;
+    if (cache_replaced()) {
+        if (cache_open_file())
+            return;
+        if (flock(cache_fd, LOCK_SH))
+            return;
+    }
+#endif
+    if (write(cache_fd, record, len) != len)
+        error(0, errno, "%s", cache_filename);
+#ifdef HAVE_FLOCK
+    flock(cache_fd, LOCK_UN);
+#endif
+}
+
+#else
+
+void cache_open(
+    const char *filename)
+{
+    error(0, 0, "%s: a cache file is not supported on this system",
+          filename);
+}
+
+
+void cache_close(
+    void)
+{
+}
+
+
+time_t cache_find(
+    int kind ATTRIBUTE_UNUSED,
+    const char *key ATTRIBUTE_UNUSED,
+    char *value ATTRIBUTE_UNUSED,
+    int value_len ATTRIBUTE_UNUSED)
+{
+    return 0;
+}
+
+
+void cache_store(
+    int kind ATTRIBUTE_UNUSED,
+    const char *key ATTRIBUTE_UNUSED,
+    const char *value ATTRIBUTE_UNUSED,
+    long ttl ATTRIBUTE_UNUSED)
+{
+}
+
+#endif
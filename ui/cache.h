@@ -0,0 +1,46 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <time.h>
+
+/*  The kinds of record kept in the cache file  */
+#define CACHE_NAME 'n'          /* the name of an address */
+#define CACHE_IPINFO 'i'        /* the ipinfo TXT record of a domain */
+
+/*  Seconds to keep an address's name, as getnameinfo() gives no TTL  */
+#define CACHE_NAME_TTL 3600
+
+extern void cache_open(
+    const char *filename);
+extern void cache_close(
+    void);
+extern time_t cache_find(
+    int kind,
+    const char *key,
+    char *value,
+    int value_len);
+extern void cache_store(
+    int kind,
+    const char *key,
+    const char *value,
+    long ttl);
+
+#endif
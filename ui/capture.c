@@ -0,0 +1,566 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_ERROR_H
+#include <error.h>
+#else
+#include "portability/error.h"
+#endif
+
+#include "mtr.h"
+#include "capture.h"
+#include "display.h"
+#include "dns.h"
+#include "event.h"
+#include "net.h"
+#include "utils.h"
+
+/*  Events are written through a buffer, rather than one write each  */
+#define CAPTURE_BUFFER_SIZE 65536
+
+/*  The shortest time between redraws of a replay, in usec  */
+#define REPLAY_REDRAW_INTERVAL 100000
+
+/*  The timers of a replay's event loop  */
+enum {
+    TIMER_EVENT,
+    TIMER_REDRAW
+};
+
+static FILE *capture_file;
+static const char *capture_name;
+static long long capture_start;
+
+
+static void put_number(
+    unsigned char *at,
+    uint64_t value,
+    int bytes)
+{
+    while (bytes--) {
+        at[bytes] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+
+static uint64_t get_number(
+    const unsigned char *at,
+    int bytes)
+{
+    uint64_t value = 0;
+    int i;
+
+    for (i = 0; i < bytes; i++) {
+        value = (value << 8) | at[i];
+    }
+
+    return value;
+}
+
+
+static int addr_length(
+    int af)
+{
+#ifdef ENABLE_IPV6
+    if (af == AF_INET6)
+        return sizeof(struct in6_addr);
+#endif
+    return sizeof(struct in_addr);
+}
+
+
+static void capture_write(
+    const void *data,
+    size_t size)
+{
+    if (fwrite(data, size, 1, capture_file) != 1) {
+        error(EXIT_FAILURE, errno, "%s", capture_name);
+    }
+}
+
+
+/*  Open a capture file, to append the sessions which follow  */
+void capture_open(
+    const char *filename)
+{
+    capture_file = fopen(filename, "ab");
+    if (capture_file == NULL) {
+        error(EXIT_FAILURE, errno, "%s", filename);
+    }
+    setvbuf(capture_file, NULL, _IOFBF, CAPTURE_BUFFER_SIZE);
+    capture_name = filename;
+}
+
+
+void capture_close(
+    void)
+{
+    if (capture_file == NULL)
+        return;
+
+    if (fclose(capture_file)) {
+        error(EXIT_FAILURE, errno, "%s", capture_name);
+    }
+    capture_file = NULL;
+}
+
+
+/*  Start a session, for the target of ctl->net  */
+void capture_session(
+    struct mtr_ctl *ctl)
+{
+    unsigned char header[CAPTURE_HEADER_SIZE];
+    unsigned char *at = header;
+
+    if (capture_file == NULL)
+        return;
+
+    memset(header, 0, sizeof(header));
+    memcpy(at, CAPTURE_MAGIC, 8);
+    at += 8;
+    put_number(at, net_session_af(ctl->net), 4);
+    at += 4;
+    put_number(at, ctl->fstTTL, 4);
+    at += 4;
+    put_number(at, ctl->maxTTL, 4);
+    at += 4;
+    put_number(at, time(NULL), 8);
+    at += 8;
+    memcpy(at, net_remote_addr(ctl->net),
+           addr_length(net_session_af(ctl->net)));
+    at += 16;
+    xstrncpy((char *) at, net_localaddr(ctl->net), 48);
+    at += 48;
+    xstrncpy((char *) at, ctl->Hostname, 256);
+    at += 256;
+    /*  The field is as wide as LocalHostname, and the header zeroed  */
+    memcpy(at, ctl->LocalHostname, strnlen(ctl->LocalHostname, 127));
+
+    capture_write(header, sizeof(header));
+    capture_start = event_now();
+}
+
+
+static void capture_event(
+    int type,
+    int labels,
+    int host,
+    int seq,
+    int err,
+    int usec,
+    int af,
+    ip_t * addr)
+{
+    unsigned char event[CAPTURE_EVENT_SIZE];
+
+    memset(event, 0, sizeof(event));
+    event[0] = type;
+    event[1] = labels;
+    put_number(event + 2, host, 2);
+    put_number(event + 4, seq, 4);
+    put_number(event + 8, err, 4);
+    put_number(event + 12, usec, 4);
+    put_number(event + 16, event_now() - capture_start, 8);
+    if (addr)
+        memcpy(event + 24, addr, addr_length(af));
+
+    capture_write(event, sizeof(event));
+}
+
+
+void capture_xmit(
+    int host,
+    int seq)
+{
+    if (capture_file == NULL)
+        return;
+
+    capture_event(CAPTURE_XMIT, 0, host, seq, 0, 0, 0, NULL);
+}
+
+
+/*  Record a reply, or with no address, a probe which timed out  */
+void capture_reply(
+    int af,
+    int host,
+    int seq,
+    int err,
+    struct mplslen *mpls,
+    ip_t * addr,
+    int usec)
+{
+    unsigned char label[CAPTURE_LABEL_SIZE];
+    int labels = addr ? mpls->labels : 0;
+    int i;
+
+    if (capture_file == NULL)
+        return;
+
+    capture_event(addr ? CAPTURE_REPLY : CAPTURE_TIMEOUT, labels, host,
+                  seq, err, usec, af, addr);
+    for (i = 0; i < labels; i++) {
+        memset(label, 0, sizeof(label));
+        put_number(label, mpls->label[i], 4);
+        label[4] = mpls->exp[i];
+        label[5] = mpls->s[i];
+        label[6] = mpls->ttl[i];
+        capture_write(label, sizeof(label));
+    }
+}
+
+
+/*  A capture file being replayed, mapped whole into memory  */
+struct replay_file {
+    const char *name;
+    const unsigned char *data;
+    size_t size;
+    size_t at;                  /* the offset of the next record */
+};
+
+
+static void replay_map(
+    struct replay_file *file,
+    const char *filename)
+{
+    struct stat st;
+    unsigned char *data;
+#if !defined(HAVE_SYS_MMAN_H) || !defined(HAVE_MMAP)
+    ssize_t got;
+    size_t size;
+#endif
+    int fd;
+
+    if ((fd = open(filename, O_RDONLY)) == -1 || fstat(fd, &st)) {
+        error(EXIT_FAILURE, errno, "%s", filename);
+    }
+    file->name = filename;
+    file->size = st.st_size;
+    file->at = 0;
+    if (file->size == 0) {
+        error(EXIT_FAILURE, 0, "%s: empty capture file", filename);
+    }
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+    data = mmap(NULL, file->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        error(EXIT_FAILURE, errno, "%s", filename);
+    }
+#else
+    data = xmalloc(file->size);
+    for (size = 0; size < file->size; size += got) {
+        got = read(fd, data + size, file->size - size);
+        if (got <= 0) {
+            error(EXIT_FAILURE, errno, "%s", filename);
+        }
+    }
+#endif
+    close(fd);
+    file->data = data;
+}
+
+
+static void replay_unmap(
+    struct replay_file *file)
+{
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+    munmap((void *) file->data, file->size);
+#else
+    free((void *) file->data);
+#endif
+}
+
+
+/*
+    The next event of the session being replayed, with the offset of
+    its labels through labels_at, or NULL at the end of the session.
+*/
+static const unsigned char *replay_next(
+    struct replay_file *file,
+    size_t *labels_at)
+{
+    const unsigned char *event = file->data + file->at;
+    size_t size;
+
+    /*  The end of the file, or the header of the next session  */
+    if (file->at >= file->size
+        || (file->size - file->at >= 8
+            && !memcmp(event, CAPTURE_MAGIC, 8))) {
+        return NULL;
+    }
+
+    size = CAPTURE_EVENT_SIZE + (size_t) event[1] * CAPTURE_LABEL_SIZE;
+    if (file->size - file->at < size) {
+        /*  A capture cut short, as by a crash, ends at its last event  */
+        error(0, 0, "%s: truncated capture file", file->name);
+        file->at = file->size;
+        return NULL;
+    }
+    *labels_at = file->at + CAPTURE_EVENT_SIZE;
+    file->at += size;
+
+    return event;
+}
+
+
+/*  Push an event through the net module, as if the probe were live  */
+static void replay_event(
+    struct mtr_ctl *ctl,
+    struct replay_file *file,
+    const unsigned char *event,
+    size_t labels_at)
+{
+    const unsigned char *label = file->data + labels_at;
+    struct mplslen mpls;
+    ip_t addr;
+    int host = get_number(event + 2, 2);
+    int seq = get_number(event + 4, 4);
+    int err = get_number(event + 8, 4);
+    int usec = get_number(event + 12, 4);
+    int i;
+
+    switch (event[0]) {
+    case CAPTURE_XMIT:
+        if (host >= MaxHost
+            || net_replay_xmit(ctl, ctl->net, host, seq) != 0) {
+            error(EXIT_FAILURE, 0, "%s: bad probe in capture file",
+                  file->name);
+        }
+        break;
+
+    case CAPTURE_REPLY:
+        memset(&mpls, 0, sizeof(mpls));
+        if (event[1] > MAXLABELS || usec < 0) {
+            error(EXIT_FAILURE, 0, "%s: bad reply in capture file",
+                  file->name);
+        }
+        mpls.labels = event[1];
+        for (i = 0; i < mpls.labels; i++, label += CAPTURE_LABEL_SIZE) {
+            mpls.label[i] = get_number(label, 4);
+            mpls.exp[i] = label[4];
+            mpls.s[i] = label[5];
+            mpls.ttl[i] = label[6];
+        }
+        memset(&addr, 0, sizeof(addr));
+        memcpy(&addr, event + 24, addr_length(ctl->af));
+        net_replay_reply(ctl, seq, err, &mpls, &addr, usec);
+        break;
+
+    case CAPTURE_TIMEOUT:
+        net_replay_reply(ctl, seq, 0, NULL, NULL, 0);
+        break;
+
+    default:
+        error(EXIT_FAILURE, 0, "%s: bad event in capture file",
+              file->name);
+    }
+}
+
+
+/*  Arm the redraw timer, no sooner than an interval after the last  */
+static void replay_request_redraw(
+    struct event_loop *loop,
+    long long last_redraw,
+    long long now)
+{
+    long long deadline = last_redraw + REPLAY_REDRAW_INTERVAL;
+
+    if (loop->deadline[TIMER_REDRAW]) {
+        return;
+    }
+    if (deadline < now) {
+        deadline = now;
+    }
+    event_set_timer(loop, TIMER_REDRAW, deadline);
+}
+
+
+/*
+    Replay the events of a session, as fast as they can be handled, or
+    with --replay-realtime, as they were spaced when captured.  An
+    interactive display is kept until it is quit.
+*/
+static void replay_events(
+    struct mtr_ctl *ctl,
+    struct replay_file *file)
+{
+    struct event_loop loop;
+    const unsigned char *event;
+    size_t labels_at = 0;
+    long long start, now, due, last_redraw = 0;
+    int keyfd = -1;
+
+    event_loop_init(&loop);
+    if (ctl->Interactive) {
+        keyfd = event_add_fd(&loop, 0);
+    }
+
+    start = event_now();
+    event = replay_next(file, &labels_at);
+    while (1) {
+        now = event_now();
+
+        while (event) {
+            due = ctl->replay_realtime ? start + get_number(event + 16, 8)
+                : now;
+            if (due > now) {
+                event_set_timer(&loop, TIMER_EVENT, due);
+                break;
+            }
+            replay_event(ctl, file, event, labels_at);
+            event = replay_next(file, &labels_at);
+            if (ctl->Interactive) {
+                replay_request_redraw(&loop, last_redraw, now);
+            }
+        }
+
+        if (!event) {
+            event_set_timer(&loop, TIMER_EVENT, 0);
+            if (!ctl->Interactive) {
+                break;
+            }
+        }
+
+        event_wait(&loop);
+        now = event_now();
+
+        if (keyfd >= 0 && loop.fd_ready[keyfd]) {
+            switch (display_keyaction(ctl)) {
+            case ActionQuit:
+                event_loop_close(&loop);
+                return;
+            case ActionDisplay:
+                ctl->display_mode =
+                    (ctl->display_mode + 1) % DisplayModeMAX;
+                break;
+            case ActionScrollDown:
+                ctl->display_offset += 5;
+                break;
+            case ActionScrollUp:
+                ctl->display_offset -= 5;
+                if (ctl->display_offset < 0) {
+                    ctl->display_offset = 0;
+                }
+                break;
+            }
+            event_set_timer(&loop, TIMER_REDRAW, now);
+        }
+
+        if (event_timer_expired(&loop, TIMER_REDRAW, now)) {
+            display_redraw(ctl);
+            last_redraw = now;
+        }
+        display_flush(ctl);
+    }
+
+    event_loop_close(&loop);
+}
+
+
+/*  Replay the sessions of a capture file, in place of tracing  */
+void replay(
+    struct mtr_ctl *ctl,
+    const char *filename)
+{
+    struct replay_file file;
+    const unsigned char *header;
+    struct hostent host;
+    char *alptr[2];
+    unsigned char remote[16];
+    char localaddr[48];
+    char hostname[256];
+    uint64_t fst_ttl, max_ttl;
+
+    replay_map(&file, filename);
+
+    while (file.at < file.size) {
+        header = file.data + file.at;
+        if (file.size - file.at < CAPTURE_HEADER_SIZE
+            || memcmp(header, CAPTURE_MAGIC, 8)) {
+            error(EXIT_FAILURE, 0, "%s: not an mtr capture file",
+                  filename);
+        }
+        file.at += CAPTURE_HEADER_SIZE;
+
+        fst_ttl = get_number(header + 12, 4);
+        max_ttl = get_number(header + 16, 4);
+        if (fst_ttl < 1 || fst_ttl > max_ttl || max_ttl > MaxHost) {
+            error(EXIT_FAILURE, 0, "%s: bad TTL range in capture file",
+                  filename);
+        }
+
+        ctl->af = get_number(header + 8, 4);
+        ctl->fstTTL = fst_ttl;
+        ctl->maxTTL = max_ttl;
+        ctl->start_time = get_number(header + 20, 8);
+        memcpy(remote, header + 28, sizeof(remote));
+        xstrncpy(localaddr, (const char *) header + 44, sizeof(localaddr));
+        xstrncpy(hostname, (const char *) header + 92, sizeof(hostname));
+        xstrncpy(ctl->LocalHostname, (const char *) header + 348,
+                 sizeof(ctl->LocalHostname));
+        ctl->Hostname = hostname;
+        if (ctl->af != AF_INET
+#ifdef ENABLE_IPV6
+            && ctl->af != AF_INET6
+#endif
+            ) {
+            error(EXIT_FAILURE, 0, "%s: bad address family in capture file",
+                  filename);
+        }
+
+        memset(&host, 0, sizeof(host));
+        host.h_name = hostname;
+        host.h_addrtype = ctl->af;
+        host.h_length = addr_length(ctl->af);
+        host.h_addr_list = alptr;
+        alptr[0] = (char *) remote;
+        alptr[1] = NULL;
+
+        if (ctl->net) {
+            net_session_free(ctl->net);
+        }
+        ctl->net = net_session_replay(ctl, &host, localaddr);
+
+        dns_open(ctl);
+        display_open(ctl);
+        replay_events(ctl, &file);
+        net_end_transit(ctl->net);
+        display_close(ctl);
+
+        if (ctl->Interactive)
+            break;
+    }
+
+    replay_unmap(&file);
+}
@@ -0,0 +1,94 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "mtr.h"
+
+/*
+    The capture file written by --capture, and read by --replay.  It is
+    only ever appended to, and holds one or more sessions, one for each
+    hostname traced, every field laid out byte by byte with integers in
+    network byte order.
+
+    A session starts with a header of CAPTURE_HEADER_SIZE bytes:
+
+        magic      8 bytes, CAPTURE_MAGIC
+        af         4 bytes, AF_INET or AF_INET6
+        fstTTL     4 bytes, the first hop probed, from 1
+        maxTTL     4 bytes, the last hop which may be probed
+        start      8 bytes, the time the trace started, in sec since 1970
+        remote     16 bytes, the address traced, zero padded
+        local      48 bytes, the local address, as text, NUL padded
+        hostname   256 bytes, the hostname traced, NUL padded
+        localhost  128 bytes, the name of the local host, NUL padded
+
+    which is followed by its events, of CAPTURE_EVENT_SIZE bytes:
+
+        type       1 byte, CAPTURE_XMIT, CAPTURE_REPLY or CAPTURE_TIMEOUT
+        labels     1 byte, the MPLS labels following a reply
+        host       2 bytes, the hop probed, counting from 0
+        seq        4 bytes, the token identifying the probe
+        err        4 bytes, the error of a reply, as net_process_ping has it
+        rtt        4 bytes, the round trip time of a reply, in usec
+        time       8 bytes, usec since the session started, by a
+                   monotonic clock
+        address    16 bytes, the address which replied, zero padded
+
+    A reply is followed by its MPLS labels, of CAPTURE_LABEL_SIZE bytes:
+
+        label      4 bytes
+        exp        1 byte
+        s          1 byte
+        ttl        1 byte
+        pad        1 byte
+*/
+#define CAPTURE_MAGIC "MTRCAP\0\1"
+
+#define CAPTURE_HEADER_SIZE (8 + 4 + 4 + 4 + 8 + 16 + 48 + 256 + 128)
+#define CAPTURE_EVENT_SIZE (1 + 1 + 2 + 4 + 4 + 4 + 8 + 16)
+#define CAPTURE_LABEL_SIZE 8
+
+#define CAPTURE_XMIT 'x'
+#define CAPTURE_REPLY 'p'
+#define CAPTURE_TIMEOUT 't'
+
+extern void capture_open(
+    const char *filename);
+extern void capture_close(
+    void);
+extern void capture_session(
+    struct mtr_ctl *ctl);
+extern void capture_xmit(
+    int host,
+    int seq);
+extern void capture_reply(
+    int af,
+    int host,
+    int seq,
+    int err,
+    struct mplslen *mpls,
+    ip_t * addr,
+    int usec);
+
+extern void replay(
+    struct mtr_ctl *ctl,
+    const char *filename);
+
+#endif
@@ -21,12 +21,18 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -36,7 +42,10 @@
 #include "portability/error.h"
 #endif
 
+#include "packet/agent.h"
 #include "packet/cmdparse.h"
+#include "packet/trace.h"
+#include "packet/wire.h"
 #include "display.h"
 
 
@@ -63,142 +72,184 @@ void set_fd_nonblock(
 
 
 /*
-    Send a command synchronously to mtr-packet, blocking until a result
-    is available.  This is intended to be used at start-up to check the
-    capabilities of mtr-packet, but probes should be sent asynchronously
-    to avoid blocking other probes and the user interface.
+    The features of mtr-packet we check at start-up.  Features which
+    don't apply to the probes we will send have no name, and aren't
+    checked.
+*/
+enum {
+    FEATURE_SEND_PROBE,
+    FEATURE_IP_VERSION,
+    FEATURE_PROTOCOL,
+    FEATURE_MARK,
+    FEATURE_PROBE_TEMPLATE,
+    FEATURE_TCP_SYN,
+    FEATURE_TIMEOUT_MS,
+    FEATURE_PACE,
+    FEATURE_COUNT
+};
+
+/*  The token of the request to enter binary mode, after the checks  */
+#define ENTER_BINARY_TOKEN (FEATURE_COUNT + 1)
+
+
+/*
+    Name the features to check for the probes selected.  Returns zero,
+    or -1 with errno set if the IP version or protocol is unknown.
 */
 static
-int send_synchronous_command(
+int name_packet_features(
     struct mtr_ctl *ctl,
-    struct packet_command_pipe_t *cmdpipe,
-    const char *cmd,
-    struct command_t *result)
+    const char **feature)
 {
-    char reply[PACKET_REPLY_BUFFER_SIZE];
-    int command_length;
-    int write_length;
-    int read_length;
-
-    /*  Query send-probe support  */
-    command_length = strlen(cmd);
-    write_length = write(cmdpipe->write_fd, cmd, command_length);
+    memset(feature, 0, FEATURE_COUNT * sizeof(const char *));
 
-    if (write_length == -1) {
-        return -1;
-    }
+    feature[FEATURE_SEND_PROBE] = "send-probe";
+    feature[FEATURE_PROBE_TEMPLATE] = "probe-template";
+    feature[FEATURE_TIMEOUT_MS] = "timeout-ms";
+    feature[FEATURE_PACE] = "pace";
 
-    if (write_length != command_length) {
-        errno = EIO;
+    /*  The IP protocol version  */
+    if (ctl->af == AF_INET6) {
+        feature[FEATURE_IP_VERSION] = "ip-6";
+    } else if (ctl->af == AF_INET) {
+        feature[FEATURE_IP_VERSION] = "ip-4";
+    } else {
+        errno = EINVAL;
         return -1;
     }
 
-    /*  Read the reply to our query  */
-    read_length =
-        read(cmdpipe->read_fd, reply, PACKET_REPLY_BUFFER_SIZE - 1);
-
-    if (read_length < 0) {
+    /*  The transport protocol  */
+    if (ctl->mtrtype == IPPROTO_ICMP) {
+        feature[FEATURE_PROTOCOL] = "icmp";
+    } else if (ctl->mtrtype == IPPROTO_UDP) {
+        feature[FEATURE_PROTOCOL] = "udp";
+    } else if (ctl->mtrtype == IPPROTO_TCP) {
+        feature[FEATURE_PROTOCOL] = "tcp";
+        feature[FEATURE_TCP_SYN] = "tcp-syn";
+#ifdef HAS_SCTP
+    } else if (ctl->mtrtype == IPPROTO_SCTP) {
+        feature[FEATURE_PROTOCOL] = "sctp";
+#endif
+    } else {
+        errno = EINVAL;
         return -1;
     }
 
-    /*  Parse the query reply  */
-    reply[read_length] = 0;
-    if (parse_command(result, reply)) {
-        return -1;
+#ifdef SO_MARK
+    if (ctl->mark) {
+        feature[FEATURE_MARK] = "mark";
     }
+#endif
 
     return 0;
 }
 
 
-/*  Check support for a particular feature with the mtr-packet we invoked  */
+/*
+    Check the support of mtr-packet for a set of features, and then
+    ask it to enter binary mode.  Rather than waiting for the reply to
+    each command in turn, all of the commands are written at once,
+    with the index of each feature as its token, and then the replies
+    are read.  Entering binary mode must come last, as mtr-packet
+    parses only binary requests after it.  An mtr-packet without the
+    binary protocol replies to it as to any unknown command.
+
+    Returns zero, or -1 with errno set if mtr-packet can't be
+    reached, as when it failed to execute.
+*/
 static
-int check_feature(
-    struct mtr_ctl *ctl,
+int query_packet_features(
     struct packet_command_pipe_t *cmdpipe,
-    const char *feature)
+    const char **feature,
+    bool *supported)
 {
-    char check_command[COMMAND_BUFFER_SIZE];
+    char commands[COMMAND_BUFFER_SIZE];
+    char replies[PACKET_REPLY_BUFFER_SIZE];
     struct command_t reply;
+    char *line;
+    char *newline;
+    int command_count = 0;
+    int reply_count = 0;
+    int length = 0;
+    int write_length;
+    int read_length;
+    int i;
 
-    snprintf(check_command, COMMAND_BUFFER_SIZE,
-             "1 check-support feature %s\n", feature);
-
-    if (send_synchronous_command(ctl, cmdpipe, check_command, &reply) ==
-        -1) {
-        return -1;
+    for (i = 0; i < FEATURE_COUNT; i++) {
+        supported[i] = false;
+        if (feature[i]) {
+            length += snprintf(commands + length,
+                               COMMAND_BUFFER_SIZE - length,
+                               "%d check-support feature %s\n", i + 1,
+                               feature[i]);
+            command_count++;
+        }
     }
+    length += snprintf(commands + length, COMMAND_BUFFER_SIZE - length,
+                       "%d enter-binary-mode\n", ENTER_BINARY_TOKEN);
+    command_count++;
 
-    /*  Check that the feature is supported  */
-    if (!strcmp(reply.command_name, "feature-support")
-        && reply.argument_count >= 1
-        && !strcmp(reply.argument_name[0], "support")
-        && !strcmp(reply.argument_value[0], "ok")) {
-
-        /*  Looks good  */
-        return 0;
+    write_length = write(cmdpipe->write_fd, commands, length);
+    if (write_length == -1) {
+        return -1;
     }
-
-    errno = ENOTSUP;
-    return -1;
-}
-
-
-/*
-    Check the protocol selected against the mtr-packet we are using.
-    Returns zero if everything is fine, or -1 with errno for either
-    a failure during the check, or for an unsupported feature.
-*/
-static
-int check_packet_features(
-    struct mtr_ctl *ctl,
-    struct packet_command_pipe_t *cmdpipe)
-{
-    /*  Check the IP protocol version  */
-    if (ctl->af == AF_INET6) {
-        if (check_feature(ctl, cmdpipe, "ip-6")) {
-            return -1;
-        }
-    } else if (ctl->af == AF_INET) {
-        if (check_feature(ctl, cmdpipe, "ip-4")) {
-            return -1;
-        }
-    } else {
-        errno = EINVAL;
+    if (write_length != length) {
+        errno = EIO;
         return -1;
     }
 
-    /*  Check the transport protocol  */
-    if (ctl->mtrtype == IPPROTO_ICMP) {
-        if (check_feature(ctl, cmdpipe, "icmp")) {
+    /*  Read until every command has its reply  */
+    length = 0;
+    while (reply_count < command_count) {
+        if (length == PACKET_REPLY_BUFFER_SIZE - 1) {
+            errno = EIO;
             return -1;
         }
-    } else if (ctl->mtrtype == IPPROTO_UDP) {
-        if (check_feature(ctl, cmdpipe, "udp")) {
+
+        read_length = read(cmdpipe->read_fd, replies + length,
+                           PACKET_REPLY_BUFFER_SIZE - 1 - length);
+        if (read_length < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
             return -1;
         }
-    } else if (ctl->mtrtype == IPPROTO_TCP) {
-        if (check_feature(ctl, cmdpipe, "tcp")) {
+        if (read_length == 0) {
+            errno = EPIPE;
             return -1;
         }
-#ifdef HAS_SCTP
-    } else if (ctl->mtrtype == IPPROTO_SCTP) {
-        if (check_feature(ctl, cmdpipe, "sctp")) {
-            return -1;
+
+        for (i = length; i < length + read_length; i++) {
+            if (replies[i] == '\n') {
+                reply_count++;
+            }
         }
-#endif
-    } else {
-        errno = EINVAL;
-        return -1;
+        length += read_length;
     }
+    replies[length] = 0;
 
-#ifdef SO_MARK
-    if (ctl->mark) {
-        if (check_feature(ctl, cmdpipe, "mark")) {
-            return -1;
+    for (line = replies; (newline = strchr(line, '\n'));
+         line = newline + 1) {
+        *newline = 0;
+        if (parse_command(&reply, line)) {
+            continue;
+        }
+
+        if (reply.token == ENTER_BINARY_TOKEN) {
+            if (!strcmp(reply.command_name, "binary-mode-entered")) {
+                cmdpipe->binary_protocol = 1;
+            }
+            continue;
+        }
+
+        if (reply.token >= 1 && reply.token <= FEATURE_COUNT
+            && !strcmp(reply.command_name, "feature-support")
+            && reply.argument_count >= 1
+            && !strcmp(reply.argument_name[0], "support")
+            && !strcmp(reply.argument_value[0], "ok")) {
+            supported[reply.token - 1] = true;
         }
     }
-#endif
 
     return 0;
 }
@@ -211,8 +262,11 @@ extern char *myname;
 */
 static
 void execute_packet_child(
-    void)
+    struct mtr_ctl *ctl,
+    const char **feature)
 {
+    bool any_ip_version = ctl->concurrent;
+    char probes[64];
     char buf[256];
     /*
        Allow the MTR_PACKET environment variable to override
@@ -224,6 +278,24 @@ void execute_packet_child(
         mtr_packet_path = "mtr-packet";
     }
 
+    /*
+       Tell mtr-packet which probes we will send, so that it needn't
+       open the sockets of others.  Traces of many targets, and targets
+       entered in the GTK window, may be of either IP version.
+     */
+#ifdef HAVE_GTK
+    if (ctl->DisplayMode == DisplayGTK) {
+        any_ip_version = true;
+    }
+#endif
+    if (any_ip_version) {
+        snprintf(probes, sizeof(probes), "%s", feature[FEATURE_PROTOCOL]);
+    } else {
+        snprintf(probes, sizeof(probes), "%s %s",
+                 feature[FEATURE_IP_VERSION], feature[FEATURE_PROTOCOL]);
+    }
+    setenv("MTR_PACKET_PROBES", probes, 1);
+
     /*
        First, try to execute mtr-packet from PATH
        or MTR_PACKET environment variable.
@@ -248,9 +320,77 @@ void execute_packet_child(
 }
 
 
-/*  Create the command pipe to a new mtr-packet subprocess  */
-int open_command_pipe(
+/*
+    Copy bytes from the reply buffer, starting at an offset from the
+    oldest unconsumed byte, to contiguous storage.  The bytes may wrap
+    around the end of the circular buffer.
+*/
+static
+void copy_reply_bytes(
+    const struct packet_command_pipe_t *cmdpipe,
+    size_t offset,
+    size_t length,
+    char *dest)
+{
+    size_t pos;
+    size_t span;
+
+    pos = (cmdpipe->reply_buffer_start + offset) % cmdpipe->reply_buffer_size;
+    span = cmdpipe->reply_buffer_size - pos;
+    if (span > length) {
+        span = length;
+    }
+
+    memcpy(dest, &cmdpipe->reply_buffer[pos], span);
+    memcpy(dest + span, cmdpipe->reply_buffer, length - span);
+}
+
+
+/*
+    Allocate a reply buffer of a particular size, moving any unconsumed
+    replies to the front of the new buffer.  Returns -1 if the
+    allocation fails, leaving the current buffer in place.
+*/
+static
+int resize_reply_buffer(
+    struct packet_command_pipe_t *cmdpipe,
+    size_t size)
+{
+    char *buffer;
+    char *line;
+
+    buffer = malloc(size);
+    line = malloc(size + 1);
+    if (buffer == NULL || line == NULL) {
+        free(buffer);
+        free(line);
+        return -1;
+    }
+
+    if (cmdpipe->reply_buffer_used) {
+        copy_reply_bytes(cmdpipe, 0, cmdpipe->reply_buffer_used, buffer);
+    }
+
+    free(cmdpipe->reply_buffer);
+    free(cmdpipe->reply_line);
+
+    cmdpipe->reply_buffer = buffer;
+    cmdpipe->reply_line = line;
+    cmdpipe->reply_buffer_size = size;
+    cmdpipe->reply_buffer_start = 0;
+
+    return 0;
+}
+
+
+/*
+    Start a new mtr-packet subprocess, with pipes attached to its
+    stdin and stdout.  Returns zero, or an errno value on failure.
+*/
+static
+int spawn_packet_child(
     struct mtr_ctl *ctl,
+    const char **feature,
     struct packet_command_pipe_t *cmdpipe)
 {
     int stdin_pipe[2];
@@ -284,47 +424,342 @@ int open_command_pipe(
             close(i);
         }
 
-        execute_packet_child();
-    } else {
-        memset(cmdpipe, 0, sizeof(struct packet_command_pipe_t));
+        execute_packet_child(ctl, feature);
+    }
 
-        /*
-           In the parent process, save the opposite ends of the pipes
-           attached as stdin and stdout in the child.
-         */
-        cmdpipe->pid = child_pid;
-        cmdpipe->read_fd = stdout_pipe[0];
-        cmdpipe->write_fd = stdin_pipe[1];
+    memset(cmdpipe, 0, sizeof(struct packet_command_pipe_t));
 
-        /*  We don't need the child ends of the pipe open in the parent.  */
-        close(stdout_pipe[1]);
-        close(stdin_pipe[0]);
+    /*
+       In the parent process, save the opposite ends of the pipes
+       attached as stdin and stdout in the child.
+     */
+    cmdpipe->pid = child_pid;
+    cmdpipe->read_fd = stdout_pipe[0];
+    cmdpipe->write_fd = stdin_pipe[1];
 
-        /*
-           Check that we can communicate with the client.  If we failed to
-           execute the mtr-packet binary, we will discover that here.
-         */
-        if (check_feature(ctl, cmdpipe, "send-probe")) {
-            error(EXIT_FAILURE, errno, "Failure to start mtr-packet");
+    /*  We don't need the child ends of the pipe open in the parent.  */
+    close(stdout_pipe[1]);
+    close(stdin_pipe[0]);
+
+    return 0;
+}
+
+
+/*
+    Connect to an mtr-packet daemon, started with "mtr-packet --listen",
+    rather than starting mtr-packet ourselves.  The daemon's raw sockets
+    and probe table are shared with its other clients.  Returns zero,
+    or an errno value on failure.
+*/
+static
+int connect_packet_daemon(
+    struct packet_command_pipe_t *cmdpipe,
+    const char *socket_path)
+{
+    struct sockaddr_un addr;
+    int daemon_socket;
+    int err;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        return ENAMETOOLONG;
+    }
+
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    daemon_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (daemon_socket == -1) {
+        return errno;
+    }
+
+    if (connect(daemon_socket, (struct sockaddr *) &addr,
+                sizeof(struct sockaddr_un))) {
+        err = errno;
+        close(daemon_socket);
+        return err;
+    }
+
+    memset(cmdpipe, 0, sizeof(struct packet_command_pipe_t));
+
+    /*  The one socket carries both commands and replies  */
+    cmdpipe->read_fd = daemon_socket;
+    cmdpipe->write_fd = daemon_socket;
+
+    return 0;
+}
+
+
+/*
+    Read a line of the authentication exchange with an agent, which
+    sends nothing more until we answer, waiting at most AGENT_TIMEOUT
+    milliseconds.  The newline is removed.
+*/
+static
+void read_agent_line(
+    int agent_socket,
+    const char *address,
+    char *line,
+    int line_size)
+{
+    struct pollfd readable;
+    char *newline;
+    int length = 0;
+    int read_length;
+
+    while (true) {
+        readable.fd = agent_socket;
+        readable.events = POLLIN;
+        if (poll(&readable, 1, AGENT_TIMEOUT) != 1) {
+            error(EXIT_FAILURE, ETIMEDOUT, "agent %s", address);
+        }
+
+        read_length = read(agent_socket, &line[length],
+                           line_size - length - 1);
+        if (read_length == -1 && errno == EINTR) {
+            continue;
+        }
+        if (read_length == -1) {
+            error(EXIT_FAILURE, errno, "agent %s", address);
+        }
+        if (read_length == 0) {
+            error(EXIT_FAILURE, ECONNRESET, "agent %s", address);
+        }
+
+        length += read_length;
+        line[length] = 0;
+
+        newline = strchr(line, '\n');
+        if (newline) {
+            *newline = 0;
+            return;
+        }
+        if (length == line_size - 1) {
+            error(EXIT_FAILURE, EPROTO, "agent %s", address);
+        }
+    }
+}
+
+/*
+    Prove to an agent that we know the secret we share with it, by
+    answering its challenge with the digest keyed by the secret.
+*/
+static
+void authenticate_packet_agent(
+    int agent_socket,
+    const char *address)
+{
+    struct command_t reply;
+    char line[COMMAND_BUFFER_SIZE];
+    char digest[AGENT_DIGEST_HEX_SIZE + 1];
+    const char *nonce = NULL;
+    char *secret = getenv("MTR_PACKET_SECRET");
+    int length;
+    int i;
+
+    if (secret == NULL || *secret == 0) {
+        error(EXIT_FAILURE, 0, "MTR_PACKET_SECRET must be set for agent %s",
+              address);
+    }
+
+    read_agent_line(agent_socket, address, line, sizeof(line));
+    if (parse_command(&reply, line) == 0
+        && !strcmp(reply.command_name, "authenticate-challenge")) {
+        for (i = 0; i < reply.argument_count; i++) {
+            if (!strcmp(reply.argument_name[i], "nonce")) {
+                nonce = reply.argument_value[i];
+            }
         }
+    }
+    if (nonce == NULL) {
+        error(EXIT_FAILURE, EPROTO, "agent %s", address);
+    }
+
+    compute_agent_digest(secret, nonce, digest);
+    snprintf(line, sizeof(line), "1 authenticate digest %s\n", digest);
+    length = strlen(line);
+    if (write(agent_socket, line, length) != length) {
+        error(EXIT_FAILURE, errno, "agent %s", address);
+    }
+
+    read_agent_line(agent_socket, address, line, sizeof(line));
+    if (strcmp(line, "1 authenticated")) {
+        error(EXIT_FAILURE, EACCES, "agent %s", address);
+    }
+}
 
-        if (check_packet_features(ctl, cmdpipe)) {
-            error(EXIT_FAILURE, errno, "Packet type unsupported");
+/*
+    Connect to a remote mtr-packet agent, listening on a TCP address of
+    the form "tcp:HOST:PORT", and authenticate.  Probes are sent from
+    the agent's host, rather than ours.  Returns zero, or an errno value
+    on failure.
+*/
+static
+int connect_packet_agent(
+    struct packet_command_pipe_t *cmdpipe,
+    const char *address)
+{
+    struct addrinfo hints;
+    struct addrinfo *res;
+    struct addrinfo *ai;
+    char host[NI_MAXHOST];
+    char port[NI_MAXSERV];
+    int agent_socket = -1;
+    int one = 1;
+    int gai_error;
+    int err = 0;
+
+    if (split_agent_address(address, host, sizeof(host),
+                            port, sizeof(port))) {
+        error(EXIT_FAILURE, 0, "agent address is not HOST:PORT: %s",
+              address + strlen(AGENT_ADDRESS_PREFIX));
+    }
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    gai_error = getaddrinfo(host, port, &hints, &res);
+    if (gai_error) {
+        error(EXIT_FAILURE, 0, "Failed to resolve agent %s: %s", host,
+              gai_strerror(gai_error));
+    }
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        agent_socket = socket(ai->ai_family, SOCK_STREAM, 0);
+        if (agent_socket == -1) {
+            err = errno;
+            continue;
         }
 
-        /*  We will need non-blocking reads from the child  */
-        set_fd_nonblock(cmdpipe->read_fd);
+        if (connect(agent_socket, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        err = errno;
+        close(agent_socket);
+        agent_socket = -1;
+    }
+    freeaddrinfo(res);
+
+    if (agent_socket == -1) {
+        return err;
+    }
+
+    /*  Probe requests go out as they are written  */
+    setsockopt(agent_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(int));
+
+    authenticate_packet_agent(agent_socket, address);
+
+    memset(cmdpipe, 0, sizeof(struct packet_command_pipe_t));
+
+    /*  The one socket carries both commands and replies  */
+    cmdpipe->read_fd = agent_socket;
+    cmdpipe->write_fd = agent_socket;
+    cmdpipe->remote = 1;
+
+    return 0;
+}
+
+
+/*
+    Create the command pipe to a new mtr-packet subprocess, or, if
+    MTR_PACKET_SOCKET is set, to a running mtr-packet daemon.  Given
+    the address of an agent, which may also be given by
+    MTR_PACKET_SOCKET, connect to the agent instead.
+*/
+int open_command_pipe(
+    struct mtr_ctl *ctl,
+    struct packet_command_pipe_t *cmdpipe,
+    const char *agent)
+{
+    const char *socket_path = getenv("MTR_PACKET_SOCKET");
+    const char *feature[FEATURE_COUNT];
+    bool supported[FEATURE_COUNT];
+    int err;
+    int i;
+
+    if (name_packet_features(ctl, feature)) {
+        error(EXIT_FAILURE, errno, "Packet type unsupported");
+    }
+
+    if (agent) {
+        socket_path = agent;
+    }
+
+    if (socket_path != NULL && is_agent_address(socket_path)) {
+        err = connect_packet_agent(cmdpipe, socket_path);
+    } else if (socket_path != NULL && *socket_path) {
+        err = connect_packet_daemon(cmdpipe, socket_path);
+    } else {
+        err = spawn_packet_child(ctl, feature, cmdpipe);
+    }
+
+    if (err) {
+        return err;
+    }
+
+    if (resize_reply_buffer(cmdpipe, PACKET_REPLY_BUFFER_SIZE)) {
+        error(EXIT_FAILURE, errno, "reply buffer allocation failure");
+    }
+
+    /*
+       Check that we can communicate with the client.  If we failed to
+       execute the mtr-packet binary, we will discover that here.
+     */
+    if (query_packet_features(cmdpipe, feature, supported)) {
+        error(EXIT_FAILURE, errno, "Failure to start mtr-packet");
+    }
+    if (!supported[FEATURE_SEND_PROBE]) {
+        error(EXIT_FAILURE, ENOTSUP, "Failure to start mtr-packet");
+    }
+
+    /*  Check the probes selected against the mtr-packet we are using  */
+    for (i = FEATURE_IP_VERSION; i <= FEATURE_MARK; i++) {
+        if (feature[i] && !supported[i]) {
+            error(EXIT_FAILURE, ENOTSUP, "Packet type unsupported");
+        }
     }
 
+    /*
+       Older mtr-packet versions don't support probe templates,
+       in which case we fall back to sending complete probe commands.
+     */
+    cmdpipe->template_support = supported[FEATURE_PROBE_TEMPLATE];
+
+    /*
+       Where mtr-packet can send TCP probes as raw SYN segments,
+       prefer that to having it connect a socket for every probe.
+     */
+    cmdpipe->tcp_syn_support = supported[FEATURE_TCP_SYN];
+
+    /*
+       Older mtr-packet versions take timeouts only in whole seconds,
+       in which case every probe has the default timeout.
+     */
+    cmdpipe->timeout_ms_support = supported[FEATURE_TIMEOUT_MS];
+
+    /*
+       Where mtr-packet can pace probes itself, the gaps within a burst
+       are kept there, free of the jitter of our own event loop.
+     */
+    cmdpipe->pace_support = supported[FEATURE_PACE];
+
+    /*  We will need non-blocking reads from the child  */
+    set_fd_nonblock(cmdpipe->read_fd);
+
     return 0;
 }
 
 
-/*  Kill the mtr-packet child process and close the command pipe  */
+/*
+    Kill the mtr-packet child process and close the command pipe, or
+    disconnect from the mtr-packet daemon.
+*/
 void close_command_pipe(
     struct packet_command_pipe_t *cmdpipe)
 {
     int child_exit_value;
+    int i;
 
     if (cmdpipe->pid) {
         close(cmdpipe->read_fd);
@@ -332,19 +767,30 @@ void close_command_pipe(
 
         kill(cmdpipe->pid, SIGTERM);
         waitpid(cmdpipe->pid, &child_exit_value, 0);
+    } else if (cmdpipe->read_fd) {
+        close(cmdpipe->read_fd);
+    }
+
+    free(cmdpipe->reply_buffer);
+    free(cmdpipe->reply_line);
+
+    for (i = 0; i < PACKET_TEMPLATE_COUNT; i++) {
+        free(cmdpipe->template_arguments[i]);
     }
 
     memset(cmdpipe, 0, sizeof(struct packet_command_pipe_t));
 }
 
 
-/*  Start building the command string for the "send-probe" command  */
+/*
+    Start building the probe arguments shared by the "send-probe" and
+    "define-probe-template" commands
+*/
 static
-void construct_base_command(
+void construct_base_arguments(
     struct mtr_ctl *ctl,
     char *command,
     int buffer_size,
-    int command_token,
     ip_t * address,
     ip_t * localaddress)
 {
@@ -361,8 +807,11 @@ void construct_base_command(
         error(EXIT_FAILURE, errno, "invalid remote IP address");
     }
 
-    if (inet_ntop(ctl->af, localaddress,
-                  local_ip_string, INET6_ADDRSTRLEN) == NULL) {
+    /*  A remote agent chooses its own local address  */
+    if (localaddress == NULL) {
+        local_ip_string[0] = 0;
+    } else if (inet_ntop(ctl->af, localaddress,
+                         local_ip_string, INET6_ADDRSTRLEN) == NULL) {
 
         display_close(ctl);
         error(EXIT_FAILURE, errno, "invalid local IP address");
@@ -392,10 +841,14 @@ void construct_base_command(
               "protocol unsupported by mtr-packet interface");
     }
 
-    snprintf(command, buffer_size,
-             "%d send-probe %s %s %s %s protocol %s",
-             command_token,
-             ip_type, ip_string, local_ip_type, local_ip_string, protocol);
+    if (localaddress == NULL) {
+        snprintf(command, buffer_size, "%s %s protocol %s",
+                 ip_type, ip_string, protocol);
+    } else {
+        snprintf(command, buffer_size, "%s %s %s %s protocol %s",
+                 ip_type, ip_string, local_ip_type, local_ip_string,
+                 protocol);
+    }
 }
 
 
@@ -417,56 +870,264 @@ void append_command_argument(
 }
 
 
-/*  Request a new probe from the "mtr-packet" child process  */
-void send_probe_command(
+/*  A probe timeout in microseconds, as whole milliseconds, rounded up  */
+static
+int timeout_milliseconds(
+    int timeout)
+{
+    return (timeout + 999) / 1000;
+}
+
+/*
+    Build the arguments for a probe, other than the time-to-live,
+    which is the only argument varying between most probes to a host.
+*/
+static
+void construct_probe_arguments(
     struct mtr_ctl *ctl,
     struct packet_command_pipe_t *cmdpipe,
+    char *arguments,
+    int buffer_size,
     ip_t * address,
     ip_t * localaddress,
     int packet_size,
-    int sequence,
-    int time_to_live)
+    int local_port)
 {
-    char command[COMMAND_BUFFER_SIZE];
-    int remaining_size;
     int timeout;
 
-    construct_base_command(ctl, command, COMMAND_BUFFER_SIZE, sequence,
-                           address, localaddress);
+    construct_base_arguments(ctl, arguments, buffer_size,
+                             address, localaddress);
 
-    append_command_argument(command, COMMAND_BUFFER_SIZE, "size",
-                            packet_size);
+    append_command_argument(arguments, buffer_size, "size", packet_size);
 
-    append_command_argument(command, COMMAND_BUFFER_SIZE, "bit-pattern",
+    append_command_argument(arguments, buffer_size, "bit-pattern",
                             ctl->bitpattern);
 
-    append_command_argument(command, COMMAND_BUFFER_SIZE, "tos", ctl->tos);
-
-    append_command_argument(command, COMMAND_BUFFER_SIZE, "ttl",
-                            time_to_live);
+    append_command_argument(arguments, buffer_size, "tos", ctl->tos);
 
     timeout = ctl->probe_timeout / 1000000;
-    append_command_argument(command, COMMAND_BUFFER_SIZE, "timeout",
-                            timeout);
+    append_command_argument(arguments, buffer_size, "timeout", timeout);
 
     if (ctl->remoteport) {
-        append_command_argument(command, COMMAND_BUFFER_SIZE, "port",
+        append_command_argument(arguments, buffer_size, "port",
                                 ctl->remoteport);
     }
 
-    if (ctl->localport) {
-        append_command_argument(command, COMMAND_BUFFER_SIZE, "local-port",
-                                ctl->localport);
+    if (local_port) {
+        append_command_argument(arguments, buffer_size, "local-port",
+                                local_port);
     }
 #ifdef SO_MARK
     if (ctl->mark) {
-        append_command_argument(command, COMMAND_BUFFER_SIZE, "mark",
+        append_command_argument(arguments, buffer_size, "mark",
                                 ctl->mark);
     }
 #endif
 
-    remaining_size = COMMAND_BUFFER_SIZE - strlen(command) - 1;
-    strncat(command, "\n", remaining_size);
+    if (cmdpipe->tcp_syn_support) {
+        strncat(arguments, " tcp-method syn",
+                buffer_size - strlen(arguments) - 1);
+    }
+
+    if (cmdpipe->pace_support && ctl->burst_rate) {
+        append_command_argument(arguments, buffer_size, "pace-us",
+                                1000000 / ctl->burst_rate);
+    }
+}
+
+
+/*  Request a new probe from mtr-packet using a binary request record  */
+static
+void send_wire_probe_command(
+    struct mtr_ctl *ctl,
+    struct packet_command_pipe_t *cmdpipe,
+    ip_t * address,
+    ip_t * localaddress,
+    int packet_size,
+    int token,
+    int time_to_live,
+    int timeout,
+    int local_port)
+{
+    struct wire_request_t request;
+    uint8_t record[WIRE_REQUEST_SIZE];
+    int address_length;
+
+    memset(&request, 0, sizeof(struct wire_request_t));
+    request.token = token;
+    request.request_type = WIRE_REQUEST_SEND_PROBE;
+    request.protocol = ctl->mtrtype;
+    request.ttl = time_to_live;
+    request.packet_size = packet_size;
+    request.dest_port = ctl->remoteport;
+    request.local_port = local_port;
+    request.type_of_service = ctl->tos;
+    if (localaddress) {
+        request.flags = WIRE_FLAG_LOCAL_ADDRESS;
+    }
+    if (cmdpipe->tcp_syn_support) {
+        request.flags |= WIRE_FLAG_TCP_SYN;
+    }
+    if (cmdpipe->pace_support && ctl->burst_rate) {
+        request.flags |= WIRE_FLAG_PACE;
+        request.pace_interval = 1000000 / ctl->burst_rate;
+    }
+    request.bit_pattern = ctl->bitpattern;
+    if (cmdpipe->timeout_ms_support) {
+        request.flags |= WIRE_FLAG_TIMEOUT_MS;
+        request.timeout = timeout_milliseconds(timeout);
+    } else {
+        request.timeout = ctl->probe_timeout / 1000000;
+    }
+#ifdef SO_MARK
+    request.routing_mark = ctl->mark;
+#endif
+
+    if (ctl->af == AF_INET6) {
+        request.ip_version = 6;
+        address_length = sizeof(struct in6_addr);
+    } else {
+        request.ip_version = 4;
+        address_length = sizeof(struct in_addr);
+    }
+    memcpy(request.remote_address, address, address_length);
+    if (localaddress) {
+        memcpy(request.local_address, localaddress, address_length);
+    }
+
+    encode_wire_request(&request, record);
+
+    if (write(cmdpipe->write_fd, record, WIRE_REQUEST_SIZE) == -1) {
+        display_close(ctl);
+        error(EXIT_FAILURE, errno,
+              "mtr-packet command pipe write failure");
+    }
+}
+
+
+/*
+    Find the template id defined with a set of probe arguments.  With
+    --flows, --dual-stack or --concurrent, probes alternate between
+    several sets, each of which keeps an id of its own.  If no id has
+    the arguments, the least recently used id is replaced, and
+    'define' is set to indicate that it must be redefined.
+*/
+static
+int find_probe_template(
+    struct packet_command_pipe_t *cmdpipe,
+    const char *arguments,
+    int *define)
+{
+    int i;
+    int template_id = 0;
+
+    *define = 0;
+    cmdpipe->template_clock++;
+
+    for (i = 0; i < PACKET_TEMPLATE_COUNT; i++) {
+        if (cmdpipe->template_arguments[i] == NULL) {
+            template_id = i;
+            *define = 1;
+            break;
+        }
+
+        if (!strcmp(arguments, cmdpipe->template_arguments[i])) {
+            cmdpipe->template_used[i] = cmdpipe->template_clock;
+            return i;
+        }
+
+        if (cmdpipe->template_used[i] <
+            cmdpipe->template_used[template_id]) {
+            template_id = i;
+        }
+    }
+
+    free(cmdpipe->template_arguments[template_id]);
+    cmdpipe->template_arguments[template_id] = strdup(arguments);
+    if (cmdpipe->template_arguments[template_id] == NULL) {
+        error(EXIT_FAILURE, errno, "template arguments allocation");
+    }
+    cmdpipe->template_used[template_id] = cmdpipe->template_clock;
+    *define = 1;
+
+    return template_id;
+}
+
+
+/*
+    Request a new probe from the "mtr-packet" child process.  A local
+    port of zero is that of the command line, if any.
+*/
+void send_probe_command(
+    struct mtr_ctl *ctl,
+    struct packet_command_pipe_t *cmdpipe,
+    ip_t * address,
+    ip_t * localaddress,
+    int packet_size,
+    int token,
+    int time_to_live,
+    int timeout,
+    int local_port)
+{
+    char arguments[COMMAND_BUFFER_SIZE];
+    char command[2 * COMMAND_BUFFER_SIZE];
+    char timeout_arg[32] = "";
+    int template_id;
+    int define;
+
+    TRACE_PROBE2(mtr, send_probe_command, token, time_to_live);
+
+    /*  Our local address means nothing to a remote agent  */
+    if (cmdpipe->remote) {
+        localaddress = NULL;
+    }
+
+    if (local_port == 0) {
+        local_port = ctl->localport;
+    }
+
+    if (cmdpipe->binary_protocol) {
+        send_wire_probe_command(ctl, cmdpipe, address, localaddress,
+                                packet_size, token, time_to_live,
+                                timeout, local_port);
+        return;
+    }
+
+    /*
+       A timeout other than the default follows the time-to-live, so
+       that per-hop timeouts don't force the template to be redefined.
+     */
+    if (cmdpipe->timeout_ms_support && timeout != ctl->probe_timeout) {
+        snprintf(timeout_arg, sizeof(timeout_arg), " timeout-ms %d",
+                 timeout_milliseconds(timeout));
+    }
+
+    construct_probe_arguments(ctl, cmdpipe, arguments,
+                              COMMAND_BUFFER_SIZE, address, localaddress,
+                              packet_size, local_port);
+
+    if (cmdpipe->template_support) {
+        /*
+           Define a probe template only for probe arguments which no
+           template already has.  Otherwise, we only need to send the
+           time-to-live for the new probe.
+         */
+        template_id = find_probe_template(cmdpipe, arguments, &define);
+        if (define) {
+            snprintf(command, sizeof(command),
+                     "%d define-probe-template template %d %s\n"
+                     "%d send-template template %d ttl %d%s\n",
+                     token, template_id, arguments, token, template_id,
+                     time_to_live, timeout_arg);
+        } else {
+            snprintf(command, sizeof(command),
+                     "%d send-template template %d ttl %d%s\n",
+                     token, template_id, time_to_live, timeout_arg);
+        }
+    } else {
+        snprintf(command, sizeof(command), "%d send-probe %s ttl %d%s\n",
+                 token, arguments, time_to_live, timeout_arg);
+    }
 
     /*  Send a probe using the mtr-packet subprocess  */
     if (write(cmdpipe->write_fd, command, strlen(command)) == -1) {
@@ -615,12 +1276,8 @@ bool parse_reply_arguments(
 static
 void handle_reply_errors(
     struct mtr_ctl *ctl,
-    struct command_t *reply)
+    const char *reply_name)
 {
-    char *reply_name;
-
-    reply_name = reply->command_name;
-
     if (!strcmp(reply_name, "probes-exhausted")) {
         display_close(ctl);
         error(EXIT_FAILURE, 0, "Probes exhausted");
@@ -684,7 +1341,7 @@ void handle_command_reply(
         return;
     }
 
-    handle_reply_errors(ctl, &reply);
+    handle_reply_errors(ctl, reply.command_name);
 
     seq_num = reply.token;
     reply_name = reply.command_name;
@@ -697,6 +1354,10 @@ void handle_command_reply(
         err = ENETUNREACH;
     } else if (!strcmp(reply_name, "network-down")) {
         err = ENETDOWN;
+    } else if (!strcmp(reply_name, "no-reply")) {
+        /*  A probe which timed out has no address or round trip time  */
+        reply_func(ctl, seq_num, ETIMEDOUT, NULL, NULL, 0);
+        return;
     } else {
         /*  If the reply type is unknown, ignore it  */
         return;
@@ -716,123 +1377,301 @@ void handle_command_reply(
 
 
 /*
-    Check the command pipe for completed replies to commands
-    we have previously sent.  Record the results of those replies.
+    A complete binary reply record has arrived.  Record the responding
+    IP and round trip time, as handle_command_reply does for text.
 */
 static
-void consume_reply_buffer(
+void handle_wire_reply(
+    struct mtr_ctl *ctl,
+    const uint8_t *record,
+    probe_reply_func_t reply_func)
+{
+    struct wire_reply_t reply;
+    struct mplslen mpls;
+    ip_t fromaddress;
+    const char *reply_name;
+    int err;
+    int i;
+
+    decode_wire_reply(record, &reply);
+
+    reply_name = wire_reply_name(reply.reply_type);
+    if (reply_name == NULL) {
+        /*  If the reply type is unknown, ignore it  */
+        return;
+    }
+
+    handle_reply_errors(ctl, reply_name);
+
+    if (reply.reply_type == WIRE_REPLY_REPLY
+        || reply.reply_type == WIRE_REPLY_TTL_EXPIRED) {
+        err = 0;
+    } else if (reply.reply_type == WIRE_REPLY_NO_ROUTE) {
+        err = ENETUNREACH;
+    } else if (reply.reply_type == WIRE_REPLY_NETWORK_DOWN) {
+        err = ENETDOWN;
+    } else if (reply.reply_type == WIRE_REPLY_NO_REPLY) {
+        reply_func(ctl, reply.token, ETIMEDOUT, NULL, NULL, 0);
+        return;
+    } else {
+        return;
+    }
+
+    /*  Only replies carrying an address of our family have a result  */
+    memset(&fromaddress, 0, sizeof(ip_t));
+    if (ctl->af == AF_INET6 && reply.ip_version == 6) {
+        memcpy(&fromaddress, reply.address, sizeof(struct in6_addr));
+    } else if (ctl->af != AF_INET6 && reply.ip_version == 4) {
+        memcpy(&fromaddress, reply.address, sizeof(struct in_addr));
+    } else {
+        return;
+    }
+
+    memset(&mpls, 0, sizeof(struct mplslen));
+    for (i = 0; i < reply.mpls_count && i < MAXLABELS; i++) {
+        mpls.label[i] = reply.mpls[i].label;
+        mpls.exp[i] = reply.mpls[i].experimental_use;
+        mpls.s[i] = reply.mpls[i].bottom_of_stack;
+        mpls.ttl[i] = reply.mpls[i].ttl;
+    }
+    mpls.labels = i;
+
+    reply_func(ctl, reply.token, err, &mpls, (void *) &fromaddress,
+               reply.round_trip_us);
+}
+
+
+/*  Free the space used by replies which have been handled  */
+static
+void consume_reply_bytes(
+    struct packet_command_pipe_t *cmdpipe,
+    size_t length)
+{
+    cmdpipe->reply_buffer_start =
+        (cmdpipe->reply_buffer_start + length) % cmdpipe->reply_buffer_size;
+    cmdpipe->reply_buffer_used -= length;
+
+    /*  Restart at the front when empty, for the largest contiguous read  */
+    if (cmdpipe->reply_buffer_used == 0) {
+        cmdpipe->reply_buffer_start = 0;
+    }
+}
+
+
+/*
+    Find the next newline in the reply buffer, scanning from an offset
+    from the oldest unconsumed byte.  Returns the offset of the newline,
+    or -1 if there is no complete reply.
+*/
+static
+long find_reply_newline(
+    const struct packet_command_pipe_t *cmdpipe,
+    size_t offset)
+{
+    size_t pos;
+    size_t span;
+    char *newline;
+
+    while (offset < cmdpipe->reply_buffer_used) {
+        pos = (cmdpipe->reply_buffer_start + offset) %
+            cmdpipe->reply_buffer_size;
+
+        span = cmdpipe->reply_buffer_size - pos;
+        if (span > cmdpipe->reply_buffer_used - offset) {
+            span = cmdpipe->reply_buffer_used - offset;
+        }
+
+        newline = memchr(&cmdpipe->reply_buffer[pos], '\n', span);
+        if (newline) {
+            return offset + (newline - &cmdpipe->reply_buffer[pos]);
+        }
+
+        offset += span;
+    }
+
+    return -1;
+}
+
+
+/*
+    Handle all complete binary reply records in the reply buffer,
+    leaving any partial record for a later read.
+*/
+static
+void consume_wire_replies(
     struct mtr_ctl *ctl,
     struct packet_command_pipe_t *cmdpipe,
     probe_reply_func_t reply_func)
 {
-    char *reply_buffer;
-    char *reply_start;
-    char *end_of_reply;
-    int used_size;
-    int move_size;
+    uint8_t wrapped_record[WIRE_REPLY_SIZE];
+    const uint8_t *record;
+    size_t start;
+
+    while (cmdpipe->reply_buffer_used >= WIRE_REPLY_SIZE) {
+        start = cmdpipe->reply_buffer_start;
 
-    reply_buffer = cmdpipe->reply_buffer;
+        if (start + WIRE_REPLY_SIZE <= cmdpipe->reply_buffer_size) {
+            record = (uint8_t *) &cmdpipe->reply_buffer[start];
+        } else {
+            copy_reply_bytes(cmdpipe, 0, WIRE_REPLY_SIZE,
+                             (char *) wrapped_record);
+            record = wrapped_record;
+        }
 
-    /*  Terminate the string storing the replies  */
-    assert(cmdpipe->reply_buffer_used < PACKET_REPLY_BUFFER_SIZE);
-    reply_buffer[cmdpipe->reply_buffer_used] = 0;
+        handle_wire_reply(ctl, record, reply_func);
+        consume_reply_bytes(cmdpipe, WIRE_REPLY_SIZE);
+    }
+}
 
-    reply_start = reply_buffer;
+
+/*
+    Check the command pipe for completed replies to commands
+    we have previously sent.  Record the results of those replies.
+*/
+static
+void consume_reply_buffer(
+    struct mtr_ctl *ctl,
+    struct packet_command_pipe_t *cmdpipe,
+    probe_reply_func_t reply_func)
+{
+    char *reply;
+    size_t start;
+    long newline;
 
     /*
        We may have multiple completed replies.  Loop until we don't
        have any more newlines termininating replies.
      */
     while (true) {
-        /*  If no newline is found, our reply isn't yet complete  */
-        end_of_reply = index(reply_start, '\n');
-        if (end_of_reply == NULL) {
+        /*
+           Bytes scanned by an earlier call are known to hold no
+           newline, so we needn't scan them again.
+         */
+        newline = find_reply_newline(cmdpipe, cmdpipe->reply_buffer_scanned);
+        if (newline == -1) {
             /*  No complete replies remaining  */
+            cmdpipe->reply_buffer_scanned = cmdpipe->reply_buffer_used;
             break;
         }
 
         /*
-           Terminate the reply string at the newline, which
-           is necessary in the case where we are able to read
-           mulitple replies arriving simultaneously.
+           Terminate the reply string at the newline.  A reply which
+           wraps around the end of the buffer is first copied to
+           contiguous storage.
          */
-        *end_of_reply = 0;
+        start = cmdpipe->reply_buffer_start;
+        if (start + newline < cmdpipe->reply_buffer_size) {
+            reply = &cmdpipe->reply_buffer[start];
+        } else {
+            reply = cmdpipe->reply_line;
+            copy_reply_bytes(cmdpipe, 0, newline, reply);
+        }
+        reply[newline] = 0;
 
         /*  Parse and record the reply results  */
-        handle_command_reply(ctl, reply_start, reply_func);
+        handle_command_reply(ctl, reply, reply_func);
 
-        reply_start = end_of_reply + 1;
+        consume_reply_bytes(cmdpipe, newline + 1);
+        cmdpipe->reply_buffer_scanned = 0;
     }
+}
 
-    /*
-       After replies have been processed, free the space used
-       by the replies, and move any remaining partial reply text
-       to the start of the reply buffer.
-     */
-    used_size = reply_start - reply_buffer;
-    move_size = cmdpipe->reply_buffer_used - used_size;
-    memmove(reply_buffer, reply_start, move_size);
-    cmdpipe->reply_buffer_used -= used_size;
 
-    if (cmdpipe->reply_buffer_used >= PACKET_REPLY_BUFFER_SIZE - 1) {
-        /*
-           We've overflowed the reply buffer without a complete reply.
-           There's not much we can do about it but discard the data
-           we've got and hope new data coming in fits.
-         */
-        cmdpipe->reply_buffer_used = 0;
+/*
+    Make room in a full reply buffer by growing it.  Only when the
+    buffer is already at its maximum size, and still holds no complete
+    reply, is the data discarded.
+*/
+static
+void grow_reply_buffer(
+    struct packet_command_pipe_t *cmdpipe)
+{
+    size_t size;
+
+    size = cmdpipe->reply_buffer_size * 2;
+    if (size <= PACKET_REPLY_BUFFER_MAX_SIZE
+        && !resize_reply_buffer(cmdpipe, size)) {
+        return;
     }
+
+    /*
+       We've overflowed the reply buffer without a complete reply.
+       There's not much we can do about it but discard the data
+       we've got and hope new data coming in fits.
+     */
+    cmdpipe->reply_buffer_start = 0;
+    cmdpipe->reply_buffer_used = 0;
+    cmdpipe->reply_buffer_scanned = 0;
 }
 
 
 /*
-    Read as much as we can from the reply pipe from the child process, and
-    process as many replies as are available.
+    Read from the reply pipe from the child process until no data
+    remains, processing replies as they are completed.
 */
 void handle_command_replies(
     struct mtr_ctl *ctl,
     struct packet_command_pipe_t *cmdpipe,
     probe_reply_func_t reply_func)
 {
-    int read_count;
-    int buffer_remaining;
-    char *reply_buffer;
-    char *read_buffer;
-
-    reply_buffer = cmdpipe->reply_buffer;
+    ssize_t read_count;
+    size_t read_pos;
+    size_t read_size;
 
-    /*
-       Read the available reply text, up to the the remaining
-       buffer space.  (Minus one for the terminating NUL.)
-     */
-    read_buffer = &reply_buffer[cmdpipe->reply_buffer_used];
-    buffer_remaining =
-        PACKET_REPLY_BUFFER_SIZE - cmdpipe->reply_buffer_used;
-    read_count = read(cmdpipe->read_fd, read_buffer, buffer_remaining - 1);
+    while (true) {
+        if (cmdpipe->reply_buffer_used == cmdpipe->reply_buffer_size) {
+            grow_reply_buffer(cmdpipe);
+        }
 
-    if (read_count < 0) {
         /*
-           EAGAIN simply indicates that there is no data currently
-           available on our non-blocking pipe.
+           Read into the free space following the used portion of the
+           buffer, up to either the end of the buffer, or the start of
+           the used portion, if the used portion has wrapped.
          */
-        if (errno == EAGAIN) {
-            return;
+        read_pos =
+            cmdpipe->reply_buffer_start + cmdpipe->reply_buffer_used;
+        if (read_pos < cmdpipe->reply_buffer_size) {
+            read_size = cmdpipe->reply_buffer_size - read_pos;
+        } else {
+            read_pos -= cmdpipe->reply_buffer_size;
+            read_size = cmdpipe->reply_buffer_start - read_pos;
         }
 
-        display_close(ctl);
-        error(EXIT_FAILURE, errno, "command reply read failure");
-        return;
-    }
+        read_count = read(cmdpipe->read_fd,
+                          &cmdpipe->reply_buffer[read_pos], read_size);
 
-    if (read_count == 0) {
-        display_close(ctl);
+        if (read_count < 0) {
+            /*
+               EAGAIN simply indicates that there is no data currently
+               available on our non-blocking pipe.
+             */
+            if (errno == EAGAIN) {
+                return;
+            }
 
-        errno = EPIPE;
-        error(EXIT_FAILURE, EPIPE, "unexpected packet generator exit");
-    }
+            if (errno == EINTR) {
+                continue;
+            }
 
-    cmdpipe->reply_buffer_used += read_count;
+            display_close(ctl);
+            error(EXIT_FAILURE, errno, "command reply read failure");
+            return;
+        }
 
-    /*  Handle any replies completed by this read  */
-    consume_reply_buffer(ctl, cmdpipe, reply_func);
+        if (read_count == 0) {
+            display_close(ctl);
+
+            errno = EPIPE;
+            error(EXIT_FAILURE, EPIPE, "unexpected packet generator exit");
+        }
+
+        cmdpipe->reply_buffer_used += read_count;
+
+        /*  Handle any replies completed by this read  */
+        if (cmdpipe->binary_protocol) {
+            consume_wire_replies(ctl, cmdpipe, reply_func);
+        } else {
+            consume_reply_buffer(ctl, cmdpipe, reply_func);
+        }
+    }
 }
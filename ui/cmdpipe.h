@@ -24,6 +24,15 @@
 #define COMMAND_BUFFER_SIZE 4096
 #define PACKET_REPLY_BUFFER_SIZE 4096
 
+/*  Milliseconds we wait for each step of authenticating with an agent  */
+#define AGENT_TIMEOUT 10000
+
+/*  The probe templates mtr-packet holds for us, each with its own id  */
+#define PACKET_TEMPLATE_COUNT 64
+
+/*  The reply buffer grows to hold bursts of replies, up to this size  */
+#define PACKET_REPLY_BUFFER_MAX_SIZE (1024 * 1024)
+
 /*  We use a pipe to the mtr-packet subprocess to generate probes  */
 struct packet_command_pipe_t {
     /*  the process id of mtr-packet  */
@@ -35,18 +44,64 @@ struct packet_command_pipe_t {
     /*  the end of the pipe we write for commands  */
     int write_fd;
 
-    /* storage for incoming replies */
-    char reply_buffer[PACKET_REPLY_BUFFER_SIZE];
+    /*  storage for incoming replies, used as a circular buffer  */
+    char *reply_buffer;
+
+    /*  the allocated size of reply_buffer  */
+    size_t reply_buffer_size;
+
+    /*  the offset of the oldest unconsumed byte in reply_buffer  */
+    size_t reply_buffer_start;
 
     /*  the number of bytes currently used in reply_buffer  */
     size_t reply_buffer_used;
+
+    /*  the number of used bytes known to hold no complete reply  */
+    size_t reply_buffer_scanned;
+
+    /*  storage for a text reply which wraps around the buffer's end  */
+    char *reply_line;
+
+    /*  nonzero if mtr-packet supports the "probe-template" feature  */
+    int template_support;
+
+    /*
+       the probe arguments with which each template id was last
+       defined, or NULL for an id not yet defined
+     */
+    char *template_arguments[PACKET_TEMPLATE_COUNT];
+
+    /*  when each template id was last used, to replace the oldest  */
+    unsigned long template_used[PACKET_TEMPLATE_COUNT];
+
+    /*  the count of probes sent from templates  */
+    unsigned long template_clock;
+
+    /*  nonzero after switching mtr-packet to binary request records  */
+    int binary_protocol;
+
+    /*  nonzero if TCP probes are to be sent as raw SYN segments  */
+    int tcp_syn_support;
+
+    /*  nonzero if probe timeouts may be given in milliseconds  */
+    int timeout_ms_support;
+
+    /*  nonzero if mtr-packet paces the probes of a burst itself  */
+    int pace_support;
+
+    /*  nonzero for a remote agent, which chooses its own local address  */
+    int remote;
 };
 
+/*
+    Called for each probe result.  A probe which timed out is reported
+    with ETIMEDOUT, and with neither an address nor MPLS labels.
+*/
 typedef
 void (
     *probe_reply_func_t) (
     struct mtr_ctl * ctl,
-    int sequence,
+    int token,
     int err,
     struct mplslen * mpls,
     ip_t * addr,
@@ -54,7 +109,8 @@ void (
 
 int open_command_pipe(
     struct mtr_ctl *ctl,
-    struct packet_command_pipe_t *cmdpipe);
+    struct packet_command_pipe_t *cmdpipe,
+    const char *agent);
 
 void close_command_pipe(
     struct packet_command_pipe_t *cmdpipe);
@@ -65,8 +121,10 @@ void send_probe_command(
     ip_t * address,
     ip_t * localaddress,
     int packet_size,
-    int sequence,
-    int time_to_live);
+    int token,
+    int time_to_live,
+    int timeout,
+    int local_port);
 
 void handle_command_replies(
     struct mtr_ctl *ctl,
@@ -63,11 +63,32 @@
 #include "asn.h"
 #include "display.h"
 #include "utils.h"
+#include "addrtab.h"
 
 
 enum { NUM_FACTORS = 8 };
 static double factors[NUM_FACTORS];
 static int scale[NUM_FACTORS];
+
+/*
+    What the screen shows, so that a redraw need draw only the hops
+    which have changed since, as on a slow terminal, drawing every hop
+    for every reply leaves mtr's output, and its keys, lagging.
+*/
+static struct {
+    int valid;                  /* whether the screen is as noted here */
+    struct net_session *net;
+    int display_mode;
+    int maxx, maxy;
+    int min, max;               /* the hops shown */
+    int startstat;              /* the column of the statistics */
+    int cols;                   /* the columns of the graph */
+    int newest;                 /* the newest column of the history */
+    int scale[NUM_FACTORS];
+    int row[MaxHost];           /* the line on which each hop starts */
+    int lines[MaxHost];         /* and the lines it takes */
+    unsigned long changed[MaxHost];     /* its changes when drawn */
+} screen;
 static char block_map[NUM_FACTORS];
 
 enum { black = 1, red, green, yellow, blue, magenta, cyan, white };
@@ -133,6 +154,9 @@ int mtr_curses_keyaction(
     float f = 0.0;
     char buf[MAXFLD + 1];
 
+    /*  Prompts and settings changed by keys are redrawn in full  */
+    screen.valid = 0;
+
     if (c == 'Q') {             /* must be checked before c = tolower(c) */
         mvprintw(2, 0, "Type of Service(tos): %d\n", ctl->tos);
         mvprintw(3, 0,
@@ -396,15 +420,14 @@ static void format_field(
     }
 }
 
-static void mtr_curses_hosts(
+static void mtr_curses_host(
     struct mtr_ctl *ctl,
+    int at,
     int startstat)
 {
-    int max;
-    int at;
     struct mplslen *mpls, *mplss;
-    ip_t *addr, *addrs;
-    int addrcmp_result;
+    int addr, addrs;
+    int paths;
     int err;
     int y;
     char *name;
@@ -414,102 +437,133 @@ static void mtr_curses_hosts(
     char buf[1024];
     int __unused_int ATTRIBUTE_UNUSED;
 
-    max = net_max(ctl);
+    printw("%2d. ", at + 1);
+    err = net_err(ctl->net, at);
+    addr = net_addr_id(ctl->net, at);
+    mpls = net_mpls(ctl->net, at);
 
-    for (at = net_min(ctl) + ctl->display_offset; at < max; at++) {
-        printw("%2d. ", at + 1);
-        err = net_err(at);
-        addr = net_addr(at);
-        mpls = net_mpls(at);
+    if (err == 0 && addr != 0) {
+        name = dns_lookup(ctl, addr);
+        if (!net_up(ctl->net, at))
+            attron(A_BOLD);
+#ifdef HAVE_IPINFO
+        if (is_printii(ctl))
+            printw(fmt_ipinfo(ctl, addr));
+#endif
+        if (name != NULL) {
+            if (ctl->show_ips)
+                printw("%s (%s)", name, addr_text(addr));
+            else
+                printw("%s", name);
+        } else {
+            printw("%s", addr_text(addr));
+        }
+        attroff(A_BOLD);
+
+        getyx(stdscr, y, __unused_int);
+        move(y, startstat);
 
-        addrcmp_result = addrcmp(
-            (void *) addr, (void *) &ctl->unspec_addr, ctl->af);
+        /* net_xxx returns times in usecs. Just display millisecs */
+        hd_len = 0;
+        for (i = 0; i < MAXFLD; i++) {
+            /* Ignore options that don't exist */
+            /* On the other hand, we now check the input side. Shouldn't happen, 
+               can't be careful enough. */
+            j = ctl->fld_index[ctl->fld_active[i]];
+            if (j == -1)
+                continue;
+            format_field(buf + hd_len, sizeof(buf) - hd_len,
+                         data_fields[j].format,
+                         data_fields[j].net_xxx(ctl->net, at));
+            hd_len += data_fields[j].length;
+        }
+        buf[hd_len] = 0;
+        printw("%s", buf);
 
-        if (err == 0 && addrcmp_result != 0) {
-            name = dns_lookup(ctl, addr);
-            if (!net_up(at))
+        for (k = 0; k < mpls->labels && ctl->enablempls; k++) {
+            printw("\n    [MPLS: Lbl %lu Exp %u S %u TTL %u]",
+                   mpls->label[k], mpls->exp[k], mpls->s[k],
+                   mpls->ttl[k]);
+        }
+
+        /* Multi path, each with its own results with --flows */
+        paths = net_path_count(ctl->net, at);
+        for (i = 0; i < paths; i++) {
+            addrs = net_addrs_id(ctl->net, at, i);
+            mplss = net_mplss(ctl->net, at, i);
+            if (addrs == addr && !(ctl->flows && paths > 1))
+                continue;
+
+            name = dns_lookup(ctl, addrs);
+            if (!net_up(ctl->net, at))
                 attron(A_BOLD);
+            printw("\n    ");
 #ifdef HAVE_IPINFO
             if (is_printii(ctl))
-                printw(fmt_ipinfo(ctl, addr));
+                printw(fmt_ipinfo(ctl, addrs));
 #endif
             if (name != NULL) {
                 if (ctl->show_ips)
-                    printw("%s (%s)", name, strlongip(ctl, addr));
+                    printw("%s (%s)", name, addr_text(addrs));
                 else
                     printw("%s", name);
             } else {
-                printw("%s", strlongip(ctl, addr));
+                printw("%s", addr_text(addrs));
             }
-            attroff(A_BOLD);
-
-            getyx(stdscr, y, __unused_int);
-            move(y, startstat);
-
-            /* net_xxx returns times in usecs. Just display millisecs */
-            hd_len = 0;
-            for (i = 0; i < MAXFLD; i++) {
-                /* Ignore options that don't exist */
-                /* On the other hand, we now check the input side. Shouldn't happen, 
-                   can't be careful enough. */
-                j = ctl->fld_index[ctl->fld_active[i]];
-                if (j == -1)
-                    continue;
-                format_field(buf + hd_len, sizeof(buf) - hd_len,
-                             data_fields[j].format,
-                             data_fields[j].net_xxx(at));
-                hd_len += data_fields[j].length;
+            if (ctl->flows) {
+                printw("  (%d sent, %.1f%% loss, %.1f ms)",
+                       net_path_xmit(ctl->net, at, i),
+                       net_path_loss(ctl->net, at, i) / 1000.0,
+                       net_path_avg(ctl->net, at, i) / 1000.0);
             }
-            buf[hd_len] = 0;
-            printw("%s", buf);
-
-            for (k = 0; k < mpls->labels && ctl->enablempls; k++) {
+            for (k = 0; k < mplss->labels && ctl->enablempls; k++) {
                 printw("\n    [MPLS: Lbl %lu Exp %u S %u TTL %u]",
-                       mpls->label[k], mpls->exp[k], mpls->s[k],
-                       mpls->ttl[k]);
-            }
-
-            /* Multi path */
-            for (i = 0; i < MAXPATH; i++) {
-                addrs = net_addrs(at, i);
-                mplss = net_mplss(at, i);
-                if (addrcmp((void *) addrs, (void *) addr, ctl->af) == 0)
-                    continue;
-                if (addrcmp
-                    ((void *) addrs, (void *) &ctl->unspec_addr,
-                     ctl->af) == 0)
-                    break;
-
-                name = dns_lookup(ctl, addrs);
-                if (!net_up(at))
-                    attron(A_BOLD);
-                printw("\n    ");
-#ifdef HAVE_IPINFO
-                if (is_printii(ctl))
-                    printw(fmt_ipinfo(ctl, addrs));
-#endif
-                if (name != NULL) {
-                    if (ctl->show_ips)
-                        printw("%s (%s)", name, strlongip(ctl, addrs));
-                    else
-                        printw("%s", name);
-                } else {
-                    printw("%s", strlongip(ctl, addrs));
-                }
-                for (k = 0; k < mplss->labels && ctl->enablempls; k++) {
-                    printw("\n    [MPLS: Lbl %lu Exp %u S %u TTL %u]",
-                           mplss->label[k], mplss->exp[k], mplss->s[k],
-                           mplss->ttl[k]);
-                }
-                attroff(A_BOLD);
+                       mplss->label[k], mplss->exp[k], mplss->s[k],
+                       mplss->ttl[k]);
             }
-        } else {
-            attron(A_BOLD);
-            printw("(%s)", host_error_to_string(err));
             attroff(A_BOLD);
         }
+    } else {
+        attron(A_BOLD);
+        printw("(%s)", host_error_to_string(err));
+        attroff(A_BOLD);
+    }
 
-        printw("\n");
+    printw("\n");
+}
+
+
+/*  Note where a hop was drawn, and as of which of its changes  */
+static void mtr_curses_drawn(
+    struct mtr_ctl *ctl,
+    int at,
+    int row)
+{
+    int y;
+    int __unused_int ATTRIBUTE_UNUSED;
+
+    getyx(stdscr, y, __unused_int);
+    screen.row[at] = row;
+    screen.lines[at] = y - row;
+    screen.changed[at] = net_hop_changed(ctl->net, at);
+}
+
+
+static void mtr_curses_hosts(
+    struct mtr_ctl *ctl,
+    int startstat)
+{
+    int max;
+    int at;
+    int y;
+    int __unused_int ATTRIBUTE_UNUSED;
+
+    max = net_max(ctl, ctl->net);
+
+    for (at = net_min(ctl) + ctl->display_offset; at < max; at++) {
+        getyx(stdscr, y, __unused_int);
+        mtr_curses_host(ctl, at, startstat);
+        mtr_curses_drawn(ctl, at, y);
     }
     move(2, 0);
 }
@@ -517,7 +571,7 @@ static void mtr_curses_hosts(
 static void mtr_gen_scale(
     struct mtr_ctl *ctl)
 {
-    int *saved, i, max, at;
+    int *saved, i, max, at, oldest, count;
     int range;
     static int low_ms, high_ms;
 
@@ -527,10 +581,11 @@ static void mtr_gen_scale(
     for (i = 0; i < NUM_FACTORS; i++) {
         scale[i] = 0;
     }
-    max = net_max(ctl);
+    max = net_max(ctl, ctl->net);
     for (at = ctl->display_offset; at < max; at++) {
-        saved = net_saved_pings(at);
-        for (i = 0; i < SAVED_PINGS; i++) {
+        saved = net_saved_pings(ctl->net, at, &oldest);
+        count = net_saved_count(ctl->net);
+        for (i = 0; i < count; i++) {
             if (saved[i] < 0)
                 continue;
             if (saved[i] < low_ms) {
@@ -594,10 +649,13 @@ static void mtr_fill_graph(
     int cols)
 {
     int *saved;
-    int i;
+    int i, oldest, count;
 
-    saved = net_saved_pings(at);
-    for (i = SAVED_PINGS - cols; i < SAVED_PINGS; i++) {
+    /*  The history is a ring, with the newest pings drawn rightmost  */
+    saved = net_saved_pings(ctl->net, at, &oldest);
+    count = net_saved_count(ctl->net);
+    for (; cols > 0; cols--) {
+        i = (oldest + count - cols) % count;
         if (saved[i] == -2) {
             printw(" ");
         } else if (saved[i] == -1) {
@@ -619,56 +677,139 @@ static void mtr_fill_graph(
 }
 
 
-static void mtr_curses_graph(
+static void mtr_curses_graph_host(
     struct mtr_ctl *ctl,
+    int at,
     int startstat,
     int cols)
 {
-    int max, at, y, err;
-    ip_t *addr;
+    int y, err;
+    int addr;
     char *name;
     int __unused_int ATTRIBUTE_UNUSED;
 
-    max = net_max(ctl);
+    printw("%2d. ", at + 1);
 
-    for (at = ctl->display_offset; at < max; at++) {
-        printw("%2d. ", at + 1);
+    addr = net_addr_id(ctl->net, at);
+    err = net_err(ctl->net, at);
 
-        addr = net_addr(at);
-        err = net_err(at);
+    if (err == 0 && addr != 0) {
 
-        if (!addr) {
-            printw("(%s)", host_error_to_string(err));
-            continue;
+        if (!net_up(ctl->net, at)) {
+            attron(A_BOLD);
         }
 
-        if (err == 0
-            && addrcmp((void *) addr, (void *) &ctl->unspec_addr, ctl->af)) {
-
-            if (!net_up(at)) {
-                attron(A_BOLD);
-            }
-
 #ifdef HAVE_IPINFO
-            if (is_printii(ctl))
-                printw(fmt_ipinfo(ctl, addr));
+        if (is_printii(ctl))
+            printw(fmt_ipinfo(ctl, addr));
 #endif
-            name = dns_lookup(ctl, addr);
-            printw("%s", name ? name : strlongip(ctl, addr));
-        } else {
-            attron(A_BOLD);
-            printw("(%s)", host_error_to_string(err));
-        }
+        name = dns_lookup(ctl, addr);
+        printw("%s", name ? name : addr_text(addr));
+    } else {
+        attron(A_BOLD);
+        printw("(%s)", host_error_to_string(err));
+    }
 
-        attroff(A_BOLD);
+    attroff(A_BOLD);
+
+    getyx(stdscr, y, __unused_int);
+    move(y, startstat);
+
+    printw(" ");
+    mtr_fill_graph(ctl, at, cols);
+    printw("\n");
+}
 
+
+static void mtr_curses_graph(
+    struct mtr_ctl *ctl,
+    int startstat,
+    int cols)
+{
+    int max, at, y;
+    int __unused_int ATTRIBUTE_UNUSED;
+
+    max = net_max(ctl, ctl->net);
+
+    for (at = ctl->display_offset; at < max; at++) {
         getyx(stdscr, y, __unused_int);
-        move(y, startstat);
+        mtr_curses_graph_host(ctl, at, startstat, cols);
+        mtr_curses_drawn(ctl, at, y);
+    }
+}
 
-        printw(" ");
-        mtr_fill_graph(ctl, at, cols);
-        printw("\n");
+
+/*
+    Redraw only the hops which have changed since the screen was last
+    drawn in full, on the lines where they were drawn then.  Returns 0
+    if the screen must be drawn in full instead, as when the path has
+    grown, or a hop now takes more or fewer lines.
+*/
+static int mtr_curses_update(
+    struct mtr_ctl *ctl,
+    int maxx,
+    int maxy)
+{
+    int min, max, at, i, y;
+    int all = 0;
+    time_t t;
+    int __unused_int ATTRIBUTE_UNUSED;
+
+    if (!screen.valid || screen.net != ctl->net
+        || screen.display_mode != ctl->display_mode
+        || screen.maxx != maxx || screen.maxy != maxy) {
+        return 0;
+    }
+
+    if (ctl->display_mode == DisplayModeDefault) {
+        min = net_min(ctl) + ctl->display_offset;
+    } else {
+        min = ctl->display_offset;
+
+        /*  A new column shifts every graph, and a new scale redraws it  */
+        mtr_gen_scale(ctl);
+        if (memcmp(scale, screen.scale, sizeof(scale))) {
+            return 0;
+        }
+        all = net_saved_newest(ctl->net) != screen.newest;
+        screen.newest = net_saved_newest(ctl->net);
+    }
+    max = net_max(ctl, ctl->net);
+    if (min != screen.min || max != screen.max) {
+        return 0;
+    }
+
+    for (at = min; at < max; at++) {
+        if (!all && net_hop_changed(ctl->net, at) == screen.changed[at]) {
+            continue;
+        }
+        if (screen.row[at] + screen.lines[at] >= maxy) {
+            return 0;
+        }
+
+        for (i = 0; i < screen.lines[at]; i++) {
+            move(screen.row[at] + i, 0);
+            clrtoeol();
+        }
+        move(screen.row[at], 0);
+        if (ctl->display_mode == DisplayModeDefault) {
+            mtr_curses_host(ctl, at, screen.startstat);
+        } else {
+            mtr_curses_graph_host(ctl, at, screen.startstat, screen.cols);
+        }
+
+        getyx(stdscr, y, __unused_int);
+        if (y != screen.row[at] + screen.lines[at]) {
+            return 0;
+        }
+        screen.changed[at] = net_hop_changed(ctl->net, at);
     }
+
+    t = time(NULL);
+    mvprintw(1, maxx - 25, iso_time(&t));
+    move(2, 0);
+
+    return 1;
 }
 
 
@@ -679,16 +820,20 @@ void mtr_curses_redraw(
     int startstat;
     int rowstat;
     time_t t;
-    int __unused_int ATTRIBUTE_UNUSED;
 
     int i, j;
     int hd_len = 0;
     char buf[1024];
     char fmt[16];
+    int maxy;
 
+    getmaxyx(stdscr, maxy, maxx);
+    if (mtr_curses_update(ctl, maxx, maxy)) {
+        refresh();
+        return;
+    }
 
     erase();
-    getmaxyx(stdscr, __unused_int, maxx);
 
     rowstat = 5;
 
@@ -699,7 +844,7 @@ void mtr_curses_redraw(
     pwcenter(buf);
     attroff(A_BOLD);
 
-    mvprintw(1, 0, "%s (%s)", ctl->LocalHostname, net_localaddr());
+    mvprintw(1, 0, "%s (%s)", ctl->LocalHostname, net_localaddr(ctl->net));
     t = time(NULL);
     mvprintw(1, maxx - 25, iso_time(&t));
     printw("\n");
@@ -745,7 +890,9 @@ void mtr_curses_redraw(
         attroff(A_BOLD);
 
         move(rowstat, 0);
-        mtr_curses_hosts(ctl, maxx - hd_len - 1);
+        screen.startstat = maxx - hd_len - 1;
+        screen.min = net_min(ctl) + ctl->display_offset;
+        mtr_curses_hosts(ctl, screen.startstat);
 
     } else {
         char msg[80];
@@ -756,8 +903,9 @@ void mtr_curses_redraw(
         if (is_printii(ctl))
             padding += get_iiwidth(ctl->ipinfo_no);
 #endif
-        max_cols =
-            maxx <= SAVED_PINGS + padding ? maxx - padding : SAVED_PINGS;
+        max_cols = net_saved_count(ctl->net);
+        if (maxx <= max_cols + padding)
+            max_cols = maxx - padding;
         startstat = padding - 2;
 
         snprintf(msg, sizeof(msg), " Last %3d pings", max_cols);
@@ -767,6 +915,11 @@ void mtr_curses_redraw(
         move(rowstat, 0);
 
         mtr_gen_scale(ctl);
+        memcpy(screen.scale, scale, sizeof(scale));
+        screen.newest = net_saved_newest(ctl->net);
+        screen.startstat = startstat;
+        screen.cols = max_cols;
+        screen.min = ctl->display_offset;
         mtr_curses_graph(ctl, startstat, max_cols);
 
         printw("\n");
@@ -787,6 +940,13 @@ void mtr_curses_redraw(
         attrset(A_NORMAL);
     }
 
+    screen.valid = 1;
+    screen.net = ctl->net;
+    screen.display_mode = ctl->display_mode;
+    screen.maxx = maxx;
+    screen.maxy = maxy;
+    screen.max = net_max(ctl, ctl->net);
+
     refresh();
 }
 
@@ -807,6 +967,7 @@ void mtr_curses_open(
         init_pair(i + 1, i, bg_col);
 
     mtr_curses_init();
+    screen.valid = 0;
     mtr_curses_redraw(ctl);
 }
 
@@ -825,3 +986,11 @@ void mtr_curses_clear(
     mtr_curses_close();
     mtr_curses_open(ctl);
 }
+
+
+/*  Have the next redraw draw everything, as when names have resolved  */
+void mtr_curses_invalidate(
+    void)
+{
+    screen.valid = 0;
+}
@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #include <time.h>
 
 #include "mtr.h"
@@ -73,10 +74,15 @@ void display_detect(
 void display_open(
     struct mtr_ctl *ctl)
 {
+#ifdef HAVE_IPINFO
+    /*  Every display may show ipinfo, and -y may be chosen at run time  */
+    asn_open(ctl);
+#endif
+
     switch (ctl->DisplayMode) {
 
     case DisplayReport:
-        report_open();
+        report_open(ctl);
         break;
     case DisplayTXT:
         txt_open();
@@ -84,18 +90,21 @@ void display_open(
     case DisplayJSON:
         json_open();
         break;
+    case DisplayNDJSON:
+        ndjson_open();
+        break;
     case DisplayXML:
         xml_open();
         break;
     case DisplayCSV:
         csv_open();
         break;
+    case DisplayRaw:
+        raw_open(ctl);
+        break;
 #ifdef HAVE_CURSES
     case DisplayCurses:
         mtr_curses_open(ctl);
-#ifdef HAVE_IPINFO
-        asn_open(ctl);
-#endif
         break;
 #endif
     case DisplaySplit:
@@ -104,9 +113,6 @@ void display_open(
 #ifdef HAVE_GTK
     case DisplayGTK:
         gtk_open(ctl);
-#ifdef HAVE_IPINFO
-        asn_open(ctl);
-#endif
         break;
 #endif
     }
@@ -130,17 +136,20 @@ void display_close(
     case DisplayJSON:
         json_close(ctl);
         break;
+    case DisplayNDJSON:
+        ndjson_close(ctl);
+        break;
     case DisplayXML:
         xml_close(ctl);
         break;
     case DisplayCSV:
         csv_close(ctl, now);
         break;
+    case DisplayRaw:
+        raw_close();
+        break;
 #ifdef HAVE_CURSES
     case DisplayCurses:
-#ifdef HAVE_IPINFO
-        asn_close(ctl);
-#endif
         mtr_curses_close();
         break;
 #endif
@@ -153,6 +162,10 @@ void display_close(
         break;
 #endif
     }
+
+#ifdef HAVE_IPINFO
+    asn_close(ctl);
+#endif
 }
 
 
@@ -207,7 +220,7 @@ void display_rawxmit(
     int seq)
 {
     if (ctl->DisplayMode == DisplayRaw)
-        raw_rawxmit(host, seq);
+        raw_rawxmit(ctl, host, seq);
 }
 
 
@@ -225,10 +238,32 @@ void display_rawping(
 void display_rawhost(
     struct mtr_ctl *ctl,
     int host,
-    ip_t * ip_addr)
+    int addr_id)
 {
     if (ctl->DisplayMode == DisplayRaw)
-        raw_rawhost(ctl, host, ip_addr);
+        raw_rawhost(ctl, host, addr_id);
+#ifdef HAVE_IPINFO
+    asn_prefetch(ctl, addr_id);
+#endif
+}
+
+
+/*  Note the end of a cycle of probes, for displays which stream  */
+void display_cycle(
+    struct mtr_ctl *ctl,
+    int cycle)
+{
+    if (ctl->DisplayMode == DisplayNDJSON)
+        ndjson_cycle(ctl, cycle);
+}
+
+
+/*  Write out what the display has buffered, once each pass of the loop  */
+void display_flush(
+    struct mtr_ctl *ctl)
+{
+    if (ctl->DisplayMode == DisplayRaw)
+        raw_flush(ctl);
 }
 
 
@@ -275,3 +310,14 @@ char *host_error_to_string(
 
     return strerror(err);
 }
+
+
+/*  Have the next redraw draw every hop, as names or ipinfo have changed  */
+void display_invalidate(
+    struct mtr_ctl *ctl)
+{
+#ifdef HAVE_CURSES
+    if (ctl->DisplayMode == DisplayCurses)
+        mtr_curses_invalidate();
+#endif
+}
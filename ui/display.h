@@ -41,7 +41,9 @@ enum {
     DisplayXML,
     DisplayCSV,
     DisplayTXT,
-    DisplayJSON
+    DisplayJSON,
+    DisplayNDJSON,
+    DisplayPrometheus
 };
 
 enum {
@@ -74,12 +76,19 @@ extern void display_rawping(
 extern void display_rawhost(
     struct mtr_ctl *ctl,
     int hostnum,
-    ip_t * ip_addr);
+    int addr_id);
 extern int display_keyaction(
     struct mtr_ctl *ctl);
 extern void display_loop(
     struct mtr_ctl *ctl);
 extern void display_clear(
     struct mtr_ctl *ctl);
+extern void display_invalidate(
+    struct mtr_ctl *ctl);
+extern void display_flush(
+    struct mtr_ctl *ctl);
+extern void display_cycle(
+    struct mtr_ctl *ctl,
+    int cycle);
 extern char *host_error_to_string(
     int err);
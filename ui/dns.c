@@ -36,19 +36,84 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #include "mtr.h"
 #include "dns.h"
 #include "net.h"
+#include "cache.h"
 #include "utils.h"
+#include "addrtab.h"
+
+/*
+    Reverse lookups are made in-process, by a small pool of resolver
+    threads, so that a slow getnameinfo() never stalls the display.
+    Results are kept in the entries of the interned addresses, of
+    addrtab.c, which only the main thread touches.
+
+    An address is queued for lookup once, when it is first seen, so
+    concurrent requests for it share the one lookup.  Failed lookups
+    are cached too, and retried only after DNS_NEGATIVE_TTL.  No more
+    than DNS_QUEUE_SIZE lookups are outstanding at once; addresses
+    seen while the queue is full wait to be queued at a later lookup.
+
+    The resolver threads pass completed lookups back through a queue
+    of their own, and write a byte to a pipe as they do, so that the
+    main loop can wait for results on dns_waitfd().
+
+    With --cache, names are also kept in a file shared across runs,
+    which is consulted before an address is queued.
+*/
+
+/*  The number of resolver threads, which is the most lookups at once  */
+#define DNS_THREADS 4
+
+/*  The most lookups queued or in progress  */
+#define DNS_QUEUE_SIZE 256
+
+/*  Seconds before an address which failed to resolve is retried  */
+#define DNS_NEGATIVE_TTL 300
+
+enum dns_state {
+    DNS_EMPTY = 0,              /* not yet seen by dns.c */
+    DNS_WAITING,                /* waiting for room in the queue */
+    DNS_QUEUED,                 /* queued, or being looked up */
+    DNS_RESOLVED,
+    DNS_FAILED
+};
 
-struct dns_results {
+/*  A lookup passed to, and back from, the resolver threads  */
+struct dns_request {
     ip_t ip;
-    char *name;
-    struct dns_results *next;
+    int af;
+    int addr_id;
+    int found;
+    char name[NI_MAXHOST];
 };
 
-static struct dns_results *results;
+/*  Set once the resolver threads have been started  */
+static int dns_opened;
+
+/*  Rings of lookups to be made and lookups completed  */
+static struct dns_request requests[DNS_QUEUE_SIZE];
+static int request_first, request_count;
+static struct dns_request completed[DNS_QUEUE_SIZE];
+static int completed_first, completed_count;
+
+/*  Lookups queued and not yet acknowledged, kept by the main thread  */
+static int outstanding;
+
+/*  Written by the resolver threads as each lookup completes  */
+static int fromdns[2];
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dns_wake = PTHREAD_COND_INITIALIZER;
+#endif
 
 char *strlongip(
     struct mtr_ctl *ctl,
@@ -64,28 +129,6 @@ char *strlongip(
 }
 
 
-#ifdef ENABLE_IPV6
-#define UNUSED_IF_NO_IPV6       /* empty */
-#else
-#define UNUSED_IF_NO_IPV6 ATTRIBUTE_UNUSED
-#endif
-
-static int todns[2], fromdns[2];
-static FILE *fromdnsfp;
-
-static int longipstr(
-    char *s,
-    ip_t * dst,
-    int family UNUSED_IF_NO_IPV6)
-{
-#ifdef ENABLE_IPV6
-    return inet_pton(family, s, dst);
-#else
-    return inet_aton(s, dst);
-#endif
-}
-
-
 struct hostent *dns_forward(
     const char *name)
 {
@@ -98,124 +141,205 @@ struct hostent *dns_forward(
 }
 
 
-static struct dns_results *findip(
-    struct mtr_ctl *ctl,
-    ip_t * ip)
+/*
+    Take the name of an address from the cache file, if it's there.
+    Addresses are keyed by their text.
+*/
+static void dns_recall(
+    struct addr_entry *entry)
 {
-    struct dns_results *t;
+    char name[NI_MAXHOST];
+    time_t expires;
+
+    expires = cache_find(CACHE_NAME, entry->text, name, sizeof(name));
+    if (!expires) {
+        return;
+    } else if (*name) {
+        entry->dns_name = xstrdup(name);
+        entry->dns_state = DNS_RESOLVED;
+    } else {
+        entry->dns_retry = expires;
+        entry->dns_state = DNS_FAILED;
+    }
+}
+
+
+/*  Record the result of a lookup in the cache file  */
+static void dns_remember(
+    struct addr_entry *entry)
+{
+    if (entry->dns_state == DNS_RESOLVED)
+        cache_store(CACHE_NAME, entry->text, entry->dns_name,
+                    CACHE_NAME_TTL);
+    else
+        cache_store(CACHE_NAME, entry->text, "", DNS_NEGATIVE_TTL);
+}
+
 
-    for (t = results; t; t = t->next) {
-        if (addrcmp((void *) ip, (void *) &t->ip, ctl->af) == 0)
-            return t;
+/*  The entry of an address, consulting the cache file when it's new  */
+static struct addr_entry *dns_find(
+    int addr_id)
+{
+    struct addr_entry *entry = addr_entry(addr_id);
+
+    if (entry->dns_state == DNS_EMPTY) {
+        entry->dns_state = DNS_WAITING;
+        dns_recall(entry);
     }
 
-    return NULL;
+    return entry;
 }
 
-static void set_sockaddr_ip(
-    struct mtr_ctl *ctl,
-    struct sockaddr_storage *sa,
-    ip_t * ip)
+
+/*  Look up the name of an address, as a resolver thread does  */
+static void dns_resolve(
+    struct dns_request *request)
 {
+    struct sockaddr_storage sa;
     struct sockaddr_in *sa_in;
+#ifdef ENABLE_IPV6
     struct sockaddr_in6 *sa_in6;
+#endif
+    socklen_t salen;
 
-    memset(sa, 0, sizeof(struct sockaddr_storage));
-    switch (ctl->af) {
-    case AF_INET:
-        sa_in = (struct sockaddr_in *) sa;
-        sa_in->sin_family = ctl->af;
-        addrcpy((void *) &sa_in->sin_addr, (void *) ip, ctl->af);
-        break;
-    case AF_INET6:
-        sa_in6 = (struct sockaddr_in6 *) sa;
-        sa_in6->sin6_family = ctl->af;
-        addrcpy((void *) &sa_in6->sin6_addr, (void *) ip, ctl->af);
-        break;
+    memset(&sa, 0, sizeof(struct sockaddr_storage));
+#ifdef ENABLE_IPV6
+    if (request->af == AF_INET6) {
+        sa_in6 = (struct sockaddr_in6 *) &sa;
+        sa_in6->sin6_family = AF_INET6;
+        memcpy(&sa_in6->sin6_addr, &request->ip, sizeof(struct in6_addr));
+        salen = sizeof(struct sockaddr_in6);
+    } else
+#endif
+    {
+        sa_in = (struct sockaddr_in *) &sa;
+        sa_in->sin_family = AF_INET;
+        memcpy(&sa_in->sin_addr, &request->ip, sizeof(struct in_addr));
+        salen = sizeof(struct sockaddr_in);
     }
+
+    request->found =
+        getnameinfo((struct sockaddr *) &sa, salen, request->name,
+                    sizeof(request->name), NULL, 0, NI_NAMEREQD) == 0;
 }
 
-void dns_open(
-    struct mtr_ctl *ctl)
+
+/*
+    Pass back a completed lookup, and wake the main loop.  A full pipe
+    is already readable, so a failed write loses nothing.
+*/
+static void dns_complete(
+    struct dns_request *request)
 {
-    int pid;
+    char wake = 0;
+
+    completed[(completed_first + completed_count) % DNS_QUEUE_SIZE] =
+        *request;
+    completed_count++;
+
+    if (write(fromdns[1], &wake, 1) == -1 && errno != EAGAIN)
+        error(0, errno, "DNS result notification");
+}
 
-    if (pipe(todns) < 0) {
-        error(EXIT_FAILURE, errno, "can't make a pipe for DNS process");
+
+#ifdef HAVE_PTHREAD
+
+static void *dns_thread(
+    void *arg ATTRIBUTE_UNUSED)
+{
+    struct dns_request request;
+
+    while (1) {
+        pthread_mutex_lock(&dns_lock);
+        while (request_count == 0)
+            pthread_cond_wait(&dns_wake, &dns_lock);
+        request = requests[request_first];
+        request_first = (request_first + 1) % DNS_QUEUE_SIZE;
+        request_count--;
+        pthread_mutex_unlock(&dns_lock);
+
+        dns_resolve(&request);
+
+        pthread_mutex_lock(&dns_lock);
+        dns_complete(&request);
+        pthread_mutex_unlock(&dns_lock);
     }
 
+    return NULL;
+}
+
+#endif
+
+
+/*  Queue a lookup of an address, if there is room for it  */
+static void dns_queue(
+    int addr_id)
+{
+    struct addr_entry *entry = addr_entry(addr_id);
+    struct dns_request *request;
+
+    if (outstanding >= DNS_QUEUE_SIZE) {
+        entry->dns_state = DNS_WAITING;
+        return;
+    }
+
+    entry->dns_state = DNS_QUEUED;
+    outstanding++;
+
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&dns_lock);
+#endif
+    request = &requests[(request_first + request_count) % DNS_QUEUE_SIZE];
+    memset(request, 0, sizeof(struct dns_request));
+    memcpy(&request->ip, &entry->ip, sizeof(ip_t));
+    request->af = entry->af;
+    request->addr_id = addr_id;
+#ifdef HAVE_PTHREAD
+    request_count++;
+    pthread_cond_signal(&dns_wake);
+    pthread_mutex_unlock(&dns_lock);
+#else
+    /*  Without threads, we have no choice but to look up in line  */
+    dns_resolve(request);
+    dns_complete(request);
+#endif
+}
+
+
+void dns_open(
+    struct mtr_ctl *ctl ATTRIBUTE_UNUSED)
+{
+    int i;
+#ifdef HAVE_PTHREAD
+    pthread_t thread;
+    sigset_t signals, oldsignals;
+#endif
+
+    /*  We're opened for each hostname, but need only start once  */
+    if (dns_opened)
+        return;
+    dns_opened = 1;
+
     if (pipe(fromdns) < 0) {
-        error(EXIT_FAILURE, errno, "can't make a pipe for DNS process");
+        error(EXIT_FAILURE, errno, "can't make a pipe for DNS results");
     }
-    fflush(stdout);
-    pid = fork();
-    if (pid < 0) {
-        error(EXIT_FAILURE, errno, "can't fork for DNS process");
+    for (i = 0; i < 2; i++) {
+        fcntl(fromdns[i], F_SETFL, fcntl(fromdns[i], F_GETFL, 0) | O_NONBLOCK);
+        fcntl(fromdns[i], F_SETFD, FD_CLOEXEC);
     }
-    if (pid == 0) {
-        char buf[2048];
-        int i;
-        FILE *infp;
-
-        /* Automatically reap children. */
-        if (signal(SIGCHLD, SIG_IGN) == SIG_ERR) {
-            error(EXIT_FAILURE, errno, "signal");
-        }
 
-        /* Close all unneccessary FDs.
-           for debugging and error reporting, keep std-in/out/err. */
-        for (i = 3; i < fromdns[1]; i++) {
-            if (i == todns[0])
-                continue;
-            if (i == fromdns[1])
-                continue;
-            close(i);
-        }
-        infp = fdopen(todns[0], "r");
-
-        while (fgets(buf, sizeof(buf), infp)) {
-            ip_t host;
-            struct sockaddr_storage sa;
-            socklen_t salen;
-            char hostname[NI_MAXHOST];
-            char result[INET6_ADDRSTRLEN + NI_MAXHOST + 2];
-
-            if (!fork()) {
-                int rv;
-
-                buf[strlen(buf) - 1] = 0;       /* chomp newline. */
-
-                longipstr(buf, &host, ctl->af);
-                set_sockaddr_ip(ctl, &sa, &host);
-                salen = (ctl->af == AF_INET) ? sizeof(struct sockaddr_in) :
-                    sizeof(struct sockaddr_in6);
-
-                rv = getnameinfo((struct sockaddr *) &sa, salen,
-                                 hostname, sizeof(hostname), NULL, 0, 0);
-                if (rv == 0) {
-                    snprintf(result, sizeof(result),
-                             "%s %s\n", strlongip(ctl, &host), hostname);
-
-                    rv = write(fromdns[1], result, strlen(result));
-                    if (rv < 0)
-                        error(0, errno, "write DNS lookup result");
-                }
-
-                exit(EXIT_SUCCESS);
-            }
+#ifdef HAVE_PTHREAD
+    /*  Signals, such as SIGWINCH, are left to the main thread  */
+    sigfillset(&signals);
+    pthread_sigmask(SIG_SETMASK, &signals, &oldsignals);
+    for (i = 0; i < DNS_THREADS; i++) {
+        if (pthread_create(&thread, NULL, dns_thread, NULL)) {
+            error(EXIT_FAILURE, errno, "can't start DNS thread");
         }
-        exit(EXIT_SUCCESS);
-    } else {
-        int flags;
-
-        /* the parent. */
-        close(todns[0]);        /* close the pipe ends we don't need. */
-        close(fromdns[1]);
-        fromdnsfp = fdopen(fromdns[0], "r");
-        flags = fcntl(fromdns[0], F_GETFL, 0);
-        flags |= O_NONBLOCK;
-        fcntl(fromdns[0], F_SETFL, flags);
+        pthread_detach(thread);
     }
+    pthread_sigmask(SIG_SETMASK, &oldsignals, NULL);
+#endif
 }
 
 int dns_waitfd(
@@ -225,23 +349,38 @@ int dns_waitfd(
 }
 
 
+/*  Record the lookups which have completed  */
 void dns_ack(
-    struct mtr_ctl *ctl)
+    struct mtr_ctl *ctl ATTRIBUTE_UNUSED)
 {
-    char buf[2048], host[NI_MAXHOST], name[NI_MAXHOST];
-    ip_t hostip;
-    struct dns_results *r;
-
-    while (fgets(buf, sizeof(buf), fromdnsfp)) {
-        sscanf(buf, "%s %s", host, name);
-
-        longipstr(host, &hostip, ctl->af);
-        r = findip(ctl, &hostip);
-        if (r)
-            r->name = xstrdup(name);
-        else
-            error(0, 0, "dns_ack: Couldn't find host %s", host);
+    char buf[256];
+    struct dns_request *request;
+    struct addr_entry *entry;
+
+    while (read(fromdns[0], buf, sizeof(buf)) > 0);
+
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&dns_lock);
+#endif
+    while (completed_count) {
+        request = &completed[completed_first];
+        completed_first = (completed_first + 1) % DNS_QUEUE_SIZE;
+        completed_count--;
+        outstanding--;
+
+        entry = dns_find(request->addr_id);
+        if (request->found) {
+            entry->dns_name = xstrdup(request->name);
+            entry->dns_state = DNS_RESOLVED;
+        } else {
+            entry->dns_retry = time(NULL) + DNS_NEGATIVE_TTL;
+            entry->dns_state = DNS_FAILED;
+        }
+        dns_remember(entry);
     }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&dns_lock);
+#endif
 }
 
 
@@ -264,47 +403,82 @@ void dns_ack6(
 
 
 char *dns_lookup2(
-    struct mtr_ctl *ctl,
-    ip_t * ip)
+    struct mtr_ctl *ctl ATTRIBUTE_UNUSED,
+    int addr_id)
 {
-    struct dns_results *r;
-    char buf[INET6_ADDRSTRLEN + 1];
-    int rv;
-
-    r = findip(ctl, ip);
-    if (r) {
-        /* we've got a result. */
-        if (r->name)
-            return r->name;
-        else
-            return strlongip(ctl, ip);
-    } else {
-        r = xmalloc(sizeof(struct dns_results));
-        memcpy(&r->ip, ip, sizeof(r->ip));
-        r->name = NULL;
-        r->next = results;
-        results = r;
-        snprintf(buf, sizeof(buf), "%s\n", strlongip(ctl, ip));
-        rv = write(todns[1], buf, strlen(buf));
-        if (rv < 0)
-            error(0, errno, "couldn't write to resolver process");
+    struct addr_entry *entry;
+
+    if (addr_id == 0)
+        return NULL;
+
+    entry = dns_find(addr_id);
+    switch (entry->dns_state) {
+    case DNS_RESOLVED:
+        return entry->dns_name;
+    case DNS_FAILED:
+        if (time(NULL) >= entry->dns_retry)
+            dns_queue(addr_id);
+        break;
+    case DNS_WAITING:
+        dns_queue(addr_id);
+        break;
     }
-    return strlongip(ctl, ip);
+
+    return entry->text;
 }
 
 
 char *dns_lookup(
     struct mtr_ctl *ctl,
-    ip_t * ip)
+    int addr_id)
 {
     char *t;
 
     if (!ctl->dns || !ctl->use_dns)
         return NULL;
-    t = dns_lookup2(ctl, ip);
+    t = dns_lookup2(ctl, addr_id);
     return t;
 }
 
+/*
+    Look up a name at once, for reports which are printed when the
+    trace is done, and so can't wait for the resolver threads.  Names
+    are taken from, and kept in, the cache, as for dns_lookup2().
+*/
+char *dns_lookup_now(
+    struct mtr_ctl *ctl ATTRIBUTE_UNUSED,
+    int addr_id)
+{
+    struct addr_entry *entry;
+    struct hostent *host;
+
+    if (addr_id == 0)
+        return NULL;
+
+    entry = dns_find(addr_id);
+    if (entry->dns_state == DNS_RESOLVED)
+        return entry->dns_name;
+    if (entry->dns_state == DNS_FAILED && time(NULL) < entry->dns_retry)
+        return NULL;
+
+    host = addr2host((void *) &entry->ip, entry->af);
+
+    /*  A resolver thread will record the name of a queued address  */
+    if (entry->dns_state == DNS_QUEUED)
+        return host ? host->h_name : NULL;
+
+    if (host) {
+        entry->dns_name = xstrdup(host->h_name);
+        entry->dns_state = DNS_RESOLVED;
+    } else {
+        entry->dns_retry = time(NULL) + DNS_NEGATIVE_TTL;
+        entry->dns_state = DNS_FAILED;
+    }
+    dns_remember(entry);
+
+    return entry->dns_name;
+}
+
 /* XXX check if necessary/exported. */
 
 /* Resolve an IP address to a hostname. */
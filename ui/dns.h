@@ -37,10 +37,13 @@ extern void dns_ack6(
 
 extern char *dns_lookup(
     struct mtr_ctl *ctl,
-    ip_t * address);
+    int addr_id);
 extern char *dns_lookup2(
     struct mtr_ctl *ctl,
-    ip_t * address);
+    int addr_id);
+extern char *dns_lookup_now(
+    struct mtr_ctl *ctl,
+    int addr_id);
 extern struct hostent *dns_forward(
     const char *name);
 extern char *strlongip(
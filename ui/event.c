@@ -0,0 +1,310 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_ERROR_H
+#include <error.h>
+#else
+#include "portability/error.h"
+#endif
+
+#include "event.h"
+
+#ifdef USE_EPOLL_EVENTS
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+/*  The epoll data value marking the timer descriptor  */
+#define EVENT_TIMER_INDEX EVENT_MAX_FDS
+#endif
+
+/*  The current time, in microseconds, from a clock which never steps  */
+long long event_now(
+    void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec now;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &now) == 0) {
+        return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    }
+#endif
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (long long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+/*  The earliest armed deadline, or zero if no timer is armed  */
+static long long event_next_deadline(
+    struct event_loop *loop)
+{
+    long long next = 0;
+    int i;
+
+    for (i = 0; i < EVENT_MAX_TIMERS; i++) {
+        if (loop->deadline[i] && (!next || loop->deadline[i] < next)) {
+            next = loop->deadline[i];
+        }
+    }
+
+    return next;
+}
+
+
+void event_loop_init(
+    struct event_loop *loop)
+{
+    memset(loop, 0, sizeof(struct event_loop));
+
+#ifdef USE_EPOLL_EVENTS
+    struct epoll_event event;
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd == -1) {
+        error(EXIT_FAILURE, errno, "epoll_create1");
+    }
+
+    loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (loop->timer_fd == -1) {
+        error(EXIT_FAILURE, errno, "timerfd_create");
+    }
+
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.events = EPOLLIN;
+    event.data.u32 = EVENT_TIMER_INDEX;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->timer_fd, &event)) {
+        error(EXIT_FAILURE, errno, "epoll_ctl");
+    }
+#endif
+}
+
+
+void event_loop_close(
+    struct event_loop *loop)
+{
+#ifdef USE_EPOLL_EVENTS
+    close(loop->timer_fd);
+    close(loop->epoll_fd);
+#endif
+    memset(loop, 0, sizeof(struct event_loop));
+}
+
+
+/*  Watch a descriptor for input, returning its index for fd_ready  */
+int event_add_fd(
+    struct event_loop *loop,
+    int fd)
+{
+    int index = loop->fd_count;
+
+    if (index >= EVENT_MAX_FDS) {
+        error(EXIT_FAILURE, 0, "too many descriptors for event loop");
+    }
+
+    loop->fd[index] = -1;
+    loop->fd_count++;
+    event_set_fd(loop, index, fd);
+
+    return index;
+}
+
+
+/*  Change the descriptor watched in a slot, or watch none with -1  */
+void event_set_fd(
+    struct event_loop *loop,
+    int index,
+    int fd)
+{
+#ifdef USE_EPOLL_EVENTS
+    struct epoll_event event;
+
+    /*  A closed descriptor has already left the epoll set  */
+    if (loop->fd[index] >= 0) {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->fd[index], &event);
+    }
+    if (fd >= 0) {
+        memset(&event, 0, sizeof(struct epoll_event));
+        event.events = EPOLLIN;
+        event.data.u32 = index;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+            error(EXIT_FAILURE, errno, "epoll_ctl");
+        }
+    }
+#else
+    /*  poll ignores negative descriptors  */
+    loop->pollfd[index].fd = fd;
+    loop->pollfd[index].events = POLLIN;
+#endif
+    loop->fd[index] = fd;
+    loop->fd_ready[index] = 0;
+}
+
+
+/*
+    Watch the descriptor of a slot for output rather than input, or
+    for input again if 'output' is zero.  Setting a new descriptor in
+    the slot returns it to watching for input.
+*/
+void event_set_output(
+    struct event_loop *loop,
+    int index,
+    int output)
+{
+#ifdef USE_EPOLL_EVENTS
+    struct epoll_event event;
+
+    if (loop->fd[index] >= 0) {
+        memset(&event, 0, sizeof(struct epoll_event));
+        event.events = output ? EPOLLOUT : EPOLLIN;
+        event.data.u32 = index;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, loop->fd[index],
+                      &event)) {
+            error(EXIT_FAILURE, errno, "epoll_ctl");
+        }
+    }
+#else
+    loop->pollfd[index].events = output ? POLLOUT : POLLIN;
+#endif
+    loop->fd_ready[index] = 0;
+}
+
+
+/*  Arm a timer for a deadline from event_now(), or disarm it with 0  */
+void event_set_timer(
+    struct event_loop *loop,
+    int timer,
+    long long deadline)
+{
+    loop->deadline[timer] = deadline;
+}
+
+
+/*  Check whether a timer's deadline has passed, disarming it if so  */
+int event_timer_expired(
+    struct event_loop *loop,
+    int timer,
+    long long now)
+{
+    if (loop->deadline[timer] && loop->deadline[timer] <= now) {
+        loop->deadline[timer] = 0;
+        return 1;
+    }
+
+    return 0;
+}
+
+
+#ifdef USE_EPOLL_EVENTS
+
+/*
+    Wait with epoll, with a timerfd armed for the earliest deadline, so
+    that the deadline is met to the microsecond.
+*/
+void event_wait(
+    struct event_loop *loop)
+{
+    struct epoll_event events[EVENT_MAX_FDS + 1];
+    struct itimerspec timer;
+    long long deadline;
+    uint64_t expirations;
+    int event_count;
+    int i;
+
+    memset(loop->fd_ready, 0, sizeof(loop->fd_ready));
+
+    /*  A zero it_value disarms the timer when no deadline is set  */
+    memset(&timer, 0, sizeof(struct itimerspec));
+    deadline = event_next_deadline(loop);
+    if (deadline) {
+        timer.it_value.tv_sec = deadline / 1000000;
+        timer.it_value.tv_nsec = (deadline % 1000000) * 1000;
+    }
+    if (timerfd_settime(loop->timer_fd, TFD_TIMER_ABSTIME, &timer, NULL)) {
+        error(EXIT_FAILURE, errno, "timerfd_settime");
+    }
+
+    event_count = epoll_wait(loop->epoll_fd, events, EVENT_MAX_FDS + 1, -1);
+    if (event_count == -1) {
+        if (errno == EINTR) {
+            return;
+        }
+        error(EXIT_FAILURE, errno, "epoll_wait");
+    }
+
+    for (i = 0; i < event_count; i++) {
+        if (events[i].data.u32 == EVENT_TIMER_INDEX) {
+            if (read(loop->timer_fd, &expirations, sizeof(expirations))
+                == -1 && errno != EAGAIN && errno != EINTR) {
+                error(EXIT_FAILURE, errno, "timerfd read");
+            }
+        } else {
+            loop->fd_ready[events[i].data.u32] = 1;
+        }
+    }
+}
+
+#else
+
+/*  Wait with poll, timing out at the earliest deadline  */
+void event_wait(
+    struct event_loop *loop)
+{
+    long long deadline;
+    long long wait;
+    int timeout = -1;
+    int i;
+
+    memset(loop->fd_ready, 0, sizeof(loop->fd_ready));
+
+    deadline = event_next_deadline(loop);
+    if (deadline) {
+        /*  Round up, so that we don't wake just short of the deadline  */
+        wait = deadline - event_now();
+        if (wait < 0) {
+            wait = 0;
+        }
+        timeout = (wait + 999) / 1000;
+    }
+
+    if (poll(loop->pollfd, loop->fd_count, timeout) == -1) {
+        if (errno == EINTR) {
+            return;
+        }
+        error(EXIT_FAILURE, errno, "poll");
+    }
+
+    for (i = 0; i < loop->fd_count; i++) {
+        if (loop->pollfd[i].revents
+            & (POLLIN | POLLOUT | POLLHUP | POLLERR)) {
+            loop->fd_ready[i] = 1;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,85 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef EVENT_H
+#define EVENT_H
+
+#include "config.h"
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE1) \
+    && defined(HAVE_SYS_TIMERFD_H) && defined(HAVE_TIMERFD_CREATE)
+#define USE_EPOLL_EVENTS 1
+#else
+#include <poll.h>
+#endif
+
+/*  The most descriptors and timers an event loop watches  */
+#define EVENT_MAX_FDS 24
+#define EVENT_MAX_TIMERS 8
+
+/*
+    The descriptors and timers for which the UI waits.  Timers hold
+    deadlines in microseconds on the monotonic clock of event_now(),
+    or zero while they are unarmed.  event_wait sleeps until the
+    earliest deadline or until a descriptor is readable, or writable
+    if it is watched for output, whichever comes first, and never
+    polls.  A descriptor of -1 holds a slot which is watched for
+    nothing.
+*/
+struct event_loop {
+    int fd[EVENT_MAX_FDS];
+    int fd_ready[EVENT_MAX_FDS];
+    int fd_count;
+    long long deadline[EVENT_MAX_TIMERS];
+#ifdef USE_EPOLL_EVENTS
+    int epoll_fd;
+    int timer_fd;
+#else
+    struct pollfd pollfd[EVENT_MAX_FDS];
+#endif
+};
+
+extern long long event_now(
+    void);
+extern void event_loop_init(
+    struct event_loop *loop);
+extern void event_loop_close(
+    struct event_loop *loop);
+extern int event_add_fd(
+    struct event_loop *loop,
+    int fd);
+extern void event_set_fd(
+    struct event_loop *loop,
+    int index,
+    int fd);
+extern void event_set_output(
+    struct event_loop *loop,
+    int index,
+    int output);
+extern void event_set_timer(
+    struct event_loop *loop,
+    int timer,
+    long long deadline);
+extern int event_timer_expired(
+    struct event_loop *loop,
+    int timer,
+    long long now);
+extern void event_wait(
+    struct event_loop *loop);
+
+#endif
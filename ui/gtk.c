@@ -35,7 +35,10 @@
 #include "dns.h"
 #include "asn.h"
 #include "mtr-gtk.h"
+#include "event.h"
+#include "select.h"
 #include "utils.h"
+#include "addrtab.h"
 
 #include "img/mtr_icon.xpm"
 #endif
@@ -56,21 +59,66 @@ static gchar *getSelectedHost(
     GtkTreePath * path);
 
 static int ping_timeout_timer;
+static long long ping_deadline;
 static GtkWidget *Pause_Button;
 static GtkWidget *Entry;
 static GtkWidget *main_window;
 
+/*
+    The shortest time between redraws, in usec.  Replies prompt a
+    redraw, but however fast they arrive, redraws are no more often
+    than this, lest drawing leave no time for the replies.
+*/
+#define GTK_REDRAW_INTERVAL 100000
+
+static guint redraw_timer;
+static long long last_redraw;
+
+static gboolean gtk_redraw_timeout(
+    gpointer data)
+{
+    redraw_timer = 0;
+    gtk_redraw((struct mtr_ctl *) data);
+
+    return FALSE;
+}
+
+/*  Redraw soon, though no sooner than an interval after the last  */
+static void gtk_request_redraw(
+    struct mtr_ctl *ctl)
+{
+    long long delay;
+
+    if (redraw_timer) {
+        return;
+    }
+
+    delay = last_redraw + GTK_REDRAW_INTERVAL - event_now();
+    if (delay < 0) {
+        delay = 0;
+    }
+    redraw_timer = g_timeout_add((delay + 999) / 1000,
+                                 gtk_redraw_timeout, ctl);
+}
+
 static void gtk_add_ping_timeout(
     struct mtr_ctl *ctl)
 {
-    int dt;
+    long long now;
 
     if (gtk_toggle_button_get_active((GtkToggleButton *) Pause_Button)) {
         return;
     }
-    dt = calc_deltatime(ctl->WaitTime);
-    gtk_redraw(ctl);
-    ping_timeout_timer = g_timeout_add(dt / 1000, gtk_ping, ctl);
+
+    /*  The probe schedule is kept as select_loop keeps it  */
+    now = event_now();
+    if (!ping_deadline) {
+        ping_deadline = now;
+    }
+    ping_deadline = select_next_probe(ctl, ping_deadline, now);
+    gtk_request_redraw(ctl);
+    ping_timeout_timer = g_timeout_add((ping_deadline - now + 999) / 1000,
+                                       gtk_ping, ctl);
 }
 
 
@@ -119,7 +167,7 @@ static gint Restart_clicked(
 {
     struct mtr_ctl *ctl = (struct mtr_ctl *) data;
 
-    net_reset(ctl);
+    net_reset(ctl, ctl->net);
     gtk_redraw(ctl);
 
     return FALSE;
@@ -135,6 +183,7 @@ static gint Pause_clicked(
     static int paused = 0;
 
     if (paused) {
+        ping_deadline = 0;
         gtk_add_ping_timeout(ctl);
     } else {
         g_source_remove(ping_timeout_timer);
@@ -232,6 +281,7 @@ static gint WaitTime_changed(
 
     ctl->WaitTime = gtk_spin_button_get_value(GTK_SPIN_BUTTON(Button));
     g_source_remove(ping_timeout_timer);
+    ping_deadline = 0;
     gtk_add_ping_timeout(ctl);
     gtk_redraw(ctl);
 
@@ -248,7 +298,7 @@ static gint Host_activate(
 
     addr = dns_forward(gtk_entry_get_text(GTK_ENTRY(entry)));
     if (addr) {
-        net_reopen(ctl, addr);
+        net_reopen(ctl, ctl->net, addr);
         /* If we are "Paused" at this point it is usually because someone
            entered a non-existing host. Therefore do the go-ahead... */
         gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(Pause_Button), 0);
@@ -498,51 +548,174 @@ static void TreeViewCreate(
 
 }
 
+/*
+    What each row of the list shows, so that a redraw sets only the
+    cells which have changed.  Setting a cell has the view redraw the
+    row, even if the value is as it was.
+*/
+struct shown_row {
+    struct net_session *net;    /* the session of the hop shown */
+    int at;                     /* the hop shown */
+    unsigned long changed;      /* the hop's changes when shown */
+    char name[256];
+#ifdef HAVE_IPINFO
+    char asn[256];
+#endif
+    int values[COL_COLOR];      /* numeric cells, as set */
+    const char *color;
+};
+
+static struct shown_row shown_rows[MaxHost];
+static int rows_valid;          /* clear when names may have changed */
+
+/*  The cells to set in a row, gathered for gtk_list_store_set_valuesv  */
+struct row_update {
+    gint columns[N_COLS];
+    GValue values[N_COLS];
+    int count;
+};
+
+static void set_string(
+    struct row_update *update,
+    int column,
+    char *shown,
+    size_t shown_size,
+    const char *value)
+{
+    GValue *v = &update->values[update->count];
+
+    if (!strcmp(shown, value)) {
+        return;
+    }
+    xstrncpy(shown, value, shown_size);
+
+    g_value_init(v, G_TYPE_STRING);
+    g_value_set_string(v, value);
+    update->columns[update->count++] = column;
+}
+
+static void set_int(
+    struct row_update *update,
+    struct shown_row *shown,
+    int column,
+    int value)
+{
+    GValue *v = &update->values[update->count];
+
+    if (shown->values[column] == value) {
+        return;
+    }
+    shown->values[column] = value;
+
+    g_value_init(v, G_TYPE_INT);
+    g_value_set_int(v, value);
+    update->columns[update->count++] = column;
+}
+
+/*  Floats are compared as shown, in thousandths  */
+static void set_float(
+    struct row_update *update,
+    struct shown_row *shown,
+    int column,
+    int value)
+{
+    GValue *v = &update->values[update->count];
+
+    if (shown->values[column] == value) {
+        return;
+    }
+    shown->values[column] = value;
+
+    g_value_init(v, G_TYPE_FLOAT);
+    g_value_set_float(v, (float) (value / 1000.0));
+    update->columns[update->count++] = column;
+}
+
 static void update_tree_row(
     struct mtr_ctl *ctl,
+    int index,
     int row,
     GtkTreeIter * iter)
 {
-    ip_t *addr;
-    char str[256] = "???", *name = str;
+    struct shown_row *shown = &shown_rows[index];
+    struct row_update update;
+    int addr;
+    char str[256] = "???";
+    const char *name = str;
+    const char *color;
+    int i;
+
+    if (rows_valid && shown->net == ctl->net && shown->at == row
+        && shown->changed == net_hop_changed(ctl->net, row)) {
+        return;
+    }
+
+    /*  A row newly showing a hop has every cell set  */
+    if (shown->net != ctl->net || shown->at != row) {
+        memset(shown, 0, sizeof(struct shown_row));
+        for (i = 0; i < COL_COLOR; i++) {
+            shown->values[i] = -1;
+        }
+        shown->color = "";
+        shown->net = ctl->net;
+        shown->at = row;
+    }
+    shown->changed = net_hop_changed(ctl->net, row);
 
-    addr = net_addr(row);
-    if (addrcmp((void *) addr, (void *) &ctl->unspec_addr, ctl->af)) {
+    addr = net_addr_id(ctl->net, row);
+    if (addr) {
         if ((name = dns_lookup(ctl, addr))) {
             if (ctl->show_ips) {
                 snprintf(str, sizeof(str), "%s (%s)", name,
-                         strlongip(ctl, addr));
+                         addr_text(addr));
                 name = str;
             }
         } else
-            name = strlongip(ctl, addr);
+            name = addr_text(addr);
     }
 
-    gtk_list_store_set(ReportStore, iter,
-                       COL_HOSTNAME, name,
-                       COL_LOSS, (float) (net_loss(row) / 1000.0),
-                       COL_RCV, net_returned(row),
-                       COL_SNT, net_xmit(row),
-                       COL_LAST, net_last(row) / 1000,
-                       COL_BEST, net_best(row) / 1000,
-                       COL_AVG, net_avg(row) / 1000,
-                       COL_WORST, net_worst(row) / 1000,
-                       COL_STDEV, (float) (net_stdev(row) / 1000.0),
-                       COL_COLOR, net_up(row) ? NULL : "red", -1);
+    memset(&update, 0, sizeof(update));
+    set_string(&update, COL_HOSTNAME, shown->name, sizeof(shown->name),
+               name);
+    set_float(&update, shown, COL_LOSS, net_loss(ctl->net, row));
+    set_int(&update, shown, COL_RCV, net_returned(ctl->net, row));
+    set_int(&update, shown, COL_SNT, net_xmit(ctl->net, row));
+    set_int(&update, shown, COL_LAST, net_last(ctl->net, row) / 1000);
+    set_int(&update, shown, COL_BEST, net_best(ctl->net, row) / 1000);
+    set_int(&update, shown, COL_AVG, net_avg(ctl->net, row) / 1000);
+    set_int(&update, shown, COL_WORST, net_worst(ctl->net, row) / 1000);
+    set_float(&update, shown, COL_STDEV, net_stdev(ctl->net, row));
+
+    color = net_up(ctl->net, row) ? NULL : "red";
+    if (color != shown->color) {
+        shown->color = color;
+        g_value_init(&update.values[update.count], G_TYPE_STRING);
+        g_value_set_static_string(&update.values[update.count], color);
+        update.columns[update.count++] = COL_COLOR;
+    }
 #ifdef HAVE_IPINFO
     if (is_printii(ctl))
-        gtk_list_store_set(ReportStore, iter, COL_ASN,
-                           fmt_ipinfo(ctl, addr), -1);
+        set_string(&update, COL_ASN, shown->asn, sizeof(shown->asn),
+                   fmt_ipinfo(ctl, addr));
 #endif
+
+    if (update.count) {
+        gtk_list_store_set_valuesv(ReportStore, iter, update.columns,
+                                   update.values, update.count);
+    }
+    for (i = 0; i < update.count; i++) {
+        g_value_unset(&update.values[i]);
+    }
 }
 
 void gtk_redraw(
     struct mtr_ctl *ctl)
 {
-    int max = net_max(ctl);
+    int max = net_max(ctl, ctl->net);
 
     GtkTreeIter iter;
     int row = net_min(ctl);
+    int index = 0;
     gboolean valid;
 
     valid =
@@ -550,7 +723,7 @@ void gtk_redraw(
 
     while (valid) {
         if (row < max) {
-            update_tree_row(ctl, row++, &iter);
+            update_tree_row(ctl, index++, row++, &iter);
             valid =
                 gtk_tree_model_iter_next(GTK_TREE_MODEL(ReportStore),
                                          &iter);
@@ -560,8 +733,12 @@ void gtk_redraw(
     }
     while (row < max) {
         gtk_list_store_append(ReportStore, &iter);
-        update_tree_row(ctl, row++, &iter);
+        shown_rows[index].net = NULL;
+        update_tree_row(ctl, index++, row++, &iter);
     }
+
+    rows_valid = 1;
+    last_redraw = event_now();
 }
 
 
@@ -646,8 +823,7 @@ static gint gtk_ping(
 {
     struct mtr_ctl *ctl = (struct mtr_ctl *) data;
 
-    gtk_redraw(ctl);
-    net_send_batch(ctl);
+    net_send_batch(ctl, ctl->net);
     net_harvest_fds(ctl);
     g_source_remove(ping_timeout_timer);
     gtk_add_ping_timeout(ctl);
@@ -663,6 +839,7 @@ static gboolean gtk_net_data(
     struct mtr_ctl *ctl = (struct mtr_ctl *) data;
 
     net_process_return(ctl);
+    gtk_request_redraw(ctl);
     return TRUE;
 }
 
@@ -675,9 +852,25 @@ static gboolean gtk_dns_data(
     struct mtr_ctl *ctl = (struct mtr_ctl *) data;
 
     dns_ack(ctl);
-    gtk_redraw(ctl);
+    rows_valid = 0;
+    gtk_request_redraw(ctl);
+    return TRUE;
+}
+
+#ifdef HAVE_IPINFO
+static gboolean gtk_asn_data(
+    ATTRIBUTE_UNUSED GIOChannel * channel,
+    ATTRIBUTE_UNUSED GIOCondition cond,
+    gpointer data)
+{
+    struct mtr_ctl *ctl = (struct mtr_ctl *) data;
+
+    asn_ack(ctl);
+    rows_valid = 0;
+    gtk_request_redraw(ctl);
     return TRUE;
 }
+#endif
 
 #ifdef ENABLE_IPV6
 static gboolean gtk_dns_data6(
@@ -688,7 +881,8 @@ static gboolean gtk_dns_data6(
     struct mtr_ctl *ctl = (struct mtr_ctl *) data;
 
     dns_ack6();
-    gtk_redraw(ctl);
+    rows_valid = 0;
+    gtk_request_redraw(ctl);
     return TRUE;
 }
 #endif
@@ -698,6 +892,9 @@ void gtk_loop(
     struct mtr_ctl *ctl)
 {
     GIOChannel *net_iochannel, *dns_iochannel;
+#ifdef HAVE_IPINFO
+    GIOChannel *asn_iochannel;
+#endif
 
     gtk_add_ping_timeout(ctl);
 
@@ -711,6 +908,12 @@ void gtk_loop(
 #endif
     dns_iochannel = g_io_channel_unix_new(dns_waitfd());
     g_io_add_watch(dns_iochannel, G_IO_IN, gtk_dns_data, ctl);
+#ifdef HAVE_IPINFO
+    if (asn_waitfd() >= 0) {
+        asn_iochannel = g_io_channel_unix_new(asn_waitfd());
+        g_io_add_watch(asn_iochannel, G_IO_IN, gtk_asn_data, ctl);
+    }
+#endif
 
     gtk_main();
 }
@@ -27,3 +27,5 @@ extern int mtr_curses_keyaction(
     struct mtr_ctl *ctl);
 extern void mtr_curses_clear(
     struct mtr_ctl *ctl);
+extern void mtr_curses_invalidate(
+    void);
@@ -47,6 +47,11 @@
 #include <limits.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <time.h>
+#include <signal.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #include "mtr.h"
 #include "mtr-curses.h"
@@ -54,7 +59,13 @@
 #include "dns.h"
 #include "report.h"
 #include "net.h"
+#include "event.h"
+#include "select.h"
 #include "asn.h"
+#include "cache.h"
+#include "capture.h"
+#include "prometheus.h"
+#include "shmstats.h"
 #include "utils.h"
 
 #ifdef HAVE_GETOPT
@@ -69,6 +80,10 @@
 #define DEFAULT_AF AF_INET
 #endif
 
+/*  Threads resolving the hostnames given, and how long to wait for each  */
+#define RESOLVE_THREADS 16
+#define RESOLVE_TIMEOUT 30
+
 
 char *myname;
 
@@ -89,12 +104,20 @@ const struct fields data_fields[MAXFLD] = {
     {'M', "M: Jitter Mean/Avg.", "Javg", " %4.1f", 5, &net_javg},
     {'X', "X: Worst Jitter", "Jmax", " %4.1f", 5, &net_jworst},
     {'I', "I: Interarrival Jitter", "Jint", " %4.1f", 5, &net_jinta},
+    {'E', "E: Median RTT(ms)", "P50", " %5.1f", 6, &net_p50},
+    {'P', "P: 90th Percentile RTT(ms)", "P90", " %5.1f", 6, &net_p90},
+    {'Q', "Q: 99th Percentile RTT(ms)", "P99", " %5.1f", 6, &net_p99},
+    {'Y', "Y: 99.9th Percentile RTT(ms)", "P99.9", " %5.1f", 6, &net_p999},
     {'\0', NULL, NULL, NULL, 0, NULL}
 };
 
 typedef struct names {
     char *name;
     struct names *next;
+    struct addrinfo *res;       /* its addresses, once resolved */
+    int gai_error;              /* or why it couldn't be resolved */
+    int resolved;
+    time_t started;             /* when a resolver thread took it */
 } names_t;
 
 static void __attribute__ ((__noreturn__)) usage(FILE * out)
@@ -104,6 +127,14 @@ static void __attribute__ ((__noreturn__)) usage(FILE * out)
     fputs("\n", out);
     fputs(" -F, --filename FILE        read hostname(s) from a file\n",
           out);
+    fputs("     --concurrent COUNT     trace COUNT hostnames at once\n",
+          out);
+#ifdef ENABLE_IPV6
+    fputs("     --dual-stack           trace both IPv4 and IPv6 at once\n",
+          out);
+#endif
+    fputs("     --agent HOST:PORT      trace from a remote mtr-packet agent\n",
+          out);
     fputs(" -4                         use IPv4 only\n", out);
 #ifdef ENABLE_IPV6
     fputs(" -6                         use IPv6 only\n", out);
@@ -131,6 +162,16 @@ static void __attribute__ ((__noreturn__)) usage(FILE * out)
         (" -B, --bitpattern NUMBER    set bit pattern to use in payload\n",
          out);
     fputs(" -i, --interval SECONDS     ICMP echo request interval\n", out);
+    fputs("     --burst RATE           probe every hop at once, RATE/sec\n",
+          out);
+    fputs("     --pipeline COUNT       overlap COUNT report cycles\n",
+          out);
+    fputs("     --flows COUNT          enumerate paths with COUNT UDP flows\n",
+          out);
+    fputs("     --share-prefix         probe hops common to targets once\n",
+          out);
+    fputs("     --adaptive-probes      probe stable hops less often\n",
+          out);
     fputs
         (" -G, --gracetime SECONDS    number of seconds to wait for responses\n",
          out);
@@ -143,6 +184,8 @@ static void __attribute__ ((__noreturn__)) usage(FILE * out)
     fputs
         (" -Z, --timeout SECONDS      seconds to keep probe sockets open\n",
          out);
+    fputs("     --adaptive-timeout     time out probes by each hop's RTT\n",
+          out);
 #ifdef SO_MARK
     fputs(" -M, --mark MARK            mark each sent packet\n", out);
 #endif
@@ -151,10 +194,23 @@ static void __attribute__ ((__noreturn__)) usage(FILE * out)
     fputs(" -c, --report-cycles COUNT  set the number of pings sent\n",
           out);
     fputs(" -j, --json                 output json\n", out);
+    fputs("     --ndjson               output a json line per hop and cycle\n",
+          out);
+    fputs("     --ndjson-cycles COUNT  output every COUNT cycles\n", out);
+    fputs("     --ndjson-changes       output only the hops which changed\n",
+          out);
+    fputs("     --prometheus PORT      serve metrics for Prometheus on PORT\n",
+          out);
+    fputs("     --shm-stats FILE       publish statistics in shared FILE\n",
+          out);
     fputs(" -x, --xml                  output xml\n", out);
     fputs(" -C, --csv                  output comma separated values\n",
           out);
     fputs(" -l, --raw                  output raw format\n", out);
+    fputs("     --raw-binary           output raw format as binary records\n",
+          out);
+    fputs("     --raw-flush MSEC       write raw output at most every MSEC\n",
+          out);
     fputs(" -p, --split                split output\n", out);
 #ifdef HAVE_CURSES
     fputs(" -t, --curses               use curses terminal interface\n",
@@ -168,11 +224,24 @@ static void __attribute__ ((__noreturn__)) usage(FILE * out)
     fputs(" -n, --no-dns               do not resove host names\n", out);
     fputs(" -b, --show-ips             show IP numbers and host names\n",
           out);
+    fputs
+        ("     --cache FILE           keep names and IP information in FILE\n",
+         out);
+    fputs("     --capture FILE         record probes and replies to FILE\n",
+          out);
+    fputs("     --replay FILE          replay the traces recorded in FILE\n",
+          out);
+    fputs("     --replay-realtime      replay at the speed of the capture\n",
+          out);
     fputs(" -o, --order FIELDS         select output fields\n", out);
+    fputs("     --history COUNT        keep COUNT pings for each graph\n",
+          out);
 #ifdef HAVE_IPINFO
     fputs(" -y, --ipinfo NUMBER        select IP information in output\n",
           out);
     fputs(" -z, --aslookup             display AS number\n", out);
+    fputs("     --asn-db FILE          look up IP information in FILE\n",
+          out);
 #endif
     fputs(" -h, --help                 display this help and exit\n", out);
     fputs
@@ -309,6 +378,21 @@ static void init_fld_options(
 }
 
 
+/*
+    The traces started for each hostname: one for each agent, or just
+    our own, and with --dual-stack, one for each family of each.
+*/
+static int concurrent_group_size(
+    struct mtr_ctl *ctl)
+{
+    int group = ctl->dual_stack ? 2 : 1;
+
+    if (ctl->agent_count)
+        group *= ctl->agent_count;
+    return group;
+}
+
+
 static void parse_arg(
     struct mtr_ctl *ctl,
     names_t ** names,
@@ -316,6 +400,7 @@ static void parse_arg(
     char **argv)
 {
     int opt;
+    int group;
     int i;
     /* IMPORTANT: when adding or modifying an option:
        0/ try to find a somewhat logical order;
@@ -324,7 +409,29 @@ static void parse_arg(
        3/ update the help message (see usage() function).
      */
     enum {
-        OPT_DISPLAYMODE = CHAR_MAX + 1
+        OPT_DISPLAYMODE = CHAR_MAX + 1,
+        OPT_CONCURRENT,
+        OPT_DUAL_STACK,
+        OPT_AGENT,
+        OPT_HISTORY,
+        OPT_BURST,
+        OPT_PIPELINE,
+        OPT_FLOWS,
+        OPT_SHARE_PREFIX,
+        OPT_ADAPTIVE_TIMEOUT,
+        OPT_ADAPTIVE_PROBES,
+        OPT_CACHE,
+        OPT_ASN_DB,
+        OPT_RAW_BINARY,
+        OPT_RAW_FLUSH,
+        OPT_CAPTURE,
+        OPT_REPLAY,
+        OPT_REPLAY_REALTIME,
+        OPT_NDJSON,
+        OPT_NDJSON_CYCLES,
+        OPT_NDJSON_CHANGES,
+        OPT_PROMETHEUS,
+        OPT_SHM_STATS
     };
     static const struct option long_options[] = {
         /* option name, has argument, NULL, short name */
@@ -336,6 +443,11 @@ static void parse_arg(
         {"inet6", 0, NULL, '6'},        /* IPv6 only */
 #endif
         {"filename", 1, NULL, 'F'},
+        {"concurrent", 1, NULL, OPT_CONCURRENT},
+#ifdef ENABLE_IPV6
+        {"dual-stack", 0, NULL, OPT_DUAL_STACK},
+#endif
+        {"agent", 1, NULL, OPT_AGENT},
 
         {"report", 0, NULL, 'r'},
         {"report-wide", 0, NULL, 'w'},
@@ -347,8 +459,15 @@ static void parse_arg(
         {"gtk", 0, NULL, 'g'},
 #endif
         {"raw", 0, NULL, 'l'},
+        {"raw-binary", 0, NULL, OPT_RAW_BINARY},
+        {"raw-flush", 1, NULL, OPT_RAW_FLUSH},
         {"csv", 0, NULL, 'C'},
         {"json", 0, NULL, 'j'},
+        {"ndjson", 0, NULL, OPT_NDJSON},
+        {"ndjson-cycles", 1, NULL, OPT_NDJSON_CYCLES},
+        {"ndjson-changes", 0, NULL, OPT_NDJSON_CHANGES},
+        {"prometheus", 1, NULL, OPT_PROMETHEUS},
+        {"shm-stats", 1, NULL, OPT_SHM_STATS},
         {"displaymode", 1, NULL, OPT_DISPLAYMODE},
         {"split", 0, NULL, 'p'},        /* BL */
         /* maybe above should change to -d 'x' */
@@ -356,9 +475,20 @@ static void parse_arg(
         {"no-dns", 0, NULL, 'n'},
         {"show-ips", 0, NULL, 'b'},
         {"order", 1, NULL, 'o'},        /* fields to display & their order */
+        {"history", 1, NULL, OPT_HISTORY},
+        {"burst", 1, NULL, OPT_BURST},
+        {"pipeline", 1, NULL, OPT_PIPELINE},
+        {"flows", 1, NULL, OPT_FLOWS},
+        {"share-prefix", 0, NULL, OPT_SHARE_PREFIX},
+        {"adaptive-probes", 0, NULL, OPT_ADAPTIVE_PROBES},
+        {"cache", 1, NULL, OPT_CACHE},
+        {"capture", 1, NULL, OPT_CAPTURE},
+        {"replay", 1, NULL, OPT_REPLAY},
+        {"replay-realtime", 0, NULL, OPT_REPLAY_REALTIME},
 #ifdef HAVE_IPINFO
         {"ipinfo", 1, NULL, 'y'},       /* IP info lookup */
         {"aslookup", 0, NULL, 'z'},     /* Do AS lookup (--ipinfo 0) */
+        {"asn-db", 1, NULL, OPT_ASN_DB},
 #endif
 
         {"interval", 1, NULL, 'i'},
@@ -380,6 +510,7 @@ static void parse_arg(
         {"port", 1, NULL, 'P'}, /* target port number for TCP/SCTP/UDP */
         {"localport", 1, NULL, 'L'},    /* source port number for UDP */
         {"timeout", 1, NULL, 'Z'},      /* timeout for probe sockets */
+        {"adaptive-timeout", 0, NULL, OPT_ADAPTIVE_TIMEOUT},
         {"gracetime", 1, NULL, 'G'},    /* gracetime for replies after last probe */
 #ifdef SO_MARK
         {"mark", 1, NULL, 'M'}, /* use SO_MARK */
@@ -458,6 +589,53 @@ static void parse_arg(
                 error(EXIT_FAILURE, 0, "value out of range (%d - %d): %s",
                       DisplayModeDefault, (DisplayModeMAX - 1), optarg);
             break;
+        case OPT_CONCURRENT:
+            ctl->concurrent =
+                strtonum_or_err(optarg, "invalid argument", STRTO_INT);
+            if (ctl->concurrent < 1 || MAX_CONCURRENT < ctl->concurrent)
+                error(EXIT_FAILURE, 0, "value out of range (1 - %d): %s",
+                      MAX_CONCURRENT, optarg);
+            break;
+        case OPT_DUAL_STACK:
+            ctl->dual_stack = 1;
+            break;
+        case OPT_AGENT:
+            if (ctl->agent_count == MAX_AGENTS)
+                error(EXIT_FAILURE, 0, "at most %d agents may be given",
+                      MAX_AGENTS);
+            ctl->agent[ctl->agent_count++] = optarg;
+            break;
+        case OPT_HISTORY:
+            ctl->saved_pings =
+                strtonum_or_err(optarg, "invalid argument", STRTO_INT);
+            if (ctl->saved_pings < 1 || MAX_SAVED_PINGS < ctl->saved_pings)
+                error(EXIT_FAILURE, 0, "value out of range (1 - %d): %s",
+                      MAX_SAVED_PINGS, optarg);
+            break;
+        case OPT_BURST:
+            ctl->burst_rate =
+                strtonum_or_err(optarg, "invalid argument", STRTO_INT);
+            if (ctl->burst_rate < 1 || MAX_BURST_RATE < ctl->burst_rate)
+                error(EXIT_FAILURE, 0, "value out of range (1 - %d): %s",
+                      MAX_BURST_RATE, optarg);
+            break;
+        case OPT_PIPELINE:
+            ctl->pipeline =
+                strtonum_or_err(optarg, "invalid argument", STRTO_INT);
+            if (ctl->pipeline < 1 || MAX_PIPELINE < ctl->pipeline)
+                error(EXIT_FAILURE, 0, "value out of range (1 - %d): %s",
+                      MAX_PIPELINE, optarg);
+            break;
+        case OPT_FLOWS:
+            ctl->flows =
+                strtonum_or_err(optarg, "invalid argument", STRTO_INT);
+            if (ctl->flows < 1 || MAX_FLOWS < ctl->flows)
+                error(EXIT_FAILURE, 0, "value out of range (1 - %d): %s",
+                      MAX_FLOWS, optarg);
+            break;
+        case OPT_SHARE_PREFIX:
+            ctl->share_prefix = 1;
+            break;
         case 'c':
             ctl->MaxPing =
                 strtonum_or_err(optarg, "invalid argument", STRTO_INT);
@@ -609,6 +787,57 @@ static void parse_arg(
                 strtonum_or_err(optarg, "invalid argument", STRTO_INT);
             ctl->probe_timeout *= 1000000;
             break;
+        case OPT_ADAPTIVE_TIMEOUT:
+            ctl->adaptive_timeout = 1;
+            break;
+        case OPT_ADAPTIVE_PROBES:
+            ctl->adaptive_probes = 1;
+            break;
+        case OPT_CACHE:
+            ctl->cache_file = optarg;
+            break;
+        case OPT_CAPTURE:
+            ctl->capture_file = optarg;
+            break;
+        case OPT_REPLAY:
+            ctl->replay_file = optarg;
+            break;
+        case OPT_REPLAY_REALTIME:
+            ctl->replay_realtime = 1;
+            break;
+        case OPT_RAW_BINARY:
+            ctl->DisplayMode = DisplayRaw;
+            ctl->raw_binary = 1;
+            break;
+        case OPT_RAW_FLUSH:
+            ctl->raw_flush =
+                strtonum_or_err(optarg, "invalid argument", STRTO_INT);
+            if (ctl->raw_flush < 0) {
+                error(EXIT_FAILURE, 0, "--raw-flush must not be negative");
+            }
+            break;
+        case OPT_NDJSON:
+            ctl->DisplayMode = DisplayNDJSON;
+            break;
+        case OPT_NDJSON_CYCLES:
+            ctl->DisplayMode = DisplayNDJSON;
+            ctl->ndjson_cycles =
+                strtonum_or_err(optarg, "invalid argument", STRTO_INT);
+            if (ctl->ndjson_cycles < 1) {
+                error(EXIT_FAILURE, 0, "--ndjson-cycles must be positive");
+            }
+            break;
+        case OPT_NDJSON_CHANGES:
+            ctl->DisplayMode = DisplayNDJSON;
+            ctl->ndjson_changes = 1;
+            break;
+        case OPT_PROMETHEUS:
+            ctl->DisplayMode = DisplayPrometheus;
+            ctl->prometheus = optarg;
+            break;
+        case OPT_SHM_STATS:
+            ctl->shm_stats = optarg;
+            break;
         case '4':
             ctl->af = AF_INET;
             break;
@@ -629,6 +858,9 @@ static void parse_arg(
         case 'z':
             ctl->ipinfo_no = 0;
             break;
+        case OPT_ASN_DB:
+            ctl->asn_db = optarg;
+            break;
 #endif
 #ifdef SO_MARK
         case 'M':
@@ -644,10 +876,95 @@ static void parse_arg(
     if (ctl->DisplayMode == DisplayReport ||
         ctl->DisplayMode == DisplayTXT ||
         ctl->DisplayMode == DisplayJSON ||
+        ctl->DisplayMode == DisplayNDJSON ||
+        ctl->DisplayMode == DisplayPrometheus ||
         ctl->DisplayMode == DisplayXML ||
         ctl->DisplayMode == DisplayRaw || ctl->DisplayMode == DisplayCSV)
         ctl->Interactive = 0;
 
+    if (ctl->dual_stack && ctl->af != AF_UNSPEC)
+        error(EXIT_FAILURE, 0, "--dual-stack can't be used with -4 or -6");
+
+    /*  Each hostname traced takes a slot for each family and agent  */
+    group = concurrent_group_size(ctl);
+    if (group > 1) {
+        if (!ctl->concurrent)
+            ctl->concurrent = 1;
+        if (ctl->concurrent > MAX_CONCURRENT / group)
+            error(EXIT_FAILURE, 0,
+                  "%s trace at most %d hostnames at once",
+                  ctl->agent_count ? "these agents" : "--dual-stack",
+                  MAX_CONCURRENT / group);
+        ctl->concurrent *= group;
+    }
+
+    if (ctl->concurrent && (ctl->Interactive
+                            || ctl->DisplayMode == DisplayRaw))
+        error(EXIT_FAILURE, 0,
+              "%s needs report, txt, json, xml, csv or prometheus output",
+              ctl->agent_count ? "--agent" : ctl->dual_stack ?
+              "--dual-stack" : "--concurrent");
+
+    if (ctl->pipeline && (ctl->Interactive
+                          || ctl->DisplayMode == DisplayRaw))
+        error(EXIT_FAILURE, 0,
+              "--pipeline needs report, txt, json, xml or csv output");
+
+    if (ctl->pipeline && ctl->burst_rate)
+        error(EXIT_FAILURE, 0, "--pipeline can't be used with --burst");
+
+    if (ctl->adaptive_probes && ctl->burst_rate)
+        error(EXIT_FAILURE, 0,
+              "--adaptive-probes can't be used with --burst");
+
+    if (ctl->share_prefix && !ctl->concurrent)
+        error(EXIT_FAILURE, 0, "--share-prefix needs --concurrent");
+
+    if (ctl->share_prefix && ctl->burst_rate)
+        error(EXIT_FAILURE, 0, "--share-prefix can't be used with --burst");
+
+    /*
+       Flows are told apart by their local ports, with the remote port
+       fixed, so that mtr-packet identifies probes by their checksums.
+     */
+    if (ctl->flows && ctl->mtrtype != IPPROTO_UDP)
+        error(EXIT_FAILURE, 0, "--flows needs --udp");
+
+    if (ctl->flows && (ctl->localport ? ctl->localport : FLOW_PORT)
+        + ctl->flows - 1 > MaxPort)
+        error(EXIT_FAILURE, 0, "--flows %d exceed the local ports",
+              ctl->flows);
+
+    if (ctl->flows && !ctl->remoteport)
+        ctl->remoteport = FLOW_PORT;
+
+    if (ctl->DisplayMode == DisplayNDJSON && ctl->concurrent)
+        error(EXIT_FAILURE, 0, "--ndjson can't be used with --concurrent");
+
+    /*  A stream runs until stopped, unless given a count of cycles  */
+    if ((ctl->DisplayMode == DisplayNDJSON
+         || ctl->DisplayMode == DisplayPrometheus) && !ctl->ForceMaxPing)
+        ctl->MaxPing = INT_MAX;
+
+    if (ctl->shm_stats && (ctl->concurrent || ctl->replay_file))
+        error(EXIT_FAILURE, 0,
+              "--shm-stats can't be used with --concurrent or --replay");
+
+    if (ctl->prometheus && ctl->replay_file)
+        error(EXIT_FAILURE, 0, "--prometheus can't be used with --replay");
+
+    if (ctl->capture_file && ctl->replay_file)
+        error(EXIT_FAILURE, 0, "--capture can't be used with --replay");
+
+    if ((ctl->capture_file || ctl->replay_file) && ctl->concurrent)
+        error(EXIT_FAILURE, 0,
+              "--capture and --replay can't be used with --concurrent");
+
+#ifdef HAVE_GTK
+    if (ctl->replay_file && ctl->DisplayMode == DisplayGTK)
+        error(EXIT_FAILURE, 0, "--replay can't be used with --gtk");
+#endif
+
     if (optind > argc - 1)
         return;
 
@@ -696,34 +1013,229 @@ static void init_rand(
     would be to use gethostbyname().  We'll use getaddrinfo() instead
     to generate the hostent.
 */
+static int resolve_name(
+    const char *name,
+    int af,
+    struct addrinfo **res)
+{
+    struct addrinfo hints;
+
+    /* gethostbyname2() is deprecated so we'll use getaddrinfo() instead. */
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = af;
+    hints.ai_socktype = SOCK_DGRAM;
+    return getaddrinfo(name, NULL, &hints, res);
+}
+
+#ifdef HAVE_PTHREAD
+
+/*
+    With many hostnames, they are all resolved at once, up front, by a
+    pool of threads, so that resolving them doesn't add up serially
+    before each is traced.  Each is traced as soon as its own name is
+    resolved, and a name which takes longer than RESOLVE_TIMEOUT is
+    given up on, without holding up the others.
+*/
+static pthread_mutex_t resolve_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolve_done = PTHREAD_COND_INITIALIZER;
+static names_t *resolve_next;   /* the next name for a thread to take */
+static int resolve_af;
+static int resolving;           /* whether resolver threads were started */
+static int resolve_stopped;     /* once the names are to be freed */
+
+static void *resolve_thread(
+    void *arg ATTRIBUTE_UNUSED)
+{
+    names_t *name;
+    char *hostname = NULL;
+    struct addrinfo *res;
+    int gai_error;
+
+    while (1) {
+        /*
+           The lookup is of a copy of the name, since the names may be
+           freed while it is under way
+         */
+        pthread_mutex_lock(&resolve_lock);
+        name = resolve_next;
+        if (name) {
+            resolve_next = name->next;
+            name->started = time(NULL);
+            hostname = xstrdup(name->name);
+        }
+        pthread_mutex_unlock(&resolve_lock);
+        if (!name)
+            break;
+
+        gai_error = resolve_name(hostname, resolve_af, &res);
+        free(hostname);
+
+        pthread_mutex_lock(&resolve_lock);
+        if (resolve_stopped || name->resolved) {
+            /*  It was given up on, and may be gone  */
+            if (!gai_error)
+                freeaddrinfo(res);
+        } else {
+            name->res = gai_error ? NULL : res;
+            name->gai_error = gai_error;
+            name->resolved = 1;
+        }
+        pthread_cond_broadcast(&resolve_done);
+        pthread_mutex_unlock(&resolve_lock);
+    }
+
+    return NULL;
+}
+
+/*  Start resolving a list of names, if there is more than one  */
+static void resolve_names(
+    struct mtr_ctl *ctl,
+    names_t * names)
+{
+    pthread_t thread;
+    sigset_t signals, oldsignals;
+    names_t *name;
+    int count = 0;
+    int i;
+
+    for (name = names; name; name = name->next)
+        count++;
+    if (count < 2)
+        return;
+    if (count > RESOLVE_THREADS)
+        count = RESOLVE_THREADS;
+
+    resolve_next = names;
+    resolve_af = ctl->dual_stack ? AF_UNSPEC : ctl->af;
+    resolving = 1;
+
+    /*  Signals, such as SIGWINCH, are left to the main thread  */
+    sigfillset(&signals);
+    pthread_sigmask(SIG_SETMASK, &signals, &oldsignals);
+    for (i = 0; i < count; i++) {
+        if (pthread_create(&thread, NULL, resolve_thread, NULL)) {
+            error(EXIT_FAILURE, errno, "can't start resolver thread");
+        }
+        pthread_detach(thread);
+    }
+    pthread_sigmask(SIG_SETMASK, &oldsignals, NULL);
+}
+
+/*  Stop the resolver threads from touching the names  */
+static void resolve_stop(
+    void)
+{
+    pthread_mutex_lock(&resolve_lock);
+    resolve_next = NULL;
+    resolve_stopped = 1;
+    pthread_mutex_unlock(&resolve_lock);
+}
+
+#else
+
+static void resolve_names(
+    struct mtr_ctl *ctl ATTRIBUTE_UNUSED,
+    names_t * names ATTRIBUTE_UNUSED)
+{
+}
+
+static void resolve_stop(
+    void)
+{
+}
+
+#endif
+
+/*
+    The addresses of a name, waiting for them if resolver threads are
+    at work on them, or resolving them now if not.
+*/
+static int resolved_name(
+    struct mtr_ctl *ctl,
+    names_t * name,
+    struct addrinfo **res)
+{
+#ifdef HAVE_PTHREAD
+    struct timespec deadline;
+
+    if (resolving) {
+        pthread_mutex_lock(&resolve_lock);
+        while (!name->resolved) {
+            if (!name->started) {
+                pthread_cond_wait(&resolve_done, &resolve_lock);
+                continue;
+            }
+            deadline.tv_sec = name->started + RESOLVE_TIMEOUT;
+            deadline.tv_nsec = 0;
+            if (pthread_cond_timedwait(&resolve_done, &resolve_lock,
+                                       &deadline) == ETIMEDOUT
+                && !name->resolved) {
+                name->gai_error = EAI_AGAIN;
+                name->resolved = 1;
+            }
+        }
+        pthread_mutex_unlock(&resolve_lock);
+
+        *res = name->res;
+        return name->gai_error;
+    }
+#endif
+
+    /*  Both families of a --dual-stack trace come from one lookup  */
+    if (!name->resolved) {
+        name->gai_error = resolve_name(name->name,
+                                       ctl->dual_stack ? AF_UNSPEC :
+                                       ctl->af, &name->res);
+        if (name->gai_error)
+            name->res = NULL;
+        name->resolved = 1;
+    }
+
+    *res = name->res;
+    return name->gai_error;
+}
+
+/*
+    The first address of a name of the given family, or of any family
+    for AF_UNSPEC, as a hostent.
+*/
 static int get_hostent_from_name(
     struct mtr_ctl *ctl,
     struct hostent *host,
-    const char *name,
-    char **alptr)
+    names_t * name,
+    char **alptr,
+    int af)
 {
     int gai_error;
-    struct addrinfo hints, *res;
+    struct addrinfo *res;
     struct sockaddr_in *sa4;
 #ifdef ENABLE_IPV6
     struct sockaddr_in6 *sa6;
 #endif
 
-    /* gethostbyname2() is deprecated so we'll use getaddrinfo() instead. */
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = ctl->af;
-    hints.ai_socktype = SOCK_DGRAM;
-    gai_error = getaddrinfo(name, NULL, &hints, &res);
+    gai_error = resolved_name(ctl, name, &res);
     if (gai_error) {
         if (gai_error == EAI_SYSTEM)
-            error(0, 0, "Failed to resolve host: %s", name);
+            error(0, 0, "Failed to resolve host: %s", name->name);
         else
-            error(0, 0, "Failed to resolve host: %s: %s", name,
+            error(0, 0, "Failed to resolve host: %s: %s", name->name,
                   gai_strerror(gai_error));
 
         return -1;
     }
 
+    while (af != AF_UNSPEC && res && res->ai_family != af)
+        res = res->ai_next;
+    if (!res) {
+        /*  With --dual-stack, a host is traced for the families it has  */
+        if (!ctl->dual_stack)
+            error(0, 0, "No %s address for host: %s",
+                  af == AF_INET ? "IPv4" : "IPv6", name->name);
+
+        errno = EINVAL;
+        return -1;
+    }
+
     /* Convert the first addrinfo into a hostent. */
     memset(host, 0, sizeof(struct hostent));
     host->h_name = res->ai_canonname;
@@ -755,6 +1267,238 @@ static int get_hostent_from_name(
 }
 
 
+/*  A hostname traced alongside others, with --concurrent  */
+struct concurrent_trace {
+    struct net_session *net;    /* NULL while the slot is free */
+    char *name;
+    time_t start_time;
+    int ping_count;             /* completed rounds of probes */
+    int graceperiod;
+    long long next_send;        /* when its next probe is due */
+    long long startgrace;
+    int vantage;                /* the agent tracing it */
+};
+
+static int start_concurrent_trace(
+    struct mtr_ctl *ctl,
+    struct concurrent_trace *trace,
+    names_t * name,
+    int af)
+{
+    struct hostent trhost;
+    char *alptr[2];
+
+    if (get_hostent_from_name(ctl, &trhost, name, alptr, af) != 0)
+        return -1;
+
+    memset(trace, 0, sizeof(struct concurrent_trace));
+    trace->net = net_session_new(ctl, &trhost);
+    trace->name = name->name;
+    trace->vantage = ctl->vantage;
+    if (ctl->prometheus)
+        prometheus_add_target(trace->name, trace->net);
+    trace->start_time = time(NULL);
+    trace->next_send = event_now();
+
+    return 0;
+}
+
+/*
+    Start tracing a hostname in a free group of slots, with a trace for
+    each agent, and with --dual-stack, one for each family of each.
+*/
+static void start_concurrent_target(
+    struct mtr_ctl *ctl,
+    struct concurrent_trace *trace,
+    names_t * name)
+{
+    int vantages = ctl->agent_count ? ctl->agent_count : 1;
+
+    for (ctl->vantage = 0; ctl->vantage < vantages; ctl->vantage++) {
+        if (ctl->dual_stack) {
+            start_concurrent_trace(ctl, trace++, name, AF_INET);
+            start_concurrent_trace(ctl, trace++, name, AF_INET6);
+        } else {
+            start_concurrent_trace(ctl, trace++, name, AF_UNSPEC);
+        }
+    }
+    ctl->vantage = 0;
+}
+
+/*  Whether none of a group of slots holds a trace  */
+static int is_concurrent_group_free(
+    struct concurrent_trace *trace,
+    int group)
+{
+    int i;
+
+    for (i = 0; i < group; i++) {
+        if (trace[i].net)
+            return 0;
+    }
+    return 1;
+}
+
+/*  Whether a trace has completed, and waited out its grace period  */
+static int is_concurrent_trace_done(
+    struct concurrent_trace *trace,
+    long long now,
+    long long graceusec)
+{
+    return trace->net && trace->graceperiod
+        && now - trace->startgrace > graceusec;
+}
+
+/*  Report a trace once its grace period has passed, freeing its slot  */
+static void finish_concurrent_trace(
+    struct mtr_ctl *ctl,
+    struct concurrent_trace *trace)
+{
+    ctl->net = trace->net;
+    ctl->af = net_session_af(trace->net);
+    ctl->Hostname = trace->name;
+    ctl->start_time = trace->start_time;
+
+    /*  The trace is reported as being from its agent's host  */
+    if (ctl->agent_count)
+        xstrncpy(ctl->LocalHostname, ctl->agent[trace->vantage],
+                 sizeof(ctl->LocalHostname));
+
+    net_end_transit(ctl->net);
+    lock(stdout);
+    display_open(ctl);
+    display_close(ctl);
+    unlock(stdout);
+
+    if (ctl->prometheus)
+        prometheus_remove_target(trace->net);
+    net_session_free(trace->net);
+    trace->net = NULL;
+    ctl->net = NULL;
+}
+
+/*
+    Trace up to ctl->concurrent hostnames at once, through a single
+    mtr-packet child, starting the next hostname as each trace is
+    reported.  The probes of all the targets are interleaved on one
+    clock, running as fast as the targets would if each were traced
+    alone, and each tick probes the target whose probe is most overdue.
+*/
+static void trace_concurrently(
+    struct mtr_ctl *ctl,
+    names_t * names)
+{
+    struct concurrent_trace trace[MAX_CONCURRENT];
+    struct concurrent_trace *due, *first;
+    long long now, lastsend, sendtime, interval, wakeup, graceusec;
+    double rate;
+    int group = concurrent_group_size(ctl);
+    int pipe_open = 0;
+    int active, waiting, i, j;
+
+    dns_open(ctl);
+
+    memset(trace, 0, sizeof(trace));
+    graceusec = ctl->GraceTime * 1000000;
+    lastsend = 0;
+
+    while (1) {
+        for (i = 0; i < ctl->concurrent; i += group) {
+            while (is_concurrent_group_free(&trace[i], group) && names) {
+                start_concurrent_target(ctl, &trace[i], names);
+                names = names->next;
+            }
+
+            /*  mtr-packet checks for the family of the first target  */
+            if (!is_concurrent_group_free(&trace[i], group) && !pipe_open) {
+                if (net_open_pipe(ctl) != 0) {
+                    error(EXIT_FAILURE, 0, "Unable to start net module");
+                }
+                pipe_open = 1;
+            }
+        }
+
+        now = event_now();
+        wakeup = now + graceusec;
+        active = 0;
+        rate = 0;
+        due = NULL;
+
+        for (i = 0; i < ctl->concurrent; i++) {
+            if (!trace[i].net)
+                continue;
+
+            if (trace[i].graceperiod) {
+                if (now - trace[i].startgrace > graceusec) {
+                    /*
+                       The traces of a hostname from each agent, and of
+                       each family, are reported together, in order.
+                     */
+                    first = &trace[i - i % group];
+                    waiting = 0;
+                    for (j = 0; j < group; j++) {
+                        if (first[j].net
+                            && !is_concurrent_trace_done(&first[j], now,
+                                                         graceusec))
+                            waiting = 1;
+                    }
+                    if (waiting) {
+                        active++;
+                        continue;
+                    }
+                    for (j = 0; j < group; j++) {
+                        if (first[j].net)
+                            finish_concurrent_trace(ctl, &first[j]);
+                    }
+                    continue;
+                }
+                if (trace[i].startgrace + graceusec < wakeup)
+                    wakeup = trace[i].startgrace + graceusec;
+            } else {
+                rate += 1.0 / calc_deltatime(trace[i].net, ctl->WaitTime);
+                if (!due || trace[i].next_send < due->next_send)
+                    due = &trace[i];
+            }
+            active++;
+        }
+
+        if (!active) {
+            if (!names)
+                break;
+            continue;
+        }
+
+        if (due) {
+            interval = 1.0 / rate;
+            sendtime = lastsend + interval;
+            if (sendtime < due->next_send)
+                sendtime = due->next_send;
+
+            if (now >= sendtime) {
+                lastsend = now;
+
+                ctl->af = net_session_af(due->net);
+                due->next_send += calc_deltatime(due->net, ctl->WaitTime);
+                if (net_send_batch(ctl, due->net))
+                    due->ping_count++;
+
+                if (due->ping_count >= ctl->MaxPing) {
+                    due->graceperiod = 1;
+                    due->startgrace = now;
+                    net_session_stop(ctl, due->net);
+                }
+                continue;
+            }
+
+            if (sendtime < wakeup)
+                wakeup = sendtime;
+        }
+
+        select_events(ctl, wakeup);
+    }
+}
+
+
 int main(
     int argc,
     char **argv)
@@ -782,6 +1526,8 @@ int main(
     ctl.maxTTL = 30;
     ctl.maxUnknown = 12;
     ctl.probe_timeout = 10 * 1000000;
+    ctl.saved_pings = SAVED_PINGS;
+    ctl.ndjson_cycles = 1;
     ctl.ipinfo_no = -1;
     ctl.ipinfo_max = -1;
     xstrncpy(ctl.fld_active, "LS NABWV", 2 * MAXFLD);
@@ -817,21 +1563,55 @@ int main(
         append_to_names(&names_head, name);
     }
 
+    if (ctl.cache_file)
+        cache_open(ctl.cache_file);
+
+    /*  A replay traces nothing, and takes its hostnames from the capture  */
+    if (ctl.replay_file) {
+        if (names_head)
+            error(EXIT_FAILURE, 0,
+                  "--replay takes its hostnames from the capture");
+        replay(&ctl, ctl.replay_file);
+        cache_close();
+        return 0;
+    }
+
     /* default: localhost. */
     if (!names_head)
         append_to_names(&names_head, "localhost");
 
-    names_walk = names_head;
+    if (ctl.capture_file)
+        capture_open(ctl.capture_file);
+    if (ctl.prometheus)
+        prometheus_open(ctl.prometheus);
+    if (ctl.shm_stats)
+        shmstats_open(ctl.shm_stats);
+    resolve_names(&ctl, names_head);
+
+    if (ctl.concurrent) {
+        if (gethostname(ctl.LocalHostname, sizeof(ctl.LocalHostname))) {
+            xstrncpy(ctl.LocalHostname, "UNKNOWNHOST",
+                     sizeof(ctl.LocalHostname));
+        }
+        trace_concurrently(&ctl, names_head);
+        names_walk = NULL;
+    } else
+        names_walk = names_head;
     while (names_walk != NULL) {
 
         ctl.Hostname = names_walk->name;
-        if (gethostname(ctl.LocalHostname, sizeof(ctl.LocalHostname))) {
+        if (ctl.agent_count) {
+            xstrncpy(ctl.LocalHostname, ctl.agent[0],
+                     sizeof(ctl.LocalHostname));
+        } else if (gethostname(ctl.LocalHostname,
+                               sizeof(ctl.LocalHostname))) {
             xstrncpy(ctl.LocalHostname, "UNKNOWNHOST",
                      sizeof(ctl.LocalHostname));
         }
 
         host = &trhost;
-        if (get_hostent_from_name(&ctl, host, ctl.Hostname, alptr) != 0) {
+        if (get_hostent_from_name(&ctl, host, names_walk, alptr, AF_UNSPEC)
+            != 0) {
             if (ctl.Interactive)
                 exit(EXIT_FAILURE);
             else {
@@ -850,15 +1630,22 @@ int main(
             }
         }
 
+        capture_session(&ctl);
+        shmstats_session(&ctl);
+        if (ctl.prometheus)
+            prometheus_add_target(ctl.Hostname, ctl.net);
+
         lock(stdout);
         dns_open(&ctl);
         display_open(&ctl);
 
         display_loop(&ctl);
 
-        net_end_transit();
+        net_end_transit(ctl.net);
         display_close(&ctl);
         unlock(stdout);
+        if (ctl.prometheus)
+            prometheus_remove_target(ctl.net);
 
         if (ctl.Interactive)
             break;
@@ -868,9 +1655,17 @@ int main(
     }
 
     net_close();
+    capture_close();
+    if (ctl.prometheus)
+        prometheus_close();
+    shmstats_close();
+    cache_close();
+    resolve_stop();
 
     while (names_head != NULL) {
         names_t *item = names_head;
+        if (item->res)
+            freeaddrinfo(item->res);
         free(item->name);
         item->name = NULL;
         names_head = item->next;
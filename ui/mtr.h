@@ -60,11 +60,21 @@ typedef int time_t;
 #define FLD_INDEX_SZ 256
 
 /* net related definitions */
-#define SAVED_PINGS 200
-#define MAXPATH 8
+#define SAVED_PINGS 200         /* default pings kept for graphs */
+#define MAX_SAVED_PINGS 100000
+#define MAXPATH 8               /* multipath addresses in --shm-stats */
 #define MaxHost 256
 #define MinPort 1024
 #define MaxPort 65535
+#define MAX_CONCURRENT 32       /* most targets traced at once */
+#define MAX_AGENTS 8            /* most remote agents traced from */
+#define MAX_BURST_RATE 100000   /* most probes/sec within a burst */
+#define MAX_PIPELINE 100        /* most report cycles kept in flight */
+#define MAX_FLOWS 1024          /* most UDP flows of --flows */
+#define FLOW_PORT 33434         /* the ports of flows, unless given */
+#define PIPELINE_HOP_GAP 20000  /* least usec between probes of a hop */
+#define PIPELINE_IN_FLIGHT 1000 /* under mtr-packet's MAX_PROBES */
+#define MIN_PROBE_TIMEOUT 100000        /* least adaptive timeout, usec */
 #define MAXPACKET 4470          /* largest test packet size */
 #define MINPACKET 28            /* 20 bytes IP header and 8 bytes ICMP or UDP */
 #define MAXLABELS 8             /* http://kb.juniper.net/KB2190 (+ 3 just in case) */
@@ -78,6 +88,8 @@ typedef int time_t;
 typedef int socklen_t;
 #endif
 
+struct net_session;
+
 struct mtr_ctl {
     int MaxPing;
     float WaitTime;
@@ -85,6 +97,12 @@ struct mtr_ctl {
     char *Hostname;
     char *InterfaceName;
     char *InterfaceAddress;
+    char *cache_file;           /* names and ipinfo kept across runs */
+    char *asn_db;               /* offline ipinfo database, or NULL */
+    char *capture_file;         /* where probes and replies are recorded */
+    char *prometheus;           /* where the exporter listens, or NULL */
+    char *shm_stats;            /* the file statistics are published in */
+    char *replay_file;          /* a capture to replay, in place of tracing */
     char LocalHostname[128];
     int ipinfo_no;
     int ipinfo_max;
@@ -103,17 +121,34 @@ struct mtr_ctl {
     int remoteport;             /* target port for TCP tracing */
     int localport;              /* source port for UDP tracing */
     int probe_timeout;          /* timeout for probe sockets */
+    int adaptive_timeout;       /* time out probes by each hop's RTT */
+    int adaptive_probes;        /* probe stable hops less often */
+    int concurrent;             /* targets traced at once, or 0 */
+    int dual_stack;             /* trace both IPv4 and IPv6 of each */
+    char *agent[MAX_AGENTS];    /* HOST:PORT of each remote agent */
+    int agent_count;
+    int vantage;                /* the agent of new sessions */
+    int saved_pings;            /* pings kept for each hop's graph */
+    int burst_rate;             /* probes/sec within a burst, or 0 */
+    int pipeline;               /* report cycles kept in flight, or 0 */
+    int flows;                  /* UDP flows to vary across, or 0 */
+    int share_prefix;           /* probe hops common to targets once */
+    int raw_flush;              /* msec between writes of raw output */
+    int ndjson_cycles;          /* cycles between lines of --ndjson */
+    time_t start_time;          /* start of the reported trace, or 0 */
     unsigned char fld_active[2 * MAXFLD];       /* SO_MARK to set for ping packet */
     int display_mode;           /* display mode selector */
     int fld_index[FLD_INDEX_SZ];        /* default display field (defined by key in net.h) and order */
     char available_options[MAXFLD];
     int display_offset;         /* only used in text mode */
     void *gtk_data;             /* pointer to hold arbitrary gtk data */
+    struct net_session *net;    /* the session being displayed */
     unsigned int                /* bit field to hold named booleans */
      ForceMaxPing:1,
         use_dns:1,
         show_ips:1,
-        enablempls:1, dns:1, reportwide:1, Interactive:1, DisplayMode:5;
+        enablempls:1, dns:1, reportwide:1, Interactive:1, DisplayMode:5,
+        raw_binary:1, replay_realtime:1, ndjson_changes:1;
 };
 
 /* dynamic field drawing */
@@ -125,6 +160,7 @@ struct fields {
     const int length;
     int (
     *net_xxx) (
+    struct net_session *,
     int);
 };
 /* defined in mtr.c */
@@ -20,7 +20,9 @@
 
 #include <errno.h>
 #include <ifaddrs.h>
+#include <limits.h>
 #include <math.h>
+#include <netdb.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/select.h>
@@ -38,400 +40,1591 @@
 #include "display.h"
 #include "dns.h"
 #include "utils.h"
+#include "capture.h"
+#include "addrtab.h"
+#include "packet/agent.h"
+#include "packet/trace.h"
 
-#define MinSequence 33000
-#define MaxSequence 65536
+/*
+    Probes are identified to mtr-packet by opaque tokens, and mtr-packet
+    chooses the sequence numbers used on the wire from its own pool.
+    Tokens are allocated consecutively from MinToken, leaving smaller
+    tokens to the requests of cmdpipe.c, and being positive ints, as
+    the text protocol carries them, wrap only after two billion probes.
+*/
+#define MinToken 256
+#define MaxToken INT_MAX
+
+/*  The initial number of slots in the table of probes in flight  */
+#define PROBE_TABLE_MIN_SIZE 256
+
+#ifndef INET_ADDRSTRLEN
+#define INET_ADDRSTRLEN 16
+#endif
+
+/*
+    Round trip times are also counted in a log-linear histogram, for
+    the percentile fields.  Times below LATENCY_SUB_BUCKETS microseconds
+    have a bucket each.  Above that, each power of two is split into
+    LATENCY_SUB_BUCKETS buckets, so a percentile is within about 2% of
+    the true value, in fixed memory, however long mtr runs.  Times of
+    2^LATENCY_MAX_BITS microseconds, about 134 seconds, or more share
+    the last bucket.
+*/
+#define LATENCY_SUB_BITS 5
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_BITS 27
+#define LATENCY_BUCKETS \
+    ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+/*  The multiplier of the round trip time variation in the timeout  */
+#define RTO_K 4
+
+/*
+    With --adaptive-probes, a hop's probes are halved in frequency after
+    each ADAPTIVE_SAMPLES consecutive stable replies, down to one cycle
+    in ADAPTIVE_MAX_EVERY.  Replies differing from the last by no more
+    than twice the RTT variation, or ADAPTIVE_JITTER, are stable.
+*/
+#define ADAPTIVE_SAMPLES 10
+#define ADAPTIVE_MAX_EVERY 8
+#define ADAPTIVE_JITTER 1000
+
+/*
+    The addresses seen at one hop, beyond which further addresses are
+    ignored, so that replies from many sources can't exhaust memory.
+*/
+#define MAX_HOP_PATHS 256
 
-static int packetsize;          /* packet size used by ping */
+/*
+    With --flows, a hop is sent new flows until the chance that they
+    all missed a further branch falls below FLOW_MISS_CHANCE.
+*/
+#define FLOW_MISS_CHANCE 0.05
 
 static void sockaddrtop(
     struct sockaddr *saddr,
     char *strptr,
     size_t len);
 
+/*
+    The statistics of a hop, updated by each of its replies and read by
+    each redraw, and kept compact so that these touch few cache lines.
+    The hop's multipath addresses, MPLS labels and latency histogram
+    are kept apart, in a detail allocated when the hop first replies
+    or is first sent a flow, and its recent round trip times are in
+    the session's saved array.
+*/
 struct nethost {
-    ip_t addr;
-    ip_t addrs[MAXPATH];        /* for multi paths byMin */
+    int addr_id;                /* the interned address, or 0 if unknown */
     int err;
     int xmit;
     int returned;
     int sent;
     int up;
-    long long ssd;              /* sum of squares of differences from the current average */
+    int transit;
     int last;
     int best;
     int worst;
-    int avg;                    /* average:  addByMin */
-    int gmean;                  /* geometric mean: addByMin */
+    int first;                  /* the first reply, offsetting the sums */
+    long long sum;              /* sum of replies less first */
+    long long sumsq;            /* sum of squares of replies less first */
+    double sumlog;              /* sum of logarithms of replies */
+    long long jsum;             /* sum of jitter */
     int jitter;                 /* current jitter, defined as t1-t0 addByMin */
-    int javg;                   /* avg jitter */
     int jworst;                 /* max jitter */
     int jinta;                  /* estimated variance,? rfc1889's "Interarrival Jitter" */
-    int transit;
-    int saved[SAVED_PINGS];
-    int saved_seq_offset;
+    int saved_column;           /* newest column blanked in its history */
+    int srtt;                   /* smoothed round trip time, usec */
+    int rttvar;                 /* round trip time variation, usec */
+    int rto;                    /* probe timeout, usec, or 0 if unknown */
+    int probe_every;            /* cycles per probe, with adaptive probes */
+    int stable;                 /* consecutive stable replies */
+    int owed;                   /* cycles left to the leader, unanswered */
+    unsigned long changed;      /* the session's changes when last changed */
+    struct nethost_detail *detail;      /* NULL until the hop replies */
+};
+
+
+/*
+    One of the addresses which have replied at a hop, with the results
+    of the probes of the flow which reaches it, as far as we know one.
+*/
+struct nethost_path {
+    int addr_id;
+    int flow;                   /* a flow reaching it, or -1 if none */
+    int xmit;                   /* probes of its flows completed */
+    int returned;
+    long long sum;              /* sum of replies, usec */
     struct mplslen mpls;
-    struct mplslen mplss[MAXPATH];
 };
 
 
-struct sequence {
-    int index;
-    int transit;
-    int saved_seq;
-    struct timeval time;
+/*  The data of a hop which few replies change, or only some displays read  */
+struct nethost_detail {
+    struct nethost_path *path;  /* for multi paths, the first is addr_id */
+    int path_count;
+    int path_max;               /* entries allocated in path */
+    int *flow_path;             /* with --flows, each flow's path, or -1 */
+    int flows_tried;            /* with --flows, the flows sent so far */
+    int next_path;              /* with --flows, the path to revisit */
+    uint32_t latency[LATENCY_BUCKETS];  /* histogram of round trip times */
 };
 
+/*  The detail of hops which have yet to reply  */
+static struct nethost_detail no_detail;
 
-static struct nethost host[MaxHost];
-static struct sequence sequence[MaxSequence];
-static struct packet_command_pipe_t packet_command_pipe;
+/*  The path of an index beyond those of a hop  */
+static struct nethost_path no_path;
 
-#ifdef ENABLE_IPV6
-static struct sockaddr_storage sourcesockaddr_struct;
-static struct sockaddr_storage remotesockaddr_struct;
-static struct sockaddr_in6 *ssa6 =
-    (struct sockaddr_in6 *) &sourcesockaddr_struct;
-static struct sockaddr_in6 *rsa6 =
-    (struct sockaddr_in6 *) &remotesockaddr_struct;
-#else
-static struct sockaddr_in sourcesockaddr_struct;
-static struct sockaddr_in remotesockaddr_struct;
-#endif
 
-static struct sockaddr *sourcesockaddr =
-    (struct sockaddr *) &sourcesockaddr_struct;
-static struct sockaddr *remotesockaddr =
-    (struct sockaddr *) &remotesockaddr_struct;
-static struct sockaddr_in *ssa4 =
-    (struct sockaddr_in *) &sourcesockaddr_struct;
-static struct sockaddr_in *rsa4 =
-    (struct sockaddr_in *) &remotesockaddr_struct;
+/*  A probe in flight, awaiting its reply or its timeout  */
+struct probe_entry {
+    int token;                  /* 0 if the slot is free */
+    struct net_session *net;    /* the session which sent it */
+    int index;                  /* the hop probed */
+    int saved_column;           /* its column of the hop's history */
+    int flow;                   /* its flow of --flows, or -1 */
+};
+
+
+/*
+    The probes in flight of all sessions, in a hash table keyed by
+    token, with linear probing.  As tokens are allocated consecutively,
+    the token modulo the table size spreads them evenly, and the probes
+    of a round occupy neighbouring slots.  The table doubles whenever
+    it becomes half full, so its size follows the number of probes
+    actually in flight rather than the range of tokens.
+*/
+struct probe_table {
+    struct probe_entry *entry;
+    int size;                   /* slots, a power of two */
+    int count;                  /* slots in use */
+};
 
-static ip_t *sourceaddress;
-static ip_t *remoteaddress;
 
+/*
+    The state of one traced target: its hop table, its addresses
+    and its progress through the current round of probes.  Usually
+    there is a single session, but several may be traced at once,
+    sharing one mtr-packet child and one table of probes in flight.
+
+    The hop table grows with the discovered path, up to MaxHost.
+
+    Each hop keeps the round trip times of its recent probes in a ring
+    of saved_max entries, within saved.  All hops share the numbering
+    of the columns of this history, one column per round of probes,
+    and the ring slot of a column is its number modulo saved_max.
+    Rather than clearing the new column of every hop as the history
+    advances, a hop's skipped columns are blanked as it is next used.
+*/
+struct net_session {
+    struct nethost *host;
+    int maxhosts;               /* entries allocated in host */
+    int *saved;                 /* saved_max pings for each host */
+    int saved_max;
+    int saved_column;           /* the newest column of the history */
+    struct sockaddr_storage sourcesockaddr;
+    struct sockaddr_storage remotesockaddr;
+    ip_t *sourceaddress;        /* the address within sourcesockaddr */
+    ip_t *remoteaddress;        /* the address within remotesockaddr */
+    int remote_id;              /* remoteaddress, interned */
 #ifdef ENABLE_IPV6
-static char localaddr[INET6_ADDRSTRLEN];
+    char localaddr[INET6_ADDRSTRLEN];
 #else
-#ifndef INET_ADDRSTRLEN
-#define INET_ADDRSTRLEN 16
-#endif
-static char localaddr[INET_ADDRSTRLEN];
+    char localaddr[INET_ADDRSTRLEN];
 #endif
+    int af;
+    int batch_at;
+    int numhosts;
+    int packetsize;             /* packet size used by ping */
+    int burst_rate;             /* probes/sec within a burst, or 0 */
+    int burst_sent;             /* probes sent in the current burst */
+    int burst_length;           /* probes sent in the last burst */
+    int pipeline;               /* report cycles kept in flight, or 0 */
+    int in_flight;              /* probes awaiting a reply */
+    int cycle;                  /* cycles of probes completed */
+    int cycle_probes;           /* hops due in this cycle, if adaptive */
+    unsigned long changes;      /* count of changes to the hop table */
+    struct packet_command_pipe_t *cmdpipe;      /* sending its probes */
+    int serial;                 /* sessions are led only by earlier ones */
+    struct net_session *leader; /* answering for hops left to it, or NULL */
+    int shared_hops;            /* hops before which the leader probes */
+    int stopped;                /* sending no more probes, so leading none */
+    struct net_session *next_session;   /* in the list of all sessions */
+};
+
+
+/*  Probes in flight, found by the token of their request  */
+static struct probe_table probes;
 
-static int batch_at = 0;
-static int numhosts = 10;
+/*  Every session, so that those sharing a prefix of hops can be found  */
+static struct net_session *sessions;
+
+/*  The local mtr-packet child, or a connection to each remote agent  */
+static struct packet_command_pipe_t packet_command_pipe[MAX_AGENTS];
+static int packet_command_pipe_count;
 
 /* return the number of microseconds to wait before sending the next
    ping */
 int calc_deltatime(
+    struct net_session *net,
     float waittime)
 {
-    waittime /= numhosts;
+    int hops = net->numhosts;
+    int gap, rest;
+
+    /*  Skipped hops leave the cycle's interval to those probed  */
+    if (net->cycle_probes) {
+        hops = net->cycle_probes;
+    }
+
+    /*
+       In burst mode, the probes of a cycle are paced at the burst rate,
+       and the next cycle starts an interval after the last began.
+     */
+    if (net->burst_rate) {
+        gap = 1000000 / net->burst_rate;
+        if (net->burst_sent) {
+            return gap;
+        }
+
+        rest = 1000000 * waittime;
+        if (net->burst_length > 1) {
+            rest -= (net->burst_length - 1) * gap;
+        }
+        return rest > gap ? rest : gap;
+    }
+
+    /*
+       With a pipeline, a cycle starts every interval divided among the
+       cycles in flight, though no hop is probed more often than
+       PIPELINE_HOP_GAP allows, lest it limit the rate of its replies.
+     */
+    if (net->pipeline) {
+        gap = 1000000 * waittime / net->pipeline;
+        if (gap < PIPELINE_HOP_GAP) {
+            gap = PIPELINE_HOP_GAP;
+        }
+        return gap / hops;
+    }
+
+    waittime /= hops;
     return 1000000 * waittime;
 }
 
 
-static void save_sequence(
-    struct mtr_ctl *ctl,
-    int index,
-    int seq)
+/*
+    Note a change to a hop, for displays which redraw only the hops
+    which have changed since they last looked.
+*/
+static void net_changed(
+    struct net_session *net,
+    int at)
 {
-    display_rawxmit(ctl, index, seq);
+    net->host[at].changed = ++net->changes;
+}
 
-    sequence[seq].index = index;
-    sequence[seq].transit = 1;
-    sequence[seq].saved_seq = ++host[index].xmit;
-    memset(&sequence[seq].time, 0, sizeof(sequence[seq].time));
 
-    host[index].transit = 1;
+/*  Clear hop entries, as they are before any probe is sent  */
+static void net_init_hosts(
+    struct net_session *net,
+    int first,
+    int count)
+{
+    int at, i;
+
+    memset(&net->host[first], 0, count * sizeof(struct nethost));
 
-    if (host[index].sent) {
-        host[index].up = 0;
+    for (at = first; at < first + count; at++) {
+        net_changed(net, at);
+        net->host[at].saved_column = net->saved_column;
+        for (i = 0; i < net->saved_max; i++) {
+            net->saved[at * net->saved_max + i] = -2;
+        }
     }
-
-    host[index].sent = 1;
-    net_save_xmit(index);
 }
 
-static int new_sequence(
-    struct mtr_ctl *ctl,
-    int index)
+
+/*
+    Make room for hops up to a count, plus a spare entry beyond it,
+    as the displays show the first unanswered hop past the last
+    responding one.
+*/
+static void net_grow_hosts(
+    struct net_session *net,
+    int count)
 {
-    static int next_sequence = MinSequence;
-    int seq;
+    struct nethost *host;
+    int *saved;
+    int maxhosts = net->maxhosts ? net->maxhosts : 16;
 
-    seq = next_sequence++;
-    if (next_sequence >= MaxSequence) {
-        next_sequence = MinSequence;
+    count++;
+    if (count <= net->maxhosts) {
+        return;
     }
 
-    save_sequence(ctl, index, seq);
+    while (maxhosts < count) {
+        maxhosts *= 2;
+    }
+    if (maxhosts > MaxHost) {
+        maxhosts = MaxHost;
+    }
 
-    return seq;
+    host = realloc(net->host, maxhosts * sizeof(struct nethost));
+    saved = realloc(net->saved, maxhosts * net->saved_max * sizeof(int));
+    if (host == NULL || saved == NULL) {
+        error(EXIT_FAILURE, errno, "memory allocation failure");
+    }
+    net->host = host;
+    net->saved = saved;
+    net_init_hosts(net, net->maxhosts, maxhosts - net->maxhosts);
+    net->maxhosts = maxhosts;
 }
 
 
-/*  Attempt to find the host at a particular number of hops away  */
-static void net_send_query(
-    struct mtr_ctl *ctl,
-    int index,
-    int packet_size)
+/*  Free the hop table, with the details of the hops which replied  */
+static void net_free_hosts(
+    struct net_session *net)
 {
-    int seq = new_sequence(ctl, index);
-    int time_to_live = index + 1;
+    int at;
+
+    for (at = 0; at < net->maxhosts; at++) {
+        if (net->host[at].detail) {
+            free(net->host[at].detail->path);
+            free(net->host[at].detail->flow_path);
+        }
+        free(net->host[at].detail);
+    }
 
-    send_probe_command(ctl, &packet_command_pipe, remoteaddress,
-                       sourceaddress, packetsize, seq, time_to_live);
+    free(net->host);
+    free(net->saved);
+    net->host = NULL;
+    net->saved = NULL;
+    net->maxhosts = 0;
 }
 
 
-/*
-    Mark a sequence entry as completed and return the host index
-    being probed.
+/*  The detail of a hop, allocated as it first replies or is sent a flow  */
+static struct nethost_detail *net_hop_detail(
+    struct nethost *hop)
+{
+    if (hop->detail == NULL) {
+        hop->detail = calloc(1, sizeof(struct nethost_detail));
+        if (hop->detail == NULL) {
+            error(EXIT_FAILURE, errno, "memory allocation failure");
+        }
+    }
+
+    return hop->detail;
+}
 
-    Returns -1 in the case of an invalid sequence number.
+
+/*
+    Note whether a hop's latest result was stable, for adaptive probes.
+    Losses, jitter and new addresses have the hop probed every cycle.
 */
-static int mark_sequence_complete(
-    int seq)
+static void net_adapt_probes(
+    struct nethost *hop,
+    int stable)
 {
-    if ((seq < 0) || (seq >= MaxSequence)) {
-        return -1;
+    if (!stable) {
+        hop->probe_every = 1;
+        hop->stable = 0;
+        return;
     }
 
-    if (!sequence[seq].transit) {
-        return -1;
+    if (++hop->stable >= ADAPTIVE_SAMPLES
+        && hop->probe_every < ADAPTIVE_MAX_EVERY) {
+        hop->probe_every = hop->probe_every ? 2 * hop->probe_every : 2;
+        hop->stable = 0;
+    }
+}
+
+
+/*  Find the slot of a probe in flight, or NULL if there is none  */
+static struct probe_entry *probe_table_find(
+    int token)
+{
+    int mask = probes.size - 1;
+    int at;
+
+    if (probes.size == 0) {
+        return NULL;
+    }
+
+    for (at = token & mask; probes.entry[at].token; at = (at + 1) & mask) {
+        if (probes.entry[at].token == token) {
+            return &probes.entry[at];
+        }
+    }
+
+    return NULL;
+}
+
+
+static void probe_table_grow(
+    void);
+
+/*  Claim a free slot for a token which isn't already in flight  */
+static struct probe_entry *probe_table_insert(
+    int token)
+{
+    struct probe_entry *entry;
+    int mask;
+    int at;
+
+    if (2 * (probes.count + 1) > probes.size) {
+        probe_table_grow();
+    }
+
+    mask = probes.size - 1;
+    for (at = token & mask; probes.entry[at].token; at = (at + 1) & mask);
+
+    entry = &probes.entry[at];
+    memset(entry, 0, sizeof(struct probe_entry));
+    entry->token = token;
+    probes.count++;
+
+    return entry;
+}
+
+
+/*  Double the size of the table, placing its probes afresh  */
+static void probe_table_grow(
+    void)
+{
+    struct probe_table old = probes;
+    int i;
+
+    probes.size = old.size ? 2 * old.size : PROBE_TABLE_MIN_SIZE;
+    probes.count = 0;
+    probes.entry = calloc(probes.size, sizeof(struct probe_entry));
+    if (probes.entry == NULL) {
+        error(EXIT_FAILURE, errno, "memory allocation failure");
+    }
+
+    for (i = 0; i < old.size; i++) {
+        if (old.entry[i].token) {
+            *probe_table_insert(old.entry[i].token) = old.entry[i];
+        }
     }
-    sequence[seq].transit = 0;
 
-    return sequence[seq].index;
+    free(old.entry);
 }
 
 
 /*
-    A probe has successfully completed.
+    Free the slot of a probe.  Later probes of the same run of slots
+    are moved back into the gap, unless that would place them before
+    their home slot, so that lookups never stop short of them.
+*/
+static void probe_table_remove(
+    struct probe_entry *entry)
+{
+    int mask = probes.size - 1;
+    int gap = entry - probes.entry;
+    int at;
+    int home;
+
+    for (at = (gap + 1) & mask; probes.entry[at].token;
+         at = (at + 1) & mask) {
+        home = probes.entry[at].token & mask;
+        if (((at - home) & mask) >= ((at - gap) & mask)) {
+            probes.entry[gap] = probes.entry[at];
+            gap = at;
+        }
+    }
 
-    Record the round trip time and address of the responding host.
+    probes.entry[gap].token = 0;
+    probes.count--;
+}
+
+
+/*
+    Forget the probes in flight of a session, so that their replies
+    are ignored.  A slot refilled by a removal is examined again.
 */
-static void net_process_ping(
-    struct mtr_ctl *ctl,
-    int seq,
-    int err,
-    struct mplslen *mpls,
-    ip_t * addr,
-    int totusec)
+static void probe_table_forget(
+    struct net_session *net)
 {
-    int index;
-    int oldavg;                 /* usedByMin */
-    int oldjavg;                /* usedByMin */
-    int i;                      /* usedByMin */
-#ifdef ENABLE_IPV6
-    char addrcopy[sizeof(struct in6_addr)];
-#else
-    char addrcopy[sizeof(struct in_addr)];
-#endif
+    int at = 0;
+
+    while (at < probes.size) {
+        if (probes.entry[at].token && probes.entry[at].net == net) {
+            probe_table_remove(&probes.entry[at]);
+        } else {
+            at++;
+        }
+    }
+}
 
-    addrcpy((void *) &addrcopy, (char *) addr, ctl->af);
 
-    index = mark_sequence_complete(seq);
-    if (index < 0) {
-        return;
+/*  The number of a session's probes of a hop which are in flight  */
+static int probe_table_count(
+    struct net_session *net,
+    int index)
+{
+    int count = 0;
+    int at;
+
+    for (at = 0; at < probes.size; at++) {
+        if (probes.entry[at].token && probes.entry[at].net == net
+            && probes.entry[at].index == index) {
+            count++;
+        }
     }
 
-    host[index].err = err;
+    return count;
+}
+
 
-    if (addrcmp((void *) &(host[index].addr),
-                (void *) &ctl->unspec_addr, ctl->af) == 0) {
-        /* should be out of if as addr can change */
-        addrcpy((void *) &(host[index].addr), addrcopy, ctl->af);
-        host[index].mpls = *mpls;
-        display_rawhost(ctl, index, (void *) &(host[index].addr));
+static void save_probe(
+    struct mtr_ctl *ctl,
+    struct net_session *net,
+    int index,
+    int token,
+    int flow)
+{
+    struct probe_entry *entry;
+
+    display_rawxmit(ctl, index, token);
 
-        /* multi paths */
-        addrcpy((void *) &(host[index].addrs[0]), addrcopy, ctl->af);
-        host[index].mplss[0] = *mpls;
+    /*  A token still in flight has wrapped, and won't be answered  */
+    entry = probe_table_find(token);
+    if (entry != NULL) {
+        entry->net->in_flight--;
     } else {
-        for (i = 0; i < MAXPATH;) {
-            if (addrcmp
-                ((void *) &(host[index].addrs[i]), (void *) &addrcopy,
-                 ctl->af) == 0
-                || addrcmp((void *) &(host[index].addrs[i]),
-                           (void *) &ctl->unspec_addr, ctl->af) == 0) {
-                break;
-            }
-            i++;
-        }
+        entry = probe_table_insert(token);
+    }
 
-        if (addrcmp((void *) &(host[index].addrs[i]), addrcopy, ctl->af) !=
-            0 && i < MAXPATH) {
-            addrcpy((void *) &(host[index].addrs[i]), addrcopy, ctl->af);
-            host[index].mplss[i] = *mpls;
-            display_rawhost(ctl, index, (void *) &(host[index].addrs[i]));
-        }
+    entry->net = net;
+    entry->index = index;
+    entry->flow = flow;
+    net->in_flight++;
+
+    net->host[index].transit = 1;
+
+    if (net->host[index].sent) {
+        net->host[index].up = 0;
+        net_adapt_probes(&net->host[index], 0);
+    }
+
+    net->host[index].sent = 1;
+    net->host[index].xmit++;
+    entry->saved_column = net_save_xmit(net, index);
+    net_changed(net, index);
+    capture_xmit(index, token);
+}
+
+static int new_token(
+    struct mtr_ctl *ctl,
+    struct net_session *net,
+    int index,
+    int flow)
+{
+    static int next_token = MinToken;
+    int token;
+
+    token = next_token;
+    next_token = token == MaxToken ? MinToken : token + 1;
+
+    save_probe(ctl, net, index, token, flow);
+
+    return token;
+}
+
+
+/*
+    Check whether a hop is due a probe in the current cycle.  Hops of
+    unknown address, or which end the path, are probed every cycle,
+    as the end of each cycle is found from them.  Others are probed
+    as adaptive probes allow, staggered so that skipped hops spread
+    through the cycles.
+*/
+static int net_hop_due(
+    struct mtr_ctl *ctl,
+    struct net_session *net,
+    int at)
+{
+    struct nethost *hop = &net->host[at];
+
+    /*  The hops of a shared prefix are probed by the session's leader  */
+    if (at < net->shared_hops) {
+        return 0;
     }
 
-    host[index].jitter = totusec - host[index].last;
-    if (host[index].jitter < 0) {
-        host[index].jitter = -host[index].jitter;
+    if (!ctl->adaptive_probes || hop->probe_every <= 1) {
+        return 1;
+    }
+
+    if (hop->err != 0 || hop->addr_id == 0
+        || hop->addr_id == net->remote_id) {
+        return 1;
     }
 
-    host[index].last = totusec;
+    return (net->cycle + at) % hop->probe_every == 0;
+}
+
 
-    if (host[index].returned < 1) {
-        host[index].best = host[index].worst = host[index].gmean = totusec;
-        host[index].avg = host[index].ssd = 0;
+/*
+    The timeout for a probe of a hop.  With --adaptive-timeout, it is
+    the hop's own estimate, and for a hop with no estimate yet, twice
+    the longest estimate of any hop, so that hops which never reply
+    don't hold probes for the full timeout.
+*/
+static int net_probe_timeout(
+    struct mtr_ctl *ctl,
+    struct net_session *net,
+    int index)
+{
+    int longest = 0;
+    int at;
 
-        host[index].jitter = host[index].jworst = host[index].jinta = 0;
+    if (!ctl->adaptive_timeout) {
+        return ctl->probe_timeout;
     }
 
-    if (totusec < host[index].best) {
-        host[index].best = totusec;
+    if (net->host[index].rto) {
+        return net->host[index].rto;
     }
-    if (totusec > host[index].worst) {
-        host[index].worst = totusec;
+
+    for (at = 0; at < net->maxhosts; at++) {
+        if (net->host[at].rto > longest) {
+            longest = net->host[at].rto;
+        }
     }
 
-    if (host[index].jitter > host[index].jworst) {
-        host[index].jworst = host[index].jitter;
+    if (longest == 0 || longest > ctl->probe_timeout / 2) {
+        return ctl->probe_timeout;
     }
+    return 2 * longest;
+}
 
-    host[index].returned++;
-    oldavg = host[index].avg;
-    host[index].avg += (totusec - oldavg + .0) / host[index].returned;
-    host[index].ssd +=
-        (totusec - oldavg + .0) * (totusec - host[index].avg);
 
-    oldjavg = host[index].javg;
-    host[index].javg +=
-        (host[index].jitter - oldjavg) / host[index].returned;
-    /* below algorithm is from rfc1889, A.8 */
-    host[index].jinta +=
-        host[index].jitter - ((host[index].jinta + 8) >> 4);
+/*
+    Update a hop's timeout from a round trip time, as RFC 6298 has TCP
+    estimate its retransmission timeout, though with a lower floor.
+*/
+static void net_update_rto(
+    struct mtr_ctl *ctl,
+    struct nethost *hop,
+    int usec)
+{
+    int delta;
+
+    if (!hop->rto) {
+        hop->srtt = usec;
+        hop->rttvar = usec / 2;
+    } else {
+        delta = hop->srtt - usec;
+        if (delta < 0) {
+            delta = -delta;
+        }
+
+        /*  beta is 1/4, and alpha 1/8  */
+        hop->rttvar += (delta - hop->rttvar) / 4;
+        hop->srtt += (usec - hop->srtt) / 8;
+    }
 
-    if (host[index].returned > 1) {
-        host[index].gmean =
-            pow((double) host[index].gmean,
-                (host[index].returned - 1.0) / host[index].returned)
-            * pow((double) totusec, 1.0 / host[index].returned);
+    hop->rto = hop->srtt + RTO_K * hop->rttvar;
+    if (hop->rto < MIN_PROBE_TIMEOUT) {
+        hop->rto = MIN_PROBE_TIMEOUT;
+    }
+    if (hop->rto > ctl->probe_timeout) {
+        hop->rto = ctl->probe_timeout;
     }
+}
+
 
-    host[index].sent = 0;
-    host[index].up = 1;
-    host[index].transit = 0;
+/*
+    The number of flows which must reach a hop, finding no more than
+    the branches seen so far, to rule out a further branch, as the
+    Multipath Detection Algorithm of Paris traceroute has it.  Should
+    there be one more branch, with flows spread evenly, the chance
+    that n flows missed one of the k + 1 is at most
+    (k + 1) (k / (k + 1))^n.
+*/
+static int net_flows_needed(
+    int branches)
+{
+    if (branches < 1) {
+        return 1;
+    }
 
-    net_save_return(index, sequence[seq].saved_seq, totusec);
-    display_rawping(ctl, index, totusec, seq);
+    return ceil(log(FLOW_MISS_CHANCE / (branches + 1))
+                / log((double) branches / (branches + 1)));
 }
 
+
 /*
-    Invoked when the read pipe from the mtr-packet subprocess is readable.
-    If we have received a complete reply, process it.
+    Choose the flow of a probe of a hop, with --flows, or -1 without.
+    New flows are tried until the hop's branches are all likely to
+    have been found, and each branch is then revisited in turn, by a
+    flow known to take it, so that its latency and loss are measured
+    with as many probes as the others.
 */
-void net_process_return(
-    struct mtr_ctl *ctl)
+static int net_choose_flow(
+    struct mtr_ctl *ctl,
+    struct net_session *net,
+    int index)
+{
+    struct nethost_detail *detail;
+    struct nethost_path *path;
+    int i;
+
+    /*  The protocol may have been switched interactively  */
+    if (!ctl->flows || ctl->mtrtype != IPPROTO_UDP) {
+        return -1;
+    }
+
+    detail = net_hop_detail(&net->host[index]);
+    if (detail->flow_path == NULL) {
+        detail->flow_path = malloc(ctl->flows * sizeof(int));
+        if (detail->flow_path == NULL) {
+            error(EXIT_FAILURE, errno, "memory allocation failure");
+        }
+        for (i = 0; i < ctl->flows; i++) {
+            detail->flow_path[i] = -1;
+        }
+    }
+
+    if (detail->flows_tried < ctl->flows
+        && detail->flows_tried < net_flows_needed(detail->path_count)) {
+        return detail->flows_tried++;
+    }
+
+    for (i = 0; i < detail->path_count; i++) {
+        path = &detail->path[detail->next_path];
+        detail->next_path = (detail->next_path + 1) % detail->path_count;
+        if (path->flow >= 0) {
+            return path->flow;
+        }
+    }
+
+    return net->cycle % detail->flows_tried;
+}
+
+
+/*  Attempt to find the host at a particular number of hops away  */
+static void net_send_query(
+    struct mtr_ctl *ctl,
+    struct net_session *net,
+    int index,
+    int packet_size)
+{
+    int flow = net_choose_flow(ctl, net, index);
+    int token = new_token(ctl, net, index, flow);
+    int time_to_live = index + 1;
+    int local_port = 0;
+
+    /*  The flows of --flows differ only in their local ports  */
+    if (flow >= 0) {
+        local_port = (ctl->localport ? ctl->localport : FLOW_PORT) + flow;
+    }
+
+    send_probe_command(ctl, net->cmdpipe, net->remoteaddress,
+                       net->sourceaddress, packet_size, token,
+                       time_to_live, net_probe_timeout(ctl, net, index),
+                       local_port);
+}
+
+
+/*
+    Mark a probe as completed, copying its entry before freeing it.
+
+    Returns -1 if the token isn't that of a probe in flight.
+*/
+static int complete_probe(
+    int token,
+    struct probe_entry *probe)
+{
+    struct probe_entry *entry;
+
+    entry = probe_table_find(token);
+    if (entry == NULL) {
+        return -1;
+    }
+
+    *probe = *entry;
+    probe_table_remove(entry);
+    probe->net->in_flight--;
+
+    return 0;
+}
+
+
+/*  Count a round trip time in a hop's histogram  */
+static void net_count_latency(
+    struct nethost_detail *detail,
+    int usec)
+{
+    int msb = LATENCY_SUB_BITS;
+    int shift;
+    int index;
+
+    if (usec >= 1 << LATENCY_MAX_BITS) {
+        usec = (1 << LATENCY_MAX_BITS) - 1;
+    }
+
+    if (usec < LATENCY_SUB_BUCKETS) {
+        detail->latency[usec < 0 ? 0 : usec]++;
+        return;
+    }
+
+    while (usec >> (msb + 1)) {
+        msb++;
+    }
+    shift = msb - LATENCY_SUB_BITS;
+    index = (shift + 1) * LATENCY_SUB_BUCKETS +
+        (usec >> shift) - LATENCY_SUB_BUCKETS;
+
+    detail->latency[index]++;
+}
+
+
+/*
+    Find the path of a hop by its address, adding it if it is new.
+    Returns NULL for a new address beyond the most a hop may have.
+*/
+static struct nethost_path *net_hop_path(
+    struct nethost_detail *detail,
+    int addr_id,
+    struct mplslen *mpls,
+    int *newpath)
+{
+    struct nethost_path *path;
+    int i;
+
+    for (i = 0; i < detail->path_count; i++) {
+        if (detail->path[i].addr_id == addr_id) {
+            return &detail->path[i];
+        }
+    }
+
+    if (detail->path_count == MAX_HOP_PATHS) {
+        return NULL;
+    }
+
+    if (detail->path_count == detail->path_max) {
+        detail->path_max = detail->path_max ? 2 * detail->path_max : 2;
+        path = realloc(detail->path,
+                       detail->path_max * sizeof(struct nethost_path));
+        if (path == NULL) {
+            error(EXIT_FAILURE, errno, "memory allocation failure");
+        }
+        detail->path = path;
+    }
+
+    path = &detail->path[detail->path_count++];
+    memset(path, 0, sizeof(struct nethost_path));
+    path->addr_id = addr_id;
+    path->flow = -1;
+    path->mpls = *mpls;
+    *newpath = 1;
+
+    return path;
+}
+
+
+/*
+    Stop following a leader, to probe the whole path again.  The
+    leader's results for the cycles already left to it are still
+    counted, as its probes in flight complete.
+*/
+static void net_unfollow(
+    struct net_session *net)
+{
+    net->shared_hops = 0;
+}
+
+
+/*
+    Probe a hop ourselves for the cycles in which it was left to a
+    leader which won't answer for them, beyond a number it still may,
+    so that no cycle goes without a probe of the hop.
+*/
+static void net_reprobe_hop(
+    struct mtr_ctl *ctl,
+    struct net_session *net,
+    int at,
+    int keep)
+{
+    int af = ctl->af;
+
+    /*  The probe is of our family, whichever session is being sent  */
+    ctl->af = net->af;
+    while (net->host[at].owed > keep) {
+        net->host[at].owed--;
+        net_send_query(ctl, net, at, abs(net->packetsize));
+    }
+    ctl->af = af;
+}
+
+
+/*  Probe ourselves the cycles left to the leader from a hop onward  */
+static void net_reprobe_owed(
+    struct mtr_ctl *ctl,
+    struct net_session *net,
+    int from)
+{
+    int at;
+
+    for (at = from; at < net->maxhosts; at++) {
+        net_reprobe_hop(ctl, net, at, 0);
+    }
+}
+
+
+/*
+    Count the cycles left to the leader which it hasn't answered for
+    as probes which went unanswered, as the leader counts its own.
+*/
+static void net_lose_owed(
+    struct net_session *net)
+{
+    int at;
+
+    for (at = 0; at < net->maxhosts; at++) {
+        while (net->host[at].owed > 0) {
+            net->host[at].owed--;
+            net->host[at].xmit++;
+            net_save_xmit(net, at);
+            net_changed(net, at);
+        }
+    }
+}
+
+
+/*  Have the sessions following a session probe their own paths  */
+static void net_release_followers(
+    struct net_session *net)
+{
+    struct net_session *follower;
+
+    for (follower = sessions; follower;
+         follower = follower->next_session) {
+        if (follower->leader == net) {
+            net_unfollow(follower);
+        }
+    }
+}
+
+
+/*
+    Release the followers of a session whose probes in flight will
+    never be answered, counting the cycles they left to it as lost.
+*/
+static void net_forget_followers(
+    struct net_session *net)
+{
+    struct net_session *follower;
+
+    for (follower = sessions; follower;
+         follower = follower->next_session) {
+        if (follower->leader == net) {
+            net_unfollow(follower);
+            net_lose_owed(follower);
+            follower->leader = NULL;
+        }
+    }
+}
+
+
+/*
+    Check whether a hop may be shared with other sessions: it has
+    replied, from the same single address every time, and isn't the
+    session's destination.
+*/
+static int net_hop_shareable(
+    struct net_session *net,
+    int at)
+{
+    struct nethost *hop = &net->host[at];
+
+    return hop->addr_id != 0 && hop->addr_id != net->remote_id
+        && hop->err == 0 && net_path_count(net, at) == 1;
+}
+
+
+/*  The hops before which two sessions have found the same addresses  */
+static int net_shared_prefix(
+    struct mtr_ctl *ctl,
+    struct net_session *net,
+    struct net_session *leader)
+{
+    int at;
+
+    for (at = ctl->fstTTL - 1;
+         at < net->maxhosts && at < leader->maxhosts; at++) {
+        if (!net_hop_shareable(net, at) || !net_hop_shareable(leader, at)
+            || net->host[at].addr_id != leader->host[at].addr_id) {
+            break;
+        }
+    }
+
+    return at;
+}
+
+
+/*
+    With --share-prefix, find the earlier session, probed through the
+    same agent, which shares the longest prefix of hops with a session,
+    to probe those hops for both.  A session which follows another
+    leads no others, so its followers look for a leader afresh.
+
+    Each cycle leaves the shared hops to the leader once more, and the
+    next result of the leader's at each is counted for the cycle, even
+    should the leader have probed the hop for its own cycle already.
+    When the leader changes, the cycles it hasn't yet answered for are
+    probed again.
+*/
+static void net_find_leader(
+    struct mtr_ctl *ctl,
+    struct net_session *net)
+{
+    struct net_session *leader;
+    struct net_session *best = NULL;
+    int best_shared = ctl->fstTTL - 1;
+    int shared;
+    int at;
+
+    for (leader = sessions; leader; leader = leader->next_session) {
+        if (leader->serial >= net->serial || leader->shared_hops
+            || leader->stopped || leader->cmdpipe != net->cmdpipe
+            || leader->af != net->af) {
+            continue;
+        }
+
+        shared = net_shared_prefix(ctl, net, leader);
+        if (shared > best_shared) {
+            best = leader;
+            best_shared = shared;
+        }
+    }
+
+    if (best != net->leader) {
+        net->leader = NULL;
+        net_reprobe_owed(ctl, net, 0);
+    }
+
+    if (best == NULL) {
+        net_unfollow(net);
+        return;
+    }
+
+    net_release_followers(net);
+    net->leader = best;
+    net->shared_hops = best_shared;
+
+    for (at = ctl->fstTTL - 1; at < net->shared_hops; at++) {
+        net->host[at].owed++;
+    }
+}
+
+
+/*
+    Record a completed probe of a hop, with a reply or by timing out,
+    returning nonzero if the reply was from an address new to the hop,
+    other than its first.  A token of zero is that of a probe of a
+    shared prefix, sent by the session's leader.
+*/
+static int net_record_result(
+    struct mtr_ctl *ctl,
+    struct net_session *net,
+    struct probe_entry *entry,
+    int token,
+    int err,
+    struct mplslen *mpls,
+    ip_t * addr,
+    int totusec)
+{
+    struct nethost *hop;
+    struct nethost_detail *detail;
+    struct nethost_path *path;
+    int index = entry->index;
+    int delta;
+    int newpath = 0;
+    int stable;
+    int addr_id;
+
+    hop = &net->host[index];
+    net_changed(net, index);
+
+    /*
+       A probe which timed out is lost, and no longer in flight.  As
+       with TCP's retransmission timer, the hop's timeout backs off.
+     */
+    if (addr == NULL) {
+        /*  A flow known to reach a path has lost a probe on it  */
+        if (entry->flow >= 0 && hop->detail
+            && hop->detail->flow_path[entry->flow] >= 0) {
+            hop->detail->path[hop->detail->flow_path[entry->flow]].xmit++;
+        }
+
+        net_adapt_probes(hop, 0);
+        if (hop->rto) {
+            hop->rto = hop->rto > ctl->probe_timeout / 2
+                ? ctl->probe_timeout : 2 * hop->rto;
+        }
+        return 0;
+    }
+
+    /*  Addresses are compared by their ids, hashing the reply's once  */
+    addr_id = addr_intern(net->af, addr);
+
+    hop->err = err;
+    detail = net_hop_detail(hop);
+
+    /* multi paths, the first of which is the hop's address */
+    path = net_hop_path(detail, addr_id, mpls, &newpath);
+    if (newpath) {
+        display_rawhost(ctl, index, addr_id);
+    }
+    if (hop->addr_id == 0) {
+        /* should be out of if as addr can change */
+        hop->addr_id = addr_id;
+        newpath = 0;
+    }
+
+    if (path != NULL) {
+        if (entry->flow >= 0) {
+            path->flow = entry->flow;
+            detail->flow_path[entry->flow] = path - detail->path;
+        }
+        path->xmit++;
+        path->returned++;
+        path->sum += totusec;
+    }
+
+    hop->jitter = totusec - hop->last;
+    if (hop->jitter < 0) {
+        hop->jitter = -hop->jitter;
+    }
+
+    hop->last = totusec;
+
+    if (hop->returned < 1) {
+        hop->best = hop->worst = hop->first = totusec;
+        hop->sum = hop->sumsq = hop->jsum = 0;
+        hop->sumlog = 0;
+
+        hop->jitter = hop->jworst = hop->jinta = 0;
+    }
+
+    if (totusec < hop->best) {
+        hop->best = totusec;
+    }
+    if (totusec > hop->worst) {
+        hop->worst = totusec;
+    }
+
+    if (hop->jitter > hop->jworst) {
+        hop->jworst = hop->jitter;
+    }
+
+    net_count_latency(detail, totusec);
+
+    /*  A reply is judged against the estimate, before it is updated  */
+    stable = err == 0 && !newpath && hop->returned >= ADAPTIVE_SAMPLES
+        && (hop->jitter <= 2 * hop->rttvar || hop->jitter <= ADAPTIVE_JITTER);
+    net_adapt_probes(hop, stable);
+
+    if (err == 0) {
+        net_update_rto(ctl, hop, totusec);
+    }
+
+    /*
+       Only sums are kept here, and the accessors derive the averages
+       from them.  Offsetting the sums by the first reply keeps them
+       exact and small, so the variance doesn't suffer from cancellation.
+     */
+    hop->returned++;
+    delta = totusec - hop->first;
+    hop->sum += delta;
+    hop->sumsq += (long long) delta * delta;
+    hop->sumlog += log(totusec > 1 ? totusec : 1);
+    hop->jsum += hop->jitter;
+
+    /* below algorithm is from rfc1889, A.8 */
+    hop->jinta +=
+        hop->jitter - ((hop->jinta + 8) >> 4);
+
+    hop->sent = 0;
+    hop->up = 1;
+    hop->transit = 0;
+
+    net_save_return(net, index, entry->saved_column, totusec);
+    if (token) {
+        display_rawping(ctl, index, totusec, token);
+    }
+
+    return newpath;
+}
+
+
+/*
+    Attribute the result of a probe of a session's hop to the sessions
+    which left a cycle's probe of the hop to it.  A new address at a
+    shared hop means that the paths may diverge there, so the prefix is
+    cut short before it, and the follower probes the cycles left to the
+    leader from there itself.  A new address at the first hop a follower
+    probes itself may mean its path has changed before it, so the
+    follower probes it all again.
+*/
+static void net_share_result(
+    struct mtr_ctl *ctl,
+    struct net_session *net,
+    int index,
+    int newpath,
+    int err,
+    struct mplslen *mpls,
+    ip_t * addr,
+    int totusec)
+{
+    struct net_session *follower;
+    struct probe_entry shared;
+
+    if (!ctl->share_prefix) {
+        return;
+    }
+
+    if (newpath && net->shared_hops && index == net->shared_hops) {
+        net_unfollow(net);
+    }
+
+    for (follower = sessions; follower;
+         follower = follower->next_session) {
+        if (follower->leader != net || index >= follower->maxhosts
+            || follower->host[index].owed == 0) {
+            continue;
+        }
+
+        if (newpath) {
+            if (index < follower->shared_hops) {
+                follower->shared_hops = index;
+            }
+            if (follower->shared_hops <= ctl->fstTTL - 1) {
+                net_unfollow(follower);
+            }
+            net_reprobe_owed(ctl, follower, index);
+            continue;
+        }
+
+        memset(&shared, 0, sizeof(struct probe_entry));
+        shared.net = follower;
+        shared.index = index;
+        shared.flow = -1;
+        follower->host[index].owed--;
+        follower->host[index].xmit++;
+        shared.saved_column = net_save_xmit(follower, index);
+        net_record_result(ctl, follower, &shared, 0, err, mpls, addr,
+                          totusec);
+    }
+}
+
+
+/*
+    A probe has completed, with a reply or by timing out.
+
+    Record the round trip time and address of the responding host.
+*/
+static void net_process_ping(
+    struct mtr_ctl *ctl,
+    int token,
+    int err,
+    struct mplslen *mpls,
+    ip_t * addr,
+    int totusec)
+{
+    struct probe_entry entry;
+    struct net_session *net;
+    int newpath;
+
+    TRACE_PROBE3(mtr, net_process_ping, token, err, totusec);
+
+    if (complete_probe(token, &entry) != 0) {
+        return;
+    }
+
+    /*  The reply may be to a probe of any of the sessions being traced  */
+    net = entry.net;
+    capture_reply(net->af, entry.index, token, err, mpls, addr, totusec);
+
+    newpath = net_record_result(ctl, net, &entry, token, err, mpls, addr,
+                                totusec);
+    net_share_result(ctl, net, entry.index, newpath, err, mpls, addr,
+                     totusec);
+}
+
+/*
+    Replay a probe, as recorded in a capture file.  Returns -1 if the
+    token is out of range.
+*/
+int net_replay_xmit(
+    struct mtr_ctl *ctl,
+    struct net_session *net,
+    int index,
+    int token)
+{
+    if (token < MinToken) {
+        return -1;
+    }
+
+    net_grow_hosts(net, index + 1);
+    if (index >= net->maxhosts) {
+        return -1;
+    }
+    save_probe(ctl, net, index, token, -1);
+
+    return 0;
+}
+
+
+/*  Replay a reply, or with no address, a timeout, from a capture file  */
+void net_replay_reply(
+    struct mtr_ctl *ctl,
+    int token,
+    int err,
+    struct mplslen *mpls,
+    ip_t * addr,
+    int usec)
+{
+    net_process_ping(ctl, token, err, mpls, addr, usec);
+}
+
+
+/*
+    Invoked when the read pipe from the mtr-packet subprocess is readable.
+    If we have received a complete reply, process it.
+*/
+void net_process_return(
+    struct mtr_ctl *ctl)
+{
+    int i;
+
+    for (i = 0; i < packet_command_pipe_count; i++) {
+        handle_command_replies(ctl, &packet_command_pipe[i],
+                               net_process_ping);
+    }
+}
+
+
+ip_t *net_addr(
+    struct net_session *net,
+    int at)
+{
+    return &addr_entry(net->host[at].addr_id)->ip;
+}
+
+
+ip_t *net_addrs(
+    struct net_session *net,
+    int at,
+    int i)
+{
+    return &addr_entry(net_addrs_id(net, at, i))->ip;
+}
+
+
+/*  The id of the address of a hop, or 0 if it hasn't replied  */
+int net_addr_id(
+    struct net_session *net,
+    int at)
+{
+    return net->host[at].addr_id;
+}
+
+
+/*  One of the multipath addresses of a hop, or an empty path  */
+static struct nethost_path *net_path(
+    struct net_session *net,
+    int at,
+    int i)
+{
+    struct nethost_detail *detail = net->host[at].detail;
+
+    if (detail == NULL || i >= detail->path_count) {
+        return &no_path;
+    }
+
+    return &detail->path[i];
+}
+
+
+/*  The id of one of the multipath addresses of a hop, or 0  */
+int net_addrs_id(
+    struct net_session *net,
+    int at,
+    int i)
+{
+    return net_path(net, at, i)->addr_id;
+}
+
+
+/*  The number of addresses which have replied at a hop  */
+int net_path_count(
+    struct net_session *net,
+    int at)
+{
+    return (net->host[at].detail ? net->host[at].detail
+            : &no_detail)->path_count;
+}
+
+
+/*  The completed probes of the flows known to reach a path of a hop  */
+int net_path_xmit(
+    struct net_session *net,
+    int at,
+    int i)
+{
+    return net_path(net, at, i)->xmit;
+}
+
+
+/*  The loss of a path of a hop, in thousandths of a percent  */
+int net_path_loss(
+    struct net_session *net,
+    int at,
+    int i)
 {
-    handle_command_replies(ctl, &packet_command_pipe, net_process_ping);
-}
+    struct nethost_path *path = net_path(net, at, i);
 
+    if (path->xmit == 0) {
+        return 0;
+    }
 
-ip_t *net_addr(
-    int at)
-{
-    return (ip_t *) & (host[at].addr);
+    return 1000 * (100 - 100.0 * path->returned / path->xmit);
 }
 
 
-ip_t *net_addrs(
+/*  The average round trip time of a path of a hop, in usec  */
+int net_path_avg(
+    struct net_session *net,
     int at,
     int i)
 {
-    return (ip_t *) & (host[at].addrs[i]);
+    struct nethost_path *path = net_path(net, at, i);
+
+    if (path->returned == 0) {
+        return 0;
+    }
+
+    return path->sum / path->returned;
 }
 
 /*
     Get the error code corresponding to a host entry.
 */
 int net_err(
+    struct net_session *net,
     int at)
 {
-    return host[at].err;
+    return net->host[at].err;
 }
 
 void *net_mpls(
+    struct net_session *net,
     int at)
 {
-    return (struct mplslen *) &(host[at].mplss);
+    return &net_path(net, at, 0)->mpls;
 }
 
 void *net_mplss(
+    struct net_session *net,
     int at,
     int i)
 {
-    return (struct mplslen *) &(host[at].mplss[i]);
+    return &net_path(net, at, i)->mpls;
 }
 
 int net_loss(
+    struct net_session *net,
     int at)
 {
-    if ((host[at].xmit - host[at].transit) == 0) {
+    if ((net->host[at].xmit - net->host[at].transit) == 0) {
         return 0;
     }
 
     /* times extra 1000 */
     return 1000 * (100 -
-                   (100.0 * host[at].returned /
-                    (host[at].xmit - host[at].transit)));
+                   (100.0 * net->host[at].returned /
+                    (net->host[at].xmit - net->host[at].transit)));
 }
 
 
 int net_drop(
+    struct net_session *net,
     int at)
 {
-    return (host[at].xmit - host[at].transit) - host[at].returned;
+    return (net->host[at].xmit - net->host[at].transit) -
+        net->host[at].returned;
 }
 
 
 int net_last(
+    struct net_session *net,
     int at)
 {
-    return (host[at].last);
+    return (net->host[at].last);
 }
 
 
 int net_best(
+    struct net_session *net,
     int at)
 {
-    return (host[at].best);
+    return (net->host[at].best);
 }
 
 
 int net_worst(
+    struct net_session *net,
     int at)
 {
-    return (host[at].worst);
+    return (net->host[at].worst);
 }
 
 
 int net_avg(
+    struct net_session *net,
     int at)
 {
-    return (host[at].avg);
+    struct nethost *hop = &net->host[at];
+
+    if (hop->returned < 1) {
+        return 0;
+    }
+
+    return hop->first + (double) hop->sum / hop->returned;
 }
 
 
 int net_gmean(
+    struct net_session *net,
     int at)
 {
-    return (host[at].gmean);
+    struct nethost *hop = &net->host[at];
+
+    if (hop->returned < 1) {
+        return 0;
+    }
+
+    return exp(hop->sumlog / hop->returned);
 }
 
 
 int net_stdev(
+    struct net_session *net,
     int at)
 {
-    if (host[at].returned > 1) {
-        return (sqrt(host[at].ssd / (host[at].returned - 1.0)));
+    struct nethost *hop = &net->host[at];
+    double variance;
+
+    if (hop->returned > 1) {
+        variance = (hop->sumsq - (double) hop->sum * hop->sum /
+                    hop->returned) / (hop->returned - 1.0);
+        return (sqrt(variance > 0 ? variance : 0));
     } else {
         return (0);
     }
@@ -439,53 +1632,131 @@ int net_stdev(
 
 
 int net_jitter(
+    struct net_session *net,
     int at)
 {
-    return (host[at].jitter);
+    return (net->host[at].jitter);
 }
 
 
 int net_jworst(
+    struct net_session *net,
     int at)
 {
-    return (host[at].jworst);
+    return (net->host[at].jworst);
 }
 
 
 int net_javg(
+    struct net_session *net,
     int at)
 {
-    return (host[at].javg);
+    struct nethost *hop = &net->host[at];
+
+    if (hop->returned < 1) {
+        return 0;
+    }
+
+    return hop->jsum / hop->returned;
 }
 
 
 int net_jinta(
+    struct net_session *net,
+    int at)
+{
+    return (net->host[at].jinta);
+}
+
+
+/*
+    Estimate a percentile, in thousandths, of a hop's round trip times,
+    as the middle of the histogram bucket in which it falls.
+*/
+static int net_percentile(
+    struct net_session *net,
+    int at,
+    int permille)
+{
+    struct nethost *hop = &net->host[at];
+    long long rank;
+    long long count = 0;
+    int index;
+    int shift;
+
+    if (hop->returned == 0 || hop->detail == NULL) {
+        return 0;
+    }
+
+    rank = ((long long) hop->returned * permille + 999) / 1000;
+    for (index = 0; index < LATENCY_BUCKETS - 1; index++) {
+        count += hop->detail->latency[index];
+        if (count >= rank) {
+            break;
+        }
+    }
+
+    if (index < LATENCY_SUB_BUCKETS) {
+        return index;
+    }
+
+    shift = index / LATENCY_SUB_BUCKETS - 1;
+    return ((index % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS) << shift)
+        + (1 << shift) / 2;
+}
+
+
+int net_p50(
+    struct net_session *net,
+    int at)
+{
+    return net_percentile(net, at, 500);
+}
+
+
+int net_p90(
+    struct net_session *net,
+    int at)
+{
+    return net_percentile(net, at, 900);
+}
+
+
+int net_p99(
+    struct net_session *net,
     int at)
 {
-    return (host[at].jinta);
+    return net_percentile(net, at, 990);
+}
+
+
+int net_p999(
+    struct net_session *net,
+    int at)
+{
+    return net_percentile(net, at, 999);
 }
 
 
 int net_max(
-    struct mtr_ctl *ctl)
+    struct mtr_ctl *ctl,
+    struct net_session *net)
 {
     int at;
     int max;
 
     max = 0;
-    for (at = 0; at < ctl->maxTTL - 1; at++) {
-        if (addrcmp((void *) &(host[at].addr),
-                    (void *) remoteaddress, ctl->af) == 0) {
+    for (at = 0; at < ctl->maxTTL - 1 && at < net->maxhosts; at++) {
+        if (net->host[at].addr_id == net->remote_id) {
             return at + 1;
-        } else if (host[at].err != 0) {
+        } else if (net->host[at].err != 0) {
             /*
                 If a hop has returned an ICMP error
                 (such as "no route to host") then we'll consider that the
                 final hop.
             */
             return at + 1;
-        } else if (addrcmp((void *) &(host[at].addr),
-                           (void *) &ctl->unspec_addr, ctl->af) != 0) {
+        } else if (net->host[at].addr_id != 0) {
             max = at + 2;
         }
     }
@@ -502,52 +1773,160 @@ int net_min(
 
 
 int net_returned(
+    struct net_session *net,
     int at)
 {
-    return host[at].returned;
+    return net->host[at].returned;
 }
 
 
 int net_xmit(
+    struct net_session *net,
     int at)
 {
-    return host[at].xmit;
+    return net->host[at].xmit;
 }
 
 
 int net_up(
+    struct net_session *net,
     int at)
 {
-    return host[at].up;
+    return net->host[at].up;
+}
+
+
+int net_session_af(
+    struct net_session *net)
+{
+    return net->af;
 }
 
 
 char *net_localaddr(
-    void)
+    struct net_session *net)
+{
+    return net->localaddr;
+}
+
+
+ip_t *net_remote_addr(
+    struct net_session *net)
+{
+    return net->remoteaddress;
+}
+
+
+/*  The number of probes sent which have had no reply  */
+int net_in_flight(
+    struct net_session *net)
+{
+    return net->in_flight;
+}
+
+
+/*
+    Check whether a pipeline has as many probes in flight as it may,
+    which is a probe of every hop for each cycle in the pipeline, but
+    never so many as to exhaust mtr-packet's probes.
+*/
+int net_pipeline_full(
+    struct net_session *net)
 {
-    return localaddr;
+    return net->in_flight >= net->pipeline * net->numhosts
+        || net->in_flight >= PIPELINE_IN_FLIGHT;
 }
 
 
 void net_end_transit(
-    void)
+    struct net_session *net)
 {
     int at;
 
-    for (at = 0; at < MaxHost; at++) {
-        host[at].transit = 0;
+    for (at = 0; at < net->maxhosts; at++) {
+        net->host[at].transit = 0;
+        net_changed(net, at);
+    }
+
+    net_lose_owed(net);
+}
+
+/*
+    The hops a burst should probe: up to the destination, where it has
+    replied, or a hop which returned an error, and otherwise far enough
+    past the furthest hop to reply to give up on the rest as maxUnknown
+    consecutive unknown hops do.
+*/
+static int net_burst_bound(
+    struct mtr_ctl *ctl,
+    struct net_session *net)
+{
+    int at, last = ctl->fstTTL - 2;
+    int bound;
+
+    for (at = ctl->fstTTL - 1; at < net->maxhosts && at < ctl->maxTTL;
+         at++) {
+        /*  As in net_max, a hop returning an error is the last  */
+        if (net->host[at].addr_id == net->remote_id
+            || net->host[at].err != 0)
+            return at + 1;
+        if (net->host[at].addr_id != 0)
+            last = at;
+    }
+
+    bound = last + ctl->maxUnknown + 2;
+    if (bound > ctl->maxTTL)
+        bound = ctl->maxTTL;
+    return bound;
+}
+
+
+/*
+    Send the next probe of a burst, which covers every hop to the path
+    bound in one pass.  Returns 1 when the burst is complete, either at
+    the bound or when the destination replies to an earlier probe.
+*/
+static int net_send_burst(
+    struct mtr_ctl *ctl,
+    struct net_session *net)
+{
+    int bound, at;
+
+    if (net->burst_sent == 0)
+        net->numhosts = net_burst_bound(ctl, net);
+    bound = net->numhosts;
+
+    net_grow_hosts(net, net->batch_at + 1);
+    net_send_query(ctl, net, net->batch_at, abs(net->packetsize));
+    net->burst_sent++;
+    net->batch_at++;
+
+    for (at = ctl->fstTTL - 1; at < net->batch_at && at < bound; at++) {
+        if (net->host[at].addr_id == net->remote_id)
+            bound = at + 1;
     }
+
+    if (net->batch_at < bound)
+        return 0;
+
+    net->numhosts = bound;
+    net->burst_length = net->burst_sent;
+    net->burst_sent = 0;
+    net->batch_at = ctl->fstTTL - 1;
+    return 1;
 }
 
+
 int net_send_batch(
-    struct mtr_ctl *ctl)
+    struct mtr_ctl *ctl,
+    struct net_session *net)
 {
     int n_unknown = 0, i;
 
     /* randomized packet size and/or bit pattern if packetsize<0 and/or 
        bitpattern<0.  abs(packetsize) and/or abs(bitpattern) will be used 
      */
-    if (batch_at < ctl->fstTTL) {
+    if (net->batch_at < ctl->fstTTL) {
         if (ctl->cpacketsize < 0) {
             /* Someone used a formula here that tried to correct for the 
                "end-error" in "rand()". By "end-error" I mean that if you 
@@ -558,10 +1937,10 @@ int net_send_batch(
                smaller (reasonable packet sizes), and our rand() range much 
                larger, this effect is insignificant. Oh! That other formula
                didn't work. */
-            packetsize =
+            net->packetsize =
                 MINPACKET + rand() % (-ctl->cpacketsize - MINPACKET);
         } else {
-            packetsize = ctl->cpacketsize;
+            net->packetsize = ctl->cpacketsize;
         }
         if (ctl->bitpattern < 0) {
             ctl->bitpattern =
@@ -569,53 +1948,79 @@ int net_send_batch(
         }
     }
 
-    net_send_query(ctl, batch_at, abs(packetsize));
+    if (net->burst_rate)
+        return net_send_burst(ctl, net);
+
+    /*  A shared prefix is found afresh for each cycle  */
+    if (ctl->share_prefix && net->batch_at < ctl->fstTTL) {
+        net_find_leader(ctl, net);
+        net->cycle_probes = 0;
+    }
+
+    if (ctl->adaptive_probes || net->shared_hops) {
+        /*  Count the hops due this cycle, which share its interval  */
+        if (net->batch_at < ctl->fstTTL) {
+            net->cycle_probes = 0;
+            for (i = ctl->fstTTL - 1;
+                 i < net->numhosts && i < net->maxhosts; i++) {
+                net->cycle_probes += net_hop_due(ctl, net, i);
+            }
+        }
+
+        while (net->batch_at < net->maxhosts
+               && net->batch_at < ctl->maxTTL - 1
+               && !net_hop_due(ctl, net, net->batch_at)) {
+            net->batch_at++;
+        }
+    }
+
+    net_grow_hosts(net, net->batch_at + 1);
+    net_send_query(ctl, net, net->batch_at, abs(net->packetsize));
 
-    for (i = ctl->fstTTL - 1; i < batch_at; i++) {
-        if (addrcmp
-            ((void *) &(host[i].addr), (void *) &ctl->unspec_addr,
-             ctl->af) == 0)
+    for (i = ctl->fstTTL - 1; i < net->batch_at; i++) {
+        if (net->host[i].addr_id == 0)
             n_unknown++;
 
         /* The second condition in the next "if" statement was added in mtr-0.56, 
            but I don't remember why. It makes mtr stop skipping sections of unknown
            hosts. Removed in 0.65. 
            If the line proves necessary, it should at least NOT trigger that line
-           when host[i].addr == 0 */
-        if ((addrcmp((void *) &(host[i].addr),
-                     (void *) remoteaddress, ctl->af) == 0))
+           when net->host[i].addr_id == 0 */
+        if (net->host[i].addr_id == net->remote_id)
             n_unknown = MaxHost;        /* Make sure we drop into "we should restart" */
     }
 
     if (                        /* success in reaching target */
-           (addrcmp((void *) &(host[batch_at].addr),
-                    (void *) remoteaddress, ctl->af) == 0) ||
+           (net->host[net->batch_at].addr_id == net->remote_id) ||
            /* fail in consecutive maxUnknown (firewall?) */
            (n_unknown > ctl->maxUnknown) ||
            /* or reach limit  */
-           (batch_at >= ctl->maxTTL - 1)) {
-        numhosts = batch_at + 1;
-        batch_at = ctl->fstTTL - 1;
+           (net->batch_at >= ctl->maxTTL - 1)) {
+        net->numhosts = net->batch_at + 1;
+        net->batch_at = ctl->fstTTL - 1;
+        net->cycle++;
         return 1;
     }
 
-    batch_at++;
+    net->batch_at++;
     return 0;
 }
 
 
 /*  Ensure the interface address a valid address for our use  */
 static void net_validate_interface_address(
+    struct net_session *net,
     int address_family,
     char *interface_address)
 {
-    if (inet_pton(address_family, interface_address, sourceaddress) != 1) {
+    if (inet_pton(address_family, interface_address,
+                  net->sourceaddress) != 1) {
         error(EXIT_FAILURE, errno, "invalid local address");
     }
 
     if (inet_ntop
-        (address_family, sourceaddress, localaddr,
-         sizeof(localaddr)) == NULL) {
+        (address_family, net->sourceaddress, net->localaddr,
+         sizeof(net->localaddr)) == NULL) {
         error(EXIT_FAILURE, errno, "invalid local address");
     }
 }
@@ -682,8 +2087,12 @@ static void net_find_interface_address_from_name(
   the socket is bound to.
 */
 static void net_find_local_address(
-    void)
+    struct net_session *net)
 {
+    struct sockaddr *remotesockaddr =
+        (struct sockaddr *) &net->remotesockaddr;
+    struct sockaddr *sourcesockaddr =
+        (struct sockaddr *) &net->sourcesockaddr;
     int udp_socket;
     int addr_length;
     struct sockaddr_storage remote_sockaddr;
@@ -704,14 +2113,14 @@ static void net_find_local_address(
 #ifdef ENABLE_IPV6
         addr_length = sizeof(struct sockaddr_in6);
 
-        memcpy(&remote_sockaddr, rsa6, addr_length);
+        memcpy(&remote_sockaddr, remotesockaddr, addr_length);
         remote6 = (struct sockaddr_in6 *) &remote_sockaddr;
         remote6->sin6_port = htons(1);
 #endif
     } else {
         addr_length = sizeof(struct sockaddr_in);
 
-        memcpy(&remote_sockaddr, rsa4, addr_length);
+        memcpy(&remote_sockaddr, remotesockaddr, addr_length);
         remote4 = (struct sockaddr_in *) &remote_sockaddr;
         remote4->sin_port = htons(1);
     }
@@ -726,72 +2135,226 @@ static void net_find_local_address(
         error(EXIT_FAILURE, errno, "local address determination failed");
     }
 
-    sockaddrtop(sourcesockaddr, localaddr, sizeof(localaddr));
+    sockaddrtop(sourcesockaddr, net->localaddr,
+                sizeof(net->localaddr));
 
     close(udp_socket);
 }
 
 
-int net_open(
+/*
+    Open the pipe to our mtr-packet child, or with --agent, connect to
+    each of the agents, whose probes share one table of tokens.
+*/
+int net_open_pipe(
+    struct mtr_ctl *ctl)
+{
+    char address[NI_MAXHOST + NI_MAXSERV + 8];
+    int err;
+    int i;
+
+    if (!ctl->agent_count) {
+        packet_command_pipe_count = 1;
+        return open_command_pipe(ctl, &packet_command_pipe[0], NULL);
+    }
+
+    for (i = 0; i < ctl->agent_count; i++) {
+        snprintf(address, sizeof(address), "%s%s", AGENT_ADDRESS_PREFIX,
+                 ctl->agent[i]);
+
+        err = open_command_pipe(ctl, &packet_command_pipe[i], address);
+        if (err) {
+            error(0, err, "agent %s", ctl->agent[i]);
+            return err;
+        }
+        packet_command_pipe_count = i + 1;
+    }
+
+    return 0;
+}
+
+
+/*  A session for a target, before its local address is known  */
+static struct net_session *net_session_alloc(
     struct mtr_ctl *ctl,
     struct hostent *hostent)
 {
-    int err;
+    static int session_serial;
+    struct net_session *net;
+    struct sockaddr_in *ssa4;
+    struct sockaddr_in *rsa4;
+#ifdef ENABLE_IPV6
+    struct sockaddr_in6 *ssa6;
+    struct sockaddr_in6 *rsa6;
+#endif
 
-    /*  Spawn the mtr-packet child process  */
-    err = open_command_pipe(ctl, &packet_command_pipe);
-    if (err) {
-        return err;
+    net = calloc(1, sizeof(struct net_session));
+    if (net == NULL) {
+        error(EXIT_FAILURE, errno, "memory allocation failure");
     }
 
-    net_reset(ctl);
+    net_reset(ctl, net);
+
+    net->serial = ++session_serial;
+    net->next_session = sessions;
+    sessions = net;
 
-    remotesockaddr->sa_family = hostent->h_addrtype;
+    net->cmdpipe = &packet_command_pipe[ctl->vantage];
+    net->af = hostent->h_addrtype;
+    net->remotesockaddr.ss_family = hostent->h_addrtype;
 
     switch (hostent->h_addrtype) {
     case AF_INET:
+        ssa4 = (struct sockaddr_in *) &net->sourcesockaddr;
+        rsa4 = (struct sockaddr_in *) &net->remotesockaddr;
         addrcpy((void *) &(rsa4->sin_addr), hostent->h_addr, AF_INET);
-        sourceaddress = (ip_t *) & (ssa4->sin_addr);
-        remoteaddress = (ip_t *) & (rsa4->sin_addr);
+        net->sourceaddress = (ip_t *) & (ssa4->sin_addr);
+        net->remoteaddress = (ip_t *) & (rsa4->sin_addr);
         break;
 #ifdef ENABLE_IPV6
     case AF_INET6:
+        ssa6 = (struct sockaddr_in6 *) &net->sourcesockaddr;
+        rsa6 = (struct sockaddr_in6 *) &net->remotesockaddr;
         addrcpy((void *) &(rsa6->sin6_addr), hostent->h_addr, AF_INET6);
-        sourceaddress = (ip_t *) & (ssa6->sin6_addr);
-        remoteaddress = (ip_t *) & (rsa6->sin6_addr);
+        net->sourceaddress = (ip_t *) & (ssa6->sin6_addr);
+        net->remoteaddress = (ip_t *) & (rsa6->sin6_addr);
         break;
 #endif
     default:
         error(EXIT_FAILURE, 0, "net_open bad address type");
     }
+    net->remote_id = addr_intern(net->af, net->remoteaddress);
+
+    return net;
+}
+
+
+/*  Begin tracing a new target, with a session of its own  */
+struct net_session *net_session_new(
+    struct mtr_ctl *ctl,
+    struct hostent *hostent)
+{
+    struct net_session *net = net_session_alloc(ctl, hostent);
 
     if (ctl->InterfaceAddress) {
-        net_validate_interface_address(ctl->af, ctl->InterfaceAddress);
+        net_validate_interface_address(net, ctl->af,
+                                       ctl->InterfaceAddress);
     } else if (ctl->InterfaceName) {
         net_find_interface_address_from_name(
-            &sourcesockaddr_struct, ctl->af, ctl->InterfaceName);
+            &net->sourcesockaddr, ctl->af, ctl->InterfaceName);
 
-        sockaddrtop(sourcesockaddr, localaddr, sizeof(localaddr));
+        sockaddrtop((struct sockaddr *) &net->sourcesockaddr,
+                    net->localaddr, sizeof(net->localaddr));
     } else {
-        net_find_local_address();
+        net_find_local_address(net);
     }
 
-    return 0;
+    return net;
 }
 
 
-void net_reopen(
+/*
+    A session for replaying a capture file, with the local address
+    as captured, and no probes of its own.
+*/
+struct net_session *net_session_replay(
     struct mtr_ctl *ctl,
-    struct hostent *addr)
+    struct hostent *hostent,
+    const char *localaddr)
+{
+    struct net_session *net = net_session_alloc(ctl, hostent);
+
+    xstrncpy(net->localaddr, localaddr, sizeof(net->localaddr));
+
+    return net;
+}
+
+
+/*
+    A session has sent its last probe, and waits out its grace period
+    for replies.  It leads no others from now on, and those following
+    it probe the cycles left to it which its probes in flight won't
+    answer for.
+*/
+void net_session_stop(
+    struct mtr_ctl *ctl,
+    struct net_session *net)
 {
+    struct net_session *follower;
     int at;
 
-    for (at = 0; at < MaxHost; at++) {
-        memset(&host[at], 0, sizeof(host[at]));
+    net->stopped = 1;
+
+    for (follower = sessions; follower;
+         follower = follower->next_session) {
+        if (follower->leader != net) {
+            continue;
+        }
+
+        net_unfollow(follower);
+        for (at = 0; at < follower->maxhosts; at++) {
+            if (follower->host[at].owed) {
+                net_reprobe_hop(ctl, follower, at,
+                                probe_table_count(net, at));
+            }
+        }
+    }
+}
+
+
+/*  Stop tracing a target, ignoring replies to its probes in flight  */
+void net_session_free(
+    struct net_session *net)
+{
+    struct net_session **link;
+
+    probe_table_forget(net);
+
+    net_forget_followers(net);
+    for (link = &sessions; *link != net; link = &(*link)->next_session);
+    *link = net->next_session;
+
+    net_free_hosts(net);
+    free(net);
+}
+
+
+int net_open(
+    struct mtr_ctl *ctl,
+    struct hostent *hostent)
+{
+    int err;
+
+    /*  Spawn the mtr-packet child process  */
+    err = net_open_pipe(ctl);
+    if (err) {
+        return err;
+    }
+
+    /*  A target traced before this one is replaced  */
+    if (ctl->net) {
+        net_session_free(ctl->net);
     }
+    ctl->net = net_session_new(ctl, hostent);
 
-    remotesockaddr->sa_family = addr->h_addrtype;
-    addrcpy((void *) remoteaddress, addr->h_addr, addr->h_addrtype);
+    return 0;
+}
+
+
+void net_reopen(
+    struct mtr_ctl *ctl,
+    struct net_session *net,
+    struct hostent *addr)
+{
+    struct sockaddr_in *rsa4 = (struct sockaddr_in *) &net->remotesockaddr;
+#ifdef ENABLE_IPV6
+    struct sockaddr_in6 *rsa6 =
+        (struct sockaddr_in6 *) &net->remotesockaddr;
+#endif
+
+    net->af = addr->h_addrtype;
+    net->remotesockaddr.ss_family = addr->h_addrtype;
+    addrcpy((void *) net->remoteaddress, addr->h_addr, addr->h_addrtype);
 
     switch (addr->h_addrtype) {
     case AF_INET:
@@ -805,93 +2368,181 @@ void net_reopen(
     default:
         error(EXIT_FAILURE, 0, "net_reopen bad address type");
     }
+    net->remote_id = addr_intern(net->af, net->remoteaddress);
 
-    net_reset(ctl);
-    net_send_batch(ctl);
+    net_reset(ctl, net);
+    net_send_batch(ctl, net);
 }
 
 
 void net_reset(
-    struct mtr_ctl *ctl)
+    struct mtr_ctl *ctl,
+    struct net_session *net)
 {
-    static struct nethost template = {
-        .saved_seq_offset = 2 - SAVED_PINGS
-    };
+    net->batch_at = ctl->fstTTL - 1;   /* above replacedByMin */
+    net->numhosts = 10;
+    net->burst_rate = ctl->burst_rate;
+    net->burst_sent = 0;
+    net->burst_length = 0;
+    net->pipeline = ctl->pipeline;
+    net->in_flight = 0;
+    net->cycle = 0;
+    net->cycle_probes = 0;
+
+    /*  The hop table starts afresh, to grow again with the path  */
+    net_forget_followers(net);
+    net_unfollow(net);
+    net->leader = NULL;
+    net->stopped = 0;
+    net_free_hosts(net);
+    net->saved_max = ctl->saved_pings;
+    net->saved_column = 0;
+    net_grow_hosts(net, net->batch_at + 1);
+
+    /*  Probes of other sessions traced at the same time are unaffected  */
+    probe_table_forget(net);
+}
+
+
+/*  Close the pipe to the packet generator process, and kill the process  */
+void net_close(
+    void)
+{
+    int i;
+
+    for (i = 0; i < packet_command_pipe_count; i++) {
+        close_command_pipe(&packet_command_pipe[i]);
+    }
+    packet_command_pipe_count = 0;
+}
 
-    int at, i;
 
-    batch_at = ctl->fstTTL - 1; /* above replacedByMin */
-    numhosts = 10;
+int net_waitfd(
+    void)
+{
+    return packet_command_pipe[0].read_fd;
+}
 
-    for (i = 0; i < SAVED_PINGS; i++)
-        template.saved[i] = -2;
 
-    for (at = 0; at < MaxHost; at++) {
-        memcpy(&(host[at]), &template, sizeof(template));
+/*  The descriptors of the pipes of all agents, returning their count  */
+int net_waitfds(
+    int *fds)
+{
+    int i;
+
+    for (i = 0; i < packet_command_pipe_count; i++) {
+        fds[i] = packet_command_pipe[i].read_fd;
     }
 
-    for (at = 0; at < MaxSequence; at++) {
-        sequence[at].transit = 0;
+    return packet_command_pipe_count;
+}
+
+
+/*  Blank the columns of a hop's history it has missed  */
+static int *net_save_catch_up(
+    struct net_session *net,
+    int at)
+{
+    struct nethost *hop = &net->host[at];
+    int *saved = &net->saved[at * net->saved_max];
+    int column = hop->saved_column + 1;
+
+    if (column <= net->saved_column - net->saved_max) {
+        column = net->saved_column - net->saved_max + 1;
     }
+    for (; column <= net->saved_column; column++) {
+        saved[column % net->saved_max] = -2;
+    }
+    hop->saved_column = net->saved_column;
 
+    return saved;
 }
 
 
-/*  Close the pipe to the packet generator process, and kill the process  */
-void net_close(
-    void)
+/*
+    Get the saved ping history of a hop, without copying it.  The
+    history is a ring of net_saved_count entries, with the oldest
+    at the index stored through oldest, and -2 for no probe and -1
+    for a probe without a reply.
+*/
+int *net_saved_pings(
+    struct net_session *net,
+    int at,
+    int *oldest)
 {
-    close_command_pipe(&packet_command_pipe);
+    *oldest = (net->saved_column + 1) % net->saved_max;
+    return net_save_catch_up(net, at);
 }
 
 
-int net_waitfd(
-    void)
+int net_saved_count(
+    struct net_session *net)
 {
-    return packet_command_pipe.read_fd;
+    return net->saved_max;
 }
 
 
-int *net_saved_pings(
-    int at)
+/*  The number of the newest column of the history  */
+int net_saved_newest(
+    struct net_session *net)
 {
-    return host[at].saved;
+    return net->saved_column;
 }
 
 
-static void net_save_increment(
-    void)
+/*
+    The count of changes to a session's hops, and the count when a hop
+    last changed, so that a display can tell which hops have changed
+    since it last drew them.
+*/
+unsigned long net_changes(
+    struct net_session *net)
 {
-    int at;
-    for (at = 0; at < MaxHost; at++) {
-        memmove(host[at].saved, host[at].saved + 1,
-                (SAVED_PINGS - 1) * sizeof(int));
-        host[at].saved[SAVED_PINGS - 1] = -2;
-        host[at].saved_seq_offset += 1;
-    }
+    return net->changes;
+}
+
+
+unsigned long net_hop_changed(
+    struct net_session *net,
+    int at)
+{
+    return net->host[at].changed;
 }
 
 
-void net_save_xmit(
+/*
+    Record a probe of a hop in the newest column of the history,
+    first advancing the history if this hop already has a probe
+    there.  Returns the column used.
+*/
+int net_save_xmit(
+    struct net_session *net,
     int at)
 {
-    if (host[at].saved[SAVED_PINGS - 1] != -2)
-        net_save_increment();
-    host[at].saved[SAVED_PINGS - 1] = -1;
+    int *saved = net_save_catch_up(net, at);
+
+    if (saved[net->saved_column % net->saved_max] != -2) {
+        net->saved_column++;
+        saved = net_save_catch_up(net, at);
+    }
+    saved[net->saved_column % net->saved_max] = -1;
+
+    return net->saved_column;
 }
 
 
 void net_save_return(
+    struct net_session *net,
     int at,
-    int seq,
+    int column,
     int ms)
 {
-    int idx;
-    idx = seq - host[at].saved_seq_offset;
-    if ((idx < 0) || (idx >= SAVED_PINGS)) {
+    int *saved = net_save_catch_up(net, at);
+
+    if (column <= net->saved_column - net->saved_max) {
         return;
     }
-    host[at].saved[idx] = ms;
+    saved[column % net->saved_max] = ms;
 }
 
 /* Similar to inet_ntop but uses a sockaddr as it's argument. */
@@ -31,89 +31,199 @@
 
 #include "mtr.h"
 
+struct net_session;
+
 extern int net_open(
     struct mtr_ctl *ctl,
     struct hostent *host);
+extern int net_open_pipe(
+    struct mtr_ctl *ctl);
+extern struct net_session *net_session_new(
+    struct mtr_ctl *ctl,
+    struct hostent *host);
+extern struct net_session *net_session_replay(
+    struct mtr_ctl *ctl,
+    struct hostent *host,
+    const char *localaddr);
+extern void net_session_stop(
+    struct mtr_ctl *ctl,
+    struct net_session *net);
+extern void net_session_free(
+    struct net_session *net);
 extern void net_reopen(
     struct mtr_ctl *ctl,
+    struct net_session *net,
     struct hostent *address);
 extern void net_reset(
-    struct mtr_ctl *ctl);
+    struct mtr_ctl *ctl,
+    struct net_session *net);
 extern void net_close(
     void);
 extern int net_waitfd(
     void);
+extern int net_waitfds(
+    int *fds);
 extern void net_process_return(
     struct mtr_ctl *ctl);
 extern void net_harvest_fds(
     struct mtr_ctl *ctl);
+extern int net_replay_xmit(
+    struct mtr_ctl *ctl,
+    struct net_session *net,
+    int index,
+    int token);
+extern void net_replay_reply(
+    struct mtr_ctl *ctl,
+    int token,
+    int err,
+    struct mplslen *mpls,
+    ip_t * addr,
+    int usec);
 
 extern int net_max(
-    struct mtr_ctl *ctl);
+    struct mtr_ctl *ctl,
+    struct net_session *net);
 extern int net_min(
     struct mtr_ctl *ctl);
 extern int net_last(
+    struct net_session *net,
     int at);
 extern ip_t *net_addr(
+    struct net_session *net,
     int at);
 extern int net_err(
+    struct net_session *net,
     int at);
 extern void *net_mpls(
+    struct net_session *net,
     int at);
 extern void *net_mplss(
+    struct net_session *net,
     int,
     int);
 extern int net_loss(
+    struct net_session *net,
     int at);
 extern int net_drop(
+    struct net_session *net,
     int at);
 extern int net_best(
+    struct net_session *net,
     int at);
 extern int net_worst(
+    struct net_session *net,
     int at);
 extern int net_avg(
+    struct net_session *net,
     int at);
 extern int net_gmean(
+    struct net_session *net,
     int at);
 extern int net_stdev(
+    struct net_session *net,
     int at);
 extern int net_jitter(
+    struct net_session *net,
     int at);
 extern int net_jworst(
+    struct net_session *net,
     int at);
 extern int net_javg(
+    struct net_session *net,
     int at);
 extern int net_jinta(
+    struct net_session *net,
+    int at);
+extern int net_p50(
+    struct net_session *net,
+    int at);
+extern int net_p90(
+    struct net_session *net,
+    int at);
+extern int net_p99(
+    struct net_session *net,
+    int at);
+extern int net_p999(
+    struct net_session *net,
     int at);
 extern ip_t *net_addrs(
+    struct net_session *net,
     int at,
     int i);
+extern int net_addr_id(
+    struct net_session *net,
+    int at);
+extern int net_addrs_id(
+    struct net_session *net,
+    int at,
+    int i);
+extern int net_path_count(
+    struct net_session *net,
+    int at);
+extern int net_path_xmit(
+    struct net_session *net,
+    int at,
+    int i);
+extern int net_path_loss(
+    struct net_session *net,
+    int at,
+    int i);
+extern int net_path_avg(
+    struct net_session *net,
+    int at,
+    int i);
+extern int net_session_af(
+    struct net_session *net);
 extern char *net_localaddr(
-    void);
+    struct net_session *net);
+extern ip_t *net_remote_addr(
+    struct net_session *net);
 
 extern int net_send_batch(
-    struct mtr_ctl *ctl);
+    struct mtr_ctl *ctl,
+    struct net_session *net);
+extern int net_in_flight(
+    struct net_session *net);
+extern int net_pipeline_full(
+    struct net_session *net);
 extern void net_end_transit(
-    void);
+    struct net_session *net);
 
 extern int calc_deltatime(
+    struct net_session *net,
     float WaitTime);
 
 extern int net_returned(
+    struct net_session *net,
     int at);
 extern int net_xmit(
+    struct net_session *net,
     int at);
 
 extern int net_up(
+    struct net_session *net,
     int at);
 
 extern int *net_saved_pings(
-    int at);
-extern void net_save_xmit(
+    struct net_session *net,
+    int at,
+    int *oldest);
+extern int net_saved_count(
+    struct net_session *net);
+extern int net_saved_newest(
+    struct net_session *net);
+extern unsigned long net_changes(
+    struct net_session *net);
+extern unsigned long net_hop_changed(
+    struct net_session *net,
+    int at);
+extern int net_save_xmit(
+    struct net_session *net,
     int at);
 extern void net_save_return(
+    struct net_session *net,
     int at,
-    int seq,
+    int column,
     int ms);
 
 extern int addrcmp(
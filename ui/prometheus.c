@@ -0,0 +1,588 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#ifdef HAVE_ERROR_H
+#include <error.h>
+#else
+#include "portability/error.h"
+#endif
+
+#include "mtr.h"
+#include "net.h"
+#include "dns.h"
+#include "event.h"
+#include "prometheus.h"
+#include "utils.h"
+#include "addrtab.h"
+
+/*
+    The exporter of --prometheus, a small HTTP server answering scrapes
+    of /metrics in the Prometheus text exposition format.  Its sockets
+    are watched by the same event loop as the probes, and a scrape is
+    answered from the statistics of the hops at hand, so that probing
+    carries on between scrapes and a scrape costs no more than the
+    formatting of its reply.
+
+    Each request is expected to arrive in a packet or two.  A reply is
+    written as the client's socket will take it, with the socket
+    watched for output by the event loop in the meantime, so that a
+    slow scraper never holds up the probes.  A client which hasn't
+    been answered within PROMETHEUS_TIMEOUT of connecting is dropped,
+    whether it sent nothing useful or is slow to take its reply.
+*/
+
+/*  The longest request we read, which is far more than a scrape sends  */
+#define REQUEST_MAX 4096
+
+/*  A client connected to the exporter  */
+struct client {
+    int fd;                     /* -1 while the slot is free */
+    long long connected;        /* when it connected, by event_now() */
+    size_t length;
+    char request[REQUEST_MAX];
+    char *output;               /* the reply being written, or NULL */
+    size_t output_size;
+    size_t output_sent;
+};
+
+/*  A hostname traced, whose hops are exported  */
+struct target {
+    const char *name;
+    struct net_session *net;    /* NULL while the slot is free */
+};
+
+/*  A statistic of each hop, exported as a metric, or one of its quantiles  */
+struct metric {
+    const char *name;
+    const char *type;
+    const char *help;
+    int (*net_xxx) (struct net_session *, int);
+    double scale;               /* of the statistic to the metric's units */
+    const char *quantile;       /* the label of a percentile, or NULL */
+};
+
+static const struct metric metrics[] = {
+    {"mtr_hop_sent_total", "counter", "Probes sent to the hop.",
+     net_xmit, 1, NULL},
+    {"mtr_hop_received_total", "counter", "Replies received from the hop.",
+     net_returned, 1, NULL},
+    {"mtr_hop_loss_ratio", "gauge",
+     "The ratio of probes to the hop which went unanswered.",
+     net_loss, 0.00001, NULL},
+    {"mtr_hop_rtt_last_seconds", "gauge",
+     "The round trip time of the last reply.", net_last, 0.000001, NULL},
+    {"mtr_hop_rtt_best_seconds", "gauge",
+     "The shortest round trip time.", net_best, 0.000001, NULL},
+    {"mtr_hop_rtt_avg_seconds", "gauge",
+     "The mean round trip time.", net_avg, 0.000001, NULL},
+    {"mtr_hop_rtt_worst_seconds", "gauge",
+     "The longest round trip time.", net_worst, 0.000001, NULL},
+    {"mtr_hop_rtt_stdev_seconds", "gauge",
+     "The standard deviation of the round trip times.", net_stdev,
+     0.000001, NULL},
+    {"mtr_hop_rtt_quantile_seconds", "gauge",
+     "Percentiles of the round trip times, estimated from a histogram.",
+     net_p50, 0.000001, "0.5"},
+    {"mtr_hop_rtt_quantile_seconds", NULL, NULL, net_p90, 0.000001, "0.9"},
+    {"mtr_hop_rtt_quantile_seconds", NULL, NULL, net_p99, 0.000001, "0.99"},
+    {"mtr_hop_rtt_quantile_seconds", NULL, NULL, net_p999, 0.000001,
+     "0.999"},
+};
+
+static int listen_fd = -1;
+static struct client clients[PROMETHEUS_CLIENTS];
+static struct target targets[MAX_CONCURRENT];
+
+/*  The loop watching our sockets, and the first of the slots we hold  */
+static struct event_loop *watched;
+static int watched_first;
+
+/*  The reply being formatted  */
+static char *reply;
+static size_t reply_size;
+static size_t reply_max;
+
+
+static void set_nonblocking(
+    int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+
+/*  Listen on "PORT", "ADDRESS:PORT" or "[ADDRESS]:PORT"  */
+void prometheus_open(
+    const char *address)
+{
+    struct addrinfo hints, *res, *ai;
+    char host[NI_MAXHOST];
+    const char *port;
+    char *colon;
+    int on = 1;
+    int gai_error;
+    int i;
+
+    for (i = 0; i < PROMETHEUS_CLIENTS; i++) {
+        clients[i].fd = -1;
+    }
+
+    xstrncpy(host, address, sizeof(host));
+    colon = strrchr(host, ':');
+    if (colon) {
+        *colon = 0;
+        port = address + (colon + 1 - host);
+        if (host[0] == '[' && colon[-1] == ']') {
+            colon[-1] = 0;
+            memmove(host, host + 1, strlen(host));
+        }
+    } else {
+        port = address;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    gai_error = getaddrinfo(colon && host[0] ? host : NULL, port, &hints,
+                            &res);
+    if (gai_error) {
+        error(EXIT_FAILURE, 0, "--prometheus %s: %s", address,
+              gai_strerror(gai_error));
+    }
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        listen_fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (listen_fd == -1)
+            continue;
+
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(listen_fd, ai->ai_addr, ai->ai_addrlen) == 0
+            && listen(listen_fd, PROMETHEUS_CLIENTS) == 0)
+            break;
+
+        close(listen_fd);
+        listen_fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (listen_fd == -1) {
+        error(EXIT_FAILURE, errno, "--prometheus %s", address);
+    }
+    set_nonblocking(listen_fd);
+}
+
+
+void prometheus_close(
+    void)
+{
+    int i;
+
+    for (i = 0; i < PROMETHEUS_CLIENTS; i++) {
+        if (clients[i].fd >= 0) {
+            close(clients[i].fd);
+            clients[i].fd = -1;
+        }
+        free(clients[i].output);
+        clients[i].output = NULL;
+    }
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        listen_fd = -1;
+    }
+    watched = NULL;
+
+    free(reply);
+    reply = NULL;
+    reply_max = 0;
+}
+
+
+void prometheus_add_target(
+    const char *name,
+    struct net_session *net)
+{
+    int i;
+
+    for (i = 0; i < MAX_CONCURRENT; i++) {
+        if (!targets[i].net) {
+            targets[i].name = name;
+            targets[i].net = net;
+            return;
+        }
+    }
+}
+
+
+void prometheus_remove_target(
+    struct net_session *net)
+{
+    int i;
+
+    for (i = 0; i < MAX_CONCURRENT; i++) {
+        if (targets[i].net == net) {
+            targets[i].net = NULL;
+        }
+    }
+}
+
+
+static void expire_clients(
+    struct event_loop *loop);
+
+
+/*
+    Watch our sockets with an event loop, returning the index of the
+    first of the slots they take: that of the listening socket, followed
+    by one for each client.  The loop's PROMETHEUS_TIMER is ours too.
+*/
+int prometheus_add_fds(
+    struct event_loop *loop)
+{
+    int i;
+
+    watched = loop;
+    watched_first = event_add_fd(loop, listen_fd);
+    for (i = 0; i < PROMETHEUS_CLIENTS; i++) {
+        event_add_fd(loop, clients[i].fd);
+        if (clients[i].output) {
+            event_set_output(loop, watched_first + 1 + i, 1);
+        }
+    }
+    expire_clients(loop);
+
+    return watched_first;
+}
+
+
+/*  Stop updating a loop which is about to close  */
+void prometheus_remove_fds(
+    struct event_loop *loop)
+{
+    if (watched == loop) {
+        watched = NULL;
+    }
+}
+
+
+static void drop_client(
+    struct client *client)
+{
+    if (watched) {
+        event_set_fd(watched, watched_first + 1 + (client - clients), -1);
+    }
+    close(client->fd);
+    client->fd = -1;
+    free(client->output);
+    client->output = NULL;
+}
+
+
+static void reply_append(
+    const char *format,
+    ...)
+{
+    va_list args;
+    int len;
+
+    while (1) {
+        va_start(args, format);
+        len = vsnprintf(reply + reply_size, reply_max - reply_size, format,
+                        args);
+        va_end(args);
+
+        if (len >= 0 && reply_size + len < reply_max) {
+            reply_size += len;
+            return;
+        }
+
+        reply_max = reply_max ? 2 * reply_max : 16384;
+        reply = realloc(reply, reply_max);
+        if (reply == NULL) {
+            error(EXIT_FAILURE, errno, "memory allocation failure");
+        }
+    }
+}
+
+
+/*  Append a label value, escaped as the exposition format requires  */
+static void append_label(
+    const char *value)
+{
+    for (; *value; value++) {
+        if (*value == '\\' || *value == '"') {
+            reply_append("\\%c", *value);
+        } else if (*value == '\n') {
+            reply_append("\\n");
+        } else {
+            reply_append("%c", *value);
+        }
+    }
+}
+
+
+/*  Format the metrics of every hop of every target  */
+static void format_metrics(
+    struct mtr_ctl *ctl)
+{
+    const struct metric *metric;
+    struct target *target;
+    int af = ctl->af;
+    int at, max;
+    int addr;
+    size_t i;
+
+    for (i = 0; i < sizeof(metrics) / sizeof(metrics[0]); i++) {
+        metric = &metrics[i];
+        if (metric->help) {
+            reply_append("# HELP %s %s\n# TYPE %s %s\n", metric->name,
+                         metric->help, metric->name, metric->type);
+        }
+
+        for (target = targets; target < targets + MAX_CONCURRENT; target++) {
+            if (!target->net)
+                continue;
+
+            ctl->af = net_session_af(target->net);
+            max = net_max(ctl, target->net);
+            for (at = net_min(ctl); at < max; at++) {
+                reply_append("%s{target=\"", metric->name);
+                append_label(target->name);
+                reply_append("\",hop=\"%d\",address=\"", at + 1);
+                addr = net_addr_id(target->net, at);
+                if (addr) {
+                    append_label(addr_text(addr));
+                }
+                if (metric->quantile) {
+                    reply_append("\",quantile=\"%s", metric->quantile);
+                }
+                reply_append("\"} %g\n",
+                             metric->net_xxx(target->net, at) *
+                             metric->scale);
+            }
+        }
+    }
+    ctl->af = af;
+}
+
+
+/*
+    Write as much of a client's reply as its socket will take without
+    blocking, dropping the client once the whole reply is written, or
+    the client has gone.
+*/
+static void write_reply(
+    struct client *client)
+{
+    ssize_t len;
+
+    while (client->output_sent < client->output_size) {
+        /*  A scraper hanging up mid-reply mustn't raise SIGPIPE  */
+        len = send(client->fd, client->output + client->output_sent,
+                   client->output_size - client->output_sent,
+                   MSG_NOSIGNAL);
+
+        if (len > 0) {
+            client->output_sent += len;
+            continue;
+        }
+        if (len == -1 && errno == EINTR)
+            continue;
+        if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        break;
+    }
+
+    drop_client(client);
+}
+
+
+/*  Format a reply, and start writing it to the client  */
+static void send_reply(
+    struct client *client,
+    const char *status,
+    struct mtr_ctl *ctl)
+{
+    char header[256];
+    size_t header_size;
+
+    reply_size = 0;
+    if (ctl) {
+        format_metrics(ctl);
+    } else {
+        reply_append("%s\n", status);
+    }
+
+    header_size =
+        snprintf(header, sizeof(header),
+                 "HTTP/1.0 %s\r\n"
+                 "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                 "Content-Length: %lu\r\n"
+                 "Connection: close\r\n\r\n", status,
+                 (unsigned long) reply_size);
+
+    /*  The client keeps its own copy, as others may be answered first  */
+    client->output = malloc(header_size + reply_size);
+    if (client->output == NULL) {
+        error(EXIT_FAILURE, errno, "memory allocation failure");
+    }
+    memcpy(client->output, header, header_size);
+    memcpy(client->output + header_size, reply, reply_size);
+    client->output_size = header_size + reply_size;
+    client->output_sent = 0;
+
+    /*  What the socket won't take now is written as it drains  */
+    if (watched) {
+        event_set_output(watched, watched_first + 1 + (client - clients),
+                         1);
+    }
+    write_reply(client);
+}
+
+
+/*  Read what a client has sent, answering once its request is whole  */
+static void read_request(
+    struct mtr_ctl *ctl,
+    struct client *client)
+{
+    ssize_t len;
+
+    len = read(client->fd, client->request + client->length,
+               REQUEST_MAX - 1 - client->length);
+    if (len == -1 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (len <= 0) {
+        drop_client(client);
+        return;
+    }
+
+    client->length += len;
+    client->request[client->length] = 0;
+    if (!strstr(client->request, "\r\n\r\n")
+        && !strstr(client->request, "\n\n")) {
+        if (client->length == REQUEST_MAX - 1)
+            send_reply(client, "400 Bad Request", NULL);
+        return;
+    }
+
+    if (strncmp(client->request, "GET ", 4)) {
+        send_reply(client, "405 Method Not Allowed", NULL);
+    } else if (strncmp(client->request + 4, "/metrics", 8)
+               || !strchr(" ?", client->request[12])) {
+        send_reply(client, "404 Not Found", NULL);
+    } else {
+        send_reply(client, "200 OK", ctl);
+    }
+}
+
+
+/*  Take a new connection, if a slot is free  */
+static void accept_client(
+    void)
+{
+    struct client *client = NULL;
+    int fd;
+    int i;
+
+    fd = accept(listen_fd, NULL, NULL);
+    if (fd == -1)
+        return;
+
+    for (i = 0; i < PROMETHEUS_CLIENTS; i++) {
+        if (clients[i].fd == -1) {
+            client = &clients[i];
+            break;
+        }
+    }
+    if (!client) {
+        close(fd);
+        return;
+    }
+
+    set_nonblocking(fd);
+    client->fd = fd;
+    client->connected = event_now();
+    client->length = 0;
+    if (watched) {
+        event_set_fd(watched, watched_first + 1 + (client - clients), fd);
+    }
+}
+
+
+/*
+    Drop the clients which haven't been answered in time, and set our
+    timer for the soonest timeout of the others.
+*/
+static void expire_clients(
+    struct event_loop *loop)
+{
+    long long now = event_now();
+    long long deadline;
+    long long next = 0;
+    int i;
+
+    for (i = 0; i < PROMETHEUS_CLIENTS; i++) {
+        if (clients[i].fd == -1)
+            continue;
+
+        deadline = clients[i].connected + PROMETHEUS_TIMEOUT * 1000LL;
+        if (deadline <= now) {
+            drop_client(&clients[i]);
+        } else if (!next || deadline < next) {
+            next = deadline;
+        }
+    }
+
+    event_set_timer(loop, PROMETHEUS_TIMER, next);
+}
+
+
+/*  Handle the activity on our sockets, in the slots from first  */
+void prometheus_handle(
+    struct mtr_ctl *ctl,
+    struct event_loop *loop,
+    int first)
+{
+    int i;
+
+    for (i = 0; i < PROMETHEUS_CLIENTS; i++) {
+        if (clients[i].fd >= 0 && loop->fd_ready[first + 1 + i]) {
+            if (clients[i].output) {
+                write_reply(&clients[i]);
+            } else {
+                read_request(ctl, &clients[i]);
+            }
+        }
+    }
+    if (loop->fd_ready[first]) {
+        accept_client();
+    }
+    expire_clients(loop);
+}
@@ -0,0 +1,53 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef PROMETHEUS_H
+#define PROMETHEUS_H
+
+#include "mtr.h"
+#include "net.h"
+#include "event.h"
+
+/*  The scrapes which may be served at once  */
+#define PROMETHEUS_CLIENTS 4
+
+/*  The longest a scrape may take, from connection to reply, in msec  */
+#define PROMETHEUS_TIMEOUT 1000
+
+/*  The timer of the watching event loop, set for the soonest timeout  */
+#define PROMETHEUS_TIMER (EVENT_MAX_TIMERS - 1)
+
+extern void prometheus_open(
+    const char *address);
+extern void prometheus_close(
+    void);
+extern void prometheus_add_target(
+    const char *name,
+    struct net_session *net);
+extern void prometheus_remove_target(
+    struct net_session *net);
+extern int prometheus_add_fds(
+    struct event_loop *loop);
+extern void prometheus_remove_fds(
+    struct event_loop *loop);
+extern void prometheus_handle(
+    struct mtr_ctl *ctl,
+    struct event_loop *loop,
+    int first);
+
+#endif
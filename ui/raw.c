@@ -21,8 +21,11 @@
 #include "config.h"
 
 #include <ctype.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -32,15 +35,106 @@
 #include "raw.h"
 #include "net.h"
 #include "dns.h"
+#include "event.h"
+#include "addrtab.h"
+
+/*
+    Raw output is buffered, and written once each pass of the event
+    loop, or with --raw-flush, no more often than that interval, rather
+    than with a write for every probe and every reply.
+*/
+#define RAW_BUFFER_SIZE 65536
+
+static long long raw_flushed;
+
+
+void raw_open(
+    struct mtr_ctl *ctl)
+{
+    static int opened;
+
+    /*  With -F, the output of each hostname follows the last  */
+    if (opened)
+        return;
+    opened = 1;
+
+    setvbuf(stdout, NULL, _IOFBF, RAW_BUFFER_SIZE);
+    if (ctl->raw_binary)
+        fwrite(RAW_BINARY_MAGIC, 8, 1, stdout);
+    raw_flushed = event_now();
+}
+
+
+void raw_close(
+    void)
+{
+    fflush(stdout);
+}
+
+
+/*  Write out what is buffered, if it is time to  */
+void raw_flush(
+    struct mtr_ctl *ctl)
+{
+    long long now = event_now();
+
+    if (now - raw_flushed < ctl->raw_flush * 1000LL)
+        return;
+
+    fflush(stdout);
+    raw_flushed = now;
+}
+
+
+static void put_number(
+    unsigned char *at,
+    uint64_t value,
+    int bytes)
+{
+    while (bytes--) {
+        at[bytes] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+
+/*  Write a record of the binary format  */
+static void raw_record(
+    struct mtr_ctl *ctl,
+    int type,
+    int host,
+    int seq,
+    int usec,
+    ip_t * addr)
+{
+    unsigned char record[RAW_RECORD_SIZE];
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    memset(record, 0, sizeof(record));
+    record[0] = type;
+    record[1] = ctl->af == AF_INET ? 4 : 6;
+    put_number(record + 2, host, 2);
+    put_number(record + 4, seq, 4);
+    put_number(record + 8, usec, 4);
+    put_number(record + 12,
+               (uint64_t) now.tv_sec * 1000000 + now.tv_usec, 8);
+    addrcpy((void *) (record + 20), (void *) addr, ctl->af);
+    fwrite(record, sizeof(record), 1, stdout);
+}
 
 
 /* Log an echo request, or a "ping" */
 void raw_rawxmit(
+    struct mtr_ctl *ctl,
     int host,
     int seq)
 {
+    if (ctl->raw_binary) {
+        raw_record(ctl, 'x', host, seq, 0, net_addr(ctl->net, host));
+        return;
+    }
     printf("x %d %d\n", host, seq);
-    fflush(stdout);
 }
 
 /* Log an echo reply, or a "pong" */
@@ -53,23 +147,30 @@ void raw_rawping(
     static int havename[MaxHost];
     char *name;
 
+    if (ctl->raw_binary) {
+        raw_record(ctl, 'p', host, seq, msec, net_addr(ctl->net, host));
+        return;
+    }
+
     if (ctl->dns && !havename[host]) {
-        name = dns_lookup2(ctl, net_addr(host));
+        name = dns_lookup2(ctl, net_addr_id(ctl->net, host));
         if (name) {
             havename[host]++;
             printf("d %d %s\n", host, name);
         }
     }
     printf("p %d %d %d\n", host, msec, seq);
-    fflush(stdout);
 }
 
 
 void raw_rawhost(
     struct mtr_ctl *ctl,
     int host,
-    ip_t * ip_addr)
+    int addr_id)
 {
-    printf("h %d %s\n", host, strlongip(ctl, ip_addr));
-    fflush(stdout);
+    if (ctl->raw_binary) {
+        raw_record(ctl, 'h', host, 0, 0, &addr_entry(addr_id)->ip);
+        return;
+    }
+    printf("h %d %s\n", host, addr_text(addr_id));
 }
@@ -18,8 +18,33 @@
     51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
+/*
+    With --raw-binary, the raw output is a header of the 8 bytes of
+    RAW_BINARY_MAGIC, followed by records of RAW_RECORD_SIZE bytes, with
+    integers in network byte order:
+
+        type       1 byte, 'h', 'x' or 'p', as in the text format
+        af         1 byte, 4 or 6, the address family of address
+        host       2 bytes, the hop, counting from 0
+        seq        4 bytes, the token identifying the probe, or 0
+        rtt        4 bytes, the round trip time in usec, or 0
+        time       8 bytes, when the record was made, in usec since 1970
+        address    16 bytes, the hop's address, zero padded
+
+    Names, the 'd' lines of the text format, are left out.
+*/
+#define RAW_BINARY_MAGIC "MTRRAW\0\1"
+#define RAW_RECORD_SIZE 36
+
 /*  Prototypes for raw.c  */
+extern void raw_open(
+    struct mtr_ctl *ctl);
+extern void raw_close(
+    void);
+extern void raw_flush(
+    struct mtr_ctl *ctl);
 extern void raw_rawxmit(
+    struct mtr_ctl *ctl,
     int host,
     int seq);
 extern void raw_rawping(
@@ -30,4 +55,4 @@ extern void raw_rawping(
 extern void raw_rawhost(
     struct mtr_ctl *ctl,
     int host,
-    ip_t * addr);
+    int addr_id);
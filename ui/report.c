@@ -19,13 +19,21 @@
 #include "config.h"
 
 #include <sys/types.h>
+#include <errno.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <string.h>
 #include <strings.h>
 #include <time.h>
+#ifdef HAVE_ERROR_H
+#include <error.h>
+#else
+#include "portability/error.h"
+#endif
 
 #include "mtr.h"
 #include "report.h"
@@ -33,15 +41,16 @@
 #include "dns.h"
 #include "asn.h"
 #include "utils.h"
+#include "addrtab.h"
 
 #define MAXLOADBAL 5
 #define MAX_FORMAT_STR 81
 
 
 void report_open(
-    void)
+    struct mtr_ctl *ctl)
 {
-    const time_t now = time(NULL);
+    const time_t now = ctl->start_time ? ctl->start_time : time(NULL);
     const char *t = iso_time(&now);
 
     printf("Start: %s\n", t);
@@ -51,18 +60,17 @@ static size_t snprint_addr(
     struct mtr_ctl *ctl,
     char *dst,
     size_t dst_len,
-    ip_t * addr)
+    int addr_id)
 {
-    if (addrcmp((void *) addr, (void *) &ctl->unspec_addr, ctl->af)) {
-        struct hostent *host =
-            ctl->dns ? addr2host((void *) addr, ctl->af) : NULL;
-        if (!host)
-            return snprintf(dst, dst_len, "%s", strlongip(ctl, addr));
+    if (addr_id) {
+        char *name = ctl->dns ? dns_lookup_now(ctl, addr_id) : NULL;
+        if (!name)
+            return snprintf(dst, dst_len, "%s", addr_text(addr_id));
         else if (ctl->dns && ctl->show_ips)
-            return snprintf(dst, dst_len, "%s (%s)", host->h_name,
-                            strlongip(ctl, addr));
+            return snprintf(dst, dst_len, "%s (%s)", name,
+                            addr_text(addr_id));
         else
-            return snprintf(dst, dst_len, "%s", host->h_name);
+            return snprintf(dst, dst_len, "%s", name);
     } else
         return snprintf(dst, dst_len, "%s", "???");
 }
@@ -79,13 +87,34 @@ static void print_mpls(
 }
 #endif
 
+/*  The loss and latency of one of the paths of a hop, with --flows  */
+static const char *fmt_path_stats(
+    struct mtr_ctl *ctl,
+    int at,
+    int z,
+    char *buf,
+    size_t len)
+{
+    buf[0] = 0;
+    if (ctl->flows) {
+        snprintf(buf, len, "  (%d sent, %.1f%% loss, %.1f ms)",
+                 net_path_xmit(ctl->net, at, z),
+                 net_path_loss(ctl->net, at, z) / 1000.0,
+                 net_path_avg(ctl->net, at, z) / 1000.0);
+    }
+
+    return buf;
+}
+
 void report_close(
     struct mtr_ctl *ctl)
 {
     int i, j, at, max, z, w;
+    int first;
+    char stats[64];
     struct mplslen *mpls, *mplss;
-    ip_t *addr;
-    ip_t *addr2 = NULL;
+    int addr;
+    int addr2 = 0;
     char name[MAX_FORMAT_STR];
     char buf[1024];
     char fmt[16];
@@ -99,11 +128,11 @@ void report_close(
     if (ctl->reportwide) {
         /* get the longest hostname */
         len_hosts = strlen(ctl->LocalHostname);
-        max = net_max(ctl);
+        max = net_max(ctl, ctl->net);
         at = net_min(ctl);
         for (; at < max; at++) {
             size_t nlen;
-            addr = net_addr(at);
+            addr = net_addr_id(ctl->net, at);
             if ((nlen = snprint_addr(ctl, name, sizeof(name), addr)))
                 if (len_hosts < nlen)
                     len_hosts = nlen;
@@ -137,11 +166,11 @@ void report_close(
     }
     printf("%s\n", buf);
 
-    max = net_max(ctl);
+    max = net_max(ctl, ctl->net);
     at = net_min(ctl);
     for (; at < max; at++) {
-        addr = net_addr(at);
-        mpls = net_mpls(at);
+        addr = net_addr_id(ctl->net, at);
+        mpls = net_mpls(ctl->net, at);
         snprint_addr(ctl, name, sizeof(name), addr);
 
 #ifdef HAVE_IPINFO
@@ -165,10 +194,10 @@ void report_close(
             /* 1000.0 is a temporay hack for stats usec to ms, impacted net_loss. */
             if (strchr(data_fields[j].format, 'f')) {
                 snprintf(buf + len, sizeof(buf), data_fields[j].format,
-                         data_fields[j].net_xxx(at) / 1000.0);
+                         data_fields[j].net_xxx(ctl->net, at) / 1000.0);
             } else {
                 snprintf(buf + len, sizeof(buf), data_fields[j].format,
-                         data_fields[j].net_xxx(at));
+                         data_fields[j].net_xxx(ctl->net, at));
             }
             len += data_fields[j].length;
         }
@@ -176,20 +205,21 @@ void report_close(
 
         /* This feature shows 'loadbalances' on routes */
 
-        /* z is starting at 1 because addrs[0] is the same that addr */
-        for (z = 1; z < MAXPATH; z++) {
+        /*
+           z is starting at 1 because addrs[0] is the same that addr,
+           unless each path has its own results, with --flows
+         */
+        first = ctl->flows && net_path_count(ctl->net, at) > 1 ? 0 : 1;
+        for (z = first; z < net_path_count(ctl->net, at); z++) {
             int found = 0;
-            addr2 = net_addrs(at, z);
-            mplss = net_mplss(at, z);
-            if ((addrcmp
-                 ((void *) &ctl->unspec_addr, (void *) addr2,
-                  ctl->af)) == 0)
+            int k;
+            addr2 = net_addrs_id(ctl->net, at, z);
+            mplss = net_mplss(ctl->net, at, z);
+            if (addr2 == 0)
                 break;
             for (w = 0; w < z; w++)
                 /* Ok... checking if there are ips repeated on same hop */
-                if ((addrcmp
-                     ((void *) addr2, (void *) net_addrs(at, w),
-                      ctl->af)) == 0) {
+                if (addr2 == net_addrs_id(ctl->net, at, w)) {
                     found = 1;
                     break;
                 }
@@ -198,16 +228,22 @@ void report_close(
 
 #ifdef HAVE_IPINFO
                 if (is_printii(ctl)) {
-                    if (mpls->labels && z == 1 && ctl->enablempls)
+                    if (mpls->labels && z == first && ctl->enablempls)
                         print_mpls(mpls);
                     snprint_addr(ctl, name, sizeof(name), addr2);
-                    printf("     %s%s\n", fmt_ipinfo(ctl, addr2), name);
+                    printf("     %s%s%s\n", fmt_ipinfo(ctl, addr2), name,
+                           fmt_path_stats(ctl, at, z, stats,
+                                          sizeof(stats)));
                     if (ctl->enablempls)
                         print_mpls(mplss);
+                    continue;
                 }
-#else
-                int k;
-                if (mpls->labels && z == 1 && ctl->enablempls) {
+
+                /*  Without -z, only the paths of --flows are shown  */
+                if (!ctl->flows)
+                    continue;
+#endif
+                if (mpls->labels && z == first && ctl->enablempls) {
                     for (k = 0; k < mpls->labels; k++) {
                         printf
                             ("    |  |+-- [MPLS: Lbl %lu Exp %u S %u TTL %u]\n",
@@ -216,8 +252,10 @@ void report_close(
                     }
                 }
 
-                if (z == 1) {
-                    printf("    |  `|-- %s\n", strlongip(ctl, addr2));
+                if (z == first) {
+                    printf("    |  `|-- %s%s\n", addr_text(addr2),
+                           fmt_path_stats(ctl, at, z, stats,
+                                          sizeof(stats)));
                     for (k = 0; k < mplss->labels && ctl->enablempls; k++) {
                         printf
                             ("    |   +-- [MPLS: Lbl %lu Exp %u S %u TTL %u]\n",
@@ -225,7 +263,9 @@ void report_close(
                              mplss->ttl[k]);
                     }
                 } else {
-                    printf("    |   |-- %s\n", strlongip(ctl, addr2));
+                    printf("    |   |-- %s%s\n", addr_text(addr2),
+                           fmt_path_stats(ctl, at, z, stats,
+                                          sizeof(stats)));
                     for (k = 0; k < mplss->labels && ctl->enablempls; k++) {
                         printf
                             ("    |   +-- [MPLS: Lbl %lu Exp %u S %u TTL %u]\n",
@@ -233,7 +273,6 @@ void report_close(
                              mplss->ttl[k]);
                     }
                 }
-#endif
             }
         }
 
@@ -280,7 +319,7 @@ void json_close(
     struct mtr_ctl *ctl)
 {
     int i, j, at, first, max;
-    ip_t *addr;
+    int addr;
     char name[MAX_FORMAT_STR];
 
     printf("{\n");
@@ -306,10 +345,10 @@ void json_close(
 
     printf("    \"hubs\": [");
 
-    max = net_max(ctl);
+    max = net_max(ctl, ctl->net);
     at = first = net_min(ctl);
     for (; at < max; at++) {
-        addr = net_addr(at);
+        addr = net_addr_id(ctl->net, at);
         snprint_addr(ctl, name, sizeof(name), addr);
 
         if (at == first) {
@@ -357,10 +396,11 @@ void json_close(
                 /* 1000.0 is a temporay hack for stats usec to ms, impacted net_loss. */
                 printf(name,
                        data_fields[j].title,
-                       data_fields[j].net_xxx(at) / 1000.0);
+                       data_fields[j].net_xxx(ctl->net, at) / 1000.0);
             } else {
                 printf(name,
-                       data_fields[j].title, data_fields[j].net_xxx(at));
+                       data_fields[j].title,
+                       data_fields[j].net_xxx(ctl->net, at));
             }
         }
         if (at + 1 == max) {
@@ -386,7 +426,7 @@ void xml_close(
     struct mtr_ctl *ctl)
 {
     int i, j, at, max;
-    ip_t *addr;
+    int addr;
     char name[MAX_FORMAT_STR];
 
     printf("<?xml version=\"1.0\"?>\n");
@@ -406,10 +446,10 @@ void xml_close(
     }
     printf(" TESTS=\"%d\">\n", ctl->MaxPing);
 
-    max = net_max(ctl);
+    max = net_max(ctl, ctl->net);
     at = net_min(ctl);
     for (; at < max; at++) {
-        addr = net_addr(at);
+        addr = net_addr_id(ctl->net, at);
         snprint_addr(ctl, name, sizeof(name), addr);
 
         printf("    <HUB COUNT=\"%d\" HOST=\"%s\">\n", at + 1, name);
@@ -431,10 +471,11 @@ void xml_close(
 
             /* 1000.0 is a temporay hack for stats usec to ms, impacted net_loss. */
             if (strchr(data_fields[j].format, 'f')) {
-                printf(name,
-                       title, data_fields[j].net_xxx(at) / 1000.0, title);
+                printf(name, title,
+                       data_fields[j].net_xxx(ctl->net, at) / 1000.0, title);
             } else {
-                printf(name, title, data_fields[j].net_xxx(at), title);
+                printf(name, title,
+                       data_fields[j].net_xxx(ctl->net, at), title);
             }
         }
         printf("    </HUB>\n");
@@ -453,7 +494,7 @@ void csv_close(
     time_t now)
 {
     int i, j, at, max;
-    ip_t *addr;
+    int addr;
     char name[MAX_FORMAT_STR];
 
     for (i = 0; i < MAXFLD; i++) {
@@ -462,10 +503,10 @@ void csv_close(
             continue;
     }
 
-    max = net_max(ctl);
+    max = net_max(ctl, ctl->net);
     at = net_min(ctl);
     for (; at < max; at++) {
-        addr = net_addr(at);
+        addr = net_addr_id(ctl->net, at);
         snprint_addr(ctl, name, sizeof(name), addr);
 
         if (at == net_min(ctl)) {
@@ -503,11 +544,174 @@ void csv_close(
             /* 1000.0 is a temporay hack for stats usec to ms, impacted net_loss. */
             if (strchr(data_fields[j].format, 'f')) {
                 printf(",%.2f",
-                       (double) (data_fields[j].net_xxx(at) / 1000.0));
+                       (double) (data_fields[j].net_xxx(ctl->net, at) /
+                                 1000.0));
             } else {
-                printf(",%d", data_fields[j].net_xxx(at));
+                printf(",%d", data_fields[j].net_xxx(ctl->net, at));
             }
         }
         printf("\n");
     }
 }
+
+
+/*
+    Streamed output, with --ndjson: a line of JSON for each hop, after
+    every --ndjson-cycles cycles of probes, for as long as mtr runs.
+    Each batch of lines is gathered in one buffer, and written with a
+    single write, so that a reader never sees part of a line.
+*/
+static char *ndjson_buffer;
+static size_t ndjson_size;
+static size_t ndjson_max;
+static unsigned long ndjson_changed[MaxHost];   /* of each hop, as written */
+static int ndjson_cycle_count;
+
+
+static void ndjson_append(
+    const char *format,
+    ...)
+{
+    va_list args;
+    int len;
+
+    while (1) {
+        va_start(args, format);
+        len = vsnprintf(ndjson_buffer + ndjson_size,
+                        ndjson_max - ndjson_size, format, args);
+        va_end(args);
+
+        if (len >= 0 && ndjson_size + len < ndjson_max) {
+            ndjson_size += len;
+            return;
+        }
+
+        ndjson_max = ndjson_max ? 2 * ndjson_max : 4096;
+        ndjson_buffer = realloc(ndjson_buffer, ndjson_max);
+        if (ndjson_buffer == NULL) {
+            error(EXIT_FAILURE, errno, "memory allocation failure");
+        }
+    }
+}
+
+
+/*  Append a string value, quoted and escaped as JSON requires  */
+static void ndjson_append_string(
+    const char *value)
+{
+    ndjson_append("\"");
+    for (; *value; value++) {
+        if (*value == '\\' || *value == '"') {
+            ndjson_append("\\%c", *value);
+        } else if ((unsigned char) *value < 0x20) {
+            ndjson_append("\\u%04x", (unsigned char) *value);
+        } else {
+            ndjson_append("%c", *value);
+        }
+    }
+    ndjson_append("\"");
+}
+
+
+/*  Write a line for each hop, or with --ndjson-changes, each changed  */
+static void ndjson_write(
+    struct mtr_ctl *ctl,
+    int final)
+{
+    int i, j, at, max;
+    int addr;
+    const char *name;
+    time_t now = time(NULL);
+
+    ndjson_size = 0;
+    max = net_max(ctl, ctl->net);
+    for (at = net_min(ctl); at < max; at++) {
+        if (ctl->ndjson_changes
+            && net_hop_changed(ctl->net, at) == ndjson_changed[at]) {
+            continue;
+        }
+        ndjson_changed[at] = net_hop_changed(ctl->net, at);
+
+        addr = net_addr_id(ctl->net, at);
+        name = NULL;
+        if (addr) {
+            /*  Not waiting on a name, which will be given once found  */
+            if (ctl->dns)
+                name = dns_lookup(ctl, addr);
+            if (!name)
+                name = addr_text(addr);
+        } else {
+            name = "???";
+        }
+
+        ndjson_append("{\"time\":%lld,\"cycle\":%d,%s\"src\":",
+                      (long long) now, ndjson_cycle_count,
+                      final ? "\"final\":true," : "");
+        ndjson_append_string(ctl->LocalHostname);
+        ndjson_append(",\"dst\":");
+        ndjson_append_string(ctl->Hostname);
+        ndjson_append(",\"count\":%d,\"host\":", at + 1);
+        ndjson_append_string(name);
+#ifdef HAVE_IPINFO
+        if (!ctl->ipinfo_no) {
+            char *fmtinfo = fmt_ipinfo(ctl, addr);
+            if (fmtinfo != NULL)
+                fmtinfo = trim(fmtinfo, '\0');
+            ndjson_append(",\"ASN\":");
+            ndjson_append_string(fmtinfo ? fmtinfo : "");
+        }
+#endif
+        for (i = 0; i < MAXFLD; i++) {
+            j = ctl->fld_index[ctl->fld_active[i]];
+            if (j <= 0)
+                continue;
+
+            /* 1000.0 is a temporay hack for stats usec to ms, impacted net_loss. */
+            if (strchr(data_fields[j].format, 'f')) {
+                ndjson_append(",\"%s\":%.2f", data_fields[j].title,
+                              data_fields[j].net_xxx(ctl->net, at) /
+                              1000.0);
+            } else {
+                ndjson_append(",\"%s\":%d", data_fields[j].title,
+                              data_fields[j].net_xxx(ctl->net, at));
+            }
+        }
+        ndjson_append("}\n");
+    }
+
+    if (ndjson_size) {
+        fwrite(ndjson_buffer, ndjson_size, 1, stdout);
+        fflush(stdout);
+    }
+}
+
+
+void ndjson_open(
+    void)
+{
+    int at;
+
+    /*  Each target's hops start afresh  */
+    ndjson_cycle_count = 0;
+    for (at = 0; at < MaxHost; at++) {
+        ndjson_changed[at] = 0;
+    }
+}
+
+
+void ndjson_cycle(
+    struct mtr_ctl *ctl,
+    int cycle)
+{
+    ndjson_cycle_count = cycle;
+    if (cycle % ctl->ndjson_cycles == 0)
+        ndjson_write(ctl, 0);
+}
+
+
+/*  The last line of each hop includes the replies of the grace period  */
+void ndjson_close(
+    struct mtr_ctl *ctl)
+{
+    ndjson_write(ctl, 1);
+}
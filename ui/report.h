@@ -19,7 +19,7 @@
 /*  Prototypes for report.h  */
 
 extern void report_open(
-    void);
+    struct mtr_ctl *ctl);
 extern void report_close(
     struct mtr_ctl *ctl);
 extern void txt_open(
@@ -36,6 +36,13 @@ extern void xml_close(
     struct mtr_ctl *ctl);
 extern void csv_open(
     void);
+extern void ndjson_open(
+    void);
+extern void ndjson_cycle(
+    struct mtr_ctl *ctl,
+    int cycle);
+extern void ndjson_close(
+    struct mtr_ctl *ctl);
 extern void csv_close(
     struct mtr_ctl *ctl,
     time_t now);
@@ -24,7 +24,6 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <time.h>
-#include <sys/select.h>
 #include <string.h>
 #include <math.h>
 #include <errno.h>
@@ -39,186 +38,228 @@
 #include "net.h"
 #include "asn.h"
 #include "display.h"
+#include "event.h"
+#include "prometheus.h"
+#include "shmstats.h"
 #include "select.h"
 
-void select_loop(
-    struct mtr_ctl *ctl)
+/*  The timers of select_loop's event loop  */
+enum {
+    TIMER_PROBE,
+    TIMER_GRACE,
+    TIMER_REDRAW
+};
+
+/*  The shortest time between redraws prompted by replies, in usec  */
+#define REDRAW_INTERVAL 100000
+
+/*  The most probes/sec with --pipeline, and the burst allowed  */
+#define PIPELINE_RATE 1000
+#define PIPELINE_BUCKET 10
+
+/*  A token bucket, for the probes of a pipeline  */
+struct token_bucket {
+    double tokens;
+    long long refilled;
+};
+
+
+/*
+    The deadline for the probe following one due at a given time.
+    Deadlines advance by whole intervals, so that the time spent
+    sending doesn't accumulate as drift, but a schedule which has
+    fallen behind, as after a pause, restarts from now rather than
+    sending a burst to catch up.  The GTK frontend shares this.
+*/
+long long select_next_probe(
+    struct mtr_ctl *ctl,
+    long long deadline,
+    long long now)
 {
-    fd_set readfd;
-    fd_set writefd;
-    int anyset = 0;
-    int maxfd = 0;
-    int dnsfd, netfd;
-#ifdef ENABLE_IPV6
-    int dnsfd6;
-#endif
-    int NumPing = 0;
-    int paused = 0;
-    struct timeval lasttime, thistime, selecttime;
-    struct timeval startgrace;
-    int dt;
-    int rv;
-    int graceperiod = 0;
-    struct timeval intervaltime;
-    static double dnsinterval = 0;
+    deadline += calc_deltatime(ctl->net, ctl->WaitTime);
+    if (deadline < now) {
+        deadline = now;
+    }
 
-    memset(&startgrace, 0, sizeof(startgrace));
+    return deadline;
+}
 
-    gettimeofday(&lasttime, NULL);
 
-    while (1) {
-        dt = calc_deltatime(ctl->WaitTime);
-        intervaltime.tv_sec = dt / 1000000;
-        intervaltime.tv_usec = dt % 1000000;
+/*
+    Take a token from a bucket.  Returns 0 if there was one, or the
+    time at which the next will be available if not.
+*/
+static long long take_token(
+    struct token_bucket *bucket,
+    long long now)
+{
+    bucket->tokens +=
+        (double) (now - bucket->refilled) * PIPELINE_RATE / 1000000;
+    bucket->refilled = now;
+    if (bucket->tokens > PIPELINE_BUCKET) {
+        bucket->tokens = PIPELINE_BUCKET;
+    }
 
-        FD_ZERO(&readfd);
-        FD_ZERO(&writefd);
+    if (bucket->tokens >= 1) {
+        bucket->tokens -= 1;
+        return 0;
+    }
 
-        maxfd = 0;
+    return now + 1 + (1 - bucket->tokens) * 1000000 / PIPELINE_RATE;
+}
 
-        if (ctl->Interactive) {
-            FD_SET(0, &readfd);
-            maxfd = 1;
-        }
+
+/*  Arm the redraw timer, no sooner than an interval after the last  */
+static void request_redraw(
+    struct event_loop *loop,
+    long long last_redraw,
+    long long now)
+{
+    long long deadline = last_redraw + REDRAW_INTERVAL;
+
+    if (loop->deadline[TIMER_REDRAW]) {
+        return;
+    }
+    if (deadline < now) {
+        deadline = now;
+    }
+    event_set_timer(loop, TIMER_REDRAW, deadline);
+}
+
+
+void select_loop(
+    struct mtr_ctl *ctl)
+{
+    struct event_loop loop;
+    int keyfd = -1;
+    int netfd;
+    int dnsfd = -1;
 #ifdef ENABLE_IPV6
-        if (ctl->dns) {
-            dnsfd6 = dns_waitfd6();
-            if (dnsfd6 >= 0) {
-                FD_SET(dnsfd6, &readfd);
-                if (dnsfd6 >= maxfd)
-                    maxfd = dnsfd6 + 1;
-            } else {
-                dnsfd6 = 0;
-            }
-        } else
-            dnsfd6 = 0;
+    int dnsfd6 = -1;
 #endif
-        if (ctl->dns) {
-            dnsfd = dns_waitfd();
-            FD_SET(dnsfd, &readfd);
-            if (dnsfd >= maxfd)
-                maxfd = dnsfd + 1;
-        } else
-            dnsfd = 0;
-
-        netfd = net_waitfd();
-        FD_SET(netfd, &readfd);
-        if (netfd >= maxfd)
-            maxfd = netfd + 1;
-
-        do {
-            if (anyset || paused) {
-                /* Set timeout to 0.1s.
-                 * While this is almost instantaneous for human operators,
-                 * it's slow enough for computers to go do something else;
-                 * this prevents mtr from hogging 100% CPU time on one core.
-                 */
-                selecttime.tv_sec = 0;
-                selecttime.tv_usec = paused ? 100000 : 0;
-
-                rv = select(maxfd, (void *) &readfd, &writefd, NULL,
-                            &selecttime);
+#ifdef HAVE_IPINFO
+    int asnfd = -1;
+#endif
+    int promfd = -1;
+    int NumPing = 0;
+    int paused = 0;
+    long long now, next_probe, token_at, last_redraw = 0;
+    struct token_bucket bucket;
 
-            } else {
-                if (ctl->Interactive)
-                    display_redraw(ctl);
-
-                gettimeofday(&thistime, NULL);
-
-                if (thistime.tv_sec > lasttime.tv_sec + intervaltime.tv_sec
-                    || (thistime.tv_sec ==
-                        lasttime.tv_sec + intervaltime.tv_sec
-                        && thistime.tv_usec >=
-                        lasttime.tv_usec + intervaltime.tv_usec)) {
-                    lasttime = thistime;
-
-                    if (!graceperiod) {
-                        if (NumPing >= ctl->MaxPing
-                            && (!ctl->Interactive || ctl->ForceMaxPing)) {
-                            graceperiod = 1;
-                            startgrace = thistime;
-                        }
-
-                        /* do not send out batch when we've already initiated grace period */
-                        if (!graceperiod && net_send_batch(ctl))
-                            NumPing++;
-                    }
-                }
+    event_loop_init(&loop);
+    if (ctl->Interactive)
+        keyfd = event_add_fd(&loop, 0);
+    netfd = event_add_fd(&loop, net_waitfd());
+    if (ctl->dns) {
+        dnsfd = event_add_fd(&loop, dns_waitfd());
+#ifdef ENABLE_IPV6
+        if (dns_waitfd6() >= 0)
+            dnsfd6 = event_add_fd(&loop, dns_waitfd6());
+#endif
+    }
+#ifdef HAVE_IPINFO
+    if (asn_waitfd() >= 0)
+        asnfd = event_add_fd(&loop, asn_waitfd());
+#endif
+    if (ctl->prometheus)
+        promfd = prometheus_add_fds(&loop);
 
-                if (graceperiod) {
-                    dt = (thistime.tv_usec - startgrace.tv_usec) +
-                        1000000 * (thistime.tv_sec - startgrace.tv_sec);
-                    if ((ctl->GraceTime * 1000 * 1000) < dt)
-                        return;
-                }
+    now = event_now();
+    bucket.tokens = PIPELINE_BUCKET;
+    bucket.refilled = now;
+    next_probe = select_next_probe(ctl, now, now);
+    event_set_timer(&loop, TIMER_PROBE, next_probe);
+    if (ctl->Interactive)
+        event_set_timer(&loop, TIMER_REDRAW, now);
 
-                selecttime.tv_usec = (thistime.tv_usec - lasttime.tv_usec);
-                selecttime.tv_sec = (thistime.tv_sec - lasttime.tv_sec);
-                if (selecttime.tv_usec < 0) {
-                    --selecttime.tv_sec;
-                    selecttime.tv_usec += 1000000;
-                }
-                selecttime.tv_usec =
-                    intervaltime.tv_usec - selecttime.tv_usec;
-                selecttime.tv_sec =
-                    intervaltime.tv_sec - selecttime.tv_sec;
-                if (selecttime.tv_usec < 0) {
-                    --selecttime.tv_sec;
-                    selecttime.tv_usec += 1000000;
-                }
+    while (1) {
+        event_wait(&loop);
+        now = event_now();
 
-                if (ctl->dns) {
-                    if ((selecttime.tv_sec > (time_t) dnsinterval) ||
-                        ((selecttime.tv_sec == (time_t) dnsinterval) &&
-                         (selecttime.tv_usec >
-                          ((time_t) (dnsinterval * 1000000) % 1000000)))) {
-                        selecttime.tv_sec = (time_t) dnsinterval;
-                        selecttime.tv_usec =
-                            (time_t) (dnsinterval * 1000000) % 1000000;
-                    }
+        if (event_timer_expired(&loop, TIMER_PROBE, now)) {
+            if (NumPing >= ctl->MaxPing
+                && (!ctl->Interactive || ctl->ForceMaxPing)) {
+                /*  Wait for the last replies, sending no more probes  */
+                event_set_timer(&loop, TIMER_GRACE,
+                                now + ctl->GraceTime * 1000000);
+            } else if (ctl->pipeline && net_pipeline_full(ctl->net)) {
+                /*  Wait for replies, or timeouts, to make room  */
+                next_probe = select_next_probe(ctl, now, now);
+                event_set_timer(&loop, TIMER_PROBE, next_probe);
+            } else if (ctl->pipeline
+                       && (token_at = take_token(&bucket, now))) {
+                event_set_timer(&loop, TIMER_PROBE, token_at);
+            } else {
+                if (net_send_batch(ctl, ctl->net)) {
+                    NumPing++;
+                    display_cycle(ctl, NumPing);
                 }
-
-                rv = select(maxfd, (void *) &readfd, NULL, NULL,
-                            &selecttime);
+                next_probe = select_next_probe(ctl, next_probe, now);
+                event_set_timer(&loop, TIMER_PROBE, next_probe);
+                if (ctl->Interactive)
+                    request_redraw(&loop, last_redraw, now);
             }
-        } while ((rv < 0) && (errno == EINTR));
+        }
 
-        if (rv < 0) {
-            error(EXIT_FAILURE, errno, "Select failed");
+        if (event_timer_expired(&loop, TIMER_GRACE, now)) {
+            break;
         }
-        anyset = 0;
 
         /*  Have we got new packets back?  */
-        if (FD_ISSET(netfd, &readfd)) {
+        if (loop.fd_ready[netfd]) {
             net_process_return(ctl);
-            anyset = 1;
+            if (ctl->Interactive)
+                request_redraw(&loop, last_redraw, now);
         }
 
-        if (ctl->dns) {
-            /* Handle any pending resolver events */
-            dnsinterval = ctl->WaitTime;
+        /*  There's no need to wait once every probe is answered  */
+        if (loop.deadline[TIMER_GRACE] && !net_in_flight(ctl->net)) {
+            break;
         }
 
         /*  Have we finished a nameservice lookup?  */
 #ifdef ENABLE_IPV6
-        if (ctl->dns && dnsfd6 && FD_ISSET(dnsfd6, &readfd)) {
+        if (dnsfd6 >= 0 && loop.fd_ready[dnsfd6]) {
             dns_ack6();
-            anyset = 1;
+            if (ctl->Interactive) {
+                display_invalidate(ctl);
+                request_redraw(&loop, last_redraw, now);
+            }
         }
 #endif
-        if (ctl->dns && dnsfd && FD_ISSET(dnsfd, &readfd)) {
+        if (dnsfd >= 0 && loop.fd_ready[dnsfd]) {
             dns_ack(ctl);
-            anyset = 1;
+            if (ctl->Interactive) {
+                /*  Names are shown in place of addresses as they resolve  */
+                display_invalidate(ctl);
+                request_redraw(&loop, last_redraw, now);
+            }
+        }
+#ifdef HAVE_IPINFO
+        if (asnfd >= 0 && loop.fd_ready[asnfd]) {
+            asn_ack(ctl);
+            if (ctl->Interactive) {
+                display_invalidate(ctl);
+                request_redraw(&loop, last_redraw, now);
+            }
         }
+#endif
+
+        /*  Has a scrape arrived?  */
+        if (promfd >= 0)
+            prometheus_handle(ctl, &loop, promfd);
 
         /*  Has a key been pressed?  */
-        if (FD_ISSET(0, &readfd)) {
+        if (keyfd >= 0 && loop.fd_ready[keyfd]) {
             switch (display_keyaction(ctl)) {
             case ActionQuit:
+                if (promfd >= 0)
+                    prometheus_remove_fds(&loop);
+                event_loop_close(&loop);
                 return;
                 break;
             case ActionReset:
-                net_reset(ctl);
+                net_reset(ctl, ctl->net);
                 break;
             case ActionDisplay:
                 ctl->display_mode =
@@ -229,8 +270,13 @@ void select_loop(
                 break;
             case ActionPause:
                 paused = 1;
+                event_set_timer(&loop, TIMER_PROBE, 0);
                 break;
             case ActionResume:
+                if (paused) {
+                    next_probe = now;
+                    event_set_timer(&loop, TIMER_PROBE, next_probe);
+                }
                 paused = 0;
                 break;
             case ActionMPLS:
@@ -264,8 +310,101 @@ void select_loop(
                 }
                 break;
             }
-            anyset = 1;
+
+            /*  Show the effect of a key at once  */
+            event_set_timer(&loop, TIMER_REDRAW, now);
+        }
+
+        if (event_timer_expired(&loop, TIMER_REDRAW, now)) {
+            display_redraw(ctl);
+            last_redraw = now;
+        }
+
+        display_flush(ctl);
+        if (ctl->shm_stats)
+            shmstats_publish(ctl, NumPing);
+    }
+
+    if (ctl->shm_stats)
+        shmstats_publish(ctl, NumPing);
+    if (promfd >= 0)
+        prometheus_remove_fds(&loop);
+    event_loop_close(&loop);
+}
+
+
+/*
+    Wait, until no later than a deadline from event_now(), for replies
+    from mtr-packet and answers from the resolver, and handle those
+    which arrive.  Unlike select_loop, this leaves the sending of probes
+    to the caller, which is how many targets share one schedule.
+*/
+void select_events(
+    struct mtr_ctl *ctl,
+    long long deadline)
+{
+    static struct event_loop loop;
+    static int initialized;
+    static int netfd[MAX_AGENTS];
+    static int netfd_count;
+    static int dnsfd = -1;
+#ifdef ENABLE_IPV6
+    static int dnsfd6 = -1;
+#endif
+#ifdef HAVE_IPINFO
+    static int asnfd = -1;
+#endif
+    static int promfd = -1;
+    int fds[MAX_AGENTS];
+    int i;
+
+    if (!initialized) {
+        event_loop_init(&loop);
+        netfd_count = net_waitfds(fds);
+        for (i = 0; i < netfd_count; i++) {
+            netfd[i] = event_add_fd(&loop, fds[i]);
+        }
+        if (ctl->dns) {
+            dnsfd = event_add_fd(&loop, dns_waitfd());
+#ifdef ENABLE_IPV6
+            if (dns_waitfd6() >= 0)
+                dnsfd6 = event_add_fd(&loop, dns_waitfd6());
+#endif
+        }
+#ifdef HAVE_IPINFO
+        if (asn_waitfd() >= 0)
+            asnfd = event_add_fd(&loop, asn_waitfd());
+#endif
+        if (ctl->prometheus)
+            promfd = prometheus_add_fds(&loop);
+        initialized = 1;
+    }
+
+    event_set_timer(&loop, 0, deadline);
+    event_wait(&loop);
+    event_set_timer(&loop, 0, 0);
+
+    /*  Replies from any of the agents are read from all of them  */
+    for (i = 0; i < netfd_count; i++) {
+        if (loop.fd_ready[netfd[i]]) {
+            net_process_return(ctl);
+            break;
         }
     }
-    return;
+#ifdef ENABLE_IPV6
+    if (dnsfd6 >= 0 && loop.fd_ready[dnsfd6]) {
+        dns_ack6();
+    }
+#endif
+    if (dnsfd >= 0 && loop.fd_ready[dnsfd]) {
+        dns_ack(ctl);
+    }
+#ifdef HAVE_IPINFO
+    if (asnfd >= 0 && loop.fd_ready[asnfd]) {
+        asn_ack(ctl);
+    }
+#endif
+    if (promfd >= 0) {
+        prometheus_handle(ctl, &loop, promfd);
+    }
 }
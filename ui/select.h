@@ -18,3 +18,10 @@
 
 extern void select_loop(
     struct mtr_ctl *ctl);
+extern void select_events(
+    struct mtr_ctl *ctl,
+    long long deadline);
+extern long long select_next_probe(
+    struct mtr_ctl *ctl,
+    long long deadline,
+    long long now);
@@ -0,0 +1,244 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_ERROR_H
+#include <error.h>
+#else
+#include "portability/error.h"
+#endif
+
+#include "mtr.h"
+#include "net.h"
+#include "shmstats.h"
+#include "utils.h"
+
+/*
+    Hops are published only as their statistics change, by the change
+    stamps of net_hop_changed(), once each pass of the event loop, so
+    that a burst of replies costs readers a single retry.
+*/
+
+static volatile struct shmstats_header *header;
+static volatile struct shmstats_hop *hops;
+static size_t map_size;
+static struct net_session *published_net;
+static unsigned long published[MaxHost];        /* of each hop, as published */
+
+
+/*  Order the writes before, and those after, a change of seq  */
+static void write_barrier(
+    void)
+{
+    __sync_synchronize();
+}
+
+
+static void begin_write(
+    volatile uint32_t * seq)
+{
+    (*seq)++;
+    write_barrier();
+}
+
+
+static void end_write(
+    volatile uint32_t * seq)
+{
+    write_barrier();
+    (*seq)++;
+}
+
+
+static int64_t now_usec(
+    void)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (int64_t) now.tv_sec * 1000000 + now.tv_usec;
+}
+
+
+void shmstats_open(
+    const char *filename)
+{
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+    void *map;
+    int fd;
+
+    map_size = sizeof(struct shmstats_header) +
+        MaxHost * sizeof(struct shmstats_hop);
+
+    fd = open(filename, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        error(EXIT_FAILURE, errno, "%s", filename);
+    }
+
+    /*  Readers of a file left by an earlier run see it emptied first  */
+    if (ftruncate(fd, 0) || ftruncate(fd, map_size)) {
+        error(EXIT_FAILURE, errno, "%s", filename);
+    }
+
+    map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        error(EXIT_FAILURE, errno, "%s", filename);
+    }
+    close(fd);
+
+    header = map;
+    hops = (void *) ((char *) map + sizeof(struct shmstats_header));
+
+    begin_write(&header->seq);
+    header->version = SHMSTATS_VERSION;
+    header->header_size = sizeof(struct shmstats_header);
+    header->hop_size = sizeof(struct shmstats_hop);
+    header->hop_max = MaxHost;
+    header->pid = getpid();
+    end_write(&header->seq);
+
+    /*  The magic marks the file as ready to read  */
+    write_barrier();
+    memcpy((void *) header->magic, SHMSTATS_MAGIC, sizeof(header->magic));
+#else
+    error(EXIT_FAILURE, 0, "--shm-stats %s: not supported on this system",
+          filename);
+#endif
+}
+
+
+void shmstats_close(
+    void)
+{
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+    if (header) {
+        munmap((void *) header, map_size);
+    }
+#endif
+    header = NULL;
+    hops = NULL;
+}
+
+
+/*  Start publishing the statistics of a new trace  */
+void shmstats_session(
+    struct mtr_ctl *ctl)
+{
+    int at;
+
+    if (!header)
+        return;
+
+    begin_write(&header->seq);
+    header->af = ctl->af;
+    header->first = net_min(ctl);
+    header->last = header->first;
+    header->cycles = 0;
+    header->started = now_usec();
+    header->updated = header->started;
+    xstrncpy((char *) header->target, ctl->Hostname,
+             sizeof(header->target));
+    end_write(&header->seq);
+
+    for (at = 0; at < MaxHost; at++) {
+        begin_write(&hops[at].seq);
+        memset((char *) &hops[at] + sizeof(uint32_t), 0,
+               sizeof(struct shmstats_hop) - sizeof(uint32_t));
+        end_write(&hops[at].seq);
+        published[at] = 0;
+    }
+    published_net = ctl->net;
+}
+
+
+static void publish_hop(
+    struct net_session *net,
+    int at,
+    int bytes)
+{
+    volatile struct shmstats_hop *hop = &hops[at];
+    ip_t *addrs;
+    int i;
+
+    begin_write(&hop->seq);
+    hop->err = net_err(net, at);
+    hop->xmit = net_xmit(net, at);
+    hop->returned = net_returned(net, at);
+    hop->loss = net_loss(net, at);
+    hop->last = net_last(net, at);
+    hop->best = net_best(net, at);
+    hop->avg = net_avg(net, at);
+    hop->worst = net_worst(net, at);
+    hop->stdev = net_stdev(net, at);
+    hop->p50 = net_p50(net, at);
+    hop->p90 = net_p90(net, at);
+    hop->p99 = net_p99(net, at);
+    hop->p999 = net_p999(net, at);
+    memcpy((void *) hop->addr, net_addr(net, at), bytes);
+    for (i = 0; i < MAXPATH; i++) {
+        addrs = net_addrs(net, at, i);
+        memcpy((void *) hop->addrs[i], addrs, bytes);
+    }
+    end_write(&hop->seq);
+}
+
+
+/*  Publish the hops which have changed since last published  */
+void shmstats_publish(
+    struct mtr_ctl *ctl,
+    int cycles)
+{
+    struct net_session *net = ctl->net;
+    int bytes = ctl->af == AF_INET ? 4 : 16;
+    int at, first, last;
+    int changed = 0;
+
+    if (!header || net != published_net)
+        return;
+
+    first = net_min(ctl);
+    last = net_max(ctl, net);
+    for (at = first; at < last; at++) {
+        if (net_hop_changed(net, at) != published[at]) {
+            published[at] = net_hop_changed(net, at);
+            publish_hop(net, at, bytes);
+            changed = 1;
+        }
+    }
+
+    if (changed || header->last != (uint32_t) last
+        || header->cycles != (uint32_t) cycles) {
+        begin_write(&header->seq);
+        header->last = last;
+        header->cycles = cycles;
+        header->updated = now_usec();
+        end_write(&header->seq);
+    }
+}
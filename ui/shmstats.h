@@ -0,0 +1,99 @@
+/*
+    mtr  --  a network diagnostic tool
+    Copyright (C) 2016  Matt Kimball
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as
+    published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef SHMSTATS_H
+#define SHMSTATS_H
+
+#include <stdint.h>
+
+#include "mtr.h"
+
+/*
+    The statistics published by --shm-stats, in a file mapped into
+    memory, such as one in /dev/shm, for readers on the same host.  The
+    structures below are laid out in the native byte order, with no
+    padding: a header, followed by hop_max hops of hop_size bytes each.
+    A reader should check magic and version, and take the sizes from
+    the header, which may grow at their ends in later versions.
+
+    Each hop has its own sequence number, and the header another, with
+    which a reader takes a consistent copy without locking:
+
+        do {
+            wait until seq is even
+            read barrier
+            copy the fields
+            read barrier
+        } while (seq has changed)
+
+    The writer makes seq odd, writes the fields, then makes it even
+    again, with a write barrier after each change of seq.  Only the
+    hops from first to last, counting from 0, are in use; the rest are
+    zero.  Times are in microseconds, and loss in thousandths of a
+    percent.  Addresses are zero padded, of the family af.
+*/
+#define SHMSTATS_MAGIC "MTRSHM\0\1"
+#define SHMSTATS_VERSION 1
+
+struct shmstats_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t hop_size;
+    uint32_t hop_max;
+    uint32_t seq;
+    uint32_t pid;               /* of the mtr writing the statistics */
+    uint32_t af;                /* AF_INET or AF_INET6 */
+    uint32_t first;             /* the first hop in use */
+    uint32_t last;              /* one past the last hop in use */
+    uint32_t cycles;            /* rounds of probes sent */
+    int64_t started;            /* usec since 1970 */
+    int64_t updated;            /* usec since 1970 */
+    char target[256];           /* the hostname traced, NUL terminated */
+};
+
+struct shmstats_hop {
+    uint32_t seq;
+    uint32_t err;
+    uint32_t xmit;
+    uint32_t returned;
+    uint32_t loss;
+    int32_t last;
+    int32_t best;
+    int32_t avg;
+    int32_t worst;
+    int32_t stdev;
+    int32_t p50;
+    int32_t p90;
+    int32_t p99;
+    int32_t p999;
+    uint8_t addr[16];           /* the address which replied first */
+    uint8_t addrs[MAXPATH][16]; /* the others which have replied */
+};
+
+extern void shmstats_open(
+    const char *filename);
+extern void shmstats_close(
+    void);
+extern void shmstats_session(
+    struct mtr_ctl *ctl);
+extern void shmstats_publish(
+    struct mtr_ctl *ctl,
+    int cycles);
+
+#endif
@@ -35,6 +35,7 @@
 #include "net.h"
 #include "split.h"
 #include "utils.h"
+#include "addrtab.h"
 
 #ifdef HAVE_CURSES
 #if defined(HAVE_NCURSES_H)
@@ -69,7 +70,7 @@ void split_redraw(
 {
     int max;
     int at;
-    ip_t *addr;
+    int addr;
     char newLine[MAX_LINE_SIZE];
     int i;
 
@@ -81,7 +82,7 @@ void split_redraw(
      * If there is less lines than last time, we delete them
      * TEST THIS PLEASE
      */
-    max = net_max(ctl);
+    max = net_max(ctl, ctl->net);
     for (i = LineCount; i > max; i--) {
         printf("-%d\n", i);
         LineCount--;
@@ -91,21 +92,23 @@ void split_redraw(
      * For each line, we compute the new one and we compare it to the old one
      */
     for (at = 0; at < max; at++) {
-        addr = net_addr(at);
-        if (addrcmp((void *) addr, (void *) &ctl->unspec_addr, ctl->af)) {
-            char str[256], *name;
+        addr = net_addr_id(ctl->net, at);
+        if (addr) {
+            char str[256];
+            const char *name;
             if (!(name = dns_lookup(ctl, addr)))
-                name = strlongip(ctl, addr);
+                name = addr_text(addr);
             if (ctl->show_ips) {
-                snprintf(str, sizeof(str), "%s %s", name,
-                         strlongip(ctl, addr));
+                snprintf(str, sizeof(str), "%s %s", name, addr_text(addr));
                 name = str;
             }
             /* May be we should test name's length */
             snprintf(newLine, sizeof(newLine), "%s %d %d %d %d %d %d",
-                     name, net_loss(at), net_returned(at), net_xmit(at),
-                     net_best(at) / 1000, net_avg(at) / 1000,
-                     net_worst(at) / 1000);
+                     name, net_loss(ctl->net, at),
+                     net_returned(ctl->net, at), net_xmit(ctl->net, at),
+                     net_best(ctl->net, at) / 1000,
+                     net_avg(ctl->net, at) / 1000,
+                     net_worst(ctl->net, at) / 1000);
         } else {
             snprintf(newLine, sizeof(newLine), "???");
         }